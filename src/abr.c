@@ -0,0 +1,96 @@
+/*
+ * BlueALSA - abr.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "abr.h"
+
+#include "rt.h"
+
+/**
+ * Get the number of milliseconds elapsed between two time points. */
+static unsigned int abr_elapsed_ms(const struct timespec *ts1, const struct timespec *ts2) {
+	struct timespec ts;
+	if (difftimespec(ts1, ts2, &ts) < 0)
+		return 0;
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize adaptive bit rate controller.
+ *
+ * @param abr Address of the controller structure.
+ * @param config Controller thresholds. This structure has to be valid for
+ *   the whole lifetime of the controller.
+ * @param levels The number of quality levels. The controller starts with
+ *   the highest quality - level 0.
+ * @param now Current time-stamp. */
+void abr_init(struct abr *abr, const struct abr_config *config,
+		unsigned int levels, const struct timespec *now) {
+	abr->config = config;
+	abr->level = 0;
+	abr->levels = levels > 0 ? levels : 1;
+	abr->ts_clear = *now;
+	abr->ts_step = *now;
+}
+
+/**
+ * Set the current quality level of the controller.
+ *
+ * This function can be used to start with the quality level known to be
+ * sustained by the link (e.g. from the previous connection). The level will
+ * be increased only after the link is clear for the upgrade interval.
+ *
+ * @param abr Address of the controller structure.
+ * @param level Quality level - it is clamped to the available levels.
+ * @param now Current time-stamp. */
+void abr_set_level(struct abr *abr, unsigned int level, const struct timespec *now) {
+	abr->level = level < abr->levels ? level : abr->levels - 1;
+	abr->ts_clear = *now;
+	abr->ts_step = *now;
+}
+
+/**
+ * Update adaptive bit rate controller state.
+ *
+ * This function should be called after every BT transfer.
+ *
+ * @param abr Address of the controller structure.
+ * @param queued The number of packets queued in the BT socket.
+ * @param blocked The time (in milliseconds) spent on waiting for the BT
+ *   socket since the last update.
+ * @param now Current time-stamp.
+ * @return This function returns the quality level, which shall be used
+ *   by the encoder. */
+unsigned int abr_update(struct abr *abr, unsigned int queued,
+		unsigned int blocked, const struct timespec *now) {
+
+	const struct abr_config *config = abr->config;
+
+	if (queued >= config->queue_high || blocked >= config->blocked) {
+		/* Link is congested - lower the quality, but give the link some time
+		 * to react on the previous change. */
+		if (abr->level + 1 < abr->levels &&
+				abr_elapsed_ms(&abr->ts_step, now) >= config->holdoff) {
+			abr->level++;
+			abr->ts_step = *now;
+		}
+		abr->ts_clear = *now;
+	}
+	else if (queued > config->queue_low)
+		/* link is not congested, but it is not clear either */
+		abr->ts_clear = *now;
+	else if (abr->level > 0 &&
+			abr_elapsed_ms(&abr->ts_clear, now) >= config->upgrade) {
+		abr->level--;
+		abr->ts_clear = *now;
+		abr->ts_step = *now;
+	}
+
+	return abr->level;
+}
@@ -0,0 +1,67 @@
+/*
+ * BlueALSA - abr.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_ABR_H_
+#define BLUEALSA_ABR_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <time.h>
+
+/**
+ * Adaptive bit rate controller thresholds. */
+struct abr_config {
+	/* if the number of packets queued in the BT socket is equal or less
+	 * than this value, the link is considered as not congested */
+	unsigned int queue_low;
+	/* if the number of packets queued in the BT socket is equal or greater
+	 * than this value, the link is considered as congested */
+	unsigned int queue_high;
+	/* the time (in milliseconds) of the BT socket being blocked during one
+	 * update interval, which is considered as a congestion */
+	unsigned int blocked;
+	/* the time (in milliseconds) without congestion required to increase
+	 * the quality level */
+	unsigned int upgrade;
+	/* minimal time (in milliseconds) between quality level decrements */
+	unsigned int holdoff;
+};
+
+/**
+ * Codec-agnostic adaptive bit rate controller.
+ *
+ * The controller maps the BT link congestion onto the quality level, where
+ * level 0 is the highest quality. It is up to the caller to translate this
+ * level into the codec specific parameter (e.g. SBC bitpool). */
+struct abr {
+
+	const struct abr_config *config;
+
+	/* current quality level */
+	unsigned int level;
+	/* the number of available quality levels */
+	unsigned int levels;
+
+	/* beginning of the period without congestion */
+	struct timespec ts_clear;
+	/* time-stamp of the last level change */
+	struct timespec ts_step;
+
+};
+
+void abr_init(struct abr *abr, const struct abr_config *config,
+		unsigned int levels, const struct timespec *now);
+void abr_set_level(struct abr *abr, unsigned int level, const struct timespec *now);
+unsigned int abr_update(struct abr *abr, unsigned int queued,
+		unsigned int blocked, const struct timespec *now);
+
+#endif
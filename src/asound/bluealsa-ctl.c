@@ -70,6 +70,12 @@ struct bluealsa_ctl {
 	/* list of control element update events */
 	struct ctl_elem_update *updates;
 	size_t updates_count;
+	size_t updates_size;
+
+	/* if true, ALSA library has subscribed for element events */
+	bool subscribed;
+	/* controller events not applied to the element table yet */
+	unsigned int events;
 
 };
 
@@ -217,43 +223,45 @@ static int bluealsa_ctl_elem_update_cmp(const void *p1, const void *p2) {
 	return strcmp(((struct ctl_elem_update *)p1)->name, ((struct ctl_elem_update *)p2)->name);
 }
 
-static void bluealsa_close(snd_ctl_ext_t *ext) {
-	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
-	close(ctl->fd);
-	close(ctl->event_fd);
-	free(ctl->devices);
-	free(ctl->transports);
-	free(ctl->elems);
-	free(ctl->updates);
-	free(ctl);
-}
-
-static int bluealsa_elem_count(snd_ctl_ext_t *ext) {
-	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
+/**
+ * Fetch devices and transports, and construct control elements.
+ *
+ * Upon success, previous lists are replaced, but not released - it is up
+ * to the caller to free them. Upon error, previous lists are retained.
+ *
+ * @param ctl An address to the bluealsa ctl structure.
+ * @return The number of control elements, or -errno upon error. */
+static int bluealsa_elems_build(struct bluealsa_ctl *ctl) {
 
+	struct ba_msg_device *devices;
+	struct ba_msg_transport *transports;
+	struct ctl_elem *elems;
 	size_t count = 0;
 	ssize_t cnt;
 	size_t i;
 
-	if ((cnt = bluealsa_get_devices(ctl->fd, &ctl->devices)) == -1)
+	if ((cnt = bluealsa_get_devices(ctl->fd, &devices)) == -1)
 		return -errno;
-	ctl->devices_count = cnt;
+	const size_t devices_count = cnt;
 
-	if ((cnt = bluealsa_get_transports(ctl->fd, &ctl->transports)) == -1)
-		return -errno;
-	ctl->transports_count = cnt;
+	if ((cnt = bluealsa_get_transports(ctl->fd, &transports)) == -1) {
+		int err = errno;
+		free(devices);
+		return -err;
+	}
+	const size_t transports_count = cnt;
 
-	for (i = 0; i < ctl->devices_count; i++) {
+	for (i = 0; i < devices_count; i++) {
 		/* add additional element for battery level */
-		if (ctl->battery && ctl->devices[i].battery)
+		if (ctl->battery && devices[i].battery)
 			count++;
 	}
 
-	for (i = 0; i < ctl->transports_count; i++) {
+	for (i = 0; i < transports_count; i++) {
 		/* Every stream has two controls associated to itself - volume adjustment
 		 * and mute switch. A2DP transport contains only one stream. However, SCO
 		 * transport represent both streams - playback and capture. */
-		switch (ctl->transports[i].type) {
+		switch (transports[i].type) {
 		case BA_PCM_TYPE_NULL:
 			continue;
 		case BA_PCM_TYPE_A2DP:
@@ -265,7 +273,17 @@ static int bluealsa_elem_count(snd_ctl_ext_t *ext) {
 		}
 	}
 
-	ctl->elems = malloc(sizeof(*ctl->elems) * count);
+	if ((elems = malloc(sizeof(*elems) * count)) == NULL && count > 0) {
+		free(devices);
+		free(transports);
+		return -ENOMEM;
+	}
+
+	ctl->devices = devices;
+	ctl->devices_count = devices_count;
+	ctl->transports = transports;
+	ctl->transports_count = transports_count;
+	ctl->elems = elems;
 	ctl->elems_count = count;
 	count = 0;
 
@@ -361,6 +379,9 @@ static int bluealsa_elem_count(snd_ctl_ext_t *ext) {
 		}
 	}
 
+	/* transports of unknown devices have been skipped */
+	ctl->elems_count = count;
+
 	/* Detect element name duplicates and annotate them with the consecutive
 	 * device ID number - which will make ALSA library happy. */
 	for (i = 0; i < ctl->elems_count; i++) {
@@ -384,10 +405,326 @@ static int bluealsa_elem_count(snd_ctl_ext_t *ext) {
 	return count;
 }
 
+/**
+ * Queue control element update event for the ALSA library.
+ *
+ * @param ctl An address to the bluealsa ctl structure.
+ * @param name The name of the control element.
+ * @param event_mask The SND_CTL_EVENT_MASK_* bit-mask.
+ * @return Zero on success, or -errno upon error. */
+static int bluealsa_elem_update_push(struct bluealsa_ctl *ctl, const char *name,
+		unsigned int event_mask) {
+
+	if (ctl->updates_count == ctl->updates_size) {
+		const size_t size = ctl->updates_size + 16;
+		struct ctl_elem_update *tmp;
+		if ((tmp = realloc(ctl->updates, sizeof(*tmp) * size)) == NULL)
+			return -ENOMEM;
+		ctl->updates = tmp;
+		ctl->updates_size = size;
+	}
+
+	struct ctl_elem_update *update = &ctl->updates[ctl->updates_count++];
+	strcpy(update->name, name);
+	update->event_mask = event_mask;
+	update->_elem = NULL;
+
+	return 0;
+}
+
+/**
+ * Rebuild the whole control element table.
+ *
+ * If events are subscribed, the old table is compared with the new one,
+ * and the ALSA library is notified about added, removed and updated
+ * elements.
+ *
+ * @param ctl An address to the bluealsa ctl structure.
+ * @return Zero on success, or -errno upon error. */
+static int bluealsa_elems_rebuild(struct bluealsa_ctl *ctl) {
+
+	/* Save current control elements for later usage. The call to the
+	 * bluealsa_elems_build() will overwrite these pointers. */
+	struct ba_msg_device *devices = ctl->devices;
+	struct ba_msg_transport *transports = ctl->transports;
+	struct ctl_elem *elems = ctl->elems;
+	size_t count = ctl->elems_count;
+	int ret;
+
+	if ((ret = bluealsa_elems_build(ctl)) < 0)
+		return ret;
+
+	if (!ctl->subscribed) {
+		ret = 0;
+		goto final;
+	}
+
+	/* This part is kinda tricky, however not very complicated. We are going
+	 * to allocate buffer, which will store references to our previous control
+	 * elements and to the new ones. Then, we are going to sort these elements
+	 * alphabetically by name - name acts as a unique identifier. Finally, we
+	 * are going to compare adjacent elements, and if names do match (the same
+	 * element), we will check if such an element should be marked for update.
+	 * Otherwise, element is added or removed. */
+
+	const size_t tmp_count = count + ctl->elems_count;
+	struct ctl_elem_update *tmp;
+	size_t i;
+
+	if ((tmp = malloc(sizeof(*tmp) * tmp_count)) == NULL && tmp_count > 0) {
+		ret = -ENOMEM;
+		goto final;
+	}
+
+	for (i = 0; i < count; i++) {
+		strcpy(tmp[i].name, elems[i].name);
+		tmp[i].event_mask = SND_CTL_EVENT_MASK_REMOVE;
+		tmp[i]._elem = &elems[i];
+	}
+	for (i = 0; i < ctl->elems_count; i++) {
+		strcpy(tmp[count + i].name, ctl->elems[i].name);
+		tmp[count + i].event_mask = SND_CTL_EVENT_MASK_ADD;
+		tmp[count + i]._elem = &ctl->elems[i];
+	}
+
+	qsort(tmp, tmp_count, sizeof(*tmp), bluealsa_ctl_elem_update_cmp);
+
+	for (i = 0; i + 1 < tmp_count; i++)
+		if (strcmp(tmp[i].name, tmp[i + 1].name) == 0) {
+			tmp[i].event_mask = tmp[i + 1].event_mask = 0;
+			if (bluealsa_ctl_elem_cmp(tmp[i]._elem, tmp[i + 1]._elem) != 0)
+				tmp[i].event_mask = SND_CTL_EVENT_MASK_VALUE;
+			i++;
+		}
+
+	for (ret = 0, i = 0; ret == 0 && i < tmp_count; i++)
+		if (tmp[i].event_mask != 0)
+			ret = bluealsa_elem_update_push(ctl, tmp[i].name, tmp[i].event_mask);
+
+	free(tmp);
+
+final:
+	free(devices);
+	free(transports);
+	free(elems);
+	return ret;
+}
+
+/**
+ * Update transport properties within the current element table.
+ *
+ * @param ctl An address to the bluealsa ctl structure.
+ * @return Zero on success, 1 if the set of transports has changed and the
+ *   element table has to be rebuilt, or -errno upon error. */
+static int bluealsa_elems_update_transports(struct bluealsa_ctl *ctl) {
+
+	struct ba_msg_transport *transports;
+	struct ba_msg_transport *match[ctl->transports_count + 1];
+	ssize_t count;
+	size_t i, ii;
+	int ret = 1;
+
+	if ((count = bluealsa_get_transports(ctl->fd, &transports)) == -1)
+		return -errno;
+
+	if ((size_t)count != ctl->transports_count)
+		goto final;
+
+	/* Transport list is not sorted, so we have to find the counterpart of
+	 * every cached transport. The number of channels (and hence the element
+	 * layout) can change with the TRANSPORT_CHANGED event only. */
+	for (i = 0; i < ctl->transports_count; i++) {
+		const struct ba_msg_transport *t = &ctl->transports[i];
+		for (match[i] = NULL, ii = 0; ii < (size_t)count; ii++)
+			if (bacmp(&transports[ii].addr, &t->addr) == 0 &&
+					transports[ii].type == t->type &&
+					transports[ii].stream == t->stream &&
+					transports[ii].channels == t->channels) {
+				match[i] = &transports[ii];
+				break;
+			}
+		if (match[i] == NULL)
+			goto final;
+	}
+
+	for (ret = 0, i = 0; ret == 0 && ctl->subscribed && i < ctl->elems_count; i++) {
+		struct ctl_elem elem = ctl->elems[i];
+		if (elem.transport == NULL)
+			continue;
+		elem.transport = match[elem.transport - ctl->transports];
+		if (bluealsa_ctl_elem_cmp(&ctl->elems[i], &elem) > 0)
+			ret = bluealsa_elem_update_push(ctl, elem.name, SND_CTL_EVENT_MASK_VALUE);
+	}
+
+	for (i = 0; i < ctl->transports_count; i++)
+		ctl->transports[i] = *match[i];
+
+final:
+	free(transports);
+	return ret;
+}
+
+/**
+ * Update device properties within the current element table.
+ *
+ * @param ctl An address to the bluealsa ctl structure.
+ * @return Zero on success, 1 if the set of devices has changed and the
+ *   element table has to be rebuilt, or -errno upon error. */
+static int bluealsa_elems_update_devices(struct bluealsa_ctl *ctl) {
+
+	struct ba_msg_device *devices;
+	struct ba_msg_device *match[ctl->devices_count + 1];
+	ssize_t count;
+	size_t i, ii;
+	int ret = 1;
+
+	if ((count = bluealsa_get_devices(ctl->fd, &devices)) == -1)
+		return -errno;
+
+	if ((size_t)count != ctl->devices_count)
+		goto final;
+
+	/* device name and battery presence are part of the element layout */
+	for (i = 0; i < ctl->devices_count; i++) {
+		const struct ba_msg_device *d = &ctl->devices[i];
+		for (match[i] = NULL, ii = 0; ii < (size_t)count; ii++)
+			if (bacmp(&devices[ii].addr, &d->addr) == 0 &&
+					strncmp(devices[ii].name, d->name, sizeof(d->name)) == 0 &&
+					devices[ii].battery == d->battery) {
+				match[i] = &devices[ii];
+				break;
+			}
+		if (match[i] == NULL)
+			goto final;
+	}
+
+	for (ret = 0, i = 0; ret == 0 && ctl->subscribed && i < ctl->elems_count; i++) {
+		struct ctl_elem elem = ctl->elems[i];
+		if (elem.type != CTL_ELEM_TYPE_BATTERY)
+			continue;
+		elem.device = match[elem.device - ctl->devices];
+		if (bluealsa_ctl_elem_cmp(&ctl->elems[i], &elem) > 0)
+			ret = bluealsa_elem_update_push(ctl, elem.name, SND_CTL_EVENT_MASK_VALUE);
+	}
+
+	for (i = 0; i < ctl->devices_count; i++)
+		ctl->devices[i] = *match[i];
+
+final:
+	free(devices);
+	return ret;
+}
+
+/**
+ * Receive pending controller events without blocking.
+ *
+ * Received events are accumulated in the pending event mask, so a burst of
+ * events is applied to the element table with a single refresh.
+ *
+ * @param ctl An address to the bluealsa ctl structure.
+ * @return Zero on success, -ENODEV if the server has been disconnected, or
+ *   -errno upon other error. */
+static int bluealsa_recv_events(struct bluealsa_ctl *ctl) {
+
+	struct ba_msg_event event;
+	ssize_t ret;
+
+	for (;;) {
+
+		while ((ret = recv(ctl->event_fd, &event, sizeof(event), MSG_DONTWAIT)) == -1 &&
+				errno == EINTR)
+			continue;
+
+		if (ret == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+		if (ret == 0)
+			return -ENODEV;
+
+		/* drop status replies of subscription requests */
+		if (ret == sizeof(event))
+			ctl->events |= event.mask;
+
+	}
+
+}
+
+/**
+ * Apply pending controller events to the element table.
+ *
+ * Events which do not change the element layout (volume and battery level
+ * updates) are applied in place, with a single list request. Otherwise,
+ * the whole element table is rebuilt.
+ *
+ * @param ctl An address to the bluealsa ctl structure.
+ * @return Zero on success, or -errno upon error. */
+static int bluealsa_elems_refresh(struct bluealsa_ctl *ctl) {
+
+	const unsigned int layout = BA_EVENT_TRANSPORT_ADDED |
+		BA_EVENT_TRANSPORT_CHANGED | BA_EVENT_TRANSPORT_REMOVED;
+	int ret;
+
+	if (!(ctl->events & layout) &&
+			ctl->events & BA_EVENT_UPDATE_VOLUME) {
+		if ((ret = bluealsa_elems_update_transports(ctl)) < 0)
+			return ret;
+		if (ret > 0)
+			ctl->events |= BA_EVENT_TRANSPORT_CHANGED;
+		ctl->events &= ~BA_EVENT_UPDATE_VOLUME;
+	}
+
+	if (!(ctl->events & layout) &&
+			ctl->events & BA_EVENT_UPDATE_BATTERY && ctl->battery) {
+		if ((ret = bluealsa_elems_update_devices(ctl)) < 0)
+			return ret;
+		if (ret > 0)
+			ctl->events |= BA_EVENT_TRANSPORT_CHANGED;
+		ctl->events &= ~BA_EVENT_UPDATE_BATTERY;
+	}
+
+	if (ctl->events & layout) {
+		if ((ret = bluealsa_elems_rebuild(ctl)) < 0)
+			return ret;
+	}
+
+	/* all pending events are covered by the current table */
+	ctl->events = 0;
+	return 0;
+}
+
+static void bluealsa_close(snd_ctl_ext_t *ext) {
+	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
+	close(ctl->fd);
+	close(ctl->event_fd);
+	free(ctl->devices);
+	free(ctl->transports);
+	free(ctl->elems);
+	free(ctl->updates);
+	free(ctl);
+}
+
+static int bluealsa_elem_count(snd_ctl_ext_t *ext) {
+	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
+
+	int ret;
+
+	/* With subscribed events, the element table is kept up to date by the
+	 * controller events, so it is rebuilt only when the layout has changed.
+	 * Otherwise, the table can not be trusted and it has to be fetched. */
+	if (!ctl->subscribed)
+		ctl->events |= BA_EVENT_TRANSPORT_CHANGED;
+	else if ((ret = bluealsa_recv_events(ctl)) < 0)
+		return ret;
+
+	if ((ret = bluealsa_elems_refresh(ctl)) < 0)
+		return ret;
+
+	return ctl->elems_count;
+}
+
 static int bluealsa_elem_list(snd_ctl_ext_t *ext, unsigned int offset, snd_ctl_elem_id_t *id) {
 	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
 
-	if (offset > ctl->elems_count)
+	if (offset >= ctl->elems_count)
 		return -EINVAL;
 
 	snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
@@ -418,7 +755,7 @@ static int bluealsa_get_attribute(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key,
 		int *type, unsigned int *acc, unsigned int *count) {
 	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
 
-	if (key > ctl->elems_count)
+	if (key >= ctl->elems_count)
 		return -EINVAL;
 
 	const struct ctl_elem *elem = &ctl->elems[key];
@@ -449,7 +786,7 @@ static int bluealsa_get_integer_info(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key,
 		long *imin, long *imax, long *istep) {
 	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
 
-	if (key > ctl->elems_count)
+	if (key >= ctl->elems_count)
 		return -EINVAL;
 
 	const struct ctl_elem *elem = &ctl->elems[key];
@@ -485,7 +822,7 @@ static int bluealsa_get_integer_info(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key,
 static int bluealsa_read_integer(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, long *value) {
 	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
 
-	if (key > ctl->elems_count)
+	if (key >= ctl->elems_count)
 		return -EINVAL;
 
 	const struct ctl_elem *elem = &ctl->elems[key];
@@ -538,7 +875,7 @@ static int bluealsa_read_integer(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, long
 static int bluealsa_write_integer(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, long *value) {
 	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
 
-	if (key > ctl->elems_count)
+	if (key >= ctl->elems_count)
 		return -EINVAL;
 
 	struct ctl_elem *elem = &ctl->elems[key];
@@ -596,8 +933,34 @@ static int bluealsa_write_integer(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, lon
 
 static void bluealsa_subscribe_events(snd_ctl_ext_t *ext, int subscribe) {
 	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
-	if (bluealsa_subscribe(ctl->event_fd, subscribe ? 0xFFFF : 0) == -1)
-		SNDERR("BlueALSA subscription failed: %s", strerror(errno));
+
+	if (subscribe) {
+		/* status reply must not be mistaken for stale events */
+		bluealsa_recv_events(ctl);
+		if (bluealsa_subscribe(ctl->event_fd, BA_EVENT_TRANSPORT_ADDED |
+					BA_EVENT_TRANSPORT_CHANGED | BA_EVENT_TRANSPORT_REMOVED |
+					BA_EVENT_UPDATE_BATTERY | BA_EVENT_UPDATE_VOLUME) == -1) {
+			SNDERR("BlueALSA subscription failed: %s", strerror(errno));
+			return;
+		}
+	}
+	else {
+		/* The server sends events in the blocking mode, so we must not stay
+		 * subscribed if no one is going to read them. The status reply will
+		 * be dropped by the event receiver. */
+		const struct ba_request req = {
+			.command = BA_COMMAND_SUBSCRIBE,
+			.events = 0,
+		};
+		if (send(ctl->event_fd, &req, sizeof(req), MSG_NOSIGNAL) == -1)
+			SNDERR("BlueALSA subscription failed: %s", strerror(errno));
+		ctl->updates_count = 0;
+	}
+
+	ctl->subscribed = subscribe;
+	/* events might have been missed while not being subscribed */
+	ctl->events |= BA_EVENT_TRANSPORT_CHANGED;
+
 }
 
 static int bluealsa_read_event(snd_ctl_ext_t *ext, snd_ctl_elem_id_t *id, unsigned int *event_mask) {
@@ -610,85 +973,37 @@ static int bluealsa_read_event(snd_ctl_ext_t *ext, snd_ctl_elem_id_t *id, unsign
 		snd_ctl_elem_id_set_name(id, ctl->updates[ctl->updates_count].name);
 		*event_mask = ctl->updates[ctl->updates_count].event_mask;
 
-		if (ctl->updates_count == 0) {
-			free(ctl->updates);
-			ctl->updates = NULL;
-		}
-
 		return 1;
 	}
 
-	struct ba_msg_event event;
-	ssize_t ret;
-
-	/* This code reads events from the socket until the EAGAIN is returned.
-	 * Since EAGAIN is returned when operation would block (there is no more
-	 * data to read), we are compliant with the ALSA specification. */
-	while ((ret = recv(ctl->event_fd, &event, sizeof(event), MSG_DONTWAIT)) == -1 && errno == EINTR)
-		continue;
-	if (ret == -1)
-		return -errno;
+	int ret;
 
-	/* Upon server disconnection, our socket file descriptor is in the ready for
-	 * reading state. However, there is no data to be read. In such a case, we
-	 * have to indicate, that the controller has been unplugged. Since, it is not
-	 * possible to manipulate revents - snd_mixer_poll_descriptors_revents() does
-	 * not call poll_revents() callback - we are going to close our socket, which
-	 * (at least for alsamixer) seems to do the trick. Anyhow, there is a caveat.
-	 * If some other thread opens new file descriptor... we are doomed. */
-	if (ret == 0) {
+	/* This code reads all pending events from the socket. When there is no
+	 * element update to report, the EAGAIN is returned - it is compliant with
+	 * the ALSA specification. */
+	if ((ret = bluealsa_recv_events(ctl)) == -ENODEV) {
+		/* Upon server disconnection, our socket file descriptor is in the ready
+		 * for reading state. However, there is no data to be read. In such a
+		 * case, we have to indicate, that the controller has been unplugged.
+		 * Since, it is not possible to manipulate revents - the function
+		 * snd_mixer_poll_descriptors_revents() does not call poll_revents()
+		 * callback - we are going to close our socket, which (at least for
+		 * alsamixer) seems to do the trick. Anyhow, there is a caveat. If some
+		 * other thread opens new file descriptor... we are doomed. */
 		close(ext->poll_fd);
 		return -ENODEV;
 	}
-
-	/* Save current control elements for later usage. The call to the
-	 * bluealsa_elem_count() will overwrite these pointers. */
-	struct ba_msg_device *devices = ctl->devices;
-	struct ba_msg_transport *transports = ctl->transports;
-	struct ctl_elem *elems = ctl->elems;
-	size_t count = ctl->elems_count;
-
-	if ((ret = bluealsa_elem_count(ext)) < 0)
+	if (ret < 0)
 		return ret;
 
-	/* This part is kinda tricky, however not very complicated. We are going
-	 * to allocate buffer, which will store references to our previous control
-	 * elements and to the new ones. Then, we are going to sort these elements
-	 * alphabetically by name - name acts as a unique identifier. Finally, we
-	 * are going to compare adjacent elements, and if names do match (the same
-	 * element), we will check if such an element should be marked for update.
-	 * Otherwise, element is added or removed. */
-
-	ctl->updates_count = count + ctl->elems_count;
-	ctl->updates = malloc(sizeof(*ctl->updates) * ctl->updates_count);
-
-	struct ctl_elem_update *_tmp = ctl->updates;
-	size_t i;
-
-	for (i = 0; i < count; i++, _tmp++) {
-		strcpy(_tmp->name, elems[i].name);
-		_tmp->event_mask = SND_CTL_EVENT_MASK_REMOVE;
-		_tmp->_elem = &elems[i];
-	}
-	for (i = 0; i < ctl->elems_count; i++, _tmp++) {
-		strcpy(_tmp->name, ctl->elems[i].name);
-		_tmp->event_mask = SND_CTL_EVENT_MASK_ADD;
-		_tmp->_elem = &ctl->elems[i];
-	}
-
-	qsort(ctl->updates, ctl->updates_count, sizeof(*ctl->updates), bluealsa_ctl_elem_update_cmp);
+	if (ctl->events == 0)
+		return -EAGAIN;
 
-	for (i = 0; i + 1 < ctl->updates_count; i++)
-		if (strcmp(ctl->updates[i].name, ctl->updates[i + 1].name) == 0) {
-			ctl->updates[i].event_mask = ctl->updates[i + 1].event_mask = 0;
-			if (bluealsa_ctl_elem_cmp(ctl->updates[i]._elem, ctl->updates[i + 1]._elem) != 0)
-				ctl->updates[i].event_mask = SND_CTL_EVENT_MASK_VALUE;
-			i++;
-		}
+	if ((ret = bluealsa_elems_refresh(ctl)) < 0)
+		return ret;
 
-	free(devices);
-	free(transports);
-	free(elems);
+	if (ctl->updates_count == 0)
+		return -EAGAIN;
 
 	return bluealsa_read_event(ext, id, event_mask);
 }
@@ -765,6 +1080,9 @@ SND_CTL_PLUGIN_DEFINE_FUNC(bluealsa) {
 	strncpy(ctl->ext.mixername, "BlueALSA Plugin", sizeof(ctl->ext.mixername) - 1);
 	ctl->battery = strcmp(battery, "yes") == 0;
 
+	/* element table has to be built upon the first enumeration */
+	ctl->events = BA_EVENT_TRANSPORT_ADDED;
+
 	ctl->ext.callback = &bluealsa_snd_ctl_ext_callback;
 	ctl->ext.private_data = ctl;
 	ctl->ext.poll_fd = ctl->event_fd;
@@ -25,6 +25,7 @@
 
 #include "ctl-client.h"
 #include "ctl-proto.h"
+#include "defs.h"
 #include "log.h"
 #include "rt.h"
 
@@ -34,6 +35,7 @@
 #define INTERFACE_STR_MAXLEN	256
 #define BDADDR_STR_LEN			18
 #define PROFILE_STR_MAXLEN		16
+#define ID_STR_MAXLEN			64
 
 struct bluealsa_pcm {
 	snd_pcm_ioplug_t io;
@@ -53,6 +55,7 @@ struct bluealsa_pcm {
 	/* virtual hardware - ring buffer */
 	snd_pcm_uframes_t io_ptr;
 	pthread_t io_thread;
+	bool io_thread_running;
 	bool io_started;
 
 	/* communication and encoding/decoding delay */
@@ -79,14 +82,26 @@ struct bluealsa_pcm {
 	enum ba_pcm_type type;
 	enum ba_pcm_stream stream;
 
+	/* The transport might be switched by the client while the IO thread is
+	 * running. The IO lock protects the PCM FIFO, and it is held by the IO
+	 * thread during a single period transfer. The control lock protects the
+	 * BlueALSA socket and the transport used by the ALSA callbacks. */
+	pthread_mutex_t io_mutex;
+	pthread_mutex_t ctl_mutex;
+
+	/* identifier used by the client for selecting PCM instance */
+	char id[ID_STR_MAXLEN];
+	struct bluealsa_pcm *next;
+
 };
 
 typedef struct bluealsa_pcm bluealsa_pcm_t;
 
-static bluealsa_pcm_t * the_pcm = NULL;
+/* list of opened PCMs - the most recently opened first */
+static pthread_mutex_t pcms_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bluealsa_pcm_t *pcms = NULL;
 
-static int close_bluez_connection();
-static int open_bluez_connection();
+static void reconnect_bluez(struct bluealsa_pcm *pcm);
 
 
 /**
@@ -96,18 +111,71 @@ static int close_transport(struct bluealsa_pcm *pcm) {
 	debug("%s ...\n", __func__);
 	if (pcm == NULL)
 		return 0;
-	if (pcm->pcm_fd == -1)
-		return 0;
 
-	int rv = bluealsa_close_transport(pcm->fd, &pcm->transport);
+	/* This function is called by the IO thread as well, which might be
+	 * cancelled by the stop callback. Both locks are held across calls
+	 * which are cancellation points, so the cancellation is deferred until
+	 * the transport is closed and the locks are released. */
+	int cancelstate;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+
+	pthread_mutex_lock(&pcm->ctl_mutex);
+	pthread_mutex_lock(&pcm->io_mutex);
+
+	int rv = 0;
 	int err = errno;
 
-	close(pcm->pcm_fd);
-	pcm->pcm_fd = -1;
+	if (pcm->pcm_fd != -1) {
+		rv = bluealsa_close_transport(pcm->fd, &pcm->transport);
+		err = errno;
+		close(pcm->pcm_fd);
+		pcm->pcm_fd = -1;
+	}
+
+	pthread_mutex_unlock(&pcm->io_mutex);
+	pthread_mutex_unlock(&pcm->ctl_mutex);
+
+	pthread_setcancelstate(cancelstate, NULL);
+
 	errno = err;
 	return rv;
 }
 
+/**
+ * Transfer data between our buffer and the PCM FIFO of the current
+ * transport. This function has to be called with the IO lock held.
+ *
+ * @return On success this function returns 0. If the remote side has been
+ *   closed, 1 is returned. On error, -1 is returned. */
+static int io_transfer(struct bluealsa_pcm *pcm, char *head, size_t len) {
+
+	const bool capture = pcm->io.stream == SND_PCM_STREAM_CAPTURE;
+	ssize_t ret;
+
+	/* If there is no transport (e.g. the device has not been selected yet),
+	 * playback data is discarded, so the timing is kept for the client. */
+	if (pcm->pcm_fd == -1)
+		return capture ? 1 : 0;
+
+	while (len != 0) {
+		if (capture)
+			ret = read(pcm->pcm_fd, head, len);
+		else
+			ret = write(pcm->pcm_fd, head, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EPIPE ? 1 : -1;
+		}
+		if (ret == 0)
+			return 1;
+		head += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
 /**
  * IO thread, which facilitates ring buffer. */
 static void *io_thread(void *arg) {
@@ -152,27 +220,29 @@ wait_pcm_fd:
 				{ pcm->pcm_fd, POLLIN, 0 },
 				{ pcm->fd, 	POLLIN|POLLPRI, 0 }};
 
-		int ret = poll(pfds, 2, -1);
+		/* Do not wait forever, because the transport might be switched by
+		 * the client in the meantime. */
+		int ret = poll(pfds, 2, 100);
 		if (ret == -1) {
 			SNDERR("PCM FIFO poll error: %s", strerror(errno));
 			goto final;
 		}
+		if (ret == 0)
+			goto wait_pcm_fd;
 
 		short int evt0 = pfds[0].revents;
 		short int evt1 = pfds[1].revents;
 
 		if (evt1 & POLLHUP) {
 			debug("Server closed the connection\n");
-			close_bluez_connection();
-			open_bluez_connection();
+			reconnect_bluez(pcm);
 			usleep(100*1000); /* avoid spinning too fast /*/
 			goto wait_pcm_fd;
 		}
 
 		if (evt0 & POLLHUP) {
 			debug("Remote device disconnected\n");
-			close_bluez_connection();
-			open_bluez_connection();
+			reconnect_bluez(pcm);
 			usleep(100*1000);
 			goto wait_pcm_fd;
 		}
@@ -180,7 +250,7 @@ wait_pcm_fd:
 
 	const snd_pcm_channel_area_t *areas = snd_pcm_ioplug_mmap_areas(io);
 
-	struct asrsync asrs;
+	struct asrsync asrs = { .frames = 0 };
 	asrsync_init(&asrs, io->rate);
 
 	for (;;) {
@@ -205,7 +275,7 @@ wait_pcm_fd:
 		snd_pcm_uframes_t frames = io->period_size;
 		char *buffer = areas->addr + (areas->first + areas->step * io_ptr) / 8;
 		char *head = buffer;
-		ssize_t ret = 0;
+		int ret;
 		size_t len;
 
 		/* If the leftover in the buffer is less than a whole period sizes,
@@ -228,25 +298,29 @@ wait_pcm_fd:
 
 		if (io->stream == SND_PCM_STREAM_CAPTURE) {
 
+			/* Wait for data without holding the IO lock, so the transport can
+			 * be switched even if the current device does not send anything. */
+			struct pollfd pfd = { pcm->pcm_fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 100) <= 0 || pfd.fd != pcm->pcm_fd)
+				continue;
+
 			/* Read the whole period "atomically". This will assure, that frames
 			 * are not fragmented, so the pointer can be correctly updated. */
-			while (len != 0 && (ret = read(pcm->pcm_fd, head, len)) != 0) {
-				if (ret == -1) {
-					if (errno == EINTR)
-						continue;
-
-					SNDERR("PCM FIFO read error: %s", strerror(errno));
-					goto final;
-				}
-				head += ret;
-				len -= ret;
+			pthread_mutex_lock(&pcm->io_mutex);
+			pthread_cleanup_push(PTHREAD_CLEANUP(pthread_mutex_unlock), &pcm->io_mutex);
+			ret = io_transfer(pcm, head, len);
+			pthread_cleanup_pop(1);
+
+			if (ret == -1) {
+				SNDERR("PCM FIFO read error: %s", strerror(errno));
+				goto final;
 			}
 
 			/* something went wrong. this can be a server,
 			 * or device disconnection, or a device change request
 			 * from the client application */
 
-			if (ret == 0)
+			if (ret == 1)
 				goto wait_pcm_fd;
 
 		}
@@ -259,18 +333,19 @@ wait_pcm_fd:
 				goto sync;
 			}
 
-			/* Perform atomic write - see the explanation above. */
-			do {
-				if ((ret = write(pcm->pcm_fd, head, len)) == -1) {
-					if (errno == EINTR)
-						continue;
+			/* Perform atomic write - see the explanation above. The transport
+			 * switch will take place between periods, so there will be no gap
+			 * in the audio stream. */
+			pthread_mutex_lock(&pcm->io_mutex);
+			pthread_cleanup_push(PTHREAD_CLEANUP(pthread_mutex_unlock), &pcm->io_mutex);
+			ret = io_transfer(pcm, head, len);
+			pthread_cleanup_pop(1);
+
+			if (ret != 0) {
+				if (ret == -1)
 					SNDERR("PCM FIFO write error: %s", strerror(errno));
-					goto final;
-				}
-				head += ret;
-				len -= ret;
+				goto final;
 			}
-			while (len != 0);
 
 			/* synchronize playback time */
 			asrsync_sync(&asrs, frames);
@@ -310,9 +385,14 @@ static int bluealsa_proxy_start(snd_pcm_ioplug_t *io) {
 	/* initialize delay calculation */
 	pcm->delay = 0;
 
-	if (bluealsa_pause_transport(pcm->fd, &pcm->transport, false) == -1) {
-		debug("Couldn't start PCM: %s\n", strerror(errno));
-		return -errno;
+	pthread_mutex_lock(&pcm->ctl_mutex);
+	int rv = bluealsa_pause_transport(pcm->fd, &pcm->transport, false);
+	int err = errno;
+	pthread_mutex_unlock(&pcm->ctl_mutex);
+
+	if (rv == -1) {
+		debug("Couldn't start PCM: %s\n", strerror(err));
+		return -err;
 	}
 
 	/* State has to be updated before the IO thread is created - if the state
@@ -333,6 +413,7 @@ static int bluealsa_proxy_stop(snd_pcm_ioplug_t *io) {
 	debug("Stopping");
 	if (pcm->io_started) {
 		pcm->io_started = false;
+		pcm->io_thread_running = false;
 		pthread_cancel(pcm->io_thread);
 		pthread_join(pcm->io_thread, NULL);
 	}
@@ -341,9 +422,8 @@ static int bluealsa_proxy_stop(snd_pcm_ioplug_t *io) {
 
 static snd_pcm_sframes_t bluealsa_proxy_pointer(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
-	if (pcm->pcm_fd == -1)
-		return -ENODEV;
-
+	/* When there is no transport attached, the IO thread keeps running in
+	 * the discard mode, so the pointer is valid regardless of the pcm_fd. */
 	return pcm->io_ptr;
 }
 
@@ -351,12 +431,34 @@ static int bluealsa_proxy_close(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
 
 	debug("Closing plugin\n");
+
+	pthread_mutex_lock(&pcms_mutex);
+	bluealsa_pcm_t **p;
+	for (p = &pcms; *p != NULL; p = &(*p)->next)
+		if (*p == pcm) {
+			*p = pcm->next;
+			break;
+		}
+	pthread_mutex_unlock(&pcms_mutex);
+
+	/* The IO thread is created upon open, so it might be still running if
+	 * the PCM has not been stopped. It uses the transport, the event FD and
+	 * both mutexes, hence it has to be joined before the teardown. */
+	if (pcm->io_thread_running) {
+		pcm->io_thread_running = false;
+		pthread_cancel(pcm->io_thread);
+		pthread_join(pcm->io_thread, NULL);
+	}
+
+	/* a cancelled IO thread leaves the transport opened */
+	close_transport(pcm);
+
 	close(pcm->fd);
 	close(pcm->event_fd);
+	pthread_mutex_destroy(&pcm->io_mutex);
+	pthread_mutex_destroy(&pcm->ctl_mutex);
 	free(pcm);
 
-	the_pcm = NULL;
-
 	return 0;
 }
 
@@ -372,17 +474,6 @@ static int bluealsa_proxy_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *p
 	if (io->stream == SND_PCM_STREAM_PLAYBACK)
 		eventfd_write(pcm->event_fd, 1);
 
-	if (pcm->io.stream == SND_PCM_STREAM_PLAYBACK) {
-		/* By default, the size of the pipe buffer is set to a too large value for
-		 * our purpose. On modern Linux system it is 65536 bytes. Large buffer in
-		 * the playback mode might contribute to an unnecessary audio delay. Since
-		 * it is possible to modify the size of this buffer we will set is to some
-		 * low value, but big enough to prevent audio tearing. Note, that the size
-		 * will be rounded up to the page size (typically 4096 bytes). */
-		pcm->pcm_buffer_size = fcntl(pcm->pcm_fd, F_SETPIPE_SZ, 2048);
-		debug("FIFO buffer size: %zd", pcm->pcm_buffer_size);
-	}
-
 	debug("Selected HW buffer: %zd periods x %zd bytes %c= %zd bytes\n",
 			io->buffer_size / io->period_size, pcm->frame_size * io->period_size,
 			io->period_size * (io->buffer_size / io->period_size) == io->buffer_size ? '=' : '<',
@@ -419,16 +510,26 @@ static int bluealsa_proxy_prepare(snd_pcm_ioplug_t *io) {
 static int bluealsa_proxy_drain(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
 
-	if (bluealsa_drain_transport(pcm->fd, &pcm->transport) == -1)
-		return -errno;
+	pthread_mutex_lock(&pcm->ctl_mutex);
+	int rv = bluealsa_drain_transport(pcm->fd, &pcm->transport);
+	int err = errno;
+	pthread_mutex_unlock(&pcm->ctl_mutex);
+
+	if (rv == -1)
+		return -err;
 	return 0;
 }
 
 static int bluealsa_proxy_pause(snd_pcm_ioplug_t *io, int enable) {
 	struct bluealsa_pcm *pcm = io->private_data;
 
-	if (bluealsa_pause_transport(pcm->fd, &pcm->transport, enable) == -1)
-		return -errno;
+	pthread_mutex_lock(&pcm->ctl_mutex);
+	int rv = bluealsa_pause_transport(pcm->fd, &pcm->transport, enable);
+	int err = errno;
+	pthread_mutex_unlock(&pcm->ctl_mutex);
+
+	if (rv == -1)
+		return -err;
 
 	if (enable == 0) {
 		io->state = SND_PCM_STATE_RUNNING;
@@ -486,10 +587,12 @@ static int bluealsa_proxy_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp)
 				(pcm->delay == 0 || ++counter % (io->rate / 10) == 0)) {
 
 			unsigned int tmp;
+			pthread_mutex_lock(&pcm->ctl_mutex);
 			if (bluealsa_get_transport_delay(pcm->fd, &pcm->transport, &tmp) != -1) {
 				pcm->delay = (io->rate / 100) * tmp / 100;
 				debug("BlueALSA delay: %.1f ms (%ld frames)", (float)tmp / 10, pcm->delay);
 			}
+			pthread_mutex_unlock(&pcm->ctl_mutex);
 
 		}
 
@@ -650,10 +753,36 @@ static int bluealsa_proxy_set_hw_constraint(struct bluealsa_pcm *pcm) {
 SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa_proxy) {
 	(void)root;
 
+	snd_config_iterator_t i, next;
+	const char *id = "default";
 	struct bluealsa_pcm *pcm;
 	long delay = 0;
 	int ret;
 
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+
+		const char *key;
+		if (snd_config_get_id(n, &key) < 0)
+			continue;
+
+		if (strcmp(key, "comment") == 0 ||
+				strcmp(key, "type") == 0 ||
+				strcmp(key, "hint") == 0)
+			continue;
+
+		if (strcmp(key, "id") == 0) {
+			if (snd_config_get_string(n, &id) < 0) {
+				SNDERR("Invalid type for %s", key);
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		SNDERR("Unknown field %s", key);
+		return -EINVAL;
+	}
+
 	if ((pcm = calloc(1, sizeof(*pcm))) == NULL)
 		return -ENOMEM;
 
@@ -661,6 +790,9 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa_proxy) {
 	pcm->event_fd = -1;
 	pcm->pcm_fd = -1;
 	pcm->delay_ex = delay;
+	strncpy(pcm->id, id, sizeof(pcm->id) - 1);
+	pthread_mutex_init(&pcm->io_mutex, NULL);
+	pthread_mutex_init(&pcm->ctl_mutex, NULL);
 
 	if ((pcm->event_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
 		ret = -errno;
@@ -677,25 +809,29 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa_proxy) {
 	enum ba_pcm_stream _stream = stream == SND_PCM_STREAM_PLAYBACK ?
 			BA_PCM_STREAM_PLAYBACK : BA_PCM_STREAM_CAPTURE;
 
-	pcm->stream = stream;
+	pcm->stream = _stream;
 
 	if ((ret = snd_pcm_ioplug_create(&pcm->io, name, stream, mode)) < 0)
 		goto fail;
 
-	*pcmp = pcm->io.pcm;
-
-	// Remember PCM
-	the_pcm = pcm;
-
 	if ((errno = pthread_create(&pcm->io_thread, NULL, io_thread, &pcm->io)) != 0) {
 		debug("Couldn't create IO thread: %s", strerror(errno));
 		pcm->io_started = false;
-
 		ret = -errno;
+		snd_pcm_ioplug_delete(&pcm->io);
 		goto fail;
 	}
 
+	pcm->io_thread_running = true;
 	pthread_setname_np(pcm->io_thread, "pcm-io");
+
+	/* remember PCM, so the client will be able to select the device */
+	pthread_mutex_lock(&pcms_mutex);
+	pcm->next = pcms;
+	pcms = pcm;
+	pthread_mutex_unlock(&pcms_mutex);
+
+	*pcmp = pcm->io.pcm;
 	return 0;
 
 fail:
@@ -703,90 +839,205 @@ fail:
 		close(pcm->fd);
 	if (pcm->event_fd != -1)
 		close(pcm->event_fd);
+	pthread_mutex_destroy(&pcm->io_mutex);
+	pthread_mutex_destroy(&pcm->ctl_mutex);
 	free(pcm);
 	return ret;
 }
 
 SND_PCM_PLUGIN_SYMBOL(bluealsa_proxy);
 
-static int open_bluez_connection() {
-	int ret = 0;
-	bluealsa_pcm_t * pcm = the_pcm;
+/**
+ * Switch PCM to the new transport.
+ *
+ * The BlueALSA socket is reused if the HCI interface has not changed. The new
+ * transport is opened and started before the old one is closed, and it is
+ * swapped between period transfers, so the ALSA client will not notice any
+ * gap in the audio stream.
+ *
+ * @return On success this function returns 0. Otherwise, negative error
+ *   code is returned. */
+static int switch_transport(struct bluealsa_pcm *pcm, const char *interface,
+		const bdaddr_t *addr, enum ba_pcm_type type) {
 
-	char addr[256];
-	ba2str(&pcm->addr, addr);
+	const bool configured = pcm->frame_size != 0;
+	struct ba_msg_transport transport;
+	int fd = pcm->fd;
+	int pcm_fd = -1;
+	int err;
 
-	debug("%s interface %s addr %s type %d\n", __func__, pcm->interface, addr, pcm->type);
+	char addr_[18];
+	ba2str(addr, addr_);
+	debug("%s interface %s addr %s type %d\n", __func__, interface, addr_, type);
 
-	if ((pcm->fd = bluealsa_open(pcm->interface)) == -1) {
-		SNDERR("BlueALSA connection failed: %s", strerror(errno));
-		ret = -errno;
-		goto fail;
-	}
+	if (fd == -1 || strcmp(interface, pcm->interface) != 0)
+		if ((fd = bluealsa_open(interface)) == -1) {
+			SNDERR("BlueALSA connection failed: %s", strerror(errno));
+			return -errno;
+		}
 
-	if ((bluealsa_get_transport(pcm->fd, pcm->addr, pcm->type, pcm->stream, &pcm->transport )) == -1) {
+	if (bluealsa_get_transport(fd, *addr, type, pcm->stream, &transport) == -1) {
 		SNDERR("Couldn't get BlueALSA transport: %s", strerror(errno));
-		ret = -errno;
 		goto fail;
 	}
 
-	if ((ret = bluealsa_proxy_set_hw_constraint(pcm)) < 0) {
-		snd_pcm_ioplug_delete(&pcm->io);
-		goto fail;
+	transport.stream = pcm->stream;
+
+	/* When the HW parameters are already set, the new transport has to be
+	 * compatible with them. For A2DP the server is able to convert the
+	 * sampling rate, though. */
+	if (configured) {
+		if (transport.channels != pcm->io.channels ||
+				(transport.sampling != pcm->io.rate && type != BA_PCM_TYPE_A2DP)) {
+			SNDERR("Incompatible BlueALSA transport: %u channels, %u Hz",
+					transport.channels, transport.sampling);
+			errno = EINVAL;
+			goto fail;
+		}
+		transport.sampling = pcm->io.rate;
 	}
 
-	pcm->transport.stream = pcm->stream;
+	if ((pcm_fd = bluealsa_open_transport(fd, &transport)) == -1) {
+		debug("Couldn't open PCM FIFO: %s\n", strerror(errno));
+		goto fail;
+	}
 
-	if ((pcm->pcm_fd = bluealsa_open_transport(pcm->fd, &pcm->transport)) == -1) {
-		debug("Couldn't open PCM FIFO: %s", strerror(errno));
-		return -errno;
+	if (pcm->stream == BA_PCM_STREAM_PLAYBACK) {
+		/* By default, the size of the pipe buffer is set to a too large value for
+		 * our purpose. On modern Linux system it is 65536 bytes. Large buffer in
+		 * the playback mode might contribute to an unnecessary audio delay. Since
+		 * it is possible to modify the size of this buffer we will set is to some
+		 * low value, but big enough to prevent audio tearing. Note, that the size
+		 * will be rounded up to the page size (typically 4096 bytes). */
+		pcm->pcm_buffer_size = fcntl(pcm_fd, F_SETPIPE_SZ, 2048);
+		debug("FIFO buffer size: %zd\n", pcm->pcm_buffer_size);
 	}
 
 	debug("PLUGIN: starting transport\n");
 
-	if (bluealsa_pause_transport(pcm->fd, &pcm->transport, false) == -1) {
-		debug("Couldn't start PCM: %s", strerror(errno));
-		return -errno;
+	if (bluealsa_pause_transport(fd, &transport, false) == -1) {
+		debug("Couldn't start PCM: %s\n", strerror(errno));
+		goto fail;
 	}
 
-	debug("PLUGIN: connection ready !\n");
+	pthread_mutex_lock(&pcm->ctl_mutex);
+	pthread_mutex_lock(&pcm->io_mutex);
+
+	const struct ba_msg_transport old_transport = pcm->transport;
+	const int old_pcm_fd = pcm->pcm_fd;
+	const int old_fd = pcm->fd;
+
+	pcm->fd = fd;
+	pcm->pcm_fd = pcm_fd;
+	pcm->transport = transport;
+	pcm->delay = 0;
+	bacpy(&pcm->addr, addr);
+	pcm->type = type;
+	if (interface != pcm->interface)
+		strncpy(pcm->interface, interface, INTERFACE_STR_MAXLEN - 1);
+
+	pthread_mutex_unlock(&pcm->io_mutex);
+	pthread_mutex_unlock(&pcm->ctl_mutex);
+
+	/* The HW constraints are derived from the transport, however they can be
+	 * set only before the HW parameters are selected by the client. */
+	if (!configured && (err = bluealsa_proxy_set_hw_constraint(pcm)) < 0)
+		debug("Couldn't set HW constraints: %s\n", strerror(-err));
+
+	/* release the old transport and connection (if not reused) */
+	if (old_pcm_fd != -1) {
+		bluealsa_close_transport(old_fd, &old_transport);
+		close(old_pcm_fd);
+	}
+	if (old_fd != -1 && old_fd != fd)
+		close(old_fd);
 
+	debug("PLUGIN: connection ready !\n");
 	return 0;
 
 fail:
-	return ret;
+	err = errno;
+	if (pcm_fd != -1) {
+		bluealsa_close_transport(fd, &transport);
+		close(pcm_fd);
+	}
+	if (fd != pcm->fd)
+		close(fd);
+	return -err;
 }
 
-static int close_bluez_connection() {
-	int ret = 0;
-	bluealsa_pcm_t * pcm = the_pcm;
+static int open_bluez_connection(struct bluealsa_pcm *pcm) {
+	bdaddr_t addr;
+	bacpy(&addr, &pcm->addr);
+	return switch_transport(pcm, pcm->interface, &addr, pcm->type);
+}
+
+static int close_bluez_connection(struct bluealsa_pcm *pcm) {
 	close_transport(pcm);
-	close(pcm->fd);
-	return ret;
+	/* do not leave the control lock held upon cancellation in close() */
+	int cancelstate;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+	pthread_mutex_lock(&pcm->ctl_mutex);
+	if (pcm->fd != -1)
+		close(pcm->fd);
+	pcm->fd = -1;
+	pthread_mutex_unlock(&pcm->ctl_mutex);
+	pthread_setcancelstate(cancelstate, NULL);
+	return 0;
 }
 
-/* This is an exported function, to be loaded by clients via dlsym */
+/**
+ * Reconnect with the server, e.g. after the device disconnection. The list
+ * lock serializes this call with the device switch requested by the client. */
+static void reconnect_bluez(struct bluealsa_pcm *pcm) {
+	pthread_mutex_lock(&pcms_mutex);
+	pthread_cleanup_push(PTHREAD_CLEANUP(pthread_mutex_unlock), &pcms_mutex);
+	close_bluez_connection(pcm);
+	open_bluez_connection(pcm);
+	pthread_cleanup_pop(1);
+}
 
-int bluealsa_proxy_set_remote_device(const char * interface, const char * device, const char * profile) {
+/**
+ * Get opened PCM by its identifier.
+ *
+ * @param id PCM identifier. If NULL, the most recently opened PCM is
+ *   returned. */
+static bluealsa_pcm_t *bluealsa_proxy_lookup(const char *id) {
+	bluealsa_pcm_t *pcm;
+	for (pcm = pcms; pcm != NULL; pcm = pcm->next)
+		if (id == NULL || strcmp(pcm->id, id) == 0)
+			break;
+	return pcm;
+}
+
+/* These are exported functions, to be loaded by clients via dlsym */
+
+int bluealsa_proxy_set_remote_device_id(const char * id, const char * interface,
+		const char * device, const char * profile) {
 	int ret  = -1;
 
-	debug("PLUGIN: %s: interface %s device %s profile %s\n", __func__, interface, device, profile);
+	debug("PLUGIN: %s: id %s interface %s device %s profile %s\n", __func__,
+			id, interface, device, profile);
+
+	pthread_mutex_lock(&pcms_mutex);
 
-	if (the_pcm == NULL) {
+	bluealsa_pcm_t *pcm;
+	if ((pcm = bluealsa_proxy_lookup(id)) == NULL) {
 		SNDERR("No current opened connection to bluezalsa server\n");
 		goto failed;
 	}
 
 	enum ba_pcm_type type;
+	bdaddr_t addr;
 
 	/* When the hardware address is NULL, just close the connection */
 	if (device == NULL ) {
-		close_bluez_connection();
+		close_bluez_connection(pcm);
 		ret = 0;
 		goto failed;
 	}
 
-	if ( str2ba(device, &the_pcm->addr) != 0) {
+	if ( str2ba(device, &addr) != 0) {
 		SNDERR("Invalid BT device address: %s", device);
 		ret = -EINVAL;
 		goto failed;
@@ -798,16 +1049,19 @@ int bluealsa_proxy_set_remote_device(const char * interface, const char * device
 		goto failed;
 	}
 
-	strncpy(the_pcm->profile, profile, PROFILE_STR_MAXLEN);
-	strncpy(the_pcm->interface, interface, INTERFACE_STR_MAXLEN);
-
-	the_pcm->type = type;
-
-	close_bluez_connection();
-	ret = open_bluez_connection();
+	/* Open the new transport before closing the old one, so the playback
+	 * will continue without interruption. */
+	if ((ret = switch_transport(pcm, interface, &addr, type)) == 0)
+		strncpy(pcm->profile, profile, PROFILE_STR_MAXLEN - 1);
 
 failed:
+	pthread_mutex_unlock(&pcms_mutex);
 	return ret;
 }
 
+int bluealsa_proxy_set_remote_device(const char * interface, const char * device, const char * profile) {
+	return bluealsa_proxy_set_remote_device_id(NULL, interface, device, profile);
+}
+
+SND_DLSYM_BUILD_VERSION(bluealsa_proxy_set_remote_device_id, SND_PCM_DLSYM_VERSION);
 SND_DLSYM_BUILD_VERSION(bluealsa_proxy_set_remote_device, SND_PCM_DLSYM_VERSION);
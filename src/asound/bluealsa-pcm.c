@@ -10,6 +10,7 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
@@ -27,8 +28,13 @@
 #include "ctl-proto.h"
 #include "defs.h"
 #include "log.h"
+#include "pcm-ring.h"
+#include "pcm-status.h"
 #include "rt.h"
 
+/* The size (in microseconds) of a single transfer in the low-latency mode. */
+#define BLUEALSA_PCM_LOWLATENCY_CHUNK 2500
+
 
 struct bluealsa_pcm {
 	snd_pcm_ioplug_t io;
@@ -44,15 +50,40 @@ struct bluealsa_pcm {
 	size_t pcm_buffer_size;
 	int pcm_fd;
 
+	/* Shared memory ring buffer used instead of the FIFO, if supported by
+	 * the server. In such case the pcm_fd is the doorbell which we wait on
+	 * - space doorbell for playback and data doorbell for capture. */
+	struct pcm_ring shm;
+
+	/* Status page published by the server IO thread. If available, the
+	 * transport delay is read from it without the server round-trip. */
+	struct pcm_status status;
+
 	/* virtual hardware - ring buffer */
 	snd_pcm_uframes_t io_ptr;
 	pthread_t io_thread;
 	bool io_started;
 
+	/* In the low-latency mode, data is transfered in small chunks which are
+	 * not tied to the period size. For playback, the pointer is updated right
+	 * after the chunk transfer, and it is interpolated (from the transfer
+	 * time-stamp) during the time the chunk is played. */
+	bool lowlatency;
+	pthread_mutex_t io_ptr_mutex;
+	snd_pcm_uframes_t io_ptr_frames;
+	struct timespec io_ptr_ts;
+
+	/* The capture IO thread keeps draining the PCM FIFO, even if the PCM is
+	 * stopped or the over-run has occurred. In such case, this flag is set
+	 * and received data are discarded. It is guarded by the io_ptr_mutex. */
+	bool io_discard;
+
 	/* communication and encoding/decoding delay */
 	snd_pcm_sframes_t delay;
 	/* user provided extra delay component */
 	snd_pcm_sframes_t delay_ex;
+	/* delay polling counter (used without the status page) */
+	unsigned int delay_counter;
 
 	/* ALSA operates on frames, we on bytes */
 	size_t frame_size;
@@ -75,12 +106,276 @@ struct bluealsa_pcm {
 static int close_transport(struct bluealsa_pcm *pcm) {
 	int rv = bluealsa_close_transport(pcm->fd, &pcm->transport);
 	int err = errno;
-	close(pcm->pcm_fd);
+	if (pcm->shm.ctrl != NULL) {
+		pcm_ring_close(&pcm->shm);
+		pcm_ring_free(&pcm->shm);
+	}
+	else
+		close(pcm->pcm_fd);
+	pcm_status_free(&pcm->status);
 	pcm->pcm_fd = -1;
 	errno = err;
 	return rv;
 }
 
+/**
+ * Wait for the shared memory ring doorbell.
+ *
+ * @return On success this function returns 0. If the server has released the
+ *   ring, -1 is returned and errno is set to EPIPE. */
+static int shm_wait(struct bluealsa_pcm *pcm) {
+
+	/* Together with the doorbell we will monitor the BlueALSA socket as well,
+	 * so we will not hang forever when the server is gone. */
+	struct pollfd pfds[] = {
+		{ pcm->pcm_fd, POLLIN, 0 },
+		{ pcm->fd, 0, 0 },
+	};
+
+	if (pcm_ring_closed(&pcm->shm))
+		goto closed;
+	if (poll(pfds, ARRAYSIZE(pfds), -1) == -1)
+		return errno == EINTR ? 0 : -1;
+	if (pfds[1].revents & (POLLERR | POLLHUP) || pcm_ring_closed(&pcm->shm))
+		goto closed;
+
+	return 0;
+
+closed:
+	errno = EPIPE;
+	return -1;
+}
+
+/**
+ * Transfer data from our buffer to the PCM FIFO (or the shared memory ring).
+ * This function performs the whole IO operation "atomically".
+ *
+ * @return On success this function returns 0. If the remote side has been
+ *   closed, 1 is returned. On error, -1 is returned. */
+static int io_transfer(struct bluealsa_pcm *pcm, char *head, size_t len) {
+
+	ssize_t ret;
+
+	if (pcm->shm.ctrl != NULL) {
+		while (len != 0) {
+			ret = pcm_ring_write(&pcm->shm, head, len);
+			head += ret;
+			len -= ret;
+			if (len != 0 && shm_wait(pcm) == -1)
+				return errno == EPIPE ? 1 : -1;
+		}
+		return 0;
+	}
+
+	while (len != 0) {
+		if ((ret = write(pcm->pcm_fd, head, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EPIPE ? 1 : -1;
+		}
+		if (ret == 0)
+			return 1;
+		head += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Wait for data in the PCM FIFO (or the shared memory ring).
+ *
+ * @return On success this function returns 0. If the remote side has been
+ *   closed, 1 is returned. On error, -1 is returned. */
+static int io_wait_data(struct bluealsa_pcm *pcm) {
+
+	if (pcm->shm.ctrl != NULL) {
+		if (shm_wait(pcm) == -1)
+			return errno == EPIPE ? 1 : -1;
+		return 0;
+	}
+
+	struct pollfd pfds[] = {
+		{ pcm->pcm_fd, POLLIN, 0 },
+		{ pcm->fd, 0, 0 },
+	};
+
+	if (poll(pfds, ARRAYSIZE(pfds), -1) == -1)
+		return errno == EINTR ? 0 : -1;
+	if (pfds[1].revents & (POLLERR | POLLHUP))
+		return 1;
+
+	return 0;
+}
+
+/**
+ * Read data which are available in the PCM FIFO (or the shared memory ring)
+ * without blocking.
+ *
+ * @return This function returns the number of bytes read, which might be
+ *   zero. If the remote side has been closed, -1 is returned and errno is
+ *   set to EPIPE. On error, -1 is returned. */
+static ssize_t io_read(struct bluealsa_pcm *pcm, char *head, size_t len) {
+
+	ssize_t ret;
+
+	if (pcm->shm.ctrl != NULL)
+		return pcm_ring_read(&pcm->shm, head, len);
+
+	while ((ret = read(pcm->pcm_fd, head, len)) == -1 && errno == EINTR)
+		continue;
+
+	if (ret == -1 && errno == EAGAIN)
+		return 0;
+	if (ret == 0) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Update the IO pointer.
+ *
+ * @param pcm Address of the plug-in structure.
+ * @param ptr The new IO pointer.
+ * @param frames The number of frames by which the pointer shall be moved
+ *   back in the pointer callback, if they are not played yet. */
+static void io_update_ptr(struct bluealsa_pcm *pcm, snd_pcm_uframes_t ptr,
+		snd_pcm_uframes_t frames) {
+	pthread_mutex_lock(&pcm->io_ptr_mutex);
+	pcm->io_ptr = ptr;
+	pcm->io_ptr_frames = frames;
+	clock_gettime(ASRSYNC_CLOCK, &pcm->io_ptr_ts);
+	pthread_mutex_unlock(&pcm->io_ptr_mutex);
+}
+
+/**
+ * Capture loop of the IO thread.
+ *
+ * Data are moved from the PCM FIFO to the ring buffer as soon as they are
+ * available, without waiting for the whole period. The server IO thread
+ * might serve the other stream direction as well (e.g. SCO speaker), so it
+ * shall never be blocked by a slow reader. Hence, if there is no space in
+ * the ring buffer, the over-run is reported and data are discarded until
+ * the PCM is restarted. The same applies to the stopped PCM.
+ *
+ * @return On success this function returns 0. If the remote side has been
+ *   closed, 1 is returned. On error, -1 is returned. */
+static int io_capture(struct bluealsa_pcm *pcm) {
+
+	snd_pcm_ioplug_t *io = &pcm->io;
+	const snd_pcm_channel_area_t *areas = snd_pcm_ioplug_mmap_areas(io);
+	const size_t frame_size = pcm->frame_size;
+
+	char discard[4096];
+	snd_pcm_uframes_t io_period = 0;
+	/* number of bytes of the incomplete frame read from the FIFO */
+	size_t partial = 0;
+	/* whether the incomplete frame is stored at the IO pointer */
+	bool partial_stored = false;
+	ssize_t ret;
+
+	debug("Starting capture IO loop");
+	for (;;) {
+
+		if (io->state == SND_PCM_STATE_DISCONNECTED)
+			return 1;
+
+		if ((ret = io_wait_data(pcm)) != 0)
+			return ret;
+
+		pthread_mutex_lock(&pcm->io_ptr_mutex);
+		const bool discarding = pcm->io_discard;
+		snd_pcm_uframes_t io_ptr = pcm->io_ptr;
+		snd_pcm_uframes_t io_hw_ptr = pcm->io_hw_ptr;
+		pthread_mutex_unlock(&pcm->io_ptr_mutex);
+
+		const bool running = !discarding &&
+			(io->state == SND_PCM_STATE_RUNNING || io->state == SND_PCM_STATE_DRAINING);
+
+		/* Discard data, but keep the frame alignment. The incomplete frame
+		 * which has been discarded partially is discarded as a whole. */
+		if (!running || (partial > 0 && !partial_stored)) {
+
+			size_t len = running ? frame_size - partial : sizeof(discard);
+			if ((ret = io_read(pcm, discard, len)) == -1)
+				break;
+
+			partial = (partial + ret) % frame_size;
+			partial_stored = false;
+			io_period = 0;
+			continue;
+		}
+
+		const snd_pcm_uframes_t io_buffer_size = io->buffer_size;
+		const snd_pcm_uframes_t io_hw_boundary = pcm->io_hw_boundary;
+
+		/* frames captured, but not read by the application yet */
+		snd_pcm_sframes_t avail = io_hw_ptr - io->appl_ptr;
+		if (avail < 0)
+			avail += io_hw_boundary;
+
+		/* check for over-run and act accordingly */
+		if ((snd_pcm_uframes_t)avail >= io_buffer_size) {
+			debug("PCM over-run: %zd frames", avail);
+			pthread_mutex_lock(&pcm->io_ptr_mutex);
+			pcm->io_discard = true;
+			pcm->io_ptr = -1;
+			pcm->io_ptr_frames = 0;
+			pthread_mutex_unlock(&pcm->io_ptr_mutex);
+			io->state = SND_PCM_STATE_XRUN;
+			partial_stored = false;
+			eventfd_write(pcm->event_fd, 1);
+			continue;
+		}
+
+		/* read up to the available space or the end of the buffer */
+		snd_pcm_uframes_t frames = io_buffer_size - avail;
+		if (io_buffer_size - io_ptr < frames)
+			frames = io_buffer_size - io_ptr;
+
+		char *head = areas->addr + (areas->first + areas->step * io_ptr) / 8;
+		if ((ret = io_read(pcm, head + partial, frames * frame_size - partial)) == -1)
+			break;
+
+		partial += ret;
+		frames = partial / frame_size;
+		partial %= frame_size;
+		partial_stored = true;
+
+		if (frames == 0)
+			continue;
+
+		io_ptr += frames;
+		if (io_ptr >= io_buffer_size)
+			io_ptr -= io_buffer_size;
+
+		io_hw_ptr += frames;
+		if (io_hw_ptr >= io_hw_boundary)
+			io_hw_ptr -= io_hw_boundary;
+
+		/* the PCM might have been stopped in the meantime */
+		pthread_mutex_lock(&pcm->io_ptr_mutex);
+		if (!pcm->io_discard) {
+			pcm->io_ptr = io_ptr;
+			pcm->io_ptr_frames = 0;
+			pcm->io_hw_ptr = io_hw_ptr;
+		}
+		pthread_mutex_unlock(&pcm->io_ptr_mutex);
+
+		/* wake up the client on period boundaries only */
+		if ((io_period += frames) >= io->period_size) {
+			io_period %= io->period_size;
+			eventfd_write(pcm->event_fd, 1);
+		}
+
+	}
+
+	return errno == EPIPE ? 1 : -1;
+}
+
 /**
  * IO thread, which facilitates ring buffer. */
 static void *io_thread(void *arg) {
@@ -104,9 +399,27 @@ static void *io_thread(void *arg) {
 		goto final;
 	}
 
-	struct asrsync asrs;
+	if (io->stream == SND_PCM_STREAM_CAPTURE) {
+		if (io_capture(pcm) == -1)
+			SNDERR("PCM read error: %s", strerror(errno));
+		goto final;
+	}
+
+	struct asrsync asrs = { .frames = 0 };
 	asrsync_init(&asrs, io->rate);
 
+	snd_pcm_uframes_t io_chunk = io->period_size;
+	snd_pcm_uframes_t io_period = 0;
+
+	if (pcm->lowlatency) {
+		io_chunk = (uint64_t)io->rate * BLUEALSA_PCM_LOWLATENCY_CHUNK / 1000000;
+		if (io_chunk == 0)
+			io_chunk = 1;
+		if (io_chunk > io->period_size)
+			io_chunk = io->period_size;
+		debug("Low-latency transfer chunk: %zu frames", io_chunk);
+	}
+
 	debug("Starting IO loop");
 	for (;;) {
 
@@ -128,13 +441,13 @@ static void *io_thread(void *arg) {
 		snd_pcm_uframes_t io_buffer_size = io->buffer_size;
 		snd_pcm_uframes_t io_hw_ptr = pcm->io_hw_ptr;
 		snd_pcm_uframes_t io_hw_boundary = pcm->io_hw_boundary;
-		snd_pcm_uframes_t frames = io->period_size;
+		snd_pcm_uframes_t frames = io_chunk;
 		char *buffer = areas->addr + (areas->first + areas->step * io_ptr) / 8;
 		char *head = buffer;
-		ssize_t ret = 0;
+		int ret;
 		size_t len;
 
-		/* If the leftover in the buffer is less than a whole period sizes,
+		/* If the leftover in the buffer is less than a whole transfer size,
 		 * adjust the number of frames which should be transfered. It has
 		 * turned out, that the buffer might contain fractional number of
 		 * periods - it could be an ALSA bug, though, it has to be handled. */
@@ -152,53 +465,43 @@ static void *io_thread(void *arg) {
 		if (io_hw_ptr >= io_hw_boundary)
 			io_hw_ptr -= io_hw_boundary;
 
-		if (io->stream == SND_PCM_STREAM_CAPTURE) {
-
-			/* Read the whole period "atomically". This will assure, that frames
-			 * are not fragmented, so the pointer can be correctly updated. */
-			while (len != 0 && (ret = read(pcm->pcm_fd, head, len)) != 0) {
-				if (ret == -1) {
-					if (errno == EINTR)
-						continue;
-					SNDERR("PCM FIFO read error: %s", strerror(errno));
-					goto final;
-				}
-				head += ret;
-				len -= ret;
-			}
-
-			if (ret == 0)
-				goto final;
+		/* check for under-run and act accordingly */
+		if (io_hw_ptr > io->appl_ptr) {
+			io->state = SND_PCM_STATE_XRUN;
+			io_ptr = -1;
+			goto sync;
+		}
 
+		/* Write the whole chunk "atomically". This will assure, that frames
+		 * are not fragmented, so the pointer can be correctly updated. */
+		if ((ret = io_transfer(pcm, head, len)) != 0) {
+			if (ret == -1)
+				SNDERR("PCM write error: %s", strerror(errno));
+			goto final;
 		}
-		else {
 
-			/* check for under-run and act accordingly */
-			if (io_hw_ptr > io->appl_ptr) {
-				io->state = SND_PCM_STATE_XRUN;
-				io_ptr = -1;
-				goto sync;
-			}
+		/* The space occupied by the transfered chunk can be reused right
+		 * away, however the pointer will reach it when the chunk is played,
+		 * so the avail will be updated smoothly. */
+		if (pcm->lowlatency)
+			io_update_ptr(pcm, io_ptr, frames);
 
-			/* Perform atomic write - see the explanation above. */
-			do {
-				if ((ret = write(pcm->pcm_fd, head, len)) == -1) {
-					if (errno == EINTR)
-						continue;
-					SNDERR("PCM FIFO write error: %s", strerror(errno));
-					goto final;
-				}
-				head += ret;
-				len -= ret;
-			} while (len != 0);
-
-			/* synchronize playback time */
-			asrsync_sync(&asrs, frames);
-		}
+		/* synchronize playback time */
+		asrsync_sync(&asrs, frames);
 
 sync:
-		pcm->io_ptr = io_ptr;
+		if (!pcm->lowlatency || io_ptr == (snd_pcm_uframes_t)-1)
+			io_update_ptr(pcm, io_ptr, 0);
 		pcm->io_hw_ptr = io_hw_ptr;
+
+		/* In the low-latency mode, wake up the client on period boundaries
+		 * only - there is no point in doing it more often. */
+		if (pcm->lowlatency && io_ptr != (snd_pcm_uframes_t)-1) {
+			if ((io_period += frames) < io->period_size)
+				continue;
+			io_period -= io->period_size;
+		}
+
 		eventfd_write(pcm->event_fd, 1);
 	}
 
@@ -217,6 +520,9 @@ static int bluealsa_start(snd_pcm_ioplug_t *io) {
 	 * we might end up with a bunch of IO threads reading or writing to the
 	 * same FIFO simultaneously. Instead, just send resume signal. */
 	if (pcm->io_started) {
+		pthread_mutex_lock(&pcm->io_ptr_mutex);
+		pcm->io_discard = false;
+		pthread_mutex_unlock(&pcm->io_ptr_mutex);
 		io->state = SND_PCM_STATE_RUNNING;
 		pthread_kill(pcm->io_thread, SIGIO);
 		return 0;
@@ -224,6 +530,7 @@ static int bluealsa_start(snd_pcm_ioplug_t *io) {
 
 	/* initialize delay calculation */
 	pcm->delay = 0;
+	pcm->io_discard = false;
 
 	if (bluealsa_pause_transport(pcm->fd, &pcm->transport, false) == -1) {
 		debug("Couldn't start PCM: %s", strerror(errno));
@@ -249,22 +556,64 @@ static int bluealsa_start(snd_pcm_ioplug_t *io) {
 	return 0;
 }
 
-static int bluealsa_stop(snd_pcm_ioplug_t *io) {
-	struct bluealsa_pcm *pcm = io->private_data;
-	debug("Stopping");
+/**
+ * Terminate the IO thread, if it is running. */
+static void io_thread_cancel(struct bluealsa_pcm *pcm) {
 	if (pcm->io_started) {
 		pcm->io_started = false;
 		pthread_cancel(pcm->io_thread);
 		pthread_join(pcm->io_thread, NULL);
 	}
+}
+
+static int bluealsa_stop(snd_pcm_ioplug_t *io) {
+	struct bluealsa_pcm *pcm = io->private_data;
+	debug("Stopping");
+
+	/* The capture IO thread is kept running, so the data sent by the server
+	 * are discarded until the PCM is started again. Otherwise, the server IO
+	 * thread would be blocked on the full PCM FIFO. */
+	if (io->stream == SND_PCM_STREAM_CAPTURE && pcm->io_started) {
+		pthread_mutex_lock(&pcm->io_ptr_mutex);
+		pcm->io_discard = true;
+		pthread_mutex_unlock(&pcm->io_ptr_mutex);
+		return 0;
+	}
+
+	io_thread_cancel(pcm);
 	return 0;
 }
 
 static snd_pcm_sframes_t bluealsa_pointer(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
+
 	if (pcm->pcm_fd == -1)
 		return -ENODEV;
-	return pcm->io_ptr;
+	if (!pcm->lowlatency)
+		return pcm->io_ptr;
+
+	pthread_mutex_lock(&pcm->io_ptr_mutex);
+	snd_pcm_sframes_t ptr = pcm->io_ptr;
+	snd_pcm_uframes_t frames = pcm->io_ptr_frames;
+	struct timespec ts = pcm->io_ptr_ts;
+	pthread_mutex_unlock(&pcm->io_ptr_mutex);
+
+	/* interpolate the pointer within the chunk which is being played */
+	if (frames > 0 && ptr != -1) {
+
+		struct timespec now;
+		clock_gettime(ASRSYNC_CLOCK, &now);
+		difftimespec(&ts, &now, &ts);
+
+		snd_pcm_uframes_t played = ts.tv_sec * io->rate +
+			(uint64_t)ts.tv_nsec * io->rate / 1000000000;
+		if (played < frames)
+			if ((ptr -= frames - played) < 0)
+				ptr += io->buffer_size;
+
+	}
+
+	return ptr;
 }
 
 static int bluealsa_close(snd_pcm_ioplug_t *io) {
@@ -272,6 +621,7 @@ static int bluealsa_close(snd_pcm_ioplug_t *io) {
 	debug("Closing plugin");
 	close(pcm->fd);
 	close(pcm->event_fd);
+	pthread_mutex_destroy(&pcm->io_ptr_mutex);
 	free(pcm);
 	return 0;
 }
@@ -283,7 +633,54 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 
 	pcm->frame_size = (snd_pcm_format_physical_width(io->format) * io->channels) / 8;
 
-	if ((pcm->pcm_fd = bluealsa_open_transport(pcm->fd, &pcm->transport)) == -1) {
+	/* If the selected rate differs from the transport one, the server
+	 * will convert the signal to (or from) the transport sampling rate. */
+	struct ba_msg_transport transport = pcm->transport;
+	transport.sampling = io->rate;
+
+	switch (io->format) {
+	case SND_PCM_FORMAT_S24_3LE:
+		transport.format = BA_PCM_FORMAT_S24_3LE;
+		break;
+	case SND_PCM_FORMAT_S32_LE:
+		transport.format = BA_PCM_FORMAT_S32_LE;
+		break;
+	case SND_PCM_FORMAT_FLOAT_LE:
+		transport.format = BA_PCM_FORMAT_FLOAT_LE;
+		break;
+	default:
+		transport.format = BA_PCM_FORMAT_S16_LE;
+	}
+
+	/* the server is not able to resample other formats */
+	if (transport.format != BA_PCM_FORMAT_S16_LE &&
+			transport.sampling != pcm->transport.sampling) {
+		debug("Resampling not available for format: %s", snd_pcm_format_name(io->format));
+		return -EINVAL;
+	}
+
+	int fds[3];
+	if (bluealsa_open_transport_shm(pcm->fd, &transport, fds) == 0) {
+
+		int err = pcm_ring_attach(&pcm->shm, fds[0], fds[1], fds[2]);
+		int tmp = errno;
+		close(fds[0]);
+
+		if (err == -1) {
+			close(fds[1]);
+			close(fds[2]);
+			bluealsa_close_transport(pcm->fd, &pcm->transport);
+			debug("Couldn't attach PCM ring: %s", strerror(tmp));
+			return -tmp;
+		}
+
+		pcm->pcm_fd = io->stream == SND_PCM_STREAM_PLAYBACK ?
+			pcm->shm.space_fd : pcm->shm.data_fd;
+		pcm->pcm_buffer_size = pcm->shm.size;
+		debug("PCM ring buffer size: %zd", pcm->pcm_buffer_size);
+
+	}
+	else if ((pcm->pcm_fd = bluealsa_open_transport(pcm->fd, &transport)) == -1) {
 		debug("Couldn't open PCM FIFO: %s", strerror(errno));
 		return -errno;
 	}
@@ -294,7 +691,17 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 	if (io->stream == SND_PCM_STREAM_PLAYBACK)
 		eventfd_write(pcm->event_fd, 1);
 
-	if (pcm->io.stream == SND_PCM_STREAM_PLAYBACK) {
+	/* The capture IO thread reads data as soon as they are available, so
+	 * it must not block on the FIFO (the shared memory ring never blocks). */
+	if (pcm->shm.ctrl == NULL && io->stream == SND_PCM_STREAM_CAPTURE &&
+			fcntl(pcm->pcm_fd, F_SETFL, fcntl(pcm->pcm_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		int err = errno;
+		close_transport(pcm);
+		debug("Couldn't set PCM FIFO non-blocking: %s", strerror(err));
+		return -err;
+	}
+
+	if (pcm->shm.ctrl == NULL && pcm->io.stream == SND_PCM_STREAM_PLAYBACK) {
 		/* By default, the size of the pipe buffer is set to a too large value for
 		 * our purpose. On modern Linux system it is 65536 bytes. Large buffer in
 		 * the playback mode might contribute to an unnecessary audio delay. Since
@@ -305,6 +712,19 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 		debug("FIFO buffer size: %zd", pcm->pcm_buffer_size);
 	}
 
+	/* The status page is published for the playback stream only. If it is
+	 * not available (e.g. older server), delay will be polled instead. */
+	if (pcm->io.stream == SND_PCM_STREAM_PLAYBACK) {
+		int status_fd;
+		if ((status_fd = bluealsa_open_transport_status(pcm->fd, &pcm->transport)) == -1)
+			debug("Couldn't get PCM status page: %s", strerror(errno));
+		else {
+			if (pcm_status_attach(&pcm->status, status_fd) == -1)
+				debug("Couldn't attach PCM status page: %s", strerror(errno));
+			close(status_fd);
+		}
+	}
+
 	debug("Selected HW buffer: %zd periods x %zd bytes %c= %zd bytes",
 			io->buffer_size / io->period_size, pcm->frame_size * io->period_size,
 			io->period_size * (io->buffer_size / io->period_size) == io->buffer_size ? '=' : '<',
@@ -316,6 +736,7 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 static int bluealsa_hw_free(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
 	debug("Freeing HW");
+	io_thread_cancel(pcm);
 	if (close_transport(pcm) == -1)
 		return -errno;
 	return 0;
@@ -336,8 +757,11 @@ static int bluealsa_prepare(snd_pcm_ioplug_t *io) {
 		return -ENODEV;
 
 	/* initialize ring buffer */
+	pthread_mutex_lock(&pcm->io_ptr_mutex);
 	pcm->io_hw_ptr = 0;
 	pcm->io_ptr = 0;
+	pcm->io_ptr_frames = 0;
+	pthread_mutex_unlock(&pcm->io_ptr_mutex);
 
 	debug("Prepared");
 	return 0;
@@ -392,15 +816,16 @@ static int bluealsa_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp) {
 	 * the FIFO buffer, the time required to encode data, Bluetooth transfer
 	 * latency and the time required by the device to decode and play audio. */
 
-	static int counter = 0;
 	snd_pcm_sframes_t delay = 0;
 	unsigned int size;
 
 	/* bytes queued in the PCM ring buffer */
 	delay += io->appl_ptr - io->hw_ptr;
 
-	/* bytes queued in the FIFO buffer */
-	if (ioctl(pcm->pcm_fd, FIONREAD, &size) != -1)
+	/* bytes queued in the FIFO buffer (or in the shared memory ring) */
+	if (pcm->shm.ctrl != NULL)
+		delay += pcm_ring_len_out(&pcm->shm) / pcm->frame_size;
+	else if (ioctl(pcm->pcm_fd, FIONREAD, &size) != -1)
 		delay += size / pcm->frame_size;
 
 	/* On the server side, the delay stat will not be available until the PCM
@@ -408,8 +833,13 @@ static int bluealsa_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp) {
 	if ((io->state == SND_PCM_STATE_RUNNING || io->state == SND_PCM_STATE_DRAINING)) {
 
 		/* data transfer (communication) and encoding/decoding */
-		if (io->stream == SND_PCM_STREAM_PLAYBACK &&
-				(pcm->delay == 0 || ++counter % (io->rate / 10) == 0)) {
+		if (pcm->status.page != NULL) {
+			struct pcm_status_data data;
+			pcm_status_read(&pcm->status, &data);
+			pcm->delay = (io->rate / 100) * data.delay / 100;
+		}
+		else if (io->stream == SND_PCM_STREAM_PLAYBACK &&
+				(pcm->delay == 0 || ++pcm->delay_counter % (io->rate / 10) == 0)) {
 
 			unsigned int tmp;
 			if (bluealsa_get_transport_delay(pcm->fd, &pcm->transport, &tmp) != -1) {
@@ -525,8 +955,18 @@ static int bluealsa_set_hw_constraint(struct bluealsa_pcm *pcm) {
 		SND_PCM_ACCESS_MMAP_INTERLEAVED,
 		SND_PCM_ACCESS_RW_INTERLEAVED,
 	};
-	static const unsigned int formats[] = {
-		SND_PCM_FORMAT_S16_LE,
+	static const struct {
+		enum ba_pcm_format format;
+		unsigned int alsa;
+	} formats_map[] = {
+		{ BA_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S16_LE },
+		{ BA_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S24_3LE },
+		{ BA_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S32_LE },
+		{ BA_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_FLOAT_LE },
+	};
+	static const unsigned int rates_common[] = {
+		8000, 11025, 16000, 22050, 32000,
+		44100, 48000, 88200, 96000,
 	};
 
 	int err;
@@ -537,8 +977,18 @@ static int bluealsa_set_hw_constraint(struct bluealsa_pcm *pcm) {
 					ARRAYSIZE(accesses), accesses)) < 0)
 		return err;
 
+	/* Formats other than the S16_LE are passed by the server straight to
+	 * the encoder, so they are advertised only if reported by the server. */
+	unsigned int formats[ARRAYSIZE(formats_map)];
+	size_t f, nf = 0;
+
+	for (f = 0; f < ARRAYSIZE(formats_map); f++)
+		if (formats_map[f].format == BA_PCM_FORMAT_S16_LE ||
+				pcm->transport.formats & (1 << formats_map[f].format))
+			formats[nf++] = formats_map[f].alsa;
+
 	if ((err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_FORMAT,
-					ARRAYSIZE(formats), formats)) < 0)
+					nf, formats)) < 0)
 		return err;
 
 	if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIODS,
@@ -565,8 +1015,32 @@ static int bluealsa_set_hw_constraint(struct bluealsa_pcm *pcm) {
 					pcm->transport.channels, pcm->transport.channels)) < 0)
 		return err;
 
-	if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_RATE,
-					pcm->transport.sampling, pcm->transport.sampling)) < 0)
+	if (pcm->transport.type != BA_PCM_TYPE_A2DP) {
+		if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_RATE,
+						pcm->transport.sampling, pcm->transport.sampling)) < 0)
+			return err;
+		return 0;
+	}
+
+	/* For A2DP the server is able to convert the sampling rate, so we can
+	 * advertise common rates in addition to the transport one. */
+	unsigned int rates[ARRAYSIZE(rates_common) + 1];
+	bool added = false;
+	size_t i, n = 0;
+
+	for (i = 0; i < ARRAYSIZE(rates_common); i++) {
+		if (!added && rates_common[i] >= pcm->transport.sampling) {
+			rates[n++] = pcm->transport.sampling;
+			added = true;
+		}
+		if (rates_common[i] != pcm->transport.sampling)
+			rates[n++] = rates_common[i];
+	}
+	if (!added)
+		rates[n++] = pcm->transport.sampling;
+
+	if ((err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_RATE,
+					n, rates)) < 0)
 		return err;
 
 	return 0;
@@ -581,6 +1055,7 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 	const char *profile = NULL;
 	struct bluealsa_pcm *pcm;
 	long delay = 0;
+	int lowlatency = 0;
 	int ret;
 
 	snd_config_for_each(i, next, conf) {
@@ -623,6 +1098,13 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 			}
 			continue;
 		}
+		if (strcmp(id, "lowlatency") == 0) {
+			if ((lowlatency = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
 
 		SNDERR("Unknown field %s", id);
 		return -EINVAL;
@@ -648,6 +1130,8 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 	pcm->event_fd = -1;
 	pcm->pcm_fd = -1;
 	pcm->delay_ex = delay;
+	pcm->lowlatency = lowlatency;
+	pthread_mutex_init(&pcm->io_ptr_mutex, NULL);
 
 	if ((pcm->fd = bluealsa_open(interface)) == -1) {
 		SNDERR("BlueALSA connection failed: %s", strerror(errno));
@@ -692,6 +1176,7 @@ fail:
 		close(pcm->fd);
 	if (pcm->event_fd != -1)
 		close(pcm->event_fd);
+	pthread_mutex_destroy(&pcm->io_ptr_mutex);
 	free(pcm);
 	return ret;
 }
@@ -12,6 +12,7 @@
 #include "at.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -61,54 +62,174 @@ char *at_build(char *buffer, enum bt_at_type type, const char *command,
 	return buffer;
 }
 
+static void at_tokenizer_reset(struct at_tokenizer *tok,
+		enum at_tokenizer_state state) {
+	tok->state = state;
+	tok->scanned = 0;
+	tok->response = false;
+	tok->sep_equal = -1;
+	tok->sep_question = -1;
+	tok->sep_colon = -1;
+}
+
+/**
+ * Initialize AT tokenizer.
+ *
+ * @param tok Address of the tokenizer structure.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int at_tokenizer_init(struct at_tokenizer *tok) {
+	memset(&tok->buffer, 0, sizeof(tok->buffer));
+	at_tokenizer_reset(tok, AT_TOKENIZER_IDLE);
+	return ffb_uint8_init(&tok->buffer, AT_TOKENIZER_BUFFER_SIZE);
+}
+
+/**
+ * Free resources allocated by the at_tokenizer_init(). */
+void at_tokenizer_free(struct at_tokenizer *tok) {
+	ffb_uint8_free(&tok->buffer);
+}
+
 /**
- * Parse AT message.
+ * Store data in the tokenizer buffer.
  *
- * @param str String to parse.
+ * Instead of using this function, one can store data directly at the tail
+ * of the tokenizer buffer, e.g. with the read() system call, and then call
+ * the ffb_seek() macro.
+ *
+ * @param tok Address of the tokenizer structure.
+ * @param data Address of the data to store.
+ * @param len The number of bytes to store.
+ * @return On success this function returns 0. If there is not enough space
+ *   in the buffer, -1 is returned and errno is set to ENOBUFS. */
+int at_tokenizer_feed(struct at_tokenizer *tok, const void *data, size_t len) {
+
+	if (len > ffb_len_in(&tok->buffer)) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	memcpy(tok->buffer.tail, data, len);
+	ffb_seek(&tok->buffer, len);
+	return 0;
+}
+
+/**
+ * Get the next AT message from the tokenizer.
+ *
+ * Messages are parsed in place, hence the command and the value of the AT
+ * structure point to the tokenizer buffer. Upon every call, only data which
+ * was not scanned yet is processed, so this function can be called after
+ * every read, regardless of the message boundaries.
+ *
+ * @param tok Address of the tokenizer structure.
  * @param at Address of the AT structure, where the parsed information will
  *   be stored.
- * @return On success this function returns a pointer to the next message
- *   within the input string. If the input string contains only one message,
- *   returned value will point to the end null byte. On error, this function
- *   returns NULL. */
-char *at_parse(const char *str, struct bt_at *at) {
-
-	char *command = at->command;
-	bool is_command = false;
-	const char *feed;
-	char *tmp;
-
-	/* locate <CR> character, which indicates end of message */
-	if ((feed = strchr(str, '\r')) == NULL)
-		return NULL;
-
-	/* consume empty message */
-	if (feed == str)
-		return at_parse(feed + 1, at);
-
-	/* check whether we are parsing AT command */
-	if (strncasecmp(str, "AT", 2) == 0) {
-		is_command = true;
-		str += 2;
+ * @return If the complete message has been parsed, this function returns 1.
+ *   If more data is required, 0 is returned. If the message is invalid, it
+ *   is discarded, the raw message is stored in the command field of the AT
+ *   structure, and -1 is returned with errno set to EBADMSG. */
+int at_tokenizer_next(struct at_tokenizer *tok, struct bt_at *at) {
+
+	ffb_uint8_t *buffer = &tok->buffer;
+	char *msg = (char *)buffer->head;
+	const size_t len = ffb_len_out(buffer);
+	size_t start = 0;
+	size_t i;
+
+	for (i = tok->scanned; i < len; i++) {
+		const char c = msg[i];
+
+		if (tok->state == AT_TOKENIZER_RESPONSE_LF) {
+			tok->state = AT_TOKENIZER_IDLE;
+			/* consume <LF> from the end of the response */
+			if (c == '\n') {
+				start = i + 1;
+				continue;
+			}
+		}
+
+		if (tok->state == AT_TOKENIZER_IDLE) {
+			/* consume empty messages, however, the response starts
+			 * with the <LF> character, so keep track of it */
+			if (c == '\r' || c == '\n') {
+				tok->response = c == '\n';
+				start = i + 1;
+				continue;
+			}
+			tok->state = AT_TOKENIZER_MESSAGE;
+		}
+
+		switch (c) {
+		case '\r':
+			goto message;
+		case '=':
+			if (tok->sep_equal == -1)
+				tok->sep_equal = i;
+			break;
+		case '?':
+			if (tok->sep_question == -1)
+				tok->sep_question = i;
+			break;
+		case ':':
+			if (tok->sep_colon == -1)
+				tok->sep_colon = i;
+			break;
+		}
+
 	}
-	else {
-		/* response starts with <LF> sequence */
-		if (str[0] != '\n')
-			return NULL;
-		str += 1;
+
+	/* Discard consumed separators, so the buffer head points to the
+	 * beginning of the message and the offsets stay valid. */
+	ffb_shift(buffer, start);
+	tok->scanned = len - start;
+	if (tok->sep_equal != -1)
+		tok->sep_equal -= start;
+	if (tok->sep_question != -1)
+		tok->sep_question -= start;
+	if (tok->sep_colon != -1)
+		tok->sep_colon -= start;
+
+	/* message does not fit into the buffer */
+	if (ffb_len_in(buffer) == 0) {
+		msg = (char *)buffer->head;
+		msg[buffer->size - 1] = '\0';
+		at->type = AT_TYPE_RAW;
+		at->command = msg;
+		at->value = NULL;
+		ffb_shift(buffer, buffer->size);
+		at_tokenizer_reset(tok, AT_TOKENIZER_IDLE);
+		errno = EBADMSG;
+		return -1;
 	}
 
-	strncpy(command, str, sizeof(at->command) - 1);
+	return 0;
+
+message:
+
+	msg[i] = '\0';
+	char *command = &msg[start];
+	char *tmp = NULL;
+
 	at->value = NULL;
 
-	/* check everything twice (we don't want to be hacked) */
-	if ((size_t)(feed - str) < sizeof(at->command))
-		command[feed - str] = '\0';
+	if (!tok->response) {
+
+		/* check whether we are parsing AT command */
+		if (strncasecmp(command, "AT", 2) != 0) {
+			at->type = AT_TYPE_RAW;
+			at->command = command;
+			ffb_shift(buffer, i + 1);
+			at_tokenizer_reset(tok, AT_TOKENIZER_IDLE);
+			errno = EBADMSG;
+			return -1;
+		}
 
-	if (is_command) {
+		command += 2;
 
 		/* determine command type */
-		if ((tmp = strchr(command, '=')) != NULL) {
+		if (tok->sep_equal != -1) {
+			tmp = &msg[tok->sep_equal];
 			if (tmp[1] == '?')
 				at->type = AT_TYPE_CMD_TEST;
 			else {
@@ -116,49 +237,50 @@ char *at_parse(const char *str, struct bt_at *at) {
 				at->value = tmp + 1;
 			}
 		}
-		else if ((tmp = strchr(command, '?')) != NULL)
+		else if (tok->sep_question != -1) {
+			tmp = &msg[tok->sep_question];
 			at->type = AT_TYPE_CMD_GET;
+		}
 		else
 			at->type = AT_TYPE_CMD;
 
-		if (tmp != NULL)
-			*tmp = '\0';
-
 	}
 	else {
 
 		at->type = AT_TYPE_RESP;
 
-		if ((tmp = strchr(command, ':')) == NULL)
+		if (tok->sep_colon != -1)
+			tmp = &msg[tok->sep_colon];
+		else if (tok->sep_equal != -1)
 			/* provide support for GSM standard */
-			tmp = strchr(command, '=');
+			tmp = &msg[tok->sep_equal];
 
-		if (tmp != NULL) {
+		if (tmp != NULL)
 			at->value = tmp + 1;
-			*tmp = '\0';
-		}
 		else {
 			/* unsolicited (with empty command) result code */
-			at->value = memmove(command + 1, command, sizeof(at->command) - 1);
-			command[0] = command[sizeof(at->command) - 1] = '\0';
+			at->value = command;
+			command = &msg[i];
 		}
 
-		/* consume <LF> from the end of the response */
-		if (feed[1] == '\n')
-			feed++;
-
 	}
 
+	if (tmp != NULL)
+		*tmp = '\0';
+	at->command = command;
+
 	/* In the BT specification, all AT commands are in uppercase letters.
 	 * However, if someone will not respect this "convention", we will make
 	 * life easier by converting received command to all uppercase. */
-	while (*command != '\0') {
-		*command = toupper(*command);
-		command++;
-	}
+	for (tmp = command; *tmp != '\0'; tmp++)
+		*tmp = toupper(*tmp);
+
+	ffb_shift(buffer, i + 1);
+	at_tokenizer_reset(tok, tok->response ?
+			AT_TOKENIZER_RESPONSE_LF : AT_TOKENIZER_IDLE);
 
 	debug("AT message: %s: command:%s, value:%s", at_type2str(at->type), at->command, at->value);
-	return (char *)&feed[1];
+	return 1;
 }
 
 /**
@@ -12,7 +12,16 @@
 #ifndef BLUEALSA_AT_H_
 #define BLUEALSA_AT_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
 #include "hfp.h"
+#include "shared/ffb.h"
+
+/* Size of the AT tokenizer buffer - it limits the length of the single
+ * AT message. Longer messages are discarded. */
+#define AT_TOKENIZER_BUFFER_SIZE 1024
 
 enum bt_at_type {
 	AT_TYPE_RAW,
@@ -24,15 +33,53 @@ enum bt_at_type {
 	__AT_TYPE_MAX
 };
 
+/**
+ * Parsed AT message.
+ *
+ * The command and the value point directly into the tokenizer buffer, so
+ * they are valid until new data is stored in the tokenizer. */
 struct bt_at {
 	enum bt_at_type type;
-	char command[256];
+	char *command;
 	char *value;
 };
 
+enum at_tokenizer_state {
+	/* skipping message separators */
+	AT_TOKENIZER_IDLE,
+	/* scanning message body */
+	AT_TOKENIZER_MESSAGE,
+	/* response has been parsed, but its trailing <LF> was not seen yet */
+	AT_TOKENIZER_RESPONSE_LF,
+};
+
+/**
+ * Incremental AT message tokenizer.
+ *
+ * Received data is appended to the ring buffer, and messages are parsed
+ * in place once the terminating <CR> character is received. Bytes which
+ * were already scanned are not scanned again, so a message split across
+ * several reads costs the same as a single one. */
+struct at_tokenizer {
+	ffb_uint8_t buffer;
+	enum at_tokenizer_state state;
+	/* number of scanned bytes (from the buffer head) */
+	size_t scanned;
+	/* whether the message starts with the <LF> character */
+	bool response;
+	/* offsets (from the buffer head) of the first separators in the
+	 * message body or -1 if given separator was not found */
+	ssize_t sep_equal;
+	ssize_t sep_question;
+	ssize_t sep_colon;
+};
+
 char *at_build(char *buffer, enum bt_at_type type, const char *command,
 		const char *value);
-char *at_parse(const char *str, struct bt_at *at);
+int at_tokenizer_init(struct at_tokenizer *tok);
+void at_tokenizer_free(struct at_tokenizer *tok);
+int at_tokenizer_feed(struct at_tokenizer *tok, const void *data, size_t len);
+int at_tokenizer_next(struct at_tokenizer *tok, struct bt_at *at);
 int at_parse_cind(const char *str, enum hfp_ind map[20]);
 const char *at_type2str(enum bt_at_type type);
 
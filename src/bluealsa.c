@@ -32,11 +32,24 @@ struct ba_config config = {
 	.gid_audio = -1,
 
 	/* initialization flags */
-	.ctl.socket_created = false,
 	.ctl.thread_created = false,
 
+	.ctl.efd = -1,
+	.ctl.srv_bound = 0,
 	.ctl.evt = { -1, -1 },
 
+	.io_engine.enabled = false,
+	.io_engine.workers = 0,
+
+	.io_thread.policy = SCHED_OTHER,
+	.io_thread.priority = 0,
+	.io_thread.cpus_a2dp = 0,
+	.io_thread.cpus_sco = 0,
+	.io_thread.mlockall = false,
+	.io_thread.catchup = ASRSYNC_CATCHUP_BURST,
+	.io_thread.buffer_pool = 256 * 1024,
+	.io_thread.buffer_limit = 0,
+
 	.hfp.features_sdp_hf =
 		SDP_HFP_HF_FEAT_CLI |
 		SDP_HFP_HF_FEAT_VOLUME,
@@ -53,11 +66,27 @@ struct ba_config config = {
 		HFP_AG_FEAT_ECC |
 		HFP_AG_FEAT_EERC |
 		HFP_AG_FEAT_CODEC,
+	.hfp.sco_period = 10,
+	.hfp.sco_preconnect = true,
 
 	.a2dp.volume = false,
 	.a2dp.force_mono = false,
 	.a2dp.force_44100 = false,
 	.a2dp.keep_alive = 0,
+	.a2dp.standby = BA_A2DP_STANDBY_HINT,
+	.a2dp.pipeline = false,
+
+	.a2dp.abr = false,
+	.a2dp.abr_config = {
+		.queue_low = 1,
+		.queue_high = 4,
+		.blocked = 10,
+		.upgrade = 2000,
+		.holdoff = 200,
+	},
+	.a2dp.jitter_buffer = 0,
+	.a2dp.plc_repeat = false,
+	.a2dp.resampler = RESAMPLER_QUALITY_MEDIUM,
 
 #if ENABLE_AAC
 	/* There are two issues with the afterburner: a) it uses a LOT of power,
@@ -78,12 +107,19 @@ struct ba_config config = {
 int bluealsa_config_init(void) {
 
 	struct group *grp;
+	size_t i;
 
 	config.main_thread = pthread_self();
 
+	for (i = 0; i < HCI_MAX_DEV; i++)
+		config.ctl.srv[i] = -1;
+
 	pthread_mutex_init(&config.devices_mutex, NULL);
 	config.devices = g_hash_table_new_full(g_str_hash, g_str_equal,
 			g_free, (GDestroyNotify)device_free);
+	config.transports = g_hash_table_new(g_str_hash, g_str_equal);
+	config.pcm_clients = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, (GDestroyNotify)g_slist_free);
 
 	config.dbus_objects = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 			NULL, g_free);
@@ -94,11 +130,39 @@ int bluealsa_config_init(void) {
 
 	config.a2dp.codecs = bluez_a2dp_codecs;
 
+	capture_init(&config.capture);
+	link_history_init(&config.a2dp.link_history);
+	cpu_budget_init(&config.io_thread.cpu_budget, 0);
+
 	return 0;
 }
 
+/**
+ * Get the index of the given HCI device in the used HCI devices table.
+ *
+ * @param hci_dev_id HCI device ID.
+ * @return If the HCI device is served by this instance, this function returns
+ *   its index. Otherwise, -1 is returned. */
+int bluealsa_hci_dev_index(int hci_dev_id) {
+
+	size_t i;
+
+	for (i = 0; i < config.hci_devs_len; i++)
+		if (config.hci_devs[i].dev_id == hci_dev_id)
+			return i;
+
+	return -1;
+}
+
 void bluealsa_config_free(void) {
+	capture_stop(&config.capture);
+	link_history_free(&config.a2dp.link_history);
+	cpu_budget_free(&config.io_thread.cpu_budget);
 	pthread_mutex_destroy(&config.devices_mutex);
 	g_hash_table_unref(config.devices);
+	g_hash_table_unref(config.transports);
+	g_hash_table_unref(config.pcm_clients);
 	g_hash_table_unref(config.dbus_objects);
+	transport_pool_free();
+	ffb_pool_free();
 }
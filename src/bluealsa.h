@@ -18,6 +18,7 @@
 #include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -25,22 +26,52 @@
 #include <glib.h>
 #include <gio/gio.h>
 
+#include "abr.h"
 #include "bluez.h"
 #include "bluez-a2dp.h"
+#include "capture.h"
+#include "cpu-budget.h"
 #include "ctl-proto.h"
+#include "link-history.h"
+#include "resample.h"
+#include "rt.h"
+
+/**
+ * Warm-standby policy of A2DP source transports. */
+enum ba_a2dp_standby {
+	/* transport is acquired upon PCM open only */
+	BA_A2DP_STANDBY_NONE,
+	/* transport might be acquired ahead of time upon client request */
+	BA_A2DP_STANDBY_HINT,
+	/* transport is acquired right after the configuration and it is
+	 * kept acquired as long as the device is connected */
+	BA_A2DP_STANDBY_ALWAYS,
+};
 
-/* Maximal number of clients connected to the controller. */
-#define BLUEALSA_MAX_CLIENTS 7
-
-/* Indexes of special file descriptors in the poll array. */
-#define CTL_IDX_SRV 0
-#define CTL_IDX_EVT 1
-#define __CTL_IDX_MAX 2
+/* The maximal number of requests served for a single client at once. */
+#define BLUEALSA_CTL_REQUESTS 16
+
+/**
+ * Client connected to the controller. */
+struct ba_ctl_client {
+	/* client socket - -1 if the slot is not used */
+	int fd;
+	/* protocol version - zero until the handshake is completed */
+	uint16_t version;
+	/* event subscriptions */
+	enum ba_event subs;
+	/* sequence number of the last v2 event */
+	uint32_t event_seq;
+	/* HCI device of the controller socket used by the client */
+	int hci_dev_id;
+};
 
 struct ba_config {
 
-	/* used HCI device */
-	struct hci_dev_info hci_dev;
+	/* Used HCI devices - all of them are served by this instance. The first
+	 * device is the default one, e.g. it names the capture file. */
+	struct hci_dev_info hci_devs[HCI_MAX_DEV];
+	size_t hci_devs_len;
 
 	/* set of enabled profiles */
 	struct {
@@ -62,6 +93,12 @@ struct ba_config {
 	/* collection of connected devices */
 	pthread_mutex_t devices_mutex;
 	GHashTable *devices;
+	/* Lookup indexes for all transports of connected devices: D-Bus path to
+	 * transport, and PCM client to the list of transports. These tables do
+	 * not own stored transports, and they are protected by the devices mutex
+	 * as well. */
+	GHashTable *transports;
+	GHashTable *pcm_clients;
 
 	/* registered D-Bus objects */
 	GHashTable *dbus_objects;
@@ -69,15 +106,57 @@ struct ba_config {
 	/* audio group ID */
 	gid_t gid_audio;
 
+	/* Serve transports by the shared pool of IO engine workers instead of
+	 * creating one IO thread per transport. If the number of workers is zero,
+	 * one worker per online processor is created. */
+	struct {
+		bool enabled;
+		unsigned int workers;
+	} io_engine;
+
+	/* Capture ring of the BT and PCM traffic of all transports. It might be
+	 * toggled at runtime with the BA_COMMAND_CAPTURE controller request. */
+	struct capture capture;
+
+	/* Scheduling policy applied to the dedicated IO threads. */
+	struct {
+		/* real-time policy (SCHED_FIFO or SCHED_RR) and its priority,
+		 * SCHED_OTHER leaves the default scheduling untouched */
+		int policy;
+		int priority;
+		/* CPU affinity masks for A2DP and SCO threads - zero means that
+		 * the thread is not pinned to any particular CPU */
+		uint64_t cpus_a2dp;
+		uint64_t cpus_sco;
+		/* lock process memory before the first IO thread is started */
+		bool mlockall;
+		/* transfer pacing behavior after an overrun */
+		enum asrsync_catchup catchup;
+		/* amount of released IO buffer memory kept mapped for reuse */
+		size_t buffer_pool;
+		/* per transport limit of the IO buffer memory - zero means that
+		 * the memory usage is not limited */
+		size_t buffer_limit;
+		/* CPU time available for the encoding - when the total load of
+		 * encoders exceeds the budget, their complexity is lowered */
+		struct cpu_budget cpu_budget;
+	} io_thread;
+
 	struct {
 
 		pthread_t thread;
-		bool socket_created;
 		bool thread_created;
 
-		struct pollfd pfds[__CTL_IDX_MAX + BLUEALSA_MAX_CLIENTS];
-		/* event subscriptions for connected clients */
-		enum ba_event subs[BLUEALSA_MAX_CLIENTS];
+		/* epoll instance and controller sockets - one socket per used HCI
+		 * device, indexed in the same way as the HCI devices table */
+		int efd;
+		int srv[HCI_MAX_DEV];
+		size_t srv_bound;
+
+		/* Connected clients indexed by the socket file descriptor. The table
+		 * grows as needed, so there is no limit on the number of clients. */
+		struct ba_ctl_client *clients;
+		size_t clients_size;
 
 		/* PIPE for transferring events */
 		int evt[2];
@@ -91,6 +170,12 @@ struct ba_config {
 		/* set of features exposed via RFCOMM connection */
 		int features_rfcomm_hf;
 		int features_rfcomm_ag;
+		/* SCO transfer period (in milliseconds) - audio is exchanged with
+		 * the SCO socket and the PCM in chunks of this duration */
+		unsigned int sco_period;
+		/* establish SCO link while the call is being set up, so the audio
+		 * is available as soon as the call is answered */
+		bool sco_preconnect;
 	} hfp;
 
 	struct {
@@ -116,6 +201,39 @@ struct ba_config {
 		 * time. This option applies for the source profile only. */
 		int keep_alive;
 
+		/* Policy of acquiring source transports ahead of the PCM open. It
+		 * trades the headset battery life for the stream start latency. */
+		enum ba_a2dp_standby standby;
+
+		/* The number of seconds of the digital silence after which the source
+		 * IO thread stops encoding and transmitting audio, even though the PCM
+		 * is still open. Zero disables the silence detection. */
+		unsigned int silence_timeout;
+
+		/* Use separate thread for the BT transmission, so the encoding time
+		 * does not affect the transmission pacing (AAC and LDAC only). */
+		bool pipeline;
+
+		/* Adjust SBC bitpool and AAC bit rate according to the BT link
+		 * congestion - adaptive bit rate. */
+		bool abr;
+		struct abr_config abr_config;
+		/* BT link quality sustained by recently connected devices - used
+		 * as the initial adaptive bit rate quality level */
+		struct link_history link_history;
+
+		/* The target delay (in milliseconds) of the sink side jitter buffer.
+		 * Zero disables the jitter buffer - packets are decoded right away. */
+		unsigned int jitter_buffer;
+		/* Conceal lost packets by repeating (attenuated) previously decoded
+		 * audio instead of inserting silence. */
+		bool plc_repeat;
+
+		/* Quality of the in-server sample-rate converter, which is used when
+		 * the client opens PCM with a sampling rate different from the one
+		 * used by the transport. RESAMPLER_QUALITY_NONE disables it. */
+		enum resampler_quality resampler;
+
 	} a2dp;
 
 #if ENABLE_AAC
@@ -136,6 +254,8 @@ struct ba_dbus_object {
 	unsigned int id;
 	enum bluetooth_profile profile;
 	uint16_t codec;
+	/* HCI device for which the object is registered */
+	int hci_dev_id;
 	/* determine whether profile is used */
 	bool connected;
 };
@@ -146,4 +266,6 @@ extern struct ba_config config;
 int bluealsa_config_init(void);
 void bluealsa_config_free(void);
 
+int bluealsa_hci_dev_index(int hci_dev_id);
+
 #endif
@@ -10,8 +10,16 @@
 
 #include "bluealsa.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/param.h>
 #include <sys/eventfd.h>
 
 #include "../shared/ctl-client.h"
@@ -31,17 +39,42 @@
 
 #define LIBNAME	"bluezalsa-lib"
 
+/* The library operates on S16_LE samples and at most two channels. */
+#define MAX_FRAME_SIZE	(2 * sizeof(int16_t))
+
+struct bluezalsa_ring {
+	char * data;
+	size_t size;	/* in bytes */
+	size_t head;	/* read position */
+	size_t len;		/* bytes stored in the ring */
+};
+
 struct bluezalsa_handle {
 	int ba_fd;	/* one per interface */
 	int event_fd; /* interface events */
 	int snd_fd; /* ports the sound */
 	int client_event_fd; /* to notify client that snd_fd has changed */
+	int poll_fd; /* epoll instance exported to the client */
 	char * interface;
 	bdaddr_t * addr;
 	bluezalsa_type type;
+	snd_pcm_stream_t stream;
+	bool nonblock;
+	size_t frame_size; /* of the attached transport */
 	struct ba_msg_transport transport;
 	pthread_t monitor;
 	pthread_mutex_t transport_mutex;
+
+	/* streaming mode */
+	bool streaming;
+	pthread_t streamer;
+	bluezalsa_stream_callback callback;
+	void * userdata;
+	struct bluezalsa_ring ring;
+	size_t ring_threshold; /* in bytes */
+	pthread_mutex_t ring_mutex;
+	pthread_cond_t ring_cond;
+	int ring_event_fd; /* to notify client that the ring needs a dispatch */
 };
 
 
@@ -66,23 +99,50 @@ static void delete_handle(bluezalsa_handle_t * h) {
 
 	pthread_mutex_lock(&h->transport_mutex);
 
-	if (h->ba_fd)
+	if (h->snd_fd != -1) {
+		bluealsa_close_transport(h->ba_fd, &h->transport);
+		close(h->snd_fd);
+	}
+	if (h->ba_fd != -1)
 		close(h->ba_fd);
-	if (h->event_fd)
+	if (h->event_fd != -1)
 		close(h->event_fd);
-	if (h->client_event_fd)
+	if (h->client_event_fd != -1)
 		close(h->client_event_fd);
+	if (h->ring_event_fd != -1)
+		close(h->ring_event_fd);
+	if (h->poll_fd != -1)
+		close(h->poll_fd);
 
 	free(h->addr);
 
 	pthread_mutex_unlock(&h->transport_mutex);
 
+	pthread_mutex_destroy(&h->transport_mutex);
+	pthread_mutex_destroy(&h->ring_mutex);
+	pthread_cond_destroy(&h->ring_cond);
+
+	free(h->ring.data);
 	free(h->interface);
 	free(h);
 done:
 	return;
 }
 
+static int poll_fd_add(bluezalsa_handle_t * h, int fd, uint32_t events) {
+	struct epoll_event event = { .events = events, .data.fd = fd };
+	return epoll_ctl(h->poll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static int poll_fd_del(bluezalsa_handle_t * h, int fd) {
+	return epoll_ctl(h->poll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void client_event_clear(bluezalsa_handle_t * h) {
+	eventfd_t u;
+	eventfd_read(h->client_event_fd, &u);
+}
+
 static int device_detach(bluezalsa_handle_t * h) {
 	int ret = -1;
 	char addr[32];
@@ -106,8 +166,14 @@ static int device_detach(bluezalsa_handle_t * h) {
 
 	bluealsa_close_transport(h->ba_fd, &h->transport);
 
+	if (!h->streaming)
+		poll_fd_del(h, h->snd_fd);
 	close(h->snd_fd);
 	h->snd_fd = -1;
+	h->frame_size = 0;
+
+	/* wake up the client (or the streaming thread) */
+	eventfd_write(h->client_event_fd, 1);
 
 done:
 	ret = 0;
@@ -143,6 +209,8 @@ static int update_device_attach_state(bluezalsa_handle_t * h) {
 		goto failed_locked;
 	}
 
+	const enum ba_pcm_stream stream = h->stream == SND_PCM_STREAM_PLAYBACK ?
+		BA_PCM_STREAM_PLAYBACK : BA_PCM_STREAM_CAPTURE;
 	int nb_transports = ret;
 	bool matched = false;
 	int idx;
@@ -167,12 +235,12 @@ static int update_device_attach_state(bluezalsa_handle_t * h) {
 		if (transport->type != h->type) {
 			continue;
 		}
-		if (transport->stream != BA_PCM_STREAM_CAPTURE &&
+		if (transport->stream != stream &&
 			transport->stream != BA_PCM_STREAM_DUPLEX) {
 			continue;
 		}
 
-		if (bacmp(h->addr, &transports->addr) == 0) {
+		if (bacmp(h->addr, &transport->addr) == 0) {
 			debug("Match !\n");
 			matched = true;
 			break;
@@ -195,17 +263,33 @@ static int update_device_attach_state(bluezalsa_handle_t * h) {
 
 	struct ba_msg_transport * transport = &transports[idx];
 
-	transport->stream = BA_PCM_STREAM_CAPTURE;
+	transport->stream = stream;
+	transport->format = BA_PCM_FORMAT_S16_LE;
 	if ((h->snd_fd = bluealsa_open_transport(h->ba_fd, transport)) == -1) {
 		error("Couldn't open PCM FIFO: %s\n", strerror(errno));
-		goto failed;
+		ret = -1;
+		goto failed_locked;
 	}
 
+	/* Both, the transfer() and the stream worker, poll the FIFO before every
+	 * I/O, so it is safe to keep it non-blocking regardless of the handle
+	 * mode. Otherwise a short FIFO space would block a non-blocking client
+	 * in the write() for the whole remaining length. */
+	if (fcntl(h->snd_fd, F_SETFL, fcntl(h->snd_fd, F_GETFL) | O_NONBLOCK) == -1)
+		error("Couldn't set PCM FIFO non-blocking: %s\n", strerror(errno));
+
+	if (stream == BA_PCM_STREAM_PLAYBACK &&
+			bluealsa_pause_transport(h->ba_fd, transport, false) == -1)
+		error("Couldn't start PCM: %s\n", strerror(errno));
+
 	memcpy(&h->transport, transport, sizeof(struct ba_msg_transport));
 	bacpy(&h->transport.addr, h->addr);
+	h->frame_size = transport->channels * sizeof(int16_t);
+
+	if (!h->streaming)
+		poll_fd_add(h, h->snd_fd, h->stream == SND_PCM_STREAM_PLAYBACK ? EPOLLOUT : EPOLLIN);
 
-	uint64_t u;
-	write(h->client_event_fd, &u, sizeof(u));
+	eventfd_write(h->client_event_fd, 1);
 
 done:
 	ret = 0;
@@ -248,6 +332,11 @@ failed:
 
 
 bluezalsa_handle_t  * bluezalsa_open(const char * interface) {
+	return bluezalsa_open_stream(interface, SND_PCM_STREAM_CAPTURE, 0);
+}
+
+bluezalsa_handle_t  * bluezalsa_open_stream(const char * interface,
+		snd_pcm_stream_t stream, int mode) {
 	bluezalsa_handle_t * h =  NULL;
 	int ret;
 
@@ -258,23 +347,42 @@ bluezalsa_handle_t  * bluezalsa_open(const char * interface) {
 	 }
 
 	 memset(h, 0, sizeof(bluezalsa_handle_t));
+	 h->ba_fd = -1;
+	 h->event_fd = -1;
 	 h->snd_fd = -1;
+	 h->client_event_fd = -1;
+	 h->ring_event_fd = -1;
+	 h->poll_fd = -1;
+	 h->stream = stream;
+	 h->nonblock = mode & SND_PCM_NONBLOCK;
+
+	 pthread_mutex_init(&h->ring_mutex, NULL);
+	 pthread_cond_init(&h->ring_cond, NULL);
 
 	 pthread_mutexattr_t attr;
 	 pthread_mutexattr_init(&attr);
 	 pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
 
 	 if (pthread_mutex_init(&h->transport_mutex, &attr) != 0) {
-		 error("%s: unable to create the transport mutex");
+		 error("%s: unable to create the transport mutex", __func__);
 		 goto failed;
 	 }
 
-	 h->client_event_fd = eventfd(0, EFD_NONBLOCK);
-	 if (h->client_event_fd == -1) {
+	 h->client_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	 h->ring_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	 if (h->client_event_fd == -1 || h->ring_event_fd == -1) {
 		 error("Unable to open event fd for client\n");
 		 goto failed;
 	 }
 
+	 /* The client is notified about the device attachment as well, so it
+	  * can wait for the device in the non-blocking mode. */
+	 if ((h->poll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+			 poll_fd_add(h, h->client_event_fd, EPOLLIN) == -1) {
+		 error("Unable to create poll fd for client: %s\n", strerror(errno));
+		 goto failed;
+	 }
+
 	 if ((h->ba_fd    = bluealsa_open(interface)) == -1 ||
 		 (h->event_fd = bluealsa_open(interface)) == -1) {
 		 log("%s,%s: No such interface '%s'\n", LIBNAME, __func__, interface);
@@ -313,6 +421,7 @@ void bluezalsa_close(bluezalsa_handle_t* h) {
 		error("%s: bad handle\n", __func__);
 		goto failed;
 	}
+	bluezalsa_stop_stream(h);
 	pthread_cancel(h->monitor);
 	pthread_join(h->monitor, NULL);
 
@@ -340,10 +449,9 @@ int	bluezalsa_set_device(bluezalsa_handle_t * h, const char * addr, bluezalsa_ty
 		goto new_adress;
 	}
 
+	device_detach(h);
 	free(h->addr);
 	h->addr = NULL;
-	bluealsa_close_transport(h->ba_fd, &h->transport);
-	h->snd_fd = -1;
 
 new_adress:
 	if (addr == NULL)
@@ -381,76 +489,442 @@ failed:
 }
 
 
-/* This function is a blocking call, unless there is a connected device sending data */
+int bluezalsa_nonblock(bluezalsa_handle_t * h, int nonblock) {
+	if (!h)
+		return -EINVAL;
+	h->nonblock = nonblock;
+	return 0;
+}
 
-snd_pcm_sframes_t 	bluezalsa_readi (bluezalsa_handle_t * h, void *buffer, snd_pcm_uframes_t size) {
-	snd_pcm_sframes_t ret = 0;
-	int timeout = -1;
-	int res;
+int bluezalsa_get_params(bluezalsa_handle_t * h, unsigned int *channels, unsigned int *rate) {
+	int ret = -ENODEV;
 
-	if (!h) {
-		log("%s: bad handle\n", __func__);
-		goto failed;
+	if (!h)
+		return -EINVAL;
+
+	pthread_mutex_lock(&h->transport_mutex);
+	if (h->snd_fd != -1) {
+		*channels = h->transport.channels;
+		*rate = h->transport.sampling;
+		ret = 0;
 	}
+	pthread_mutex_unlock(&h->transport_mutex);
 
-	struct pollfd pfds[] = {
-		{ h->snd_fd, POLLIN, 0},
-		{ h->client_event_fd, POLLIN, 0}
-	};
+	return ret;
+}
 
-again:
+int bluezalsa_get_poll_fd(bluezalsa_handle_t * h) {
+	if (!h)
+		return -EINVAL;
+	return h->poll_fd;
+}
 
-	pfds[0].fd = h->snd_fd;
-	res = poll(pfds, ARRAYSIZE(pfds), timeout);
+/**
+ * Write data to the PCM FIFO without raising SIGPIPE, which would terminate
+ * the client application, when the server closes the reading end. */
+static ssize_t write_nosigpipe(int fd, const void *buffer, size_t len) {
 
-	if (res == -1) {
-		log("%s: poll failed (%s)\n", __func__, strerror(errno));
-		goto failed;
+	sigset_t sigset, oldset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+
+	ssize_t ret = write(fd, buffer, len);
+
+	if (ret == -1 && errno == EPIPE) {
+		/* consume pending signal generated by our write */
+		const struct timespec timeout = { 0 };
+		sigtimedwait(&sigset, NULL, &timeout);
+		errno = EPIPE;
 	}
 
-	if (res == 0) {
-		/* timeout. cannot happen */
-		goto again;
+	int err = errno;
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	errno = err;
+
+	return ret;
+}
+
+/**
+ * Wait for the device attachment.
+ *
+ * @return If the device is attached, this function returns its PCM FIFO
+ *   file descriptor. Otherwise, negative error code is returned. */
+static int wait_device(bluezalsa_handle_t * h, bool nonblock, size_t *frame_size) {
+
+	for (;;) {
+
+		pthread_mutex_lock(&h->transport_mutex);
+		int fd = h->snd_fd;
+		*frame_size = h->frame_size;
+		pthread_mutex_unlock(&h->transport_mutex);
+
+		if (fd != -1)
+			return fd;
+		if (nonblock)
+			return -EAGAIN;
+
+		struct pollfd pfds[] = {{ h->client_event_fd, POLLIN, 0 }};
+		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1 && errno != EINTR)
+			return -errno;
+		client_event_clear(h);
+
 	}
 
-	if (pfds[0].revents & POLLHUP) {
-		device_detach(h);
-		goto again;
+}
+
+/**
+ * Transfer interleaved frames between the client buffer and the PCM FIFO.
+ *
+ * @return The number of transfered frames, or negative error code. */
+static snd_pcm_sframes_t transfer(bluezalsa_handle_t * h, char *buffer,
+		snd_pcm_uframes_t size, snd_pcm_stream_t stream) {
+
+	const bool capture = stream == SND_PCM_STREAM_CAPTURE;
+	size_t frame_size;
+	size_t done = 0;
+	int fd;
+
+	if (!h) {
+		log("%s: bad handle\n", __func__);
+		return -EINVAL;
 	}
+	if (h->stream != stream)
+		return -EBADFD;
+	if (h->streaming)
+		return -EBUSY;
 
-	/* Check if there has been a sound fd change */
-	if (pfds[1].revents & POLLIN) {
-		uint64_t u;
+	/* drain device change notification */
+	client_event_clear(h);
 
-		while ((ret = read(h->client_event_fd, &u, sizeof(uint64_t))) == -1 &&
-				errno == EINTR)
+	if ((fd = wait_device(h, h->nonblock, &frame_size)) < 0)
+		return fd;
+
+	const size_t len = size * frame_size;
+
+	while (done < len) {
+
+		/* In the non-blocking mode we will wait only for the rest of
+		 * the partially transfered frame. */
+		const int timeout = h->nonblock && done % frame_size == 0 ? 0 : -1;
+
+		struct pollfd pfds[] = {
+			{ fd, capture ? POLLIN : POLLOUT, 0 },
+			{ h->client_event_fd, POLLIN, 0 },
+		};
+
+		int res;
+		if ((res = poll(pfds, ARRAYSIZE(pfds), timeout)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log("%s: poll failed (%s)\n", __func__, strerror(errno));
+			return done >= frame_size ? (snd_pcm_sframes_t)(done / frame_size) : -errno;
+		}
+
+		if (res == 0)
+			/* nothing can be transfered right now */
+			break;
+
+		/* the device might have been detached or changed */
+		if (pfds[1].revents & POLLIN) {
+			client_event_clear(h);
+			pthread_mutex_lock(&h->transport_mutex);
+			bool changed = h->snd_fd != fd;
+			pthread_mutex_unlock(&h->transport_mutex);
+			if (changed)
+				goto disconnected;
+		}
+
+		if (!(pfds[0].revents & (POLLIN | POLLOUT))) {
+			if (pfds[0].revents & (POLLERR | POLLHUP))
+				goto disconnected;
 			continue;
-		if (ret != sizeof(u)) {
-			error("Couldn't read event: %s", strerror(ret == -1 ? errno : EBADMSG));
+		}
+
+		ssize_t ret;
+		if (capture)
+			ret = read(fd, buffer + done, len - done);
+		else
+			ret = write_nosigpipe(fd, buffer + done, len - done);
+
+		if (ret == -1) {
+			/* In the non-blocking mode the poll() with zero timeout will
+			 * end the transfer with a partial count or -EAGAIN. */
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			if (errno == EPIPE)
+				goto disconnected;
+			error("PCM FIFO %s error: %s\n", capture ? "read" : "write", strerror(errno));
+			return done >= frame_size ? (snd_pcm_sframes_t)(done / frame_size) : -errno;
+		}
+
+		if (ret == 0)
+			goto disconnected;
+
+		done += ret;
+	}
+
+	if (done == 0)
+		return -EAGAIN;
+	return done / frame_size;
+
+disconnected:
+	/* An error on fd here is likely due to a broken transport. The monitor
+	 * will attach the device again, once it is available. */
+	pthread_mutex_lock(&h->transport_mutex);
+	if (h->snd_fd == fd)
+		device_detach(h);
+	pthread_mutex_unlock(&h->transport_mutex);
+	if (done >= frame_size)
+		return done / frame_size;
+	return -ENODEV;
+}
+
+snd_pcm_sframes_t 	bluezalsa_readi (bluezalsa_handle_t * h, void *buffer, snd_pcm_uframes_t size) {
+	return transfer(h, buffer, size, SND_PCM_STREAM_CAPTURE);
+}
+
+snd_pcm_sframes_t 	bluezalsa_writei (bluezalsa_handle_t *h, const void *buffer, snd_pcm_uframes_t size) {
+	return transfer(h, (char *)buffer, size, SND_PCM_STREAM_PLAYBACK);
+}
+
+int bluezalsa_drain(bluezalsa_handle_t * h) {
+	int ret = 0;
+
+	if (!h)
+		return -EINVAL;
+
+	pthread_mutex_lock(&h->transport_mutex);
+	if (h->snd_fd != -1 && h->stream == SND_PCM_STREAM_PLAYBACK &&
+			bluealsa_drain_transport(h->ba_fd, &h->transport) == -1)
+		ret = -errno;
+	pthread_mutex_unlock(&h->transport_mutex);
+
+	return ret;
+}
+
+/**
+ * Check whether the ring buffer requires the client dispatch. This function
+ * shall be called with the ring lock held. */
+static bool ring_needs_dispatch(bluezalsa_handle_t * h) {
+	if (h->stream == SND_PCM_STREAM_CAPTURE)
+		return h->ring.len >= h->ring_threshold;
+	return h->ring.size - h->ring.len >= h->ring_threshold;
+}
+
+static void * stream_worker_routine(void *arg) {
+	bluezalsa_handle_t * h = (bluezalsa_handle_t*) arg;
+	const bool capture = h->stream == SND_PCM_STREAM_CAPTURE;
+
+	/* The FIFO is written from this thread only, so it is safe to block the
+	 * SIGPIPE signal here, instead of blocking it for every write. */
+	sigset_t sigset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	for (;;) {
+
+		size_t frame_size;
+		int fd;
+
+		if ((fd = wait_device(h, false, &frame_size)) < 0)
 			goto failed;
+
+		/* Wait for the free space (capture) or data (playback) in the ring
+		 * buffer. The client accesses the ring in whole frames, however this
+		 * thread transfers bytes as they come. */
+		pthread_mutex_lock(&h->ring_mutex);
+		pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &h->ring_mutex);
+		while (capture ? h->ring.len == h->ring.size : h->ring.len == 0)
+			pthread_cond_wait(&h->ring_cond, &h->ring_mutex);
+		pthread_cleanup_pop(1);
+
+		/* Only this thread moves the tail (capture) or the head (playback)
+		 * of the ring, so the data can be accessed without the lock. */
+		const size_t tail = (h->ring.head + h->ring.len) % h->ring.size;
+		char *ptr = h->ring.data + (capture ? tail : h->ring.head);
+		size_t len = capture ?
+			MIN(h->ring.size - h->ring.len, h->ring.size - tail) :
+			MIN(h->ring.len, h->ring.size - h->ring.head);
+
+		ssize_t ret;
+		if (capture)
+			ret = read(fd, ptr, len);
+		else
+			ret = write(fd, ptr, len);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && errno == EAGAIN) {
+			/* Wait for the FIFO readiness, or for the device change, which
+			 * might have closed the fd we are waiting on. */
+			struct pollfd pfds[] = {
+				{ fd, capture ? POLLIN : POLLOUT, 0 },
+				{ h->client_event_fd, POLLIN, 0 },
+			};
+			if (poll(pfds, ARRAYSIZE(pfds), -1) == -1 && errno != EINTR) {
+				debug("PCM FIFO poll error: %s\n", strerror(errno));
+				goto failed;
+			}
+			if (pfds[1].revents & POLLIN)
+				client_event_clear(h);
+			continue;
+		}
+		if (ret <= 0) {
+			if (ret == -1)
+				debug("PCM FIFO error: %s\n", strerror(errno));
+			pthread_mutex_lock(&h->transport_mutex);
+			if (h->snd_fd == fd)
+				device_detach(h);
+			pthread_mutex_unlock(&h->transport_mutex);
+			continue;
 		}
+
+		pthread_mutex_lock(&h->ring_mutex);
+		if (capture)
+			h->ring.len += ret;
+		else {
+			h->ring.head = (h->ring.head + ret) % h->ring.size;
+			h->ring.len -= ret;
+		}
+		bool dispatch = ring_needs_dispatch(h);
+		pthread_mutex_unlock(&h->ring_mutex);
+
+		if (dispatch)
+			eventfd_write(h->ring_event_fd, 1);
+
 	}
 
-	if (!(pfds[0].revents & POLLIN)) {
-		debug("%s: nothing to read\n", __func__);
-		goto again;
+failed:
+	return NULL;
+}
+
+int bluezalsa_start_stream(bluezalsa_handle_t * h, snd_pcm_uframes_t buffer_size,
+		bluezalsa_stream_callback callback, void *userdata) {
+	int ret;
+
+	if (!h || !callback || buffer_size == 0)
+		return -EINVAL;
+	if (h->streaming)
+		return -EBUSY;
+
+	if ((h->ring.data = malloc(buffer_size * MAX_FRAME_SIZE)) == NULL)
+		return -ENOMEM;
+
+	h->ring.size = buffer_size * MAX_FRAME_SIZE;
+	h->ring.head = 0;
+	h->ring.len = 0;
+	/* notify the client when a quarter of the ring is ready */
+	h->ring_threshold = MAX(h->ring.size / 4, MAX_FRAME_SIZE);
+	h->callback = callback;
+	h->userdata = userdata;
+
+	/* From now on, the client shall poll for the ring events only. */
+	pthread_mutex_lock(&h->transport_mutex);
+	h->streaming = true;
+	if (h->snd_fd != -1)
+		poll_fd_del(h, h->snd_fd);
+	poll_fd_del(h, h->client_event_fd);
+	poll_fd_add(h, h->ring_event_fd, EPOLLIN);
+	pthread_mutex_unlock(&h->transport_mutex);
+
+	/* playback ring is empty - ask the client for data right away */
+	if (h->stream == SND_PCM_STREAM_PLAYBACK)
+		eventfd_write(h->ring_event_fd, 1);
+
+	if ((ret = pthread_create(&h->streamer, NULL, stream_worker_routine, h)) != 0) {
+		error("%s: unable to create streaming thread: %s\n", __func__, strerror(ret));
+		h->streaming = false;
+		bluezalsa_stop_stream(h);
+		return -ret;
 	}
 
-	if ((res = read(h->snd_fd, buffer, size * sizeof(int16_t))) == -1) {
-		error("PCM FIFO read error: %s\n", strerror(errno));
-		/* An error on fd here is likely due to a broken transport.
-		 * To poll again, without returning, in this way the caller will not
-		 * be aware of that */
+	return 0;
+}
+
+int bluezalsa_stop_stream(bluezalsa_handle_t * h) {
+
+	if (!h)
+		return -EINVAL;
+	if (!h->streaming && h->ring.data == NULL)
+		return 0;
 
-		goto again;
+	if (h->streaming) {
+		pthread_cancel(h->streamer);
+		pthread_join(h->streamer, NULL);
 	}
-	ret = res;
-failed:
-	return ret;
+
+	pthread_mutex_lock(&h->transport_mutex);
+	h->streaming = false;
+	poll_fd_del(h, h->ring_event_fd);
+	poll_fd_add(h, h->client_event_fd, EPOLLIN);
+	if (h->snd_fd != -1)
+		poll_fd_add(h, h->snd_fd, h->stream == SND_PCM_STREAM_PLAYBACK ? EPOLLOUT : EPOLLIN);
+	pthread_mutex_unlock(&h->transport_mutex);
+
+	eventfd_t u;
+	eventfd_read(h->ring_event_fd, &u);
+
+	free(h->ring.data);
+	h->ring.data = NULL;
+	h->ring.size = 0;
+
+	return 0;
 }
 
-snd_pcm_sframes_t 	bluezalsa_writei (bluezalsa_handle_t *h, const void *buffer, snd_pcm_uframes_t size) {
-	snd_pcm_sframes_t ret = 0;
-	/* TODO */
-	return ret;
+int bluezalsa_dispatch(bluezalsa_handle_t * h) {
+
+	if (!h)
+		return -EINVAL;
+	if (!h->streaming)
+		return -EBADFD;
+
+	const bool capture = h->stream == SND_PCM_STREAM_CAPTURE;
+	eventfd_t u;
+
+	eventfd_read(h->ring_event_fd, &u);
+
+	pthread_mutex_lock(&h->transport_mutex);
+	size_t frame_size = h->frame_size;
+	pthread_mutex_unlock(&h->transport_mutex);
+
+	/* without the device, the frame size is not known */
+	if (frame_size == 0)
+		frame_size = MAX_FRAME_SIZE;
+
+	for (;;) {
+
+		pthread_mutex_lock(&h->ring_mutex);
+		const size_t tail = (h->ring.head + h->ring.len) % h->ring.size;
+		char *ptr = h->ring.data + (capture ? h->ring.head : tail);
+		size_t len = capture ?
+			MIN(h->ring.len, h->ring.size - h->ring.head) :
+			MIN(h->ring.size - h->ring.len, h->ring.size - tail);
+		pthread_mutex_unlock(&h->ring_mutex);
+
+		snd_pcm_uframes_t frames;
+		if ((frames = len / frame_size) == 0)
+			break;
+
+		/* Only this function moves the head (capture) or the tail (playback)
+		 * of the ring, so the callback can be called without the lock. */
+		if ((frames = h->callback(h, ptr, frames, h->userdata)) == 0)
+			break;
+
+		len = frames * frame_size;
+
+		pthread_mutex_lock(&h->ring_mutex);
+		if (capture) {
+			h->ring.head = (h->ring.head + len) % h->ring.size;
+			h->ring.len -= len;
+		}
+		else
+			h->ring.len += len;
+		pthread_cond_signal(&h->ring_cond);
+		pthread_mutex_unlock(&h->ring_mutex);
+
+	}
+
+	return 0;
 }
@@ -22,10 +22,47 @@ typedef enum {
 	BA_SCO
 } bluezalsa_type;
 
+/* Streaming mode callback. For the capture stream, the callback shall consume
+ * up to the given number of frames from the buffer. For the playback stream,
+ * the callback shall store up to the given number of frames in the buffer.
+ * The callback returns the number of processed frames. */
+typedef snd_pcm_uframes_t (*bluezalsa_stream_callback)(bluezalsa_handle_t *h,
+		void *buffer, snd_pcm_uframes_t frames, void *userdata);
+
+/* Open the capture stream in the blocking mode. */
 extern bluezalsa_handle_t  * bluezalsa_open(const char * interface);
+/* Open the given stream. The SND_PCM_NONBLOCK mode is supported. */
+extern bluezalsa_handle_t  * bluezalsa_open_stream(const char * interface,
+		snd_pcm_stream_t stream, int mode);
 extern void 				 bluezalsa_close(bluezalsa_handle_t* h);
 
 extern int					bluezalsa_set_device(bluezalsa_handle_t * h, const char * addr, bluezalsa_type t);
+extern int					bluezalsa_nonblock(bluezalsa_handle_t * h, int nonblock);
+
+/* Get the number of channels and the sampling rate of the attached device.
+ * If there is no attached device, -ENODEV is returned. */
+extern int					bluezalsa_get_params(bluezalsa_handle_t * h,
+		unsigned int *channels, unsigned int *rate);
 
+/* Get the file descriptor which can be used in the poll(), select() or epoll
+ * based event loop. It will not change during the lifetime of the handle.
+ * Upon the POLLIN event, the client shall call readi/writei (or dispatch in
+ * the streaming mode) in the non-blocking mode. */
+extern int					bluezalsa_get_poll_fd(bluezalsa_handle_t * h);
+
+/* Read and write interleaved S16_LE frames. In the blocking mode, these
+ * functions wait until all frames are transfered. In the non-blocking mode,
+ * -EAGAIN is returned if no frame can be transfered right away. If the
+ * device has been disconnected, -ENODEV is returned. */
 extern snd_pcm_sframes_t 	bluezalsa_readi (bluezalsa_handle_t * h, void *buffer, snd_pcm_uframes_t size);
 extern snd_pcm_sframes_t 	bluezalsa_writei (bluezalsa_handle_t *h, const void *buffer, snd_pcm_uframes_t size);
+extern int					bluezalsa_drain(bluezalsa_handle_t * h);
+
+/* Streaming mode - the data is transfered by the internal thread using the
+ * ring buffer of the given size (in frames), and the callback is invoked by
+ * the bluezalsa_dispatch() function, which shall be called upon every event
+ * on the poll file descriptor. */
+extern int					bluezalsa_start_stream(bluezalsa_handle_t * h, snd_pcm_uframes_t buffer_size,
+		bluezalsa_stream_callback callback, void *userdata);
+extern int					bluezalsa_stop_stream(bluezalsa_handle_t * h);
+extern int					bluezalsa_dispatch(bluezalsa_handle_t * h);
@@ -12,11 +12,13 @@
 #include <getopt.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 static unsigned int verbose = 0;
 
 static const char *ba_interface = "hci0";
 static bluezalsa_type ba_type = BA_A2DP;
+static snd_pcm_stream_t ba_stream = SND_PCM_STREAM_CAPTURE;
 static bool terminate = false;
 
 static void sig_handle(int sig) {
@@ -25,11 +27,12 @@ static void sig_handle(int sig) {
 
 int main(int argc,char * argv[]) {
 	int opt;
-	const char *opts = "hvi:";
+	const char *opts = "hvi:p";
 	const struct option longopts[] = {
 		{ "help", no_argument, NULL, 'h' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "hci", required_argument, NULL, 'i' },
+		{ "playback", no_argument, NULL, 'p' },
 		{ "profile-a2dp", no_argument, NULL, 1 },
 		{ "profile-sco", no_argument, NULL, 2 },
 		{ 0, 0, 0, 0 },
@@ -48,6 +51,7 @@ usage:
 					"  -h, --help\t\tprint this help and exit\n"
 					"  -v, --verbose\t\tmake output more verbose\n"
 					"  -i, --hci=hciX\tHCI device to use\n"
+					"  -p, --playback\tplay S16_LE audio from the standard input\n"
 					"  --profile-a2dp\tuse A2DP profile\n"
 					"  --profile-sco\t\tuse SCO profile\n"
 					"\nNote:\n"
@@ -65,6 +69,9 @@ usage:
 		case 'i' /* --hci */ :
 			ba_interface = optarg;
 			break;
+		case 'p' /* --playback */ :
+			ba_stream = SND_PCM_STREAM_PLAYBACK;
+			break;
 
 		case 1 /* --profile-a2dp */ :
 			ba_type = BA_A2DP;
@@ -90,29 +97,41 @@ usage:
 
 	printf("Opening bluetooth interface...\n");
 
-	bluezalsa_handle_t * h = bluezalsa_open(ba_interface);
+	bluezalsa_handle_t * h = bluezalsa_open_stream(ba_interface, ba_stream, 0);
 	if (h == NULL) {
 		printf("Failed to open '%s' interface\n", ba_interface);
 		goto failed;
 	}
 
-	bluezalsa_set_device(h, argv[optind], BA_A2DP);
+	bluezalsa_set_device(h, argv[optind], ba_type);
 
-	size_t frame_size = 2*16;
-	size_t buffsize=1024*frame_size;
+	const size_t frame_size = 2 * sizeof(int16_t);
+	const snd_pcm_uframes_t buffer_frames = 1024;
 
 	int cpt = 0;
 
 	for (;;) {
-		char buff[buffsize];
+		char buff[buffer_frames * frame_size];
 		snd_pcm_sframes_t frames;
 		if (terminate)
 			break;
 
-		frames = bluezalsa_readi(h, buff, buffsize);
-		printf("Main Read %d: %llu frames\n", cpt++, frames);
+		if (ba_stream == SND_PCM_STREAM_PLAYBACK) {
+			ssize_t len;
+			if ((len = read(STDIN_FILENO, buff, sizeof(buff))) <= 0)
+				break;
+			frames = bluezalsa_writei(h, buff, len / frame_size);
+			printf("Main Write %d: %ld frames\n", cpt++, (long)frames);
+		}
+		else {
+			frames = bluezalsa_readi(h, buff, buffer_frames);
+			printf("Main Read %d: %ld frames\n", cpt++, (long)frames);
+		}
 	}
 
+	if (ba_stream == SND_PCM_STREAM_PLAYBACK)
+		bluezalsa_drain(h);
+
 	printf("Closing bluetooth interface...\n");
 	bluezalsa_close(h);
 
@@ -180,6 +180,31 @@ static const struct bluez_a2dp_sampling_freq a2dp_aptx_samplings[] = {
 	{ 48000, APTX_SAMPLING_FREQ_48000 },
 };
 
+static const a2dp_aptx_hd_t a2dp_aptx_hd = {
+	.info.vendor_id = APTX_HD_VENDOR_ID,
+	.info.codec_id = APTX_HD_CODEC_ID,
+	.channel_mode =
+		/* NOTE: Used apt-X HD library does not support
+		 *       single channel (mono) mode. */
+		APTX_HD_CHANNEL_MODE_STEREO,
+	.frequency =
+		APTX_HD_SAMPLING_FREQ_16000 |
+		APTX_HD_SAMPLING_FREQ_32000 |
+		APTX_HD_SAMPLING_FREQ_44100 |
+		APTX_HD_SAMPLING_FREQ_48000,
+};
+
+static const struct bluez_a2dp_channel_mode a2dp_aptx_hd_channels[] = {
+	{ BLUEZ_A2DP_CHM_STEREO, APTX_HD_CHANNEL_MODE_STEREO },
+};
+
+static const struct bluez_a2dp_sampling_freq a2dp_aptx_hd_samplings[] = {
+	{ 16000, APTX_HD_SAMPLING_FREQ_16000 },
+	{ 32000, APTX_HD_SAMPLING_FREQ_32000 },
+	{ 44100, APTX_HD_SAMPLING_FREQ_44100 },
+	{ 48000, APTX_HD_SAMPLING_FREQ_48000 },
+};
+
 static const a2dp_ldac_t a2dp_ldac = {
 	.info.vendor_id = LDAC_VENDOR_ID,
 	.info.codec_id = LDAC_CODEC_ID,
@@ -297,6 +322,17 @@ static const struct bluez_a2dp_codec a2dp_codec_sink_aptx = {
 	.samplings_size = ARRAYSIZE(a2dp_aptx_samplings),
 };
 
+static const struct bluez_a2dp_codec a2dp_codec_source_aptx_hd = {
+	.dir = BLUEZ_A2DP_SOURCE,
+	.id = A2DP_CODEC_VENDOR_APTX_HD,
+	.cfg = &a2dp_aptx_hd,
+	.cfg_size = sizeof(a2dp_aptx_hd),
+	.channels = a2dp_aptx_hd_channels,
+	.channels_size = ARRAYSIZE(a2dp_aptx_hd_channels),
+	.samplings = a2dp_aptx_hd_samplings,
+	.samplings_size = ARRAYSIZE(a2dp_aptx_hd_samplings),
+};
+
 static const struct bluez_a2dp_codec a2dp_codec_source_ldac = {
 	.dir = BLUEZ_A2DP_SOURCE,
 	.id = A2DP_CODEC_VENDOR_LDAC,
@@ -323,6 +359,9 @@ static const struct bluez_a2dp_codec *a2dp_codecs[] = {
 #if ENABLE_LDAC
 	&a2dp_codec_source_ldac,
 #endif
+#if ENABLE_APTX_HD
+	&a2dp_codec_source_aptx_hd,
+#endif
 #if ENABLE_APTX
 	&a2dp_codec_source_aptx,
 #endif
@@ -331,8 +370,9 @@ static const struct bluez_a2dp_codec *a2dp_codecs[] = {
 	&a2dp_codec_sink_aac,
 #endif
 #if ENABLE_MPEG
+	/* There is no MPEG-1,2 audio decoder, so the source endpoint (which
+	 * serves the passthrough data) is the only one registered. */
 	&a2dp_codec_source_mpeg,
-	&a2dp_codec_sink_mpeg,
 #endif
 	&a2dp_codec_source_sbc,
 	&a2dp_codec_sink_sbc,
@@ -28,10 +28,11 @@
 
 
 /**
- * Get D-Bus object reference count for given profile. */
+ * Get D-Bus object reference count for given profile and HCI device. */
 static int bluez_get_dbus_object_count(
 		enum bluetooth_profile profile,
-		uint16_t codec) {
+		uint16_t codec,
+		int hci_dev_id) {
 
 	GHashTableIter iter;
 	struct ba_dbus_object *obj;
@@ -39,7 +40,8 @@ static int bluez_get_dbus_object_count(
 
 	g_hash_table_iter_init(&iter, config.dbus_objects);
 	while (g_hash_table_iter_next(&iter, NULL, (gpointer)&obj))
-		if (obj->profile == profile && obj->codec == codec && obj->connected)
+		if (obj->profile == profile && obj->codec == codec &&
+				obj->hci_dev_id == hci_dev_id && obj->connected)
 			count++;
 
 	return count;
@@ -277,6 +279,27 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 	}
 #endif
 
+#if ENABLE_APTX_HD
+	case A2DP_CODEC_VENDOR_APTX_HD: {
+
+		a2dp_aptx_hd_t *cap = (a2dp_aptx_hd_t *)capabilities;
+		unsigned int cap_chm = cap->channel_mode;
+		unsigned int cap_freq = cap->frequency;
+
+		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
+			error("No supported channel modes: %#x", cap_chm);
+			goto fail;
+		}
+
+		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) == 0) {
+			error("No supported sampling frequencies: %#x", cap_freq);
+			goto fail;
+		}
+
+		break;
+	}
+#endif
+
 #if ENABLE_LDAC
 	case A2DP_CODEC_VENDOR_LDAC: {
 
@@ -325,6 +348,14 @@ final:
 	g_free(capabilities);
 }
 
+/**
+ * Report the result of the speculative transport acquisition. */
+static void bluez_endpoint_standby_complete(struct ba_transport *t, int ret, void *userdata) {
+	(void)userdata;
+	if (t != NULL && ret == -1)
+		warn("Couldn't acquire standby transport: %s", t->dbus_path);
+}
+
 static int bluez_endpoint_set_configuration(GDBusMethodInvocation *inv, void *userdata) {
 
 	const gchar *sender = g_dbus_method_invocation_get_sender(inv);
@@ -472,6 +503,15 @@ static int bluez_endpoint_set_configuration(GDBusMethodInvocation *inv, void *us
 			}
 #endif
 
+#if ENABLE_APTX_HD
+			case A2DP_CODEC_VENDOR_APTX_HD: {
+				a2dp_aptx_hd_t *cap = (a2dp_aptx_hd_t *)capabilities;
+				cap_chm = cap->channel_mode;
+				cap_freq = cap->frequency;
+				break;
+			}
+#endif
+
 #if ENABLE_LDAC
 			case A2DP_CODEC_VENDOR_LDAC: {
 				a2dp_ldac_t *cap = (a2dp_ldac_t *)capabilities;
@@ -567,6 +607,17 @@ static int bluez_endpoint_set_configuration(GDBusMethodInvocation *inv, void *us
 	transport_set_state_from_string(t, state);
 
 	g_dbus_method_invocation_return_value(inv, NULL);
+
+	/* In the always-acquired standby mode, the source transport is acquired
+	 * right away, so the PCM open will not have to wait for the headset. */
+	if (t->profile == BLUETOOTH_PROFILE_A2DP_SOURCE &&
+			config.a2dp.standby == BA_A2DP_STANDBY_ALWAYS) {
+		pthread_mutex_lock(&t->mutex);
+		if (transport_acquire_bt_a2dp_async(t, bluez_endpoint_standby_complete, NULL) == -1)
+			error("Couldn't acquire transport: %s", strerror(errno));
+		pthread_mutex_unlock(&t->mutex);
+	}
+
 	goto final;
 
 fail:
@@ -638,7 +689,8 @@ static void bluez_endpoint_method_call(GDBusConnection *conn, const gchar *sende
 	else if (strcmp(method, "SetConfiguration") == 0) {
 		if (bluez_endpoint_set_configuration(invocation, userdata) == 0) {
 			obj->connected = true;
-			bluez_register_a2dp();
+			/* spare endpoint for the next connection with this adapter */
+			bluez_register_a2dp_hci(obj->hci_dev_id);
 		}
 	}
 	else if (strcmp(method, "ClearConfiguration") == 0) {
@@ -660,21 +712,97 @@ static const GDBusInterfaceVTable endpoint_vtable = {
 	.method_call = bluez_endpoint_method_call,
 };
 
+/* Data of the pending D-Bus object registration call. */
+struct bluez_register_call {
+	const char *type;
+	gpointer hash;
+	guint id;
+	gchar *path;
+};
+
+/**
+ * Complete D-Bus object registration.
+ *
+ * Registration calls are sent without waiting for the reply, so all of
+ * them are processed by BlueZ in parallel. Upon failure, the D-Bus object
+ * is unregistered, unless it was released and registered again. */
+static void bluez_register_finish(GObject *source, GAsyncResult *result,
+		gpointer userdata) {
+
+	GDBusConnection *conn = G_DBUS_CONNECTION(source);
+	struct bluez_register_call *call = userdata;
+	struct ba_dbus_object *obj;
+	GDBusMessage *rep;
+	GError *err = NULL;
+
+	if ((rep = g_dbus_connection_send_message_with_reply_finish(conn,
+					result, &err)) != NULL &&
+			g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR)
+		g_dbus_message_to_gerror(rep, &err);
+
+	if (err != NULL) {
+		warn("Couldn't register %s: %s", call->type, err->message);
+		if ((obj = g_hash_table_lookup(config.dbus_objects, call->hash)) != NULL &&
+				obj->id == call->id) {
+			g_dbus_connection_unregister_object(conn, call->id);
+			g_hash_table_remove(config.dbus_objects, call->hash);
+		}
+		g_error_free(err);
+	}
+	else
+		debug("Registered %s: %s", call->type, call->path);
+
+	if (rep != NULL)
+		g_object_unref(rep);
+	g_free(call->path);
+	g_free(call);
+}
+
+/**
+ * Send D-Bus object registration call.
+ *
+ * The D-Bus object is added to the list of registered objects right away,
+ * so it will not be registered twice, while the call is pending. */
+static void bluez_register_send(GDBusConnection *conn, GDBusMessage *msg,
+		const char *type, const char *path, gpointer hash,
+		const struct ba_dbus_object *dbus_object) {
+
+	struct bluez_register_call *call = g_new0(struct bluez_register_call, 1);
+	call->type = type;
+	call->hash = hash;
+	call->id = dbus_object->id;
+	call->path = g_strdup(path);
+
+	g_hash_table_insert(config.dbus_objects, hash,
+			g_memdup(dbus_object, sizeof(*dbus_object)));
+
+	g_dbus_connection_send_message_with_reply(conn, msg,
+			G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL,
+			bluez_register_finish, call);
+
+}
+
 /**
  * Register A2DP endpoint.
  *
+ * Every HCI device has its own set of endpoints, so the endpoint release
+ * requested by one adapter does not affect the other ones.
+ *
+ * @param hci HCI device for which the endpoint shall be registered.
  * @param uuid
  * @param profile
  * @param codec
- * @return On success this function returns 0. Otherwise -1 is returned. */
+ * @return On success this function returns 0. Otherwise -1 is returned.
+ *   The result of the registration itself is reported asynchronously. */
 static int bluez_register_a2dp_endpoint(
+		const struct hci_dev_info *hci,
 		const char *uuid,
 		enum bluetooth_profile profile,
 		const struct bluez_a2dp_codec *codec) {
 
-	gchar *path = g_strdup_printf("%s/%d",
-		g_dbus_get_profile_object_path(profile, codec->id),
-		bluez_get_dbus_object_count(profile, codec->id) + 1);
+	gchar *path = g_strdup_printf("%s/%s/%d",
+		g_dbus_get_profile_object_path(profile, codec->id), hci->name,
+		bluez_get_dbus_object_count(profile, codec->id, hci->dev_id) + 1);
 	gpointer hash = GINT_TO_POINTER(g_str_hash(path));
 
 	if (g_hash_table_contains(config.dbus_objects, hash)) {
@@ -684,7 +812,7 @@ static int bluez_register_a2dp_endpoint(
 	}
 
 	GDBusConnection *conn = config.dbus;
-	GDBusMessage *msg = NULL, *rep = NULL;
+	GDBusMessage *msg = NULL;
 	GError *err = NULL;
 	gchar *dev = NULL;
 	int ret = 0;
@@ -693,6 +821,7 @@ static int bluez_register_a2dp_endpoint(
 	struct ba_dbus_object dbus_object = {
 		.profile = profile,
 		.codec = codec->id,
+		.hci_dev_id = hci->dev_id,
 	};
 
 	debug("Registering endpoint: %s", path);
@@ -701,7 +830,7 @@ static int bluez_register_a2dp_endpoint(
 					(void *)codec, endpoint_free, &err)) == 0)
 		goto fail;
 
-	dev = g_strdup_printf("/org/bluez/%s", config.hci_dev.name);
+	dev = g_strdup_printf("/org/bluez/%s", hci->name);
 	msg = g_dbus_message_new_method_call("org.bluez", dev,
 			"org.bluez.Media1", "RegisterEndpoint");
 
@@ -722,17 +851,7 @@ static int bluez_register_a2dp_endpoint(
 	g_dbus_message_set_body(msg, g_variant_new("(oa{sv})", path, &properties));
 	g_variant_builder_clear(&properties);
 
-	if ((rep = g_dbus_connection_send_message_with_reply_sync(conn, msg,
-					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
-		goto fail;
-
-	if (g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR) {
-		g_dbus_message_to_gerror(rep, &err);
-		goto fail;
-	}
-
-	g_hash_table_insert(config.dbus_objects, hash,
-			g_memdup(&dbus_object, sizeof(dbus_object)));
+	bluez_register_send(conn, msg, "endpoint", path, hash, &dbus_object);
 
 	goto final;
 
@@ -743,8 +862,6 @@ final:
 	g_free(path);
 	if (msg != NULL)
 		g_object_unref(msg);
-	if (rep != NULL)
-		g_object_unref(rep);
 	if (dev != NULL)
 		g_free(dev);
 	if (err != NULL) {
@@ -757,27 +874,49 @@ final:
 }
 
 /**
- * Register A2DP endpoints. */
-void bluez_register_a2dp(void) {
+ * Register A2DP endpoints for given HCI device.
+ *
+ * @param hci_dev_id The ID of the HCI device. If the device is not used,
+ *   this function does nothing. */
+void bluez_register_a2dp_hci(int hci_dev_id) {
 
-	const struct bluez_a2dp_codec **cc = config.a2dp.codecs;
+	const struct hci_dev_info *hci = NULL;
+	size_t i;
+
+	for (i = 0; i < config.hci_devs_len; i++)
+		if (config.hci_devs[i].dev_id == hci_dev_id) {
+			hci = &config.hci_devs[i];
+			break;
+		}
+
+	if (hci == NULL)
+		return;
 
+	const struct bluez_a2dp_codec **cc = config.a2dp.codecs;
 	while (*cc != NULL) {
 		const struct bluez_a2dp_codec *c = *cc++;
 		switch (c->dir) {
 		case BLUEZ_A2DP_SOURCE:
 			if (config.enable.a2dp_source)
-				bluez_register_a2dp_endpoint(BLUETOOTH_UUID_A2DP_SOURCE, BLUETOOTH_PROFILE_A2DP_SOURCE, c);
+				bluez_register_a2dp_endpoint(hci, BLUETOOTH_UUID_A2DP_SOURCE, BLUETOOTH_PROFILE_A2DP_SOURCE, c);
 			break;
 		case BLUEZ_A2DP_SINK:
 			if (config.enable.a2dp_sink)
-				bluez_register_a2dp_endpoint(BLUETOOTH_UUID_A2DP_SINK, BLUETOOTH_PROFILE_A2DP_SINK, c);
+				bluez_register_a2dp_endpoint(hci, BLUETOOTH_UUID_A2DP_SINK, BLUETOOTH_PROFILE_A2DP_SINK, c);
 			break;
 		}
 	}
 
 }
 
+/**
+ * Register A2DP endpoints for all used HCI devices. */
+void bluez_register_a2dp(void) {
+	size_t i;
+	for (i = 0; i < config.hci_devs_len; i++)
+		bluez_register_a2dp_hci(config.hci_devs[i].dev_id);
+}
+
 static void bluez_profile_new_connection(GDBusMethodInvocation *inv, void *userdata) {
 	(void)userdata;
 
@@ -907,7 +1046,8 @@ static const GDBusInterfaceVTable profile_vtable = {
  * @param profile
  * @param version
  * @param features
- * @return On success this function returns 0. Otherwise -1 is returned. */
+ * @return On success this function returns 0. Otherwise -1 is returned.
+ *   The result of the registration itself is reported asynchronously. */
 static int bluez_register_profile(
 		const char *uuid,
 		enum bluetooth_profile profile,
@@ -923,13 +1063,15 @@ static int bluez_register_profile(
 	}
 
 	GDBusConnection *conn = config.dbus;
-	GDBusMessage *msg = NULL, *rep = NULL;
+	GDBusMessage *msg = NULL;
 	GError *err = NULL;
 	int ret = 0;
 
 	struct ba_dbus_object dbus_object = {
 		.profile = profile,
 		.codec = 0,
+		/* profiles are shared by all adapters */
+		.hci_dev_id = -1,
 	};
 
 	debug("Registering profile: %s", path);
@@ -952,17 +1094,7 @@ static int bluez_register_profile(
 	g_dbus_message_set_body(msg, g_variant_new("(osa{sv})", path, uuid, &options));
 	g_variant_builder_clear(&options);
 
-	if ((rep = g_dbus_connection_send_message_with_reply_sync(conn, msg,
-					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
-		goto fail;
-
-	if (g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR) {
-		g_dbus_message_to_gerror(rep, &err);
-		goto fail;
-	}
-
-	g_hash_table_insert(config.dbus_objects, hash,
-			g_memdup(&dbus_object, sizeof(dbus_object)));
+	bluez_register_send(conn, msg, "profile", path, hash, &dbus_object);
 
 	goto final;
 
@@ -972,8 +1104,6 @@ fail:
 final:
 	if (msg != NULL)
 		g_object_unref(msg);
-	if (rep != NULL)
-		g_object_unref(rep);
 	if (err != NULL) {
 		warn("Couldn't register profile: %s", err->message);
 		g_dbus_connection_unregister_object(conn, dbus_object.id);
@@ -1012,19 +1142,22 @@ static void bluez_signal_interfaces_added(GDBusConnection *conn, const gchar *se
 	(void)signal;
 	(void)userdata;
 
-	char *device_path = g_strdup_printf("/org/bluez/%s", config.hci_dev.name);
 	GVariantIter *interfaces;
 	const char *object;
+	size_t i;
 
 	g_variant_get(params, "(&oa{sa{sv}})", &object, &interfaces);
 
-	if (strcmp(object, device_path) == 0)
-		bluez_register_a2dp();
+	for (i = 0; i < config.hci_devs_len; i++)
+		if (strncmp(object, "/org/bluez/", 11) == 0 &&
+				strcmp(object + 11, config.hci_devs[i].name) == 0) {
+			bluez_register_a2dp_hci(config.hci_devs[i].dev_id);
+			break;
+		}
 	if (strcmp(object, "/org/bluez") == 0)
 		bluez_register_hfp();
 
 	g_variant_iter_free(interfaces);
-	g_free(device_path);
 }
 
 static void bluez_signal_transport_changed(GDBusConnection *conn, const gchar *sender,
@@ -1077,6 +1210,7 @@ static void bluez_signal_transport_changed(GDBusConnection *conn, const gchar *s
 			}
 
 			t->a2dp.delay = g_variant_get_uint16(value);
+			bluealsa_ctl_event_transport(BA_EVENT_UPDATE_DELAY, t);
 
 		}
 		else if (strcmp(key, "Volume") == 0) {
@@ -1089,7 +1223,7 @@ static void bluez_signal_transport_changed(GDBusConnection *conn, const gchar *s
 
 			/* received volume is in range [0, 127]*/
 			t->a2dp.ch1_volume = t->a2dp.ch2_volume = g_variant_get_uint16(value);
-			bluealsa_ctl_event(BA_EVENT_UPDATE_VOLUME);
+			bluealsa_ctl_event_transport(BA_EVENT_UPDATE_VOLUME, t);
 
 		}
 
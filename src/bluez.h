@@ -30,6 +30,7 @@ enum bluetooth_profile {
 };
 
 void bluez_register_a2dp(void);
+void bluez_register_a2dp_hci(int hci_dev_id);
 void bluez_register_hfp(void);
 int bluez_subscribe_signals(void);
 
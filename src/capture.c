@@ -0,0 +1,170 @@
+/*
+ * BlueALSA - capture.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "log.h"
+
+/* the header occupies single memory page */
+#define CAPTURE_HEADER_SIZE 4096
+#define CAPTURE_RECORD_SIZE (sizeof(struct capture_record) + CAPTURE_SNAPLEN)
+
+static uint64_t capture_timestamp(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Initialize capture structure. */
+void capture_init(struct capture *c) {
+	pthread_mutex_init(&c->mutex, NULL);
+	atomic_init(&c->active, false);
+	atomic_init(&c->writers, 0);
+	c->header = NULL;
+	c->size = 0;
+}
+
+/**
+ * Start capturing into the given file.
+ *
+ * The file is preallocated and mapped, so writing records does not require
+ * any system call. If the capture is already running, it is stopped first.
+ *
+ * @param c Address of the capture structure.
+ * @param path Path to the capture file. Existing file is truncated.
+ * @param records The number of records in the ring.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int capture_start(struct capture *c, const char *path, unsigned int records) {
+
+	const size_t size = CAPTURE_HEADER_SIZE + (size_t)records * CAPTURE_RECORD_SIZE;
+	void *addr = MAP_FAILED;
+	int fd = -1;
+	int err;
+
+	if (records == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	capture_stop(c);
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1)
+		goto fail;
+	/* Allocate all blocks right away, otherwise writing to the mapping on
+	 * a full file system would end with the SIGBUS. */
+	if ((errno = posix_fallocate(fd, 0, size)) != 0)
+		goto fail;
+	if ((addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto fail;
+
+	close(fd);
+
+	struct capture_header *header = addr;
+	header->magic = CAPTURE_MAGIC;
+	header->version = CAPTURE_VERSION;
+	header->record_size = CAPTURE_RECORD_SIZE;
+	header->records = records;
+	atomic_init(&header->seq, 0);
+	header->realtime_offset = capture_timestamp(CLOCK_REALTIME) -
+		capture_timestamp(CLOCK_MONOTONIC);
+
+	debug("Starting capture: %s (%u records)", path, records);
+
+	pthread_mutex_lock(&c->mutex);
+	c->header = header;
+	c->size = size;
+	atomic_store_explicit(&c->active, true, memory_order_release);
+	pthread_mutex_unlock(&c->mutex);
+
+	return 0;
+
+fail:
+	err = errno;
+	if (fd != -1) {
+		close(fd);
+		unlink(path);
+	}
+	errno = err;
+	return -1;
+}
+
+/**
+ * Stop capturing.
+ *
+ * This function waits for all writers which have already seen the capture
+ * enabled, which takes no longer than copying a single record. */
+void capture_stop(struct capture *c) {
+
+	pthread_mutex_lock(&c->mutex);
+
+	if (c->header != NULL) {
+
+		atomic_store_explicit(&c->active, false, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (atomic_load_explicit(&c->writers, memory_order_acquire) != 0)
+			sched_yield();
+
+		debug("Stopping capture: %zu records",
+				(size_t)atomic_load_explicit(&c->header->seq, memory_order_relaxed));
+
+		munmap(c->header, c->size);
+		c->header = NULL;
+		c->size = 0;
+
+	}
+
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/**
+ * Store data chunk in the capture ring - see the capture_record(). */
+void capture_record_(struct capture *c, const bdaddr_t *addr, uint8_t profile,
+		uint16_t codec, enum capture_type type, const void *data, size_t len) {
+
+	atomic_fetch_add_explicit(&c->writers, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	/* the capture might have been stopped in the meantime */
+	if (!atomic_load_explicit(&c->active, memory_order_acquire))
+		goto final;
+
+	struct capture_header *header = c->header;
+	const uint64_t seq = atomic_fetch_add_explicit(&header->seq, 1, memory_order_relaxed) + 1;
+	struct capture_record *r = (struct capture_record *)((uint8_t *)header +
+			CAPTURE_HEADER_SIZE + (seq - 1) % header->records * CAPTURE_RECORD_SIZE);
+
+	/* invalidate the record before overwriting it */
+	atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	r->timestamp = capture_timestamp(CLOCK_MONOTONIC);
+	bacpy(&r->addr, addr);
+	r->profile = profile;
+	r->type = type;
+	r->codec = codec;
+	r->len = len < CAPTURE_SNAPLEN ? len : CAPTURE_SNAPLEN;
+	r->orig_len = len;
+	memcpy(r->data, data, r->len);
+
+	atomic_store_explicit(&r->seq, seq, memory_order_release);
+
+final:
+	atomic_fetch_sub_explicit(&c->writers, 1, memory_order_release);
+}
@@ -0,0 +1,113 @@
+/*
+ * BlueALSA - capture.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_CAPTURE_H_
+#define BLUEALSA_CAPTURE_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+
+/* Magic number of the capture file ("BACP" in little-endian). */
+#define CAPTURE_MAGIC 0x50434142
+#define CAPTURE_VERSION 1
+
+/* The maximal number of data bytes stored in a single record. Longer
+ * chunks are truncated, but their original length is recorded. */
+#define CAPTURE_SNAPLEN 1024
+
+enum capture_type {
+	CAPTURE_TYPE_BT_IN = 0,
+	CAPTURE_TYPE_BT_OUT,
+	CAPTURE_TYPE_PCM_IN,
+	CAPTURE_TYPE_PCM_OUT,
+};
+
+/**
+ * Header at the beginning of the capture file.
+ *
+ * The header occupies a single memory page, and it is followed by the
+ * ring of fixed-size records. All fields are stored in the host byte
+ * order, which is indicated by the magic number. */
+struct capture_header {
+	uint32_t magic;
+	uint16_t version;
+	/* size of a single record including its header */
+	uint16_t record_size;
+	/* the number of records in the ring */
+	uint32_t records;
+	uint32_t reserved;
+	/* sequence number of the last reserved record */
+	_Atomic uint64_t seq;
+	/* the CLOCK_REALTIME minus CLOCK_MONOTONIC (in nanoseconds) taken
+	 * when the capture has been started */
+	int64_t realtime_offset;
+};
+
+/**
+ * Single record of the capture ring.
+ *
+ * The record with the sequence number N is stored at the index N - 1
+ * modulo the number of records. Sequence number is updated when the
+ * record is complete, so zero indicates an empty (or partial) record. */
+struct capture_record {
+	_Atomic uint64_t seq;
+	/* CLOCK_MONOTONIC time-stamp in nanoseconds */
+	uint64_t timestamp;
+	/* transport device address, profile and codec */
+	bdaddr_t addr;
+	uint8_t profile;
+	uint8_t type;
+	uint16_t codec;
+	/* the number of captured and the original number of bytes */
+	uint16_t len;
+	uint32_t orig_len;
+	uint8_t data[];
+};
+
+/**
+ * Capture ring mapped from the file. */
+struct capture {
+	pthread_mutex_t mutex;
+	/* capture is enabled - checked in the hot path */
+	atomic_bool active;
+	/* number of IO threads writing to the ring right now */
+	atomic_uint writers;
+	struct capture_header *header;
+	size_t size;
+};
+
+void capture_init(struct capture *c);
+int capture_start(struct capture *c, const char *path, unsigned int records);
+void capture_stop(struct capture *c);
+
+void capture_record_(struct capture *c, const bdaddr_t *addr, uint8_t profile,
+		uint16_t codec, enum capture_type type, const void *data, size_t len);
+
+/**
+ * Store data chunk in the capture ring.
+ *
+ * If the capture is not enabled, the cost of this function is a single
+ * relaxed atomic load. */
+static inline void capture_record(struct capture *c, const bdaddr_t *addr, uint8_t profile,
+		uint16_t codec, enum capture_type type, const void *data, size_t len) {
+	if (atomic_load_explicit(&c->active, memory_order_relaxed))
+		capture_record_(c, addr, profile, codec, type, data, len);
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * BlueALSA - codec-cache.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "codec-cache.h"
+
+#include <string.h>
+
+#include "log.h"
+
+/**
+ * Initialize codec context cache. */
+void codec_cache_init(struct codec_cache *cache) {
+	pthread_mutex_init(&cache->mutex, NULL);
+	cache->len = 0;
+}
+
+/**
+ * Free all cached codec contexts.
+ *
+ * Contexts which have been taken from the cache are not affected, so it
+ * is up to the caller to make sure that all of them have been released. */
+void codec_cache_free(struct codec_cache *cache) {
+
+	size_t i;
+
+	for (i = 0; i < cache->len; i++)
+		cache->entries[i].free(cache->entries[i].handle);
+	cache->len = 0;
+
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+static bool codec_cache_entry_match(const struct codec_cache_entry *a,
+		const struct codec_cache_entry *b) {
+	return a->codec == b->codec &&
+		a->encoder == b->encoder &&
+		a->param == b->param &&
+		a->cconfig_size == b->cconfig_size &&
+		memcmp(a->cconfig, b->cconfig, a->cconfig_size) == 0;
+}
+
+/**
+ * Take codec context from the cache.
+ *
+ * Regardless of the result, the entry structure is initialized with the
+ * given key, so it can be used for the codec_cache_release() later on. If
+ * the context was not found, it is up to the caller to create a new one
+ * and to set the handle and the free function of the entry.
+ *
+ * @param cache Address of the cache structure. If NULL, contexts will not
+ *   be cached at all.
+ * @param entry Address of the entry structure to initialize.
+ * @param codec Codec identifier.
+ * @param encoder True for the encoder context, false for the decoder.
+ * @param cconfig Codec configuration blob.
+ * @param cconfig_size The size of the codec configuration.
+ * @param param Additional codec-specific parameter.
+ * @return If the context was found in the cache, this function returns its
+ *   handle and the ownership is passed to the caller. Otherwise, NULL is
+ *   returned. */
+void *codec_cache_take(struct codec_cache *cache, struct codec_cache_entry *entry,
+		uint16_t codec, bool encoder, const void *cconfig, size_t cconfig_size,
+		unsigned int param) {
+
+	size_t i;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->codec = codec;
+	entry->encoder = encoder;
+	entry->param = param;
+
+	/* configuration which does not fit the key is never cached */
+	if (cache == NULL || cconfig_size > sizeof(entry->cconfig))
+		return NULL;
+
+	entry->cache = cache;
+	memcpy(entry->cconfig, cconfig, cconfig_size);
+	entry->cconfig_size = cconfig_size;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	for (i = 0; i < cache->len; i++)
+		if (codec_cache_entry_match(&cache->entries[i], entry)) {
+			entry->handle = cache->entries[i].handle;
+			entry->free = cache->entries[i].free;
+			memmove(&cache->entries[i], &cache->entries[i + 1],
+					(cache->len - i - 1) * sizeof(*cache->entries));
+			cache->len--;
+			break;
+		}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (entry->handle != NULL)
+		debug("Reusing cached codec context: %#x (%s)", codec, encoder ? "encoder" : "decoder");
+
+	return entry->handle;
+}
+
+/**
+ * Release codec context taken with the codec_cache_take().
+ *
+ * If the context is reusable, it is stored in the cache, evicting the least
+ * recently released one if the cache is full. Otherwise, it is freed. This
+ * function is suitable for the thread cleanup handler.
+ *
+ * @param entry Address of the entry structure. */
+void codec_cache_release(struct codec_cache_entry *entry) {
+
+	struct codec_cache *cache = entry->cache;
+	struct codec_cache_entry evicted = { 0 };
+
+	if (entry->handle == NULL)
+		return;
+
+	if (cache == NULL || !entry->reusable) {
+		entry->free(entry->handle);
+		entry->handle = NULL;
+		return;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+
+	if (cache->len == CODEC_CACHE_SIZE) {
+		evicted = cache->entries[0];
+		memmove(&cache->entries[0], &cache->entries[1],
+				(cache->len - 1) * sizeof(*cache->entries));
+		cache->len--;
+	}
+
+	cache->entries[cache->len++] = *entry;
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	/* free evicted context outside of the critical section */
+	if (evicted.handle != NULL)
+		evicted.free(evicted.handle);
+
+	entry->handle = NULL;
+}
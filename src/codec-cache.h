@@ -0,0 +1,74 @@
+/*
+ * BlueALSA - codec-cache.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_CODECCACHE_H_
+#define BLUEALSA_CODECCACHE_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The maximal number of contexts cached for a single device. */
+#define CODEC_CACHE_SIZE 4
+
+/* The maximal size of the codec configuration used as a cache key. */
+#define CODEC_CACHE_CCONFIG_SIZE 32
+
+struct codec_cache;
+
+/**
+ * Codec context which might be stored in the cache.
+ *
+ * The context is identified by the codec, the direction and the codec
+ * configuration, plus an additional codec-specific parameter (e.g. the
+ * frame size derived from the MTU). */
+struct codec_cache_entry {
+
+	struct codec_cache *cache;
+
+	uint16_t codec;
+	bool encoder;
+	uint8_t cconfig[CODEC_CACHE_CCONFIG_SIZE];
+	size_t cconfig_size;
+	unsigned int param;
+
+	/* initialized codec context */
+	void *handle;
+	/* function used to free the context */
+	void (*free)(void *handle);
+
+	/* If true, the context is in a consistent state, so it can be stored in
+	 * the cache upon release. Otherwise, the context will be freed. */
+	bool reusable;
+
+};
+
+/**
+ * Cache of initialized codec contexts. */
+struct codec_cache {
+	pthread_mutex_t mutex;
+	struct codec_cache_entry entries[CODEC_CACHE_SIZE];
+	size_t len;
+};
+
+void codec_cache_init(struct codec_cache *cache);
+void codec_cache_free(struct codec_cache *cache);
+
+void *codec_cache_take(struct codec_cache *cache, struct codec_cache_entry *entry,
+		uint16_t codec, bool encoder, const void *cconfig, size_t cconfig_size,
+		unsigned int param);
+void codec_cache_release(struct codec_cache_entry *entry);
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * BlueALSA - codec-lib.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "codec-lib.h"
+
+#if ENABLE_CODEC_DLOPEN
+# include <dlfcn.h>
+# include <errno.h>
+# include <pthread.h>
+# include <stdbool.h>
+# include <stddef.h>
+#endif
+
+#include "defs.h"
+#include "log.h"
+
+#if ENABLE_CODEC_DLOPEN
+
+struct codec_lib_symbol {
+	const char *name;
+	size_t offset;
+};
+
+#if ENABLE_AAC
+struct codec_lib_aac codec_lib_aac;
+# define CODEC_LIB_AAC_ENTRY(name) \
+	{ #name, offsetof(struct codec_lib_aac, sym_ ## name) },
+static const struct codec_lib_symbol codec_lib_aac_symbols[] = {
+	CODEC_LIB_AAC_SYMBOLS(CODEC_LIB_AAC_ENTRY)
+};
+#endif
+
+#if ENABLE_APTX
+struct codec_lib_aptx codec_lib_aptx;
+# define CODEC_LIB_APTX_ENTRY(name) \
+	{ #name, offsetof(struct codec_lib_aptx, sym_ ## name) },
+static const struct codec_lib_symbol codec_lib_aptx_symbols[] = {
+	CODEC_LIB_APTX_SYMBOLS(CODEC_LIB_APTX_ENTRY)
+};
+#endif
+
+#if ENABLE_APTX_HD
+struct codec_lib_aptx_hd codec_lib_aptx_hd;
+# define CODEC_LIB_APTX_HD_ENTRY(name) \
+	{ #name, offsetof(struct codec_lib_aptx_hd, sym_ ## name) },
+static const struct codec_lib_symbol codec_lib_aptx_hd_symbols[] = {
+	CODEC_LIB_APTX_HD_SYMBOLS(CODEC_LIB_APTX_HD_ENTRY)
+};
+#endif
+
+#if ENABLE_LDAC
+struct codec_lib_ldac codec_lib_ldac;
+# define CODEC_LIB_LDAC_ENTRY(name) \
+	{ #name, offsetof(struct codec_lib_ldac, sym_ ## name) },
+static const struct codec_lib_symbol codec_lib_ldac_symbols[] = {
+	CODEC_LIB_LDAC_SYMBOLS(CODEC_LIB_LDAC_ENTRY)
+};
+struct codec_lib_ldac_abr codec_lib_ldac_abr;
+# define CODEC_LIB_LDAC_ABR_ENTRY(name) \
+	{ #name, offsetof(struct codec_lib_ldac_abr, sym_ ## name) },
+static const struct codec_lib_symbol codec_lib_ldac_abr_symbols[] = {
+	CODEC_LIB_LDAC_ABR_SYMBOLS(CODEC_LIB_LDAC_ABR_ENTRY)
+};
+#endif
+
+/* Library file names (in the order of preference) and the symbol table
+ * of every supported library. Entry without names is not available. */
+static const struct {
+	const char *names[3];
+	void *table;
+	const struct codec_lib_symbol *symbols;
+	size_t symbols_len;
+} codec_libs[__CODEC_LIB_MAX] = {
+#if ENABLE_AAC
+	[CODEC_LIB_AAC] = {
+		{ "libfdk-aac.so.2", "libfdk-aac.so.1", "libfdk-aac.so" },
+		&codec_lib_aac, codec_lib_aac_symbols, ARRAYSIZE(codec_lib_aac_symbols) },
+#endif
+#if ENABLE_APTX
+	[CODEC_LIB_APTX] = {
+		{ "libopenaptx.so.0", "libopenaptx.so" },
+		&codec_lib_aptx, codec_lib_aptx_symbols, ARRAYSIZE(codec_lib_aptx_symbols) },
+#endif
+#if ENABLE_APTX_HD
+	[CODEC_LIB_APTX_HD] = {
+		{ "libopenaptxhd.so.0", "libopenaptxhd.so" },
+		&codec_lib_aptx_hd, codec_lib_aptx_hd_symbols, ARRAYSIZE(codec_lib_aptx_hd_symbols) },
+#endif
+#if ENABLE_LDAC
+	[CODEC_LIB_LDAC] = {
+		{ "libldacBT_enc.so.2", "libldacBT_enc.so" },
+		&codec_lib_ldac, codec_lib_ldac_symbols, ARRAYSIZE(codec_lib_ldac_symbols) },
+	[CODEC_LIB_LDAC_ABR] = {
+		{ "libldacBT_abr.so.2", "libldacBT_abr.so" },
+		&codec_lib_ldac_abr, codec_lib_ldac_abr_symbols, ARRAYSIZE(codec_lib_ldac_abr_symbols) },
+#endif
+};
+
+static pthread_mutex_t codec_libs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool codec_libs_loaded[__CODEC_LIB_MAX] = { 0 };
+
+static int codec_lib_dlopen(enum codec_lib lib) {
+
+	const char *name = NULL;
+	void *handle = NULL;
+	size_t i;
+
+	for (i = 0; i < ARRAYSIZE(codec_libs[lib].names); i++) {
+		if ((name = codec_libs[lib].names[i]) == NULL)
+			break;
+		if ((handle = dlopen(name, RTLD_NOW | RTLD_LOCAL)) != NULL)
+			break;
+		debug("Couldn't open codec library: %s", dlerror());
+	}
+
+	if (handle == NULL) {
+		errno = ELIBACC;
+		return -1;
+	}
+
+	for (i = 0; i < codec_libs[lib].symbols_len; i++) {
+		const struct codec_lib_symbol *s = &codec_libs[lib].symbols[i];
+		void *sym;
+		if ((sym = dlsym(handle, s->name)) == NULL) {
+			error("Couldn't resolve codec symbol: %s", dlerror());
+			dlclose(handle);
+			errno = ELIBBAD;
+			return -1;
+		}
+		*(void **)((char *)codec_libs[lib].table + s->offset) = sym;
+	}
+
+	debug("Loaded codec library: %s", name);
+	return 0;
+}
+
+#endif
+
+/**
+ * Make sure that the codec library is loaded.
+ *
+ * If the dlopen support is not enabled, libraries are linked with the
+ * daemon, so this function does nothing. Once loaded, the library is
+ * never unloaded - codec contexts might be kept in the codec cache.
+ *
+ * @param lib Codec library identifier.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int codec_lib_load(enum codec_lib lib) {
+#if ENABLE_CODEC_DLOPEN
+
+	int ret = 0;
+
+	pthread_mutex_lock(&codec_libs_mutex);
+	if (!codec_libs_loaded[lib]) {
+		if ((ret = codec_lib_dlopen(lib)) == 0)
+			codec_libs_loaded[lib] = true;
+	}
+	pthread_mutex_unlock(&codec_libs_mutex);
+
+	return ret;
+#else
+	(void)lib;
+	return 0;
+#endif
+}
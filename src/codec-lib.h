@@ -0,0 +1,146 @@
+/*
+ * BlueALSA - codec-lib.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_CODECLIB_H_
+#define BLUEALSA_CODECLIB_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* Optional codec libraries. If BlueALSA is configured with the codec
+ * dlopen support, these libraries are not linked with the daemon, but
+ * they are loaded when the codec is used for the first time. */
+enum codec_lib {
+	CODEC_LIB_AAC,
+	CODEC_LIB_APTX,
+	CODEC_LIB_APTX_HD,
+	CODEC_LIB_LDAC,
+	CODEC_LIB_LDAC_ABR,
+	__CODEC_LIB_MAX,
+};
+
+int codec_lib_load(enum codec_lib lib);
+
+#if ENABLE_CODEC_DLOPEN
+
+#if ENABLE_AAC
+# include <fdk-aac/aacdecoder_lib.h>
+# include <fdk-aac/aacenc_lib.h>
+#endif
+#if ENABLE_APTX || ENABLE_APTX_HD
+# include <openaptx.h>
+#endif
+#if ENABLE_LDAC
+# include <ldacBT.h>
+# include <ldacBT_abr.h>
+#endif
+
+/* Every library is represented by the structure of pointers to symbols
+ * resolved upon the load. Calls of library functions are redirected to
+ * these pointers with macros defined below, so the codec code does not
+ * have to be aware of the dynamic loading. */
+#define CODEC_LIB_SYMBOL(name) __typeof__(name) *sym_ ## name;
+
+#if ENABLE_AAC
+# define CODEC_LIB_AAC_SYMBOLS(X) \
+	X(aacDecoder_Close) \
+	X(aacDecoder_DecodeFrame) \
+	X(aacDecoder_Fill) \
+	X(aacDecoder_GetStreamInfo) \
+	X(aacDecoder_Open) \
+	X(aacDecoder_SetParam) \
+	X(aacEncClose) \
+	X(aacEncEncode) \
+	X(aacEncInfo) \
+	X(aacEncOpen) \
+	X(aacEncoder_SetParam)
+extern struct codec_lib_aac {
+	CODEC_LIB_AAC_SYMBOLS(CODEC_LIB_SYMBOL)
+} codec_lib_aac;
+# define aacDecoder_Close (*codec_lib_aac.sym_aacDecoder_Close)
+# define aacDecoder_DecodeFrame (*codec_lib_aac.sym_aacDecoder_DecodeFrame)
+# define aacDecoder_Fill (*codec_lib_aac.sym_aacDecoder_Fill)
+# define aacDecoder_GetStreamInfo (*codec_lib_aac.sym_aacDecoder_GetStreamInfo)
+# define aacDecoder_Open (*codec_lib_aac.sym_aacDecoder_Open)
+# define aacDecoder_SetParam (*codec_lib_aac.sym_aacDecoder_SetParam)
+# define aacEncClose (*codec_lib_aac.sym_aacEncClose)
+# define aacEncEncode (*codec_lib_aac.sym_aacEncEncode)
+# define aacEncInfo (*codec_lib_aac.sym_aacEncInfo)
+# define aacEncOpen (*codec_lib_aac.sym_aacEncOpen)
+# define aacEncoder_SetParam (*codec_lib_aac.sym_aacEncoder_SetParam)
+#endif
+
+#if ENABLE_APTX
+# define CODEC_LIB_APTX_SYMBOLS(X) \
+	X(SizeofAptxbtenc) \
+	X(aptxbtenc_encodestereo) \
+	X(aptxbtenc_init)
+extern struct codec_lib_aptx {
+	CODEC_LIB_APTX_SYMBOLS(CODEC_LIB_SYMBOL)
+} codec_lib_aptx;
+# define SizeofAptxbtenc (*codec_lib_aptx.sym_SizeofAptxbtenc)
+# define aptxbtenc_encodestereo (*codec_lib_aptx.sym_aptxbtenc_encodestereo)
+# define aptxbtenc_init (*codec_lib_aptx.sym_aptxbtenc_init)
+#endif
+
+#if ENABLE_APTX_HD
+# define CODEC_LIB_APTX_HD_SYMBOLS(X) \
+	X(SizeofAptxhdbtenc) \
+	X(aptxhdbtenc_encodestereo) \
+	X(aptxhdbtenc_init)
+extern struct codec_lib_aptx_hd {
+	CODEC_LIB_APTX_HD_SYMBOLS(CODEC_LIB_SYMBOL)
+} codec_lib_aptx_hd;
+# define SizeofAptxhdbtenc (*codec_lib_aptx_hd.sym_SizeofAptxhdbtenc)
+# define aptxhdbtenc_encodestereo (*codec_lib_aptx_hd.sym_aptxhdbtenc_encodestereo)
+# define aptxhdbtenc_init (*codec_lib_aptx_hd.sym_aptxhdbtenc_init)
+#endif
+
+#if ENABLE_LDAC
+# define CODEC_LIB_LDAC_SYMBOLS(X) \
+	X(ldacBT_close_handle) \
+	X(ldacBT_encode) \
+	X(ldacBT_free_handle) \
+	X(ldacBT_get_eqmid) \
+	X(ldacBT_get_error_code) \
+	X(ldacBT_get_handle) \
+	X(ldacBT_init_handle_encode) \
+	X(ldacBT_set_eqmid)
+extern struct codec_lib_ldac {
+	CODEC_LIB_LDAC_SYMBOLS(CODEC_LIB_SYMBOL)
+} codec_lib_ldac;
+# define ldacBT_close_handle (*codec_lib_ldac.sym_ldacBT_close_handle)
+# define ldacBT_encode (*codec_lib_ldac.sym_ldacBT_encode)
+# define ldacBT_free_handle (*codec_lib_ldac.sym_ldacBT_free_handle)
+# define ldacBT_get_eqmid (*codec_lib_ldac.sym_ldacBT_get_eqmid)
+# define ldacBT_get_error_code (*codec_lib_ldac.sym_ldacBT_get_error_code)
+# define ldacBT_get_handle (*codec_lib_ldac.sym_ldacBT_get_handle)
+# define ldacBT_init_handle_encode (*codec_lib_ldac.sym_ldacBT_init_handle_encode)
+# define ldacBT_set_eqmid (*codec_lib_ldac.sym_ldacBT_set_eqmid)
+# define CODEC_LIB_LDAC_ABR_SYMBOLS(X) \
+	X(ldac_ABR_Init) \
+	X(ldac_ABR_Proc) \
+	X(ldac_ABR_free_handle) \
+	X(ldac_ABR_get_handle) \
+	X(ldac_ABR_set_thresholds)
+extern struct codec_lib_ldac_abr {
+	CODEC_LIB_LDAC_ABR_SYMBOLS(CODEC_LIB_SYMBOL)
+} codec_lib_ldac_abr;
+# define ldac_ABR_Init (*codec_lib_ldac_abr.sym_ldac_ABR_Init)
+# define ldac_ABR_Proc (*codec_lib_ldac_abr.sym_ldac_ABR_Proc)
+# define ldac_ABR_free_handle (*codec_lib_ldac_abr.sym_ldac_ABR_free_handle)
+# define ldac_ABR_get_handle (*codec_lib_ldac_abr.sym_ldac_ABR_get_handle)
+# define ldac_ABR_set_thresholds (*codec_lib_ldac_abr.sym_ldac_ABR_set_thresholds)
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * BlueALSA - cpu-budget.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "cpu-budget.h"
+
+#include <string.h>
+
+#include "rt.h"
+
+/**
+ * Get the number of milliseconds elapsed between two time points. */
+static unsigned int cpu_budget_elapsed_ms(const struct timespec *ts1,
+		const struct timespec *ts2) {
+	struct timespec ts;
+	if (difftimespec(ts1, ts2, &ts) < 0)
+		return 0;
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize CPU budget.
+ *
+ * @param b Address of the budget structure.
+ * @param limit The budget in 1/10 of percent of a single CPU core. If
+ *   zero, the complexity of encoders is not controlled. */
+void cpu_budget_init(struct cpu_budget *b, unsigned int limit) {
+	pthread_mutex_init(&b->mutex, NULL);
+	b->clients = NULL;
+	b->limit = limit;
+}
+
+/**
+ * Free CPU budget. */
+void cpu_budget_free(struct cpu_budget *b) {
+	pthread_mutex_destroy(&b->mutex);
+	b->clients = NULL;
+}
+
+/**
+ * Register encoder within the CPU budget.
+ *
+ * @param b Address of the budget structure.
+ * @param c Address of the client structure. This structure has to be valid
+ *   until the client is unregistered.
+ * @param levels The number of complexity levels. The client starts with
+ *   the full complexity - level 0. If the encoder does not provide any
+ *   complexity control, this value shall be 1, so its load is accounted
+ *   within the budget nevertheless.
+ * @param codec_time The total codec time (in microseconds) of the encoder.
+ * @param now Current time-stamp. */
+void cpu_budget_register(struct cpu_budget *b, struct cpu_budget_client *c,
+		unsigned int levels, uint64_t codec_time, const struct timespec *now) {
+
+	memset(c, 0, sizeof(*c));
+	c->levels = levels < CPU_BUDGET_LEVELS_MAX ? levels : CPU_BUDGET_LEVELS_MAX;
+	if (c->levels == 0)
+		c->levels = 1;
+	c->codec_time = codec_time;
+	c->ts = c->ts_step = *now;
+
+	pthread_mutex_lock(&b->mutex);
+	c->next = b->clients;
+	b->clients = c;
+	c->registered = true;
+	pthread_mutex_unlock(&b->mutex);
+
+}
+
+/**
+ * Unregister encoder from the CPU budget.
+ *
+ * It is safe to call this function for a client which is not registered. */
+void cpu_budget_unregister(struct cpu_budget *b, struct cpu_budget_client *c) {
+
+	struct cpu_budget_client **p;
+
+	if (!c->registered)
+		return;
+
+	pthread_mutex_lock(&b->mutex);
+	for (p = &b->clients; *p != NULL; p = &(*p)->next)
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	c->registered = false;
+	pthread_mutex_unlock(&b->mutex);
+
+}
+
+/**
+ * Update the load of the encoder and adjust its complexity level.
+ *
+ * The load is measured once per CPU_BUDGET_INTERVAL, so this function can
+ * be called for every encoded block. Only the client which is calling this
+ * function (i.e. its own IO thread) can have its level changed, so other
+ * encoders will follow on their next update.
+ *
+ * @param b Address of the budget structure.
+ * @param c Address of the registered client structure.
+ * @param codec_time The total codec time (in microseconds) of the encoder.
+ * @param now Current time-stamp.
+ * @return This function returns true if the complexity level of the client
+ *   has been changed. */
+bool cpu_budget_update(struct cpu_budget *b, struct cpu_budget_client *c,
+		uint64_t codec_time, const struct timespec *now) {
+
+	const unsigned int elapsed = cpu_budget_elapsed_ms(&c->ts, now);
+	if (elapsed < CPU_BUDGET_INTERVAL)
+		return false;
+
+	struct cpu_budget_client *heaviest = NULL;
+	struct cpu_budget_client *degraded = NULL;
+	struct cpu_budget_client *tmp;
+	unsigned int total = 0;
+	bool changed = false;
+
+	pthread_mutex_lock(&b->mutex);
+
+	/* the codec time is in microseconds, so this is the permil load */
+	c->load = (codec_time - c->codec_time) / elapsed;
+	c->loads[c->level] = c->load;
+	c->codec_time = codec_time;
+	c->ts = *now;
+
+	if (b->limit == 0)
+		goto final;
+
+	for (tmp = b->clients; tmp != NULL; tmp = tmp->next) {
+		/* encoder which has not been updated recently is idle */
+		if (cpu_budget_elapsed_ms(&tmp->ts, now) > 2 * CPU_BUDGET_INTERVAL)
+			tmp->load = 0;
+		total += tmp->load;
+		if (tmp->level + 1 < tmp->levels &&
+				(heaviest == NULL || tmp->load > heaviest->load))
+			heaviest = tmp;
+		if (tmp->level > 0 &&
+				(degraded == NULL || tmp->level > degraded->level))
+			degraded = tmp;
+	}
+
+	const unsigned int since_step = cpu_budget_elapsed_ms(&c->ts_step, now);
+
+	if (total > b->limit) {
+		if (heaviest == c && since_step >= CPU_BUDGET_HOLDOFF) {
+			c->level++;
+			c->ts_step = *now;
+			changed = true;
+		}
+	}
+	else if (total * 4 < b->limit * 3 && degraded == c &&
+			since_step >= CPU_BUDGET_UPGRADE &&
+			/* do not upgrade if the load measured at the higher complexity
+			 * level would exceed the budget once again */
+			total - c->load + c->loads[c->level - 1] <= b->limit) {
+		c->level--;
+		c->ts_step = *now;
+		changed = true;
+	}
+
+final:
+	pthread_mutex_unlock(&b->mutex);
+	return changed;
+}
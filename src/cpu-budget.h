@@ -0,0 +1,87 @@
+/*
+ * BlueALSA - cpu-budget.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_CPUBUDGET_H_
+#define BLUEALSA_CPUBUDGET_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* The maximal number of complexity levels of a single client. */
+#define CPU_BUDGET_LEVELS_MAX 8
+/* The interval (in milliseconds) of the codec load measurement. */
+#define CPU_BUDGET_INTERVAL 1000
+/* Minimal time (in milliseconds) between complexity level decrements. */
+#define CPU_BUDGET_HOLDOFF 2000
+/* The time (in milliseconds) without overload required to increase the
+ * complexity level. */
+#define CPU_BUDGET_UPGRADE 10000
+
+/**
+ * Encoder registered within the CPU budget.
+ *
+ * Level 0 is the full encoder complexity. It is up to the caller to
+ * translate the level into the codec specific parameter (e.g. the LDAC
+ * encoder quality mode). */
+struct cpu_budget_client {
+
+	struct cpu_budget_client *next;
+	bool registered;
+
+	/* current complexity level and the number of available levels */
+	unsigned int level;
+	unsigned int levels;
+
+	/* the last measured load (in 1/10 of percent of a single CPU core) */
+	unsigned int load;
+	/* the last load measured at the given complexity level */
+	unsigned int loads[CPU_BUDGET_LEVELS_MAX];
+
+	/* the total codec time (in microseconds) and time-stamp of the last
+	 * load measurement */
+	uint64_t codec_time;
+	struct timespec ts;
+	/* time-stamp of the last level change */
+	struct timespec ts_step;
+
+};
+
+/**
+ * Global CPU budget shared by all encoders.
+ *
+ * When the total encoding load exceeds the limit, the complexity of the
+ * heaviest encoder is lowered. When there is enough headroom, the most
+ * degraded encoder is restored - but only if its load measured at the
+ * higher complexity level would still fit within the limit. */
+struct cpu_budget {
+	pthread_mutex_t mutex;
+	struct cpu_budget_client *clients;
+	/* budget (in 1/10 of percent of a single CPU core) - zero disables
+	 * the complexity control */
+	unsigned int limit;
+};
+
+void cpu_budget_init(struct cpu_budget *b, unsigned int limit);
+void cpu_budget_free(struct cpu_budget *b);
+
+void cpu_budget_register(struct cpu_budget *b, struct cpu_budget_client *c,
+		unsigned int levels, uint64_t codec_time, const struct timespec *now);
+void cpu_budget_unregister(struct cpu_budget *b, struct cpu_budget_client *c);
+
+bool cpu_budget_update(struct cpu_budget *b, struct cpu_budget_client *c,
+		uint64_t codec_time, const struct timespec *now);
+
+#endif
@@ -12,12 +12,14 @@
 #include "ctl.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -35,6 +37,21 @@
 #include "log.h"
 
 
+/**
+ * Check whether the device is accessible via the given controller socket.
+ *
+ * Every controller socket exposes devices connected to its HCI device only.
+ * However, devices which are not bound to any used HCI device (e.g. oFono
+ * cards) are accessible via all controller sockets.
+ *
+ * @param d Address of the device structure.
+ * @param hci_dev_id HCI device ID of the controller socket.
+ * @return This function returns true if the device is accessible. */
+static bool _device_visible(const struct ba_device *d, int hci_dev_id) {
+	return d->hci_dev_id == hci_dev_id ||
+		bluealsa_hci_dev_index(d->hci_dev_id) == -1;
+}
+
 /**
  * Looks up a transport matching BT address and profile.
  *
@@ -43,6 +60,7 @@
  * other thread, it may result in an undefined behavior.
  *
  * @param devices Address of the hash-table with connected devices.
+ * @param hci_dev_id HCI device ID of the controller socket.
  * @param addr Address to the structure with the looked up BT address.
  * @param type Looked up PCM type.
  * @param stream Looked up PCM stream direction.
@@ -50,7 +68,7 @@
  * @return If the lookup succeeded, this function returns 0. Otherwise, -1 or
  *   -2 is returned respectively for not found device and not found stream.
  *   Upon error value of the transport pointer is undefined. */
-static int _transport_lookup(GHashTable *devices, const bdaddr_t *addr,
+static int _transport_lookup(GHashTable *devices, int hci_dev_id, const bdaddr_t *addr,
 		enum ba_pcm_type type, enum ba_pcm_stream stream, struct ba_transport **t) {
 
 	bool device_found = false;
@@ -60,7 +78,7 @@ static int _transport_lookup(GHashTable *devices, const bdaddr_t *addr,
 	for (g_hash_table_iter_init(&iter_d, devices);
 			g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d); ) {
 
-		if (bacmp(&d->addr, addr) != 0)
+		if (bacmp(&d->addr, addr) != 0 || !_device_visible(d, hci_dev_id))
 			continue;
 
 		device_found = true;
@@ -104,8 +122,8 @@ static int _transport_lookup(GHashTable *devices, const bdaddr_t *addr,
 	return device_found ? -2 : -1;
 }
 
-static int _transport_lookup_rfcomm(GHashTable *devices, const bdaddr_t *addr,
-		struct ba_transport **t) {
+static int _transport_lookup_rfcomm(GHashTable *devices, int hci_dev_id,
+		const bdaddr_t *addr, struct ba_transport **t) {
 
 	GHashTableIter iter_d, iter_t;
 	struct ba_device *d;
@@ -113,7 +131,7 @@ static int _transport_lookup_rfcomm(GHashTable *devices, const bdaddr_t *addr,
 	for (g_hash_table_iter_init(&iter_d, devices);
 			g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d); ) {
 
-		if (bacmp(&d->addr, addr) != 0)
+		if (bacmp(&d->addr, addr) != 0 || !_device_visible(d, hci_dev_id))
 			continue;
 
 		for (g_hash_table_iter_init(&iter_t, d->transports);
@@ -161,25 +179,32 @@ static struct ba_pcm *_transport_get_pcm(struct ba_transport *t, enum ba_pcm_str
 static void _transport_release_pcm(struct ba_transport *t, int client) {
 	switch (t->type) {
 	case TRANSPORT_TYPE_A2DP:
+		if (t->a2dp.pcm.open_request != NULL) {
+			transport_acquire_bt_a2dp_cancel(t, t->a2dp.pcm.open_request);
+			t->a2dp.pcm.open_request = NULL;
+		}
 		transport_release_pcm(&t->a2dp.pcm);
-		t->a2dp.pcm.client = -1;
+		atomic_store(&t->a2dp.pcm.drain, BA_PCM_DRAIN_NONE);
+		transport_set_pcm_client(t, &t->a2dp.pcm, -1);
 		break;
 	case TRANSPORT_TYPE_RFCOMM:
 		break;
 	case TRANSPORT_TYPE_SCO:
 		if (t->sco.spk_pcm.client == client) {
 			transport_release_pcm(&t->sco.spk_pcm);
-			t->sco.spk_pcm.client = -1;
+			atomic_store(&t->sco.spk_pcm.drain, BA_PCM_DRAIN_NONE);
+			transport_set_pcm_client(t, &t->sco.spk_pcm, -1);
 		}
 		if (t->sco.mic_pcm.client == client) {
 			transport_release_pcm(&t->sco.mic_pcm);
-			t->sco.mic_pcm.client = -1;
+			transport_set_pcm_client(t, &t->sco.mic_pcm, -1);
 		}
 	}
 }
 
 static void _ctl_transport(const struct ba_transport *t, struct ba_msg_transport *transport) {
 
+	memset(transport, 0, sizeof(*transport));
 	bacpy(&transport->addr, &t->device->addr);
 
 	switch (t->type) {
@@ -191,7 +216,8 @@ static void _ctl_transport(const struct ba_transport *t, struct ba_msg_transport
 		transport->ch1_volume = t->a2dp.ch1_volume;
 		transport->ch2_muted = t->a2dp.ch2_muted;
 		transport->ch2_volume = t->a2dp.ch2_volume;
-		transport->delay = t->a2dp.delay;
+		transport->cconfig_size = MIN(t->a2dp.cconfig_size, sizeof(transport->cconfig));
+		memcpy(transport->cconfig, t->a2dp.cconfig, transport->cconfig_size);
 		break;
 	case TRANSPORT_TYPE_RFCOMM:
 		transport->type = BA_PCM_TYPE_NULL;
@@ -203,14 +229,15 @@ static void _ctl_transport(const struct ba_transport *t, struct ba_msg_transport
 		transport->ch1_volume = t->sco.spk_gain;
 		transport->ch2_muted = t->sco.mic_muted;
 		transport->ch2_volume = t->sco.mic_gain;
-		transport->delay = 10;
 		break;
 	}
 
 	transport->codec = t->codec;
 	transport->channels = transport_get_channels(t);
 	transport->sampling = transport_get_sampling(t);
-	transport->delay += t->delay;
+	transport->delay = transport_get_delay(t);
+	transport->formats = transport_get_pcm_formats(t);
+	transport->format = BA_PCM_FORMAT_S16_LE;
 
 }
 
@@ -220,14 +247,41 @@ static void ctl_thread_cmd_ping(const struct ba_request *req, int fd) {
 	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
 }
 
+/**
+ * Get the client structure for the given socket.
+ *
+ * @param fd Client socket file descriptor.
+ * @return This function returns the address of the client structure, or
+ *   NULL if the client is not connected. */
+static struct ba_ctl_client *ctl_client_lookup(int fd) {
+	if (fd < 0 || (size_t)fd >= config.ctl.clients_size ||
+			config.ctl.clients[fd].fd == -1)
+		return NULL;
+	return &config.ctl.clients[fd];
+}
+
+/**
+ * Get the HCI device ID of the controller socket used by the client.
+ *
+ * @param fd Client socket file descriptor.
+ * @return This function returns the HCI device ID. If the client is not
+ *   connected, the ID of the default HCI device is returned. */
+static int ctl_client_hci_dev_id(int fd) {
+	const struct ba_ctl_client *c;
+	if ((c = ctl_client_lookup(fd)) == NULL)
+		return config.hci_devs[0].dev_id;
+	return c->hci_dev_id;
+}
+
 static void ctl_thread_cmd_subscribe(const struct ba_request *req, int fd) {
 
 	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
-	size_t i;
+	struct ba_ctl_client *c;
 
-	for (i = __CTL_IDX_MAX; i < __CTL_IDX_MAX + BLUEALSA_MAX_CLIENTS; i++)
-		if (config.ctl.pfds[i].fd == fd)
-			config.ctl.subs[i - __CTL_IDX_MAX] = req->events;
+	if ((c = ctl_client_lookup(fd)) != NULL) {
+		c->subs = req->events;
+		c->event_seq = 0;
+	}
 
 	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
 }
@@ -236,6 +290,7 @@ static void ctl_thread_cmd_list_devices(const struct ba_request *req, int fd) {
 	(void)req;
 
 	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	const int hci_dev_id = ctl_client_hci_dev_id(fd);
 	struct ba_msg_device device;
 	GHashTableIter iter_d;
 	struct ba_device *d;
@@ -245,6 +300,9 @@ static void ctl_thread_cmd_list_devices(const struct ba_request *req, int fd) {
 	for (g_hash_table_iter_init(&iter_d, config.devices);
 			g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d); ) {
 
+		if (!_device_visible(d, hci_dev_id))
+			continue;
+
 		bacpy(&device.addr, &d->addr);
 		strncpy(device.name, d->name, sizeof(device.name) - 1);
 		device.name[sizeof(device.name) - 1] = '\0';
@@ -263,6 +321,7 @@ static void ctl_thread_cmd_list_transports(const struct ba_request *req, int fd)
 	(void)req;
 
 	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	const int hci_dev_id = ctl_client_hci_dev_id(fd);
 	struct ba_msg_transport transport;
 	GHashTableIter iter_d, iter_t;
 	struct ba_device *d;
@@ -271,7 +330,11 @@ static void ctl_thread_cmd_list_transports(const struct ba_request *req, int fd)
 	pthread_mutex_lock(&config.devices_mutex);
 
 	for (g_hash_table_iter_init(&iter_d, config.devices);
-			g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d); )
+			g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d); ) {
+
+		if (!_device_visible(d, hci_dev_id))
+			continue;
+
 		for (g_hash_table_iter_init(&iter_t, d->transports);
 				g_hash_table_iter_next(&iter_t, NULL, (gpointer)&t); ) {
 			/* ignore SCO transport if codec is not selected yet */
@@ -284,6 +347,8 @@ static void ctl_thread_cmd_list_transports(const struct ba_request *req, int fd)
 			send(fd, &transport, sizeof(transport), MSG_NOSIGNAL);
 		}
 
+	}
+
 	pthread_mutex_unlock(&config.devices_mutex);
 	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
 }
@@ -296,7 +361,7 @@ static void ctl_thread_cmd_transport_get(const struct ba_request *req, int fd) {
 
 	pthread_mutex_lock(&config.devices_mutex);
 
-	switch (_transport_lookup(config.devices, &req->addr, req->type, req->stream, &t)) {
+	switch (_transport_lookup(config.devices, ctl_client_hci_dev_id(fd), &req->addr, req->type, req->stream, &t)) {
 	case -1:
 		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
 		goto fail;
@@ -313,6 +378,54 @@ fail:
 	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
 }
 
+static void ctl_thread_cmd_transport_stats(const struct ba_request *req, int fd) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	struct ba_msg_transport_stats stats;
+	struct ba_transport *t;
+	size_t i;
+
+	pthread_mutex_lock(&config.devices_mutex);
+
+	switch (_transport_lookup(config.devices, ctl_client_hci_dev_id(fd), &req->addr, req->type, req->stream, &t)) {
+	case -1:
+		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
+		goto fail;
+	case -2:
+		status.code = BA_STATUS_CODE_STREAM_NOT_FOUND;
+		goto fail;
+	}
+
+	/* Counters are updated by the IO thread without any locking, so the
+	 * snapshot might be slightly inconsistent. It is acceptable for the
+	 * diagnostic purpose. */
+	for (i = 0; i < BA_STATS_CODEC_TIME_BINS; i++)
+		stats.codec_time[i] = t->stats.codec_time[i];
+	stats.bt_blocked = t->stats.bt_blocked / 1000;
+	stats.bt_coutq_max = t->stats.bt_coutq_max;
+	stats.bt_packets = t->stats.bt_packets;
+	stats.bt_dropped = t->stats.bt_dropped;
+	stats.pcm_underruns = t->stats.pcm_underruns;
+	stats.rtp_gaps = t->stats.rtp_gaps;
+	stats.sync_skipped = t->stats.sync_skipped / 1000;
+	stats.sync_overdue_max = t->stats.sync_overdue_max;
+	stats.codec = t->codec;
+	stats.codec_param = t->stats.codec_param;
+	stats.codec_time_total = t->stats.codec_time_total;
+	stats.bt_bytes = t->stats.bt_bytes;
+	stats.bt_coutq = t->stats.bt_coutq;
+	stats.buffer_bytes = atomic_load(&t->buffers.used);
+	stats.buffer_peak = atomic_load(&t->buffers.peak);
+	stats.drift_ppm = t->stats.drift_ppm;
+	stats.pcm_overruns = t->stats.pcm_overruns;
+
+	send(fd, &stats, sizeof(stats), MSG_NOSIGNAL);
+
+fail:
+	pthread_mutex_unlock(&config.devices_mutex);
+	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+}
+
 static void ctl_thread_cmd_transport_set_volume(const struct ba_request *req, int fd) {
 
 	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
@@ -320,7 +433,7 @@ static void ctl_thread_cmd_transport_set_volume(const struct ba_request *req, in
 
 	pthread_mutex_lock(&config.devices_mutex);
 
-	switch (_transport_lookup(config.devices, &req->addr, req->type, req->stream, &t)) {
+	switch (_transport_lookup(config.devices, ctl_client_hci_dev_id(fd), &req->addr, req->type, req->stream, &t)) {
 	case -1:
 		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
 		goto fail;
@@ -336,18 +449,93 @@ fail:
 	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
 }
 
-static void ctl_thread_cmd_pcm_open(const struct ba_request *req, int fd) {
+static void ctl_thread_cmd_transport_set_group(const struct ba_request *req, int fd) {
 
 	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
 	struct ba_transport *t;
-	struct ba_pcm *t_pcm;
-	int pipefd[2];
 
-	debug("PCM requested for %s type %d stream %d", batostr_(&req->addr), req->type, req->stream);
+	pthread_mutex_lock(&config.devices_mutex);
+
+	switch (_transport_lookup(config.devices, ctl_client_hci_dev_id(fd), &req->addr, req->type, req->stream, &t)) {
+	case -1:
+		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
+		goto fail;
+	case -2:
+		status.code = BA_STATUS_CODE_STREAM_NOT_FOUND;
+		goto fail;
+	}
+
+	/* only A2DP source transports can be grouped */
+	if (t->profile != BLUETOOTH_PROFILE_A2DP_SOURCE) {
+		status.code = BA_STATUS_CODE_FORBIDDEN;
+		goto fail;
+	}
+
+	if (t->a2dp.group == req->group)
+		goto fail;
+
+	/* PCM of the group leader (or standalone transport) is in use */
+	if (t->a2dp.pcm.fd != -1) {
+		status.code = BA_STATUS_CODE_DEVICE_BUSY;
+		goto fail;
+	}
+
+	debug("Changing transport group: %u -> %u", t->a2dp.group, req->group);
+
+	transport_group_unlink(config.devices, t);
+	t->a2dp.group = req->group;
+	transport_group_link(config.devices, t);
+
+fail:
+	pthread_mutex_unlock(&config.devices_mutex);
+	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+}
+
+static void ctl_thread_cmd_capture(const struct ba_request *req, int fd) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	char path[128];
+
+	if (req->capture == 0) {
+		capture_stop(&config.capture);
+		goto final;
+	}
+
+	snprintf(path, sizeof(path), BLUEALSA_RUN_STATE_DIR "/%s.capture",
+			config.hci_devs[0].name);
+
+	if (capture_start(&config.capture, path, req->capture) == -1) {
+		error("Couldn't start capture: %s", strerror(errno));
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+	}
+
+final:
+	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+}
+
+/**
+ * Complete transport standby request. */
+static void ctl_thread_transport_standby_complete(struct ba_transport *t, int ret, void *userdata) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	int client = GPOINTER_TO_INT(userdata);
+
+	if (t == NULL || ret == -1)
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+
+	send(client, &status, sizeof(status), MSG_NOSIGNAL);
+	close(client);
+}
+
+static void ctl_thread_cmd_transport_standby(const struct ba_request *req, int fd) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	struct ba_transport *t;
+	int client;
 
 	pthread_mutex_lock(&config.devices_mutex);
 
-	switch (_transport_lookup(config.devices, &req->addr, req->type, req->stream, &t)) {
+	switch (_transport_lookup(config.devices, ctl_client_hci_dev_id(fd), &req->addr, req->type, req->stream, &t)) {
 	case -1:
 		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
 		goto fail_lookup;
@@ -356,27 +544,99 @@ static void ctl_thread_cmd_pcm_open(const struct ba_request *req, int fd) {
 		goto fail_lookup;
 	}
 
+	/* only A2DP source transports can be acquired ahead of time */
+	if (t->profile != BLUETOOTH_PROFILE_A2DP_SOURCE ||
+			config.a2dp.standby == BA_A2DP_STANDBY_NONE) {
+		status.code = BA_STATUS_CODE_FORBIDDEN;
+		goto fail_lookup;
+	}
+
 	pthread_mutex_lock(&t->mutex);
 
-	if ((t_pcm = _transport_get_pcm(t, req->stream)) == NULL) {
+	t->a2dp.keep_alive = req->standby != 0 ? req->standby :
+		transport_get_default_keep_alive(t);
+
+	debug("Transport standby: %s: %d", t->dbus_path, t->a2dp.keep_alive);
+
+	/* When the transport is already acquired (or the standby is canceled),
+	 * we have to re-arm the keep-alive timer of our IO thread - it is done
+	 * in the same way as upon the PCM close. */
+	if (t->bt_fd != -1 || req->standby == 0) {
+		if (t->a2dp.pcm.fd == -1)
+			transport_send_signal(t, TRANSPORT_PCM_CLOSE);
+		goto fail;
+	}
+
+	/* The status is sent upon the acquisition completion, so the client might
+	 * wait for the transport to be ready. Keep our own copy of the socket, in
+	 * case the client disconnects in the meantime. */
+	if ((client = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
 		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
-		goto final;
+		goto fail;
 	}
 
-	if (t_pcm->fd != -1) {
-		debug("PCM already requested: %d", t_pcm->fd);
-		status.code = BA_STATUS_CODE_DEVICE_BUSY;
-		goto final;
+	if (transport_acquire_bt_a2dp_async(t, ctl_thread_transport_standby_complete,
+				GINT_TO_POINTER(client)) == -1) {
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+		close(client);
+		goto fail;
 	}
 
-	if (pipe(pipefd) == -1) {
-		error("Couldn't create FIFO: %s", strerror(errno));
+	pthread_mutex_unlock(&t->mutex);
+	pthread_mutex_unlock(&config.devices_mutex);
+	return;
+
+fail:
+	pthread_mutex_unlock(&t->mutex);
+fail_lookup:
+	pthread_mutex_unlock(&config.devices_mutex);
+	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+}
+
+/**
+ * PCM open request waiting for the BT transport acquisition. */
+struct ctl_pcm_open {
+	/* duplicated client socket - valid even if the client disconnects */
+	int client;
+	struct ba_pcm *pcm;
+	/* file descriptors passed to the client */
+	int fds[3];
+	unsigned int fds_count;
+	/* our copy of the client side of the PCM */
+	int close_fd;
+};
+
+/**
+ * Release PCM resources set up for the open request. */
+static void ctl_pcm_open_release(struct ba_transport *t, struct ba_pcm *pcm) {
+	transport_release_pcm(pcm);
+	pcm_ring_free(&pcm->shm);
+	resampler_free(&pcm->rs);
+	transport_set_pcm_client(t, pcm, -1);
+}
+
+/**
+ * Complete PCM open request.
+ *
+ * This function is called when the BT transport is acquired (or when it
+ * is not required), so it is called either by the controller thread or
+ * by the main thread via the transport_acquire_bt_a2dp_async(). */
+static void ctl_thread_pcm_open_complete(struct ba_transport *t, int ret, void *userdata) {
+
+	struct ctl_pcm_open *op = userdata;
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+
+	/* If the acquisition was canceled, the PCM has already been released by
+	 * whoever canceled it - the transport might not even exist anymore. */
+	if (t == NULL) {
 		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
 		goto final;
 	}
 
+	op->pcm->open_request = NULL;
+
 	union {
-		char buf[CMSG_SPACE(sizeof(int))];
+		char buf[CMSG_SPACE(sizeof(int) * 3)];
 		struct cmsghdr _align;
 	} control_un;
 	struct iovec io = { .iov_base = "", .iov_len = 1 };
@@ -384,55 +644,266 @@ static void ctl_thread_cmd_pcm_open(const struct ba_request *req, int fd) {
 		.msg_iov = &io,
 		.msg_iovlen = 1,
 		.msg_control = control_un.buf,
-		.msg_controllen = sizeof(control_un.buf),
+		.msg_controllen = CMSG_SPACE(sizeof(int) * op->fds_count),
 	};
 
 	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
 	cmsg->cmsg_level = SOL_SOCKET;
 	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-	int *fdptr = (int *)CMSG_DATA(cmsg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * op->fds_count);
+	memcpy(CMSG_DATA(cmsg), op->fds, sizeof(int) * op->fds_count);
 
-	switch (req->stream) {
-	case BA_PCM_STREAM_PLAYBACK:
-		t_pcm->fd = pipefd[0];
-		*fdptr = pipefd[1];
+	if (ret == -1 || sendmsg(op->client, &msg, MSG_NOSIGNAL) == -1) {
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+		ctl_pcm_open_release(t, op->pcm);
+		goto final;
+	}
+
+	/* fan-out the PCM to all other group members */
+	if (t->type == TRANSPORT_TYPE_A2DP && t->a2dp.group != 0)
+		debug("Linked group members: %d", transport_group_link(config.devices, t));
+
+final:
+	close(op->close_fd);
+	send(op->client, &status, sizeof(status), MSG_NOSIGNAL);
+	close(op->client);
+	free(op);
+}
+
+static void ctl_thread_cmd_pcm_open(const struct ba_request *req, int fd) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	struct ctl_pcm_open *op = NULL;
+	struct ba_transport *t;
+	struct ba_pcm *t_pcm;
+	int pipefd[2] = { -1, -1 };
+	int memfd = -1;
+
+	debug("PCM requested for %s type %d stream %d transfer %d sampling %u format %u",
+			batostr_(&req->addr), req->type, req->stream, req->transfer, req->sampling, req->format);
+
+	pthread_mutex_lock(&config.devices_mutex);
+
+	switch (_transport_lookup(config.devices, ctl_client_hci_dev_id(fd), &req->addr, req->type, req->stream, &t)) {
+	case -1:
+		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
+		goto fail_lookup;
+	case -2:
+		status.code = BA_STATUS_CODE_STREAM_NOT_FOUND;
+		goto fail_lookup;
+	}
+
+	pthread_mutex_lock(&t->mutex);
+
+	if ((t_pcm = _transport_get_pcm(t, req->stream)) == NULL) {
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+		goto final;
+	}
+
+	if (t_pcm->fd != -1) {
+		debug("PCM already requested: %d", t_pcm->fd);
+		status.code = BA_STATUS_CODE_DEVICE_BUSY;
+		goto final;
+	}
+
+	/* transport is used by the group, which is controlled by the leader */
+	if (t->type == TRANSPORT_TYPE_A2DP &&
+			transport_group_lookup_leader(config.devices, t->a2dp.group) != NULL) {
+		debug("PCM used by the transport group: %u", t->a2dp.group);
+		status.code = BA_STATUS_CODE_DEVICE_BUSY;
+		goto final;
+	}
+
+	if (req->stream != BA_PCM_STREAM_PLAYBACK &&
+			req->stream != BA_PCM_STREAM_CAPTURE) {
+		debug("Invalid PCM stream type: %d", req->stream);
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+		goto final;
+	}
+
+	if (t_pcm->shm.ctrl != NULL) {
+		/* The shared memory left by the previous client might be still used by
+		 * the IO thread - the ring is only marked as closed upon the release.
+		 * Before unmapping it, wait until the IO thread dispatches the PCM
+		 * close, which means that it has returned to its main loop. The IO
+		 * thread might need the transport lock in the meantime. */
+		struct ba_transport_cmd cmd = { .sig = TRANSPORT_PCM_CLOSE };
+		pthread_mutex_unlock(&t->mutex);
+		int ret = transport_send_command_sync(t, &cmd);
+		pthread_mutex_lock(&t->mutex);
+		if (ret == -1 && (!pthread_equal(t->thread, config.main_thread) ||
+					io_engine_task_running(&t->task))) {
+			error("Couldn't quiesce IO thread: %s", strerror(errno));
+			status.code = BA_STATUS_CODE_DEVICE_BUSY;
+			goto final;
+		}
+	}
+
+	/* release shared memory left by the previous client */
+	pcm_ring_free(&t_pcm->shm);
+	resampler_free(&t_pcm->rs);
+	t_pcm->residue_len = 0;
+
+	const unsigned int sampling = transport_get_sampling(t);
+	const bool resample = req->sampling != 0 && req->sampling != sampling;
+
+	/* Formats other than the default one are passed to the encoder directly,
+	 * so they can not be resampled nor fanned-out to the group members. */
+	if (req->format > BA_PCM_FORMAT_ENCODED ||
+			!(transport_get_pcm_formats(t) & (1 << req->format)) ||
+			(req->format != BA_PCM_FORMAT_S16_LE && (resample || t->a2dp.group != 0))) {
+		debug("PCM format not available: %u", req->format);
+		status.code = BA_STATUS_CODE_FORBIDDEN;
+		goto final;
+	}
+
+	if (resample) {
+
+		if (t->type != TRANSPORT_TYPE_A2DP ||
+				config.a2dp.resampler == RESAMPLER_QUALITY_NONE) {
+			debug("PCM resampling not available: %u != %u", req->sampling, sampling);
+			status.code = BA_STATUS_CODE_FORBIDDEN;
+			goto final;
+		}
+
+		/* playback signal is converted to the transport sampling rate,
+		 * while the capture is converted in the opposite direction */
+		const bool playback = req->stream == BA_PCM_STREAM_PLAYBACK;
+		if (resampler_init(&t_pcm->rs, config.a2dp.resampler, transport_get_channels(t),
+					playback ? req->sampling : sampling, playback ? sampling : req->sampling) == -1) {
+			error("Couldn't create resampler: %s", strerror(errno));
+			status.code = BA_STATUS_CODE_FORBIDDEN;
+			goto final;
+		}
+
+	}
+
+	/* The status page is created only once, and it is kept until the
+	 * transport is freed, so the IO thread can use it without locking.
+	 * It is not essential for the PCM operation, though. */
+	if (t_pcm->status.page == NULL &&
+			pcm_status_create(&t_pcm->status) == -1)
+		warn("Couldn't create PCM status page: %s", strerror(errno));
+
+	/* The client socket is duplicated, so the completion will not send the
+	 * reply to a reused descriptor, if the client disconnects meanwhile. */
+	if ((op = calloc(1, sizeof(*op))) == NULL ||
+			(op->client = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+		error("Couldn't create PCM open request: %s", strerror(errno));
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+		goto fail;
+	}
+
+	op->pcm = t_pcm;
+	t_pcm->format = req->format;
+
+	switch (req->transfer) {
+	case BA_PCM_TRANSFER_FIFO:
+
+		if (pipe(pipefd) == -1) {
+			error("Couldn't create FIFO: %s", strerror(errno));
+			status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+			goto fail;
+		}
+
+		if (req->stream == BA_PCM_STREAM_PLAYBACK) {
+			t_pcm->fd = pipefd[0];
+			op->fds[0] = pipefd[1];
+		}
+		else {
+			t_pcm->fd = pipefd[1];
+			op->fds[0] = pipefd[0];
+		}
+
+		/* Our end of the FIFO is non-blocking, so the IO engine worker will
+		 * never stall on it. The client end is not affected. */
+		fcntl(t_pcm->fd, F_SETFL, fcntl(t_pcm->fd, F_GETFL) | O_NONBLOCK);
+
+		op->close_fd = op->fds[0];
+		op->fds_count = 1;
 		break;
-	case BA_PCM_STREAM_CAPTURE:
-		t_pcm->fd = pipefd[1];
-		*fdptr = pipefd[0];
+
+	case BA_PCM_TRANSFER_SHM: {
+
+		/* The size of the ring is comparable with the size of the pipe buffer
+		 * used by the PCM plug-in in the playback mode. For capture use bigger
+		 * ring, so the client will be able to read whole periods. */
+		size_t size = req->stream == BA_PCM_STREAM_PLAYBACK ? 4096 : 65536;
+
+		if ((memfd = pcm_ring_create(&t_pcm->shm, size)) == -1) {
+			error("Couldn't create PCM ring: %s", strerror(errno));
+			status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+			goto fail;
+		}
+
+		/* In the playback mode we are the reader, so we will wait for data,
+		 * otherwise we will wait for a space in the ring buffer. */
+		t_pcm->fd = req->stream == BA_PCM_STREAM_PLAYBACK ?
+			t_pcm->shm.data_fd : t_pcm->shm.space_fd;
+
+		op->fds[0] = memfd;
+		op->fds[1] = t_pcm->shm.data_fd;
+		op->fds[2] = t_pcm->shm.space_fd;
+		op->close_fd = memfd;
+		op->fds_count = 3;
 		break;
-	case BA_PCM_STREAM_DUPLEX:
-		debug("Invalid PCM stream type: %d", req->stream);
+	}
+
+	default:
+		debug("Invalid PCM transfer mode: %d", req->transfer);
 		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
 		goto fail;
 	}
 
+	/* From now on, the PCM is associated with the client, so if the client
+	 * disconnects before the request is completed, the PCM is released. */
+	transport_set_pcm_client(t, t_pcm, fd);
+
 	/* Notify our IO thread, that the FIFO has just been created - it may be
-	 * used for poll() right away. */
-	transport_send_signal(t, TRANSPORT_PCM_OPEN);
+	 * used for poll() right away. The negotiated sample format is passed to
+	 * the IO thread, so the encoder can be reconfigured if needed. */
+	struct ba_transport_cmd cmd = {
+		.sig = TRANSPORT_PCM_OPEN,
+		.reconfig = { .format_valid = true, .format = t_pcm->format },
+	};
+	transport_send_command(t, &cmd);
 
 	/* A2DP source profile should be initialized (acquired) only if the audio
 	 * is about to be transfered. It is most likely, that BT headset will not
 	 * run voltage converter (power-on its circuit board) until the transport
-	 * is acquired - in order to extend battery life. */
-	if (t->profile == BLUETOOTH_PROFILE_A2DP_SOURCE)
-		if (transport_acquire_bt_a2dp(t) == -1) {
+	 * is acquired - in order to extend battery life. The acquisition might
+	 * take a while, so the request is completed asynchronously, in order not
+	 * to block other clients or BlueZ callbacks in the meantime. */
+	if (t->profile == BLUETOOTH_PROFILE_A2DP_SOURCE) {
+		t_pcm->open_request = op;
+		if (transport_acquire_bt_a2dp_async(t, ctl_thread_pcm_open_complete, op) == -1) {
 			status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+			t_pcm->open_request = NULL;
+			transport_set_pcm_client(t, t_pcm, -1);
 			goto fail;
 		}
+	}
+	else
+		ctl_thread_pcm_open_complete(t, 0, op);
 
-	if (sendmsg(fd, &msg, 0) == -1)
-		goto fail;
-
-	t_pcm->client = fd;
-	close(*fdptr);
-	goto final;
+	pthread_mutex_unlock(&t->mutex);
+	pthread_mutex_unlock(&config.devices_mutex);
+	return;
 
 fail:
-	close(pipefd[0]);
-	close(pipefd[1]);
+	if (memfd != -1) {
+		close(memfd);
+		pcm_ring_free(&t_pcm->shm);
+	}
+	resampler_free(&t_pcm->rs);
+	if (pipefd[0] != -1) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
 	t_pcm->fd = -1;
+	if (op != NULL && op->client != -1)
+		close(op->client);
+	free(op);
 
 final:
 	pthread_mutex_unlock(&t->mutex);
@@ -441,6 +912,65 @@ fail_lookup:
 	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
 }
 
+static void ctl_thread_cmd_pcm_status(const struct ba_request *req, int fd) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	struct ba_transport *t;
+	struct ba_pcm *t_pcm;
+	int status_fd = -1;
+
+	pthread_mutex_lock(&config.devices_mutex);
+
+	switch (_transport_lookup(config.devices, ctl_client_hci_dev_id(fd), &req->addr, req->type, req->stream, &t)) {
+	case -1:
+		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
+		goto fail;
+	case -2:
+		status.code = BA_STATUS_CODE_STREAM_NOT_FOUND;
+		goto fail;
+	}
+
+	if ((t_pcm = _transport_get_pcm(t, req->stream)) == NULL ||
+			t_pcm->status.page == NULL) {
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+		goto fail;
+	}
+
+	/* the client shall not be able to modify the status page */
+	if ((status_fd = pcm_status_dup_readonly(&t_pcm->status)) == -1) {
+		error("Couldn't duplicate PCM status page: %s", strerror(errno));
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+		goto fail;
+	}
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr _align;
+	} control_un;
+	struct iovec io = { .iov_base = "", .iov_len = 1 };
+	struct msghdr msg = {
+		.msg_iov = &io,
+		.msg_iovlen = 1,
+		.msg_control = control_un.buf,
+		.msg_controllen = CMSG_SPACE(sizeof(int)),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	*(int *)CMSG_DATA(cmsg) = status_fd;
+
+	if (sendmsg(fd, &msg, 0) == -1)
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+
+	close(status_fd);
+
+fail:
+	pthread_mutex_unlock(&config.devices_mutex);
+	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+}
+
 static void ctl_thread_cmd_pcm_close(const struct ba_request *req, int fd) {
 
 	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
@@ -451,7 +981,7 @@ static void ctl_thread_cmd_pcm_close(const struct ba_request *req, int fd) {
 
 	pthread_mutex_lock(&config.devices_mutex);
 
-	switch (_transport_lookup(config.devices, &req->addr, req->type, req->stream, &t)) {
+	switch (_transport_lookup(config.devices, ctl_client_hci_dev_id(fd), &req->addr, req->type, req->stream, &t)) {
 	case -1:
 		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
 		goto fail_lookup;
@@ -474,6 +1004,7 @@ static void ctl_thread_cmd_pcm_close(const struct ba_request *req, int fd) {
 
 	_transport_release_pcm(t, fd);
 	transport_send_signal(t, TRANSPORT_PCM_CLOSE);
+	transport_group_signal(config.devices, t, TRANSPORT_PCM_CLOSE);
 
 fail:
 	pthread_mutex_unlock(&t->mutex);
@@ -490,7 +1021,7 @@ static void ctl_thread_cmd_pcm_control(const struct ba_request *req, int fd) {
 
 	pthread_mutex_lock(&config.devices_mutex);
 
-	switch (_transport_lookup(config.devices, &req->addr, req->type, req->stream, &t)) {
+	switch (_transport_lookup(config.devices, ctl_client_hci_dev_id(fd), &req->addr, req->type, req->stream, &t)) {
 	case -1:
 		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
 		goto fail;
@@ -521,7 +1052,11 @@ static void ctl_thread_cmd_pcm_control(const struct ba_request *req, int fd) {
 		transport_send_signal(t, TRANSPORT_PCM_RESUME);
 		break;
 	case BA_COMMAND_PCM_DRAIN:
-		transport_drain_pcm(t);
+		/* status will be sent upon the drain completion */
+		if (transport_drain_pcm(t) == 1) {
+			pthread_mutex_unlock(&config.devices_mutex);
+			return;
+		}
 		break;
 	default:
 		warn("Invalid PCM control command: %d", req->command);
@@ -539,18 +1074,150 @@ static void ctl_thread_cmd_rfcomm_send(const struct ba_request *req, int fd) {
 
 	pthread_mutex_lock(&config.devices_mutex);
 
-	if (_transport_lookup_rfcomm(config.devices, &req->addr, &t) != 0) {
+	if (_transport_lookup_rfcomm(config.devices, ctl_client_hci_dev_id(fd), &req->addr, &t) != 0) {
 		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
 		goto fail;
 	}
 
-	transport_send_rfcomm(t, req->rfcomm_command);
+	/* the client shall retry, if the RFCOMM thread is not keeping up */
+	if (transport_send_rfcomm(t, req->rfcomm_command) == -1)
+		status.code = errno == EAGAIN ? BA_STATUS_CODE_DEVICE_BUSY : BA_STATUS_CODE_ERROR_UNKNOWN;
 
 fail:
 	pthread_mutex_unlock(&config.devices_mutex);
 	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
 }
 
+/**
+ * Send the status to clients waiting for the PCM drain completion. */
+static void ctl_thread_pcm_drained(void) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	GHashTableIter iter_d, iter_t;
+	struct ba_device *d;
+	struct ba_transport *t;
+
+	pthread_mutex_lock(&config.devices_mutex);
+
+	g_hash_table_iter_init(&iter_d, config.devices);
+	while (g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d)) {
+		g_hash_table_iter_init(&iter_t, d->transports);
+		while (g_hash_table_iter_next(&iter_t, NULL, (gpointer)&t)) {
+
+			struct ba_pcm *pcm = NULL;
+			int state = BA_PCM_DRAIN_DONE;
+
+			switch (t->type) {
+			case TRANSPORT_TYPE_A2DP:
+				pcm = &t->a2dp.pcm;
+				break;
+			case TRANSPORT_TYPE_RFCOMM:
+				break;
+			case TRANSPORT_TYPE_SCO:
+				pcm = &t->sco.spk_pcm;
+				break;
+			}
+
+			if (pcm != NULL &&
+					atomic_compare_exchange_strong(&pcm->drain, &state, BA_PCM_DRAIN_NONE) &&
+					pcm->client != -1) {
+				debug("Sending PCM drain status: %d", pcm->client);
+				send(pcm->client, &status, sizeof(status), MSG_NOSIGNAL);
+			}
+
+		}
+	}
+
+	pthread_mutex_unlock(&config.devices_mutex);
+}
+
+/**
+ * Register new client connection.
+ *
+ * The client table is indexed by the socket file descriptor, so it is
+ * extended to cover the new descriptor if needed.
+ *
+ * @param fd Accepted client socket file descriptor.
+ * @param hci_dev_id HCI device ID of the controller socket.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int ctl_client_add(int fd, int hci_dev_id) {
+
+	if ((size_t)fd >= config.ctl.clients_size) {
+
+		size_t size = config.ctl.clients_size > 0 ? config.ctl.clients_size : 16;
+		struct ba_ctl_client *clients;
+		size_t i;
+
+		while (size <= (size_t)fd)
+			size *= 2;
+		if ((clients = realloc(config.ctl.clients, size * sizeof(*clients))) == NULL)
+			return -1;
+
+		for (i = config.ctl.clients_size; i < size; i++)
+			clients[i].fd = -1;
+		config.ctl.clients = clients;
+		config.ctl.clients_size = size;
+
+	}
+
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+	if (epoll_ctl(config.ctl.efd, EPOLL_CTL_ADD, fd, &event) == -1)
+		return -1;
+
+	config.ctl.clients[fd].fd = fd;
+	config.ctl.clients[fd].version = 0;
+	config.ctl.clients[fd].subs = 0;
+	config.ctl.clients[fd].event_seq = 0;
+	config.ctl.clients[fd].hci_dev_id = hci_dev_id;
+	return 0;
+}
+
+/**
+ * Close client connection and release associated resources. */
+static void ctl_client_close(struct ba_ctl_client *c) {
+
+	struct ba_transport *t;
+
+	pthread_mutex_lock(&config.devices_mutex);
+
+	/* release all transports which were opened with this connection */
+	while ((t = transport_lookup_pcm_client(config.devices, c->fd)) != NULL) {
+		_transport_release_pcm(t, c->fd);
+		transport_send_signal(t, TRANSPORT_PCM_CLOSE);
+		transport_group_signal(config.devices, t, TRANSPORT_PCM_CLOSE);
+	}
+
+	pthread_mutex_unlock(&config.devices_mutex);
+
+	/* closing the socket removes it from the epoll set */
+	close(c->fd);
+	c->fd = -1;
+}
+
+/**
+ * Receive the protocol version from the new client. */
+static void ctl_client_handshake(struct ba_ctl_client *c) {
+
+	uint16_t ver = 0;
+
+	if (recv(c->fd, &ver, sizeof(ver), MSG_DONTWAIT) != sizeof(ver)) {
+		warn("Couldn't receive protocol version: %s", strerror(errno));
+		close(c->fd);
+		c->fd = -1;
+	}
+	else if (ver < BLUEALSA_CRL_PROTO_VERSION_MIN || ver > BLUEALSA_CRL_PROTO_VERSION) {
+		warn("Invalid protocol version: %#06x != %#06x", ver, BLUEALSA_CRL_PROTO_VERSION);
+		close(c->fd);
+		c->fd = -1;
+	}
+	else {
+		debug("New client accepted: %d", c->fd);
+		c->version = ver;
+	}
+
+}
+
 static void *ctl_thread(void *arg) {
 	(void)arg;
 
@@ -567,56 +1234,123 @@ static void *ctl_thread(void *arg) {
 		[BA_COMMAND_PCM_RESUME] = ctl_thread_cmd_pcm_control,
 		[BA_COMMAND_PCM_DRAIN] = ctl_thread_cmd_pcm_control,
 		[BA_COMMAND_RFCOMM_SEND] = ctl_thread_cmd_rfcomm_send,
+		[BA_COMMAND_TRANSPORT_STATS] = ctl_thread_cmd_transport_stats,
+		[BA_COMMAND_PCM_STATUS] = ctl_thread_cmd_pcm_status,
+		[BA_COMMAND_TRANSPORT_SET_GROUP] = ctl_thread_cmd_transport_set_group,
+		[BA_COMMAND_TRANSPORT_STANDBY] = ctl_thread_cmd_transport_standby,
+		[BA_COMMAND_CAPTURE] = ctl_thread_cmd_capture,
 	};
 
+	struct epoll_event events[16];
+	int i, count;
+
 	debug("Starting controller loop");
 	while (config.ctl.thread_created) {
 
-		if (poll(config.ctl.pfds, ARRAYSIZE(config.ctl.pfds), -1) == -1) {
+		if ((count = epoll_wait(config.ctl.efd, events, ARRAYSIZE(events), -1)) == -1) {
 			if (errno == EINTR)
 				continue;
 			error("Controller poll error: %s", strerror(errno));
 			break;
 		}
 
-		/* Clients handling loop will update this variable to point to the
-		 * first available client structure, which might be later used by
-		 * the connection handling loop. */
-		struct pollfd *pfd = NULL;
-		size_t i;
+		for (i = 0; i < count; i++) {
+			const int fd = events[i].data.fd;
+			size_t srv;
 
-		/* handle data transmission with connected clients */
-		for (i = __CTL_IDX_MAX; i < __CTL_IDX_MAX + BLUEALSA_MAX_CLIENTS; i++) {
-			const int fd = config.ctl.pfds[i].fd;
+			for (srv = 0; srv < config.ctl.srv_bound; srv++)
+				if (fd == config.ctl.srv[srv])
+					break;
+
+			if (srv < config.ctl.srv_bound) {
+				/* process new connections to our controller */
+
+				const int hci_dev_id = config.hci_devs[srv].dev_id;
+				int client;
+
+				while ((client = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+					debug("Received new connection: %s: %d", config.hci_devs[srv].name, client);
+					if (ctl_client_add(client, hci_dev_id) == -1) {
+						error("Couldn't register new client: %s", strerror(errno));
+						close(client);
+					}
+				}
+
+				continue;
+			}
+
+			if (fd == config.ctl.evt[0]) {
+				/* generate notifications for subscribed clients */
+
+				struct ba_msg_event_v2 event = { 0 };
+				size_t j;
+
+				if (read(fd, &event, sizeof(event)) == -1)
+					warn("Couldn't read controller event: %s", strerror(errno));
+
+				/* internal event - not delivered to clients */
+				if (event.mask == 0)
+					ctl_thread_pcm_drained();
+
+				const struct ba_msg_event event_v1 = { .mask = event.mask };
+
+				for (j = 0; j < config.ctl.clients_size; j++) {
+
+					struct ba_ctl_client *c = &config.ctl.clients[j];
+					if (c->fd == -1 || !(c->subs & event.mask))
+						continue;
+
+					if (!(c->subs & BA_EVENT_V2)) {
+						debug("Sending notification: %B => %d", event.mask, c->fd);
+						send(c->fd, &event_v1, sizeof(event_v1), MSG_NOSIGNAL);
+						continue;
+					}
+
+					/* The v2 event is sent without blocking, so the client which
+					 * does not keep up with events can not stall the controller.
+					 * The lost event is reported with the sequence number gap. */
+					event.seq = ++c->event_seq;
+					debug("Sending notification: %B [%u] => %d", event.mask, event.seq, c->fd);
+					if (send(c->fd, &event, sizeof(event), MSG_NOSIGNAL | MSG_DONTWAIT) == -1)
+						debug("Couldn't send notification: %d: %s", c->fd, strerror(errno));
+
+				}
 
-			if (fd == -1) {
-				pfd = &config.ctl.pfds[i];
 				continue;
 			}
 
-			if (config.ctl.pfds[i].revents & POLLIN) {
+			struct ba_ctl_client *c;
+			if ((c = ctl_client_lookup(fd)) == NULL)
+				continue;
+
+			if (c->version == 0) {
+				ctl_client_handshake(c);
+				continue;
+			}
+
+			/* Handle data transmission with the connected client. Several
+			 * queued requests are served at once, but the limit keeps other
+			 * clients from being starved by a single busy one. */
+
+			size_t n;
+			for (n = 0; n < BLUEALSA_CTL_REQUESTS && c->fd != -1; n++) {
 
 				struct ba_request request;
 				ssize_t len;
 
 				if ((len = recv(fd, &request, sizeof(request), MSG_DONTWAIT)) != sizeof(request)) {
-					/* if the request cannot be retrieved, release resources */
 
+					if (len == -1 && errno == EAGAIN)
+						break;
+
+					/* if the request cannot be retrieved, release resources */
 					if (len == 0)
 						debug("Client closed connection: %d", fd);
 					else
 						debug("Invalid request length: %zd != %zd", len, sizeof(request));
 
-					struct ba_transport *t;
-					if ((t = transport_lookup_pcm_client(config.devices, fd)) != NULL) {
-						_transport_release_pcm(t, fd);
-						transport_send_signal(t, TRANSPORT_PCM_CLOSE);
-					}
-
-					config.ctl.pfds[i].fd = -1;
-					config.ctl.subs[i - __CTL_IDX_MAX] = 0;
-					close(fd);
-					continue;
+					ctl_client_close(c);
+					break;
 				}
 
 				/* validate and execute requested command */
@@ -629,50 +1363,6 @@ static void *ctl_thread(void *arg) {
 
 		}
 
-		/* process new connections to our controller */
-		if (config.ctl.pfds[CTL_IDX_SRV].revents & POLLIN && pfd != NULL) {
-
-			struct pollfd fd = { -1, POLLIN, 0 };
-			uint16_t ver = 0;
-
-			fd.fd = accept(config.ctl.pfds[CTL_IDX_SRV].fd, NULL, NULL);
-			debug("Received new connection: %d", fd.fd);
-
-			errno = ETIMEDOUT;
-			if (poll(&fd, 1, 500) <= 0 ||
-					recv(fd.fd, &ver, sizeof(ver), MSG_DONTWAIT) != sizeof(ver)) {
-				warn("Couldn't receive protocol version: %s", strerror(errno));
-				close(fd.fd);
-			}
-			else if (ver != BLUEALSA_CRL_PROTO_VERSION) {
-				warn("Invalid protocol version: %#06x != %#06x", ver, BLUEALSA_CRL_PROTO_VERSION);
-				close(fd.fd);
-			}
-			else {
-				debug("New client accepted: %d", fd.fd);
-				pfd->fd = fd.fd;
-			}
-
-		}
-
-		/* generate notifications for subscribed clients */
-		if (config.ctl.pfds[CTL_IDX_EVT].revents & POLLIN) {
-
-			struct ba_msg_event event = { 0 };
-			size_t i;
-
-			if (read(config.ctl.pfds[CTL_IDX_EVT].fd, &event.mask, sizeof(event.mask)) == -1)
-				warn("Couldn't read controller event: %s", strerror(errno));
-
-			for (i = 0; i < BLUEALSA_MAX_CLIENTS; i++)
-				if (config.ctl.subs[i] & event.mask) {
-					const int client = config.ctl.pfds[i + __CTL_IDX_MAX].fd;
-					debug("Sending notification: %B => %d", event.mask, client);
-					send(client, &event, sizeof(event), MSG_NOSIGNAL);
-				}
-
-		}
-
 		debug("+-+-");
 	}
 
@@ -688,47 +1378,62 @@ int bluealsa_ctl_thread_init(void) {
 		return -1;
 	}
 
-	{ /* initialize (mark as closed) all sockets */
-		size_t i;
-		for (i = 0; i < ARRAYSIZE(config.ctl.pfds); i++) {
-			config.ctl.pfds[i].events = POLLIN;
-			config.ctl.pfds[i].fd = -1;
-		}
-	}
-
-	struct sockaddr_un saddr = { .sun_family = AF_UNIX };
-	snprintf(saddr.sun_path, sizeof(saddr.sun_path) - 1,
-			BLUEALSA_RUN_STATE_DIR "/%s", config.hci_dev.name);
+	size_t i;
 
 	if (mkdir(BLUEALSA_RUN_STATE_DIR, 0755) == -1 && errno != EEXIST) {
 		error("Couldn't create run-state directory: %s", strerror(errno));
 		goto fail;
 	}
-	if ((config.ctl.pfds[CTL_IDX_SRV].fd = socket(PF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
-		error("Couldn't create controller socket: %s", strerror(errno));
-		goto fail;
-	}
 
-	if (bind(config.ctl.pfds[CTL_IDX_SRV].fd, (struct sockaddr *)(&saddr), sizeof(saddr)) == -1) {
-		error("Couldn't bind controller socket: %s", strerror(errno));
-		goto fail;
+	/* Every used HCI device has its own controller socket. All of them are
+	 * served by the same controller thread, though. */
+	for (i = 0; i < config.hci_devs_len; i++) {
+
+		struct sockaddr_un saddr = { .sun_family = AF_UNIX };
+		snprintf(saddr.sun_path, sizeof(saddr.sun_path) - 1,
+				BLUEALSA_RUN_STATE_DIR "/%s", config.hci_devs[i].name);
+
+		if ((config.ctl.srv[i] = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+			error("Couldn't create controller socket: %s", strerror(errno));
+			goto fail;
+		}
+
+		if (bind(config.ctl.srv[i], (struct sockaddr *)(&saddr), sizeof(saddr)) == -1) {
+			error("Couldn't bind controller socket: %s", strerror(errno));
+			goto fail;
+		}
+		config.ctl.srv_bound = i + 1;
+		if (chmod(saddr.sun_path, 0660) == -1 ||
+				chown(saddr.sun_path, -1, config.gid_audio) == -1) {
+			error("Couldn't set permission for controller socket: %s", strerror(errno));
+			goto fail;
+		}
+		if (listen(config.ctl.srv[i], SOMAXCONN) == -1) {
+			error("Couldn't listen on controller socket: %s", strerror(errno));
+			goto fail;
+		}
+
 	}
-	config.ctl.socket_created = true;
-	if (chmod(saddr.sun_path, 0660) == -1 ||
-			chown(saddr.sun_path, -1, config.gid_audio) == -1) {
-		error("Couldn't set permission for controller socket: %s", strerror(errno));
+
+	if (pipe(config.ctl.evt) == -1) {
+		error("Couldn't create controller event PIPE: %s", strerror(errno));
 		goto fail;
 	}
-	if (listen(config.ctl.pfds[CTL_IDX_SRV].fd, 2) == -1) {
-		error("Couldn't listen on controller socket: %s", strerror(errno));
+
+	if ((config.ctl.efd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		error("Couldn't create controller epoll: %s", strerror(errno));
 		goto fail;
 	}
 
-	if (pipe(config.ctl.evt) == -1) {
-		error("Couldn't create controller event PIPE: %s", strerror(errno));
-		goto fail;
+	struct epoll_event event = { .events = EPOLLIN };
+	for (i = 0; i < config.ctl.srv_bound; i++) {
+		event.data.fd = config.ctl.srv[i];
+		if (epoll_ctl(config.ctl.efd, EPOLL_CTL_ADD, config.ctl.srv[i], &event) == -1)
+			goto fail_epoll;
 	}
-	config.ctl.pfds[CTL_IDX_EVT].fd = config.ctl.evt[0];
+	event.data.fd = config.ctl.evt[0];
+	if (epoll_ctl(config.ctl.efd, EPOLL_CTL_ADD, config.ctl.evt[0], &event) == -1)
+		goto fail_epoll;
 
 	config.ctl.thread_created = true;
 	if ((errno = pthread_create(&config.ctl.thread, NULL, ctl_thread, NULL)) != 0) {
@@ -742,6 +1447,8 @@ int bluealsa_ctl_thread_init(void) {
 
 	return 0;
 
+fail_epoll:
+	error("Couldn't setup controller epoll: %s", strerror(errno));
 fail:
 	bluealsa_ctl_free();
 	return -1;
@@ -758,11 +1465,17 @@ void bluealsa_ctl_free(void) {
 		close(config.ctl.evt[0]);
 	if (config.ctl.evt[1] != -1)
 		close(config.ctl.evt[1]);
+	config.ctl.evt[0] = config.ctl.evt[1] = -1;
+
+	for (i = 0; i < HCI_MAX_DEV; i++) {
+		if (config.ctl.srv[i] != -1)
+			close(config.ctl.srv[i]);
+		config.ctl.srv[i] = -1;
+	}
 
-	config.ctl.pfds[CTL_IDX_EVT].fd = -1;
-	for (i = 0; i < ARRAYSIZE(config.ctl.pfds); i++)
-		if (config.ctl.pfds[i].fd != -1)
-			close(config.ctl.pfds[i].fd);
+	for (i = 0; i < config.ctl.clients_size; i++)
+		if (config.ctl.clients[i].fd != -1)
+			close(config.ctl.clients[i].fd);
 
 	if (created) {
 		pthread_cancel(config.ctl.thread);
@@ -770,14 +1483,140 @@ void bluealsa_ctl_free(void) {
 			error("Couldn't join controller thread: %s", strerror(errno));
 	}
 
-	if (config.ctl.socket_created) {
+	if (config.ctl.efd != -1)
+		close(config.ctl.efd);
+	config.ctl.efd = -1;
+
+	free(config.ctl.clients);
+	config.ctl.clients = NULL;
+	config.ctl.clients_size = 0;
+
+	/* remove only sockets which were bound by us */
+	for (i = 0; i < config.ctl.srv_bound; i++) {
 		char tmp[256] = BLUEALSA_RUN_STATE_DIR "/";
-		unlink(strcat(tmp, config.hci_dev.name));
-		config.ctl.socket_created = false;
+		unlink(strcat(tmp, config.hci_devs[i].name));
+	}
+	config.ctl.srv_bound = 0;
+
+}
+
+/**
+ * Get the transport state as reported to clients. */
+static enum ba_transport_state_code ctl_transport_state(const struct ba_transport *t) {
+	switch (t->state) {
+	case TRANSPORT_PENDING:
+		return BA_TRANSPORT_STATE_PENDING;
+	case TRANSPORT_ACTIVE:
+		return BA_TRANSPORT_STATE_ACTIVE;
+	case TRANSPORT_PAUSED:
+		return BA_TRANSPORT_STATE_PAUSED;
+	case TRANSPORT_IDLE:
+	case TRANSPORT_LIMBO:
+	default:
+		return BA_TRANSPORT_STATE_IDLE;
 	}
+}
+
+/**
+ * Get the bit-mask with fields carried by the given event. */
+static uint8_t ctl_event_fields(enum ba_event event) {
+	uint8_t fields = 0;
+	if (event & (BA_EVENT_TRANSPORT_ADDED | BA_EVENT_TRANSPORT_CHANGED))
+		fields |= BA_EVENT_FIELD_VOLUME | BA_EVENT_FIELD_DELAY |
+			BA_EVENT_FIELD_BATTERY | BA_EVENT_FIELD_STATE;
+	if (event & BA_EVENT_UPDATE_VOLUME)
+		fields |= BA_EVENT_FIELD_VOLUME;
+	if (event & BA_EVENT_UPDATE_DELAY)
+		fields |= BA_EVENT_FIELD_DELAY;
+	if (event & BA_EVENT_UPDATE_BATTERY)
+		fields |= BA_EVENT_FIELD_BATTERY;
+	if (event & BA_EVENT_UPDATE_STATE)
+		fields |= BA_EVENT_FIELD_STATE;
+	return fields;
+}
 
+static int ctl_event_write(const struct ba_msg_event_v2 *event) {
+	/* The event message is smaller than the PIPE_BUF, so it is written
+	 * atomically - events can be generated by many threads at once. */
+	return write(config.ctl.evt[1], event, sizeof(*event));
 }
 
+/**
+ * Notify subscribed clients about the event.
+ *
+ * For clients subscribed for the v2 event stream, this event is delivered
+ * without the transport identification. */
 int bluealsa_ctl_event(enum ba_event event) {
-	return write(config.ctl.evt[1], &event, sizeof(event));
+	const struct ba_msg_event_v2 msg = { .mask = event };
+	return ctl_event_write(&msg);
+}
+
+/**
+ * Notify subscribed clients about the transport event.
+ *
+ * The transport is not referenced by the controller thread, so the event
+ * payload is taken at the time of this call. It is safe to call this
+ * function for the transport which is about to be freed.
+ *
+ * @param event Event bit-mask.
+ * @param t Transport structure or NULL.
+ * @return This function returns the number of written bytes, or -1 upon
+ *   error. */
+int bluealsa_ctl_event_transport(enum ba_event event, const struct ba_transport *t) {
+
+	struct ba_msg_event_v2 msg = { .mask = event };
+	struct ba_msg_transport transport;
+
+	if (t == NULL)
+		return ctl_event_write(&msg);
+
+	_ctl_transport(t, &transport);
+
+	bacpy(&msg.addr, &transport.addr);
+	msg.type = transport.type;
+	msg.stream = transport.stream;
+
+	/* removed transport is reported with the identification only */
+	if (!(event & BA_EVENT_TRANSPORT_REMOVED)) {
+		msg.fields = ctl_event_fields(event);
+		msg.ch1_muted = transport.ch1_muted;
+		msg.ch1_volume = transport.ch1_volume;
+		msg.ch2_muted = transport.ch2_muted;
+		msg.ch2_volume = transport.ch2_volume;
+		msg.delay = transport.delay;
+		msg.battery = t->device->battery.enabled;
+		msg.battery_level = t->device->battery.level;
+		msg.state = ctl_transport_state(t);
+	}
+
+	return ctl_event_write(&msg);
+}
+
+/**
+ * Notify subscribed clients about the device event.
+ *
+ * @param event Event bit-mask.
+ * @param d Device structure.
+ * @return This function returns the number of written bytes, or -1 upon
+ *   error. */
+int bluealsa_ctl_event_device(enum ba_event event, const struct ba_device *d) {
+
+	struct ba_msg_event_v2 msg = {
+		.mask = event,
+		.type = BA_PCM_TYPE_NULL,
+		.fields = BA_EVENT_FIELD_BATTERY,
+		.battery = d->battery.enabled,
+		.battery_level = d->battery.level,
+	};
+
+	bacpy(&msg.addr, &d->addr);
+	return ctl_event_write(&msg);
+}
+
+/**
+ * Wake up the controller thread, so it will send the status to clients
+ * waiting for the PCM drain completion. */
+int bluealsa_ctl_pcm_drained(void) {
+	/* zero event mask is never delivered to clients */
+	return bluealsa_ctl_event(0);
 }
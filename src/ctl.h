@@ -13,9 +13,15 @@
 
 #include "ctl-proto.h"
 
+struct ba_device;
+struct ba_transport;
+
 int bluealsa_ctl_thread_init(void);
 void bluealsa_ctl_free(void);
 
 int bluealsa_ctl_event(enum ba_event event);
+int bluealsa_ctl_event_transport(enum ba_event event, const struct ba_transport *t);
+int bluealsa_ctl_event_device(enum ba_event event, const struct ba_device *d);
+int bluealsa_ctl_pcm_drained(void);
 
 #endif
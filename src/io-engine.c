@@ -0,0 +1,517 @@
+/*
+ * BlueALSA - io-engine.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "io-engine.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "shared/defs.h"
+#include "shared/log.h"
+
+struct io_engine_worker {
+
+	pthread_t thread;
+	int epoll_fd;
+
+	/* Event file descriptor used for notifying the worker about pending stop
+	 * requests (and about the worker termination request). */
+	int event_fd;
+
+	/* list of served tasks */
+	struct io_engine_task *tasks;
+	unsigned int tasks_count;
+
+	/* currently dispatched batch of events */
+	struct epoll_event events[IO_ENGINE_MAX_EVENTS];
+	int events_len;
+	int events_i;
+
+	/* there is a task stopped by the worker itself */
+	bool reap;
+	/* worker shall be terminated */
+	bool quit;
+
+};
+
+static struct {
+	/* mutex guarding tasks and workers state */
+	pthread_mutex_t mutex;
+	/* condition signaled upon every task termination */
+	pthread_cond_t stopped;
+	struct io_engine_worker *workers;
+	unsigned int workers_count;
+} engine = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.stopped = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Terminate task - this function shall be called by the worker thread. */
+static void io_engine_task_teardown(struct io_engine_worker *w, struct io_engine_task *task) {
+
+	struct io_engine_watch *watch;
+	struct io_engine_task **tmp;
+	int i;
+
+	for (watch = task->watches; watch != NULL; watch = watch->next) {
+		if (watch->fd != -1)
+			epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+		/* discard events which are pending in the current batch */
+		for (i = w->events_i + 1; i < w->events_len; i++)
+			if (w->events[i].data.ptr == watch)
+				w->events[i].data.ptr = NULL;
+	}
+
+	pthread_mutex_lock(&engine.mutex);
+	for (tmp = &w->tasks; *tmp != NULL; tmp = &(*tmp)->next)
+		if (*tmp == task) {
+			*tmp = task->next;
+			w->tasks_count--;
+			break;
+		}
+	task->watches = NULL;
+	pthread_mutex_unlock(&engine.mutex);
+
+	if (task->cleanup != NULL)
+		task->cleanup(task);
+
+	pthread_mutex_lock(&engine.mutex);
+	task->worker = NULL;
+	task->next = NULL;
+	task->state = IO_ENGINE_TASK_IDLE;
+	pthread_cond_broadcast(&engine.stopped);
+	pthread_mutex_unlock(&engine.mutex);
+
+}
+
+/**
+ * Terminate all tasks marked as stopping. */
+static void io_engine_worker_reap(struct io_engine_worker *w) {
+
+	struct io_engine_task *task;
+
+	for (;;) {
+
+		pthread_mutex_lock(&engine.mutex);
+		for (task = w->tasks; task != NULL; task = task->next)
+			if (task->state == IO_ENGINE_TASK_STOPPING)
+				break;
+		pthread_mutex_unlock(&engine.mutex);
+
+		if (task == NULL)
+			break;
+
+		io_engine_task_teardown(w, task);
+	}
+
+}
+
+static void *io_engine_worker_thread(void *arg) {
+	struct io_engine_worker *w = (struct io_engine_worker *)arg;
+
+	debug("Starting IO engine worker: %d", w->epoll_fd);
+
+	for (;;) {
+
+		if ((w->events_len = epoll_wait(w->epoll_fd, w->events,
+						ARRAYSIZE(w->events), -1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("IO engine poll error: %s", strerror(errno));
+			break;
+		}
+
+		for (w->events_i = 0; w->events_i < w->events_len; w->events_i++) {
+
+			struct epoll_event *event = &w->events[w->events_i];
+			struct io_engine_watch *watch = event->data.ptr;
+
+			/* watch was removed during this batch */
+			if (watch == NULL)
+				continue;
+
+			if (event->data.ptr == w) {
+
+				eventfd_t value;
+				eventfd_read(w->event_fd, &value);
+
+				pthread_mutex_lock(&engine.mutex);
+				bool quit = w->quit;
+				pthread_mutex_unlock(&engine.mutex);
+
+				if (quit)
+					goto final;
+
+				io_engine_worker_reap(w);
+				continue;
+			}
+
+			watch->callback(watch, event->events);
+
+			if (w->reap) {
+				w->reap = false;
+				io_engine_worker_reap(w);
+			}
+
+		}
+
+	}
+
+final:
+	debug("Exiting IO engine worker: %d", w->epoll_fd);
+	return NULL;
+}
+
+/**
+ * Initialize IO engine.
+ *
+ * @param workers The number of worker threads. If zero is given, the number
+ *   of worker threads will be equal to the number of online processors.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int io_engine_init(unsigned int workers) {
+
+	struct io_engine_worker *w;
+	unsigned int i;
+	int err;
+
+	if (workers == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? cpus : 1;
+	}
+
+	if ((engine.workers = calloc(workers, sizeof(*engine.workers))) == NULL)
+		return -1;
+
+	for (i = 0; i < workers; i++) {
+
+		w = &engine.workers[i];
+
+		if ((w->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+			goto fail;
+		if ((w->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+			err = errno;
+			close(w->epoll_fd);
+			errno = err;
+			goto fail;
+		}
+
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = w };
+		if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &event) == -1)
+			goto fail_worker;
+
+		if ((err = pthread_create(&w->thread, NULL, io_engine_worker_thread, w)) != 0) {
+			errno = err;
+			goto fail_worker;
+		}
+
+		pthread_setname_np(w->thread, "baio");
+		engine.workers_count++;
+
+	}
+
+	debug("Created IO engine with %u workers", workers);
+	return 0;
+
+fail_worker:
+	err = errno;
+	close(w->epoll_fd);
+	close(w->event_fd);
+	errno = err;
+fail:
+	err = errno;
+	io_engine_free();
+	errno = err;
+	return -1;
+}
+
+/**
+ * Terminate IO engine workers and free resources.
+ *
+ * Tasks which are still running are not stopped. */
+void io_engine_free(void) {
+
+	unsigned int i;
+
+	for (i = 0; i < engine.workers_count; i++) {
+		struct io_engine_worker *w = &engine.workers[i];
+
+		pthread_mutex_lock(&engine.mutex);
+		w->quit = true;
+		pthread_mutex_unlock(&engine.mutex);
+
+		eventfd_write(w->event_fd, 1);
+		pthread_join(w->thread, NULL);
+
+		close(w->epoll_fd);
+		close(w->event_fd);
+	}
+
+	free(engine.workers);
+	engine.workers = NULL;
+	engine.workers_count = 0;
+
+}
+
+/**
+ * Check whether the IO engine is initialized. */
+bool io_engine_enabled(void) {
+	return engine.workers_count > 0;
+}
+
+/**
+ * Add file descriptor watch to the task.
+ *
+ * This function shall be called before the task is started. Watches with
+ * the file descriptor set to -1 are not monitored until the descriptor is
+ * set with the io_engine_watch_set_fd() function. */
+void io_engine_task_add_watch(struct io_engine_task *task,
+		struct io_engine_watch *watch) {
+	watch->task = task;
+	watch->next = task->watches;
+	task->watches = watch;
+}
+
+/**
+ * Start IO task.
+ *
+ * The task is assigned to the least loaded worker.
+ *
+ * @param task Address of the task structure with watches already added.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int io_engine_task_start(struct io_engine_task *task) {
+
+	struct io_engine_worker *w = NULL;
+	struct io_engine_watch *watch;
+	unsigned int i;
+	int ret = -1;
+
+	pthread_mutex_lock(&engine.mutex);
+
+	if (task->state != IO_ENGINE_TASK_IDLE) {
+		errno = EBUSY;
+		goto final;
+	}
+
+	for (i = 0; i < engine.workers_count; i++)
+		if (w == NULL || engine.workers[i].tasks_count < w->tasks_count)
+			w = &engine.workers[i];
+
+	if (w == NULL) {
+		errno = ENODEV;
+		goto final;
+	}
+
+	/* Worker has to be known before any watch is registered - callbacks might
+	 * be called right away (before this function returns). */
+	task->worker = w;
+	task->state = IO_ENGINE_TASK_RUNNING;
+
+	for (watch = task->watches; watch != NULL; watch = watch->next) {
+		struct epoll_event event = { .events = watch->events, .data.ptr = watch };
+		if (watch->fd != -1 &&
+				epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, watch->fd, &event) == -1) {
+			int err = errno;
+			struct io_engine_watch *tmp;
+			for (tmp = task->watches; tmp != watch; tmp = tmp->next)
+				if (tmp->fd != -1)
+					epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, tmp->fd, NULL);
+			task->worker = NULL;
+			task->state = IO_ENGINE_TASK_IDLE;
+			errno = err;
+			goto final;
+		}
+	}
+
+	task->next = w->tasks;
+	w->tasks = task;
+	w->tasks_count++;
+	ret = 0;
+
+final:
+	pthread_mutex_unlock(&engine.mutex);
+	return ret;
+}
+
+/**
+ * Stop IO task.
+ *
+ * Upon return, the task cleanup function has been called, unless this
+ * function is called from within the worker thread serving given task. In
+ * such case the task will be terminated as soon as the current callback
+ * returns - just like the pthread_cancel() called for the current thread.
+ *
+ * @param task Address of the task structure. */
+void io_engine_task_stop(struct io_engine_task *task) {
+
+	pthread_mutex_lock(&engine.mutex);
+
+	if (task->state == IO_ENGINE_TASK_IDLE)
+		goto final;
+
+	struct io_engine_worker *w = task->worker;
+	const bool self = pthread_equal(w->thread, pthread_self());
+
+	if (task->state == IO_ENGINE_TASK_RUNNING) {
+		task->state = IO_ENGINE_TASK_STOPPING;
+		if (self)
+			w->reap = true;
+		else
+			eventfd_write(w->event_fd, 1);
+	}
+
+	if (self)
+		goto final;
+
+	while (task->state != IO_ENGINE_TASK_IDLE)
+		pthread_cond_wait(&engine.stopped, &engine.mutex);
+
+final:
+	pthread_mutex_unlock(&engine.mutex);
+}
+
+/**
+ * Check whether the task is running. */
+bool io_engine_task_running(struct io_engine_task *task) {
+	pthread_mutex_lock(&engine.mutex);
+	bool running = task->state != IO_ENGINE_TASK_IDLE;
+	pthread_mutex_unlock(&engine.mutex);
+	return running;
+}
+
+/**
+ * Modify events requested for the watch.
+ *
+ * This function shall be called from within the task callback.
+ *
+ * @param watch Address of the watch structure.
+ * @param events New set of epoll events. Zero disarms the watch.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int io_engine_watch_set_events(struct io_engine_watch *watch, uint32_t events) {
+	struct epoll_event event = { .events = events, .data.ptr = watch };
+	watch->events = events;
+	if (watch->fd == -1)
+		return 0;
+	return epoll_ctl(watch->task->worker->epoll_fd, EPOLL_CTL_MOD, watch->fd, &event);
+}
+
+/**
+ * Replace file descriptor monitored by the watch.
+ *
+ * This function shall be called from within the task callback. Caller is
+ * responsible for closing the old file descriptor - if required. The new
+ * file descriptor is registered even if its number is equal to the old one,
+ * because the old descriptor might have been closed in the meantime.
+ *
+ * @param watch Address of the watch structure.
+ * @param fd New file descriptor or -1 in order to stop monitoring.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int io_engine_watch_set_fd(struct io_engine_watch *watch, int fd) {
+
+	struct io_engine_worker *w = watch->task->worker;
+	struct epoll_event event = { .events = watch->events, .data.ptr = watch };
+	int i;
+
+	if (watch->fd == -1 && fd == -1)
+		return 0;
+
+	if (watch->fd != -1) {
+		epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+		/* events of the old descriptor are no longer valid */
+		for (i = w->events_i + 1; i < w->events_len; i++)
+			if (w->events[i].data.ptr == watch)
+				w->events[i].data.ptr = NULL;
+	}
+
+	watch->fd = fd;
+	if (fd == -1)
+		return 0;
+
+	return epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void io_engine_timer_dispatch(struct io_engine_watch *watch, uint32_t events) {
+	struct io_engine_timer *timer = (struct io_engine_timer *)watch;
+	(void)events;
+
+	uint64_t expirations = 0;
+	if (read(watch->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	timer->callback(timer, expirations);
+
+}
+
+/**
+ * Initialize timer watch.
+ *
+ * The timer is created disarmed. It shall be added to the task with the
+ * io_engine_task_add_watch() function - just like any other watch.
+ *
+ * @param timer Address of the timer structure.
+ * @param callback Function called upon the timer expiration.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int io_engine_timer_init(struct io_engine_timer *timer,
+		void (*callback)(struct io_engine_timer *timer, uint64_t expirations)) {
+
+	int fd;
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		return -1;
+
+	timer->watch.fd = fd;
+	timer->watch.events = EPOLLIN;
+	timer->watch.callback = io_engine_timer_dispatch;
+	timer->callback = callback;
+
+	return 0;
+}
+
+/**
+ * Arm or disarm the timer.
+ *
+ * @param timer Address of the timer structure.
+ * @param value_usec Time of the first expiration relative to the current
+ *   time. Zero disarms the timer.
+ * @param interval_usec Interval of subsequent expirations. If zero is given,
+ *   the timer will expire only once.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int io_engine_timer_set(struct io_engine_timer *timer,
+		unsigned int value_usec, unsigned int interval_usec) {
+	const struct itimerspec ts = {
+		.it_value.tv_sec = value_usec / 1000000,
+		.it_value.tv_nsec = value_usec % 1000000 * 1000,
+		.it_interval.tv_sec = interval_usec / 1000000,
+		.it_interval.tv_nsec = interval_usec % 1000000 * 1000,
+	};
+	return timerfd_settime(timer->watch.fd, 0, &ts, NULL);
+}
+
+/**
+ * Release resources allocated by the timer.
+ *
+ * This function shall not be called for the timer of the running task. */
+void io_engine_timer_free(struct io_engine_timer *timer) {
+	if (timer->watch.fd == -1)
+		return;
+	close(timer->watch.fd);
+	timer->watch.fd = -1;
+}
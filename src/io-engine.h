@@ -0,0 +1,109 @@
+/*
+ * BlueALSA - io-engine.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_IOENGINE_H_
+#define BLUEALSA_IOENGINE_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* Maximal number of events dispatched by the worker at once. */
+#define IO_ENGINE_MAX_EVENTS 16
+
+struct io_engine_task;
+struct io_engine_worker;
+
+/**
+ * File descriptor watch.
+ *
+ * The callback function is called from within the worker thread whenever
+ * the file descriptor is ready for the requested IO operation. Watches are
+ * level-triggered - just like poll(). */
+struct io_engine_watch {
+
+	int fd;
+	/* requested epoll events */
+	uint32_t events;
+
+	void (*callback)(struct io_engine_watch *watch, uint32_t events);
+
+	/* task to which this watch belongs */
+	struct io_engine_task *task;
+	struct io_engine_watch *next;
+
+};
+
+/**
+ * Timer watch.
+ *
+ * The timer is backed by the timerfd, so it is dispatched just like any
+ * other watch of the task. The callback function receives the number of
+ * expirations since the last dispatch. */
+struct io_engine_timer {
+	struct io_engine_watch watch;
+	void (*callback)(struct io_engine_timer *timer, uint64_t expirations);
+};
+
+enum io_engine_task_state {
+	IO_ENGINE_TASK_IDLE = 0,
+	IO_ENGINE_TASK_RUNNING,
+	IO_ENGINE_TASK_STOPPING,
+};
+
+/**
+ * IO task - a state machine driven by the file descriptor readiness.
+ *
+ * All watches of a single task are served by the same worker thread, so
+ * callbacks of a given task are never called concurrently. The zero-filled
+ * structure is a valid idle task. */
+struct io_engine_task {
+
+	enum io_engine_task_state state;
+
+	/* list of registered watches */
+	struct io_engine_watch *watches;
+
+	/* Function called from within the worker thread, when the task has been
+	 * stopped. It shall release all resources allocated by the task. */
+	void (*cleanup)(struct io_engine_task *task);
+	void *userdata;
+
+	/* worker which serves this task */
+	struct io_engine_worker *worker;
+	struct io_engine_task *next;
+
+};
+
+int io_engine_init(unsigned int workers);
+void io_engine_free(void);
+bool io_engine_enabled(void);
+
+void io_engine_task_add_watch(struct io_engine_task *task,
+		struct io_engine_watch *watch);
+int io_engine_task_start(struct io_engine_task *task);
+void io_engine_task_stop(struct io_engine_task *task);
+bool io_engine_task_running(struct io_engine_task *task);
+
+int io_engine_watch_set_events(struct io_engine_watch *watch, uint32_t events);
+int io_engine_watch_set_fd(struct io_engine_watch *watch, int fd);
+
+int io_engine_timer_init(struct io_engine_timer *timer,
+		void (*callback)(struct io_engine_timer *timer, uint64_t expirations));
+int io_engine_timer_set(struct io_engine_timer *timer,
+		unsigned int value_usec, unsigned int interval_usec);
+void io_engine_timer_free(struct io_engine_timer *timer);
+
+#endif
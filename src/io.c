@@ -8,12 +8,12 @@
  *
  */
 
+#define _GNU_SOURCE
 #include "io.h"
 
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <math.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
 #include <sbc/sbc.h>
@@ -31,7 +32,7 @@
 # define AACENCODER_LIB_VERSION LIB_VERSION( \
 		AACENCODER_LIB_VL0, AACENCODER_LIB_VL1, AACENCODER_LIB_VL2)
 #endif
-#if ENABLE_APTX
+#if ENABLE_APTX || ENABLE_APTX_HD
 # include <openaptx.h>
 #endif
 #if ENABLE_LDAC
@@ -41,7 +42,13 @@
 
 #include "a2dp-codecs.h"
 #include "a2dp-rtp.h"
+#include "abr.h"
 #include "bluealsa.h"
+#include "capture.h"
+#include "codec-cache.h"
+#include "codec-lib.h"
+#include "jitter.h"
+#include "resample.h"
 #include "transport.h"
 #include "utils.h"
 #include "defs.h"
@@ -50,43 +57,141 @@
 #include "rt.h"
 
 
+/* Value returned by the A2DP source IO loop, when the PCM has been opened
+ * in the format which is served by the other IO loop. */
+#define IO_THREAD_HANDOVER ((void *)-1)
+
+/**
+ * Store data chunk of the transport in the capture ring.
+ *
+ * It is safe to call this function in the hot path - if the capture is
+ * disabled, it costs a single relaxed atomic load. */
+static inline void io_thread_capture(const struct ba_transport *t,
+		enum capture_type type, const void *data, size_t len) {
+	if (!atomic_load_explicit(&config.capture.active, memory_order_relaxed) ||
+			t == NULL || t->device == NULL)
+		return;
+	capture_record_(&config.capture, &t->device->addr, t->profile, t->codec,
+			type, data, len);
+}
+
 /**
- * Scale PCM signal according to the transport audio properties. */
-static void io_thread_scale_pcm(const struct ba_transport *t, int16_t *buffer,
+ * Scale PCM signal according to the transport audio properties.
+ *
+ * The signal is expected to be in the sample format of the A2DP PCM. */
+static void io_thread_scale_pcm(const struct ba_transport *t, void *buffer,
 		size_t samples, int channels) {
 
 	/* Get a snapshot of audio properties. Please note, that mutex is not
 	 * required here, because we are not modifying these variables. */
-	uint8_t ch1_volume = t->a2dp.ch1_volume;
-	uint8_t ch2_volume = t->a2dp.ch2_volume;
+	uint8_t ch1_volume = MIN(t->a2dp.ch1_volume, 127);
+	uint8_t ch2_volume = MIN(t->a2dp.ch2_volume, 127);
 
-	double ch1_scale = 0;
-	double ch2_scale = 0;
+	uint16_t ch1_gain = 0;
+	uint16_t ch2_gain = 0;
 
 	if (!t->a2dp.ch1_muted)
-		ch1_scale = pow(10, (-64 + 64.0 * ch1_volume / 127) / 20);
+		ch1_gain = snd_pcm_volume_gain[ch1_volume];
 	if (!t->a2dp.ch2_muted)
-		ch2_scale = pow(10, (-64 + 64.0 * ch2_volume / 127) / 20);
+		ch2_gain = snd_pcm_volume_gain[ch2_volume];
+
+	switch (t->a2dp.pcm.format) {
+	case BA_PCM_FORMAT_S16_LE:
+		snd_pcm_scale_s16le(buffer, samples, channels, ch1_gain, ch2_gain);
+		break;
+	case BA_PCM_FORMAT_S24_3LE:
+		snd_pcm_scale_s24_3le(buffer, samples, channels, ch1_gain, ch2_gain);
+		break;
+	case BA_PCM_FORMAT_S32_LE:
+		snd_pcm_scale_s32le(buffer, samples, channels, ch1_gain, ch2_gain);
+		break;
+	case BA_PCM_FORMAT_FLOAT_LE:
+		snd_pcm_scale_float_le(buffer, samples, channels, ch1_gain, ch2_gain);
+		break;
+	case BA_PCM_FORMAT_ENCODED:
+		break;
+	}
+}
 
-	snd_pcm_scale_s16le(buffer, samples, channels, ch1_scale, ch2_scale);
+/**
+ * Check whether the transport audio is muted.
+ *
+ * The audio is considered muted, if all channels are muted or their volume
+ * is set to zero. In case of the native volume control, the PCM signal is
+ * not scaled at all, so it is never muted by the IO thread. */
+static bool io_thread_pcm_muted(const struct ba_transport *t, int channels) {
+	if (config.a2dp.volume)
+		return false;
+	const bool ch1 = t->a2dp.ch1_muted || t->a2dp.ch1_volume == 0;
+	const bool ch2 = t->a2dp.ch2_muted || t->a2dp.ch2_volume == 0;
+	return ch1 && (channels == 1 || ch2);
 }
 
 /**
- * Read PCM signal from the transport PCM FIFO. */
-static ssize_t io_thread_read_pcm(struct ba_pcm *pcm, int16_t *buffer, size_t samples) {
+ * Read PCM data from the transport PCM shared memory ring.
+ *
+ * In case when there is no data in the ring, this function returns -1 and
+ * errno is set to EAGAIN. It might happen, because the data doorbell might
+ * be rung by the client without anything being written (e.g. upon release). */
+static ssize_t io_thread_read_pcm_shm(struct ba_pcm *pcm, void *buffer, size_t len) {
+
+	if ((len = pcm_ring_read(&pcm->shm, buffer, len)) > 0)
+		return len;
+
+	if (pcm_ring_closed(&pcm->shm)) {
+		debug("PCM ring has been closed: %d", pcm->fd);
+		transport_release_pcm(pcm);
+		return 0;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
 
+/**
+ * Read PCM signal from the transport PCM FIFO without resampling.
+ *
+ * Neither the FIFO nor the shared memory ring is aware of the sample size,
+ * so the read might end in the middle of a sample (e.g. S24_3LE stream read
+ * in power-of-two chunks). Such trailing bytes are stored in the PCM residue
+ * and they are prepended to the data read with the next call. If there is
+ * not enough data for a single sample, or there is no space for the data in
+ * the caller buffer, -1 is returned and errno is set to EAGAIN. Zero is
+ * returned only when the PCM has been released. */
+static ssize_t io_thread_read_pcm_(struct ba_pcm *pcm, void *buffer, size_t samples) {
+
+	const size_t size = transport_pcm_format_size(pcm->format);
+	const size_t residue_len = pcm->residue_len;
+	uint8_t *head = (uint8_t *)buffer;
 	ssize_t ret;
 
+	/* Nothing can be read into a full buffer, which is not the end of the
+	 * stream, though. The PCM shall be released by the EOF only. */
+	if (samples == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	memcpy(head, pcm->residue, residue_len);
+
+	if (pcm->shm.ctrl != NULL) {
+		if ((ret = io_thread_read_pcm_shm(pcm, head + residue_len,
+						samples * size - residue_len)) > 0)
+			goto done;
+		return ret;
+	}
+
 	/* If the passed file descriptor is invalid (e.g. -1) is means, that other
 	 * thread (the controller) has closed the connection. If the connection was
 	 * closed during this call, we will still read correct data, because Linux
 	 * kernel does not decrement file descriptor reference counter until the
 	 * read returns. */
-	while ((ret = read(pcm->fd, buffer, samples * sizeof(int16_t))) == -1 && errno == EINTR)
+	while ((ret = read(pcm->fd, head + residue_len,
+					samples * size - residue_len)) == -1 && errno == EINTR)
 		continue;
 
 	if (ret > 0)
-		return ret / sizeof(int16_t);
+		goto done;
 
 	if (ret == 0)
 		debug("FIFO endpoint has been closed: %d", pcm->fd);
@@ -96,20 +201,101 @@ static ssize_t io_thread_read_pcm(struct ba_pcm *pcm, int16_t *buffer, size_t sa
 		transport_release_pcm(pcm);
 
 	return ret;
+
+done:
+	ret += residue_len;
+	pcm->residue_len = ret % size;
+	memcpy(pcm->residue, &head[ret - pcm->residue_len], pcm->residue_len);
+	if ((ret /= size) == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return ret;
+}
+
+/**
+ * Account PCM samples which could not be written without blocking. */
+static void io_thread_pcm_overrun(struct ba_pcm *pcm, size_t samples) {
+	debug("Dropping PCM samples: %zu", samples);
+	pcm->t->stats.pcm_overruns++;
 }
 
 /**
- * Write PCM signal to the transport PCM FIFO. */
-static ssize_t io_thread_write_pcm(struct ba_pcm *pcm, const int16_t *buffer, size_t samples) {
+ * Write PCM signal to the transport PCM shared memory ring. */
+static ssize_t io_thread_write_pcm_shm(struct ba_pcm *pcm, const void *buffer, size_t samples) {
+
+	struct pollfd pfd = { pcm->shm.space_fd, POLLIN, 0 };
+	const uint8_t *head = (uint8_t *)buffer;
+	size_t len = samples * transport_pcm_format_size(pcm->format);
+	size_t ret;
+
+	/* In the non-blocking mode, the signal is written either as a whole or
+	 * not at all, so the stream stays aligned to the frame boundary. */
+	if (pcm->nonblock && !pcm_ring_closed(&pcm->shm) &&
+			pcm_ring_len_in(&pcm->shm) < len) {
+		io_thread_pcm_overrun(pcm, samples);
+		return samples;
+	}
+
+	for (;;) {
+
+		ret = pcm_ring_write(&pcm->shm, head, len);
+		head += ret;
+		len -= ret;
+
+		/* the ring state might have been corrupted by the client as well */
+		if (pcm_ring_closed(&pcm->shm)) {
+			debug("PCM ring has been closed: %d", pcm->fd);
+			transport_release_pcm(pcm);
+			return 0;
+		}
+
+		if (len == 0)
+			break;
 
+		/* Wait for the client to make some space in the ring. The space doorbell
+		 * is rung upon release as well, so it is safe to wait infinitely. */
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			return -1;
+
+	}
+
+	return samples;
+}
+
+/**
+ * Write PCM signal to the transport PCM FIFO without resampling.
+ *
+ * The FIFO is opened in the non-blocking mode. If the PCM is served by the
+ * IO engine, the signal is written in chunks which do not exceed the
+ * PIPE_BUF limit, so every chunk is written atomically. Chunks which do
+ * not fit in the FIFO are dropped. Otherwise, this function waits for the
+ * client to read the FIFO. */
+static ssize_t io_thread_write_pcm_(struct ba_pcm *pcm, const void *buffer, size_t samples) {
+
+	const size_t size = transport_pcm_format_size(pcm->format);
+	/* chunk holds whole frames of mono and stereo streams */
+	const size_t chunk = PIPE_BUF / (2 * size) * (2 * size);
 	const uint8_t *head = (uint8_t *)buffer;
-	size_t len = samples * sizeof(int16_t);
+	size_t len = samples * size;
 	ssize_t ret;
 
+	if (pcm->shm.ctrl != NULL)
+		return io_thread_write_pcm_shm(pcm, buffer, samples);
+
 	do {
-		if ((ret = write(pcm->fd, head, len)) == -1) {
+		if ((ret = write(pcm->fd, head, pcm->nonblock ? MIN(len, chunk) : len)) == -1) {
 			if (errno == EINTR)
 				continue;
+			if (errno == EAGAIN && pcm->nonblock) {
+				io_thread_pcm_overrun(pcm, len / size);
+				break;
+			}
+			if (errno == EAGAIN) {
+				struct pollfd pfd = { pcm->fd, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
 			if (errno == EPIPE) {
 				/* This errno value will be received only, when the SIGPIPE
 				 * signal is caught, blocked or ignored. */
@@ -123,293 +309,2608 @@ static ssize_t io_thread_write_pcm(struct ba_pcm *pcm, const int16_t *buffer, si
 		len -= ret;
 	} while (len != 0);
 
-	/* It is guaranteed, that this function will write data atomically. */
 	return samples;
 }
 
 /**
- * Write data to the BT SEQPACKET socket. */
-static ssize_t io_thread_write_bt(const struct ba_transport *t,
-		const uint8_t *buffer, size_t len, int *coutq) {
-
-	struct pollfd pfd = { t->bt_fd, POLLOUT, 0 };
+ * Read PCM signal and convert it to the transport sampling rate.
+ *
+ * The client signal is read into the staging buffer of the resampler, so
+ * incomplete frames are kept until the next call. The number of samples
+ * read from the PCM is limited to the amount required to produce the
+ * requested output, so the staging buffer can always be consumed. */
+static ssize_t io_thread_read_pcm_resample(struct ba_pcm *pcm, int16_t *buffer, size_t samples) {
+
+	struct resampler *r = &pcm->rs;
+	const unsigned int channels = r->channels;
+	size_t frames = samples / channels;
+	size_t frames_in;
 	ssize_t ret;
 
-	if (ioctl(pfd.fd, TIOCOUTQ, coutq) == -1)
-		warn("Couldn't get BT queued bytes: %s", strerror(errno));
-	else
-		*coutq = abs(t->a2dp.bt_fd_coutq_init - *coutq);
+	if ((frames_in = resampler_input_frames(r, frames)) > RESAMPLER_BLOCK)
+		frames_in = RESAMPLER_BLOCK;
 
-retry:
-	if ((ret = write(pfd.fd, buffer, len)) == -1)
-		switch (errno) {
-		case EINTR:
-			goto retry;
-		case EAGAIN:
-			poll(&pfd, 1, -1);
-			/* set coutq to some arbitrary big value */
-			*coutq = 1024 * 16;
-			goto retry;
-		}
+	if (frames_in * channels > r->staging_len) {
+		if ((ret = io_thread_read_pcm_(pcm, &r->staging[r->staging_len],
+						frames_in * channels - r->staging_len)) <= 0)
+			return ret;
+		r->staging_len += ret;
+	}
 
-	return ret;
+	frames_in = r->staging_len / channels;
+	frames = resampler_process(r, r->staging, &frames_in, buffer, frames);
+
+	r->staging_len -= frames_in * channels;
+	memmove(r->staging, &r->staging[frames_in * channels],
+			r->staging_len * sizeof(*r->staging));
+
+	if (frames == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return frames * channels;
 }
 
 /**
- * Initialize RTP headers.
+ * Convert PCM signal to the client sampling rate and write it.
  *
- * @param s The memory area where the RTP headers will be initialized.
- * @param hdr The address where the pointer to the RTP header will be stored.
- * @param mhdr The address where the pointer to the RTP media payload header
- *   will be stored. This parameter might be NULL in order to omit RTP media
- *   payload header.
- * @return This function returns the address of the RTP payload region. */
-static uint8_t *io_thread_init_rtp(void *s, rtp_header_t **hdr, rtp_media_header_t **mhdr) {
+ * The signal is converted in blocks, which are written to the PCM right
+ * away. The number of samples shall be a multiple of the number of
+ * channels, otherwise the incomplete frame is discarded. */
+static ssize_t io_thread_write_pcm_resample(struct ba_pcm *pcm, const int16_t *buffer, size_t samples) {
 
-	rtp_header_t *header = *hdr = (rtp_header_t *)s;
-	memset(header, 0, RTP_HEADER_LEN);
-	header->paytype = 96;
-	header->version = 2;
-	header->seq_number = random();
-	header->timestamp = random();
+	struct resampler *r = &pcm->rs;
+	const unsigned int channels = r->channels;
+	size_t frames = samples / channels;
 
-	uint8_t *data = (uint8_t *)&header->csrc[header->cc];
+	while (frames > 0) {
+
+		size_t frames_in = frames;
+		size_t frames_out;
+		ssize_t ret;
+
+		if ((frames_out = resampler_process(r, buffer, &frames_in,
+						r->staging, RESAMPLER_BLOCK)) > 0 &&
+				(ret = io_thread_write_pcm_(pcm, r->staging, frames_out * channels)) <= 0)
+			return ret;
+
+		buffer += frames_in * channels;
+		frames -= frames_in;
 
-	if (mhdr != NULL) {
-		memset(data, 0, sizeof(rtp_media_header_t));
-		*mhdr = (rtp_media_header_t *)data;
-		data += sizeof(rtp_media_header_t);
 	}
 
-	return data;
+	return samples;
 }
 
-void *io_thread_a2dp_sink_sbc(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
+/**
+ * Read PCM signal from the transport PCM FIFO.
+ *
+ * In case when the client has opened the PCM with a different sampling
+ * rate, the signal is converted to the transport sampling rate. The signal
+ * is read in the PCM sample format, which is S16_LE unless the IO thread
+ * supports other formats (resampling is available for S16_LE only). */
+static ssize_t io_thread_read_pcm(struct ba_pcm *pcm, void *buffer, size_t samples) {
 
-	/* Cancellation should be possible only in the carefully selected place
-	 * in order to prevent memory leaks and resources not being released. */
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+	ssize_t ret;
 
-	/* Lock transport during initialization stage. This lock will ensure,
-	 * that no one will modify critical section until thread state can be
-	 * known - initialization has failed or succeeded. */
-	bool locked = !transport_pthread_cleanup_lock(t);
+	if (pcm->rs.filter != NULL)
+		ret = io_thread_read_pcm_resample(pcm, buffer, samples);
+	else
+		ret = io_thread_read_pcm_(pcm, buffer, samples);
 
-	if (t->bt_fd == -1) {
-		error("Invalid BT socket: %d", t->bt_fd);
-		goto fail_init;
-	}
+	if (ret > 0)
+		io_thread_capture(pcm->t, CAPTURE_TYPE_PCM_IN, buffer,
+				ret * transport_pcm_format_size(pcm->format));
 
-	/* Check for invalid (e.g. not set) reading MTU. If buffer allocation does
-	 * not return NULL (allocating zero bytes might return NULL), we will read
-	 * zero bytes from the BT socket, which will be wrongly identified as a
-	 * "connection closed" action. */
-	if (t->mtu_read <= 0) {
-		error("Invalid reading MTU: %zu", t->mtu_read);
-		goto fail_init;
-	}
+	return ret;
+}
 
-	sbc_t sbc;
+/**
+ * Write PCM signal to the transport PCM FIFO.
+ *
+ * In case when the client has opened the PCM with a different sampling
+ * rate, the signal is converted to the client sampling rate. The signal
+ * is written in the PCM sample format, which is S16_LE unless the client
+ * has requested the encoded data. */
+static ssize_t io_thread_write_pcm(struct ba_pcm *pcm, const void *buffer, size_t samples) {
+	io_thread_capture(pcm->t, CAPTURE_TYPE_PCM_OUT, buffer,
+			samples * transport_pcm_format_size(pcm->format));
+	if (pcm->rs.filter != NULL)
+		return io_thread_write_pcm_resample(pcm, buffer, samples);
+	return io_thread_write_pcm_(pcm, buffer, samples);
+}
 
-	if ((errno = -sbc_init_a2dp(&sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
-		error("Couldn't initialize SBC codec: %s", strerror(errno));
-		goto fail_init;
-	}
+/**
+ * Account the codec processing time in the transport statistics.
+ *
+ * @param t Transport structure.
+ * @param ts0 Time-stamp taken before the processing has started. */
+static void io_thread_stats_codec(struct ba_transport *t, const struct timespec *ts0) {
 
-	const unsigned int channels = transport_get_channels(t);
+	struct timespec ts;
+	unsigned int bin = 0;
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(sbc_finish), &sbc);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+	gettimestamp(&ts);
+	difftimespec(ts0, &ts, &ts);
 
-	if (ffb_init(&pcm, sbc_get_codesize(&sbc)) == NULL ||
-			ffb_init(&bt, t->mtu_read) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
-	}
+	const unsigned long usec = ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	while (bin < BA_STATS_CODEC_TIME_BINS - 1 && usec >= (16UL << bin))
+		bin++;
 
-	/* Lock transport during thread cancellation. This handler shall be at
-	 * the top of the cleanup stack - lastly pushed. */
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+	t->stats.codec_time[bin]++;
+	t->stats.codec_time_total += usec;
+}
 
-	uint16_t seq_number = -1;
+/**
+ * Register encoder of the IO thread within the CPU budget.
+ *
+ * If the CPU budget is not configured, the client is not registered, so
+ * the update function is a no-op.
+ *
+ * @param t Transport structure.
+ * @param c Address of the budget client structure.
+ * @param levels The number of encoder complexity levels. */
+static void io_thread_cpu_budget_register(struct ba_transport *t,
+		struct cpu_budget_client *c, unsigned int levels) {
 
-	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
-		{ -1, POLLIN, 0 },
-	};
+	if (config.io_thread.cpu_budget.limit == 0)
+		return;
 
-	transport_pthread_cleanup_unlock(t);
-	locked = false;
+	struct timespec ts;
+	gettimestamp(&ts);
+	cpu_budget_register(&config.io_thread.cpu_budget, c, levels,
+			t->stats.codec_time_total, &ts);
 
-	debug("Starting IO loop: %s (%s)",
-			bluetooth_profile_to_string(t->profile),
-			bluetooth_a2dp_codec_to_string(t->codec));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+}
 
-		ssize_t len;
+/**
+ * Unregister encoder of the IO thread from the CPU budget. */
+static void io_thread_cpu_budget_unregister(struct cpu_budget_client *c) {
+	cpu_budget_unregister(&config.io_thread.cpu_budget, c);
+}
 
-		/* add BT socket to the poll if transport is active */
-		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
+/**
+ * Update the encoder load within the CPU budget.
+ *
+ * @param t Transport structure.
+ * @param c Address of the budget client structure.
+ * @return This function returns true if the encoder complexity shall be
+ *   changed to the current level of the budget client. */
+static bool io_thread_cpu_budget_update(struct ba_transport *t,
+		struct cpu_budget_client *c) {
+
+	if (!c->registered)
+		return false;
+
+	struct timespec ts;
+	gettimestamp(&ts);
+	if (!cpu_budget_update(&config.io_thread.cpu_budget, c,
+				t->stats.codec_time_total, &ts))
+		return false;
+
+	debug("Encoder complexity level changed: %s: %u/%u",
+			bluetooth_a2dp_codec_to_string(t->codec), c->level, c->levels);
+	return true;
+}
 
-		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1) {
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
-		}
+/**
+ * Publish PCM status for the client-side delay reporting.
+ *
+ * @param t Transport structure.
+ * @param pcm PCM structure with the status page.
+ * @param frames Number of PCM frames transferred since the last call. */
+static void io_thread_pcm_status(struct ba_transport *t, struct ba_pcm *pcm,
+		unsigned int frames) {
+
+	if (pcm->status.page == NULL)
+		return;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	const struct pcm_status_data data = {
+		.delay = transport_get_delay(t),
+		.bt_queued = t->stats.bt_coutq,
+		.hw_ptr = atomic_load_explicit(&pcm->status.page->hw_ptr,
+				memory_order_relaxed) + frames,
+		.timestamp = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+	};
 
-		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
-			continue;
-		}
+	pcm_status_update(&pcm->status, &data);
+}
 
-		if ((len = read(pfds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
-			debug("BT read error: %s", strerror(errno));
-			continue;
-		}
+/**
+ * Keep data transfer at a constant bit rate.
+ *
+ * If the synchronization was not required, it means that we are late,
+ * either due to the PCM samples not being delivered on time or due to the
+ * processing overhead. Such an event is accounted as a PCM underrun. */
+static void io_thread_asrsync(struct ba_transport *t, struct asrsync *asrs,
+		unsigned int frames) {
+
+	const uint64_t skipped = asrs->skipped;
+
+	if (asrsync_sync(asrs, frames) == 0) {
+		const unsigned int overdue = asrsync_get_overdue_usec(asrs);
+		if (overdue > t->stats.sync_overdue_max)
+			t->stats.sync_overdue_max = overdue;
+		t->stats.pcm_underruns++;
+	}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	t->stats.sync_skipped += asrs->skipped - skipped;
+	io_thread_pcm_status(t, &t->a2dp.pcm, frames);
+}
 
-		/* it seems that zero is never returned... */
-		if (len == 0) {
-			debug("BT socket has been closed: %d", pfds[1].fd);
-			/* Prevent sending the release request to the BlueZ. If the socket has
-			 * been closed, it means that BlueZ has already closed the connection. */
-			close(pfds[1].fd);
-			t->bt_fd = -1;
-			goto fail;
-		}
+/**
+ * Check whether there are samples waiting in the transport PCM FIFO. */
+static bool io_thread_pcm_pending(struct ba_pcm *pcm) {
 
-		if (t->a2dp.pcm.fd == -1) {
-			seq_number = -1;
-			continue;
-		}
+	int len;
 
-		const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
-		const rtp_media_header_t *rtp_media_header = (rtp_media_header_t *)&rtp_header->csrc[rtp_header->cc];
-		const uint8_t *rtp_payload = (uint8_t *)(rtp_media_header + 1);
-		size_t rtp_payload_len = len - ((void *)rtp_payload - (void *)rtp_header);
+	if (pcm->fd == -1)
+		return false;
+	if (pcm->shm.ctrl != NULL)
+		return pcm_ring_len_out(&pcm->shm) >= transport_pcm_format_size(pcm->format);
+	if (ioctl(pcm->fd, FIONREAD, &len) == -1)
+		return false;
 
-#if ENABLE_PAYLOADCHECK
-		if (rtp_header->paytype < 96) {
-			warn("Unsupported RTP payload type: %u", rtp_header->paytype);
-			continue;
-		}
-#endif
+	return len > 0;
+}
 
-		uint16_t _seq_number = ntohs(rtp_header->seq_number);
-		if (++seq_number != _seq_number) {
-			if (seq_number != 0)
-				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
-			seq_number = _seq_number;
-		}
+/**
+ * Check whether samples can be written to the transport PCM without blocking.
+ *
+ * @param pcm Address of the transport PCM structure.
+ * @param samples The number of samples to write. In case of the PCM FIFO,
+ *   it shall not exceed the PIPE_BUF limit.
+ * @return If the write will not block, true is returned. */
+static bool io_thread_pcm_writable(struct ba_pcm *pcm, size_t samples) {
+
+	struct pollfd pfd = { pcm->fd, POLLOUT, 0 };
+
+	if (pcm->fd == -1)
+		return false;
+	if (pcm->shm.ctrl != NULL)
+		return pcm_ring_len_in(&pcm->shm) >= samples * transport_pcm_format_size(pcm->format);
+
+	/* Poll errors are reported as writable, so the write call will
+	 * detect closed FIFO and release the PCM accordingly. */
+	return poll(&pfd, 1, 0) > 0;
+}
 
-		/* decode retrieved SBC frames */
-		size_t frames = rtp_media_header->frame_count;
-		while (frames--) {
+/**
+ * Digital silence detector of the A2DP source IO thread. */
+struct io_silence {
+	/* silence duration (in frames) after which the encoding is
+	 * suspended - zero if the silence detection is disabled */
+	size_t threshold;
+	/* the number of consecutive silent frames */
+	size_t frames;
+	/* encoding is suspended */
+	bool suspended;
+};
+
+static void io_silence_reset(struct io_silence *s) {
+	s->frames = 0;
+	s->suspended = false;
+}
 
-			ssize_t len;
-			size_t decoded;
+static void io_silence_init(struct io_silence *s, unsigned int samplerate) {
+	s->threshold = (size_t)config.a2dp.silence_timeout * samplerate;
+	io_silence_reset(s);
+}
 
-			if ((len = sbc_decode(&sbc, rtp_payload, rtp_payload_len,
-							pcm.data, ffb_blen_in(&pcm), &decoded)) < 0) {
-				error("SBC decoding error: %s", strerror(-len));
-				break;
-			}
+/**
+ * Check whether the PCM signal is a digital silence.
+ *
+ * When the silence lasts longer than the configured threshold, the encoding
+ * and transmission shall be suspended - there is no point in wasting CPU,
+ * airtime and headset battery for sending nothing. The encoder itself is
+ * kept intact, so it can be resumed right away upon the first non-silent
+ * sample. In the suspended state, the caller shall drop the PCM signal, but
+ * it shall keep the pace of the PCM client with the given sync structure.
+ *
+ * @param s Address of the silence detector structure.
+ * @param t Transport structure.
+ * @param asrs Address of the rate sync structure of the IO thread.
+ * @param buffer Buffer with the PCM signal, after the volume scaling. If
+ *   NULL, the signal is known to be silent (e.g. muted transport).
+ * @param samples The number of samples in the buffer.
+ * @param channels The number of channels.
+ * @return If the encoding is suspended, this function returns true. */
+static bool io_silence_check(struct io_silence *s, const struct ba_transport *t,
+		struct asrsync *asrs, const void *buffer, size_t samples, int channels) {
+
+	if (s->threshold == 0)
+		return false;
+
+	const size_t size = samples * transport_pcm_format_size(t->a2dp.pcm.format);
+	const uint8_t *data = buffer;
+
+	/* Buffer is zero-filled if the first byte is zero and every byte equals
+	 * its successor - the memcmp() is vectorized by the C library. */
+	if (data != NULL && size > 0 &&
+			(data[0] != 0 || memcmp(data, data + 1, size - 1) != 0)) {
+		if (s->suspended)
+			debug("Resuming encoding after %zu silent frames", s->frames);
+		s->frames = 0;
+		s->suspended = false;
+		return false;
+	}
 
-			rtp_payload += len;
-			rtp_payload_len -= len;
+	s->frames += samples / channels;
+	if (!s->suspended && s->frames >= s->threshold) {
+		debug("Suspending encoding after %zu silent frames", s->frames);
+		s->suspended = true;
+		/* From now on, the client is paced by the IO thread itself (it might
+		 * have been paced by the transmit stage in the pipeline mode). */
+		asrsync_init(asrs, asrs->rate);
+	}
 
-			const size_t samples = decoded / sizeof(int16_t);
-			io_thread_scale_pcm(t, pcm.data, samples, channels);
-			if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
-				error("FIFO write error: %s", strerror(errno));
+	return s->suspended;
+}
 
-		}
+/**
+ * Write packet loss concealment signal to the transport PCM FIFO.
+ *
+ * Depending on the configuration, either silence is written, or the last
+ * decoded audio is repeated - attenuated by 6 dB with every repetition.
+ *
+ * @param pcm Address of the transport PCM structure.
+ * @param buffer Address of the buffer with the last decoded audio. The
+ *   content of this buffer is modified in place.
+ * @param buffer_samples Address of the number of valid samples in the
+ *   buffer. Zero means that there is no valid audio in the buffer.
+ * @param samples The number of samples to write. */
+static void io_thread_write_pcm_plc(struct ba_pcm *pcm, ffb_int16_t *buffer,
+		size_t *buffer_samples, size_t samples) {
+
+	const bool repeat = config.a2dp.plc_repeat && *buffer_samples > 0;
+	size_t i;
+
+	/* lost packets are not concealed in the encoded stream */
+	if (pcm->format == BA_PCM_FORMAT_ENCODED)
+		return;
+
+	if (!repeat) {
+		memset(buffer->data, 0, buffer->size * sizeof(*buffer->data));
+		*buffer_samples = buffer->size;
+	}
 
+	while (samples > 0 && pcm->fd != -1) {
+		size_t len = MIN(samples, *buffer_samples);
+		if (repeat)
+			for (i = 0; i < len; i++)
+				buffer->data[i] /= 2;
+		if (io_thread_write_pcm(pcm, buffer->data, len) == -1) {
+			error("FIFO write error: %s", strerror(errno));
+			break;
+		}
+		samples -= len;
 	}
 
-fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-	return NULL;
 }
 
-void *io_thread_a2dp_source_sbc(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
+/**
+ * Store received RTP packet in the jitter buffer. */
+static void io_thread_jitter_put(struct ba_transport *t, struct jitter_buffer *jb,
+		const uint8_t *packet, size_t len, unsigned int frames) {
+	const rtp_header_t *rtp_header = (rtp_header_t *)packet;
+	const uint16_t seq_number = ntohs(rtp_header->seq_number);
+	const unsigned int dropped = jb->dropped;
+	t->stats.bt_packets++;
+	t->stats.bt_bytes += len;
+	if (jitter_buffer_put(jb, packet, len, seq_number, frames) == -1) {
+		debug("Dropping RTP packet [%u]: %s", seq_number, strerror(errno));
+		t->stats.bt_dropped++;
+	}
+	t->stats.bt_dropped += jb->dropped - dropped;
+}
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+/**
+ * BT output stage.
+ *
+ * Packets written to the BT socket are queued, so all packets available
+ * at a given time can be transfered with a single system call. Also, the
+ * number of bytes queued in the socket output buffer is sampled with the
+ * fixed interval, instead of for every written packet. */
+struct io_bt_queue {
 
-	bool locked = !transport_pthread_cleanup_lock(t);
+	/* associated transport */
+	struct ba_transport *t;
+	/* BT socket - by default the transport one */
+	int fd;
+	int fd_coutq_init;
 
-	sbc_t sbc;
+	/* storage for queued packets */
+	uint8_t *data;
+	size_t mtu;
 
-	if ((errno = -sbc_init_a2dp(&sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
-		error("Couldn't initialize SBC codec: %s", strerror(errno));
-		goto fail_init;
-	}
+	struct mmsghdr msgs[IO_THREAD_BT_QUEUE_SIZE];
+	struct iovec iov[IO_THREAD_BT_QUEUE_SIZE];
+	/* number of queued packets */
+	size_t len;
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
-	pthread_cleanup_push(PTHREAD_CLEANUP(sbc_finish), &sbc);
+	/* the last sample of bytes queued in the BT socket */
+	int coutq;
+	struct timespec coutq_ts;
 
-	const size_t sbc_pcm_samples = sbc_get_codesize(&sbc) / sizeof(int16_t);
-	const size_t sbc_frame_len = sbc_get_frame_length(&sbc);
-	const unsigned int channels = transport_get_channels(t);
-	const unsigned int samplerate = transport_get_sampling(t);
+	/* time (in microseconds) spent on waiting for the BT socket */
+	unsigned int blocked;
+
+	/* drop packets instead of waiting for the congested BT socket */
+	bool drop;
+
+};
+
+/**
+ * Initialize BT output queue for the given BT socket.
+ *
+ * @param q Address of the queue structure.
+ * @param t Transport associated with the queue. Packets transfered by this
+ *   queue are accounted in the statistics of this transport.
+ * @param fd BT socket file descriptor.
+ * @param mtu The maximal size of the packet.
+ * @param coutq_init The number of bytes reported by the TIOCOUTQ ioctl when
+ *   the socket output buffer is empty.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int io_bt_queue_init_fd(struct io_bt_queue *q, struct ba_transport *t,
+		int fd, size_t mtu, int coutq_init) {
+
+	size_t i;
+
+	q->t = t;
+	q->fd = fd;
+	q->fd_coutq_init = coutq_init;
+	q->mtu = mtu;
+	q->len = 0;
+	q->coutq = 0;
+	q->coutq_ts.tv_sec = 0;
+	q->coutq_ts.tv_nsec = 0;
+	q->blocked = 0;
+	q->drop = false;
+
+	if ((q->data = malloc(ARRAYSIZE(q->msgs) * q->mtu)) == NULL)
+		return -1;
+
+	memset(q->msgs, 0, sizeof(q->msgs));
+	for (i = 0; i < ARRAYSIZE(q->msgs); i++) {
+		q->iov[i].iov_base = q->data + i * q->mtu;
+		q->msgs[i].msg_hdr.msg_iov = &q->iov[i];
+		q->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Initialize BT output queue.
+ *
+ * @param q Address of the queue structure.
+ * @param t Transport associated with the queue. The writing MTU of this
+ *   transport determines the maximal size of the packet.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int io_bt_queue_init(struct io_bt_queue *q, struct ba_transport *t) {
+	return io_bt_queue_init_fd(q, t, t->bt_fd, t->mtu_write, t->a2dp.bt_fd_coutq_init);
+}
+
+/**
+ * Free BT output queue resources. */
+static void io_bt_queue_free(struct io_bt_queue *q) {
+	free(q->data);
+	q->data = NULL;
+}
+
+/**
+ * Sample the number of bytes queued in the BT socket. */
+static void io_bt_queue_sample_coutq(struct io_bt_queue *q) {
+
+	int coutq;
+
+	gettimestamp(&q->coutq_ts);
+	if (ioctl(q->fd, TIOCOUTQ, &coutq) == -1) {
+		warn("Couldn't get BT queued bytes: %s", strerror(errno));
+		return;
+	}
+
+	q->coutq = abs(q->fd_coutq_init - coutq);
+	if (q->fd == q->t->bt_fd)
+		q->t->stats.bt_coutq = q->coutq;
+	if ((unsigned int)q->coutq > q->t->stats.bt_coutq_max)
+		q->t->stats.bt_coutq_max = q->coutq;
+}
+
+/**
+ * Get the number of bytes queued in the BT socket.
+ *
+ * The value returned by this function is updated at most once per the
+ * IO_THREAD_COUTQ_INTERVAL milliseconds, or right after the BT socket has
+ * refused to accept more data. */
+static int io_bt_queue_coutq(struct io_bt_queue *q) {
+
+	struct timespec ts_now;
+	struct timespec ts_diff;
+
+	gettimestamp(&ts_now);
+	difftimespec(&q->coutq_ts, &ts_now, &ts_diff);
+
+	if (ts_diff.tv_sec > 0 ||
+			ts_diff.tv_nsec >= IO_THREAD_COUTQ_INTERVAL * 1000000L)
+		io_bt_queue_sample_coutq(q);
+
+	return q->coutq;
+}
+
+/**
+ * Get the time (in milliseconds) spent on waiting for the BT socket since
+ * the last call to this function. */
+static unsigned int io_bt_queue_blocked(struct io_bt_queue *q) {
+	unsigned int blocked = q->blocked / 1000;
+	q->blocked %= 1000;
+	return blocked;
+}
+
+/**
+ * Write all queued packets to the BT SEQPACKET socket.
+ *
+ * If the socket output buffer is full, this function will block until all
+ * packets are written. In such case, the number of bytes queued in the BT
+ * socket is sampled right away, so the encoder will see the congestion.
+ *
+ * @param q Address of the queue structure.
+ * @return Upon success this function returns the number of written packets.
+ *   Otherwise, -1 is returned and errno is set appropriately. Upon error, all
+ *   queued packets are discarded. In the drop mode, packets which can not
+ *   be written right away are discarded as well. */
+static ssize_t io_bt_queue_flush(struct io_bt_queue *q) {
+
+	struct pollfd pfd = { q->fd, POLLOUT, 0 };
+	struct timespec ts0, ts;
+	size_t i = 0;
+	int ret;
+
+	while (i < q->len) {
+		if ((ret = sendmmsg(pfd.fd, &q->msgs[i], q->len - i, MSG_DONTWAIT)) == -1)
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				io_bt_queue_sample_coutq(q);
+				if (q->drop) {
+					q->t->stats.bt_dropped += q->len - i;
+					goto final;
+				}
+				ts0 = q->coutq_ts;
+				poll(&pfd, 1, -1);
+				gettimestamp(&ts);
+				difftimespec(&ts0, &ts, &ts);
+				q->blocked += ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+				q->t->stats.bt_blocked += ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+				continue;
+			default:
+				q->t->stats.bt_packets += i;
+				q->t->stats.bt_dropped += q->len - i;
+				q->len = 0;
+				return -1;
+			}
+		for (ret += i; i < (size_t)ret; i++)
+			q->t->stats.bt_bytes += q->msgs[i].msg_len;
+	}
+
+final:
+	q->t->stats.bt_packets += i;
+	q->len = 0;
+	return i;
+}
+
+/**
+ * Append packet to the BT output queue.
+ *
+ * If the queue is full, queued packets are flushed first.
+ *
+ * @param q Address of the queue structure.
+ * @param buffer Address of the packet data.
+ * @param len Size of the packet. It shall not exceed the writing MTU.
+ * @return Upon success this function returns the number of queued bytes.
+ *   Otherwise, -1 is returned and errno is set appropriately. */
+static ssize_t io_bt_queue_push(struct io_bt_queue *q, const void *buffer, size_t len) {
+
+	if (len > q->mtu) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (q->len == ARRAYSIZE(q->msgs) &&
+			io_bt_queue_flush(q) == -1)
+		return -1;
+
+	io_thread_capture(q->t, CAPTURE_TYPE_BT_OUT, buffer, len);
+
+	memcpy(q->iov[q->len].iov_base, buffer, len);
+	q->iov[q->len].iov_len = len;
+	q->len++;
+
+	return len;
+}
+
+/**
+ * Check whether all packets have been transmitted.
+ *
+ * Packets which are still queued in the BT output stage are flushed, and
+ * the number of bytes queued in the BT socket is sampled right away. */
+static bool io_bt_queue_drained(struct io_bt_queue *q) {
+	if (q->len > 0 && io_bt_queue_flush(q) == -1)
+		return true;
+	io_bt_queue_sample_coutq(q);
+	return q->coutq == 0;
+}
+
+#if ENABLE_AAC || ENABLE_LDAC
+/**
+ * Get the codec context cache of the transport device. */
+static struct codec_cache *io_thread_codec_cache(const struct ba_transport *t) {
+	return t->device != NULL ? &t->device->codecs : NULL;
+}
+#endif
+
+#if ENABLE_AAC
+static void io_aacdec_close(void *handle) {
+	aacDecoder_Close(handle);
+}
+static void io_aacenc_close(void *handle) {
+	HANDLE_AACENCODER h = handle;
+	aacEncClose(&h);
+}
+#endif
+
+#if ENABLE_LDAC
+static void io_ldacenc_close(void *handle) {
+	ldacBT_free_handle(handle);
+}
+
+/**
+ * Initialize LDAC encoder for the given PCM sample format. */
+static int io_ldacenc_init(HANDLE_LDAC_BT handle, int mtu, int channel_mode,
+		enum ba_pcm_format format, int samplerate) {
+
+	static const LDACBT_SMPL_FMT_T formats[] = {
+		[BA_PCM_FORMAT_S16_LE] = LDACBT_SMPL_FMT_S16,
+		[BA_PCM_FORMAT_S24_3LE] = LDACBT_SMPL_FMT_S24,
+		[BA_PCM_FORMAT_S32_LE] = LDACBT_SMPL_FMT_S32,
+		[BA_PCM_FORMAT_FLOAT_LE] = LDACBT_SMPL_FMT_F32,
+	};
+
+	return ldacBT_init_handle_encode(handle, mtu, config.ldac_eqmid,
+			channel_mode, formats[format], samplerate);
+}
+#endif
+
+/**
+ * Pipelined BT transmit stage (pacer).
+ *
+ * The encoder thread pushes ready RTP packets into a small queue, while the
+ * pacer thread transmits them at the rate determined by the number of PCM
+ * frames carried by every packet. In such a setup, the time spent on the
+ * encoding does not affect the transmission clock, and the spare CPU core
+ * might be used for encoding the next packets in the meantime. */
+struct io_pacer {
+
+	/* associated transport */
+	struct ba_transport *t;
+	unsigned int samplerate;
+	/* limit of frames queued ahead of the transmission */
+	unsigned int frames_max;
+
+	pthread_t thread;
+	bool thread_created;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* storage for queued packets */
+	uint8_t *data;
+	size_t mtu;
+
+	size_t lens[IO_THREAD_PACER_QUEUE_SIZE];
+	unsigned int frames[IO_THREAD_PACER_QUEUE_SIZE];
+	/* index of the oldest packet and the number of queued packets */
+	size_t head;
+	size_t len;
+	/* overall number of queued frames */
+	unsigned int queued_frames;
+
+	/* restart transmission clock */
+	bool reset;
+	/* packets are being transmitted by the pacer thread */
+	bool sending;
+	/* the last sample of bytes queued in the BT socket */
+	int coutq;
+	/* time (in milliseconds) spent on waiting for the BT socket */
+	unsigned int blocked;
+	/* fatal error reported by the transmit thread */
+	int err;
+
+};
+
+static void *io_pacer_thread(void *arg) {
+	struct io_pacer *p = (struct io_pacer *)arg;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	struct io_bt_queue btq = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_bt_queue_free), &btq);
+
+	struct asrsync asrs = { .frames = 0, .catchup = config.io_thread.catchup };
+
+	if (io_bt_queue_init(&btq, p->t) == -1) {
+		error("Couldn't create data buffers: %s", strerror(errno));
+		pthread_mutex_lock(&p->mutex);
+		p->err = errno;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->mutex);
+		goto fail;
+	}
+
+	for (;;) {
+
+		unsigned int frames = 0;
+
+		pthread_mutex_lock(&p->mutex);
+		pthread_cleanup_push(PTHREAD_CLEANUP(pthread_mutex_unlock), &p->mutex);
+
+		while (p->len == 0) {
+			/* Queue underrun - it is not possible to keep the constant rate any
+			 * more, so the transmission clock will be restarted. */
+			asrs.frames = 0;
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			pthread_cond_wait(&p->cond, &p->mutex);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		}
+
+		if (p->reset) {
+			asrs.frames = 0;
+			p->reset = false;
+		}
+
+		/* Move packets to the BT output stage. Packets which do not carry any
+		 * frames (e.g. fragments of the larger payload) are sent together with
+		 * the following one. */
+		while (p->len > 0 && frames == 0 && btq.len < ARRAYSIZE(btq.msgs)) {
+			io_bt_queue_push(&btq, p->data + p->head * p->mtu, p->lens[p->head]);
+			frames = p->frames[p->head];
+			p->queued_frames -= frames;
+			p->head = (p->head + 1) % IO_THREAD_PACER_QUEUE_SIZE;
+			p->len--;
+		}
+
+		p->sending = true;
+
+		pthread_cond_broadcast(&p->cond);
+		pthread_cleanup_pop(1);
+
+		if (asrs.frames == 0)
+			asrsync_init(&asrs, p->samplerate);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ssize_t ret = io_bt_queue_flush(&btq);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (ret == -1) {
+			if (errno == ECONNRESET || errno == ENOTCONN) {
+				/* let the encoder know about the BT socket disconnection */
+				pthread_mutex_lock(&p->mutex);
+				p->err = errno;
+				pthread_cond_broadcast(&p->cond);
+				pthread_mutex_unlock(&p->mutex);
+				goto fail;
+			}
+			error("BT socket write error: %s", strerror(errno));
+		}
+
+		int coutq = io_bt_queue_coutq(&btq);
+		pthread_mutex_lock(&p->mutex);
+		p->sending = false;
+		p->coutq = coutq;
+		p->blocked += io_bt_queue_blocked(&btq);
+		pthread_mutex_unlock(&p->mutex);
+
+		/* keep data transfer at a constant bit rate */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		io_thread_asrsync(p->t, &asrs, frames);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	}
+
+fail:
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/**
+ * Initialize and start the pipelined transmit stage.
+ *
+ * @param p Address of the pacer structure.
+ * @param t Transport associated with the pacer. The writing MTU of this
+ *   transport determines the maximal size of the packet.
+ * @param samplerate Sampling rate of the transmitted audio.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int io_pacer_init(struct io_pacer *p, struct ba_transport *t,
+		unsigned int samplerate) {
+
+	int err;
+
+	p->t = t;
+	p->samplerate = samplerate;
+	p->frames_max = samplerate * IO_THREAD_PACER_AHEAD / 1000;
+	p->thread_created = false;
+	p->mtu = t->mtu_write;
+	p->head = 0;
+	p->len = 0;
+	p->queued_frames = 0;
+	p->reset = false;
+	p->sending = false;
+	p->coutq = 0;
+	p->blocked = 0;
+	p->err = 0;
+
+	if ((p->data = malloc(IO_THREAD_PACER_QUEUE_SIZE * p->mtu)) == NULL)
+		return -1;
+
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	if ((err = pthread_create(&p->thread, NULL, io_pacer_thread, p)) != 0) {
+		errno = err;
+		return -1;
+	}
+
+	pthread_setname_np(p->thread, "baio-tx");
+	p->thread_created = true;
+	return 0;
+}
+
+/**
+ * Terminate the transmit thread and free pacer resources.
+ *
+ * It is safe to call this function for a zero-initialized structure. */
+static void io_pacer_free(struct io_pacer *p) {
+
+	if (p->thread_created) {
+		pthread_cancel(p->thread);
+		pthread_join(p->thread, NULL);
+		p->thread_created = false;
+	}
+
+	if (p->data == NULL)
+		return;
+
+	pthread_mutex_destroy(&p->mutex);
+	pthread_cond_destroy(&p->cond);
+	free(p->data);
+	p->data = NULL;
+
+}
+
+/**
+ * Queue packet for the transmission.
+ *
+ * This function blocks if the encoder is too far ahead of the transmission.
+ * It is a cancellation point.
+ *
+ * @param p Address of the pacer structure.
+ * @param buffer Address of the packet data.
+ * @param len Size of the packet. It shall not exceed the writing MTU.
+ * @param frames The number of PCM frames carried by this packet. Packets with
+ *   zero frames are transmitted together with the next packet.
+ * @return Upon success this function returns the number of queued bytes.
+ *   Otherwise, -1 is returned and errno is set appropriately. */
+static ssize_t io_pacer_push(struct io_pacer *p, const void *buffer, size_t len,
+		unsigned int frames) {
+
+	ssize_t ret = -1;
+
+	if (len > p->mtu) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&p->mutex);
+	pthread_cleanup_push(PTHREAD_CLEANUP(pthread_mutex_unlock), &p->mutex);
+
+	while (p->err == 0 && (p->len == IO_THREAD_PACER_QUEUE_SIZE ||
+				(p->queued_frames > 0 && p->queued_frames >= p->frames_max)))
+		pthread_cond_wait(&p->cond, &p->mutex);
+
+	if (p->err != 0) {
+		errno = p->err;
+		goto final;
+	}
+
+	size_t i = (p->head + p->len) % IO_THREAD_PACER_QUEUE_SIZE;
+	memcpy(p->data + i * p->mtu, buffer, len);
+	p->lens[i] = len;
+	p->frames[i] = frames;
+	p->queued_frames += frames;
+	p->len++;
+	ret = len;
+
+	pthread_cond_broadcast(&p->cond);
+
+final:
+	pthread_cleanup_pop(1);
+	return ret;
+}
+
+/**
+ * Restart the transmission clock before the next packet. */
+static void io_pacer_reset(struct io_pacer *p) {
+	pthread_mutex_lock(&p->mutex);
+	p->reset = true;
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/**
+ * Get the number of bytes queued in the BT socket. */
+static int io_pacer_coutq(struct io_pacer *p) {
+	pthread_mutex_lock(&p->mutex);
+	int coutq = p->coutq;
+	pthread_mutex_unlock(&p->mutex);
+	return coutq;
+}
+
+/**
+ * Check whether all packets have been transmitted. */
+static bool io_pacer_drained(struct io_pacer *p) {
+
+	int coutq;
+
+	pthread_mutex_lock(&p->mutex);
+	const bool idle = p->len == 0 && !p->sending;
+	pthread_mutex_unlock(&p->mutex);
+
+	if (!idle)
+		return false;
+	if (ioctl(p->t->bt_fd, TIOCOUTQ, &coutq) == -1)
+		return true;
+
+	return coutq == p->t->a2dp.bt_fd_coutq_init;
+}
+
+/**
+ * Get the time (in milliseconds) spent on waiting for the BT socket since
+ * the last call to this function. */
+static unsigned int io_pacer_blocked(struct io_pacer *p) {
+	pthread_mutex_lock(&p->mutex);
+	unsigned int blocked = p->blocked;
+	p->blocked = 0;
+	pthread_mutex_unlock(&p->mutex);
+	return blocked;
+}
+
+/**
+ * Get the delay (in 1/10 of millisecond) of frames queued in the pacer. */
+static unsigned int io_pacer_delay(struct io_pacer *p) {
+	pthread_mutex_lock(&p->mutex);
+	unsigned int frames = p->queued_frames;
+	pthread_mutex_unlock(&p->mutex);
+	return (uint64_t)frames * 10000 / p->samplerate;
+}
+
+/**
+ * Initialize RTP headers.
+ *
+ * @param s The memory area where the RTP headers will be initialized.
+ * @param hdr The address where the pointer to the RTP header will be stored.
+ * @param mhdr The address where the pointer to the RTP media payload header
+ *   will be stored. This parameter might be NULL in order to omit RTP media
+ *   payload header.
+ * @return This function returns the address of the RTP payload region. */
+static uint8_t *io_thread_init_rtp(void *s, rtp_header_t **hdr, rtp_media_header_t **mhdr) {
+
+	rtp_header_t *header = *hdr = (rtp_header_t *)s;
+	memset(header, 0, RTP_HEADER_LEN);
+	header->paytype = 96;
+	header->version = 2;
+	header->seq_number = random();
+	header->timestamp = random();
+
+	uint8_t *data = (uint8_t *)&header->csrc[header->cc];
+
+	if (mhdr != NULL) {
+		memset(data, 0, sizeof(rtp_media_header_t));
+		*mhdr = (rtp_media_header_t *)data;
+		data += sizeof(rtp_media_header_t);
+	}
+
+	return data;
+}
+
+/**
+ * Write the encoded data block to the A2DP sink PCM.
+ *
+ * @param t Transport associated with the PCM.
+ * @param timestamp RTP time-stamp of the first frame in the block.
+ * @param data Address of the encoded data.
+ * @param len Length of the encoded data. */
+static void io_a2dp_sink_write_encoded(struct ba_transport *t, uint32_t timestamp,
+		const void *data, size_t len) {
+
+	const struct ba_pcm_encoded_frame header = {
+		.timestamp = timestamp, .len = len };
+
+	ssize_t ret;
+
+	/* In the non-blocking mode, the frame is written with a single call,
+	 * so it is either written or dropped as a whole. */
+	if (t->a2dp.pcm.nonblock) {
+		uint8_t buffer[PIPE_BUF];
+		if (sizeof(header) + len > sizeof(buffer)) {
+			io_thread_pcm_overrun(&t->a2dp.pcm, len);
+			return;
+		}
+		memcpy(buffer, &header, sizeof(header));
+		memcpy(buffer + sizeof(header), data, len);
+		ret = io_thread_write_pcm(&t->a2dp.pcm, buffer, sizeof(header) + len);
+	}
+	/* Header and data are written separately, which is fine, because the
+	 * IO thread is the only writer. However, if the client has gone away
+	 * after the header has been written, the data shall not be written. */
+	else if ((ret = io_thread_write_pcm(&t->a2dp.pcm, &header, sizeof(header))) > 0)
+		ret = io_thread_write_pcm(&t->a2dp.pcm, data, len);
+
+	if (ret == -1)
+		error("FIFO write error: %s", strerror(errno));
+
+}
+
+/**
+ * Update the remote clock drift estimation with the received RTP packet. */
+static void io_a2dp_sink_drift(struct ba_transport *t, const rtp_header_t *rtp_header) {
+	struct timespec ts;
+	gettimestamp(&ts);
+	drift_estimator_update(&t->a2dp.drift, ntohl(rtp_header->timestamp), &ts);
+	t->stats.drift_ppm = drift_estimator_get_ppm(&t->a2dp.drift);
+}
+
+/**
+ * Decode SBC frames carried by the RTP packet and write them to the PCM.
+ *
+ * @param t Transport associated with the decoder.
+ * @param sbc Initialized SBC decoder.
+ * @param packet Address of the RTP packet.
+ * @param len Length of the RTP packet.
+ * @param pcm PCM buffer, which shall fit at least one decoded SBC frame.
+ * @param channels Number of PCM channels.
+ * @param seq_number The address of the last received RTP sequence number. */
+static void io_a2dp_sink_sbc_decode(struct ba_transport *t, sbc_t *sbc,
+		const uint8_t *packet, size_t len, ffb_int16_t *pcm, unsigned int channels,
+		uint16_t *seq_number) {
+
+	const rtp_header_t *rtp_header = (rtp_header_t *)packet;
+	const rtp_media_header_t *rtp_media_header = (rtp_media_header_t *)&rtp_header->csrc[rtp_header->cc];
+	const uint8_t *rtp_payload = (uint8_t *)(rtp_media_header + 1);
+	size_t rtp_payload_len = len - ((void *)rtp_payload - (void *)rtp_header);
+
+#if ENABLE_PAYLOADCHECK
+	if (rtp_header->paytype < 96) {
+		warn("Unsupported RTP payload type: %u", rtp_header->paytype);
+		return;
+	}
+#endif
+
+	uint16_t _seq_number = ntohs(rtp_header->seq_number);
+	if (++*seq_number != _seq_number) {
+		if (*seq_number != 0) {
+			warn("Missing RTP packet: %u != %u", _seq_number, *seq_number);
+			t->stats.rtp_gaps += (uint16_t)(_seq_number - *seq_number);
+		}
+		*seq_number = _seq_number;
+	}
+
+	io_a2dp_sink_drift(t, rtp_header);
+
+	if (t->a2dp.pcm.format == BA_PCM_FORMAT_ENCODED) {
+		io_a2dp_sink_write_encoded(t, ntohl(rtp_header->timestamp), rtp_payload, rtp_payload_len);
+		return;
+	}
+
+	/* decode retrieved SBC frames */
+	size_t frames = rtp_media_header->frame_count;
+	while (frames--) {
+
+		struct timespec ts_codec;
+		ssize_t len;
+		size_t decoded;
+
+		gettimestamp(&ts_codec);
+		if ((len = sbc_decode(sbc, rtp_payload, rtp_payload_len,
+						pcm->data, ffb_blen_in(pcm), &decoded)) < 0) {
+			error("SBC decoding error: %s", strerror(-len));
+			break;
+		}
+		io_thread_stats_codec(t, &ts_codec);
+
+		rtp_payload += len;
+		rtp_payload_len -= len;
+
+		const size_t samples = decoded / sizeof(int16_t);
+		io_thread_scale_pcm(t, pcm->data, samples, channels);
+		if (io_thread_write_pcm(&t->a2dp.pcm, pcm->data, samples) == -1)
+			error("FIFO write error: %s", strerror(errno));
+
+	}
+
+}
+
+void *io_thread_a2dp_sink_sbc(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+
+	/* Cancellation should be possible only in the carefully selected place
+	 * in order to prevent memory leaks and resources not being released. */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+
+	/* Lock transport during initialization stage. This lock will ensure,
+	 * that no one will modify critical section until thread state can be
+	 * known - initialization has failed or succeeded. */
+	bool locked = !transport_pthread_cleanup_lock(t);
+
+	if (t->bt_fd == -1) {
+		error("Invalid BT socket: %d", t->bt_fd);
+		goto fail_init;
+	}
+
+	/* Check for invalid (e.g. not set) reading MTU. If buffer allocation does
+	 * not return NULL (allocating zero bytes might return NULL), we will read
+	 * zero bytes from the BT socket, which will be wrongly identified as a
+	 * "connection closed" action. */
+	if (t->mtu_read <= 0) {
+		error("Invalid reading MTU: %zu", t->mtu_read);
+		goto fail_init;
+	}
+
+	sbc_t sbc;
+
+	if ((errno = -sbc_init_a2dp(&sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
+		error("Couldn't initialize SBC codec: %s", strerror(errno));
+		goto fail_init;
+	}
+
+	const unsigned int channels = transport_get_channels(t);
+
+	ffb_uint8_t bt = { 0 };
+	ffb_int16_t pcm = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(sbc_finish), &sbc);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+
+	if (ffb_int16_init(&pcm, sbc_get_codesize(&sbc)) == -1 ||
+			ffb_uint8_init(&bt, t->mtu_read) == -1) {
+		error("Couldn't create data buffers: %s", strerror(errno));
+		goto fail_ffb;
+	}
+
+	struct jitter_buffer jb = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(jitter_buffer_free), &jb);
+
+	if (config.a2dp.jitter_buffer > 0 &&
+			jitter_buffer_init(&jb, t->mtu_read, transport_get_sampling(t),
+				config.a2dp.jitter_buffer) == -1) {
+		error("Couldn't create jitter buffer: %s", strerror(errno));
+		goto fail_jitter;
+	}
+
+	/* the number of PCM frames encoded in a single SBC frame */
+	const unsigned int sbc_frame_frames = sbc_get_codesize(&sbc) / channels / sizeof(int16_t);
+	/* the number of valid samples in the PCM buffer - used for PLC */
+	size_t pcm_samples = 0;
+
+	/* Lock transport during thread cancellation. This handler shall be at
+	 * the top of the cleanup stack - lastly pushed. */
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+
+	uint16_t seq_number = -1;
+	drift_estimator_init(&t->a2dp.drift, transport_get_sampling(t));
+
+	struct pollfd pfds[] = {
+		{ t->sig_fd, POLLIN, 0 },
+		{ -1, POLLIN, 0 },
+	};
+
+	transport_pthread_cleanup_unlock(t);
+	locked = false;
+
+	debug("Starting IO loop: %s (%s)",
+			bluetooth_profile_to_string(t->profile),
+			bluetooth_a2dp_codec_to_string(t->codec));
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		struct timespec ts;
+		int timeout = -1;
+		ssize_t len;
+
+		/* add BT socket to the poll if transport is active */
+		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
+
+		if (jb.packets != NULL) {
+			gettimestamp(&ts);
+			timeout = jitter_buffer_timeout(&jb, &ts);
+		}
+
+		if (poll(pfds, ARRAYSIZE(pfds), timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("Transport poll error: %s", strerror(errno));
+			goto fail;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			/* drop incoming commands */
+			struct ba_transport_cmd cmd;
+			while (transport_recv_command(t, &cmd))
+				continue;
+			continue;
+		}
+
+		if (pfds[1].revents & POLLIN) {
+
+			if ((len = read(pfds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
+				debug("BT read error: %s", strerror(errno));
+				continue;
+			}
+
+			io_thread_capture(t, CAPTURE_TYPE_BT_IN, bt.tail, len);
+
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+			/* it seems that zero is never returned... */
+			if (len == 0) {
+				debug("BT socket has been closed: %d", pfds[1].fd);
+				/* Prevent sending the release request to the BlueZ. If the socket has
+				 * been closed, it means that BlueZ has already closed the connection. */
+				close(pfds[1].fd);
+				t->bt_fd = -1;
+				goto fail;
+			}
+
+			if (t->a2dp.pcm.fd == -1) {
+				seq_number = -1;
+				if (jb.packets != NULL)
+					jitter_buffer_reset(&jb);
+				continue;
+			}
+
+			if (jb.packets == NULL) {
+				t->stats.bt_packets++;
+				t->stats.bt_bytes += len;
+				io_a2dp_sink_sbc_decode(t, &sbc, bt.data, len, &pcm, channels, &seq_number);
+				continue;
+			}
+
+			const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
+			const rtp_media_header_t *rtp_media_header = (rtp_media_header_t *)&rtp_header->csrc[rtp_header->cc];
+			io_thread_jitter_put(t, &jb, bt.data, len, rtp_media_header->frame_count * sbc_frame_frames);
+
+		}
+
+		if (jb.packets == NULL || t->a2dp.pcm.fd == -1)
+			continue;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/* release packets from the jitter buffer with the stream rate */
+		const uint8_t *packet;
+		size_t packet_len;
+		unsigned int frames;
+		enum jitter_status status;
+
+		const unsigned int underruns = jb.underruns;
+
+		gettimestamp(&ts);
+		while ((status = jitter_buffer_get(&jb, &ts, &packet, &packet_len, &frames)) != JITTER_EMPTY) {
+			if (status == JITTER_PACKET) {
+				io_a2dp_sink_sbc_decode(t, &sbc, packet, packet_len, &pcm, channels, &seq_number);
+				pcm_samples = sbc_get_codesize(&sbc) / sizeof(int16_t);
+			}
+			else
+				io_thread_write_pcm_plc(&t->a2dp.pcm, &pcm, &pcm_samples, frames * channels);
+		}
+
+		t->stats.pcm_underruns += jb.underruns - underruns;
+
+	}
+
+fail:
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_pop(!locked);
+fail_jitter:
+	pthread_cleanup_pop(1);
+fail_ffb:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+fail_init:
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/**
+ * Release transport served by the IO engine task.
+ *
+ * This function does the same as the IO thread cleanup handler, except
+ * that there is no thread handler to reset. */
+static void io_engine_transport_release(struct ba_transport *t) {
+
+	transport_pthread_cleanup_lock(t);
+
+	if (t->release != NULL)
+		t->release(t);
+
+	switch (t->type) {
+	case TRANSPORT_TYPE_A2DP:
+		transport_pcm_drained(&t->a2dp.pcm);
+		break;
+	case TRANSPORT_TYPE_RFCOMM:
+		break;
+	case TRANSPORT_TYPE_SCO:
+		transport_pcm_drained(&t->sco.spk_pcm);
+		break;
+	}
+
+	transport_pthread_cleanup_unlock(t);
+
+	debug("Exiting IO task");
+}
+
+/**
+ * The state of the A2DP SBC sink driven by the IO engine. */
+struct io_engine_a2dp_sink_sbc {
+
+	struct ba_transport *t;
+
+	sbc_t sbc;
+	unsigned int channels;
+	uint16_t seq_number;
+
+	ffb_uint8_t bt;
+	ffb_int16_t pcm;
+
+	struct jitter_buffer jb;
+	/* the number of PCM frames encoded in a single SBC frame */
+	unsigned int sbc_frame_frames;
+	/* the number of valid samples in the PCM buffer - used for PLC */
+	size_t pcm_samples;
+
+	struct io_engine_watch sig_watch;
+	struct io_engine_watch bt_watch;
+	/* jitter buffer playout timer */
+	struct io_engine_timer jb_timer;
+
+};
+
+/**
+ * Schedule the next jitter buffer playout. */
+static void io_engine_a2dp_sink_sbc_schedule(struct io_engine_a2dp_sink_sbc *io) {
+
+	struct timespec ts;
+	int timeout;
+
+	gettimestamp(&ts);
+	switch (timeout = jitter_buffer_timeout(&io->jb, &ts)) {
+	case -1:
+		io_engine_timer_set(&io->jb_timer, 0, 0);
+		break;
+	case 0:
+		/* zero value would disarm the timer */
+		io_engine_timer_set(&io->jb_timer, 1, 0);
+		break;
+	default:
+		io_engine_timer_set(&io->jb_timer, timeout * 1000, 0);
+	}
+
+}
+
+static void io_engine_a2dp_sink_sbc_reset(struct io_engine_a2dp_sink_sbc *io) {
+	io->seq_number = -1;
+	if (io->jb.packets != NULL) {
+		jitter_buffer_reset(&io->jb);
+		io_engine_timer_set(&io->jb_timer, 0, 0);
+	}
+}
+
+/**
+ * Release packets from the jitter buffer with the stream rate. */
+static void io_engine_a2dp_sink_sbc_playout(struct io_engine_timer *timer, uint64_t expirations) {
+	struct io_engine_a2dp_sink_sbc *io = timer->watch.task->userdata;
+	struct ba_transport *t = io->t;
+	(void)expirations;
+
+	const uint8_t *packet;
+	size_t packet_len;
+	unsigned int frames;
+	enum jitter_status status;
+	struct timespec ts;
+
+	if (t->a2dp.pcm.fd == -1)
+		return;
+
+	const unsigned int underruns = io->jb.underruns;
+
+	gettimestamp(&ts);
+	while ((status = jitter_buffer_get(&io->jb, &ts, &packet, &packet_len, &frames)) != JITTER_EMPTY) {
+		if (status == JITTER_PACKET) {
+			io_a2dp_sink_sbc_decode(t, &io->sbc, packet, packet_len, &io->pcm,
+					io->channels, &io->seq_number);
+			io->pcm_samples = sbc_get_codesize(&io->sbc) / sizeof(int16_t);
+		}
+		else
+			io_thread_write_pcm_plc(&t->a2dp.pcm, &io->pcm, &io->pcm_samples,
+					frames * io->channels);
+	}
+
+	t->stats.pcm_underruns += io->jb.underruns - underruns;
+	io_engine_a2dp_sink_sbc_schedule(io);
+
+}
+
+static void io_engine_a2dp_sink_sbc_sig(struct io_engine_watch *watch, uint32_t events) {
+	struct io_engine_a2dp_sink_sbc *io = watch->task->userdata;
+	(void)events;
+
+	struct ba_transport_cmd cmd;
+	while (transport_recv_command(io->t, &cmd))
+		switch (cmd.sig) {
+		case TRANSPORT_PCM_OPEN:
+		case TRANSPORT_PCM_CLOSE:
+			/* the stream is restarted for the new PCM client */
+			io_engine_a2dp_sink_sbc_reset(io);
+			break;
+		default:
+			break;
+		}
+
+	/* read BT socket only if transport is active */
+	io_engine_watch_set_events(&io->bt_watch,
+			io->t->state == TRANSPORT_ACTIVE ? EPOLLIN : 0);
+
+}
+
+static void io_engine_a2dp_sink_sbc_bt(struct io_engine_watch *watch, uint32_t events) {
+	struct io_engine_a2dp_sink_sbc *io = watch->task->userdata;
+	struct ba_transport *t = io->t;
+	(void)events;
+
+	ssize_t len;
+
+	if (t->state != TRANSPORT_ACTIVE) {
+		io_engine_watch_set_events(watch, 0);
+		return;
+	}
+
+	if ((len = read(watch->fd, io->bt.tail, ffb_len_in(&io->bt))) == -1) {
+		debug("BT read error: %s", strerror(errno));
+		return;
+	}
+
+	io_thread_capture(t, CAPTURE_TYPE_BT_IN, io->bt.tail, len);
+
+	if (len == 0) {
+		debug("BT socket has been closed: %d", watch->fd);
+		/* Prevent sending the release request to the BlueZ. If the socket has
+		 * been closed, it means that BlueZ has already closed the connection. */
+		close(watch->fd);
+		t->bt_fd = -1;
+		io_engine_task_stop(watch->task);
+		return;
+	}
+
+	if (t->a2dp.pcm.fd == -1) {
+		io_engine_a2dp_sink_sbc_reset(io);
+		return;
+	}
+
+	if (io->jb.packets == NULL) {
+		t->stats.bt_packets++;
+		t->stats.bt_bytes += len;
+		io_a2dp_sink_sbc_decode(t, &io->sbc, io->bt.data, len, &io->pcm,
+				io->channels, &io->seq_number);
+		return;
+	}
+
+	const rtp_header_t *rtp_header = (rtp_header_t *)io->bt.data;
+	const rtp_media_header_t *rtp_media_header = (rtp_media_header_t *)&rtp_header->csrc[rtp_header->cc];
+	io_thread_jitter_put(t, &io->jb, io->bt.data, len,
+			rtp_media_header->frame_count * io->sbc_frame_frames);
+
+	/* release packets which are already due, and reschedule the playout */
+	io_engine_a2dp_sink_sbc_playout(&io->jb_timer, 0);
+
+}
+
+static void io_engine_a2dp_sink_sbc_free(struct io_engine_a2dp_sink_sbc *io) {
+	io_engine_timer_free(&io->jb_timer);
+	jitter_buffer_free(&io->jb);
+	sbc_finish(&io->sbc);
+	ffb_uint8_free(&io->bt);
+	ffb_int16_free(&io->pcm);
+	free(io);
+}
+
+static void io_engine_a2dp_sink_sbc_cleanup(struct io_engine_task *task) {
+	struct io_engine_a2dp_sink_sbc *io = task->userdata;
+	struct ba_transport *t = io->t;
+
+	io_engine_a2dp_sink_sbc_free(io);
+	task->userdata = NULL;
+
+	t->a2dp.pcm.nonblock = false;
+	io_engine_transport_release(t);
+}
+
+/**
+ * Start A2DP SBC sink as an IO engine task.
+ *
+ * This is an equivalent of the io_thread_a2dp_sink_sbc() thread, which is
+ * served by the IO engine worker instead of a dedicated thread.
+ *
+ * @param t Transport structure.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned. */
+int io_engine_a2dp_sink_sbc(struct ba_transport *t) {
+
+	struct io_engine_a2dp_sink_sbc *io;
+
+	if (t->bt_fd == -1) {
+		error("Invalid BT socket: %d", t->bt_fd);
+		return -1;
+	}
+
+	if (t->mtu_read <= 0) {
+		error("Invalid reading MTU: %zu", t->mtu_read);
+		return -1;
+	}
+
+	if ((io = calloc(1, sizeof(*io))) == NULL) {
+		error("Couldn't create IO task: %s", strerror(errno));
+		return -1;
+	}
+
+	io->jb_timer.watch.fd = -1;
+
+	if ((errno = -sbc_init_a2dp(&io->sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
+		error("Couldn't initialize SBC codec: %s", strerror(errno));
+		free(io);
+		return -1;
+	}
+
+	io->t = t;
+	io->channels = transport_get_channels(t);
+	io->seq_number = -1;
+	io->sbc_frame_frames = sbc_get_codesize(&io->sbc) / io->channels / sizeof(int16_t);
+	drift_estimator_init(&t->a2dp.drift, transport_get_sampling(t));
+
+	/* IO task buffers are charged to the transport like in the IO thread */
+	ffb_budget_attach(&t->buffers);
+	if (ffb_int16_init(&io->pcm, sbc_get_codesize(&io->sbc)) == -1 ||
+			ffb_uint8_init(&io->bt, t->mtu_read) == -1) {
+		ffb_budget_attach(NULL);
+		error("Couldn't create data buffers: %s", strerror(errno));
+		goto fail;
+	}
+	if (config.a2dp.jitter_buffer > 0 &&
+			jitter_buffer_init(&io->jb, t->mtu_read, transport_get_sampling(t),
+				config.a2dp.jitter_buffer) == -1) {
+		ffb_budget_attach(NULL);
+		error("Couldn't create jitter buffer: %s", strerror(errno));
+		goto fail;
+	}
+	ffb_budget_attach(NULL);
+
+	if (io_engine_timer_init(&io->jb_timer, io_engine_a2dp_sink_sbc_playout) == -1) {
+		error("Couldn't create playout timer: %s", strerror(errno));
+		goto fail;
+	}
+
+	io->sig_watch.fd = t->sig_fd;
+	io->sig_watch.events = EPOLLIN;
+	io->sig_watch.callback = io_engine_a2dp_sink_sbc_sig;
+
+	io->bt_watch.fd = t->bt_fd;
+	io->bt_watch.events = t->state == TRANSPORT_ACTIVE ? EPOLLIN : 0;
+	io->bt_watch.callback = io_engine_a2dp_sink_sbc_bt;
+
+	t->task.watches = NULL;
+	t->task.cleanup = io_engine_a2dp_sink_sbc_cleanup;
+	t->task.userdata = io;
+	io_engine_task_add_watch(&t->task, &io->sig_watch);
+	io_engine_task_add_watch(&t->task, &io->bt_watch);
+	io_engine_task_add_watch(&t->task, &io->jb_timer.watch);
+
+	/* the shared worker shall never block on the PCM write */
+	t->a2dp.pcm.nonblock = true;
+
+	if (io_engine_task_start(&t->task) == -1) {
+		error("Couldn't start IO task: %s", strerror(errno));
+		t->a2dp.pcm.nonblock = false;
+		t->task.watches = NULL;
+		t->task.userdata = NULL;
+		goto fail;
+	}
+
+	debug("Starting IO task: %s (%s)",
+			bluetooth_profile_to_string(t->profile),
+			bluetooth_a2dp_codec_to_string(t->codec));
+	return 0;
+
+fail:
+	io_engine_a2dp_sink_sbc_free(io);
+	return -1;
+}
+
+/**
+ * Transport group fan-out.
+ *
+ * The PCM stream of the group leader is transmitted to all linked BT
+ * sockets. Links with the codec configuration identical to the leader one
+ * reuse SBC frames encoded for the leader - only the RTP header is created
+ * per link. Other links share one encoder per distinct configuration. All
+ * links are paced by the leader transmission clock, so the audio played by
+ * all group members stays sample-aligned. */
+struct io_group_encoder {
+
+	uint8_t cconfig[TRANSPORT_GROUP_CCONFIG_SIZE];
+	size_t cconfig_size;
+	/* number of links using this encoder - zero if not initialized */
+	unsigned int links;
+
+	sbc_t sbc;
+	size_t pcm_samples;
+	size_t frame_len;
+
+	/* PCM samples waiting for the encoding */
+	ffb_int16_t pcm;
+	/* encoded payload and the lowest writing MTU of links */
+	ffb_uint8_t bt;
+	size_t mtu_write;
+
+};
+
+struct io_group_link {
+
+	bdaddr_t addr;
+	/* encoder used by this link - NULL for the leader one */
+	struct io_group_encoder *enc;
+
+	struct io_bt_queue btq;
+
+	/* packet buffer with the RTP headers of this link */
+	ffb_uint8_t bt;
+	rtp_header_t *rtp_header;
+	rtp_media_header_t *rtp_media_header;
+	uint8_t *rtp_payload;
+	uint16_t seq_number;
+	uint32_t timestamp;
+
+};
+
+struct io_group {
+
+	struct io_group_link links[IO_THREAD_GROUP_LINKS];
+	size_t links_len;
+
+	struct io_group_encoder encoders[IO_THREAD_GROUP_LINKS];
+
+	/* the lowest writing MTU of links using the leader encoder (including
+	 * the leader itself) - it limits the size of the leader packets */
+	size_t mtu_write;
+
+};
+
+static void io_group_update_mtu(struct io_group *g, const struct ba_transport *t) {
+
+	size_t i;
+
+	g->mtu_write = t->mtu_write;
+	for (i = 0; i < ARRAYSIZE(g->encoders); i++)
+		if (g->encoders[i].links > 0)
+			g->encoders[i].mtu_write = g->encoders[i].bt.size;
+
+	for (i = 0; i < g->links_len; i++) {
+		struct io_group_link *l = &g->links[i];
+		if (l->enc == NULL)
+			g->mtu_write = MIN(g->mtu_write, l->btq.mtu);
+		else
+			l->enc->mtu_write = MIN(l->enc->mtu_write, l->btq.mtu);
+	}
+
+}
+
+static void io_group_encoder_release(struct io_group_encoder *e) {
+	if (--e->links > 0)
+		return;
+	sbc_finish(&e->sbc);
+	ffb_int16_free(&e->pcm);
+	ffb_uint8_free(&e->bt);
+}
+
+/**
+ * Get encoder for the given codec configuration.
+ *
+ * @param g Address of the group structure.
+ * @param cconfig Address of the SBC codec configuration.
+ * @param size Size of the codec configuration.
+ * @param mtu The writing MTU of the link which will use the encoder.
+ * @param pcm_samples The size of the PCM buffer, which shall be big enough
+ *   to store samples consumed by the leader within a single iteration.
+ * @return On success this function returns the encoder, which is already
+ *   referenced by the caller. Otherwise, NULL is returned and errno is set
+ *   appropriately. */
+static struct io_group_encoder *io_group_encoder_get(struct io_group *g,
+		const uint8_t *cconfig, size_t size, size_t mtu, size_t pcm_samples) {
+
+	struct io_group_encoder *e = NULL;
+	size_t i;
+
+	for (i = 0; i < ARRAYSIZE(g->encoders); i++) {
+		struct io_group_encoder *tmp = &g->encoders[i];
+		if (tmp->links == 0) {
+			if (e == NULL)
+				e = tmp;
+			continue;
+		}
+		if (tmp->cconfig_size == size && memcmp(tmp->cconfig, cconfig, size) == 0) {
+			tmp->links++;
+			return tmp;
+		}
+	}
+
+	if (e == NULL) {
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	if ((errno = -sbc_init_a2dp(&e->sbc, 0, cconfig, size)) != 0)
+		return NULL;
+
+	e->pcm_samples = sbc_get_codesize(&e->sbc) / sizeof(int16_t);
+	e->frame_len = sbc_get_frame_length(&e->sbc);
+
+	if (mtu < RTP_HEADER_LEN + sizeof(rtp_media_header_t) + e->frame_len) {
+		sbc_finish(&e->sbc);
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	if (ffb_int16_init(&e->pcm, pcm_samples + e->pcm_samples) == -1 ||
+			ffb_uint8_init(&e->bt, mtu) == -1) {
+		sbc_finish(&e->sbc);
+		ffb_int16_free(&e->pcm);
+		return NULL;
+	}
+
+	memcpy(e->cconfig, cconfig, size);
+	e->cconfig_size = size;
+	e->links = 1;
+
+	return e;
+}
+
+static void io_group_link_free(struct io_group_link *l) {
+	debug("Unlinking transport group member: %d", l->btq.fd);
+	close(l->btq.fd);
+	io_bt_queue_free(&l->btq);
+	ffb_uint8_free(&l->bt);
+	if (l->enc != NULL)
+		io_group_encoder_release(l->enc);
+}
+
+/**
+ * Remove link from the group.
+ *
+ * @param g Address of the group structure.
+ * @param t The group leader transport structure.
+ * @param i Index of the link which shall be removed. */
+static void io_group_unlink(struct io_group *g, const struct ba_transport *t, size_t i) {
+	io_group_link_free(&g->links[i]);
+	g->links[i] = g->links[--g->links_len];
+	io_group_update_mtu(g, t);
+}
+
+static void io_group_unlink_addr(struct io_group *g, const struct ba_transport *t,
+		const bdaddr_t *addr) {
+	size_t i;
+	for (i = g->links_len; i > 0; i--)
+		if (bacmp(&g->links[i - 1].addr, addr) == 0)
+			io_group_unlink(g, t, i - 1);
+}
+
+/**
+ * Remove all links from the group.
+ *
+ * It is safe to call this function for a zero-initialized structure. */
+static void io_group_free(struct io_group *g) {
+	while (g->links_len > 0)
+		io_group_link_free(&g->links[--g->links_len]);
+}
+
+/**
+ * Add link to the group.
+ *
+ * @param g Address of the group structure.
+ * @param t The group leader transport structure.
+ * @param cmd Address of the link command. The BT socket carried by this
+ *   command is owned by the group afterwards, even if this call fails.
+ * @param mtu_min The minimal writing MTU required by the leader encoder.
+ * @param pcm_samples The size of the leader PCM buffer.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int io_group_link(struct io_group *g, struct ba_transport *t,
+		const struct ba_transport_cmd *cmd, size_t mtu_min, size_t pcm_samples) {
+
+	const size_t mtu = cmd->link.mtu_write;
+	struct io_group_link *l;
+
+	/* link might be refreshed, e.g. after the BT transport re-acquisition */
+	io_group_unlink_addr(g, t, &cmd->link.addr);
+
+	if (g->links_len == ARRAYSIZE(g->links)) {
+		errno = ENOBUFS;
+		goto fail;
+	}
+
+	l = &g->links[g->links_len];
+	memset(l, 0, sizeof(*l));
+	bacpy(&l->addr, &cmd->link.addr);
+
+	if (cmd->link.cconfig_size != t->a2dp.cconfig_size ||
+			memcmp(cmd->link.cconfig, t->a2dp.cconfig, t->a2dp.cconfig_size) != 0) {
+		if ((l->enc = io_group_encoder_get(g, cmd->link.cconfig,
+						cmd->link.cconfig_size, mtu, pcm_samples)) == NULL)
+			goto fail;
+	}
+	else if (mtu < mtu_min) {
+		errno = EMSGSIZE;
+		goto fail;
+	}
+
+	if (io_bt_queue_init_fd(&l->btq, t, cmd->link.bt_fd, mtu,
+				cmd->link.bt_fd_coutq_init) == -1 ||
+			ffb_uint8_init(&l->bt, mtu) == -1)
+		goto fail_init;
+
+	/* congested member shall not stall the whole group */
+	l->btq.drop = true;
+
+	l->rtp_payload = io_thread_init_rtp(l->bt.data, &l->rtp_header, &l->rtp_media_header);
+	l->seq_number = ntohs(l->rtp_header->seq_number);
+	l->timestamp = ntohl(l->rtp_header->timestamp);
+
+	debug("Linked transport group member: %d (MTU: %zu)", cmd->link.bt_fd, mtu);
+
+	g->links_len++;
+	io_group_update_mtu(g, t);
+	return 0;
+
+fail_init:
+	io_bt_queue_free(&l->btq);
+	ffb_uint8_free(&l->bt);
+	if (l->enc != NULL)
+		io_group_encoder_release(l->enc);
+fail:
+	close(cmd->link.bt_fd);
+	return -1;
+}
+
+/**
+ * Queue SBC payload for the linked BT socket.
+ *
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int io_group_link_send(struct io_group_link *l, const uint8_t *payload,
+		size_t len, unsigned int sbc_frames, unsigned int pcm_frames,
+		unsigned int samplerate) {
+
+	memcpy(l->rtp_payload, payload, len);
+	l->rtp_header->seq_number = htons(++l->seq_number);
+	l->rtp_header->timestamp = htonl(l->timestamp);
+	l->rtp_media_header->frame_count = sbc_frames;
+	l->timestamp += pcm_frames * 10000 / samplerate;
+
+	if (io_bt_queue_push(&l->btq, l->bt.data, l->rtp_payload - l->bt.data + len) == -1)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Encode PCM samples with the shared encoder and send them to all links
+ * which are using this encoder. */
+static void io_group_encode(struct io_group *g, struct ba_transport *t,
+		struct io_group_encoder *e, unsigned int channels, unsigned int samplerate) {
+
+	const size_t mtu_payload = e->mtu_write - RTP_HEADER_LEN - sizeof(rtp_media_header_t);
+	size_t i;
+
+	while (ffb_len_out(&e->pcm) >= e->pcm_samples) {
+
+		const int16_t *input = e->pcm.head;
+		size_t input_len = ffb_len_out(&e->pcm);
+		uint8_t *output = e->bt.data;
+		size_t output_len = mtu_payload;
+		unsigned int pcm_frames = 0;
+		unsigned int sbc_frames = 0;
+
+		while (input_len >= e->pcm_samples && output_len >= e->frame_len) {
+
+			struct timespec ts_codec;
+			ssize_t len;
+			ssize_t encoded;
+
+			gettimestamp(&ts_codec);
+			if ((len = sbc_encode(&e->sbc, input, input_len * sizeof(int16_t),
+							output, output_len, &encoded)) < 0) {
+				error("SBC encoding error: %s", strerror(-len));
+				break;
+			}
+			io_thread_stats_codec(t, &ts_codec);
+
+			len = len / sizeof(int16_t);
+			input += len;
+			input_len -= len;
+			output += encoded;
+			output_len -= encoded;
+			pcm_frames += len / channels;
+			sbc_frames++;
+
+		}
+
+		if (sbc_frames == 0) {
+			/* drop samples which can not be encoded */
+			ffb_rewind(&e->pcm);
+			break;
+		}
+
+		ffb_shift(&e->pcm, ffb_len_out(&e->pcm) - input_len);
+
+		for (i = g->links_len; i > 0; i--) {
+			struct io_group_link *l = &g->links[i - 1];
+			if (l->enc != e)
+				continue;
+			if (io_group_link_send(l, e->bt.data, output - e->bt.data,
+						sbc_frames, pcm_frames, samplerate) == -1 &&
+					(errno == ECONNRESET || errno == ENOTCONN || errno == EPIPE)) {
+				io_group_unlink(g, t, i - 1);
+				/* encoder might have been released with the last link */
+				if (e->links == 0)
+					return;
+			}
+		}
 
-	/* Writing MTU should be big enough to contain RTP header, SBC payload
-	 * header and at least one SBC frame. In general, there is no constraint
-	 * for the MTU value, but the speed might suffer significantly. */
-	const size_t mtu_write_payload = t->mtu_write - RTP_HEADER_LEN - sizeof(rtp_media_header_t);
-	if (mtu_write_payload < sbc_frame_len) {
-		warn("Writing MTU too small for one single SBC frame: %zu < %zu",
-				t->mtu_write, RTP_HEADER_LEN + sizeof(rtp_media_header_t) + sbc_frame_len);
-		t->mtu_write = RTP_HEADER_LEN + sizeof(rtp_media_header_t) + sbc_frame_len;
 	}
 
-	if (ffb_init(&pcm, sbc_pcm_samples * (mtu_write_payload / sbc_frame_len)) == NULL ||
-			ffb_init(&bt, t->mtu_write) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
+}
+
+/**
+ * Write packets queued for all links of the group. */
+static void io_group_flush(struct io_group *g, struct ba_transport *t) {
+	size_t i;
+	for (i = g->links_len; i > 0; i--) {
+		struct io_group_link *l = &g->links[i - 1];
+		if (l->btq.len > 0 && io_bt_queue_flush(&l->btq) == -1 &&
+				(errno == ECONNRESET || errno == ENOTCONN || errno == EPIPE))
+			io_group_unlink(g, t, i - 1);
 	}
+}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+/**
+ * Transmit the leader audio to all links of the group.
+ *
+ * @param g Address of the group structure.
+ * @param t The group leader transport structure.
+ * @param payload Address of the SBC payload encoded by the leader.
+ * @param len Size of the SBC payload.
+ * @param sbc_frames Number of SBC frames in the payload.
+ * @param pcm Address of the PCM samples encoded in the payload.
+ * @param samples Number of PCM samples encoded in the payload.
+ * @param channels Number of audio channels.
+ * @param samplerate Sampling rate of the transmitted audio. */
+static void io_group_transfer(struct io_group *g, struct ba_transport *t,
+		const uint8_t *payload, size_t len, unsigned int sbc_frames,
+		const int16_t *pcm, size_t samples, unsigned int channels,
+		unsigned int samplerate) {
+
+	size_t i;
+
+	for (i = g->links_len; i > 0; i--) {
+		struct io_group_link *l = &g->links[i - 1];
+		if (l->enc != NULL)
+			continue;
+		if (io_group_link_send(l, payload, len, sbc_frames, samples / channels,
+					samplerate) == -1 &&
+				(errno == ECONNRESET || errno == ENOTCONN || errno == EPIPE))
+			io_group_unlink(g, t, i - 1);
+	}
+
+	for (i = 0; i < ARRAYSIZE(g->encoders); i++) {
+		struct io_group_encoder *e = &g->encoders[i];
+		if (e->links == 0)
+			continue;
+		const size_t n = MIN(samples, ffb_len_in(&e->pcm));
+		memcpy(e->pcm.tail, pcm, n * sizeof(int16_t));
+		ffb_seek(&e->pcm, n);
+		io_group_encode(g, t, e, channels, samplerate);
+	}
+
+	/* packets encoded for this transfer are written at once */
+	io_group_flush(g, t);
+
+}
+
+/**
+ * Encode SBC frame of the digital silence.
+ *
+ * The SBC encoder has a memory (analysis filter bank), so in order to get
+ * a frame which does not depend on the preceding signal, the silence is
+ * encoded a few times with a separate encoder instance.
+ *
+ * @param sbc The SBC encoder used as a configuration template.
+ * @param frame Buffer for the encoded frame.
+ * @param size The size of the buffer.
+ * @return On success this function returns the length of the encoded
+ *   frame. Otherwise, -1 is returned and errno is set appropriately. */
+static ssize_t io_sbc_encode_silence(const sbc_t *sbc, void *frame, size_t size) {
+
+	/* enough for 16 blocks, 8 sub-bands and 2 channels */
+	const int16_t silence[16 * 8 * 2] = { 0 };
+	ssize_t encoded = 0;
+	sbc_t enc;
+	int i, ret;
+
+	if ((ret = sbc_init(&enc, 0)) != 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	enc.frequency = sbc->frequency;
+	enc.blocks = sbc->blocks;
+	enc.subbands = sbc->subbands;
+	enc.mode = sbc->mode;
+	enc.allocation = sbc->allocation;
+	enc.bitpool = sbc->bitpool;
+	enc.endian = sbc->endian;
+
+	for (i = 0; i < 3; i++)
+		if ((ret = sbc_encode(&enc, silence, sizeof(silence), frame, size, &encoded)) < 0)
+			break;
+
+	sbc_finish(&enc);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return encoded;
+}
+
+struct io_a2dp_encoder;
+
+/**
+ * Codec backend of the generic A2DP source engine.
+ *
+ * The engine takes care of the PCM reading, volume scaling, silence
+ * detection, rate synchronization, RTP encapsulation and transmission
+ * (including the pipelined one), so the backend provides the encoding
+ * only. All optional callbacks might be set to NULL. */
+struct io_a2dp_encoder_ops {
+
+	/* the encoded stream is carried in RTP packets */
+	bool rtp;
+	/* RTP packets have the media payload header */
+	bool rtp_media;
+	/* payload which exceeds the writing MTU is fragmented - according to
+	 * the RFC 3016, the mark bit is set in the last fragment only */
+	bool rtp_fragment;
+	/* encoded packets can be queued in the pipelined transmit stage */
+	bool pipeline;
+	/* encoder consumes multiples of this number of frames */
+	size_t block_frames;
+	/* the longest time (in milliseconds) for which the encoder can hold
+	 * the pending payload, when there is no more audio */
+	int flush_timeout;
+
+	/* initialize encoder - upon error the reason shall be reported */
+	int (*init)(struct io_a2dp_encoder *enc, struct ba_transport *t);
+	/* maximal number of PCM frames passed to the single encode call */
+	size_t (*frames_per_packet)(const struct io_a2dp_encoder *enc);
+	/* encode PCM frames (the number of consumed frames is stored back) and
+	 * return the size of the packet payload, or zero if the payload is not
+	 * complete yet - upon error, -1 shall be returned */
+	ssize_t (*encode)(struct io_a2dp_encoder *enc, const void *input,
+			size_t *frames, uint8_t *output, size_t size, unsigned int *codec_frames);
+	/* return the payload held by the encoder (optional) */
+	ssize_t (*flush)(struct io_a2dp_encoder *enc, uint8_t *output, size_t size,
+			unsigned int *codec_frames);
+	/* check whether the muted signal can be replaced with the pre-encoded
+	 * audio - in such case, the signal is neither scaled nor checked for
+	 * the silence, and the encoder is called with the muted flag (optional) */
+	bool (*mute)(struct io_a2dp_encoder *enc, struct ba_transport *t);
+	/* notify the encoder that the packet has been sent - the PCM frames are
+	 * the ones passed to the last encode call (optional) */
+	void (*sent)(struct io_a2dp_encoder *enc, struct ba_transport *t,
+			const uint8_t *payload, size_t len, unsigned int codec_frames,
+			const void *pcm, size_t frames);
+	/* handle transport command - it is called after the engine has handled
+	 * the command by itself (optional) */
+	void (*command)(struct io_a2dp_encoder *enc, struct ba_transport *t,
+			const struct ba_transport_cmd *cmd);
+	/* reinitialize encoder for the new PCM sample format (optional) */
+	int (*reconfigure)(struct io_a2dp_encoder *enc, struct ba_transport *t);
+	/* adapt bit rate to the number of bytes queued in the BT socket and the
+	 * time (in milliseconds) spent on waiting for the socket (optional) */
+	void (*adapt)(struct io_a2dp_encoder *enc, struct ba_transport *t,
+			int coutq, unsigned int blocked);
+	/* number of complexity levels available for the CPU budget (optional) */
+	unsigned int (*complexity_levels)(const struct io_a2dp_encoder *enc);
+	/* lower encoder complexity to the given level, where level 0 is the
+	 * full complexity (optional) */
+	void (*set_complexity)(struct io_a2dp_encoder *enc, struct ba_transport *t,
+			unsigned int level);
+	/* release resources - it shall be safe for partially initialized encoder */
+	void (*free)(struct io_a2dp_encoder *enc);
+
+};
+
+struct io_a2dp_encoder {
+
+	const struct io_a2dp_encoder_ops *ops;
+
+	/* properties of the encoder input */
+	enum ba_pcm_format format;
+	unsigned int channels;
+	/* encoder consumes multiples of this number of frames - the value is
+	 * taken from the backend, but it might be changed by the init call */
+	size_t block_frames;
+	/* maximal size of the packet payload */
+	size_t payload_len;
+	/* size of the payload buffer - it might be set by the init call, if
+	 * the encoder output can exceed the maximal payload length */
+	size_t payload_size;
+
+	/* encoder holds the payload which shall be flushed, if there is no
+	 * more audio for the flush timeout */
+	bool pending;
+	/* PCM frames consumed for the payload which is held by the encoder,
+	 * but which is not a part of the returned one */
+	size_t pending_frames;
+	/* signal passed to the encoder is muted */
+	bool muted;
+
+	union {
+		struct {
+			sbc_t sbc;
+			unsigned int bitpool_min;
+			unsigned int bitpool_max;
+			size_t frame_len;
+			size_t frames;
+			/* writing MTU of the leader and the minimal one of the group
+			 * members which can reuse the leader packets */
+			size_t mtu_write;
+			size_t mtu_write_min;
+			struct abr abr;
+			/* pre-encoded SBC frame of the digital silence and the bitpool
+			 * for which this frame was encoded (zero if none) */
+			ffb_uint8_t silent;
+			unsigned int silent_bitpool;
+			struct io_group group;
+		} sbc;
+#if ENABLE_AAC
+		struct {
+			struct codec_cache_entry codec;
+			AACENC_InfoStruct info;
+			unsigned int bitrate;
+			unsigned int abr_bitrate;
+			bool abr_enabled;
+			struct abr abr;
+			/* audioMuxElements packed in the pending payload */
+			unsigned int aus;
+			size_t aus_len;
+			/* element which will be sent with the next payload */
+			size_t carry_offset;
+			size_t carry_len;
+		} aac;
+#endif
+#if ENABLE_APTX || ENABLE_APTX_HD
+		struct {
+			APTXENC handle;
+			bool hd;
+			/* deinterleaved PCM block for the whole packet payload */
+			int32_t *pcm_lr;
+			size_t frames;
+		} aptx;
+#endif
+#if ENABLE_LDAC
+		struct {
+			struct codec_cache_entry codec;
+			HANDLE_LDAC_ABR handle_abr;
+			int channel_mode;
+			int eqmid;
+			/* the highest quality allowed by the CPU budget */
+			int eqmid_min;
+		} ldac;
+#endif
+	};
+
+};
+
+/**
+ * State of the generic A2DP source engine. */
+struct io_a2dp_source {
+
+	struct ba_transport *t;
+	struct io_a2dp_encoder enc;
+
+	unsigned int channels;
+	unsigned int samplerate;
+	size_t sample_size;
+	size_t frames_max;
+	/* packets are transmitted by the pipelined transmit stage */
+	bool pipeline;
+
+	ffb_uint8_t bt;
+	ffb_uint8_t pcm;
+	struct io_bt_queue btq;
+	struct io_pacer pacer;
+	struct asrsync asrs;
+	struct cpu_budget_client budget;
 
 	rtp_header_t *rtp_header;
 	rtp_media_header_t *rtp_media_header;
+	uint8_t *rtp_payload;
+	uint16_t seq_number;
+	uint32_t timestamp;
+	/* frames carried by the packet which is being encoded */
+	size_t ts_frames;
 
-	/* initialize RTP headers and get anchor for payload */
-	uint8_t *rtp_payload = io_thread_init_rtp(bt.data, &rtp_header, &rtp_media_header);
-	uint16_t seq_number = ntohs(rtp_header->seq_number);
-	uint32_t timestamp = ntohl(rtp_header->timestamp);
+};
+
+/**
+ * Transfer encoded packet to the BT socket or to the transmit stage.
+ *
+ * @param s Address of the engine structure.
+ * @param len Length of the packet payload.
+ * @param frames Number of PCM frames carried by the packet.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int io_a2dp_source_send(struct io_a2dp_source *s, size_t len, size_t frames) {
+
+	const size_t header_len = s->rtp_payload - s->bt.data;
+
+	for (;;) {
+
+		const size_t n = s->enc.ops->rtp_fragment ? MIN(len, s->enc.payload_len) : len;
+		ssize_t ret;
+
+		if (s->enc.ops->rtp_fragment)
+			s->rtp_header->markbit = n == len;
+
+		/* In the pipelined mode, all frames are accounted to the last
+		 * fragment, which will be transmitted together with the rest. */
+		if (s->pipeline)
+			ret = io_pacer_push(&s->pacer, s->bt.data, header_len + n, n == len ? frames : 0);
+		else
+			ret = io_bt_queue_push(&s->btq, s->bt.data, header_len + n);
+		if (ret == -1)
+			return -1;
+
+		if ((len -= n) == 0)
+			break;
+
+		/* move rest of data to the beginning of the payload */
+		debug("Payload fragmentation: extra %zu bytes", len);
+		memmove(s->rtp_payload, s->rtp_payload + n, len);
+		s->rtp_header->seq_number = htons(++s->seq_number);
+
+	}
+
+	return 0;
+}
+
+/**
+ * Transmit packets queued in the BT output stage.
+ *
+ * Packets are queued until the RTP deadline of the next packet, so if the
+ * transfer is late, all overdue packets are written with one system call.
+ *
+ * @param s Address of the engine structure.
+ * @return If the BT socket was disconnected, -1 is returned. */
+static int io_a2dp_source_commit(struct io_a2dp_source *s) {
+
+	if (s->pipeline || s->btq.len == 0)
+		return 0;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+	if (io_bt_queue_flush(&s->btq) == -1) {
+		if (errno == ECONNRESET || errno == ENOTCONN) {
+			/* exit thread upon BT socket disconnection */
+			debug("BT socket disconnected: %d", s->t->bt_fd);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			return -1;
+		}
+		error("BT socket write error: %s", strerror(errno));
+	}
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	return 0;
+}
+
+/**
+ * Send the payload returned by the encoder and update RTP headers.
+ *
+ * @param s Address of the engine structure.
+ * @param len Length of the packet payload.
+ * @param codec_frames Number of codec frames in the payload.
+ * @param pcm Address of the PCM frames passed to the last encode call.
+ * @param frames Number of PCM frames passed to the last encode call.
+ * @return If the BT socket was disconnected, -1 is returned. */
+static int io_a2dp_source_transfer(struct io_a2dp_source *s, size_t len,
+		unsigned int codec_frames, const void *pcm, size_t frames) {
+
+	struct ba_transport *t = s->t;
+	/* frames consumed for the payload held by the encoder belong to the
+	 * next packet, so they are excluded from the time line of this one */
+	const size_t ts_frames = s->ts_frames - s->enc.pending_frames;
+
+	if (s->rtp_media_header != NULL)
+		s->rtp_media_header->frame_count = codec_frames;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+	if (io_a2dp_source_send(s, len, ts_frames) == -1) {
+		if (errno == ECONNRESET || errno == ENOTCONN) {
+			/* exit thread upon BT socket disconnection */
+			debug("BT socket disconnected: %d", t->bt_fd);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			return -1;
+		}
+		error("BT socket write error: %s", strerror(errno));
+	}
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	if (s->enc.ops->sent != NULL)
+		s->enc.ops->sent(&s->enc, t, s->rtp_payload, len, codec_frames, pcm, frames);
+
+	/* get a timestamp for the next RTP frame */
+	s->timestamp += ts_frames * 10000 / s->samplerate;
+	if (s->rtp_header != NULL) {
+		s->rtp_header->timestamp = htonl(s->timestamp);
+		s->rtp_header->seq_number = htons(++s->seq_number);
+	}
+
+	s->ts_frames = s->enc.pending_frames;
+	return 0;
+}
+
+/**
+ * Send the payload held by the encoder. */
+static int io_a2dp_source_flush(struct io_a2dp_source *s) {
+
+	unsigned int codec_frames = 0;
+	ssize_t len;
+
+	if ((len = s->enc.ops->flush(&s->enc, s->rtp_payload,
+					s->enc.payload_len, &codec_frames)) <= 0)
+		return 0;
+
+	if (io_a2dp_source_transfer(s, len, codec_frames, NULL, 0) == -1)
+		return -1;
+
+	return io_a2dp_source_commit(s);
+}
+
+/**
+ * Encode and transfer PCM samples.
+ *
+ * This function is always inlined, so for constant channels and block
+ * size, the compiler generates a loop specialized for the given stream
+ * layout, with all frame arithmetic folded.
+ *
+ * @return On success this function returns the number of consumed PCM
+ *   samples. If the BT socket was disconnected, -1 is returned. */
+static inline __attribute__((always_inline)) ssize_t io_a2dp_source_encode_(
+		struct io_a2dp_source *s, const uint8_t *input, size_t samples,
+		const unsigned int channels, const size_t block_frames) {
+
+	struct ba_transport *t = s->t;
+	const size_t frame_size = channels * s->sample_size;
+	const size_t samples_total = samples;
+
+	while (samples >= block_frames * channels) {
+
+		/* Encode as many frames as possible in one go, so the output buffer,
+		 * which is based on the socket MTU, is filled in the most efficient
+		 * way. The number of frames has to be a multiple of the block. */
+		size_t frames = MIN(samples / channels / block_frames * block_frames, s->frames_max);
+		unsigned int codec_frames = 0;
+		struct timespec ts_codec;
+		ssize_t encoded;
+
+		gettimestamp(&ts_codec);
+		if ((encoded = s->enc.ops->encode(&s->enc, input, &frames,
+						s->rtp_payload, s->enc.payload_len, &codec_frames)) == -1)
+			break;
+		/* pre-encoded audio does not count as the encoding */
+		if (!s->enc.muted)
+			io_thread_stats_codec(t, &ts_codec);
+
+		s->ts_frames += frames;
+
+		if (encoded > 0 &&
+				io_a2dp_source_transfer(s, encoded, codec_frames, input, frames) == -1)
+			return -1;
+
+		input += frames * frame_size;
+		samples -= frames * channels;
+
+		if (s->enc.ops->adapt != NULL)
+			s->enc.ops->adapt(&s->enc, t, s->pipeline ?
+					io_pacer_coutq(&s->pacer) : io_bt_queue_coutq(&s->btq), s->pipeline ?
+					io_pacer_blocked(&s->pacer) : io_bt_queue_blocked(&s->btq));
+
+		if (s->pipeline)
+			/* update delay of packets queued in the transmit stage */
+			t->delay = io_pacer_delay(&s->pacer);
+		else {
+			/* write queued packets before waiting for the deadline */
+			if (!asrsync_is_overdue(&s->asrs, frames) &&
+					io_a2dp_source_commit(s) == -1)
+				return -1;
+			/* keep data transfer at a constant bit rate */
+			io_thread_asrsync(t, &s->asrs, frames);
+			/* update busy delay (encoding overhead) */
+			t->delay = asrsync_get_busy_usec(&s->asrs) / 100;
+		}
 
-	/* array with historical data of queued bytes for BT socket */
-	int coutq_history[IO_THREAD_COUTQ_HISTORY_SIZE] = { 0 };
-	size_t coutq_i = 0;
+	}
+
+	if (io_a2dp_source_commit(s) == -1)
+		return -1;
+
+	return samples_total - samples;
+}
+
+/**
+ * Encode PCM samples with the loop specialized for the stream layout. */
+static ssize_t io_a2dp_source_encode(struct io_a2dp_source *s,
+		const uint8_t *input, size_t samples) {
+
+	const size_t block_frames = s->enc.block_frames;
+
+#define IO_A2DP_SOURCE_ENCODE(ch, block) \
+	if (s->channels == (ch) && block_frames == (block)) \
+		return io_a2dp_source_encode_(s, input, samples, ch, block)
+	/* SBC with 16 blocks and 8 sub-bands */
+	IO_A2DP_SOURCE_ENCODE(1, 16 * 8);
+	IO_A2DP_SOURCE_ENCODE(2, 16 * 8);
+#if ENABLE_AAC
+	IO_A2DP_SOURCE_ENCODE(2, 1024);
+#endif
+#if ENABLE_APTX || ENABLE_APTX_HD
+	IO_A2DP_SOURCE_ENCODE(2, 4);
+#endif
+#if ENABLE_LDAC
+	IO_A2DP_SOURCE_ENCODE(1, LDACBT_ENC_LSU);
+	IO_A2DP_SOURCE_ENCODE(2, LDACBT_ENC_LSU);
+#endif
+#undef IO_A2DP_SOURCE_ENCODE
+
+	return io_a2dp_source_encode_(s, input, samples, s->channels, block_frames);
+}
+
+/**
+ * Generic IO thread for the A2DP source.
+ *
+ * The codec specific part is provided by the encoder backend, so every
+ * codec which uses this engine gets the same pacing, pipelining, silence
+ * suspension and bit rate adaptation support. */
+static void *io_thread_a2dp_source_engine(struct ba_transport *t,
+		const struct io_a2dp_encoder_ops *ops) {
+
+	/* set when the transport is handed over to the other IO loop */
+	bool handover = false;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+
+	bool locked = !transport_pthread_cleanup_lock(t);
+
+	struct io_a2dp_source s = {
+		.t = t,
+		.enc = {
+			.ops = ops,
+			.format = t->a2dp.pcm.format,
+			.channels = transport_get_channels(t),
+			.block_frames = ops->block_frames,
+		},
+		.channels = transport_get_channels(t),
+		.samplerate = transport_get_sampling(t),
+		.pipeline = config.a2dp.pipeline && ops->pipeline,
+		.asrs = { .frames = 0, .catchup = config.io_thread.catchup },
+	};
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(ops->free), &s.enc);
+
+	const size_t header_len = (ops->rtp ? RTP_HEADER_LEN : 0) +
+		(ops->rtp_media ? sizeof(rtp_media_header_t) : 0);
+	if (t->mtu_write > header_len)
+		s.enc.payload_len = t->mtu_write - header_len;
+
+	if (s.enc.payload_len == 0) {
+		error("Invalid writing MTU: %zu", t->mtu_write);
+		goto fail_init;
+	}
+
+	if (ops->init(&s.enc, t) == -1)
+		goto fail_init;
+
+	if ((s.frames_max = ops->frames_per_packet(&s.enc)) == 0) {
+		error("Invalid writing MTU: %zu", t->mtu_write);
+		goto fail_init;
+	}
+
+	if (s.enc.payload_size < s.enc.payload_len)
+		s.enc.payload_size = s.enc.payload_len;
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &s.bt);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &s.pcm);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_bt_queue_free), &s.btq);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_pacer_free), &s.pacer);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_thread_cpu_budget_unregister), &s.budget);
+
+	/* PCM buffer holds the signal in the client sample format, so it
+	 * is allocated for the widest format supported by the encoder. The
+	 * writing MTU might have been adjusted by the encoder. */
+	if (ffb_uint8_init(&s.pcm, s.frames_max * s.channels * sizeof(int32_t)) == -1 ||
+			ffb_uint8_init(&s.bt, header_len + s.enc.payload_size) == -1 ||
+			io_bt_queue_init(&s.btq, t) == -1) {
+		error("Couldn't create data buffers: %s", strerror(errno));
+		goto fail_ffb;
+	}
+
+	if (s.pipeline &&
+			io_pacer_init(&s.pacer, t, s.samplerate) == -1) {
+		error("Couldn't create transmit stage: %s", strerror(errno));
+		goto fail_ffb;
+	}
 
-	int poll_timeout = -1;
-	struct asrsync asrs = { .frames = 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+
+	s.sample_size = transport_pcm_format_size(s.enc.format);
+	s.rtp_payload = s.bt.data;
+
+	io_thread_cpu_budget_register(t, &s.budget, ops->complexity_levels != NULL ?
+			ops->complexity_levels(&s.enc) : 1);
+
+	if (ops->rtp) {
+		/* initialize RTP headers and get anchor for payload */
+		s.rtp_payload = io_thread_init_rtp(s.bt.data, &s.rtp_header,
+				ops->rtp_media ? &s.rtp_media_header : NULL);
+		s.seq_number = ntohs(s.rtp_header->seq_number);
+		s.timestamp = ntohl(s.rtp_header->timestamp);
+	}
+
+	/* transport might have been acquired ahead of the PCM open */
+	int poll_timeout = t->a2dp.pcm.fd == -1 ? t->a2dp.keep_alive * 1000 : -1;
+	struct io_silence silence;
+	io_silence_init(&silence, s.samplerate);
 	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
+		{ t->sig_fd, POLLIN, 0 },
 		{ -1, POLLIN, 0 },
 	};
 
@@ -427,9 +2928,24 @@ void *io_thread_a2dp_source_sbc(void *arg) {
 		/* add PCM socket to the poll if transport is active */
 		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
 
-		switch (poll(pfds, ARRAYSIZE(pfds), poll_timeout)) {
+		/* do not hold the pending payload if there is no more audio */
+		int timeout = poll_timeout;
+		if (s.enc.pending && (timeout == -1 || timeout > ops->flush_timeout))
+			timeout = ops->flush_timeout;
+
+		switch (poll(pfds, ARRAYSIZE(pfds), timeout)) {
 		case 0:
-			pthread_cond_signal(&t->a2dp.pcm.drained);
+			if (s.enc.pending) {
+				pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+				if (io_a2dp_source_flush(&s) == -1)
+					goto fail;
+				continue;
+			}
+			if (transport_pcm_drain_pending(&t->a2dp.pcm) &&
+					(io_thread_pcm_pending(&t->a2dp.pcm) || !(s.pipeline ?
+						io_pacer_drained(&s.pacer) : io_bt_queue_drained(&s.btq))))
+				continue;
+			transport_pcm_drained(&t->a2dp.pcm);
 			poll_timeout = -1;
 			locked = !transport_pthread_cleanup_lock(t);
 			if (t->a2dp.pcm.fd == -1)
@@ -444,134 +2960,446 @@ void *io_thread_a2dp_source_sbc(void *arg) {
 			goto fail;
 		}
 
-		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
-			switch (sig) {
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				poll_timeout = -1;
-				asrs.frames = 0;
-				break;
-			case TRANSPORT_PCM_CLOSE:
-				poll_timeout = config.a2dp.keep_alive * 1000;
-				break;
-			case TRANSPORT_PCM_SYNC:
-				poll_timeout = 100;
-				break;
-			default:
-				break;
-			}
-			continue;
-		}
+		if (pfds[0].revents & POLLIN) {
+			/* dispatch incoming commands */
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			struct ba_transport_cmd cmd;
+			while (transport_recv_command(t, &cmd)) {
+				switch (cmd.sig) {
+				case TRANSPORT_PCM_OPEN:
+					/* encoded data is served by the passthrough IO loop */
+					if (t->a2dp.pcm.format == BA_PCM_FORMAT_ENCODED) {
+						/* remaining commands (e.g. the drain request) are
+						 * dispatched by the passthrough IO loop */
+						transport_forward_commands(t);
+						handover = true;
+						goto final;
+					}
+					/* The transport might have been acquired before the PCM open,
+					 * so the encoder has to follow the negotiated sample format. */
+					if (cmd.reconfig.format_valid && cmd.reconfig.format != s.enc.format &&
+							ops->reconfigure != NULL) {
+						debug("Reinitializing %s encoder: format: %d -> %d",
+								bluetooth_a2dp_codec_to_string(t->codec), s.enc.format, cmd.reconfig.format);
+						s.enc.format = cmd.reconfig.format;
+						s.sample_size = transport_pcm_format_size(s.enc.format);
+						ffb_rewind(&s.pcm);
+						if (ops->reconfigure(&s.enc, t) == -1)
+							goto fail;
+					}
+					/* fall-through */
+				case TRANSPORT_PCM_RESUME:
+					poll_timeout = -1;
+					s.asrs.frames = 0;
+					io_silence_reset(&silence);
+					if (s.pipeline)
+						io_pacer_reset(&s.pacer);
+					break;
+				case TRANSPORT_PCM_CLOSE:
+					poll_timeout = t->a2dp.keep_alive * 1000;
+					break;
+				case TRANSPORT_PCM_SYNC:
+					poll_timeout = IO_THREAD_DRAIN_INTERVAL;
+					break;
+				default:
+					break;
+				}
+				if (ops->command != NULL)
+					ops->command(&s.enc, t, &cmd);
+			}
+			continue;
+		}
+
+		/* read data from the FIFO - this function will block */
+		if ((samples = io_thread_read_pcm(&t->a2dp.pcm, s.pcm.tail,
+						ffb_len_in(&s.pcm) / s.sample_size)) <= 0) {
+			if (samples == -1 && errno == EAGAIN)
+				continue;
+			if (samples == -1)
+				error("FIFO read error: %s", strerror(errno));
+			goto fail;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/* When the thread is created, there might be no data in the FIFO. In fact
+		 * there might be no data for a long time - until client starts playback.
+		 * In order to correctly calculate time drift, the zero time point has to
+		 * be obtained after the stream has started. */
+		if (s.asrs.frames == 0)
+			asrsync_init(&s.asrs, s.samplerate);
+
+		/* Muted audio might be replaced with the pre-encoded one, in which
+		 * case it is neither scaled nor examined by the silence detector. */
+		s.enc.muted = ops->mute != NULL && ops->mute(&s.enc, t);
+
+		if (!config.a2dp.volume && !s.enc.muted)
+			/* scale volume or mute audio signal */
+			io_thread_scale_pcm(t, s.pcm.tail, samples, s.channels);
+
+		const bool suspended = silence.suspended;
+		if (io_silence_check(&silence, t, &s.asrs, s.enc.muted ? NULL : s.pcm.tail,
+					samples, s.channels)) {
+			/* drop silence, but keep the RTP time line */
+			io_thread_asrsync(t, &s.asrs, samples / s.channels);
+			s.timestamp += samples / s.channels * 10000 / s.samplerate;
+			if (s.rtp_header != NULL)
+				s.rtp_header->timestamp = htonl(s.timestamp);
+			continue;
+		}
+		if (suspended && s.pipeline)
+			io_pacer_reset(&s.pacer);
+
+		/* get overall number of input samples */
+		ffb_seek(&s.pcm, samples * s.sample_size);
+		samples = ffb_len_out(&s.pcm) / s.sample_size;
+
+		ssize_t consumed;
+		if ((consumed = io_a2dp_source_encode(&s, s.pcm.head, samples)) == -1)
+			goto fail;
+
+		if (io_thread_cpu_budget_update(t, &s.budget) && ops->set_complexity != NULL)
+			ops->set_complexity(&s.enc, t, s.budget.level);
+
+		/* unscaled remainder of the muted audio must not be heard later */
+		if (s.enc.muted)
+			memset(s.pcm.head + consumed * s.sample_size, 0,
+					(samples - consumed) * s.sample_size);
+
+		/* If the input buffer was not consumed (due to codesize limit), we
+		 * have to append new data to the existing one. Since we are using
+		 * ring buffer, unprocessed data will stay where it is. */
+		ffb_shift(&s.pcm, consumed * s.sample_size);
+
+	}
+
+fail:
+final:
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_pop(!locked && !handover);
+fail_ffb:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+fail_init:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(!handover);
+	return handover ? IO_THREAD_HANDOVER : NULL;
+}
+
+static int io_sbc_encoder_init(struct io_a2dp_encoder *enc, struct ba_transport *t) {
+
+	const a2dp_sbc_t *cconfig = (a2dp_sbc_t *)t->a2dp.cconfig;
+	sbc_t *sbc = &enc->sbc.sbc;
+
+	if ((errno = -sbc_init_a2dp(sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
+		error("Couldn't initialize SBC codec: %s", strerror(errno));
+		return -1;
+	}
+
+	/* The bitpool selected during the configuration is the maximal one. With
+	 * the adaptive bit rate, the bitpool will be lowered upon congestion, but
+	 * it will never exceed the optimum value for given parameters. */
+	enc->sbc.bitpool_max = MIN(sbc->bitpool,
+			a2dp_sbc_default_bitpool(cconfig->frequency, cconfig->channel_mode));
+	enc->sbc.bitpool_min = MIN(enc->sbc.bitpool_max, MAX(cconfig->min_bitpool, SBC_MIN_BITPOOL));
+
+	struct timespec ts_abr;
+	gettimestamp(&ts_abr);
+	abr_init(&enc->sbc.abr, &config.a2dp.abr_config,
+			(enc->sbc.bitpool_max - enc->sbc.bitpool_min) / IO_THREAD_SBC_BITPOOL_STEP + 1, &ts_abr);
+
+	if (config.a2dp.abr) {
+		/* start with the bitpool which the link has been able to carry */
+		abr_set_level(&enc->sbc.abr, link_history_get_level(&config.a2dp.link_history,
+					&t->device->addr, A2DP_CODEC_SBC, enc->sbc.abr.levels), &ts_abr);
+		sbc->bitpool = MAX(enc->sbc.bitpool_min,
+				enc->sbc.bitpool_max - enc->sbc.abr.level * IO_THREAD_SBC_BITPOOL_STEP);
+	}
+	t->stats.codec_param = sbc->bitpool;
+
+	enc->format = BA_PCM_FORMAT_S16_LE;
+	enc->block_frames = sbc_get_codesize(sbc) / sizeof(int16_t) / enc->channels;
+	enc->sbc.frame_len = sbc_get_frame_length(sbc);
+
+	/* Writing MTU should be big enough to contain RTP header, SBC payload
+	 * header and at least one SBC frame. In general, there is no constraint
+	 * for the MTU value, but the speed might suffer significantly. */
+	if (enc->payload_len < enc->sbc.frame_len) {
+		warn("Writing MTU too small for one single SBC frame: %zu < %zu",
+				t->mtu_write, RTP_HEADER_LEN + sizeof(rtp_media_header_t) + enc->sbc.frame_len);
+		t->mtu_write = RTP_HEADER_LEN + sizeof(rtp_media_header_t) + enc->sbc.frame_len;
+		enc->payload_len = enc->sbc.frame_len;
+	}
+
+	/* SBC frame length will not exceed the initial one, so group members with
+	 * such a writing MTU can receive packets encoded for the leader */
+	enc->sbc.mtu_write = t->mtu_write;
+	enc->sbc.mtu_write_min = RTP_HEADER_LEN + sizeof(rtp_media_header_t) + enc->sbc.frame_len;
+	enc->sbc.frames = enc->block_frames * (enc->payload_len / enc->sbc.frame_len);
+	io_group_update_mtu(&enc->sbc.group, t);
+
+	if (ffb_uint8_init(&enc->sbc.silent, enc->sbc.frame_len) == -1) {
+		error("Couldn't create data buffers: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static size_t io_sbc_encoder_frames_per_packet(const struct io_a2dp_encoder *enc) {
+	return enc->sbc.frames;
+}
 
-		/* read data from the FIFO - this function will block */
-		if ((samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) <= 0) {
-			if (samples == -1)
-				error("FIFO read error: %s", strerror(errno));
-			goto fail;
+/**
+ * Generate as many SBC frames as possible to fill the output buffer without
+ * overflowing it. The size of the output buffer is based on the socket MTU,
+ * so such a transfer should be most efficient. */
+static ssize_t io_sbc_encoder_encode(struct io_a2dp_encoder *enc, const void *input,
+		size_t *frames, uint8_t *output, size_t size, unsigned int *codec_frames) {
+
+	sbc_t *sbc = &enc->sbc.sbc;
+	const size_t codesize = sbc_get_codesize(sbc);
+	const uint8_t *head = input;
+	size_t input_len = *frames * enc->channels * sizeof(int16_t);
+	uint8_t *tail = output;
+	/* packet size is limited by the lowest MTU within the group */
+	size_t output_len = size - (enc->sbc.mtu_write - enc->sbc.group.mtu_write);
+	unsigned int sbc_frames = 0;
+
+	while (input_len >= codesize && output_len >= enc->sbc.frame_len) {
+
+		ssize_t len;
+		ssize_t encoded;
+
+		/* muted audio is not encoded - the pre-encoded silence is sent */
+		if (enc->muted) {
+			memcpy(tail, enc->sbc.silent.data, enc->sbc.frame_len);
+			len = codesize;
+			encoded = enc->sbc.frame_len;
+		}
+		else if ((len = sbc_encode(sbc, head, input_len, tail, output_len, &encoded)) < 0) {
+			error("SBC encoding error: %s", strerror(-len));
+			break;
 		}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		head += len;
+		input_len -= len;
+		tail += encoded;
+		output_len -= encoded;
+		sbc_frames++;
 
-		/* When the thread is created, there might be no data in the FIFO. In fact
-		 * there might be no data for a long time - until client starts playback.
-		 * In order to correctly calculate time drift, the zero time point has to
-		 * be obtained after the stream has started. */
-		if (asrs.frames == 0)
-			asrsync_init(&asrs, samplerate);
+	}
 
-		if (!config.a2dp.volume)
-			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+	if (sbc_frames == 0)
+		return -1;
 
-		/* get overall number of input samples */
-		ffb_seek(&pcm, samples);
-		samples = ffb_len_out(&pcm);
+	*frames = (head - (const uint8_t *)input) / (enc->channels * sizeof(int16_t));
+	*codec_frames = sbc_frames;
+	return tail - output;
+}
 
-		/* anchor for RTP payload */
-		bt.tail = rtp_payload;
+/**
+ * Use the pre-encoded silence for the muted audio.
+ *
+ * Group members might require their own encoding, so in such a case the
+ * regular path is taken. */
+static bool io_sbc_encoder_mute(struct io_a2dp_encoder *enc, struct ba_transport *t) {
+
+	if (enc->sbc.group.links_len > 0 ||
+			!io_thread_pcm_muted(t, enc->channels))
+		return false;
+
+	if (enc->sbc.silent_bitpool != enc->sbc.sbc.bitpool) {
+		if (io_sbc_encode_silence(&enc->sbc.sbc, enc->sbc.silent.data,
+					enc->sbc.silent.size) != (ssize_t)enc->sbc.frame_len) {
+			error("Couldn't encode SBC silence: %s", strerror(errno));
+			return false;
+		}
+		enc->sbc.silent_bitpool = enc->sbc.sbc.bitpool;
+	}
 
-		const int16_t *input = pcm.data;
-		size_t input_len = samples;
-		size_t output_len = ffb_len_in(&bt);
-		size_t pcm_frames = 0;
-		size_t sbc_frames = 0;
+	return true;
+}
 
-		/* Generate as many SBC frames as possible to fill the output buffer
-		 * without overflowing it. The size of the output buffer is based on
-		 * the socket MTU, so such a transfer should be most efficient. */
-		while (input_len >= sbc_pcm_samples && output_len >= sbc_frame_len) {
+/**
+ * Transmit the same audio to all group members. Writes to the linked BT
+ * sockets are not blocking, so cancellation is not required. */
+static void io_sbc_encoder_sent(struct io_a2dp_encoder *enc, struct ba_transport *t,
+		const uint8_t *payload, size_t len, unsigned int codec_frames,
+		const void *pcm, size_t frames) {
+	if (enc->sbc.group.links_len > 0)
+		io_group_transfer(&enc->sbc.group, t, payload, len, codec_frames, pcm,
+				frames * enc->channels, enc->channels, transport_get_sampling(t));
+}
 
-			ssize_t len;
-			ssize_t encoded;
+/**
+ * Modify group links. */
+static void io_sbc_encoder_command(struct io_a2dp_encoder *enc, struct ba_transport *t,
+		const struct ba_transport_cmd *cmd) {
+	struct io_group *group = &enc->sbc.group;
+	switch (cmd->sig) {
+	case TRANSPORT_PCM_CLOSE:
+		/* group will be linked again upon the next PCM open */
+		io_group_free(group);
+		io_group_update_mtu(group, t);
+		break;
+	case TRANSPORT_GROUP_LINK:
+		if (io_group_link(group, t, cmd, enc->sbc.mtu_write_min,
+					enc->sbc.frames * enc->channels) == -1)
+			error("Couldn't link transport group member: %s", strerror(errno));
+		break;
+	case TRANSPORT_GROUP_UNLINK:
+		io_group_unlink_addr(group, t, &cmd->link.addr);
+		break;
+	default:
+		break;
+	}
+}
 
-			if ((len = sbc_encode(&sbc, input, input_len * sizeof(int16_t),
-							bt.tail, output_len, &encoded)) < 0) {
-				error("SBC encoding error: %s", strerror(-len));
-				break;
-			}
+/**
+ * Adjust bitpool according to the BT link congestion. */
+static void io_sbc_encoder_adapt(struct io_a2dp_encoder *enc, struct ba_transport *t,
+		int coutq, unsigned int blocked) {
+
+	sbc_t *sbc = &enc->sbc.sbc;
+	struct timespec ts_abr;
+
+	if (!config.a2dp.abr)
+		return;
+
+	gettimestamp(&ts_abr);
+	unsigned int level = abr_update(&enc->sbc.abr, coutq / t->mtu_write, blocked, &ts_abr);
+	unsigned int bitpool = MAX(enc->sbc.bitpool_min,
+			enc->sbc.bitpool_max - level * IO_THREAD_SBC_BITPOOL_STEP);
+
+	if (sbc->bitpool != bitpool) {
+		debug("Changing SBC bitpool: %u -> %u", sbc->bitpool, bitpool);
+		sbc->bitpool = bitpool;
+		t->stats.codec_param = bitpool;
+		enc->sbc.frame_len = sbc_get_frame_length(sbc);
+		link_history_update(&config.a2dp.link_history, &t->device->addr,
+				A2DP_CODEC_SBC, level, enc->sbc.abr.levels);
+	}
 
-			len = len / sizeof(int16_t);
-			input += len;
-			input_len -= len;
-			ffb_seek(&bt, encoded);
-			output_len -= encoded;
-			pcm_frames += len / channels;
-			sbc_frames++;
+}
 
-		}
+static void io_sbc_encoder_free(struct io_a2dp_encoder *enc) {
+	io_group_free(&enc->sbc.group);
+	ffb_uint8_free(&enc->sbc.silent);
+	sbc_finish(&enc->sbc.sbc);
+}
 
-		rtp_header->seq_number = htons(++seq_number);
-		rtp_header->timestamp = htonl(timestamp);
-		rtp_media_header->frame_count = sbc_frames;
+/* SBC has no complexity knob - the number of subbands and blocks is a part
+ * of the negotiated configuration - however, its load is still accounted
+ * within the CPU budget. Group members are paced by the leader transmission
+ * clock, so the pipelined transmit stage is not used. */
+static const struct io_a2dp_encoder_ops io_sbc_encoder = {
+	.rtp = true,
+	.rtp_media = true,
+	.init = io_sbc_encoder_init,
+	.frames_per_packet = io_sbc_encoder_frames_per_packet,
+	.encode = io_sbc_encoder_encode,
+	.mute = io_sbc_encoder_mute,
+	.sent = io_sbc_encoder_sent,
+	.command = io_sbc_encoder_command,
+	.adapt = io_sbc_encoder_adapt,
+	.free = io_sbc_encoder_free,
+};
 
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+void *io_thread_a2dp_source_sbc(void *arg) {
+	return io_thread_a2dp_source_engine((struct ba_transport *)arg, &io_sbc_encoder);
+}
 
-		coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
-		if (io_thread_write_bt(t, bt.data, ffb_len_out(&bt), &coutq_history[coutq_i]) == -1) {
-			if (errno == ECONNRESET || errno == ENOTCONN) {
-				/* exit thread upon BT socket disconnection */
-				debug("BT socket disconnected: %d", t->bt_fd);
-				goto fail;
-			}
-			error("BT socket write error: %s", strerror(errno));
+#if ENABLE_AAC
+/**
+ * Decode AAC (LATM) RTP packet and write PCM to the transport FIFO.
+ *
+ * @return This function returns the number of written samples. Zero is
+ *   returned if the packet is a fragment, decoding was not possible or the
+ *   audioMuxElement has been forwarded to the client without decoding. */
+static size_t io_a2dp_sink_aac_decode(struct ba_transport *t, HANDLE_AACDECODER handle,
+		const uint8_t *packet, size_t len, int markbit_quirk, ffb_uint8_t *latm,
+		ffb_int16_t *pcm, unsigned int channels, uint16_t *seq_number) {
+
+	const rtp_header_t *rtp_header = (rtp_header_t *)packet;
+	const uint8_t *rtp_latm = (uint8_t *)&rtp_header->csrc[rtp_header->cc];
+	size_t rtp_latm_len = len - ((void *)rtp_latm - (void *)rtp_header);
+	AAC_DECODER_ERROR err;
+	CStreamInfo *aacinf;
+
+	uint16_t _seq_number = ntohs(rtp_header->seq_number);
+	if (++*seq_number != _seq_number) {
+		if (*seq_number != 0) {
+			warn("Missing RTP packet: %u != %u", _seq_number, *seq_number);
+			t->stats.rtp_gaps += (uint16_t)(_seq_number - *seq_number);
 		}
+		*seq_number = _seq_number;
+	}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	io_a2dp_sink_drift(t, rtp_header);
 
-		/* keep data transfer at a constant bit rate, also
-		 * get a timestamp for the next RTP frame */
-		asrsync_sync(&asrs, pcm_frames);
-		timestamp += pcm_frames * 10000 / samplerate;
+	if (ffb_len_in(latm) < rtp_latm_len) {
+		debug("Resizing LATM buffer: %zd -> %zd", latm->size, latm->size + t->mtu_read);
+		if (ffb_uint8_init(latm, latm->size + t->mtu_read) == -1) {
+			error("Couldn't resize LATM buffer: %s", strerror(errno));
+			ffb_rewind(latm);
+			return 0;
+		}
+	}
 
-		/* update busy delay (encoding overhead) */
-		t->delay = asrsync_get_busy_usec(&asrs) / 100;
+	memcpy(latm->tail, rtp_latm, rtp_latm_len);
+	ffb_seek(latm, rtp_latm_len);
 
-		/* If the input buffer was not consumed (due to codesize limit), we
-		 * have to append new data to the existing one. Since we do not use
-		 * ring buffer, we will simply move unprocessed data to the front
-		 * of our linear buffer. */
-		ffb_shift(&pcm, samples - input_len);
+	if (markbit_quirk != 1 && !rtp_header->markbit) {
+		debug("Fragmented RTP packet [%u]: LATM len: %zd", *seq_number, rtp_latm_len);
+		return 0;
+	}
 
+	if (t->a2dp.pcm.format == BA_PCM_FORMAT_ENCODED) {
+		/* all fragments of the audioMuxElement share the same time-stamp */
+		io_a2dp_sink_write_encoded(t, ntohl(rtp_header->timestamp), latm->head, ffb_len_out(latm));
+		ffb_rewind(latm);
+		return 0;
 	}
 
-fail:
-final:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-	return NULL;
+	unsigned int data_len = ffb_len_out(latm);
+	unsigned int valid = ffb_len_out(latm);
+	struct timespec ts_codec;
+	size_t samples = 0;
+
+	gettimestamp(&ts_codec);
+	if ((err = aacDecoder_Fill(handle, &latm->head, &data_len, &valid)) != AAC_DEC_OK) {
+		error("AAC buffer fill error: %s", aacdec_strerror(err));
+		return 0;
+	}
+
+	/* According to the RFC 3016, single RTP packet might carry more than one
+	 * audioMuxElement, so decode frames until all filled data is consumed. */
+	while ((err = aacDecoder_DecodeFrame(handle, pcm->tail, ffb_blen_in(pcm), 0)) == AAC_DEC_OK) {
+		if ((aacinf = aacDecoder_GetStreamInfo(handle)) == NULL) {
+			error("Couldn't get AAC stream info");
+			break;
+		}
+		io_thread_stats_codec(t, &ts_codec);
+		const size_t frame_samples = aacinf->frameSize * aacinf->numChannels;
+		io_thread_scale_pcm(t, pcm->data, frame_samples, channels);
+		if (io_thread_write_pcm(&t->a2dp.pcm, pcm->data, frame_samples) == -1)
+			error("FIFO write error: %s", strerror(errno));
+		samples += frame_samples;
+		gettimestamp(&ts_codec);
+	}
+
+	if (samples == 0 || err != AAC_DEC_NOT_ENOUGH_BITS)
+		error("AAC decode frame error: %s", aacdec_strerror(err));
+	if (samples > 0)
+		ffb_rewind(latm);
+
+	return samples;
 }
 
-#if ENABLE_AAC
 void *io_thread_a2dp_sink_aac(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 
@@ -589,15 +3417,29 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 		goto fail_open;
 	}
 
+	if (codec_lib_load(CODEC_LIB_AAC) == -1) {
+		error("Couldn't load AAC library: %s", strerror(errno));
+		goto fail_open;
+	}
+
+	struct codec_cache_entry codec;
 	HANDLE_AACDECODER handle;
 	AAC_DECODER_ERROR err;
 
-	if ((handle = aacDecoder_Open(TT_MP4_LATM_MCP1, 1)) == NULL) {
+	if ((handle = codec_cache_take(io_thread_codec_cache(t), &codec, A2DP_CODEC_MPEG24,
+					false, t->a2dp.cconfig, t->a2dp.cconfig_size, 0)) != NULL) {
+		/* drop data left by the previous stream */
+		if ((err = aacDecoder_SetParam(handle, AAC_TPDEC_CLEAR_BUFFER, 1)) != AAC_DEC_OK)
+			warn("Couldn't reset AAC decoder: %s", aacdec_strerror(err));
+	}
+	else if ((handle = aacDecoder_Open(TT_MP4_LATM_MCP1, 1)) == NULL) {
 		error("Couldn't open AAC decoder");
 		goto fail_open;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(aacDecoder_Close), handle);
+	codec.handle = handle;
+	codec.free = io_aacdec_close;
+	pthread_cleanup_push(PTHREAD_CLEANUP(codec_cache_release), &codec);
 
 	const unsigned int channels = transport_get_channels(t);
 #ifdef AACDECODER_LIB_VL0
@@ -616,6 +3458,8 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 	}
 #endif
 
+	codec.reusable = true;
+
 	ffb_uint8_t bt = { 0 };
 	ffb_uint8_t latm = { 0 };
 	ffb_int16_t pcm = { 0 };
@@ -623,20 +3467,37 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &latm);
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
 
-	if (ffb_init(&pcm, 2048 * channels) == NULL ||
-			ffb_init(&latm, t->mtu_read) == NULL ||
-			ffb_init(&bt, t->mtu_read) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+	if (ffb_int16_init(&pcm, 2048 * channels) == -1 ||
+			ffb_uint8_init(&latm, t->mtu_read) == -1 ||
+			ffb_uint8_init(&bt, t->mtu_read) == -1) {
+		error("Couldn't create data buffers: %s", strerror(errno));
 		goto fail_ffb;
 	}
 
+	struct jitter_buffer jb = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(jitter_buffer_free), &jb);
+
+	if (config.a2dp.jitter_buffer > 0 &&
+			jitter_buffer_init(&jb, t->mtu_read, transport_get_sampling(t),
+				config.a2dp.jitter_buffer) == -1) {
+		error("Couldn't create jitter buffer: %s", strerror(errno));
+		goto fail_jitter;
+	}
+
+	/* The number of PCM frames in a single AAC frame. It is updated with
+	 * the value reported by the decoder (e.g. 2048 for HE-AAC). */
+	unsigned int aac_frame_frames = 1024;
+	/* the number of valid samples in the PCM buffer - used for PLC */
+	size_t pcm_samples = 0;
+
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
 
 	uint16_t seq_number = -1;
+	drift_estimator_init(&t->a2dp.drift, transport_get_sampling(t));
 	int markbit_quirk = -3;
 
 	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
+		{ t->sig_fd, POLLIN, 0 },
 		{ -1, POLLIN, 0 },
 	};
 
@@ -649,13 +3510,20 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 	for (;;) {
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-		CStreamInfo *aacinf;
+		struct timespec ts;
+		int timeout = -1;
+		size_t samples;
 		ssize_t len;
 
 		/* add BT socket to the poll if transport is active */
 		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
 
-		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1) {
+		if (jb.packets != NULL) {
+			gettimestamp(&ts);
+			timeout = jitter_buffer_timeout(&jb, &ts);
+		}
+
+		if (poll(pfds, ARRAYSIZE(pfds), timeout) == -1) {
 			if (errno == EINTR)
 				continue;
 			error("Transport poll error: %s", strerror(errno));
@@ -663,102 +3531,115 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 		}
 
 		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
+			/* drop incoming commands */
+			struct ba_transport_cmd cmd;
+			while (transport_recv_command(t, &cmd))
+				continue;
 			continue;
 		}
 
-		if ((len = read(pfds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
-			debug("BT read error: %s", strerror(errno));
-			continue;
-		}
+		if (pfds[1].revents & POLLIN) {
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			if ((len = read(pfds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
+				debug("BT read error: %s", strerror(errno));
+				continue;
+			}
 
-		/* it seems that zero is never returned... */
-		if (len == 0) {
-			debug("BT socket has been closed: %d", pfds[1].fd);
-			/* Prevent sending the release request to the BlueZ. If the socket has
-			 * been closed, it means that BlueZ has already closed the connection. */
-			close(pfds[1].fd);
-			t->bt_fd = -1;
-			goto fail;
-		}
+			io_thread_capture(t, CAPTURE_TYPE_BT_IN, bt.tail, len);
 
-		if (t->a2dp.pcm.fd == -1) {
-			seq_number = -1;
-			continue;
-		}
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+			/* it seems that zero is never returned... */
+			if (len == 0) {
+				debug("BT socket has been closed: %d", pfds[1].fd);
+				/* Prevent sending the release request to the BlueZ. If the socket has
+				 * been closed, it means that BlueZ has already closed the connection. */
+				close(pfds[1].fd);
+				t->bt_fd = -1;
+				goto fail;
+			}
+
+			if (t->a2dp.pcm.fd == -1) {
+				seq_number = -1;
+				if (jb.packets != NULL)
+					jitter_buffer_reset(&jb);
+				continue;
+			}
 
-		const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
-		uint8_t *rtp_latm = (uint8_t *)&rtp_header->csrc[rtp_header->cc];
-		size_t rtp_latm_len = len - ((void *)rtp_latm - (void *)rtp_header);
+			const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
 
 #if ENABLE_PAYLOADCHECK
-		if (rtp_header->paytype < 96) {
-			warn("Unsupported RTP payload type: %u", rtp_header->paytype);
-			continue;
-		}
+			if (rtp_header->paytype < 96) {
+				warn("Unsupported RTP payload type: %u", rtp_header->paytype);
+				continue;
+			}
 #endif
 
-		/* If in the first N packets mark bit is not set, it might mean, that
-		 * the mark bit will not be set at all. In such a case, activate mark
-		 * bit quirk workaround. */
-		if (markbit_quirk < 0) {
-			if (rtp_header->markbit)
-				markbit_quirk = 0;
-			else if (++markbit_quirk == 0) {
-				warn("Activating RTP mark bit quirk workaround");
-				markbit_quirk = 1;
+			/* If in the first N packets mark bit is not set, it might mean, that
+			 * the mark bit will not be set at all. In such a case, activate mark
+			 * bit quirk workaround. */
+			if (markbit_quirk < 0) {
+				if (rtp_header->markbit)
+					markbit_quirk = 0;
+				else if (++markbit_quirk == 0) {
+					warn("Activating RTP mark bit quirk workaround");
+					markbit_quirk = 1;
+				}
 			}
-		}
 
-		uint16_t _seq_number = ntohs(rtp_header->seq_number);
-		if (++seq_number != _seq_number) {
-			if (seq_number != 0)
-				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
-			seq_number = _seq_number;
-		}
+			if (jb.packets == NULL) {
+				t->stats.bt_packets++;
+				t->stats.bt_bytes += len;
+				io_a2dp_sink_aac_decode(t, handle, bt.data, len, markbit_quirk,
+						&latm, &pcm, channels, &seq_number);
+				continue;
+			}
 
-		if (ffb_len_in(&latm) < rtp_latm_len) {
-			debug("Resizing LATM buffer: %zd -> %zd", latm.size, latm.size + t->mtu_read);
-			size_t prev_len = ffb_len_out(&latm);
-			ffb_init(&latm, latm.size + t->mtu_read);
-			ffb_seek(&latm, prev_len);
-		}
+			/* only the last fragment of the AAC frame carries audio */
+			const bool complete = markbit_quirk == 1 || rtp_header->markbit;
+			io_thread_jitter_put(t, &jb, bt.data, len, complete ? aac_frame_frames : 0);
 
-		memcpy(latm.tail, rtp_latm, rtp_latm_len);
-		ffb_seek(&latm, rtp_latm_len);
+		}
 
-		if (markbit_quirk != 1 && !rtp_header->markbit) {
-			debug("Fragmented RTP packet [%u]: LATM len: %zd", seq_number, rtp_latm_len);
+		if (jb.packets == NULL || t->a2dp.pcm.fd == -1)
 			continue;
-		}
 
-		unsigned int data_len = ffb_len_out(&latm);
-		unsigned int valid = ffb_len_out(&latm);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-		if ((err = aacDecoder_Fill(handle, &latm.data, &data_len, &valid)) != AAC_DEC_OK)
-			error("AAC buffer fill error: %s", aacdec_strerror(err));
-		else if ((err = aacDecoder_DecodeFrame(handle, pcm.tail, ffb_blen_in(&pcm), 0)) != AAC_DEC_OK)
-			error("AAC decode frame error: %s", aacdec_strerror(err));
-		else if ((aacinf = aacDecoder_GetStreamInfo(handle)) == NULL)
-			error("Couldn't get AAC stream info");
-		else {
-			const size_t samples = aacinf->frameSize * aacinf->numChannels;
-			io_thread_scale_pcm(t, pcm.data, samples, channels);
-			if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
-				error("FIFO write error: %s", strerror(errno));
-			ffb_rewind(&latm);
+		/* release packets from the jitter buffer with the stream rate */
+		const uint8_t *packet;
+		size_t packet_len;
+		unsigned int frames;
+		enum jitter_status status;
+
+		const unsigned int underruns = jb.underruns;
+
+		gettimestamp(&ts);
+		while ((status = jitter_buffer_get(&jb, &ts, &packet, &packet_len, &frames)) != JITTER_EMPTY) {
+			if (status == JITTER_PACKET) {
+				if ((samples = io_a2dp_sink_aac_decode(t, handle, packet, packet_len,
+								markbit_quirk, &latm, &pcm, channels, &seq_number)) > 0) {
+					aac_frame_frames = samples / channels;
+					/* PCM buffer holds the last decoded frame only */
+					pcm_samples = MIN(samples, pcm.size);
+				}
+			}
+			else {
+				/* drop partially assembled AAC frame */
+				ffb_rewind(&latm);
+				io_thread_write_pcm_plc(&t->a2dp.pcm, &pcm, &pcm_samples, frames * channels);
+			}
 		}
 
+		t->stats.pcm_underruns += jb.underruns - underruns;
+
 	}
 
 fail:
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_cleanup_pop(!locked);
+fail_jitter:
+	pthread_cleanup_pop(1);
 fail_ffb:
 	pthread_cleanup_pop(1);
 	pthread_cleanup_pop(1);
@@ -772,32 +3653,32 @@ fail_open:
 #endif
 
 #if ENABLE_AAC
-void *io_thread_a2dp_source_aac(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
-	const a2dp_aac_t *cconfig = (a2dp_aac_t *)t->a2dp.cconfig;
-
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
-
-	bool locked = !transport_pthread_cleanup_lock(t);
+static int io_aac_encoder_init(struct io_a2dp_encoder *enc, struct ba_transport *t) {
 
+	const a2dp_aac_t *cconfig = (a2dp_aac_t *)t->a2dp.cconfig;
 	HANDLE_AACENCODER handle;
-	AACENC_InfoStruct aacinf;
 	AACENC_ERROR err;
 
+	if (codec_lib_load(CODEC_LIB_AAC) == -1) {
+		error("Couldn't load AAC library: %s", strerror(errno));
+		return -1;
+	}
+
 	/* create AAC encoder without the Meta Data module */
-	const unsigned int channels = transport_get_channels(t);
-	if ((err = aacEncOpen(&handle, 0x07, channels)) != AACENC_OK) {
+	if ((handle = codec_cache_take(io_thread_codec_cache(t), &enc->aac.codec, A2DP_CODEC_MPEG24,
+					true, t->a2dp.cconfig, t->a2dp.cconfig_size, 0)) == NULL &&
+			(err = aacEncOpen(&handle, 0x07, enc->channels)) != AACENC_OK) {
 		error("Couldn't open AAC encoder: %s", aacenc_strerror(err));
-		goto fail_open;
+		return -1;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(aacEncClose), &handle);
+	enc->aac.codec.handle = handle;
+	enc->aac.codec.free = io_aacenc_close;
 
 	unsigned int aot = AOT_NONE;
 	unsigned int bitrate = AAC_GET_BITRATE(*cconfig);
 	unsigned int samplerate = transport_get_sampling(t);
-	unsigned int channelmode = channels == 1 ? MODE_1 : MODE_2;
+	unsigned int channelmode = enc->channels == 1 ? MODE_1 : MODE_2;
 
 	switch (cconfig->object_type) {
 	case AAC_OBJECT_TYPE_MPEG2_AAC_LC:
@@ -816,563 +3697,906 @@ void *io_thread_a2dp_source_aac(void *arg) {
 		break;
 	}
 
+	/* The cached encoder is not allocated again, but its whole state is
+	 * re-initialized upon the priming call below. */
+	if ((err = aacEncoder_SetParam(handle, AACENC_CONTROL_STATE, AACENC_INIT_ALL)) != AACENC_OK) {
+		error("Couldn't reset AAC encoder: %s", aacenc_strerror(err));
+		return -1;
+	}
 	if ((err = aacEncoder_SetParam(handle, AACENC_AOT, aot)) != AACENC_OK) {
 		error("Couldn't set audio object type: %s", aacenc_strerror(err));
-		goto fail_init;
+		return -1;
 	}
 	if ((err = aacEncoder_SetParam(handle, AACENC_BITRATE, bitrate)) != AACENC_OK) {
 		error("Couldn't set bitrate: %s", aacenc_strerror(err));
-		goto fail_init;
+		return -1;
 	}
 	if ((err = aacEncoder_SetParam(handle, AACENC_SAMPLERATE, samplerate)) != AACENC_OK) {
 		error("Couldn't set sampling rate: %s", aacenc_strerror(err));
-		goto fail_init;
+		return -1;
 	}
 	if ((err = aacEncoder_SetParam(handle, AACENC_CHANNELMODE, channelmode)) != AACENC_OK) {
 		error("Couldn't set channel mode: %s", aacenc_strerror(err));
-		goto fail_init;
+		return -1;
 	}
 	if (cconfig->vbr) {
 		if ((err = aacEncoder_SetParam(handle, AACENC_BITRATEMODE, config.aac_vbr_mode)) != AACENC_OK) {
 			error("Couldn't set VBR bitrate mode %u: %s", config.aac_vbr_mode, aacenc_strerror(err));
-			goto fail_init;
+			return -1;
 		}
 	}
 	if ((err = aacEncoder_SetParam(handle, AACENC_AFTERBURNER, config.aac_afterburner)) != AACENC_OK) {
 		error("Couldn't enable afterburner: %s", aacenc_strerror(err));
-		goto fail_init;
+		return -1;
 	}
 	if ((err = aacEncoder_SetParam(handle, AACENC_TRANSMUX, TT_MP4_LATM_MCP1)) != AACENC_OK) {
 		error("Couldn't enable LATM transport type: %s", aacenc_strerror(err));
-		goto fail_init;
+		return -1;
 	}
 	if ((err = aacEncoder_SetParam(handle, AACENC_HEADER_PERIOD, 1)) != AACENC_OK) {
 		error("Couldn't set LATM header period: %s", aacenc_strerror(err));
-		goto fail_init;
+		return -1;
 	}
 
 	if ((err = aacEncEncode(handle, NULL, NULL, NULL, NULL)) != AACENC_OK) {
 		error("Couldn't initialize AAC encoder: %s", aacenc_strerror(err));
-		goto fail_init;
+		return -1;
 	}
-	if ((err = aacEncInfo(handle, &aacinf)) != AACENC_OK) {
+	if ((err = aacEncInfo(handle, &enc->aac.info)) != AACENC_OK) {
 		error("Couldn't get encoder info: %s", aacenc_strerror(err));
-		goto fail_init;
+		return -1;
 	}
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
-
-	if (ffb_init(&pcm, aacinf.inputChannels * aacinf.frameLength) == NULL ||
-			ffb_init(&bt, RTP_HEADER_LEN + aacinf.maxOutBufBytes) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
+	enc->aac.codec.reusable = true;
+
+	enc->format = BA_PCM_FORMAT_S16_LE;
+	enc->block_frames = enc->aac.info.frameLength;
+	/* room for packed audioMuxElements followed by the encoder output */
+	enc->payload_size = enc->payload_len + enc->aac.info.maxOutBufBytes;
+
+	/* Bit rate can be adjusted in the constant bit rate mode only. The quality
+	 * levels span from the configured bit rate down to the half of it. */
+	enc->aac.abr_enabled = config.a2dp.abr && !cconfig->vbr;
+	enc->aac.bitrate = enc->aac.abr_bitrate = bitrate;
+	t->stats.codec_param = bitrate;
+
+	struct timespec ts_abr;
+	gettimestamp(&ts_abr);
+	abr_init(&enc->aac.abr, &config.a2dp.abr_config, IO_THREAD_AAC_ABR_LEVELS, &ts_abr);
+
+	if (enc->aac.abr_enabled) {
+		/* start with the bit rate which the link has been able to carry */
+		abr_set_level(&enc->aac.abr, link_history_get_level(&config.a2dp.link_history,
+					&t->device->addr, A2DP_CODEC_MPEG24, enc->aac.abr.levels), &ts_abr);
+		unsigned int rate = bitrate - bitrate / 2 * enc->aac.abr.level / (IO_THREAD_AAC_ABR_LEVELS - 1);
+		if (rate != enc->aac.abr_bitrate) {
+			if ((err = aacEncoder_SetParam(handle, AACENC_BITRATE, rate)) != AACENC_OK)
+				error("Couldn't set bitrate: %s", aacenc_strerror(err));
+			else
+				t->stats.codec_param = enc->aac.abr_bitrate = rate;
+		}
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+	return 0;
+}
 
-	rtp_header_t *rtp_header;
+static size_t io_aac_encoder_frames_per_packet(const struct io_a2dp_encoder *enc) {
+	/* every encode call produces at most one audioMuxElement */
+	return enc->aac.info.frameLength;
+}
 
-	/* initialize RTP header and get anchor for payload */
-	uint8_t *rtp_payload = io_thread_init_rtp(bt.data, &rtp_header, NULL);
-	uint16_t seq_number = ntohs(rtp_header->seq_number);
-	uint32_t timestamp = ntohl(rtp_header->timestamp);
+/**
+ * Complete the payload with the packed audioMuxElements. */
+static size_t io_aac_encoder_complete(struct io_a2dp_encoder *enc) {
+	const size_t len = enc->aac.aus_len;
+	enc->aac.aus = 0;
+	enc->aac.aus_len = 0;
+	enc->pending = enc->aac.carry_len > 0;
+	return len;
+}
+
+/**
+ * Start the payload with the element which did not fit into the previous
+ * one. Frames consumed for this element are already accounted to the time
+ * line of the new payload. */
+static void io_aac_encoder_carry(struct io_a2dp_encoder *enc, uint8_t *output) {
+	memmove(output, output + enc->aac.carry_offset, enc->aac.carry_len);
+	enc->aac.aus = 1;
+	enc->aac.aus_len = enc->aac.carry_len;
+	enc->aac.carry_len = 0;
+	enc->pending_frames = 0;
+	enc->pending = true;
+}
+
+/**
+ * Encode audioMuxElement and pack it into the payload.
+ *
+ * According to the RFC 3016, multiple audioMuxElements can be put into a
+ * single RTP packet, in which case the RTP time-stamp is the one of the
+ * first element. The payload is completed if the new element does not fit
+ * in it (such element is carried to the next payload), if the next element
+ * of a similar size would not fit in it, or if there is no more audio for
+ * the flush timeout. */
+static ssize_t io_aac_encoder_encode(struct io_a2dp_encoder *enc, const void *input,
+		size_t *frames, uint8_t *output, size_t size, unsigned int *codec_frames) {
+
+	HANDLE_AACENCODER handle = enc->aac.codec.handle;
+	AACENC_ERROR err;
+
+	(void)codec_frames;
 
+	if (enc->aac.carry_len > 0) {
+		io_aac_encoder_carry(enc, output);
+		if (2 * enc->aac.aus_len > size) {
+			*frames = 0;
+			return io_aac_encoder_complete(enc);
+		}
+	}
+
+	void *in_ptr = (void *)input;
+	void *out_ptr = output + enc->aac.aus_len;
 	int in_bufferIdentifiers[] = { IN_AUDIO_DATA };
 	int out_bufferIdentifiers[] = { OUT_BITSTREAM_DATA };
-	int in_bufSizes[] = { pcm.size * sizeof(*pcm.data) };
-	int out_bufSizes[] = { aacinf.maxOutBufBytes };
-	int in_bufElSizes[] = { sizeof(*pcm.data) };
-	int out_bufElSizes[] = { sizeof(*bt.data) };
+	int in_bufSizes[] = { *frames * enc->channels * sizeof(int16_t) };
+	int out_bufSizes[] = { enc->payload_size - enc->aac.aus_len };
+	int in_bufElSizes[] = { sizeof(int16_t) };
+	int out_bufElSizes[] = { sizeof(uint8_t) };
 
 	AACENC_BufDesc in_buf = {
 		.numBufs = 1,
-		.bufs = (void **)&pcm.data,
+		.bufs = &in_ptr,
 		.bufferIdentifiers = in_bufferIdentifiers,
 		.bufSizes = in_bufSizes,
 		.bufElSizes = in_bufElSizes,
 	};
 	AACENC_BufDesc out_buf = {
 		.numBufs = 1,
-		.bufs = (void **)&rtp_payload,
+		.bufs = &out_ptr,
 		.bufferIdentifiers = out_bufferIdentifiers,
 		.bufSizes = out_bufSizes,
 		.bufElSizes = out_bufElSizes,
 	};
-	AACENC_InArgs in_args = { 0 };
+	AACENC_InArgs in_args = { .numInSamples = *frames * enc->channels };
 	AACENC_OutArgs out_args = { 0 };
 
-	/* array with historical data of queued bytes for BT socket */
-	int coutq_history[IO_THREAD_COUTQ_HISTORY_SIZE] = { 0 };
-	size_t coutq_i = 0;
+	if ((err = aacEncEncode(handle, &in_buf, &out_buf, &in_args, &out_args)) != AACENC_OK) {
+		error("AAC encoding error: %s", aacenc_strerror(err));
+		return -1;
+	}
 
-	int poll_timeout = -1;
-	struct asrsync asrs = { .frames = 0 };
-	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
-		{ -1, POLLIN, 0 },
-	};
+	*frames = out_args.numInSamples / enc->channels;
 
-	transport_pthread_cleanup_unlock(t);
-	locked = false;
+	const size_t len = out_args.numOutBytes;
+	if (len == 0)
+		return 0;
 
-	debug("Starting IO loop: %s (%s)",
-			bluetooth_profile_to_string(t->profile),
-			bluetooth_a2dp_codec_to_string(t->codec));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	if (enc->aac.aus > 0 && enc->aac.aus_len + len > size) {
+		/* the new element belongs to the next payload */
+		enc->aac.carry_offset = enc->aac.aus_len;
+		enc->aac.carry_len = len;
+		enc->pending_frames = *frames;
+		return io_aac_encoder_complete(enc);
+	}
+
+	enc->aac.aus++;
+	enc->aac.aus_len += len;
+	enc->pending = true;
+
+	/* Send the packet right away if it requires fragmentation, or if
+	 * the next element of a similar size would not fit in it. */
+	if (enc->aac.aus == IO_THREAD_AAC_PACK_AUS || enc->aac.aus_len + len > size)
+		return io_aac_encoder_complete(enc);
+
+	return 0;
+}
+
+static ssize_t io_aac_encoder_flush(struct io_a2dp_encoder *enc, uint8_t *output,
+		size_t size, unsigned int *codec_frames) {
+	(void)size;
+	(void)codec_frames;
+	if (enc->aac.aus == 0 && enc->aac.carry_len > 0)
+		io_aac_encoder_carry(enc, output);
+	return io_aac_encoder_complete(enc);
+}
+
+/**
+ * Adjust bit rate according to the BT link congestion. */
+static void io_aac_encoder_adapt(struct io_a2dp_encoder *enc, struct ba_transport *t,
+		int coutq, unsigned int blocked) {
+
+	const unsigned int bitrate = enc->aac.bitrate;
+	struct timespec ts_abr;
+	AACENC_ERROR err;
+
+	if (!enc->aac.abr_enabled)
+		return;
+
+	gettimestamp(&ts_abr);
+	unsigned int level = abr_update(&enc->aac.abr, coutq / t->mtu_write, blocked, &ts_abr);
+	unsigned int rate = bitrate - bitrate / 2 * level / (IO_THREAD_AAC_ABR_LEVELS - 1);
+
+	if (rate != enc->aac.abr_bitrate) {
+		debug("Changing AAC bit rate: %u -> %u", enc->aac.abr_bitrate, rate);
+		if ((err = aacEncoder_SetParam(enc->aac.codec.handle, AACENC_BITRATE, rate)) != AACENC_OK)
+			error("Couldn't set bitrate: %s", aacenc_strerror(err));
+		else {
+			t->stats.codec_param = enc->aac.abr_bitrate = rate;
+			link_history_update(&config.a2dp.link_history, &t->device->addr,
+					A2DP_CODEC_MPEG24, level, enc->aac.abr.levels);
+		}
+	}
+
+}
+
+static unsigned int io_aac_encoder_complexity_levels(const struct io_a2dp_encoder *enc) {
+	/* The afterburner is the only complexity knob of the AAC encoder which
+	 * does not affect the negotiated stream parameters. */
+	(void)enc;
+	return config.aac_afterburner ? 2 : 1;
+}
+
+static void io_aac_encoder_set_complexity(struct io_a2dp_encoder *enc, struct ba_transport *t,
+		unsigned int level) {
+	AACENC_ERROR err;
+	(void)t;
+	/* the new value is applied upon the next encoding call */
+	if ((err = aacEncoder_SetParam(enc->aac.codec.handle, AACENC_AFTERBURNER, level == 0)) != AACENC_OK)
+		error("Couldn't set afterburner: %s", aacenc_strerror(err));
+}
+
+static void io_aac_encoder_free(struct io_a2dp_encoder *enc) {
+	codec_cache_release(&enc->aac.codec);
+}
+
+static const struct io_a2dp_encoder_ops io_aac_encoder = {
+	.rtp = true,
+	.rtp_fragment = true,
+	.pipeline = true,
+	.flush_timeout = IO_THREAD_AAC_PACK_TIMEOUT,
+	.init = io_aac_encoder_init,
+	.frames_per_packet = io_aac_encoder_frames_per_packet,
+	.encode = io_aac_encoder_encode,
+	.flush = io_aac_encoder_flush,
+	.adapt = io_aac_encoder_adapt,
+	.complexity_levels = io_aac_encoder_complexity_levels,
+	.set_complexity = io_aac_encoder_set_complexity,
+	.free = io_aac_encoder_free,
+};
+
+void *io_thread_a2dp_source_aac(void *arg) {
+	return io_thread_a2dp_source_engine((struct ba_transport *)arg, &io_aac_encoder);
+}
+#endif
+
+#if ENABLE_APTX || ENABLE_APTX_HD
+/**
+ * Encode block of the deinterleaved stereo signal.
+ *
+ * The apt-X encoder consumes 4 frames per call, so with the whole block
+ * deinterleaved up front, the loop below does nothing but the encoding.
+ *
+ * @param handle Initialized apt-X (or apt-X HD) encoder.
+ * @param hd If true, the apt-X HD encoder is used.
+ * @param pcm_l Address of the 1st channel samples.
+ * @param pcm_r Address of the 2nd channel samples.
+ * @param frames The number of frames - it shall be a multiple of 4.
+ * @param output Address of the output buffer, which shall be big enough to
+ *   hold all encoded code words.
+ * @return On success this function returns the number of encoded bytes.
+ *   Otherwise, -1 is returned. */
+static ssize_t io_aptx_encode_block(APTXENC handle, bool hd, int32_t *pcm_l,
+		int32_t *pcm_r, size_t frames, uint8_t *output) {
+
+	uint8_t *tail = output;
+	size_t i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+#if ENABLE_APTX_HD
+		if (hd) {
+			uint32_t code[2];
+			if (aptxhdbtenc_encodestereo(handle, &pcm_l[i], &pcm_r[i], code) != 0)
+				return -1;
+			/* apt-X HD code words are 24-bit big-endian */
+			tail[0] = code[0] >> 16;
+			tail[1] = code[0] >> 8;
+			tail[2] = code[0];
+			tail[3] = code[1] >> 16;
+			tail[4] = code[1] >> 8;
+			tail[5] = code[1];
+			tail += 6;
+			continue;
+		}
+#endif
+#if ENABLE_APTX
+		if (aptxbtenc_encodestereo(handle, &pcm_l[i], &pcm_r[i], (uint16_t *)tail) != 0)
+			return -1;
+		tail += 2 * sizeof(uint16_t);
+#endif
+	}
+
+	(void)hd;
+	return tail - output;
+}
+#endif
+
+#if ENABLE_APTX || ENABLE_APTX_HD
+static size_t io_aptx_encoder_frames_per_packet(const struct io_a2dp_encoder *enc) {
+	/* apt-X encoder generates two code words for every 4 stereo frames */
+	const size_t aptx_code_len = enc->aptx.hd ? 2 * 3 : 2 * sizeof(uint16_t);
+	return 4 * (enc->payload_len / aptx_code_len);
+}
 
-		ssize_t samples;
+static int io_aptx_encoder_init_(struct io_a2dp_encoder *enc, bool hd) {
 
-		/* add PCM socket to the poll if transport is active */
-		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
+	int err = 0;
 
-		switch (poll(pfds, ARRAYSIZE(pfds), poll_timeout)) {
-		case 0:
-			pthread_cond_signal(&t->a2dp.pcm.drained);
-			poll_timeout = -1;
-			locked = !transport_pthread_cleanup_lock(t);
-			if (t->a2dp.pcm.fd == -1)
-				goto final;
-			transport_pthread_cleanup_unlock(t);
-			locked = false;
-			continue;
-		case -1:
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
-		}
+	enc->aptx.hd = hd;
+	enc->aptx.frames = io_aptx_encoder_frames_per_packet(enc);
 
-		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
-			switch (sig) {
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				poll_timeout = -1;
-				asrs.frames = 0;
-				break;
-			case TRANSPORT_PCM_CLOSE:
-				poll_timeout = config.a2dp.keep_alive * 1000;
-				break;
-			case TRANSPORT_PCM_SYNC:
-				poll_timeout = 100;
-				break;
-			default:
-				break;
-			}
-			continue;
-		}
+	if (codec_lib_load(hd ? CODEC_LIB_APTX_HD : CODEC_LIB_APTX) == -1)
+		goto fail;
 
-		/* read data from the FIFO - this function will block */
-		if ((samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) <= 0) {
-			if (samples == -1)
-				error("FIFO read error: %s", strerror(errno));
-			goto fail;
-		}
+#if ENABLE_APTX_HD
+	if (hd && (enc->aptx.handle = malloc(SizeofAptxhdbtenc())) != NULL)
+		err = aptxhdbtenc_init(enc->aptx.handle, false);
+#endif
+#if ENABLE_APTX
+	if (!hd && (enc->aptx.handle = malloc(SizeofAptxbtenc())) != NULL)
+		err = aptxbtenc_init(enc->aptx.handle, __BYTE_ORDER == __LITTLE_ENDIAN);
+#endif
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	if (enc->aptx.handle == NULL || err != 0 ||
+			(enc->aptx.pcm_lr = malloc(2 * MAX(enc->aptx.frames, 4) * sizeof(int32_t))) == NULL)
+		goto fail;
 
-		if (asrs.frames == 0)
-			asrsync_init(&asrs, samplerate);
+	return 0;
 
-		if (!config.a2dp.volume)
-			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+fail:
+	error("Couldn't initialize apt-X encoder: %s", strerror(errno));
+	return -1;
+}
 
-		/* move tail pointer */
-		ffb_seek(&pcm, samples);
+static ssize_t io_aptx_encoder_encode(struct io_a2dp_encoder *enc, const void *input,
+		size_t *frames, uint8_t *output, size_t size, unsigned int *codec_frames) {
 
-		while ((in_args.numInSamples = ffb_len_out(&pcm)) > 0) {
+	int32_t *pcm_l = enc->aptx.pcm_lr;
+	int32_t *pcm_r = enc->aptx.pcm_lr + enc->aptx.frames;
+	ssize_t encoded;
 
-			if ((err = aacEncEncode(handle, &in_buf, &out_buf, &in_args, &out_args)) != AACENC_OK)
-				error("AAC encoding error: %s", aacenc_strerror(err));
+	(void)size;
+	(void)codec_frames;
 
-			if (out_args.numOutBytes > 0) {
+	snd_pcm_deinterleave_s16le(input, *frames, enc->aptx.hd ? 8 : 0, pcm_l, pcm_r);
+	if ((encoded = io_aptx_encode_block(enc->aptx.handle, enc->aptx.hd,
+					pcm_l, pcm_r, *frames, output)) == -1)
+		error("Apt-X encoding error: %s", strerror(errno));
 
-				size_t payload_len_max = t->mtu_write - RTP_HEADER_LEN;
-				size_t payload_len = out_args.numOutBytes;
-				rtp_header->timestamp = htonl(timestamp);
+	return encoded;
+}
 
-				/* If the size of the RTP packet exceeds writing MTU, the RTP payload
-				 * should be fragmented. According to the RFC 3016, fragmentation of
-				 * the audioMuxElement requires no extra header - the payload should
-				 * be fragmented and spread across multiple RTP packets. */
-				for (;;) {
+static void io_aptx_encoder_free(struct io_a2dp_encoder *enc) {
+	free(enc->aptx.handle);
+	free(enc->aptx.pcm_lr);
+}
+#endif
 
-					ssize_t ret;
-					size_t len;
+#if ENABLE_APTX
+static int io_aptx_encoder_init(struct io_a2dp_encoder *enc, struct ba_transport *t) {
+	(void)t;
+	return io_aptx_encoder_init_(enc, false);
+}
 
-					len = payload_len > payload_len_max ? payload_len_max : payload_len;
-					rtp_header->markbit = payload_len <= payload_len_max;
-					rtp_header->seq_number = htons(++seq_number);
+/* The apt-X stream has no RTP headers at all. */
+static const struct io_a2dp_encoder_ops io_aptx_encoder = {
+	.rtp = false,
+	.pipeline = true,
+	.block_frames = 4,
+	.init = io_aptx_encoder_init,
+	.frames_per_packet = io_aptx_encoder_frames_per_packet,
+	.encode = io_aptx_encoder_encode,
+	.free = io_aptx_encoder_free,
+};
 
-					pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+void *io_thread_a2dp_source_aptx(void *arg) {
+	return io_thread_a2dp_source_engine((struct ba_transport *)arg, &io_aptx_encoder);
+}
+#endif
 
-					coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
-					if ((ret = io_thread_write_bt(t, bt.data, RTP_HEADER_LEN + len, &coutq_history[coutq_i])) == -1) {
-						if (errno == ECONNRESET || errno == ENOTCONN) {
-							/* exit thread upon BT socket disconnection */
-							debug("BT socket disconnected: %d", t->bt_fd);
-							goto fail;
-						}
-						error("BT socket write error: %s", strerror(errno));
-						break;
-					}
+#if ENABLE_APTX_HD
+static int io_aptx_hd_encoder_init(struct io_a2dp_encoder *enc, struct ba_transport *t) {
+	(void)t;
+	return io_aptx_encoder_init_(enc, true);
+}
 
-					pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+static const struct io_a2dp_encoder_ops io_aptx_hd_encoder = {
+	.rtp = true,
+	.pipeline = true,
+	.block_frames = 4,
+	.init = io_aptx_hd_encoder_init,
+	.frames_per_packet = io_aptx_encoder_frames_per_packet,
+	.encode = io_aptx_encoder_encode,
+	.free = io_aptx_encoder_free,
+};
+
+void *io_thread_a2dp_source_aptx_hd(void *arg) {
+	return io_thread_a2dp_source_engine((struct ba_transport *)arg, &io_aptx_hd_encoder);
+}
+#endif
 
-					/* account written payload only */
-					ret -= RTP_HEADER_LEN;
+#if ENABLE_LDAC
+static int io_ldac_encoder_init(struct io_a2dp_encoder *enc, struct ba_transport *t) {
 
-					/* break if the last part of the payload has been written */
-					if ((payload_len -= ret) == 0)
-						break;
+	const a2dp_ldac_t *cconfig = (a2dp_ldac_t *)t->a2dp.cconfig;
+	const unsigned int samplerate = transport_get_sampling(t);
+	const size_t ldac_pcm_samples = LDACBT_ENC_LSU * enc->channels;
+	const int ldac_mtu = enc->payload_len;
+	HANDLE_LDAC_BT handle;
+	bool reused = false;
 
-					/* move rest of data to the beginning of the payload */
-					debug("Payload fragmentation: extra %zd bytes", payload_len);
-					memmove(rtp_payload, rtp_payload + ret, payload_len);
+	enc->ldac.channel_mode = cconfig->channel_mode;
 
-				}
+	if (codec_lib_load(CODEC_LIB_LDAC) == -1 ||
+			codec_lib_load(CODEC_LIB_LDAC_ABR) == -1) {
+		error("Couldn't load LDAC library: %s", strerror(errno));
+		return -1;
+	}
 
-			}
+	/* The frame size of the encoder is derived from the write MTU, so it is
+	 * a part of the cache key, as well as the PCM sample format. The reused
+	 * handle still carries the state of the previous stream (quality mode and
+	 * the analysis filter history), so it is initialized again. */
+	if ((handle = codec_cache_take(io_thread_codec_cache(t), &enc->ldac.codec,
+					A2DP_CODEC_VENDOR_LDAC, true, t->a2dp.cconfig, t->a2dp.cconfig_size,
+					ldac_mtu << 2 | enc->format)) != NULL)
+		reused = true;
+	else if ((handle = ldacBT_get_handle()) == NULL) {
+		error("Couldn't open LDAC encoder: %s", strerror(errno));
+		return -1;
+	}
 
-			/* keep data transfer at a constant bit rate, also
-			 * get a timestamp for the next RTP frame */
-			unsigned int frames = out_args.numInSamples / channels;
-			asrsync_sync(&asrs, frames);
-			timestamp += frames * 10000 / samplerate;
+	enc->ldac.codec.handle = handle;
+	enc->ldac.codec.free = io_ldacenc_close;
 
-			/* update busy delay (encoding overhead) */
-			t->delay = asrsync_get_busy_usec(&asrs) / 100;
+	if ((enc->ldac.handle_abr = ldac_ABR_get_handle()) == NULL) {
+		error("Couldn't open LDAC ABR: %s", strerror(errno));
+		return -1;
+	}
 
-			/* If the input buffer was not consumed, we have to append new data to
-			 * the existing one. Since we do not use ring buffer, we will simply
-			 * move unprocessed data to the front of our linear buffer. */
-			ffb_shift(&pcm, out_args.numInSamples);
+	if (reused)
+		ldacBT_close_handle(handle);
+	if (io_ldacenc_init(handle, ldac_mtu, enc->ldac.channel_mode, enc->format, samplerate) == -1) {
+		error("Couldn't initialize LDAC encoder: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
+		return -1;
+	}
 
-		}
+	enc->ldac.codec.reusable = true;
 
+	if (ldac_ABR_Init(enc->ldac.handle_abr, 1000 * ldac_pcm_samples / enc->channels / samplerate) == -1) {
+		error("Couldn't initialize LDAC ABR");
+		return -1;
+	}
+	if (ldac_ABR_set_thresholds(enc->ldac.handle_abr, 6, 4, 2) == -1) {
+		error("Couldn't set LDAC ABR thresholds");
+		return -1;
 	}
 
-fail:
-final:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-fail_open:
-	pthread_cleanup_pop(1);
-	return NULL;
+	if (config.ldac_abr) {
+		/* Start with the encoder quality which the link has been able to carry.
+		 * The LDAC ABR might go below the MQ level, but such qualities can not
+		 * be selected with the ldacBT_set_eqmid(). */
+		unsigned int eqmid = link_history_get_level(&config.a2dp.link_history,
+				&t->device->addr, A2DP_CODEC_VENDOR_LDAC, LDACBT_EQMID_NUM);
+		if (eqmid > config.ldac_eqmid &&
+				ldacBT_set_eqmid(handle, eqmid) == -1)
+			warn("Couldn't set LDAC encoder quality: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
+	}
+
+	enc->ldac.eqmid = ldacBT_get_eqmid(handle);
+	enc->ldac.eqmid_min = config.ldac_eqmid;
+	t->stats.codec_param = enc->ldac.eqmid;
+
+	return 0;
 }
-#endif
 
-#if ENABLE_APTX
-void *io_thread_a2dp_source_aptx(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
+static void io_ldac_encoder_set_eqmid(struct io_a2dp_encoder *enc, struct ba_transport *t, int eqmid) {
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+	HANDLE_LDAC_BT handle = enc->ldac.codec.handle;
 
-	bool locked = !transport_pthread_cleanup_lock(t);
+	if (ldacBT_set_eqmid(handle, eqmid) == -1)
+		warn("Couldn't set LDAC encoder quality: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
+	t->stats.codec_param = enc->ldac.eqmid = ldacBT_get_eqmid(handle);
 
-	APTXENC handle = malloc(SizeofAptxbtenc());
-	pthread_cleanup_push(PTHREAD_CLEANUP(free), handle);
+}
 
-	if (handle == NULL || aptxbtenc_init(handle, __BYTE_ORDER == __LITTLE_ENDIAN) != 0) {
-		error("Couldn't initialize apt-X encoder: %s", strerror(errno));
-		goto fail_init;
-	}
+static size_t io_ldac_encoder_frames_per_packet(const struct io_a2dp_encoder *enc) {
+	/* LDAC encoder consumes single LSU per call, and it assembles packets
+	 * out of several such units internally */
+	(void)enc;
+	return LDACBT_ENC_LSU;
+}
 
-	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+static ssize_t io_ldac_encoder_encode(struct io_a2dp_encoder *enc, const void *input,
+		size_t *frames, uint8_t *output, size_t size, unsigned int *codec_frames) {
 
-	const unsigned int channels = transport_get_channels(t);
-	const size_t aptx_pcm_samples = 4 * channels;
-	const size_t aptx_code_len = 2 * sizeof(uint16_t);
-	const size_t mtu_write = t->mtu_write;
+	HANDLE_LDAC_BT handle = enc->ldac.codec.handle;
+	int len;
+	int encoded;
+	int ldac_frames;
 
-	if (ffb_init(&pcm, aptx_pcm_samples * (mtu_write / aptx_code_len)) == NULL ||
-			ffb_init(&bt, mtu_write) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
-		goto fail_ffb;
+	(void)size;
+
+	if (ldacBT_encode(handle, (void *)input, &len, output, &encoded, &ldac_frames) != 0) {
+		error("LDAC encoding error: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
+		return -1;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+	*frames = len / (transport_pcm_format_size(enc->format) * enc->channels);
+	*codec_frames = ldac_frames;
+	return encoded;
+}
 
-	/* array with historical data of queued bytes for BT socket */
-	int coutq_history[IO_THREAD_COUTQ_HISTORY_SIZE] = { 0 };
-	size_t coutq_i = 0;
+static int io_ldac_encoder_reconfigure(struct io_a2dp_encoder *enc, struct ba_transport *t) {
 
-	int poll_timeout = -1;
-	struct asrsync asrs = { .frames = 0 };
-	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
-		{ -1, POLLIN, 0 },
-	};
+	HANDLE_LDAC_BT handle = enc->ldac.codec.handle;
+	const int ldac_mtu = enc->payload_len;
 
-	transport_pthread_cleanup_unlock(t);
-	locked = false;
+	enc->ldac.codec.param = ldac_mtu << 2 | enc->format;
+	ldacBT_close_handle(handle);
 
-	debug("Starting IO loop: %s (%s)",
-			bluetooth_profile_to_string(t->profile),
-			bluetooth_a2dp_codec_to_string(t->codec));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	if (io_ldacenc_init(handle, ldac_mtu, enc->ldac.channel_mode, enc->format,
+				transport_get_sampling(t)) == -1) {
+		error("Couldn't initialize LDAC encoder: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
+		enc->ldac.codec.reusable = false;
+		return -1;
+	}
 
-		ssize_t samples;
+	/* reinitialized encoder starts with the configured quality */
+	enc->ldac.eqmid = ldacBT_get_eqmid(handle);
+	if (enc->ldac.eqmid < enc->ldac.eqmid_min)
+		io_ldac_encoder_set_eqmid(enc, t, enc->ldac.eqmid_min);
 
-		/* add PCM socket to the poll if transport is active */
-		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
+	return 0;
+}
 
-		switch (poll(pfds, ARRAYSIZE(pfds), poll_timeout)) {
-		case 0:
-			pthread_cond_signal(&t->a2dp.pcm.drained);
-			poll_timeout = -1;
-			locked = !transport_pthread_cleanup_lock(t);
-			if (t->a2dp.pcm.fd == -1)
-				goto final;
-			transport_pthread_cleanup_unlock(t);
-			locked = false;
-			continue;
-		case -1:
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
-		}
+static void io_ldac_encoder_adapt(struct io_a2dp_encoder *enc, struct ba_transport *t,
+		int coutq, unsigned int blocked) {
 
-		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
-			switch (sig) {
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				poll_timeout = -1;
-				asrs.frames = 0;
-				break;
-			case TRANSPORT_PCM_CLOSE:
-				poll_timeout = config.a2dp.keep_alive * 1000;
-				break;
-			case TRANSPORT_PCM_SYNC:
-				poll_timeout = 100;
-				break;
-			default:
-				break;
-			}
-			continue;
-		}
+	HANDLE_LDAC_BT handle = enc->ldac.codec.handle;
 
-		/* read data from the FIFO - this function will block */
-		if ((samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) <= 0) {
-			if (samples == -1)
-				error("FIFO read error: %s", strerror(errno));
-			goto fail;
-		}
+	(void)blocked;
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	if (!config.ldac_abr)
+		return;
 
-		if (asrs.frames == 0)
-			asrsync_init(&asrs, transport_get_sampling(t));
+	ldac_ABR_Proc(handle, enc->ldac.handle_abr, coutq / t->mtu_write, 1);
 
-		if (!config.a2dp.volume)
-			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+	/* The ABR might raise the quality above the level allowed by the CPU
+	 * budget. Such change is not stored in the link history, because the
+	 * link is not the limiting factor here. */
+	if (ldacBT_get_eqmid(handle) < enc->ldac.eqmid_min) {
+		io_ldac_encoder_set_eqmid(enc, t, enc->ldac.eqmid_min);
+		return;
+	}
 
-		/* get overall number of input samples */
-		ffb_seek(&pcm, samples);
-		samples = ffb_len_out(&pcm);
+	if (ldacBT_get_eqmid(handle) != enc->ldac.eqmid) {
+		t->stats.codec_param = enc->ldac.eqmid = ldacBT_get_eqmid(handle);
+		link_history_update(&config.a2dp.link_history, &t->device->addr,
+				A2DP_CODEC_VENDOR_LDAC, MIN(enc->ldac.eqmid, LDACBT_EQMID_MQ), LDACBT_EQMID_NUM);
+	}
 
-		int16_t *input = pcm.data;
-		size_t input_len = samples;
+}
 
-		/* encode and transfer obtained data */
-		while (input_len >= aptx_pcm_samples) {
+static unsigned int io_ldac_encoder_complexity_levels(const struct io_a2dp_encoder *enc) {
+	/* qualities below the MQ level can be selected by the ABR only */
+	(void)enc;
+	if (config.ldac_eqmid >= LDACBT_EQMID_MQ)
+		return 1;
+	return LDACBT_EQMID_MQ - config.ldac_eqmid + 1;
+}
 
-			size_t output_len = ffb_len_in(&bt);
-			size_t pcm_frames = 0;
+static void io_ldac_encoder_set_complexity(struct io_a2dp_encoder *enc, struct ba_transport *t,
+		unsigned int level) {
 
-			/* Generate as many apt-X frames as possible to fill the output buffer
-			 * without overflowing it. The size of the output buffer is based on
-			 * the socket MTU, so such a transfer should be most efficient. */
-			while (input_len >= aptx_pcm_samples && output_len >= aptx_code_len) {
+	enc->ldac.eqmid_min = config.ldac_eqmid + level;
 
-				int32_t pcm_l[4];
-				int32_t pcm_r[4];
-				size_t i;
+	/* With the ABR enabled, the quality might be lower than the one allowed
+	 * by the CPU budget - in such case the ABR will raise it by itself. */
+	int eqmid = enc->ldac.eqmid_min;
+	if (config.ldac_abr && enc->ldac.eqmid > eqmid)
+		eqmid = enc->ldac.eqmid;
 
-				for (i = 0; i < 4; i++) {
-					pcm_l[i] = input[2 * i];
-					pcm_r[i] = input[2 * i + 1];
-				}
+	if (eqmid != enc->ldac.eqmid)
+		io_ldac_encoder_set_eqmid(enc, t, eqmid);
 
-				if (aptxbtenc_encodestereo(handle, pcm_l, pcm_r, (uint16_t *)bt.tail) != 0) {
-					error("Apt-X encoding error: %s", strerror(errno));
-					break;
-				}
+}
 
-				input += 4 * channels;
-				input_len -= 4 * channels;
-				ffb_seek(&bt, aptx_code_len);
-				output_len -= aptx_code_len;
-				pcm_frames += 4;
+static void io_ldac_encoder_free(struct io_a2dp_encoder *enc) {
+	if (enc->ldac.handle_abr != NULL)
+		ldac_ABR_free_handle(enc->ldac.handle_abr);
+	codec_cache_release(&enc->ldac.codec);
+}
 
-			}
+static const struct io_a2dp_encoder_ops io_ldac_encoder = {
+	.rtp = true,
+	.rtp_media = true,
+	.pipeline = true,
+	.block_frames = LDACBT_ENC_LSU,
+	.init = io_ldac_encoder_init,
+	.frames_per_packet = io_ldac_encoder_frames_per_packet,
+	.encode = io_ldac_encoder_encode,
+	.reconfigure = io_ldac_encoder_reconfigure,
+	.adapt = io_ldac_encoder_adapt,
+	.complexity_levels = io_ldac_encoder_complexity_levels,
+	.set_complexity = io_ldac_encoder_set_complexity,
+	.free = io_ldac_encoder_free,
+};
 
-			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+void *io_thread_a2dp_source_ldac(void *arg) {
+	return io_thread_a2dp_source_engine((struct ba_transport *)arg, &io_ldac_encoder);
+}
+#endif
 
-			coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
-			if (io_thread_write_bt(t, bt.data, ffb_len_out(&bt), &coutq_history[coutq_i]) == -1) {
-				if (errno == ECONNRESET || errno == ENOTCONN) {
-					/* exit thread upon BT socket disconnection */
-					debug("BT socket disconnected: %d", t->bt_fd);
-					goto fail;
-				}
-				error("BT socket write error: %s", strerror(errno));
-			}
+/**
+ * Codec frame found in the passthrough stream. */
+struct io_passthrough_frame {
+	/* number of bytes preceding the frame synchronization word */
+	size_t skip;
+	/* length of the frame header which is not transmitted */
+	size_t header;
+	/* total length of the frame (including the header) */
+	size_t len;
+	/* number of PCM frames carried by the codec frame */
+	unsigned int frames;
+};
 
-			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+/**
+ * Get the length of the SBC frame with the given header. */
+static size_t io_passthrough_sbc_frame(const uint8_t *h, unsigned int *frames) {
 
-			/* keep data transfer at a constant bit rate */
-			asrsync_sync(&asrs, pcm_frames);
+	if (h[0] != 0x9C)
+		return 0;
 
-			/* update busy delay (encoding overhead) */
-			t->delay = asrsync_get_busy_usec(&asrs) / 100;
+	const unsigned int blocks = 4 * (((h[1] >> 4) & 0x03) + 1);
+	const unsigned int mode = (h[1] >> 2) & 0x03;
+	const unsigned int subbands = h[1] & 0x01 ? 8 : 4;
+	const unsigned int channels = mode == 0 ? 1 : 2;
+	const unsigned int bitpool = h[2];
 
-			/* reinitialize output buffer */
-			ffb_rewind(&bt);
+	if (bitpool < SBC_MIN_BITPOOL)
+		return 0;
 
-		}
+	size_t len = 4 + 4 * subbands * channels / 8;
+	/* mono and dual channel modes code channels separately */
+	if (mode < 2)
+		len += (blocks * channels * bitpool + 7) / 8;
+	else
+		len += ((mode == 3 ? subbands : 0) + blocks * bitpool + 7) / 8;
 
-		/* If the input buffer was not consumed (due to codesize limit), we
-		 * have to append new data to the existing one. Since we do not use
-		 * ring buffer, we will simply move unprocessed data to the front
-		 * of our linear buffer. */
-		ffb_shift(&pcm, samples - input_len);
+	*frames = blocks * subbands;
+	return len;
+}
 
+/**
+ * Get the length of the MPEG-1,2 audio frame with the given header. */
+static size_t io_passthrough_mpeg_frame(const uint8_t *h, unsigned int *frames) {
+
+	static const uint16_t bitrates[5][16] = {
+		/* MPEG-1 layer I, II and III */
+		{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0 },
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0 },
+		{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },
+		/* MPEG-2 layer I, and layers II and III */
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0 },
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },
+	};
+	static const unsigned int samplings[] = { 44100, 48000, 32000, 0 };
+
+	if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0)
+		return 0;
+
+	/* version: 0 - MPEG-2.5, 2 - MPEG-2, 3 - MPEG-1; layer: 3 - I, 1 - III */
+	const unsigned int version = (h[1] >> 3) & 0x03;
+	const unsigned int layer = 4 - ((h[1] >> 1) & 0x03);
+	const unsigned int padding = (h[2] >> 1) & 0x01;
+
+	if (version == 1 || layer == 4)
+		return 0;
+
+	const unsigned int bitrate = 1000 * (version == 3 ?
+			bitrates[layer - 1][h[2] >> 4] : bitrates[layer == 1 ? 3 : 4][h[2] >> 4]);
+	unsigned int sampling = samplings[(h[2] >> 2) & 0x03];
+	if (version != 3)
+		sampling /= version == 2 ? 2 : 4;
+
+	/* free format bit rate is not supported */
+	if (bitrate == 0 || sampling == 0)
+		return 0;
+
+	switch (layer) {
+	case 1:
+		*frames = 384;
+		return (12 * bitrate / sampling + padding) * 4;
+	case 2:
+		*frames = 1152;
+		return 144 * bitrate / sampling + padding;
+	default:
+		*frames = version == 3 ? 1152 : 576;
+		return (version == 3 ? 144 : 72) * bitrate / sampling + padding;
 	}
 
-fail:
-final:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!locked);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	return NULL;
 }
-#endif
 
-#if ENABLE_LDAC
-void *io_thread_a2dp_source_ldac(void *arg) {
-	struct ba_transport *t = (struct ba_transport *)arg;
-	const a2dp_ldac_t *cconfig = (a2dp_ldac_t *)t->a2dp.cconfig;
+/**
+ * Get the length of the LOAS frame (AudioSyncStream) with the given header. */
+static size_t io_passthrough_loas_frame(const uint8_t *h, unsigned int *frames) {
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+	if (h[0] != 0x56 || (h[1] & 0xE0) != 0xE0)
+		return 0;
 
-	bool locked = !transport_pthread_cleanup_lock(t);
+	*frames = 1024;
+	return 3 + (((h[1] & 0x1F) << 8) | h[2]);
+}
 
-	HANDLE_LDAC_BT handle;
-	HANDLE_LDAC_ABR handle_abr;
+/**
+ * Find the next codec frame in the passthrough stream.
+ *
+ * SBC frames and MPEG-1,2 audio frames are transmitted as they are, while
+ * MPEG-2,4 AAC shall be framed with the LOAS synchronization layer, which
+ * is stripped - A2DP carries bare audioMuxElements.
+ *
+ * @param codec A2DP codec identifier.
+ * @param data Address of the stream data.
+ * @param len Length of the stream data.
+ * @param frame The address where the frame description will be stored.
+ *   The skip field is valid even if no frame has been found.
+ * @return If the whole frame is available, this function returns true. */
+static bool io_passthrough_frame(uint16_t codec, const uint8_t *data, size_t len,
+		struct io_passthrough_frame *frame) {
+
+	const size_t header = 4;
+	size_t i;
+
+	frame->header = codec == A2DP_CODEC_MPEG24 ? 3 : 0;
+
+	for (i = 0; i + header <= len; i++) {
+
+		size_t frame_len = 0;
+
+		switch (codec) {
+		case A2DP_CODEC_SBC:
+			frame_len = io_passthrough_sbc_frame(&data[i], &frame->frames);
+			break;
+		case A2DP_CODEC_MPEG12:
+			frame_len = io_passthrough_mpeg_frame(&data[i], &frame->frames);
+			break;
+		case A2DP_CODEC_MPEG24:
+			frame_len = io_passthrough_loas_frame(&data[i], &frame->frames);
+			break;
+		}
 
-	if ((handle = ldacBT_get_handle()) == NULL) {
-		error("Couldn't open LDAC encoder: %s", strerror(errno));
-		goto fail_open_ldac;
+		if (frame_len <= frame->header)
+			continue;
+
+		frame->skip = i;
+		frame->len = frame_len;
+		return i + frame_len <= len;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ldacBT_free_handle), handle);
+	frame->skip = i;
+	return false;
+}
 
-	if ((handle_abr = ldac_ABR_get_handle()) == NULL) {
-		error("Couldn't open LDAC ABR: %s", strerror(errno));
-		goto fail_open_ldac_abr;
-	}
+/**
+ * Write packets queued for the passthrough transfer.
+ *
+ * @return If the BT socket was disconnected, -1 is returned. */
+static int io_passthrough_commit(struct ba_transport *t, struct io_bt_queue *q) {
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ldac_ABR_free_handle), handle_abr);
+	if (q->len == 0)
+		return 0;
 
-	const unsigned int channels = transport_get_channels(t);
-	const unsigned int samplerate = transport_get_sampling(t);
-	const size_t ldac_pcm_samples = LDACBT_ENC_LSU * channels;
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-	if (ldacBT_init_handle_encode(handle, t->mtu_write - RTP_HEADER_LEN - sizeof(rtp_media_header_t),
-				config.ldac_eqmid, cconfig->channel_mode, LDACBT_SMPL_FMT_S16, samplerate) == -1) {
-		error("Couldn't initialize LDAC encoder: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
-		goto fail_init;
+	if (io_bt_queue_flush(q) == -1) {
+		if (errno == ECONNRESET || errno == ENOTCONN) {
+			/* exit thread upon BT socket disconnection */
+			debug("BT socket disconnected: %d", t->bt_fd);
+			return -1;
+		}
+		error("BT socket write error: %s", strerror(errno));
 	}
 
-	if (ldac_ABR_Init(handle_abr, 1000 * ldac_pcm_samples / channels / samplerate) == -1) {
-		error("Couldn't initialize LDAC ABR");
-		goto fail_init;
-	}
-	if (ldac_ABR_set_thresholds(handle_abr, 6, 4, 2) == -1) {
-		error("Couldn't set LDAC ABR thresholds");
-		goto fail_init;
-	}
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	return 0;
+}
+
+/**
+ * IO thread which transmits pre-encoded audio.
+ *
+ * The client writes codec frames (in the configuration reported by the
+ * controller), which are only packetized into the RTP and paced according
+ * to the number of PCM frames carried by them. */
+void *io_thread_a2dp_source_passthrough(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+
+	/* set when the transport is handed over to the other IO loop */
+	bool handover = false;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+
+	bool locked = !transport_pthread_cleanup_lock(t);
 
 	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
+	ffb_uint8_t pcm = { 0 };
+	struct io_bt_queue btq = { 0 };
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &pcm);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_bt_queue_free), &btq);
 
-	if (ffb_init(&pcm, ldac_pcm_samples) == NULL ||
-			ffb_init(&bt, t->mtu_write) == NULL) {
-		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+	const uint16_t codec = t->codec;
+	const unsigned int samplerate = transport_get_sampling(t);
+
+	/* The stream buffer shall fit the biggest frame supported by any codec,
+	 * which is the LOAS frame with 13-bit length field. */
+	if (ffb_uint8_init(&pcm, 2 * (3 + 0x1FFF)) == -1 ||
+			ffb_uint8_init(&bt, t->mtu_write) == -1 ||
+			io_bt_queue_init(&btq, t) == -1) {
+		error("Couldn't create data buffers: %s", strerror(errno));
 		goto fail_ffb;
 	}
 
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
 
 	rtp_header_t *rtp_header;
-	rtp_media_header_t *rtp_media_header;
+	rtp_media_header_t *rtp_media_header = NULL;
+	uint8_t *rtp_payload;
+
+	/* initialize RTP headers and get anchor for payload */
+	if (codec == A2DP_CODEC_SBC)
+		rtp_payload = io_thread_init_rtp(bt.data, &rtp_header, &rtp_media_header);
+	else
+		rtp_payload = io_thread_init_rtp(bt.data, &rtp_header, NULL);
+
+	/* MPEG audio payload header: 16 bits MBZ and the fragment offset */
+	uint8_t *rtp_mpa_header = rtp_payload;
+	if (codec == A2DP_CODEC_MPEG12) {
+		memset(rtp_mpa_header, 0, 4);
+		rtp_payload += 4;
+	}
 
-	/* initialize RTP headers and get anchor for payload */
-	bt.tail = io_thread_init_rtp(bt.data, &rtp_header, &rtp_media_header);
 	uint16_t seq_number = ntohs(rtp_header->seq_number);
 	uint32_t timestamp = ntohl(rtp_header->timestamp);
-	size_t ts_frames = 0;
-
-	/* number of queued bytes in the BT socket */
-	int coutq = 0;
+	const size_t payload_len_max = bt.data + t->mtu_write - rtp_payload;
 
-	int poll_timeout = -1;
-	struct asrsync asrs = { .frames = 0 };
+	/* transport might have been acquired ahead of the PCM open */
+	int poll_timeout = t->a2dp.pcm.fd == -1 ? t->a2dp.keep_alive * 1000 : -1;
+	struct asrsync asrs = { .frames = 0, .catchup = config.io_thread.catchup };
 	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
+		{ t->sig_fd, POLLIN, 0 },
 		{ -1, POLLIN, 0 },
 	};
 
 	transport_pthread_cleanup_unlock(t);
 	locked = false;
 
-	debug("Starting IO loop: %s (%s)",
+	debug("Starting IO loop: %s (%s passthrough)",
 			bluetooth_profile_to_string(t->profile),
 			bluetooth_a2dp_codec_to_string(t->codec));
 	for (;;) {
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-		ssize_t samples;
+		ssize_t len;
 
 		/* add PCM socket to the poll if transport is active */
 		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
 
 		switch (poll(pfds, ARRAYSIZE(pfds), poll_timeout)) {
 		case 0:
-			pthread_cond_signal(&t->a2dp.pcm.drained);
+			if (transport_pcm_drain_pending(&t->a2dp.pcm) &&
+					(io_thread_pcm_pending(&t->a2dp.pcm) || !io_bt_queue_drained(&btq)))
+				continue;
+			transport_pcm_drained(&t->a2dp.pcm);
 			poll_timeout = -1;
 			locked = !transport_pthread_cleanup_lock(t);
 			if (t->a2dp.pcm.fd == -1)
@@ -1388,31 +4612,42 @@ void *io_thread_a2dp_source_ldac(void *arg) {
 		}
 
 		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
-			switch (sig) {
-			case TRANSPORT_PCM_OPEN:
-			case TRANSPORT_PCM_RESUME:
-				poll_timeout = -1;
-				asrs.frames = 0;
-				break;
-			case TRANSPORT_PCM_CLOSE:
-				poll_timeout = config.a2dp.keep_alive * 1000;
-				break;
-			case TRANSPORT_PCM_SYNC:
-				poll_timeout = 100;
-				break;
-			default:
-				break;
-			}
+			/* dispatch incoming commands */
+			struct ba_transport_cmd cmd;
+			while (transport_recv_command(t, &cmd))
+				switch (cmd.sig) {
+				case TRANSPORT_PCM_OPEN:
+					/* PCM signal is served by the encoder IO loop */
+					if (t->a2dp.pcm.format != BA_PCM_FORMAT_ENCODED) {
+						/* remaining commands (e.g. the drain request) are
+						 * dispatched by the encoder IO loop */
+						transport_forward_commands(t);
+						handover = true;
+						goto final;
+					}
+					/* fall-through */
+				case TRANSPORT_PCM_RESUME:
+					poll_timeout = -1;
+					asrs.frames = 0;
+					ffb_rewind(&pcm);
+					break;
+				case TRANSPORT_PCM_CLOSE:
+					poll_timeout = t->a2dp.keep_alive * 1000;
+					break;
+				case TRANSPORT_PCM_SYNC:
+					poll_timeout = IO_THREAD_DRAIN_INTERVAL;
+					break;
+				default:
+					break;
+				}
 			continue;
 		}
 
 		/* read data from the FIFO - this function will block */
-		if ((samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) <= 0) {
-			if (samples == -1)
+		if ((len = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) <= 0) {
+			if (len == -1 && errno == EAGAIN)
+				continue;
+			if (len == -1)
 				error("FIFO read error: %s", strerror(errno));
 			goto fail;
 		}
@@ -1422,416 +4657,508 @@ void *io_thread_a2dp_source_ldac(void *arg) {
 		if (asrs.frames == 0)
 			asrsync_init(&asrs, samplerate);
 
-		if (!config.a2dp.volume)
-			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+		ffb_seek(&pcm, len);
 
-		/* get overall number of input samples */
-		ffb_seek(&pcm, samples);
-		samples = ffb_len_out(&pcm);
+		struct io_passthrough_frame frame;
+		for (;;) {
 
-		int16_t *input = pcm.data;
-		size_t input_len = samples;
+			unsigned int pcm_frames = 0;
+			size_t codec_frames = 0;
+			size_t payload_len = 0;
 
-		/* encode and transfer obtained data */
-		while (input_len >= ldac_pcm_samples) {
+			/* Pack as many frames as possible into the RTP packet. Only one
+			 * audioMuxElement is sent per packet, though. */
+			while (io_passthrough_frame(codec, pcm.head, ffb_len_out(&pcm), &frame)) {
 
-			int len;
-			int encoded;
-			int frames;
+				const size_t frame_len = frame.len - frame.header;
 
-			if (ldacBT_encode(handle, input, &len, bt.tail, &encoded, &frames) != 0) {
-				error("LDAC encoding error: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
-				break;
-			}
+				if (codec_frames > 0 && (payload_len + frame_len > payload_len_max ||
+							codec == A2DP_CODEC_MPEG24 || codec_frames == 15))
+					break;
 
-			rtp_media_header->frame_count = frames;
+				if (frame.skip > 0)
+					debug("Skipping passthrough stream garbage: %zu", frame.skip);
+
+				/* SBC frame can not be fragmented */
+				if (codec == A2DP_CODEC_SBC && frame_len > payload_len_max) {
+					warn("SBC frame too big for writing MTU: %zu > %zu", frame_len, payload_len_max);
+					ffb_shift(&pcm, frame.skip + frame.len);
+					continue;
+				}
 
-			frames = len / sizeof(int16_t);
-			input += frames;
-			input_len -= frames;
+				/* the payload buffer is extended by the stream buffer */
+				if (payload_len + frame_len <= payload_len_max)
+					memcpy(rtp_payload + payload_len, pcm.head + frame.skip + frame.header, frame_len);
 
-			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+				payload_len += frame_len;
+				pcm_frames += frame.frames;
+				codec_frames++;
 
-			if (encoded &&
-					io_thread_write_bt(t, bt.data, ffb_len_out(&bt) + encoded, &coutq) == -1) {
-				if (errno == ECONNRESET || errno == ENOTCONN) {
-					/* exit thread upon BT socket disconnection */
-					debug("BT socket disconnected: %d", t->bt_fd);
-					goto fail;
+				/* frame which exceeds the MTU is sent right from the stream */
+				if (payload_len > payload_len_max)
+					break;
+
+				ffb_shift(&pcm, frame.skip + frame.len);
+
+			}
+
+			if (codec_frames == 0) {
+				/* drop garbage, but keep the beginning of the next frame */
+				ffb_shift(&pcm, frame.skip);
+				/* if there is no space left, the stream is corrupted */
+				if (ffb_len_in(&pcm) == 0) {
+					warn("Invalid passthrough stream: %s", "No frame found");
+					ffb_rewind(&pcm);
 				}
-				error("BT socket write error: %s", strerror(errno));
+				break;
 			}
 
-			if (config.ldac_abr)
-				ldac_ABR_Proc(handle, handle_abr, coutq / t->mtu_write, 1);
+			const uint8_t *payload = rtp_payload;
+			size_t offset = 0;
 
-			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			if (payload_len > payload_len_max) {
+				/* oversized frame is still at the head of the stream buffer */
+				payload = pcm.head + frame.skip + frame.header;
+				ffb_shift(&pcm, frame.skip + frame.len);
+			}
 
-			/* keep data transfer at a constant bit rate */
-			asrsync_sync(&asrs, frames / channels);
-			ts_frames += frames;
+			rtp_header->timestamp = htonl(timestamp);
+			if (rtp_media_header != NULL)
+				rtp_media_header->frame_count = codec_frames;
 
-			/* update busy delay (encoding overhead) */
-			t->delay = asrsync_get_busy_usec(&asrs) / 100;
+			/* Fragmentation of the MPEG audio frame is signaled with the offset
+			 * in the payload header, while the fragmentation of the AAC audio
+			 * element is signaled with the mark bit of the last fragment. */
+			while (offset < payload_len) {
+
+				const size_t len = MIN(payload_len - offset, payload_len_max);
+
+				if (payload != rtp_payload)
+					memcpy(rtp_payload, payload + offset, len);
+				if (codec == A2DP_CODEC_MPEG12) {
+					rtp_mpa_header[2] = offset >> 8;
+					rtp_mpa_header[3] = offset;
+				}
 
-			if (encoded) {
-				timestamp += ts_frames / channels * 10000 / samplerate;
-				rtp_header->timestamp = htonl(timestamp);
+				rtp_header->markbit = offset + len == payload_len;
 				rtp_header->seq_number = htons(++seq_number);
-				ts_frames = 0;
+				bt.tail = rtp_payload + len;
+				offset += len;
+
+				pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+				if (io_bt_queue_push(&btq, bt.data, ffb_len_out(&bt)) == -1) {
+					if (errno == ECONNRESET || errno == ENOTCONN) {
+						/* exit thread upon BT socket disconnection */
+						debug("BT socket disconnected: %d", t->bt_fd);
+						goto fail;
+					}
+					error("BT socket write error: %s", strerror(errno));
+				}
+
+				pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
 			}
 
+			/* write queued packets before waiting for the deadline */
+			if (!asrsync_is_overdue(&asrs, pcm_frames) &&
+					io_passthrough_commit(t, &btq) == -1)
+				goto fail;
+
+			/* keep data transfer at a constant bit rate, also
+			 * get a timestamp for the next RTP frame */
+			io_thread_asrsync(t, &asrs, pcm_frames);
+			timestamp += pcm_frames * 10000 / samplerate;
+
+			/* update busy delay (packetization overhead) */
+			t->delay = asrsync_get_busy_usec(&asrs) / 100;
+
+			ffb_rewind(&bt);
+
 		}
 
-		/* If the input buffer was not consumed (due to codesize limit), we
-		 * have to append new data to the existing one. Since we do not use
-		 * ring buffer, we will simply move unprocessed data to the front
-		 * of our linear buffer. */
-		ffb_shift(&pcm, samples - input_len);
+		if (io_passthrough_commit(t, &btq) == -1)
+			goto fail;
 
 	}
 
 fail:
 final:
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(!locked);
+	pthread_cleanup_pop(!locked && !handover);
 fail_ffb:
 	pthread_cleanup_pop(1);
 	pthread_cleanup_pop(1);
-fail_init:
-	pthread_cleanup_pop(1);
-fail_open_ldac_abr:
-	pthread_cleanup_pop(1);
-fail_open_ldac:
 	pthread_cleanup_pop(1);
-	return NULL;
+	pthread_cleanup_pop(!handover);
+	return handover ? IO_THREAD_HANDOVER : NULL;
 }
-#endif
 
-void *io_thread_sco(void *arg) {
+/**
+ * IO thread of the A2DP source, which can be fed with the encoded data.
+ *
+ * Depending on the format negotiated upon the PCM open, either the encoder
+ * IO loop or the passthrough one is run. These loops hand over the transport
+ * to each other, whenever the PCM is opened in the other format. */
+void *io_thread_a2dp_source_dispatch(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+	void *ret;
+	do {
+		if (t->a2dp.encoder == NULL ||
+				t->a2dp.pcm.format == BA_PCM_FORMAT_ENCODED)
+			ret = io_thread_a2dp_source_passthrough(t);
+		else
+			ret = t->a2dp.encoder(t);
+	} while (ret == IO_THREAD_HANDOVER);
 
-	/* buffers for transferring data to and from SCO socket */
-	ffb_uint8_t bt_in = { 0 };
-	ffb_uint8_t bt_out = { 0 };
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt_in);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt_out);
-
-	/* these buffers shall be bigger than the SCO MTU */
-	if (ffb_init(&bt_in, 128) == NULL ||
-		ffb_init(&bt_out, 128) == NULL) {
-		error("Couldn't create data buffer: %s", strerror(ENOMEM));
-		goto fail_ffb;
+	return NULL;
+}
+
+/**
+ * Receive all pending SCO packets.
+ *
+ * Packets are received in batches and stored in the buffer one after
+ * another, so several packets might be moved to the PCM FIFO at once.
+ *
+ * @param fd SCO socket file descriptor.
+ * @param buffer Address of the buffer for the incoming data.
+ * @param mtu The reading MTU of the SCO socket.
+ * @return Upon success this function returns the number of received bytes.
+ *   If there is no more data pending or there is no space in the buffer,
+ *   zero is returned. Otherwise, -1 is returned and errno is set
+ *   appropriately. Disconnection of the SCO link is reported as an error
+ *   with the ECONNRESET errno value. */
+static ssize_t io_thread_sco_recv(int fd, ffb_uint8_t *buffer, size_t mtu) {
+
+	struct mmsghdr msgs[IO_THREAD_BT_QUEUE_SIZE];
+	struct iovec iov[IO_THREAD_BT_QUEUE_SIZE];
+	size_t count = ffb_len_in(buffer) / mtu;
+	size_t len = 0;
+	size_t i;
+	int ret;
+
+	if (count > ARRAYSIZE(msgs))
+		count = ARRAYSIZE(msgs);
+	if (count == 0)
+		return 0;
+
+	memset(msgs, 0, count * sizeof(*msgs));
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = buffer->tail + i * mtu;
+		iov[i].iov_len = mtu;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
 
-	int poll_timeout = -1;
-	struct asrsync asrs = { .frames = 0 };
-	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
-		/* SCO socket */
-		{ -1, POLLIN, 0 },
-		{ -1, POLLOUT, 0 },
-		/* PCM FIFO */
-		{ -1, POLLIN, 0 },
-		{ -1, POLLOUT, 0 },
-	};
+	while ((ret = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL)) == -1 && errno == EINTR)
+		continue;
+	if (ret == -1)
+		return errno == EAGAIN ? 0 : -1;
 
-	debug("Starting IO loop: %s",
-			bluetooth_profile_to_string(t->profile));
-	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	for (i = 0; i < (size_t)ret; i++) {
+		if (msgs[i].msg_len == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		/* close gaps left by packets shorter than the MTU */
+		if (buffer->tail + len != iov[i].iov_base)
+			memmove(buffer->tail + len, iov[i].iov_base, msgs[i].msg_len);
+		len += msgs[i].msg_len;
+	}
+
+	ffb_seek(buffer, len);
+	return len;
+}
 
-		/* fresh-start for file descriptors polling */
-		pfds[1].fd = pfds[2].fd = -1;
-		pfds[3].fd = pfds[4].fd = -1;
+/**
+ * Close the file descriptor if it is valid. */
+static void io_thread_close_fd(int *fd) {
+	if (*fd != -1)
+		close(*fd);
+	*fd = -1;
+}
 
-		switch (t->codec) {
-		case HFP_CODEC_CVSD:
-		default:
-			if (t->mtu_read > 0 && ffb_len_in(&bt_in) >= t->mtu_read)
-				pfds[1].fd = t->bt_fd;
-			if (t->mtu_write > 0 && ffb_len_out(&bt_out) >= t->mtu_write)
-				pfds[2].fd = t->bt_fd;
-			if (t->mtu_write > 0 && ffb_len_in(&bt_out) >= t->mtu_write)
-				pfds[3].fd = t->sco.spk_pcm.fd;
-			if (ffb_len_out(&bt_in) > 0)
-				pfds[4].fd = t->sco.mic_pcm.fd;
-		}
+/**
+ * The state of the SCO transfer. */
+struct io_sco {
 
-		if (t->sco.mic_pcm.fd == -1)
-			pfds[1].fd = -1;
+	struct ba_transport *t;
 
-		switch (poll(pfds, ARRAYSIZE(pfds), poll_timeout)) {
-		case 0:
-			pthread_cond_signal(&t->sco.spk_pcm.drained);
-			poll_timeout = -1;
-			continue;
-		case -1:
-			if (errno == EINTR)
-				continue;
-			error("Transport poll error: %s", strerror(errno));
-			goto fail;
+	/* buffers for transferring data to and from SCO socket */
+	ffb_uint8_t bt_in;
+	ffb_uint8_t bt_out;
+	struct io_bt_queue btq;
+
+	/* transfer period timer */
+	int timer_fd;
+
+	/* The size of the transfer period (in bytes) and its duration, which are
+	 * determined by the SCO MTU. The period is set up when the SCO link is
+	 * acquired, and it is reset (zeroed) upon the link release. */
+	size_t period;
+	unsigned int period_usec;
+	/* the number of bytes transfered per second */
+	size_t rate;
+
+};
+
+static void io_sco_free(struct io_sco *io) {
+	ffb_uint8_free(&io->bt_in);
+	ffb_uint8_free(&io->bt_out);
+	io_bt_queue_free(&io->btq);
+}
+
+/**
+ * Update the transfer state according to the SCO link state.
+ *
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int io_sco_update(struct io_sco *io) {
+
+	struct ba_transport *t = io->t;
+
+	/* Speaker PCM is drained, when there is no more data in the FIFO and
+	 * the remaining data can not fill the SCO packet. */
+	if (transport_pcm_drain_pending(&t->sco.spk_pcm) &&
+			!io_thread_pcm_pending(&t->sco.spk_pcm) &&
+			(t->bt_fd == -1 || ffb_len_out(&io->bt_out) < t->mtu_write))
+		transport_pcm_drained(&t->sco.spk_pcm);
+
+	if (t->bt_fd != -1 && io->period == 0) {
+		/* set up transfer period for the new SCO link */
+
+		struct itimerspec ts = { 0 };
+		size_t packets;
+		int coutq = 0;
+
+		io->rate = transport_get_sampling(t) * sizeof(int16_t);
+		if ((packets = config.hfp.sco_period * io->rate / 1000 / t->mtu_write) == 0)
+			packets = 1;
+		io->period = packets * t->mtu_write;
+		io->period_usec = io->period * 1000000 / io->rate;
+
+		/* Buffers shall hold several periods, so the jitter of the PCM
+		 * client will not stall the SCO link. The incoming buffer has to
+		 * have a space for one additional SCO packet. */
+		io_bt_queue_free(&io->btq);
+		if (ffb_uint8_init(&io->bt_in, IO_THREAD_SCO_PERIODS * io->period + t->mtu_read) == -1 ||
+				ffb_uint8_init(&io->bt_out, IO_THREAD_SCO_PERIODS * io->period) == -1 ||
+				io_bt_queue_init_fd(&io->btq, t, t->bt_fd, t->mtu_write, 0) == -1) {
+			error("Couldn't create data buffer: %s", strerror(errno));
+			return -1;
 		}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		ffb_rewind(&io->bt_in);
+		ffb_rewind(&io->bt_out);
+		if (ioctl(t->bt_fd, TIOCOUTQ, &coutq) != -1)
+			io->btq.fd_coutq_init = coutq;
+		/* SCO link is isochronous - it is better to drop audio than to
+		 * delay the microphone signal when the link is congested. */
+		io->btq.drop = true;
 
-		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
-
-			/* FIXME: Drain functionality for speaker.
-			 * XXX: Right now it is not possible to drain speaker PCM (in a clean
-			 *      fashion), because poll() will not timeout if we've got incoming
-			 *      data from the microphone (BT SCO socket). In order not to hang
-			 *      forever in the transport_drain_pcm() function, we will signal
-			 *      PCM drain right now. */
-			if (sig == TRANSPORT_PCM_SYNC)
-				pthread_cond_signal(&t->sco.spk_pcm.drained);
-
-			const enum hfp_ind *inds = t->sco.rfcomm->rfcomm.hfp_inds;
-			bool release = false;
-
-			/* It is required to release SCO if we are not transferring audio,
-			 * because it will free Bluetooth bandwidth - microphone signal is
-			 * transfered even though we are not reading from it! */
-			if (t->sco.spk_pcm.fd == -1 && t->sco.mic_pcm.fd == -1)
-				release = true;
-
-			if (!t->sco.is_ofono) {
-				/* For HFP HF we have to check if we are in the call stage or in the
-				 * call setup stage. Otherwise, it might be not possible to acquire
-				 * SCO connection. */
-				if (t->profile == BLUETOOTH_PROFILE_HFP_HF &&
-						inds[HFP_IND_CALL] == HFP_IND_CALL_NONE &&
-						inds[HFP_IND_CALLSETUP] == HFP_IND_CALLSETUP_NONE)
-					release = true;
-			}
+		ts.it_value.tv_sec = ts.it_interval.tv_sec = io->period_usec / 1000000;
+		ts.it_value.tv_nsec = ts.it_interval.tv_nsec = io->period_usec % 1000000 * 1000;
+		timerfd_settime(io->timer_fd, 0, &ts, NULL);
 
-			if (release) {
-				transport_release_bt_sco(t);
-				asrs.frames = 0;
-			}
-			else
-				transport_acquire_bt_sco(t);
+		debug("SCO transfer period: %zu bytes (%u us)", io->period, io->period_usec);
 
-			continue;
-		}
+	}
+	else if (t->bt_fd == -1 && io->period != 0) {
+		/* disarm the timer - there is nothing to transfer */
+		const struct itimerspec ts = { 0 };
+		timerfd_settime(io->timer_fd, 0, &ts, NULL);
+		io->period = 0;
+	}
 
-		if (asrs.frames == 0)
-			asrsync_init(&asrs, transport_get_sampling(t));
+	return 0;
+}
 
-		if (pfds[1].revents & POLLIN) {
-			/* dispatch incoming SCO data */
+/**
+ * Dispatch incoming commands and acquire or release the SCO link. */
+static void io_sco_signal(struct ba_transport *t) {
 
-			uint8_t *buffer;
-			size_t buffer_len;
-			ssize_t len;
+	struct ba_transport_cmd cmd;
+	while (transport_recv_command(t, &cmd))
+		continue;
 
-			switch (t->codec) {
-			case HFP_CODEC_CVSD:
-			default:
-				buffer = bt_in.tail;
-				buffer_len = ffb_len_in(&bt_in);
-			}
+	const enum hfp_ind *inds = t->sco.rfcomm->rfcomm.hfp_inds;
+	bool release = false;
+
+	/* For oFono cards, the call state is tracked by the oFono backend,
+	 * otherwise we have to check the HFP indicators. */
+	if (!t->sco.is_ofono && t->profile == BLUETOOTH_PROFILE_HFP_HF)
+		t->sco.preconnect = inds[HFP_IND_CALLSETUP] != HFP_IND_CALLSETUP_NONE;
+
+	/* It is required to release SCO if we are not transferring audio,
+	 * because it will free Bluetooth bandwidth - microphone signal is
+	 * transfered even though we are not reading from it! However, it
+	 * is worth to pay this price while the call is being set up, so
+	 * the audio will be available right after the call is answered. */
+	if (t->sco.spk_pcm.fd == -1 && t->sco.mic_pcm.fd == -1 &&
+			!(config.hfp.sco_preconnect && t->sco.preconnect))
+		release = true;
+
+	if (!t->sco.is_ofono) {
+		/* For HFP HF we have to check if we are in the call stage or in the
+		 * call setup stage. Otherwise, it might be not possible to acquire
+		 * SCO connection. */
+		if (t->profile == BLUETOOTH_PROFILE_HFP_HF &&
+				inds[HFP_IND_CALL] == HFP_IND_CALL_NONE &&
+				inds[HFP_IND_CALLSETUP] == HFP_IND_CALLSETUP_NONE)
+			release = true;
+	}
 
-retry_sco_read:
-			errno = 0;
-			if ((len = read(pfds[1].fd, buffer, buffer_len)) <= 0)
-				switch (errno) {
-				case EINTR:
-					goto retry_sco_read;
-				case 0:
-				case ECONNABORTED:
-				case ECONNRESET:
-					transport_release_bt_sco(t);
-					continue;
-				default:
-					error("SCO read error: %s", strerror(errno));
-					continue;
-				}
+	if (release)
+		transport_release_bt_sco(t);
+	else
+		transport_acquire_bt_sco(t);
 
-			switch (t->codec) {
-			case HFP_CODEC_CVSD:
-			default:
-				ffb_seek(&bt_in, len);
-			}
+}
 
-		}
-		else if (pfds[1].revents & (POLLERR | POLLHUP)) {
-			debug("SCO poll error status: %#x", pfds[1].revents);
+/**
+ * Transfer audio for all elapsed periods. */
+static void io_sco_transfer(struct io_sco *io, uint64_t expirations) {
+
+	struct ba_transport *t = io->t;
+	const size_t period = io->period;
+
+	if (period == 0)
+		return;
+
+	/* If we were not scheduled on time, we will try to catch up, but no
+	 * more than the buffered audio allows. */
+	if (expirations > 1)
+		t->stats.sync_skipped += (expirations - 1) * io->period_usec;
+	if (expirations > IO_THREAD_SCO_PERIODS)
+		expirations = IO_THREAD_SCO_PERIODS;
+
+	ssize_t len;
+	/* batch of packets is captured as a single record */
+	while ((len = io_thread_sco_recv(t->bt_fd, &io->bt_in, t->mtu_read)) > 0) {
+		io_thread_capture(t, CAPTURE_TYPE_BT_IN, io->bt_in.tail - len, len);
+		t->stats.bt_bytes += len;
+	}
+	if (len == -1)
+		switch (errno) {
+		case ECONNABORTED:
+		case ECONNRESET:
+		case ENOTCONN:
 			transport_release_bt_sco(t);
+			return;
+		default:
+			error("SCO read error: %s", strerror(errno));
 		}
 
-		if (pfds[2].revents & POLLOUT) {
-			/* write-out SCO data */
+	if (t->sco.mic_pcm.fd == -1)
+		/* there is no one to receive the microphone signal */
+		ffb_rewind(&io->bt_in);
 
-			uint8_t *buffer;
-			size_t buffer_len;
-			ssize_t len;
+	/* Write-out microphone signal in period-sized chunks. The POLLOUT event
+	 * guarantees that the FIFO write will not block only for up to PIPE_BUF
+	 * bytes, so the chunk must not exceed that limit. */
+	const size_t chunk = MIN(period, PIPE_BUF / sizeof(int16_t) * sizeof(int16_t));
+	while (ffb_len_out(&io->bt_in) >= chunk &&
+			io_thread_pcm_writable(&t->sco.mic_pcm, chunk / sizeof(int16_t))) {
 
-			switch (t->codec) {
-			case HFP_CODEC_CVSD:
-			default:
-				buffer = bt_out.data;
-				buffer_len = t->mtu_write;
-			}
+		int16_t *buffer = (int16_t *)io->bt_in.head;
+		const size_t samples = chunk / sizeof(int16_t);
 
-retry_sco_write:
-			errno = 0;
-			if ((len = write(pfds[2].fd, buffer, buffer_len)) <= 0)
-				switch (errno) {
-				case EINTR:
-					goto retry_sco_write;
-				case 0:
-				case ECONNABORTED:
-				case ECONNRESET:
-					transport_release_bt_sco(t);
-					continue;
-				default:
-					error("SCO write error: %s", strerror(errno));
-					continue;
-				}
+		if (t->sco.mic_muted)
+			snd_pcm_scale_s16le(buffer, samples, 1, 0, 0);
 
-			switch (t->codec) {
-			case HFP_CODEC_CVSD:
-			default:
-				ffb_shift(&bt_out, len);
-			}
+		if (io_thread_write_pcm(&t->sco.mic_pcm, buffer, samples) == -1)
+			error("FIFO write error: %s", strerror(errno));
 
-		}
+		ffb_shift(&io->bt_in, chunk);
 
-		if (pfds[3].revents & POLLIN) {
-			/* dispatch incoming PCM data */
+	}
 
-			int16_t *buffer;
-			ssize_t samples;
+	/* In case when the client is not keeping up, the oldest audio is
+	 * dropped, so the buffer will have a space for the incoming data. */
+	if (ffb_len_out(&io->bt_in) >= IO_THREAD_SCO_PERIODS * period)
+		ffb_shift(&io->bt_in, period);
 
-			switch (t->codec) {
-			case HFP_CODEC_CVSD:
-			default:
-				buffer = (int16_t *)bt_out.tail;
-				samples = ffb_len_in(&bt_out) / sizeof(int16_t);
-			}
+	if (io_thread_pcm_pending(&t->sco.spk_pcm) &&
+			ffb_len_in(&io->bt_out) >= sizeof(int16_t)) {
+		/* dispatch incoming PCM data - pending data will not block */
 
-			/* read data from the FIFO - this function will block */
-			if ((samples = io_thread_read_pcm(&t->sco.spk_pcm, buffer, samples)) <= 0) {
-				if (samples == -1)
-					error("FIFO read error: %s", strerror(errno));
-				continue;
-			}
+		int16_t *buffer = (int16_t *)io->bt_out.tail;
+		ssize_t samples = ffb_len_in(&io->bt_out) / sizeof(int16_t);
 
+		if ((samples = io_thread_read_pcm(&t->sco.spk_pcm, buffer, samples)) > 0) {
 			if (t->sco.spk_muted)
 				snd_pcm_scale_s16le(buffer, samples, 1, 0, 0);
-
-			switch (t->codec) {
-			case HFP_CODEC_CVSD:
-			default:
-				ffb_seek(&bt_out, samples * sizeof(int16_t));
-			}
-
+			ffb_seek(&io->bt_out, samples * sizeof(int16_t));
 		}
-		else if (pfds[3].revents & (POLLERR | POLLHUP)) {
-			debug("PCM poll error status: %#x", pfds[3].revents);
-			close(t->sco.spk_pcm.fd);
-			t->sco.spk_pcm.fd = -1;
-		}
-
-		if (pfds[4].revents & POLLOUT) {
-			/* write-out PCM data */
+		else if (samples == -1 && errno != EAGAIN)
+			error("FIFO read error: %s", strerror(errno));
 
-			int16_t *buffer;
-			ssize_t samples;
-
-			switch (t->codec) {
-			case HFP_CODEC_CVSD:
-			default:
-				buffer = (int16_t *)bt_in.data;
-				samples = ffb_len_out(&bt_in) / sizeof(int16_t);
-			}
-
-			if (t->sco.mic_muted)
-				snd_pcm_scale_s16le(buffer, samples, 1, 0, 0);
+	}
 
-			if (io_thread_write_pcm(&t->sco.mic_pcm, buffer, samples) == -1)
-				error("FIFO write error: %s", strerror(errno));
+	/* write-out speaker signal for all elapsed periods */
+	size_t packets = expirations * period / t->mtu_write;
+	unsigned int frames = 0;
+	while (packets > 0 && ffb_len_out(&io->bt_out) >= t->mtu_write) {
+		if (io_bt_queue_push(&io->btq, io->bt_out.head, t->mtu_write) == -1)
+			break;
+		ffb_shift(&io->bt_out, t->mtu_write);
+		frames += t->mtu_write / sizeof(int16_t);
+		packets--;
+	}
 
-			switch (t->codec) {
-			case HFP_CODEC_CVSD:
-			default:
-				ffb_shift(&bt_in, samples * sizeof(int16_t));
-			}
+	if (packets > 0 && t->sco.spk_pcm.fd != -1)
+		t->stats.pcm_underruns++;
 
+	if (io->btq.len > 0 && io_bt_queue_flush(&io->btq) == -1)
+		switch (errno) {
+		case ECONNABORTED:
+		case ECONNRESET:
+		case ENOTCONN:
+			transport_release_bt_sco(t);
+			return;
+		default:
+			error("SCO write error: %s", strerror(errno));
 		}
 
-		/* keep data transfer at a constant bit rate */
-		asrsync_sync(&asrs, 48 / 2);
-		/* update busy delay (encoding overhead) */
-		t->delay = asrsync_get_busy_usec(&asrs) / 100;
-
-	}
+	/* delay of the audio buffered for the transmission */
+	t->delay = (io->period_usec + ffb_len_out(&io->bt_out) * 1000000 / io->rate) / 100;
+	io_thread_pcm_status(t, &t->sco.spk_pcm, frames);
 
-fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-fail_ffb:
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	return NULL;
 }
 
-#ifdef DEBUG
-/**
- * Dump incoming BT data to a file. */
-void *io_thread_a2dp_sink_dump(void *arg) {
+void *io_thread_sco(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
 
-	ffb_uint8_t bt = { 0 };
-	FILE *f = NULL;
-	char fname[64];
-	char *ptr;
-
-	sprintf(fname, "/tmp/ba-%s-%s.dump",
-			bluetooth_profile_to_string(t->profile),
-			bluetooth_a2dp_codec_to_string(t->codec));
-	for (ptr = fname; *ptr != '\0'; ptr++) {
-		*ptr = tolower(*ptr);
-		if (*ptr == ' ')
-			*ptr = '-';
-	}
-
-	debug("Opening BT dump file: %s", fname);
-	if ((f = fopen(fname, "wb")) == NULL) {
-		error("Couldn't create dump file: %s", strerror(errno));
-		goto fail_open;
-	}
+	struct io_sco io = { .t = t, .btq = { .data = NULL }, .timer_fd = -1 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_sco_free), &io);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_thread_close_fd), &io.timer_fd);
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(fclose), f);
-
-	if (ffb_init(&bt, t->mtu_read) == NULL) {
-		error("Couldn't create data buffer: %s", strerror(ENOMEM));
-		goto fail_ffb;
+	if ((io.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		error("Couldn't create transfer timer: %s", strerror(errno));
+		goto fail_timer;
 	}
 
 	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
-		{ t->bt_fd, POLLIN, 0 },
+		{ t->sig_fd, POLLIN, 0 },
+		{ io.timer_fd, POLLIN, 0 },
+		/* pending SCO connection */
+		{ -1, POLLOUT, 0 },
 	};
 
+	debug("Starting IO loop: %s",
+			bluetooth_profile_to_string(t->profile));
 	for (;;) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-		ssize_t len;
+		if (io_sco_update(&io) == -1)
+			goto fail;
+
+		pfds[2].fd = t->sco.connect_fd;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
 		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1) {
 			if (errno == EINTR)
@@ -1840,28 +5167,160 @@ void *io_thread_a2dp_sink_dump(void *arg) {
 			goto fail;
 		}
 
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
 		if (pfds[0].revents & POLLIN) {
-			if (read(pfds[0].fd, bt.data, ffb_blen_in(&bt)) == -1)
-				warn("Couldn't read signal: %s", strerror(errno));
+			io_sco_signal(t);
 			continue;
 		}
 
-		if ((len = read(pfds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
-			debug("BT read error: %s", strerror(errno));
+		if (pfds[2].revents & (POLLOUT | POLLERR | POLLHUP)) {
+			/* pending SCO connection has been completed (or it has failed) */
+			transport_acquire_bt_sco_complete(t);
 			continue;
 		}
 
-		debug("BT read: %zd", len);
-		fwrite(bt.data, 1, len, f);
+		uint64_t expirations = 0;
+		if (!(pfds[1].revents & POLLIN) ||
+				read(io.timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+			continue;
+
+		io_sco_transfer(&io, expirations);
+
 	}
 
 fail:
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-fail_ffb:
+fail_timer:
 	pthread_cleanup_pop(1);
 	pthread_cleanup_pop(1);
-fail_open:
 	pthread_cleanup_pop(1);
 	return NULL;
 }
-#endif
+
+/**
+ * The state of the SCO transfer driven by the IO engine. */
+struct io_engine_sco {
+	struct io_sco io;
+	struct io_engine_watch sig_watch;
+	struct io_engine_watch connect_watch;
+	struct io_engine_timer timer;
+};
+
+/**
+ * Synchronize the task with the SCO link state - this function shall be
+ * called at the end of every task callback. */
+static void io_engine_sco_update(struct io_engine_sco *sco, struct io_engine_task *task) {
+	if (io_sco_update(&sco->io) == -1) {
+		io_engine_task_stop(task);
+		return;
+	}
+	if (io_engine_watch_set_fd(&sco->connect_watch, sco->io.t->sco.connect_fd) == -1)
+		error("Couldn't watch SCO connection: %s", strerror(errno));
+}
+
+static void io_engine_sco_sig(struct io_engine_watch *watch, uint32_t events) {
+	struct io_engine_sco *sco = watch->task->userdata;
+	(void)events;
+	io_sco_signal(sco->io.t);
+	io_engine_sco_update(sco, watch->task);
+}
+
+static void io_engine_sco_connect(struct io_engine_watch *watch, uint32_t events) {
+	struct io_engine_sco *sco = watch->task->userdata;
+	(void)events;
+	/* pending SCO connection has been completed (or it has failed) */
+	transport_acquire_bt_sco_complete(sco->io.t);
+	io_engine_sco_update(sco, watch->task);
+}
+
+static void io_engine_sco_timer(struct io_engine_timer *timer, uint64_t expirations) {
+	struct io_engine_sco *sco = timer->watch.task->userdata;
+	io_sco_transfer(&sco->io, expirations);
+	io_engine_sco_update(sco, timer->watch.task);
+}
+
+static void io_engine_sco_free(struct io_engine_sco *sco) {
+	io_sco_free(&sco->io);
+	io_engine_timer_free(&sco->timer);
+	free(sco);
+}
+
+static void io_engine_sco_cleanup(struct io_engine_task *task) {
+	struct io_engine_sco *sco = task->userdata;
+	struct ba_transport *t = sco->io.t;
+
+	io_engine_sco_free(sco);
+	task->userdata = NULL;
+
+	t->sco.mic_pcm.nonblock = false;
+	io_engine_transport_release(t);
+}
+
+/**
+ * Start SCO transfer as an IO engine task.
+ *
+ * This is an equivalent of the io_thread_sco() thread, which is served by
+ * the IO engine worker instead of a dedicated thread.
+ *
+ * @param t Transport structure.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned. */
+int io_engine_sco(struct ba_transport *t) {
+
+	struct io_engine_sco *sco;
+
+	if ((sco = calloc(1, sizeof(*sco))) == NULL) {
+		error("Couldn't create IO task: %s", strerror(errno));
+		return -1;
+	}
+
+	sco->io.t = t;
+
+	if (io_engine_timer_init(&sco->timer, io_engine_sco_timer) == -1) {
+		error("Couldn't create transfer timer: %s", strerror(errno));
+		free(sco);
+		return -1;
+	}
+
+	/* Set up the transfer state right away, in case when the SCO link has
+	 * been acquired before the task start. */
+	sco->io.timer_fd = sco->timer.watch.fd;
+	if (io_sco_update(&sco->io) == -1)
+		goto fail;
+
+	sco->sig_watch.fd = t->sig_fd;
+	sco->sig_watch.events = EPOLLIN;
+	sco->sig_watch.callback = io_engine_sco_sig;
+
+	/* pending SCO connection */
+	sco->connect_watch.fd = t->sco.connect_fd;
+	sco->connect_watch.events = EPOLLOUT;
+	sco->connect_watch.callback = io_engine_sco_connect;
+
+	t->task.watches = NULL;
+	t->task.cleanup = io_engine_sco_cleanup;
+	t->task.userdata = sco;
+	io_engine_task_add_watch(&t->task, &sco->sig_watch);
+	io_engine_task_add_watch(&t->task, &sco->connect_watch);
+	io_engine_task_add_watch(&t->task, &sco->timer.watch);
+
+	/* the shared worker shall never block on the PCM write */
+	t->sco.mic_pcm.nonblock = true;
+
+	if (io_engine_task_start(&t->task) == -1) {
+		error("Couldn't start IO task: %s", strerror(errno));
+		t->sco.mic_pcm.nonblock = false;
+		t->task.watches = NULL;
+		t->task.userdata = NULL;
+		goto fail;
+	}
+
+	debug("Starting IO task: %s",
+			bluetooth_profile_to_string(t->profile));
+	return 0;
+
+fail:
+	io_engine_sco_free(sco);
+	return -1;
+}
+
@@ -15,10 +15,37 @@
 # include "config.h"
 #endif
 
-/* The number of snapshots of BT socket COUTQ bytes. */
-#define IO_THREAD_COUTQ_HISTORY_SIZE 16
+/* The maximal number of packets queued in the BT output stage. */
+#define IO_THREAD_BT_QUEUE_SIZE 8
+/* The interval (in milliseconds) of BT socket COUTQ bytes sampling. */
+#define IO_THREAD_COUTQ_INTERVAL 20
+/* The interval (in milliseconds) of checking whether all PCM samples have
+ * been transfered, when the PCM drain has been requested. */
+#define IO_THREAD_DRAIN_INTERVAL 10
+/* The maximal number of packets queued in the pipelined transmit stage. */
+#define IO_THREAD_PACER_QUEUE_SIZE 8
+/* The maximal time (in milliseconds) of audio encoded ahead of the
+ * transmission, when the pipelined transmit stage is used. */
+#define IO_THREAD_PACER_AHEAD 30
+/* The SBC bitpool difference between adaptive bit rate quality levels. */
+#define IO_THREAD_SBC_BITPOOL_STEP 4
+/* The number of AAC adaptive bit rate quality levels. */
+#define IO_THREAD_AAC_ABR_LEVELS 5
+/* The maximal number of AAC audioMuxElements packed into one RTP packet. */
+#define IO_THREAD_AAC_PACK_AUS 4
+/* The maximal time (in milliseconds) for which packed AAC audioMuxElements
+ * are held, when there is no more PCM data. */
+#define IO_THREAD_AAC_PACK_TIMEOUT 10
+/* The maximal number of transports linked with the transport group leader. */
+#define IO_THREAD_GROUP_LINKS 8
+/* The number of SCO transfer periods buffered in each direction. */
+#define IO_THREAD_SCO_PERIODS 3
+
+struct ba_transport;
 
 void *io_thread_a2dp_sink_sbc(void *arg);
+int io_engine_a2dp_sink_sbc(struct ba_transport *t);
+int io_engine_sco(struct ba_transport *t);
 void *io_thread_a2dp_source_sbc(void *arg);
 #if ENABLE_AAC
 void *io_thread_a2dp_sink_aac(void *arg);
@@ -27,14 +54,15 @@ void *io_thread_a2dp_source_aac(void *arg);
 #if ENABLE_APTX
 void *io_thread_a2dp_source_aptx(void *arg);
 #endif
+#if ENABLE_APTX_HD
+void *io_thread_a2dp_source_aptx_hd(void *arg);
+#endif
 #if ENABLE_LDAC
 void *io_thread_a2dp_source_ldac(void *arg);
 #endif
+void *io_thread_a2dp_source_passthrough(void *arg);
+void *io_thread_a2dp_source_dispatch(void *arg);
 
 void *io_thread_sco(void *arg);
 
-#ifdef DEBUG
-void *io_thread_a2dp_sink_dump(void *arg);
-#endif
-
 #endif
@@ -0,0 +1,256 @@
+/*
+ * BlueALSA - jitter.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "jitter.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rt.h"
+
+/* The smallest expected packet duration (e.g. single SBC frame). */
+#define JITTER_MIN_PACKET_FRAMES 128
+
+/**
+ * Initialize jitter buffer.
+ *
+ * @param jb Address of the jitter buffer structure.
+ * @param mtu The maximal size of a single packet.
+ * @param samplerate Sampling rate of the stream.
+ * @param delay Target buffering delay in milliseconds. Buffered audio will
+ *   never exceed twice this value - the oldest packets will be dropped.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int jitter_buffer_init(struct jitter_buffer *jb, size_t mtu,
+		unsigned int samplerate, unsigned int delay) {
+
+	size_t size = JITTER_BUFFER_MIN_SLOTS;
+	size_t i;
+
+	memset(jb, 0, sizeof(*jb));
+
+	jb->samplerate = samplerate;
+	jb->target = (uint64_t)samplerate * delay / 1000;
+	jb->limit = jb->target * 2;
+
+	while (size * JITTER_MIN_PACKET_FRAMES < jb->limit)
+		size <<= 1;
+
+	if ((jb->packets = calloc(size, sizeof(*jb->packets))) == NULL)
+		return -1;
+	if ((jb->data = malloc(size * mtu)) == NULL) {
+		free(jb->packets);
+		jb->packets = NULL;
+		return -1;
+	}
+
+	jb->size = size;
+	jb->mtu = mtu;
+	for (i = 0; i < size; i++)
+		jb->packets[i].data = &jb->data[i * mtu];
+
+	return 0;
+}
+
+/**
+ * Release resources allocated by the jitter_buffer_init(). */
+void jitter_buffer_free(struct jitter_buffer *jb) {
+	free(jb->packets);
+	jb->packets = NULL;
+	free(jb->data);
+	jb->data = NULL;
+}
+
+/**
+ * Drop all buffered packets and stop the playout. */
+void jitter_buffer_reset(struct jitter_buffer *jb) {
+	size_t i;
+	for (i = 0; i < jb->size; i++)
+		jb->packets[i].used = false;
+	jb->synced = false;
+	jb->playing = false;
+	jb->count = 0;
+	jb->frames = 0;
+}
+
+/**
+ * Advance the play position by one packet. */
+static struct jitter_packet *jitter_buffer_pop(struct jitter_buffer *jb) {
+
+	struct jitter_packet *p = &jb->packets[jb->seq & (jb->size - 1)];
+	jb->seq++;
+
+	if (!p->used)
+		return NULL;
+
+	p->used = false;
+	jb->count--;
+	jb->frames -= p->frames;
+	return p;
+}
+
+/**
+ * Store packet in the jitter buffer.
+ *
+ * @param jb Address of the jitter buffer structure.
+ * @param packet Address of the packet data.
+ * @param len Length of the packet data.
+ * @param seq RTP sequence number of the packet.
+ * @param frames The number of PCM frames carried by the packet.
+ * @return Upon success this function returns 0. If the packet has arrived
+ *   too late, or it is a duplicate, -1 is returned and errno is set to
+ *   EALREADY. If the packet is bigger than the slot size, errno is set to
+ *   EMSGSIZE. */
+int jitter_buffer_put(struct jitter_buffer *jb, const void *packet, size_t len,
+		uint16_t seq, unsigned int frames) {
+
+	if (len > jb->mtu)
+		return errno = EMSGSIZE, -1;
+
+	/* While not playing and empty, synchronize with whatever comes first.
+	 * It allows us to follow the sequence number discontinuity. */
+	if (!jb->synced || (!jb->playing && jb->count == 0)) {
+		jb->seq = seq;
+		jb->synced = true;
+	}
+
+	if ((int16_t)(seq - jb->seq) < 0) {
+		jb->late++;
+		return errno = EALREADY, -1;
+	}
+
+	/* Packet is too far ahead - move the window, so it will fit. */
+	while ((uint16_t)(seq - jb->seq) >= jb->size)
+		if (jitter_buffer_pop(jb) != NULL)
+			jb->dropped++;
+		else
+			jb->lost++;
+
+	struct jitter_packet *p = &jb->packets[seq & (jb->size - 1)];
+	if (p->used) {
+		jb->late++;
+		return errno = EALREADY, -1;
+	}
+
+	memcpy(p->data, packet, len);
+	p->len = len;
+	p->seq = seq;
+	p->frames = frames;
+	p->used = true;
+
+	jb->count++;
+	jb->frames += frames;
+
+	/* keep the latency bounded - drop the oldest audio */
+	while (jb->frames > jb->limit && jb->count > 1)
+		if (jitter_buffer_pop(jb) != NULL)
+			jb->dropped++;
+
+	return 0;
+}
+
+/**
+ * Get the deadline of the next packet playout. */
+static void jitter_buffer_deadline(const struct jitter_buffer *jb, struct timespec *ts) {
+	/* split the conversion, so the multiplication will not overflow */
+	const uint64_t sec = jb->played / jb->samplerate;
+	const uint64_t nsec = (jb->played % jb->samplerate) * 1000000000 / jb->samplerate;
+	ts->tv_sec = jb->ts0.tv_sec + sec;
+	ts->tv_nsec = jb->ts0.tv_nsec + nsec;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_nsec -= 1000000000;
+		ts->tv_sec++;
+	}
+}
+
+/**
+ * Get next packet for the playout.
+ *
+ * This function shall be called repeatedly, until it returns JITTER_EMPTY.
+ *
+ * @param jb Address of the jitter buffer structure.
+ * @param now Current time-stamp.
+ * @param packet Address where the pointer to the packet data will be
+ *   stored. The data is valid until the next call to jitter_buffer_put().
+ * @param len Address where the length of the packet will be stored.
+ * @param frames Address where the number of frames carried by the packet
+ *   will be stored. In case of the lost packet, the length of the previous
+ *   packet is used as an estimation.
+ * @return This function returns the status of the playout. */
+enum jitter_status jitter_buffer_get(struct jitter_buffer *jb,
+		const struct timespec *now, const uint8_t **packet, size_t *len,
+		unsigned int *frames) {
+
+	struct jitter_packet *p;
+	struct timespec ts;
+
+	if (!jb->playing) {
+		/* wait until the target delay is buffered */
+		if (jb->count == 0 || jb->frames < jb->target)
+			return JITTER_EMPTY;
+		jb->playing = true;
+		jb->ts0 = *now;
+		jb->played = 0;
+	}
+
+	jitter_buffer_deadline(jb, &ts);
+	if (difftimespec(&ts, now, &ts) < 0)
+		return JITTER_EMPTY;
+
+	if (jb->count == 0) {
+		/* buffer underrun - start buffering once again */
+		jb->underruns++;
+		jb->playing = false;
+		return JITTER_EMPTY;
+	}
+
+	if ((p = jitter_buffer_pop(jb)) == NULL) {
+		jb->lost++;
+		*frames = jb->frames_last;
+		jb->played += *frames;
+		return JITTER_LOST;
+	}
+
+	*packet = p->data;
+	*len = p->len;
+	*frames = p->frames;
+
+	/* Packets which do not carry audio on their own (e.g. fragments of
+	 * a bigger frame) do not provide a valid estimation for concealment. */
+	if (p->frames > 0)
+		jb->frames_last = p->frames;
+
+	jb->played += p->frames;
+	return JITTER_PACKET;
+}
+
+/**
+ * Get the poll() timeout for the next playout.
+ *
+ * @param jb Address of the jitter buffer structure.
+ * @param now Current time-stamp.
+ * @return This function returns the number of milliseconds to the next
+ *   playout deadline, or -1 if the playout is not running. */
+int jitter_buffer_timeout(const struct jitter_buffer *jb,
+		const struct timespec *now) {
+
+	struct timespec ts;
+
+	if (!jb->playing)
+		return -1;
+
+	jitter_buffer_deadline(jb, &ts);
+	if (difftimespec(now, &ts, &ts) < 0)
+		return 0;
+
+	/* round up, so we will not wake up too early */
+	return ts.tv_sec * 1000 + (ts.tv_nsec + 999999) / 1000000;
+}
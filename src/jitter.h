@@ -0,0 +1,102 @@
+/*
+ * BlueALSA - jitter.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_JITTER_H_
+#define BLUEALSA_JITTER_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* The minimal number of packet slots in the jitter buffer. */
+#define JITTER_BUFFER_MIN_SLOTS 16
+
+struct jitter_packet {
+	uint8_t *data;
+	size_t len;
+	/* RTP sequence number */
+	uint16_t seq;
+	/* the number of PCM frames carried by this packet */
+	unsigned int frames;
+	bool used;
+};
+
+enum jitter_status {
+	/* there is nothing to play right now */
+	JITTER_EMPTY = 0,
+	/* next packet shall be decoded */
+	JITTER_PACKET,
+	/* next packet is missing - its content shall be concealed */
+	JITTER_LOST,
+};
+
+/**
+ * Receiver side jitter buffer.
+ *
+ * Packets are stored in slots indexed by the RTP sequence number, so the
+ * stream is reordered on the fly. The playout starts when the target delay
+ * has been buffered, and from that point packets are released with the
+ * nominal rate of the stream, regardless of the arrival pattern. */
+struct jitter_buffer {
+
+	struct jitter_packet *packets;
+	uint8_t *data;
+	/* number of slots (power of 2) */
+	size_t size;
+	/* size of a single slot */
+	size_t mtu;
+
+	unsigned int samplerate;
+	/* target and maximal amount of buffered audio (in frames) */
+	unsigned int target;
+	unsigned int limit;
+
+	/* sequence number of the next packet to play */
+	uint16_t seq;
+	bool synced;
+
+	/* number of buffered packets and the amount of buffered audio */
+	size_t count;
+	unsigned int frames;
+	/* the number of frames in the last played packet */
+	unsigned int frames_last;
+
+	/* playout clock */
+	bool playing;
+	struct timespec ts0;
+	uint64_t played;
+
+	/* statistics */
+	unsigned int lost;
+	unsigned int late;
+	unsigned int dropped;
+	unsigned int underruns;
+
+};
+
+int jitter_buffer_init(struct jitter_buffer *jb, size_t mtu,
+		unsigned int samplerate, unsigned int delay);
+void jitter_buffer_free(struct jitter_buffer *jb);
+void jitter_buffer_reset(struct jitter_buffer *jb);
+
+int jitter_buffer_put(struct jitter_buffer *jb, const void *packet, size_t len,
+		uint16_t seq, unsigned int frames);
+enum jitter_status jitter_buffer_get(struct jitter_buffer *jb,
+		const struct timespec *now, const uint8_t **packet, size_t *len,
+		unsigned int *frames);
+int jitter_buffer_timeout(const struct jitter_buffer *jb,
+		const struct timespec *now);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * BlueALSA - link-history.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "link-history.h"
+
+#include <string.h>
+
+/**
+ * Initialize BT link quality history. */
+void link_history_init(struct link_history *h) {
+	pthread_mutex_init(&h->mutex, NULL);
+	h->len = 0;
+	h->seq = 0;
+}
+
+/**
+ * Free BT link quality history. */
+void link_history_free(struct link_history *h) {
+	pthread_mutex_destroy(&h->mutex);
+	h->len = 0;
+}
+
+/**
+ * Lookup history entry - this function shall be called with mutex held. */
+static struct link_history_entry *link_history_lookup(struct link_history *h,
+		const bdaddr_t *addr, uint16_t codec) {
+
+	size_t i;
+
+	for (i = 0; i < h->len; i++)
+		if (h->entries[i].codec == codec &&
+				bacmp(&h->entries[i].addr, addr) == 0)
+			return &h->entries[i];
+
+	return NULL;
+}
+
+/**
+ * Store the quality level currently sustained by the BT link.
+ *
+ * This function should be called whenever the adaptive bit rate changes
+ * the quality level, so the history holds the level at which the link has
+ * settled down. If the history is full, the least recently updated entry
+ * is replaced.
+ *
+ * @param h Address of the history structure.
+ * @param addr Address of the Bluetooth device.
+ * @param codec Codec identifier.
+ * @param level Current quality level, where level 0 is the highest quality.
+ * @param levels The number of available quality levels. */
+void link_history_update(struct link_history *h, const bdaddr_t *addr,
+		uint16_t codec, unsigned int level, unsigned int levels) {
+
+	struct link_history_entry *e;
+	size_t i;
+
+	pthread_mutex_lock(&h->mutex);
+
+	if ((e = link_history_lookup(h, addr, codec)) == NULL) {
+
+		if (h->len < LINK_HISTORY_SIZE)
+			e = &h->entries[h->len++];
+		else
+			for (e = &h->entries[0], i = 1; i < h->len; i++)
+				if (h->entries[i].seq < e->seq)
+					e = &h->entries[i];
+
+		bacpy(&e->addr, addr);
+		e->codec = codec;
+
+	}
+
+	e->level = level;
+	e->levels = levels;
+	e->seq = ++h->seq;
+
+	pthread_mutex_unlock(&h->mutex);
+}
+
+/**
+ * Get the quality level sustained by the BT link recently.
+ *
+ * The number of quality levels might differ between connections (e.g. the
+ * SBC bitpool range depends on the negotiated configuration), so the stored
+ * level is scaled to the given number of levels.
+ *
+ * @param h Address of the history structure.
+ * @param addr Address of the Bluetooth device.
+ * @param codec Codec identifier.
+ * @param levels The number of available quality levels.
+ * @return This function returns the quality level which should be used at
+ *   the beginning of the transfer. If there is no history for the given
+ *   device, the highest quality (level 0) is returned. */
+unsigned int link_history_get_level(struct link_history *h, const bdaddr_t *addr,
+		uint16_t codec, unsigned int levels) {
+
+	const struct link_history_entry *e;
+	unsigned int level = 0;
+
+	pthread_mutex_lock(&h->mutex);
+
+	if ((e = link_history_lookup(h, addr, codec)) != NULL &&
+			e->levels > 1 && levels > 1)
+		/* round towards the lower quality - it is better to upgrade later
+		 * on than to stutter at the beginning of the transfer */
+		level = (e->level * (levels - 1) + e->levels - 2) / (e->levels - 1);
+
+	pthread_mutex_unlock(&h->mutex);
+
+	if (level >= levels)
+		level = levels > 0 ? levels - 1 : 0;
+
+	return level;
+}
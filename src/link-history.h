@@ -0,0 +1,61 @@
+/*
+ * BlueALSA - link-history.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_LINKHISTORY_H_
+#define BLUEALSA_LINKHISTORY_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+
+/* The maximal number of remembered device and codec pairs. */
+#define LINK_HISTORY_SIZE 32
+
+/**
+ * Quality level sustained by the BT link of the given device. */
+struct link_history_entry {
+	bdaddr_t addr;
+	uint16_t codec;
+	/* the last quality level used by the adaptive bit rate, where level 0
+	 * is the highest quality, and the number of available levels */
+	unsigned int level;
+	unsigned int levels;
+	/* sequence number of the last update, used for the LRU eviction */
+	unsigned long seq;
+};
+
+/**
+ * Per-device history of the BT link quality.
+ *
+ * The history outlives device connections, so the next connection of the
+ * same device can start with the quality its link has been able to carry
+ * recently, instead of the highest one. */
+struct link_history {
+	pthread_mutex_t mutex;
+	struct link_history_entry entries[LINK_HISTORY_SIZE];
+	size_t len;
+	unsigned long seq;
+};
+
+void link_history_init(struct link_history *h);
+void link_history_free(struct link_history *h);
+
+void link_history_update(struct link_history *h, const bdaddr_t *addr,
+		uint16_t codec, unsigned int level, unsigned int levels);
+unsigned int link_history_get_level(struct link_history *h, const bdaddr_t *addr,
+		uint16_t codec, unsigned int levels);
+
+#endif
@@ -14,6 +14,7 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,9 +36,11 @@
 #include "ofono.h"
 #endif
 #include "ctl.h"
+#include "io-engine.h"
 #include "transport.h"
 #include "utils.h"
 #include "defs.h"
+#include "shared/ffb.h"
 #include "log.h"
 
 
@@ -82,7 +85,26 @@ int main(int argc, char **argv) {
 		{ "a2dp-force-mono", no_argument, NULL, 6 },
 		{ "a2dp-force-audio-cd", no_argument, NULL, 7 },
 		{ "a2dp-keep-alive", required_argument, NULL, 8 },
+		{ "a2dp-standby", required_argument, NULL, 25 },
+		{ "a2dp-silence-timeout", required_argument, NULL, 27 },
 		{ "a2dp-volume", no_argument, NULL, 9 },
+		{ "a2dp-pipeline", no_argument, NULL, 13 },
+		{ "a2dp-abr", no_argument, NULL, 14 },
+		{ "a2dp-abr-thresholds", required_argument, NULL, 15 },
+		{ "a2dp-jitter-buffer", required_argument, NULL, 16 },
+		{ "a2dp-plc", required_argument, NULL, 17 },
+		{ "a2dp-resampler", required_argument, NULL, 24 },
+		{ "io-workers", required_argument, NULL, 12 },
+		{ "io-rt-priority", required_argument, NULL, 18 },
+		{ "io-cpus-a2dp", required_argument, NULL, 19 },
+		{ "io-cpus-sco", required_argument, NULL, 20 },
+		{ "io-mlockall", no_argument, NULL, 21 },
+		{ "io-catchup", required_argument, NULL, 22 },
+		{ "io-buffer-pool", required_argument, NULL, 28 },
+		{ "io-buffer-limit", required_argument, NULL, 29 },
+		{ "io-cpu-budget", required_argument, NULL, 30 },
+		{ "sco-period", required_argument, NULL, 23 },
+		{ "sco-no-preconnect", no_argument, NULL, 26 },
 #if ENABLE_AAC
 		{ "aac-afterburner", no_argument, NULL, 4 },
 		{ "aac-vbr-mode", required_argument, NULL, 5 },
@@ -97,6 +119,7 @@ int main(int argc, char **argv) {
 	bool syslog = false;
 	struct hci_dev_info *hci_devs;
 	int hci_devs_num;
+	int hci_dev_default = 0;
 
 	/* Check if syslog forwarding has been enabled. This check has to be
 	 * done before anything else, so we can log early stage warnings and
@@ -134,7 +157,7 @@ int main(int argc, char **argv) {
 		int i;
 		for (i = 0; i < hci_devs_num; i++)
 			if (i == 0 || hci_test_bit(HCI_UP, &hci_devs[i].flags))
-				memcpy(&config.hci_dev, &hci_devs[i], sizeof(config.hci_dev));
+				hci_dev_default = i;
 	}
 
 	/* parse options */
@@ -149,12 +172,38 @@ int main(int argc, char **argv) {
 					"  -h, --help\t\tprint this help and exit\n"
 					"  -V, --version\t\tprint version and exit\n"
 					"  -S, --syslog\t\tsend output to syslog\n"
-					"  -i, --device=hciX\tHCI device to use\n"
+					"  -i, --device=hciX\tHCI device to use (can be given multiple times)\n"
 					"  -p, --profile=NAME\tenable BT profile\n"
 					"  --a2dp-force-mono\tforce monophonic sound\n"
 					"  --a2dp-force-audio-cd\tforce 44.1 kHz sampling\n"
 					"  --a2dp-keep-alive=SEC\tkeep A2DP transport alive\n"
+					"  --a2dp-standby=MODE\tacquire A2DP ahead of time (none, hint, always)\n"
+					"  --a2dp-silence-timeout=SEC\n"
+					"\t\t\tsuspend A2DP streaming upon silence\n"
 					"  --a2dp-volume\t\tcontrol volume natively\n"
+					"  --a2dp-pipeline\tencode ahead of transmission\n"
+					"  --a2dp-abr\t\tenable SBC/AAC adaptive bit rate\n"
+					"  --a2dp-abr-thresholds=LOW:HIGH:MS\n"
+					"\t\t\tset ABR queue and blocking thresholds\n"
+					"  --a2dp-jitter-buffer=MS\n"
+					"\t\t\tbuffer MS of audio on the sink side\n"
+					"  --a2dp-plc=MODE\tconceal lost packets (silence, repeat)\n"
+					"  --a2dp-resampler=QUALITY\n"
+					"\t\t\tresample PCM (none, fast, medium, best)\n"
+					"  --io-workers=NB\tuse NB shared IO workers for\n"
+					"\t\t\tSBC sink and SCO transports\n"
+					"  --io-rt-priority=[POLICY:]PRIO\n"
+					"\t\t\trun IO threads with real-time priority (fifo, rr)\n"
+					"  --io-cpus-a2dp=LIST\tpin A2DP IO threads to CPUs (e.g. 0,2-3)\n"
+					"  --io-cpus-sco=LIST\tpin SCO IO threads to CPUs\n"
+					"  --io-mlockall\t\tlock process memory\n"
+					"  --io-catchup=MODE\tpacing after overrun (burst, skip)\n"
+					"  --io-buffer-pool=KiB\tkeep released IO buffers for reuse\n"
+					"  --io-buffer-limit=KiB\tlimit IO buffers of one transport\n"
+					"  --io-cpu-budget=PERCENT\n"
+					"\t\t\tlower encoder complexity above CPU load\n"
+					"  --sco-period=MS\tSCO transfer period\n"
+					"  --sco-no-preconnect\tdo not open SCO link during call setup\n"
 #if ENABLE_AAC
 					"  --aac-afterburner\tenable afterburner\n"
 					"  --aac-vbr-mode=NB\tset VBR mode to NB\n"
@@ -194,30 +243,33 @@ int main(int argc, char **argv) {
 
 			bdaddr_t addr;
 			int i = hci_devs_num;
-			int found = 0;
+			int found = -1;
 
 			if (str2ba(optarg, &addr) == 0) {
 				while (i--)
 					if (bacmp(&addr, &hci_devs[i].bdaddr) == 0) {
-						memcpy(&config.hci_dev, &hci_devs[i], sizeof(config.hci_dev));
-						found = 1;
+						found = i;
 						break;
 					}
 			}
 			else {
 				while (i--)
 					if (strcmp(optarg, hci_devs[i].name) == 0) {
-						memcpy(&config.hci_dev, &hci_devs[i], sizeof(config.hci_dev));
-						found = 1;
+						found = i;
 						break;
 				}
 			}
 
-			if (found == 0) {
+			if (found == -1) {
 				error("HCI device not found: %s", optarg);
 				return EXIT_FAILURE;
 			}
 
+			/* the same device given more than once is served only once */
+			if (bluealsa_hci_dev_index(hci_devs[found].dev_id) == -1)
+				memcpy(&config.hci_devs[config.hci_devs_len++], &hci_devs[found],
+						sizeof(*config.hci_devs));
+
 			break;
 		}
 
@@ -268,9 +320,170 @@ int main(int argc, char **argv) {
 		case 8 /* --a2dp-keep-alive=SEC */ :
 			config.a2dp.keep_alive = atoi(optarg);
 			break;
+		case 25 /* --a2dp-standby=MODE */ : {
+			static const char *values[] = {
+				[BA_A2DP_STANDBY_NONE] = "none",
+				[BA_A2DP_STANDBY_HINT] = "hint",
+				[BA_A2DP_STANDBY_ALWAYS] = "always",
+			};
+			size_t i;
+			for (i = 0; i < ARRAYSIZE(values); i++)
+				if (strcasecmp(optarg, values[i]) == 0)
+					break;
+			if (i == ARRAYSIZE(values)) {
+				error("Invalid standby mode {none, hint, always}: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			config.a2dp.standby = i;
+			break;
+		}
+		case 27 /* --a2dp-silence-timeout=SEC */ :
+			config.a2dp.silence_timeout = atoi(optarg);
+			break;
 		case 9 /* --a2dp-volume */ :
 			config.a2dp.volume = true;
 			break;
+		case 13 /* --a2dp-pipeline */ :
+			config.a2dp.pipeline = true;
+			break;
+		case 14 /* --a2dp-abr */ :
+			config.a2dp.abr = true;
+			break;
+		case 15 /* --a2dp-abr-thresholds=LOW:HIGH:MS */ : {
+			struct abr_config *abr = &config.a2dp.abr_config;
+			if (sscanf(optarg, "%u:%u:%u", &abr->queue_low, &abr->queue_high, &abr->blocked) != 3 ||
+					abr->queue_low >= abr->queue_high) {
+				error("Invalid ABR thresholds [LOW < HIGH]: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		case 16 /* --a2dp-jitter-buffer=MS */ :
+			config.a2dp.jitter_buffer = atoi(optarg);
+			if (config.a2dp.jitter_buffer > 1000) {
+				error("Invalid jitter buffer delay [0, 1000]: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 17 /* --a2dp-plc=MODE */ :
+			if (strcasecmp(optarg, "silence") == 0)
+				config.a2dp.plc_repeat = false;
+			else if (strcasecmp(optarg, "repeat") == 0)
+				config.a2dp.plc_repeat = true;
+			else {
+				error("Invalid packet loss concealment mode {silence, repeat}: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 24 /* --a2dp-resampler=QUALITY */ : {
+			static const char *values[] = {
+				[RESAMPLER_QUALITY_NONE] = "none",
+				[RESAMPLER_QUALITY_FAST] = "fast",
+				[RESAMPLER_QUALITY_MEDIUM] = "medium",
+				[RESAMPLER_QUALITY_BEST] = "best",
+			};
+			size_t i;
+			for (i = 0; i < ARRAYSIZE(values); i++)
+				if (strcasecmp(optarg, values[i]) == 0)
+					break;
+			if (i == ARRAYSIZE(values)) {
+				error("Invalid resampler quality {none, fast, medium, best}: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			config.a2dp.resampler = i;
+			break;
+		}
+
+		case 12 /* --io-workers=NB */ :
+			config.io_engine.enabled = true;
+			config.io_engine.workers = 0;
+			if (strcmp(optarg, "auto") != 0 &&
+					(config.io_engine.workers = atoi(optarg)) == 0) {
+				error("Invalid number of IO workers: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 18 /* --io-rt-priority=[POLICY:]PRIO */ : {
+			const char *tmp;
+			config.io_thread.policy = SCHED_FIFO;
+			if ((tmp = strchr(optarg, ':')) != NULL) {
+				if (strncasecmp(optarg, "fifo:", tmp - optarg + 1) == 0)
+					config.io_thread.policy = SCHED_FIFO;
+				else if (strncasecmp(optarg, "rr:", tmp - optarg + 1) == 0)
+					config.io_thread.policy = SCHED_RR;
+				else {
+					error("Invalid real-time scheduling policy {fifo, rr}: %s", optarg);
+					return EXIT_FAILURE;
+				}
+				optarg = (char *)tmp + 1;
+			}
+			config.io_thread.priority = atoi(optarg);
+			if (config.io_thread.priority < sched_get_priority_min(config.io_thread.policy) ||
+					config.io_thread.priority > sched_get_priority_max(config.io_thread.policy)) {
+				error("Invalid real-time priority [%d, %d]: %s",
+						sched_get_priority_min(config.io_thread.policy),
+						sched_get_priority_max(config.io_thread.policy), optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		case 19 /* --io-cpus-a2dp=LIST */ :
+			if (cpulist_to_mask(optarg, &config.io_thread.cpus_a2dp) == -1) {
+				error("Invalid CPU list: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 20 /* --io-cpus-sco=LIST */ :
+			if (cpulist_to_mask(optarg, &config.io_thread.cpus_sco) == -1) {
+				error("Invalid CPU list: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 21 /* --io-mlockall */ :
+			config.io_thread.mlockall = true;
+			break;
+		case 22 /* --io-catchup=MODE */ :
+			if (strcasecmp(optarg, "burst") == 0)
+				config.io_thread.catchup = ASRSYNC_CATCHUP_BURST;
+			else if (strcasecmp(optarg, "skip") == 0)
+				config.io_thread.catchup = ASRSYNC_CATCHUP_SKIP;
+			else {
+				error("Invalid pacing catch-up mode {burst, skip}: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 28 /* --io-buffer-pool=KiB */ :
+		case 29 /* --io-buffer-limit=KiB */ : {
+			int kib;
+			if ((kib = atoi(optarg)) < 0) {
+				error("Invalid IO buffer memory size: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			if (opt == 28)
+				config.io_thread.buffer_pool = (size_t)kib * 1024;
+			else
+				config.io_thread.buffer_limit = (size_t)kib * 1024;
+			break;
+		}
+		case 30 /* --io-cpu-budget=PERCENT */ : {
+			double percent;
+			if (sscanf(optarg, "%lf", &percent) != 1 || percent < 0 || percent > 10000) {
+				error("Invalid CPU budget [0, 10000]: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			config.io_thread.cpu_budget.limit = percent * 10;
+			break;
+		}
+		case 23 /* --sco-period=MS */ :
+			config.hfp.sco_period = atoi(optarg);
+			if (config.hfp.sco_period < 1 || config.hfp.sco_period > 100) {
+				error("Invalid SCO transfer period [1, 100]: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 26 /* --sco-no-preconnect */ :
+			config.hfp.sco_preconnect = false;
+			break;
 
 #if ENABLE_AAC
 		case 4 /* --aac-afterburner */ :
@@ -303,12 +516,29 @@ int main(int argc, char **argv) {
 			return EXIT_FAILURE;
 		}
 
+	/* use default HCI device if none was given explicitly */
+	if (config.hci_devs_len == 0)
+		memcpy(&config.hci_devs[config.hci_devs_len++], &hci_devs[hci_dev_default],
+				sizeof(*config.hci_devs));
+
 	/* device list is no longer required */
 	free(hci_devs);
 
 	/* initialize random number generator */
 	srandom(time(NULL));
 
+	/* do not block IO threads on the stderr or the system logger */
+	if (log_async_start() == -1)
+		warn("Couldn't start asynchronous logging: %s", strerror(errno));
+
+	ffb_pool_set_limit(config.io_thread.buffer_pool);
+
+	if (config.io_engine.enabled &&
+			io_engine_init(config.io_engine.workers) == -1) {
+		error("Couldn't initialize IO engine: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
 	if ((bluealsa_ctl_thread_init()) == -1)
 		return EXIT_FAILURE;
 
@@ -360,6 +590,7 @@ int main(int argc, char **argv) {
 	 * to unlink named sockets, otherwise service will not start any more. */
 	bluealsa_ctl_free();
 	bluealsa_config_free();
+	io_engine_free();
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,68 @@
+/*
+ * BlueALSA - mem-pool.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "mem-pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Allocate zero-initialized object.
+ *
+ * @param pool Address of the pool structure.
+ * @return On success this function returns the address of the object,
+ *   either taken from the pool or freshly allocated. Otherwise, NULL is
+ *   returned and errno is set appropriately. */
+void *mem_pool_alloc(struct mem_pool *pool) {
+
+	void *object = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->len > 0)
+		object = pool->objects[--pool->len];
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (object == NULL)
+		return calloc(1, pool->size);
+
+	memset(object, 0, pool->size);
+	return object;
+}
+
+/**
+ * Release object allocated with the mem_pool_alloc().
+ *
+ * If the pool is full, the object is returned to the heap.
+ *
+ * @param pool Address of the pool structure.
+ * @param object Address of the object or NULL. */
+void mem_pool_release(struct mem_pool *pool, void *object) {
+
+	if (object == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->len < MEM_POOL_SIZE) {
+		pool->objects[pool->len++] = object;
+		object = NULL;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	free(object);
+}
+
+/**
+ * Free all objects kept in the pool. */
+void mem_pool_free(struct mem_pool *pool) {
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->len > 0)
+		free(pool->objects[--pool->len]);
+	pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,44 @@
+/*
+ * BlueALSA - mem-pool.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_MEMPOOL_H_
+#define BLUEALSA_MEMPOOL_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* The maximal number of objects kept in a single pool. */
+#define MEM_POOL_SIZE 16
+
+/**
+ * Pool of released objects of the same size.
+ *
+ * Objects which are frequently allocated and released (e.g. transports
+ * upon every reconnection) are kept in the pool instead of being returned
+ * to the heap, so the heap is not fragmented by the churn. */
+struct mem_pool {
+	pthread_mutex_t mutex;
+	size_t size;
+	void *objects[MEM_POOL_SIZE];
+	size_t len;
+};
+
+#define MEM_POOL_INITIALIZER(type) { \
+	.mutex = PTHREAD_MUTEX_INITIALIZER, .size = sizeof(type) }
+
+void *mem_pool_alloc(struct mem_pool *pool);
+void mem_pool_release(struct mem_pool *pool, void *object);
+void mem_pool_free(struct mem_pool *pool);
+
+#endif
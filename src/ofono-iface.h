@@ -17,6 +17,8 @@
 #define HF_AUDIO_AGENT_INTERFACE OFONO_SERVICE ".HandsfreeAudioAgent"
 #define HF_AUDIO_MANAGER_INTERFACE OFONO_SERVICE ".HandsfreeAudioManager"
 #define HF_AUDIO_CARD_INTERFACE OFONO_SERVICE ".HandsfreeAudioCard"
+#define VOICE_CALL_MANAGER_INTERFACE OFONO_SERVICE ".VoiceCallManager"
+#define VOICE_CALL_INTERFACE OFONO_SERVICE ".VoiceCall"
 
 extern GDBusInterfaceInfo ofono_iface_profile;
 
@@ -24,6 +24,7 @@
 #include "transport.h"
 #include "log.h"
 #include "ctl.h"
+#include "utils.h"
 
 #include <gio/gunixfdlist.h>
 #include <errno.h>
@@ -34,6 +35,8 @@
 #define GET_CARDS_SIGNATURE		"a(oa{sv})"
 #define CARD_ADDED_SIGNATURE	"(oa{sv})"
 #define CARD_REMOVED_SIGNATURE	"(o)"
+#define CALL_ADDED_SIGNATURE	"(oa{sv})"
+#define PROPERTY_CHANGED_SIGNATURE	"(sv)"
 
 #define HFP_AUDIO_CODEC_CVSD    0x01
 #define HFP_AUDIO_CODEC_MSBC    0x02
@@ -45,6 +48,8 @@
 static guint card_added_subsc_id = 0;
 static guint card_removed_subsc_id = 0;
 static guint name_owner_changed_subsc_id = 0;
+static guint call_manager_subsc_id = 0;
+static guint call_property_subsc_id = 0;
 static guint agent_methods_id = 0;
 
 /* forward static declarations */
@@ -190,8 +195,12 @@ static void ofono_profile_new_connection(GDBusMethodInvocation * invocation, voi
 
 	transport->bt_fd = fd2;
 	transport->codec = codec;
+	transport->sco.ofono.connect_pending = false;
 	ofono_socket_accept(fd2);
-	bluealsa_ctl_event(BA_EVENT_TRANSPORT_ADDED);
+	bluealsa_ctl_event_transport(BA_EVENT_TRANSPORT_ADDED, transport);
+
+	/* wake up the IO thread, so it will start the transfer right away */
+	transport_send_signal(transport, TRANSPORT_PCM_OPEN);
 
 	g_dbus_method_invocation_return_value(invocation, NULL);
 	return;
@@ -268,7 +277,7 @@ static int ofono_card_disconnect(struct ba_transport * transport) {
 	transport->bt_fd = -1;
 	transport->codec = HFP_CODEC_UNDEFINED;
 
-	bluealsa_ctl_event(BA_EVENT_TRANSPORT_REMOVED);
+	bluealsa_ctl_event_transport(BA_EVENT_TRANSPORT_REMOVED, transport);
 	debug("%s -> DONE", card);
 
 	return 0;
@@ -336,16 +345,48 @@ done:
 }
 
 
+/*
+ * Callback for the card Connect method reply
+ * On success, there is nothing to do here - the SCO socket is passed to us
+ * with the NewConnection method call. */
+
+static void ofono_card_connect_finish(GObject *source, GAsyncResult *result, gpointer userdata) {
+	char *card = userdata;
+	GDBusMessage *rep;
+	GError *err = NULL;
+	struct ba_transport *t;
+
+	if ((rep = g_dbus_connection_send_message_with_reply_finish(G_DBUS_CONNECTION(source),
+					result, &err)) != NULL &&
+			g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR)
+		g_dbus_message_to_gerror(rep, &err);
+
+	if (err != NULL) {
+		error("Failed to connect to card %s: %s", card, err->message);
+		pthread_mutex_lock(&config.devices_mutex);
+		if ((t = ofono_transport_find(card)) != NULL)
+			t->sco.ofono.connect_pending = false;
+		pthread_mutex_unlock(&config.devices_mutex);
+		g_error_free(err);
+	}
+
+	if (rep != NULL)
+		g_object_unref(rep);
+	free(card);
+}
+
 /*
  * Asks Ofono to connect to a card. It should in return invoke our NewConnection method
+ * The request is sent asynchronously, so the caller (which is the transport IO
+ * thread) is not blocked while Ofono is setting up the SCO link.
  * @return On success this function returns 0. Otherwise -1 is returned. */
 
 
 static int ofono_card_connect(struct ba_transport * transport) {
 	GDBusConnection *conn = config.dbus;
-	GDBusMessage *msg = NULL, *rep = NULL;
-	GError *err = NULL;
+	GDBusMessage *msg = NULL;
 	struct ofono * ofono = &transport->sco.ofono;
+	char *card;
 
 	const char * path = ofono->card;
 	debug("%s...", path);
@@ -355,29 +396,18 @@ static int ofono_card_connect(struct ba_transport * transport) {
 		return 0;
 	}
 
-	ofono->connect_pending = false;
-
-	msg = g_dbus_message_new_method_call(OFONO_SERVICE, path, HF_AUDIO_CARD_INTERFACE, "Connect");
+	if ((card = strdup(path)) == NULL)
+		return -1;
 
-	if ((rep = g_dbus_connection_send_message_with_reply_sync(conn, msg,
-					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
-		goto fail;
+	ofono->connect_pending = true;
 
-	if (g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR) {
-		g_dbus_message_to_gerror(rep, &err);
-		error("Failed to connect to card %s: %s !\n", path, err->message);
-		goto fail;
-	}
+	msg = g_dbus_message_new_method_call(OFONO_SERVICE, path, HF_AUDIO_CARD_INTERFACE, "Connect");
+	g_dbus_connection_send_message_with_reply(conn, msg, G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+			-1, NULL, NULL, ofono_card_connect_finish, card);
+	g_object_unref(msg);
 
 	return 0;
 
-fail:
-	if (msg != NULL)
-		g_object_unref(msg);
-	if (rep != NULL)
-		g_object_unref(rep);
-	return -1;
-
 }
 
 /* Adds a new card. This can be called upon the CardAdded signal, or when retrieving the list of cards at startup */
@@ -495,6 +525,121 @@ fail:
 	return;
 }
 
+/*
+ * Sets the SCO pre-connection flag for the card of the given modem
+ * The modem object path (or the voice call path) contains the BlueZ device
+ * object path, so we can match it with the remote address of the card. */
+
+static void ofono_card_set_preconnect(const char * path, bool preconnect) {
+	GHashTableIter iter_d, iter_t;
+	struct ba_device *d;
+	struct ba_transport *t;
+	const char *dev;
+	char tmp[64];
+	char *p;
+	bdaddr_t addr;
+
+	if ((dev = strstr(path, "/dev_")) == NULL)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s", dev);
+	if ((p = strchr(tmp + 1, '/')) != NULL)
+		*p = '\0';
+	if (g_dbus_device_path_to_bdaddr(tmp, &addr) == -1)
+		return;
+
+	pthread_mutex_lock(&config.devices_mutex);
+
+	g_hash_table_iter_init(&iter_d, config.devices);
+	while (g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d)) {
+		if (d->hci_dev_id != OFONO_FAKE_DEV_ID || bacmp(&d->addr, &addr) != 0)
+			continue;
+		g_hash_table_iter_init(&iter_t, d->transports);
+		while (g_hash_table_iter_next(&iter_t, NULL, (gpointer)&t)) {
+			if (t->type != TRANSPORT_TYPE_SCO || !t->sco.is_ofono ||
+					t->sco.preconnect == preconnect)
+				continue;
+			debug("%s: SCO pre-connection: %s", t->sco.ofono.card, preconnect ? "on" : "off");
+			t->sco.preconnect = preconnect;
+			/* let the IO thread connect (or release) the SCO link */
+			transport_send_signal(t, TRANSPORT_PCM_OPEN);
+		}
+	}
+
+	pthread_mutex_unlock(&config.devices_mutex);
+}
+
+/* Checks whether the given voice call state is one of the call setup states */
+
+static bool ofono_call_state_setup(const char * state) {
+	return strcmp(state, "incoming") == 0 ||
+		strcmp(state, "waiting") == 0 ||
+		strcmp(state, "dialing") == 0 ||
+		strcmp(state, "alerting") == 0;
+}
+
+/* callback for the voice call manager CallAdded/CallRemoved signals and for the
+ * voice call PropertyChanged signal
+ * While the call is being set up (ringing or dialing), the SCO link is opened
+ * in advance, so the audio is available as soon as the call is answered. */
+
+static void ofono_signal_call_state(GDBusConnection *conn, const gchar *sender,
+		const gchar *path, const gchar *interface, const gchar *signal, GVariant *params,
+		void *userdata) {
+	(void)conn;
+	(void)sender;
+	(void)interface;
+	(void)userdata;
+
+	const gchar *signature = g_variant_get_type_string(params);
+	int state = -1;
+
+	if (strcmp(signal, "CallAdded") == 0) {
+
+		if (strcmp(signature, CALL_ADDED_SIGNATURE) != 0) {
+			error("Invalid signature for %s: %s != %s", signal, signature, CALL_ADDED_SIGNATURE);
+			return;
+		}
+
+		GVariantIter *gproperties = NULL;
+		GVariant *value = NULL;
+		const gchar *key;
+
+		g_variant_get(params, "(&oa{sv})", NULL, &gproperties);
+		while (g_variant_iter_next(gproperties, "{&sv}", &key, &value)) {
+			if (strcmp(key, "State") == 0)
+				state = ofono_call_state_setup(g_variant_get_string(value, NULL));
+			g_variant_unref(value);
+		}
+		g_variant_iter_free(gproperties);
+
+	}
+	else if (strcmp(signal, "CallRemoved") == 0)
+		state = false;
+	else if (strcmp(signal, "PropertyChanged") == 0) {
+
+		if (strcmp(signature, PROPERTY_CHANGED_SIGNATURE) != 0) {
+			error("Invalid signature for %s: %s != %s", signal, signature, PROPERTY_CHANGED_SIGNATURE);
+			return;
+		}
+
+		const gchar *name;
+		GVariant *value = NULL;
+
+		g_variant_get(params, "(&sv)", &name, &value);
+		if (strcmp(name, "State") == 0)
+			state = ofono_call_state_setup(g_variant_get_string(value, NULL));
+		g_variant_unref(value);
+
+	}
+
+	if (state == -1)
+		return;
+
+	debug("%s: %s: call setup: %d", path, signal, state);
+	ofono_card_set_preconnect(path, state);
+
+}
+
 /* Monitor the Ofono service availability. When Ofono is properly shutdown,
  * we are notified through the Release() method.
  * We get here the opportunity to perform some cleanup if it is killed */
@@ -747,6 +892,14 @@ int ofono_register(void) {
 			"NameOwnerChanged", NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
 			ofono_signal_name_owner_changed, NULL, NULL);
 
+	call_manager_subsc_id = g_dbus_connection_signal_subscribe(conn, OFONO_SERVICE, VOICE_CALL_MANAGER_INTERFACE,
+			NULL, NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+			ofono_signal_call_state, NULL, NULL);
+
+	call_property_subsc_id = g_dbus_connection_signal_subscribe(conn, OFONO_SERVICE, VOICE_CALL_INTERFACE,
+			"PropertyChanged", NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+			ofono_signal_call_state, NULL, NULL);
+
 	if (ofono_agent_register() != 0)
 		goto fail;
 
@@ -771,6 +924,8 @@ int ofono_unregister(void) {
 	g_dbus_connection_signal_unsubscribe(conn, card_added_subsc_id);
 	g_dbus_connection_signal_unsubscribe(conn, card_removed_subsc_id);
 	g_dbus_connection_signal_unsubscribe(conn, name_owner_changed_subsc_id);
+	g_dbus_connection_signal_unsubscribe(conn, call_manager_subsc_id);
+	g_dbus_connection_signal_unsubscribe(conn, call_property_subsc_id);
 
 	g_dbus_connection_unregister_object(conn, agent_methods_id);
 
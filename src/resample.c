@@ -0,0 +1,306 @@
+/*
+ * BlueALSA - resample.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "resample.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+/**
+ * Filter parameters for every quality level. The cutoff frequency is given
+ * relative to the Nyquist frequency of the lower sampling rate. */
+static const struct {
+	unsigned int taps;
+	double cutoff;
+	double beta;
+} resampler_profiles[] = {
+	[RESAMPLER_QUALITY_FAST] = { 16, 0.80, 5.0 },
+	[RESAMPLER_QUALITY_MEDIUM] = { 32, 0.90, 7.0 },
+	[RESAMPLER_QUALITY_BEST] = { 64, 0.95, 9.0 },
+};
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+	while (b != 0) {
+		unsigned int tmp = a % b;
+		a = b;
+		b = tmp;
+	}
+	return a;
+}
+
+/**
+ * Zeroth order modified Bessel function of the first kind. */
+static double bessel_i0(double x) {
+	double sum = 1, term = 1;
+	unsigned int k;
+	for (k = 1; k < 64 && term > sum * 1e-12; k++) {
+		const double tmp = x / (2 * k);
+		term *= tmp * tmp;
+		sum += term;
+	}
+	return sum;
+}
+
+/**
+ * Design polyphase filter bank from the Kaiser-windowed sinc prototype.
+ *
+ * Coefficients of every phase are normalized to the unity gain, and they
+ * are stored in the reversed order, so the filter can be applied to the
+ * input history directly. */
+static int resampler_design(struct resampler *r, double cutoff, double beta) {
+
+	const unsigned int up = r->up;
+	const unsigned int taps = r->taps;
+	const size_t n = (size_t)taps * up;
+	const double center = (n - 1) / 2.0;
+	const double fc = cutoff / (2.0 * (up > r->down ? up : r->down));
+	const double i0_beta = bessel_i0(beta);
+	double *h;
+	size_t i;
+
+	if ((h = malloc(taps * sizeof(*h))) == NULL)
+		return -1;
+
+	for (i = 0; i < up; i++) {
+
+		double sum = 0;
+		unsigned int j;
+
+		for (j = 0; j < taps; j++) {
+			const double x = (double)j * up + i - center;
+			const double w = x / center;
+			double v = x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+			v *= bessel_i0(beta * sqrt(fmax(0, 1 - w * w))) / i0_beta;
+			sum += h[j] = v;
+		}
+
+		for (j = 0; j < taps; j++)
+			r->filter[i * taps + taps - 1 - j] = lrint(h[j] / sum * (1 << 14));
+
+	}
+
+	free(h);
+	return 0;
+}
+
+/**
+ * Initialize sample-rate converter.
+ *
+ * @param r Address of the resampler structure.
+ * @param quality Conversion quality.
+ * @param channels The number of channels of the interleaved signal.
+ * @param rate_in Sampling rate of the input signal.
+ * @param rate_out Sampling rate of the output signal.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int resampler_init(struct resampler *r, enum resampler_quality quality,
+		unsigned int channels, unsigned int rate_in, unsigned int rate_out) {
+
+	memset(r, 0, sizeof(*r));
+
+	if (quality == RESAMPLER_QUALITY_NONE ||
+			quality > RESAMPLER_QUALITY_BEST ||
+			channels == 0 || rate_in == 0 || rate_out == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const unsigned int div = gcd(rate_in, rate_out);
+	if (rate_out / div > RESAMPLER_MAX_PHASES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->channels = channels;
+	r->rate_in = rate_in;
+	r->rate_out = rate_out;
+	r->up = rate_out / div;
+	r->down = rate_in / div;
+	r->taps = resampler_profiles[quality].taps;
+	r->size = r->taps + RESAMPLER_BLOCK;
+
+	if ((r->filter = malloc(r->up * r->taps * sizeof(*r->filter))) == NULL ||
+			(r->history = malloc(r->size * channels * sizeof(*r->history))) == NULL ||
+			(r->staging = malloc(RESAMPLER_BLOCK * channels * sizeof(*r->staging))) == NULL ||
+			resampler_design(r, resampler_profiles[quality].cutoff,
+				resampler_profiles[quality].beta) == -1) {
+		resampler_free(r);
+		return -1;
+	}
+
+	resampler_reset(r);
+
+	return 0;
+}
+
+/**
+ * Release resources allocated by the resampler_init().
+ *
+ * It is safe to call this function for a zero-initialized structure. */
+void resampler_free(struct resampler *r) {
+	free(r->filter);
+	r->filter = NULL;
+	free(r->history);
+	r->history = NULL;
+	free(r->staging);
+	r->staging = NULL;
+}
+
+/**
+ * Drop the input history and the staged data. */
+void resampler_reset(struct resampler *r) {
+	/* the history is primed with silence, so the first output frame
+	 * will correspond to the first input frame */
+	memset(r->history, 0, r->size * r->channels * sizeof(*r->history));
+	r->len = r->taps - 1;
+	r->pos = 0;
+	r->phase = 0;
+	r->staging_len = 0;
+}
+
+/**
+ * Calculate the dot product of the signal and the Q14 filter. */
+static int16_t resampler_dot(const int16_t *x, const int16_t *h, unsigned int taps) {
+
+	int32_t acc = 0;
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+
+	__m128i sum = _mm_setzero_si128();
+	for (; i < taps; i += 8)
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(
+					_mm_loadu_si128((const __m128i *)&x[i]),
+					_mm_loadu_si128((const __m128i *)&h[i])));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	acc = _mm_cvtsi128_si32(sum);
+
+#elif defined(__ARM_NEON)
+
+	int32x4_t sum = vdupq_n_s32(0);
+	for (; i < taps; i += 8) {
+		const int16x8_t vx = vld1q_s16(&x[i]);
+		const int16x8_t vh = vld1q_s16(&h[i]);
+		sum = vmlal_s16(sum, vget_low_s16(vx), vget_low_s16(vh));
+		sum = vmlal_s16(sum, vget_high_s16(vx), vget_high_s16(vh));
+	}
+	const int32x2_t tmp = vadd_s32(vget_low_s32(sum), vget_high_s32(sum));
+	acc = vget_lane_s32(vpadd_s32(tmp, tmp), 0);
+
+#endif
+
+	for (; i < taps; i++)
+		acc += (int32_t)x[i] * h[i];
+
+	acc = (acc + (1 << 13)) >> 14;
+	if (acc > INT16_MAX)
+		return INT16_MAX;
+	if (acc < INT16_MIN)
+		return INT16_MIN;
+	return acc;
+}
+
+/**
+ * Convert the sampling rate of the interleaved signal.
+ *
+ * @param r Address of the resampler structure.
+ * @param in Address of the input signal.
+ * @param in_frames Address of the number of input frames. Upon return, it
+ *   is updated with the number of consumed frames. All frames are consumed
+ *   unless the output buffer is full.
+ * @param out Address of the buffer for the output signal.
+ * @param out_frames The number of frames which fit in the output buffer.
+ * @return This function returns the number of produced frames. */
+size_t resampler_process(struct resampler *r, const int16_t *in, size_t *in_frames,
+		int16_t *out, size_t out_frames) {
+
+	const unsigned int channels = r->channels;
+	size_t consumed = 0;
+	size_t produced = 0;
+	size_t i, n;
+	unsigned int c;
+
+	for (;;) {
+
+		/* de-interleave as much of the input as the history can hold */
+		if ((n = *in_frames - consumed) > r->size - r->len)
+			n = r->size - r->len;
+		for (c = 0; c < channels; c++) {
+			int16_t *dst = &r->history[c * r->size + r->len];
+			const int16_t *src = &in[consumed * channels + c];
+			for (i = 0; i < n; i++)
+				dst[i] = src[i * channels];
+		}
+		r->len += n;
+		consumed += n;
+
+		while (produced < out_frames && r->pos + r->taps <= r->len) {
+			const int16_t *h = &r->filter[r->phase * r->taps];
+			for (c = 0; c < channels; c++)
+				out[produced * channels + c] =
+					resampler_dot(&r->history[c * r->size + r->pos], h, r->taps);
+			produced++;
+			r->phase += r->down;
+			r->pos += r->phase / r->up;
+			r->phase %= r->up;
+		}
+
+		/* discard frames which are not needed anymore */
+		if ((n = r->pos < r->len ? r->pos : r->len) > 0) {
+			for (c = 0; c < channels; c++) {
+				int16_t *hist = &r->history[c * r->size];
+				memmove(hist, &hist[n], (r->len - n) * sizeof(*hist));
+			}
+			r->len -= n;
+			r->pos -= n;
+		}
+
+		if (consumed == *in_frames || produced == out_frames)
+			break;
+
+	}
+
+	*in_frames = consumed;
+	return produced;
+}
+
+/**
+ * Get the number of input frames required to produce given output.
+ *
+ * @param r Address of the resampler structure.
+ * @param out_frames The number of requested output frames.
+ * @return The number of input frames, which shall be passed to the
+ *   resampler_process() in order to produce exactly out_frames frames. */
+size_t resampler_input_frames(const struct resampler *r, size_t out_frames) {
+
+	if (out_frames == 0)
+		return 0;
+
+	const size_t last = r->pos + r->taps +
+		(r->phase + (out_frames - 1) * r->down) / r->up;
+
+	return last > r->len ? last - r->len : 0;
+}
+
+/**
+ * Get the delay introduced by the resampler in 1/10 of millisecond. */
+unsigned int resampler_get_delay(const struct resampler *r) {
+	if (r->filter == NULL)
+		return 0;
+	return r->taps / 2 * 10000 / r->rate_in;
+}
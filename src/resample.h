@@ -0,0 +1,80 @@
+/*
+ * BlueALSA - resample.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_RESAMPLE_H_
+#define BLUEALSA_RESAMPLE_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The maximal number of frames processed in a single block. */
+#define RESAMPLER_BLOCK 512
+/* The maximal number of polyphase filter phases. */
+#define RESAMPLER_MAX_PHASES 1024
+
+enum resampler_quality {
+	RESAMPLER_QUALITY_NONE = 0,
+	RESAMPLER_QUALITY_FAST,
+	RESAMPLER_QUALITY_MEDIUM,
+	RESAMPLER_QUALITY_BEST,
+};
+
+/**
+ * Polyphase sample-rate converter for the interleaved S16 signal.
+ *
+ * The conversion ratio is expressed as an irreducible fraction up/down,
+ * and for every output frame one of the up polyphase filters is applied
+ * to the input history. Filters are stored in the Q14 format, so the dot
+ * product can be calculated with the 16-bit integer SIMD instructions. */
+struct resampler {
+
+	unsigned int channels;
+	unsigned int rate_in;
+	unsigned int rate_out;
+
+	/* conversion ratio (output/input) */
+	unsigned int up;
+	unsigned int down;
+
+	/* number of taps per phase - always a multiple of 8 */
+	unsigned int taps;
+	/* polyphase filter bank - up x taps coefficients */
+	int16_t *filter;
+
+	/* de-interleaved input history - every channel has a space for the
+	 * size frames, the current filter window starts at the pos frame */
+	int16_t *history;
+	size_t size;
+	size_t len;
+	size_t pos;
+	unsigned int phase;
+
+	/* staging buffer for the interleaved PCM transfers, which can hold
+	 * RESAMPLER_BLOCK frames */
+	int16_t *staging;
+	size_t staging_len;
+
+};
+
+int resampler_init(struct resampler *r, enum resampler_quality quality,
+		unsigned int channels, unsigned int rate_in, unsigned int rate_out);
+void resampler_free(struct resampler *r);
+void resampler_reset(struct resampler *r);
+
+size_t resampler_process(struct resampler *r, const int16_t *in, size_t *in_frames,
+		int16_t *out, size_t out_frames);
+size_t resampler_input_frames(const struct resampler *r, size_t out_frames);
+unsigned int resampler_get_delay(const struct resampler *r);
+
+#endif
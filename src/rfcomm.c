@@ -27,53 +27,61 @@
 /**
  * Structure used for buffered reading from the RFCOMM. */
 struct at_reader {
+	struct at_tokenizer tok;
 	struct bt_at at;
-	char buffer[256];
-	/* pointer to the next message within the buffer */
-	char *next;
+	/* buffered data might contain more messages */
+	bool pending;
 };
 
 /**
  * Read AT message.
  *
- * Upon error it is required to set the next pointer of the reader structure
- * to NULL. Otherwise, this function might fail indefinitely.
+ * If there is no pending data in the reader buffer, this function reads
+ * from the RFCOMM socket, so it should be called only if the socket is
+ * readable or the pending flag of the reader structure is set.
  *
  * @param fd RFCOMM socket file descriptor.
  * @param reader Pointer to initialized reader structure.
  * @return On success this function returns 0. Otherwise, -1 is returned and
- *   errno is set to indicate the error. */
+ *   errno is set to indicate the error. If the message is not complete yet,
+ *   errno is set to EAGAIN. */
 static int rfcomm_read_at(int fd, struct at_reader *reader) {
 
-	char *buffer = reader->buffer;
-	char *msg = reader->next;
-	char *tmp;
+	ffb_uint8_t *buffer = &reader->tok.buffer;
 
 	/* In case of reading more than one message from the RFCOMM, we have to
 	 * parse all of them before we can read from the socket once more. */
-	if (msg == NULL) {
+	if (!reader->pending) {
 
 		ssize_t len;
 
 retry:
-		if ((len = read(fd, buffer, sizeof(reader->buffer))) == -1) {
+		if ((len = read(fd, buffer->tail, ffb_len_in(buffer))) == -1) {
 			if (errno == EINTR)
 				goto retry;
 			return -1;
 		}
 
-		buffer[len] = '\0';
-		msg = buffer;
+		if (len == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+
+		ffb_seek(buffer, len);
 	}
 
 	/* parse AT message received from the RFCOMM */
-	if ((tmp = at_parse(msg, &reader->at)) == NULL) {
-		reader->next = msg;
-		errno = EBADMSG;
+	switch (at_tokenizer_next(&reader->tok, &reader->at)) {
+	case 0:
+		reader->pending = false;
+		errno = EAGAIN;
+		return -1;
+	case -1:
+		reader->pending = true;
 		return -1;
 	}
 
-	reader->next = tmp[0] != '\0' ? tmp : NULL;
+	reader->pending = true;
 	return 0;
 }
 
@@ -316,7 +324,7 @@ static int rfcomm_handler_vgm_set_cb(struct rfcomm_conn *c, const struct bt_at *
 	if (rfcomm_write_at(fd, AT_TYPE_RESP, NULL, "OK") == -1)
 		return -1;
 
-	bluealsa_ctl_event(BA_EVENT_UPDATE_VOLUME);
+	bluealsa_ctl_event_transport(BA_EVENT_UPDATE_VOLUME, t->rfcomm.sco);
 	return 0;
 }
 
@@ -330,7 +338,7 @@ static int rfcomm_handler_vgs_set_cb(struct rfcomm_conn *c, const struct bt_at *
 	if (rfcomm_write_at(fd, AT_TYPE_RESP, NULL, "OK") == -1)
 		return -1;
 
-	bluealsa_ctl_event(BA_EVENT_UPDATE_VOLUME);
+	bluealsa_ctl_event_transport(BA_EVENT_UPDATE_VOLUME, t->rfcomm.sco);
 	return 0;
 }
 
@@ -374,7 +382,7 @@ static int rfcomm_handler_resp_bcs_ok_cb(struct rfcomm_conn *c, const struct bt_
 	/* When codec selection is completed, notify connected clients, that
 	 * transport has been changed. Note, that this event might be emitted
 	 * for an active transport - codec switching. */
-	bluealsa_ctl_event(BA_EVENT_TRANSPORT_CHANGED);
+	bluealsa_ctl_event_transport(BA_EVENT_TRANSPORT_CHANGED, c->t->rfcomm.sco);
 	return 0;
 }
 
@@ -563,9 +571,16 @@ void *rfcomm_thread(void *arg) {
 		.t = t,
 	};
 
-	struct at_reader reader = { .next = NULL };
+	struct at_reader reader = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(at_tokenizer_free), &reader.tok);
+
+	if (at_tokenizer_init(&reader.tok) == -1) {
+		error("Couldn't create AT tokenizer: %s", strerror(errno));
+		goto fail;
+	}
+
 	struct pollfd pfds[] = {
-		{ t->sig_fd[0], POLLIN, 0 },
+		{ t->sig_fd, POLLIN, 0 },
 		{ t->bt_fd, POLLIN, 0 },
 	};
 
@@ -655,7 +670,7 @@ void *rfcomm_thread(void *arg) {
 					rfcomm_set_hfp_state(&conn, HFP_CONNECTED);
 					/* fall-through */
 				case HFP_CONNECTED:
-					bluealsa_ctl_event(BA_EVENT_TRANSPORT_ADDED);
+					bluealsa_ctl_event_transport(BA_EVENT_TRANSPORT_ADDED, t->rfcomm.sco);
 				}
 
 			if (t->profile == BLUETOOTH_PROFILE_HFP_AG)
@@ -687,7 +702,7 @@ void *rfcomm_thread(void *arg) {
 					rfcomm_set_hfp_state(&conn, HFP_CONNECTED);
 					/* fall-through */
 				case HFP_CONNECTED:
-					bluealsa_ctl_event(BA_EVENT_TRANSPORT_ADDED);
+					bluealsa_ctl_event_transport(BA_EVENT_TRANSPORT_ADDED, t->rfcomm.sco);
 				}
 
 			if (conn.handler != NULL) {
@@ -698,7 +713,7 @@ void *rfcomm_thread(void *arg) {
 		}
 
 		/* skip poll() since we've got unprocessed data */
-		if (reader.next != NULL)
+		if (reader.pending)
 			goto read;
 
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
@@ -717,42 +732,36 @@ void *rfcomm_thread(void *arg) {
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
 		if (pfds[0].revents & POLLIN) {
-			/* dispatch incoming event */
-
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
-
-			switch (sig) {
-			case TRANSPORT_SET_VOLUME:
-				if (conn.mic_gain != t->rfcomm.sco->sco.mic_gain) {
-					char tmp[16];
-					int gain = conn.mic_gain = t->rfcomm.sco->sco.mic_gain;
-					debug("Setting microphone gain: %d", gain);
-					sprintf(tmp, "+VGM=%d", gain);
-					if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RESP, NULL, tmp) == -1)
-						goto ioerror;
-				}
-				if (conn.spk_gain != t->rfcomm.sco->sco.spk_gain) {
-					char tmp[16];
-					int gain = conn.spk_gain = t->rfcomm.sco->sco.spk_gain;
-					debug("Setting speaker gain: %d", gain);
-					sprintf(tmp, "+VGS=%d", gain);
-					if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RESP, NULL, tmp) == -1)
+			/* dispatch incoming commands */
+
+			struct ba_transport_cmd cmd;
+			while (transport_recv_command(t, &cmd))
+				switch (cmd.sig) {
+				case TRANSPORT_SET_VOLUME:
+					if (conn.mic_gain != cmd.volume.ch2_volume) {
+						char tmp[16];
+						int gain = conn.mic_gain = cmd.volume.ch2_volume;
+						debug("Setting microphone gain: %d", gain);
+						sprintf(tmp, "+VGM=%d", gain);
+						if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RESP, NULL, tmp) == -1)
+							goto ioerror;
+					}
+					if (conn.spk_gain != cmd.volume.ch1_volume) {
+						char tmp[16];
+						int gain = conn.spk_gain = cmd.volume.ch1_volume;
+						debug("Setting speaker gain: %d", gain);
+						sprintf(tmp, "+VGS=%d", gain);
+						if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RESP, NULL, tmp) == -1)
+							goto ioerror;
+					}
+					break;
+				case TRANSPORT_SEND_RFCOMM:
+					if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RAW, cmd.rfcomm, NULL) == -1)
 						goto ioerror;
+					break;
+				default:
+					break;
 				}
-				break;
-			case TRANSPORT_SEND_RFCOMM: {
-				char cmd[32];
-				if (read(pfds[0].fd, cmd, sizeof(cmd)) != sizeof(cmd))
-					warn("Couldn't read RFCOMM command: %s", strerror(errno));
-				if (rfcomm_write_at(pfds[1].fd, AT_TYPE_RAW, cmd, NULL) == -1)
-					goto ioerror;
-				break;
-			}
-			default:
-				break;
-			}
 
 		}
 
@@ -762,9 +771,10 @@ void *rfcomm_thread(void *arg) {
 read:
 			if (rfcomm_read_at(pfds[1].fd, &reader) == -1)
 				switch (errno) {
+				case EAGAIN:
+					continue;
 				case EBADMSG:
-					warn("Invalid AT message: %s", reader.next);
-					reader.next = NULL;
+					warn("Invalid AT message: %s", reader.at.command);
 					continue;
 				default:
 					goto ioerror;
@@ -817,5 +827,6 @@ ioerror:
 fail:
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
 	return NULL;
 }
@@ -341,20 +341,138 @@ int bluealsa_set_transport_volume(int fd, const struct ba_msg_transport *transpo
 }
 
 /**
- * Open PCM transport.
+ * Set PCM transport group.
+ *
+ * PCM opened for one of the A2DP source transports within the group is
+ * transmitted to all other transports of the same group.
  *
  * @param fd Opened socket file descriptor.
  * @param transport Address to the transport structure with the addr, type
  *   and stream fields set - other fields are not used by this function.
- * @return PCM FIFO file descriptor, or -1 on error. */
-int bluealsa_open_transport(int fd, const struct ba_msg_transport *transport) {
+ * @param group Transport group identifier. Zero removes the transport from
+ *   the group it belongs to.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int bluealsa_set_transport_group(int fd, const struct ba_msg_transport *transport,
+		unsigned int group) {
+
+	struct ba_request req = {
+		.command = BA_COMMAND_TRANSPORT_SET_GROUP,
+		.addr = transport->addr,
+		.type = transport->type,
+		.stream = transport->stream,
+		.group = group,
+	};
+
+	return bluealsa_send_request(fd, &req);
+}
+
+/**
+ * Start or stop capturing the BT and PCM traffic.
+ *
+ * The capture ring is stored by the server in the BLUEALSA_RUN_STATE_DIR
+ * directory. When the ring is full, the oldest records are overwritten.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param records The number of records in the capture ring. Zero stops
+ *   the capture.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int bluealsa_set_capture(int fd, unsigned int records) {
+	struct ba_request req = {
+		.command = BA_COMMAND_CAPTURE,
+		.capture = records,
+	};
+	return bluealsa_send_request(fd, &req);
+}
+
+/**
+ * Keep PCM transport acquired ahead of the PCM open.
+ *
+ * This function returns when the transport is ready for the audio transfer.
+ * Subsequent PCM open will not have to wait for the BT device.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param transport Address to the transport structure with the addr, type
+ *   and stream fields set - other fields are not used by this function.
+ * @param standby The number of seconds for keeping the transport acquired
+ *   without the PCM. Negative value keeps the transport acquired until the
+ *   next request, zero restores the default keep-alive time.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int bluealsa_set_transport_standby(int fd, const struct ba_msg_transport *transport,
+		int standby) {
+
+	struct ba_request req = {
+		.command = BA_COMMAND_TRANSPORT_STANDBY,
+		.addr = transport->addr,
+		.type = transport->type,
+		.stream = transport->stream,
+		.standby = standby,
+	};
+
+	return bluealsa_send_request(fd, &req);
+}
+
+/**
+ * Get PCM transport statistics.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param transport Address to the transport structure with the addr, type
+ *   and stream fields set - other fields are not used by this function.
+ * @param stats An address where the transport statistics will be stored.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int bluealsa_get_transport_stats(int fd, const struct ba_msg_transport *transport,
+		struct ba_msg_transport_stats *stats) {
+
+	struct ba_msg_status status = { 0xAB };
+	struct ba_request req = {
+		.command = BA_COMMAND_TRANSPORT_STATS,
+		.addr = transport->addr,
+		.type = transport->type,
+		.stream = transport->stream,
+	};
+	ssize_t len;
+
+	/* older server might send shorter message */
+	memset(stats, 0, sizeof(*stats));
+
+	if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) == -1)
+		return -1;
+	if ((len = read(fd, stats, sizeof(*stats))) == -1)
+		return -1;
+
+	/* in case of error, status message is returned */
+	if (len == sizeof(status)) {
+		memcpy(&status, stats, sizeof(status));
+		errno = bluealsa_status_to_errno(&status);
+		return -1;
+	}
+
+	if (read(fd, &status, sizeof(status)) == -1)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Send request and receive transferred file descriptors.
+ *
+ * @return Upon success this function returns the number of received file
+ *   descriptors. Otherwise, -1 is returned and errno is set appropriately. */
+static int bluealsa_open_transport_(int fd, const struct ba_msg_transport *transport,
+		enum ba_command command, enum ba_pcm_transfer transfer, int *fds, size_t nfds) {
 
 	struct ba_msg_status status = { 0xAB };
 	struct ba_request req = {
-		.command = BA_COMMAND_PCM_OPEN,
+		.command = command,
 		.addr = transport->addr,
 		.type = transport->type,
 		.stream = transport->stream,
+		.transfer = transfer,
+		.sampling = transport->sampling,
+		.format = transport->format,
 	};
 	char buf[256] = "";
 	struct iovec io = {
@@ -368,11 +486,12 @@ int bluealsa_open_transport(int fd, const struct ba_msg_transport *transport) {
 		.msg_controllen = sizeof(buf),
 	};
 	ssize_t len;
+	size_t i, count;
 
 #ifdef DEBUG
 	char addr_[18];
 	ba2str_(&req.addr, addr_);
-	debug("Requesting PCM open for %s", addr_);
+	debug("Requesting PCM file descriptors for %s", addr_);
 #endif
 
 	if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) == -1)
@@ -389,10 +508,82 @@ int bluealsa_open_transport(int fd, const struct ba_msg_transport *transport) {
 		return -1;
 	}
 
+	const int *cmsg_fds = (int *)CMSG_DATA(cmsg);
+	count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
 	if (read(fd, &status, sizeof(status)) == -1)
+		goto fail;
+
+	if (count != nfds) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	for (i = 0; i < count; i++)
+		fds[i] = cmsg_fds[i];
+	return count;
+
+fail:
+	for (i = 0; i < count; i++)
+		close(cmsg_fds[i]);
+	return -1;
+}
+
+/**
+ * Open PCM transport.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param transport Address to the transport structure with the addr, type,
+ *   stream, sampling and format fields set - other fields are not used by
+ *   this function. If the sampling rate differs from the one reported by
+ *   the server, audio will be resampled by the server (A2DP only). The PCM
+ *   sample format shall be one of the formats reported by the server.
+ * @return PCM FIFO file descriptor, or -1 on error. */
+int bluealsa_open_transport(int fd, const struct ba_msg_transport *transport) {
+	int pcm_fd;
+	if (bluealsa_open_transport_(fd, transport, BA_COMMAND_PCM_OPEN,
+				BA_PCM_TRANSFER_FIFO, &pcm_fd, 1) == -1)
 		return -1;
+	return pcm_fd;
+}
 
-	return *((int *)CMSG_DATA(cmsg));
+/**
+ * Open PCM transport with the shared memory ring buffer.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param transport Address to the transport structure with the addr, type,
+ *   stream and sampling fields set - other fields are not used by this
+ *   function. See the bluealsa_open_transport() for the sampling field.
+ * @param fds Address where the memfd, the data doorbell and the space
+ *   doorbell file descriptors will be stored (in that order). These file
+ *   descriptors shall be passed to the pcm_ring_attach() function.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned. */
+int bluealsa_open_transport_shm(int fd, const struct ba_msg_transport *transport,
+		int fds[3]) {
+	if (bluealsa_open_transport_(fd, transport, BA_COMMAND_PCM_OPEN,
+				BA_PCM_TRANSFER_SHM, fds, 3) == -1)
+		return -1;
+	return 0;
+}
+
+/**
+ * Get PCM status page file descriptor.
+ *
+ * The status page is available once the PCM has been opened, and it is
+ * published by the server IO thread, so it is possible to read the current
+ * PCM delay without communicating with the server.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param transport Address to the transport structure with the addr, type
+ *   and stream fields set - other fields are not used by this function.
+ * @return Read-only memfd file descriptor, which shall be passed to the
+ *   pcm_status_attach() function, or -1 on error. */
+int bluealsa_open_transport_status(int fd, const struct ba_msg_transport *transport) {
+	int status_fd;
+	if (bluealsa_open_transport_(fd, transport, BA_COMMAND_PCM_STATUS,
+				BA_PCM_TRANSFER_FIFO, &status_fd, 1) == -1)
+		return -1;
+	return status_fd;
 }
 
 /**
@@ -34,7 +34,20 @@ int bluealsa_get_transport_volume(int fd, const struct ba_msg_transport *transpo
 int bluealsa_set_transport_volume(int fd, const struct ba_msg_transport *transport,
 		bool ch1_muted, int ch1_volume, bool ch2_muted, int ch2_volume);
 
+int bluealsa_set_transport_group(int fd, const struct ba_msg_transport *transport,
+		unsigned int group);
+int bluealsa_set_transport_standby(int fd, const struct ba_msg_transport *transport,
+		int standby);
+
+int bluealsa_set_capture(int fd, unsigned int records);
+
+int bluealsa_get_transport_stats(int fd, const struct ba_msg_transport *transport,
+		struct ba_msg_transport_stats *stats);
+
 int bluealsa_open_transport(int fd, const struct ba_msg_transport *transport);
+int bluealsa_open_transport_shm(int fd, const struct ba_msg_transport *transport,
+		int fds[3]);
+int bluealsa_open_transport_status(int fd, const struct ba_msg_transport *transport);
 int bluealsa_close_transport(int fd, const struct ba_msg_transport *transport);
 int bluealsa_pause_transport(int fd, const struct ba_msg_transport *transport, bool pause);
 int bluealsa_drain_transport(int fd, const struct ba_msg_transport *transport);
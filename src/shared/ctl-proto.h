@@ -21,7 +21,10 @@
 /* Location where the control socket and pipes are stored. */
 #define BLUEALSA_RUN_STATE_DIR RUN_STATE_DIR "/bluealsa"
 /* Version of the controller communication protocol. */
-#define BLUEALSA_CRL_PROTO_VERSION 0x0300
+#define BLUEALSA_CRL_PROTO_VERSION 0x0404
+/* The oldest protocol version still accepted by the controller. Clients
+ * using it can only open PCM with the BA_PCM_TRANSFER_FIFO mode. */
+#define BLUEALSA_CRL_PROTO_VERSION_MIN 0x0300
 
 enum ba_command {
 	BA_COMMAND_PING,
@@ -37,6 +40,11 @@ enum ba_command {
 	BA_COMMAND_PCM_RESUME,
 	BA_COMMAND_PCM_DRAIN,
 	BA_COMMAND_RFCOMM_SEND,
+	BA_COMMAND_TRANSPORT_STATS,
+	BA_COMMAND_PCM_STATUS,
+	BA_COMMAND_TRANSPORT_SET_GROUP,
+	BA_COMMAND_TRANSPORT_STANDBY,
+	BA_COMMAND_CAPTURE,
 	__BA_COMMAND_MAX
 };
 
@@ -56,6 +64,27 @@ enum ba_event {
 	BA_EVENT_TRANSPORT_REMOVED = 1 << 2,
 	BA_EVENT_UPDATE_BATTERY    = 1 << 3,
 	BA_EVENT_UPDATE_VOLUME     = 1 << 4,
+	BA_EVENT_UPDATE_DELAY      = 1 << 5,
+	BA_EVENT_UPDATE_STATE      = 1 << 6,
+	/* Subscription flag (never set in the event mask) which selects the
+	 * ba_msg_event_v2 message format, i.e. every event is delivered with
+	 * the affected transport and its changed fields. */
+	BA_EVENT_V2                = 1 << 16,
+};
+
+/* Transport fields carried by the ba_msg_event_v2 message. */
+enum ba_event_field {
+	BA_EVENT_FIELD_VOLUME  = 1 << 0,
+	BA_EVENT_FIELD_DELAY   = 1 << 1,
+	BA_EVENT_FIELD_BATTERY = 1 << 2,
+	BA_EVENT_FIELD_STATE   = 1 << 3,
+};
+
+enum ba_transport_state_code {
+	BA_TRANSPORT_STATE_IDLE = 0,
+	BA_TRANSPORT_STATE_PENDING,
+	BA_TRANSPORT_STATE_ACTIVE,
+	BA_TRANSPORT_STATE_PAUSED,
 };
 
 enum ba_pcm_type {
@@ -74,6 +103,43 @@ enum ba_pcm_stream {
 	BA_PCM_STREAM_DUPLEX,
 };
 
+enum ba_pcm_transfer {
+	/* PCM data is transfered via the pipe - one file descriptor is
+	 * passed to the client with the SCM_RIGHTS control message */
+	BA_PCM_TRANSFER_FIFO = 0,
+	/* PCM data is transfered via the shared memory ring buffer - the
+	 * memfd file descriptor, and the data and space doorbell eventfd
+	 * descriptors are passed to the client (in that order) */
+	BA_PCM_TRANSFER_SHM,
+};
+
+enum ba_pcm_format {
+	/* signed 16-bit little-endian (the default one) */
+	BA_PCM_FORMAT_S16_LE = 0,
+	/* signed 24-bit little-endian packed in 3 bytes */
+	BA_PCM_FORMAT_S24_3LE,
+	/* signed 32-bit little-endian */
+	BA_PCM_FORMAT_S32_LE,
+	/* 32-bit IEEE float little-endian in the range [-1.0, 1.0] */
+	BA_PCM_FORMAT_FLOAT_LE,
+	/* Codec frames in the configuration reported with the transport. For
+	 * the A2DP source, frames are only packetized by the server: SBC frames,
+	 * MPEG-1,2 audio frames or MPEG-2,4 AAC framed with the LOAS. For the
+	 * A2DP sink, the RTP payload is forwarded without decoding, and every
+	 * payload is preceded by the ba_pcm_encoded_frame header. */
+	BA_PCM_FORMAT_ENCODED,
+};
+
+/* Header of the encoded data block read from the A2DP sink PCM. It is
+ * followed by the len bytes of SBC frames or by the AAC audioMuxElement
+ * (the LATM stream without the LOAS sync layer). */
+struct __attribute__ ((packed)) ba_pcm_encoded_frame {
+	/* RTP time-stamp of the first frame in the block */
+	uint32_t timestamp;
+	/* length of the encoded data */
+	uint16_t len;
+};
+
 struct __attribute__ ((packed)) ba_request {
 
 	enum ba_command command;
@@ -104,10 +170,35 @@ struct __attribute__ ((packed)) ba_request {
 			uint8_t ch2_volume:7;
 		};
 
+		/* Requested PCM data transfer mode, the PCM sampling rate and the
+		 * sample format. If the sampling rate is zero or it is equal to the
+		 * transport one, audio is not resampled by the server. Formats other
+		 * than the S16_LE can not be resampled.
+		 * used by BA_COMMAND_PCM_OPEN */
+		struct {
+			enum ba_pcm_transfer transfer;
+			uint32_t sampling;
+			uint8_t format;
+		};
+
 		/* RFCOMM command string to send
 		 * used by BA_COMMAND_RFCOMM_SEND */
 		char rfcomm_command[32];
 
+		/* transport group identifier (zero to leave the group)
+		 * used by BA_COMMAND_TRANSPORT_SET_GROUP */
+		uint8_t group;
+
+		/* number of seconds for keeping the transport acquired without the
+		 * PCM (negative for infinity, zero to restore the default value)
+		 * used by BA_COMMAND_TRANSPORT_STANDBY */
+		int32_t standby;
+
+		/* Number of records in the capture ring (zero stops the capture).
+		 * The ring is stored in the BLUEALSA_RUN_STATE_DIR/<hci>.capture.
+		 * used by BA_COMMAND_CAPTURE */
+		uint32_t capture;
+
 	};
 
 };
@@ -125,6 +216,48 @@ struct __attribute__ ((packed)) ba_msg_event {
 	enum ba_event mask;
 };
 
+/**
+ * Event message delivered to clients subscribed with the BA_EVENT_V2 flag.
+ *
+ * Clients can tell this message from the ba_msg_event one by its size. The
+ * sequence number is incremented for every event generated for the client,
+ * also for the one which could not be delivered (e.g. the client socket
+ * buffer is full). Upon a gap in the sequence, the client shall fetch the
+ * transport list once again. */
+struct __attribute__ ((packed)) ba_msg_event_v2 {
+
+	/* bit-mask with events */
+	enum ba_event mask;
+	/* event sequence number */
+	uint32_t seq;
+
+	/* Affected transport. For the battery update it is the device only, so
+	 * the type is set to BA_PCM_TYPE_NULL. */
+	bdaddr_t addr;
+	enum ba_pcm_type type;
+	enum ba_pcm_stream stream;
+
+	/* bit-mask with valid fields (see the ba_event_field) */
+	uint8_t fields;
+
+	/* transport volume - the same as in the ba_msg_transport */
+	uint8_t ch1_muted:1;
+	uint8_t ch1_volume:7;
+	uint8_t ch2_muted:1;
+	uint8_t ch2_volume:7;
+
+	/* transport delay */
+	uint16_t delay;
+
+	/* device battery level */
+	uint8_t battery:1;
+	uint8_t battery_level:7;
+
+	/* transport state (see the ba_transport_state_code) */
+	uint8_t state;
+
+};
+
 struct __attribute__ ((packed)) ba_msg_device {
 
 	/* device address */
@@ -165,6 +298,83 @@ struct __attribute__ ((packed)) ba_msg_transport {
 	/* transport delay in 1/10 of millisecond */
 	uint16_t delay;
 
+	/* Bit-mask of PCM sample formats (1 << BA_PCM_FORMAT_*) supported by
+	 * the transport and the format requested upon the PCM open. Fields are
+	 * appended at the end, so older clients can still read this message. */
+	uint8_t formats;
+	uint8_t format;
+
+	/* A2DP codec configuration selected for the transport, which shall be
+	 * followed by the client writing the encoded data. */
+	uint8_t cconfig_size;
+	uint8_t cconfig[32];
+
+};
+
+/* Number of bins in the codec processing time histogram. */
+#define BA_STATS_CODEC_TIME_BINS 12
+
+/**
+ * Transport performance counters.
+ *
+ * All counters are accumulated since the transport creation. */
+struct __attribute__ ((packed)) ba_msg_transport_stats {
+
+	/* Histogram of the time spent on encoding (or decoding) a single BT
+	 * packet. The first bin counts packets processed in less than 16 us,
+	 * and every next bin doubles the upper limit (bin N counts times in
+	 * the range [2^(N+3), 2^(N+4)) us). The last bin has no upper limit. */
+	uint32_t codec_time[BA_STATS_CODEC_TIME_BINS];
+
+	/* time (in milliseconds) spent on waiting for the BT socket */
+	uint32_t bt_blocked;
+	/* the highest number of bytes queued in the BT socket */
+	uint32_t bt_coutq_max;
+	/* number of packets sent (or received) over the BT socket */
+	uint32_t bt_packets;
+	/* number of packets which were dropped (e.g. write error, too late
+	 * arrival or jitter buffer overflow) */
+	uint32_t bt_dropped;
+
+	/* Number of PCM underruns. For playback it is the number of times when
+	 * samples were not delivered on time, for capture it is the number of
+	 * jitter buffer underruns. */
+	uint32_t pcm_underruns;
+
+	/* number of missing RTP packets (A2DP sink only) */
+	uint32_t rtp_gaps;
+
+	/* accumulated time (in milliseconds) skipped by the transfer pacing
+	 * after overruns and the longest overdue time (in microseconds) */
+	uint32_t sync_skipped;
+	uint32_t sync_overdue_max;
+	/* Fields below are appended at the end, so older clients can still
+	 * read this message. Newer clients shall zero-initialize the message,
+	 * in case of the reply from the older server. */
+	/* full codec identifier (the transport message holds the lower byte) */
+	uint16_t codec;
+	/* Codec specific quality parameter currently used by the encoder: the
+	 * bitpool for SBC, the bit rate (in bits per second) for AAC and the
+	 * encode quality mode index (EQMID) for LDAC. Zero if not applicable. */
+	uint32_t codec_param;
+	/* overall time (in microseconds) spent on the codec processing, which
+	 * can be used to calculate the codec CPU share */
+	uint64_t codec_time_total;
+	/* number of bytes sent (or received) over the BT socket */
+	uint64_t bt_bytes;
+	/* the last sampled number of bytes queued in the BT socket */
+	uint32_t bt_coutq;
+	/* current and peak amount of memory used by the IO buffers */
+	uint32_t buffer_bytes;
+	uint32_t buffer_peak;
+	/* Drift (in ppm) of the remote clock relative to the local monotonic
+	 * clock, estimated from RTP time-stamps (A2DP sink only). Positive value
+	 * means that the remote device delivers audio faster than nominal. */
+	int32_t drift_ppm;
+	/* number of times when the PCM samples were dropped, because the client
+	 * has not read the PCM on time (transports served by the IO engine) */
+	uint32_t pcm_overruns;
+
 };
 
 #endif
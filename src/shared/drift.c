@@ -0,0 +1,298 @@
+/*
+ * BlueALSA - drift.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "drift.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Proportional gain of the occupancy controller (in ppm per second of the
+ * occupancy error) - 10 ms error is corrected with 1000 ppm. */
+#define DRIFT_CONTROLLER_KP 1e5
+/* Integral time of the occupancy controller (in seconds). */
+#define DRIFT_CONTROLLER_TI 30.0
+
+#define drift_fabs(x) ((x) < 0 ? -(x) : (x))
+#define drift_round(x) ((long)((x) < 0 ? (x) - 0.5 : (x) + 0.5))
+
+/**
+ * Initialize clock drift estimator.
+ *
+ * @param d Address of the estimator structure.
+ * @param rate Nominal sampling rate of the stream. */
+void drift_estimator_init(struct drift_estimator *d, unsigned int rate) {
+	memset(d, 0, sizeof(*d));
+	d->rate = rate;
+}
+
+/**
+ * Restart the time line of the drift estimator.
+ *
+ * The last estimated drift is retained, since it is a property of the
+ * remote clock, which does not change upon the stream restart. */
+void drift_estimator_reset(struct drift_estimator *d) {
+	d->started = false;
+	d->head = 0;
+	d->len = 0;
+}
+
+static void drift_estimator_start(struct drift_estimator *d, uint32_t rtp_ts,
+		uint64_t now) {
+	d->started = true;
+	d->ts0 = d->ts = now;
+	d->rtp_ts = rtp_ts;
+	d->rtp_ticks = 0;
+	d->window_ts = now;
+	d->window_min = INT64_MAX;
+}
+
+/**
+ * Update drift estimator with the RTP time-stamp of the received packet.
+ *
+ * @param d Address of the estimator structure.
+ * @param rtp_ts RTP time-stamp in the host byte order.
+ * @param ts Local time-stamp of the packet reception. */
+void drift_estimator_update(struct drift_estimator *d, uint32_t rtp_ts,
+		const struct timespec *ts) {
+
+	const uint64_t now = (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+
+	if (!d->started) {
+		drift_estimator_start(d, rtp_ts, now);
+		return;
+	}
+
+	const int32_t ticks = rtp_ts - d->rtp_ts;
+
+	/* restart the time line after the stream pause or the time-stamp
+	 * discontinuity (e.g. the remote device has restarted the stream) */
+	if ((int64_t)(now - d->ts) > 1000000 || ticks < 0) {
+		drift_estimator_reset(d);
+		drift_estimator_start(d, rtp_ts, now);
+		return;
+	}
+
+	d->ts = now;
+	d->rtp_ts = rtp_ts;
+	d->rtp_ticks += ticks;
+
+	/* packets might be reordered by the jitter */
+	const int64_t elapsed = now - d->ts0;
+
+	if (d->rtp_rate == 0) {
+
+		if (elapsed < 2000000)
+			return;
+
+		/* The RTP clock rate shall be equal to the sampling rate, however,
+		 * some sources use the 10 kHz clock instead. Any other clock is not
+		 * supported, so the time line is restarted in such case. */
+		const double rate = d->rtp_ticks * 1e6 / elapsed;
+		if (drift_fabs(rate - d->rate) < d->rate * 0.05)
+			d->rtp_rate = d->rate;
+		else if (drift_fabs(rate - 10000) < 10000 * 0.05)
+			d->rtp_rate = 10000;
+		else {
+			drift_estimator_reset(d);
+			return;
+		}
+
+	}
+
+	const int64_t offset = elapsed - (int64_t)(d->rtp_ticks * 1000000 / d->rtp_rate);
+
+	/* the remote clock is way off - most likely we have missed the
+	 * time-stamp discontinuity, so the time line has to be restarted */
+	if (llabs(offset) > 1000000) {
+		drift_estimator_reset(d);
+		return;
+	}
+
+	if (offset < d->window_min)
+		d->window_min = offset;
+
+	if (now - d->window_ts < DRIFT_WINDOW_USEC)
+		return;
+
+	d->mins[d->head] = d->window_min;
+	d->mins_ts[d->head] = now;
+	d->head = (d->head + 1) % DRIFT_WINDOWS;
+	if (d->len < DRIFT_WINDOWS)
+		d->len++;
+
+	d->window_ts = now;
+	d->window_min = INT64_MAX;
+
+	/* at least two window intervals are required for the estimation */
+	if (d->len < 3)
+		return;
+
+	const size_t newest = (d->head + DRIFT_WINDOWS - 1) % DRIFT_WINDOWS;
+	const size_t oldest = (d->head + DRIFT_WINDOWS - d->len) % DRIFT_WINDOWS;
+	const double slope = (double)(d->mins[newest] - d->mins[oldest]) /
+		(d->mins_ts[newest] - d->mins_ts[oldest]);
+
+	/* offset decreases if the remote clock is faster */
+	const long ppm = drift_round(-slope * 1e6);
+	if (labs(ppm) < 10 * DRIFT_PPM_MAX)
+		d->ppm = ppm;
+
+}
+
+/**
+ * Initialize buffer occupancy controller.
+ *
+ * @param c Address of the controller structure.
+ * @param rate Sampling rate of the stream.
+ * @param target Target buffer occupancy in frames. */
+void drift_controller_init(struct drift_controller *c, unsigned int rate,
+		size_t target) {
+	memset(c, 0, sizeof(*c));
+	c->rate = rate;
+	c->target = target;
+}
+
+/**
+ * Update buffer occupancy controller.
+ *
+ * @param c Address of the controller structure.
+ * @param level Current buffer occupancy in frames.
+ * @param elapsed_usec Time elapsed since the last update.
+ * @param feedforward Known clock drift (in ppm), e.g. estimated by the
+ *   drift estimator. It is added to the controller output directly.
+ * @return This function returns the rate correction (in ppm) which shall
+ *   be applied. Positive value means, that the buffer shall be consumed
+ *   faster than the nominal rate. */
+int drift_controller_update(struct drift_controller *c, size_t level,
+		unsigned int elapsed_usec, int feedforward) {
+
+	const double dt = elapsed_usec / 1e6;
+
+	/* smooth the occupancy with the time constant of one second */
+	if (!c->primed) {
+		c->level = level;
+		c->primed = true;
+	}
+	else
+		c->level += (dt < 1.0 ? dt : 1.0) * ((double)level - c->level);
+
+	const double error = (c->level - c->target) / c->rate;
+	double ppm = feedforward + DRIFT_CONTROLLER_KP *
+		(error + c->integral / DRIFT_CONTROLLER_TI);
+
+	/* anti-windup - do not integrate while the output is saturated */
+	if (drift_fabs(ppm) < DRIFT_PPM_MAX)
+		c->integral += error * dt;
+
+	if (ppm > DRIFT_PPM_MAX)
+		ppm = DRIFT_PPM_MAX;
+	if (ppm < -DRIFT_PPM_MAX)
+		ppm = -DRIFT_PPM_MAX;
+
+	return c->ppm = drift_round(ppm);
+}
+
+/**
+ * Initialize drift resampler.
+ *
+ * @param r Address of the resampler structure.
+ * @param channels The number of channels of the interleaved signal.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int drift_resampler_init(struct drift_resampler *r, unsigned int channels) {
+
+	if (channels == 0 || channels > DRIFT_CHANNELS_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->channels = channels;
+	r->step = 1ULL << 32;
+	drift_resampler_reset(r);
+
+	return 0;
+}
+
+/**
+ * Reset the resampler state, e.g. upon the stream restart. */
+void drift_resampler_reset(struct drift_resampler *r) {
+	/* the first output frame is the first input frame */
+	r->pos = 1ULL << 32;
+	memset(r->last, 0, sizeof(r->last));
+}
+
+/**
+ * Set the rate correction of the resampler.
+ *
+ * @param r Address of the resampler structure.
+ * @param ppm Rate correction - positive value means, that the input is
+ *   consumed faster, so less output frames are generated. */
+void drift_resampler_set_ppm(struct drift_resampler *r, int ppm) {
+	if (ppm > DRIFT_PPM_MAX)
+		ppm = DRIFT_PPM_MAX;
+	if (ppm < -DRIFT_PPM_MAX)
+		ppm = -DRIFT_PPM_MAX;
+	r->step = (1ULL << 32) + (int64_t)ppm * (1LL << 32) / 1000000;
+}
+
+/**
+ * Resample interleaved S16 signal.
+ *
+ * @param r Address of the resampler structure.
+ * @param in Address of the input signal.
+ * @param in_frames The number of input frames. Upon return, it holds the
+ *   number of frames consumed by the resampler.
+ * @param out Address of the output buffer.
+ * @param out_frames The size of the output buffer in frames.
+ * @return This function returns the number of generated frames. */
+size_t drift_resampler_process(struct drift_resampler *r, const int16_t *in,
+		size_t *in_frames, int16_t *out, size_t out_frames) {
+
+	const unsigned int channels = r->channels;
+	const size_t frames = *in_frames;
+	size_t generated = 0;
+	unsigned int i;
+
+	while (generated < out_frames) {
+
+		/* The position is relative to the last frame of the previous block,
+		 * so the output frame is interpolated between x[n] and x[n + 1],
+		 * where x[0] is the last frame and x[1] is the first input frame. */
+		const size_t n = r->pos >> 32;
+		if (n + 1 > frames)
+			break;
+
+		const int64_t frac = r->pos & 0xFFFFFFFF;
+		const int16_t *x0 = n == 0 ? r->last : &in[(n - 1) * channels];
+		const int16_t *x1 = &in[n * channels];
+
+		for (i = 0; i < channels; i++)
+			out[i] = x0[i] + (((x1[i] - x0[i]) * frac) >> 32);
+
+		out += channels;
+		r->pos += r->step;
+		generated++;
+
+	}
+
+	/* frames before the interpolation position are not needed anymore */
+	size_t consumed = r->pos >> 32;
+	if (consumed > frames)
+		consumed = frames;
+
+	if (consumed > 0) {
+		memcpy(r->last, &in[(consumed - 1) * channels], channels * sizeof(*in));
+		r->pos -= (uint64_t)consumed << 32;
+	}
+
+	*in_frames = consumed;
+	return generated;
+}
@@ -0,0 +1,132 @@
+/*
+ * BlueALSA - drift.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_SHARED_DRIFT_H_
+#define BLUEALSA_SHARED_DRIFT_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* The maximal clock drift correction (in ppm). */
+#define DRIFT_PPM_MAX 2000
+/* Length of the single drift measurement window (in microseconds). */
+#define DRIFT_WINDOW_USEC (10 * 1000000)
+/* The number of windows which form the measurement baseline. */
+#define DRIFT_WINDOWS 32
+/* The maximal number of channels supported by the drift resampler. */
+#define DRIFT_CHANNELS_MAX 8
+
+/**
+ * Clock drift estimator based on the RTP time-stamps.
+ *
+ * The offset between the local monotonic clock and the remote clock (given
+ * by RTP time-stamps) grows with the rate of the drift, however, it is also
+ * affected by the transmission jitter. Since the jitter can only delay the
+ * packet arrival, the lower envelope of the offset (minimum within every
+ * measurement window) follows the drift very closely. The drift is given by
+ * the slope of this envelope over the whole baseline. */
+struct drift_estimator {
+
+	/* nominal sampling rate of the stream */
+	unsigned int rate;
+	/* detected rate of the RTP time-stamp clock (zero if not known yet) */
+	unsigned int rtp_rate;
+
+	bool started;
+	/* local time (in microseconds) of the time line start */
+	uint64_t ts0;
+	/* the last local time and RTP time-stamp */
+	uint64_t ts;
+	uint32_t rtp_ts;
+	/* RTP clock ticks since the time line start */
+	uint64_t rtp_ticks;
+
+	/* the current measurement window */
+	uint64_t window_ts;
+	int64_t window_min;
+
+	/* lower envelope of the offset and local time of every point */
+	int64_t mins[DRIFT_WINDOWS];
+	uint64_t mins_ts[DRIFT_WINDOWS];
+	size_t head;
+	size_t len;
+
+	/* estimated drift of the remote clock (positive if faster) */
+	int ppm;
+
+};
+
+void drift_estimator_init(struct drift_estimator *d, unsigned int rate);
+void drift_estimator_reset(struct drift_estimator *d);
+void drift_estimator_update(struct drift_estimator *d, uint32_t rtp_ts,
+		const struct timespec *ts);
+
+/**
+ * Get the estimated clock drift in ppm. */
+#define drift_estimator_get_ppm(d) ((d)->ppm)
+
+/**
+ * Buffer occupancy controller.
+ *
+ * The PI controller which determines the rate correction needed in order
+ * to keep the buffer occupancy at the given target level. The occupancy
+ * is smoothed before the processing, so bursty deliveries of BT packets
+ * do not cause rate oscillations. */
+struct drift_controller {
+
+	unsigned int rate;
+	/* target and smoothed buffer occupancy (in frames) */
+	double target;
+	double level;
+	bool primed;
+	/* integral of the occupancy error (in seconds squared) */
+	double integral;
+
+	/* correction (in ppm) which shall be applied */
+	int ppm;
+
+};
+
+void drift_controller_init(struct drift_controller *c, unsigned int rate,
+		size_t target);
+int drift_controller_update(struct drift_controller *c, size_t level,
+		unsigned int elapsed_usec, int feedforward);
+
+/**
+ * Fine-grained adaptive resampler for the interleaved S16 signal.
+ *
+ * The conversion ratio is close to one, and it can be changed at any time
+ * without any discontinuity in the output signal. For such small ratios,
+ * the linear interpolation between adjacent frames is transparent. */
+struct drift_resampler {
+
+	unsigned int channels;
+	/* input frames per output frame in the Q32 format */
+	uint64_t step;
+	/* position of the next output frame in the Q32 format, relative to the
+	 * last frame of the previously processed block */
+	uint64_t pos;
+	int16_t last[DRIFT_CHANNELS_MAX];
+
+};
+
+int drift_resampler_init(struct drift_resampler *r, unsigned int channels);
+void drift_resampler_reset(struct drift_resampler *r);
+void drift_resampler_set_ppm(struct drift_resampler *r, int ppm);
+size_t drift_resampler_process(struct drift_resampler *r, const int16_t *in,
+		size_t *in_frames, int16_t *out, size_t out_frames);
+
+#endif
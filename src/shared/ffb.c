@@ -10,6 +10,299 @@
 
 #include "ffb.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+# define MFD_CLOEXEC 0x0001U
+#endif
+
+/* The maximal number of rings kept in the pool. */
+#define FFB_POOL_SIZE 32
+
+/**
+ * Pool of released memory rings.
+ *
+ * Creating a ring requires a memory file and three mappings, so rings are
+ * kept for reuse by the buffer of the same size (e.g. the IO thread started
+ * for the same transport after the reconnection). The pool is disabled by
+ * default - its size limit is zero. */
+static struct {
+	pthread_mutex_t mutex;
+	void *data[FFB_POOL_SIZE];
+	size_t ring[FFB_POOL_SIZE];
+	size_t len;
+	/* overall size of pooled rings in bytes */
+	size_t size;
+	size_t limit;
+} ffb_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* budget charged by buffers initialized by the calling thread */
+static __thread struct ffb_budget *ffb_budget = NULL;
+
+/**
+ * Attach memory budget to the calling thread.
+ *
+ * @param budget Address of the budget structure or NULL to detach. */
+void ffb_budget_attach(struct ffb_budget *budget) {
+	ffb_budget = budget;
+}
+
+/**
+ * Set the size limit of the pool of released rings.
+ *
+ * @param limit The overall size in bytes of rings kept in the pool. Zero
+ *   disables the pool. */
+void ffb_pool_set_limit(size_t limit) {
+	pthread_mutex_lock(&ffb_pool.mutex);
+	ffb_pool.limit = limit;
+	pthread_mutex_unlock(&ffb_pool.mutex);
+	if (limit == 0)
+		ffb_pool_free();
+}
+
+/**
+ * Unmap all rings kept in the pool. */
+void ffb_pool_free(void) {
+	pthread_mutex_lock(&ffb_pool.mutex);
+	while (ffb_pool.len > 0) {
+		ffb_pool.len--;
+		munmap(ffb_pool.data[ffb_pool.len], ffb_pool.ring[ffb_pool.len] * 2);
+	}
+	ffb_pool.size = 0;
+	pthread_mutex_unlock(&ffb_pool.mutex);
+}
+
+/**
+ * Take the ring of the given size from the pool.
+ *
+ * @return On success this function returns the address of the zeroed ring.
+ *   Otherwise, NULL is returned. */
+static void *ffb_pool_take(size_t ring) {
+
+	void *data = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&ffb_pool.mutex);
+	for (i = 0; i < ffb_pool.len; i++)
+		if (ffb_pool.ring[i] == ring) {
+			data = ffb_pool.data[i];
+			ffb_pool.len--;
+			ffb_pool.data[i] = ffb_pool.data[ffb_pool.len];
+			ffb_pool.ring[i] = ffb_pool.ring[ffb_pool.len];
+			ffb_pool.size -= ring;
+			break;
+		}
+	pthread_mutex_unlock(&ffb_pool.mutex);
+
+	/* keep the semantic of the fresh mapping */
+	if (data != NULL)
+		memset(data, 0, ring);
+
+	return data;
+}
+
+/**
+ * Put the ring into the pool or unmap it if the pool is full. */
+static void ffb_pool_release(void *data, size_t ring) {
+
+	pthread_mutex_lock(&ffb_pool.mutex);
+	if (ffb_pool.len < FFB_POOL_SIZE &&
+			ffb_pool.size + ring <= ffb_pool.limit) {
+		ffb_pool.data[ffb_pool.len] = data;
+		ffb_pool.ring[ffb_pool.len++] = ring;
+		ffb_pool.size += ring;
+		data = NULL;
+	}
+	pthread_mutex_unlock(&ffb_pool.mutex);
+
+	if (data != NULL)
+		munmap(data, ring * 2);
+
+}
+
+/**
+ * Charge the budget with the given number of bytes.
+ *
+ * @return On success this function returns 0. If the limit would be
+ *   exceeded, -1 is returned and errno is set to ENOMEM. */
+static int ffb_budget_charge(struct ffb_budget *budget, size_t size) {
+
+	if (budget == NULL)
+		return 0;
+
+	size_t used = atomic_fetch_add(&budget->used, size) + size;
+	if (budget->limit != 0 && used > budget->limit) {
+		atomic_fetch_sub(&budget->used, size);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	size_t peak = atomic_load(&budget->peak);
+	while (used > peak &&
+			!atomic_compare_exchange_weak(&budget->peak, &peak, used))
+		continue;
+
+	return 0;
+}
+
+static void ffb_budget_uncharge(struct ffb_budget *budget, size_t size) {
+	if (budget != NULL)
+		atomic_fetch_sub(&budget->used, size);
+}
+
+
+/**
+ * Map memory region twice in a row.
+ *
+ * @param size Requested size of the region in bytes. Upon success, it will
+ *   be updated with the real size of the region, which is rounded up to
+ *   the memory page size.
+ * @return On success this function returns the address of the first
+ *   mapping. Otherwise, NULL is returned and errno is set appropriately. */
+static void *ffb_mmap(size_t *size) {
+
+	const size_t page = sysconf(_SC_PAGESIZE);
+	size_t len = (*size + page - 1) / page * page;
+	uint8_t *addr = MAP_FAILED;
+	int fd;
+
+	if (len == 0)
+		len = page;
+
+	if ((addr = ffb_pool_take(len)) != NULL) {
+		*size = len;
+		return addr;
+	}
+
+	/* The memfd_create() wrapper is not available in older libc
+	 * implementations, so we will use a raw system call instead. */
+	if ((fd = syscall(SYS_memfd_create, "ffb", MFD_CLOEXEC)) == -1)
+		return NULL;
+	if (ftruncate(fd, len) == -1)
+		goto fail;
+
+	/* reserve the address space for both mappings */
+	if ((addr = mmap(NULL, len * 2, PROT_NONE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		goto fail;
+
+	if (mmap(addr, len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+			mmap(addr + len, len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		goto fail;
+
+	close(fd);
+	*size = len;
+	return addr;
+
+fail:
+	if (addr != MAP_FAILED)
+		munmap(addr, len * 2);
+	int err = errno;
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * Allocate/reallocate resources for the ring buffer.
+ *
+ * Data stored in the old buffer (if any) is preserved up to the new size
+ * of the buffer.
+ *
+ * @param data Address of the current mapping, or NULL.
+ * @param ring Size of the current mapping in bytes. On success, it will be
+ *   updated with the size of the new mapping.
+ * @param head Pointer to the data which shall be preserved.
+ * @param len Number of bytes to preserve.
+ * @param size Requested size of the buffer in bytes.
+ * @return On success this function returns the address of the new mapping.
+ *   Otherwise, NULL is returned and errno is set appropriately. */
+static void *ffb_remap(void *data, size_t *ring, const void *head,
+		size_t len, size_t size, struct ffb_budget **budget) {
+
+	size_t new_ring = size;
+	void *new_data;
+
+	/* buffer stays charged to the budget of its first initialization */
+	if (data == NULL)
+		*budget = ffb_budget;
+
+	if ((new_data = ffb_mmap(&new_ring)) == NULL)
+		return NULL;
+
+	if (ffb_budget_charge(*budget, new_ring) == -1) {
+		ffb_pool_release(new_data, new_ring);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (data != NULL) {
+		memcpy(new_data, head, len < size ? len : size);
+		ffb_budget_uncharge(*budget, *ring);
+		ffb_pool_release(data, *ring);
+	}
+
+	*ring = new_ring;
+	return new_data;
+}
+
+/**
+ * Allocate/reallocate resources for the uint8_t ring buffer.
+ *
+ * @param ffb Pointer to the buffer structure. The structure shall be
+ *   zero-initialized before the first call to this function.
+ * @param size Number of the buffer unite blocks.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int ffb_uint8_init(ffb_uint8_t *ffb, size_t size) {
+
+	size_t len = ffb_len_out(ffb);
+	size_t ring = ffb->ring * sizeof(*ffb->data);
+	uint8_t *data;
+
+	if ((data = ffb_remap(ffb->data, &ring, ffb->head, len * sizeof(*ffb->data),
+					size * sizeof(*ffb->data), &ffb->budget)) == NULL)
+		return -1;
+
+	ffb->data = ffb->head = data;
+	ffb->tail = data + (len < size ? len : size);
+	ffb->ring = ring / sizeof(*ffb->data);
+	ffb->size = size;
+	return 0;
+}
+
+/**
+ * Allocate/reallocate resources for the int16_t ring buffer.
+ *
+ * @param ffb Pointer to the buffer structure. The structure shall be
+ *   zero-initialized before the first call to this function.
+ * @param size Number of the buffer unite blocks.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int ffb_int16_init(ffb_int16_t *ffb, size_t size) {
+
+	size_t len = ffb_len_out(ffb);
+	size_t ring = ffb->ring * sizeof(*ffb->data);
+	int16_t *data;
+
+	if ((data = ffb_remap(ffb->data, &ring, ffb->head, len * sizeof(*ffb->data),
+					size * sizeof(*ffb->data), &ffb->budget)) == NULL)
+		return -1;
+
+	ffb->data = ffb->head = data;
+	ffb->tail = data + (len < size ? len : size);
+	ffb->ring = ring / sizeof(*ffb->data);
+	ffb->size = size;
+	return 0;
+}
 
 /**
  * Free resources allocated by the ffb_uint8_init().
@@ -18,8 +311,11 @@
 void ffb_uint8_free(ffb_uint8_t *ffb) {
 	if (ffb->data == NULL)
 		return;
-	free(ffb->data);
-	ffb->data = NULL;
+	ffb_budget_uncharge(ffb->budget, ffb->ring * sizeof(*ffb->data));
+	ffb_pool_release(ffb->data, ffb->ring * sizeof(*ffb->data));
+	ffb->data = ffb->head = ffb->tail = NULL;
+	ffb->budget = NULL;
+	ffb->ring = 0;
 }
 
 /**
@@ -29,6 +325,9 @@ void ffb_uint8_free(ffb_uint8_t *ffb) {
 void ffb_int16_free(ffb_int16_t *ffb) {
 	if (ffb->data == NULL)
 		return;
-	free(ffb->data);
-	ffb->data = NULL;
+	ffb_budget_uncharge(ffb->budget, ffb->ring * sizeof(*ffb->data));
+	ffb_pool_release(ffb->data, ffb->ring * sizeof(*ffb->data));
+	ffb->data = ffb->head = ffb->tail = NULL;
+	ffb->budget = NULL;
+	ffb->ring = 0;
 }
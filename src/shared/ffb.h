@@ -11,38 +11,71 @@
 #ifndef BLUEALSA_SHARED_FFB_H_
 #define BLUEALSA_SHARED_FFB_H_
 
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 /**
- * Convenience wrapper for FIFO-like buffer for uint8_t. */
+ * Memory budget for the buffers.
+ *
+ * Buffers initialized by the thread which has attached the budget (see the
+ * ffb_budget_attach() function) are charged to that budget, and they are
+ * uncharged upon release - regardless of the releasing thread. */
+struct ffb_budget {
+	/* number of bytes currently used */
+	atomic_size_t used;
+	/* the highest number of bytes used */
+	atomic_size_t peak;
+	/* upper limit in bytes (zero means no limit) */
+	size_t limit;
+};
+
+/**
+ * Convenience wrapper for FIFO-like buffer for uint8_t.
+ *
+ * The buffer is backed by a ring of memory pages, which is mapped twice in
+ * a row in the process address space. Thanks to that, data stored in the
+ * buffer (from the head to the tail) and the free space behind the tail are
+ * always accessible as a single contiguous block - consuming data from the
+ * front of the buffer does not require moving the rest of it. */
 typedef struct {
-	/* pointer to the allocated memory block */
+	/* pointer to the mapped memory block */
 	uint8_t *data;
+	/* pointer to the beginning of data */
+	uint8_t *head;
 	/* pointer to the end of data */
 	uint8_t *tail;
 	/* size of the buffer */
 	size_t size;
+	/* size of the mapped ring (greater or equal to the buffer size) */
+	size_t ring;
+	/* budget charged with the mapped ring */
+	struct ffb_budget *budget;
 } ffb_uint8_t;
 
 /**
  * Convenience wrapper for FIFO-like buffer for int16_t. */
 typedef struct {
 	int16_t *data;
+	int16_t *head;
 	int16_t *tail;
 	size_t size;
+	size_t ring;
+	struct ffb_budget *budget;
 } ffb_int16_t;
 
-/**
- * Allocate/reallocate resources for the FIFO-like buffer.
- *
- * @param p Pointer to the buffer structure.
- * @param s Number of the buffer unite blocks.
- * @return On success this function returns non-NULL value. */
-#define ffb_init(p, s) \
-	((p)->data = (p)->tail = realloc((p)->data, ((p)->size = s) * sizeof(*(p)->data)))
+void ffb_budget_attach(struct ffb_budget *budget);
+void ffb_pool_set_limit(size_t limit);
+void ffb_pool_free(void);
+
+int ffb_uint8_init(ffb_uint8_t *ffb, size_t size);
+int ffb_int16_init(ffb_int16_t *ffb, size_t size);
 
 void ffb_uint8_free(ffb_uint8_t *ffb);
 void ffb_int16_free(ffb_int16_t *ffb);
@@ -52,7 +85,7 @@ void ffb_int16_free(ffb_int16_t *ffb);
 #define ffb_len_in(p) ((p)->size - ffb_len_out(p))
 /**
  * Get number of unite blocks available for reading. */
-#define ffb_len_out(p) ((size_t)((p)->tail - (p)->data))
+#define ffb_len_out(p) ((size_t)((p)->tail - (p)->head))
 
 /**
  * Get number of bytes available for writing. */
@@ -66,14 +99,21 @@ void ffb_int16_free(ffb_int16_t *ffb);
 #define ffb_seek(p, s) ((p)->tail += s)
 
 /**
- * Set the tail pointer to the beginning of the buffer. */
-#define ffb_rewind(p) ((p)->tail = (p)->data)
+ * Set the head and the tail pointers to the beginning of the buffer. */
+#define ffb_rewind(p) ((p)->head = (p)->tail = (p)->data)
 
 /**
- * Shift data by the given number of unite blocks. */
+ * Shift data by the given number of unite blocks.
+ *
+ * This operation does not move any data, it simply advances the head
+ * pointer. Both pointers are wrapped into the first mapping of the ring
+ * if the head has left it. */
 #define ffb_shift(p, s) do { \
-		memmove((p)->data, (p)->data + (s), sizeof(*(p)->data) * (ffb_len_out(p) - (s))); \
-		(p)->tail -= s; \
+		(p)->head += s; \
+		if ((p)->head >= (p)->data + (p)->ring) { \
+			(p)->head -= (p)->ring; \
+			(p)->tail -= (p)->ring; \
+		} \
 	} while (0)
 
 #endif
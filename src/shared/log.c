@@ -10,8 +10,13 @@
 
 #include "log.h"
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +24,16 @@
 
 #include "rt.h"
 
+/* The number of records in the asynchronous logging ring (power of 2). */
+#define LOG_RING_SIZE 256
+/* The maximal length of the single log record. */
+#define LOG_RECORD_SIZE 256
+/* The number of call sites tracked by the rate limiter. */
+#define LOG_SITES_SIZE 64
+/* The number of messages logged by a single call site within one second
+ * before next messages are suppressed. */
+#define LOG_RATE_BURST 5
+
 
 /* internal logging identifier */
 static char *_ident = NULL;
@@ -27,6 +42,44 @@ static bool _syslog = false;
 /* if true, print logging time */
 static bool _time = BLUEALSA_LOGTIME;
 
+struct log_record {
+	/* sequence number of the ring slot */
+	atomic_size_t seq;
+	int priority;
+	struct timespec ts;
+	char text[LOG_RECORD_SIZE];
+};
+
+struct log_site {
+	/* return address of the logging function */
+	atomic_uintptr_t addr;
+	/* current rate limiting window (in seconds) */
+	atomic_uint window;
+	atomic_uint count;
+	atomic_uint suppressed;
+};
+
+/* Ring of log records written out by the background thread. Records are
+ * enqueued without any locking, so the logging does not block the caller,
+ * e.g. the real-time IO thread. If the ring is full, the record is dropped
+ * and the overflow is reported by the background thread later on. */
+static struct {
+	struct log_record records[LOG_RING_SIZE];
+	atomic_size_t head;
+	size_t tail;
+	atomic_ulong dropped;
+	atomic_ulong suppressed;
+	struct log_site sites[LOG_SITES_SIZE];
+	atomic_bool enabled;
+	/* the number of callers which are putting records into the ring */
+	atomic_uint writers;
+	atomic_bool stopping;
+	pthread_t thread;
+	/* initialized once, never destroyed - see log_async_stop() */
+	bool sem_initialized;
+	sem_t sem;
+} log_ring;
+
 
 void log_open(const char *ident, bool syslog, bool time) {
 
@@ -40,7 +93,236 @@ void log_open(const char *ident, bool syslog, bool time) {
 
 }
 
-static void vlog(int priority, const char *format, va_list ap) {
+static void log_write(int priority, const struct timespec *ts, const char *text) {
+
+	if (_syslog)
+		syslog(priority, "%s", text);
+
+	flockfile(stderr);
+
+	if (_ident != NULL)
+		fprintf(stderr, "%s: ", _ident);
+	if (_time)
+		fprintf(stderr, "%lu.%.9lu: ", (long int)ts->tv_sec, ts->tv_nsec);
+	fputs(text, stderr);
+	fputs("\n", stderr);
+
+	funlockfile(stderr);
+
+}
+
+/**
+ * Check whether the call site has not exceeded its logging rate.
+ *
+ * Call sites are identified by the return address of the logging function.
+ * If the site table is full, the rate is not limited at all. */
+static bool log_rate_check(uintptr_t addr, unsigned int *suppressed) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	const unsigned int window = now.tv_sec;
+
+	struct log_site *site = NULL;
+	size_t i, ii = addr % LOG_SITES_SIZE;
+	for (i = 0; i < LOG_SITES_SIZE; i++, ii = (ii + 1) % LOG_SITES_SIZE) {
+		uintptr_t tmp = 0;
+		if (atomic_load(&log_ring.sites[ii].addr) == addr ||
+				atomic_compare_exchange_strong(&log_ring.sites[ii].addr, &tmp, addr) ||
+				tmp == addr) {
+			site = &log_ring.sites[ii];
+			break;
+		}
+	}
+
+	*suppressed = 0;
+	if (site == NULL)
+		return true;
+
+	unsigned int tmp = atomic_load(&site->window);
+	if (tmp != window && atomic_compare_exchange_strong(&site->window, &tmp, window)) {
+		*suppressed = atomic_exchange(&site->suppressed, 0);
+		atomic_store(&site->count, 0);
+	}
+
+	if (atomic_fetch_add(&site->count, 1) >= LOG_RATE_BURST) {
+		atomic_fetch_add(&site->suppressed, 1);
+		atomic_fetch_add(&log_ring.suppressed, 1);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Put the record into the logging ring.
+ *
+ * This function never blocks. If there is no free slot in the ring,
+ * the record is dropped. */
+static void log_enqueue(int priority, const char *format, va_list ap) {
+
+	size_t pos = atomic_load(&log_ring.head);
+	struct log_record *r;
+
+	for (;;) {
+		r = &log_ring.records[pos % LOG_RING_SIZE];
+		const intptr_t diff = (intptr_t)atomic_load(&r->seq) - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak(&log_ring.head, &pos, pos + 1))
+				break;
+		}
+		else if (diff < 0) {
+			atomic_fetch_add(&log_ring.dropped, 1);
+			return;
+		}
+		else
+			pos = atomic_load(&log_ring.head);
+	}
+
+	r->priority = priority;
+	if (_time)
+		gettimestamp(&r->ts);
+	vsnprintf(r->text, sizeof(r->text), format, ap);
+
+	atomic_store(&r->seq, pos + 1);
+	sem_post(&log_ring.sem);
+
+}
+
+static void log_enqueue_printf(int priority, const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	log_enqueue(priority, format, ap);
+	va_end(ap);
+}
+
+/**
+ * Write out all queued log records.
+ *
+ * @return This function returns the number of written records. */
+static size_t log_flush(void) {
+
+	static unsigned long dropped = 0;
+	size_t count = 0;
+
+	for (;;) {
+
+		struct log_record *r = &log_ring.records[log_ring.tail % LOG_RING_SIZE];
+		if (atomic_load(&r->seq) != log_ring.tail + 1)
+			break;
+
+		log_write(r->priority, &r->ts, r->text);
+		atomic_store(&r->seq, log_ring.tail + LOG_RING_SIZE);
+		log_ring.tail++;
+		count++;
+
+	}
+
+	unsigned long tmp;
+	if ((tmp = atomic_load(&log_ring.dropped)) != dropped) {
+		char text[64];
+		struct timespec ts;
+		gettimestamp(&ts);
+		snprintf(text, sizeof(text), "Log ring overflow: %lu messages dropped", tmp - dropped);
+		log_write(LOG_WARNING, &ts, text);
+		dropped = tmp;
+	}
+
+	return count;
+}
+
+static void *log_thread(void *arg) {
+	(void)arg;
+
+	for (;;) {
+		while (sem_wait(&log_ring.sem) == -1 && errno == EINTR)
+			continue;
+		log_flush();
+		if (atomic_load(&log_ring.stopping) && atomic_load(&log_ring.head) == log_ring.tail)
+			break;
+	}
+
+	return NULL;
+}
+
+/**
+ * Start asynchronous logging.
+ *
+ * Log records are queued into the ring and written out by the background
+ * thread, so the caller does not block on the stderr or the system logger.
+ * Also, messages logged by the same call site are rate limited. Records
+ * which are still queued upon exit are written out by the atexit handler.
+ *
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int log_async_start(void) {
+
+	static bool registered = false;
+	size_t i;
+	int ret;
+
+	if (atomic_load(&log_ring.enabled))
+		return 0;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		atomic_store(&log_ring.records[i].seq, i);
+	atomic_store(&log_ring.head, 0);
+	log_ring.tail = 0;
+	atomic_store(&log_ring.stopping, false);
+
+	if (!log_ring.sem_initialized) {
+		if (sem_init(&log_ring.sem, 0, 0) == -1)
+			return -1;
+		log_ring.sem_initialized = true;
+	}
+
+	if ((ret = pthread_create(&log_ring.thread, NULL, log_thread, NULL)) != 0) {
+		errno = ret;
+		return -1;
+	}
+
+	atomic_store(&log_ring.enabled, true);
+
+	if (!registered) {
+		atexit(log_async_stop);
+		registered = true;
+	}
+
+	return 0;
+}
+
+/**
+ * Stop asynchronous logging.
+ *
+ * All queued records are written out before this function returns. Other
+ * threads (e.g. IO threads upon exit) might still be logging, so callers
+ * which have seen the asynchronous mode enabled are waited for, and the
+ * semaphore is not destroyed. Subsequent messages are logged directly. */
+void log_async_stop(void) {
+
+	if (!atomic_exchange(&log_ring.enabled, false))
+		return;
+
+	/* putting the record into the ring never blocks */
+	while (atomic_load(&log_ring.writers) > 0)
+		sched_yield();
+
+	atomic_store(&log_ring.stopping, true);
+	sem_post(&log_ring.sem);
+	pthread_join(log_ring.thread, NULL);
+
+}
+
+/**
+ * Get the number of messages not logged in the asynchronous mode.
+ *
+ * @param dropped The number of records dropped due to the ring overflow.
+ * @param suppressed The number of records suppressed by the rate limiter. */
+void log_async_stats(unsigned long *dropped, unsigned long *suppressed) {
+	*dropped = atomic_load(&log_ring.dropped);
+	*suppressed = atomic_load(&log_ring.suppressed);
+}
+
+static void vlog(uintptr_t site, int priority, const char *format, va_list ap) {
 
 	int oldstate;
 
@@ -50,6 +332,21 @@ static void vlog(int priority, const char *format, va_list ap) {
 	 * has to be temporally disabled. */
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 
+	/* The writer is accounted before the mode is checked, so the record will
+	 * be either written out by the background thread or logged directly. */
+	atomic_fetch_add(&log_ring.writers, 1);
+	if (atomic_load(&log_ring.enabled)) {
+		unsigned int suppressed;
+		if (log_rate_check(site, &suppressed)) {
+			if (suppressed > 0)
+				log_enqueue_printf(LOG_WARNING, "Suppressed %u similar messages", suppressed);
+			log_enqueue(priority, format, ap);
+		}
+		atomic_fetch_sub(&log_ring.writers, 1);
+		goto final;
+	}
+	atomic_fetch_sub(&log_ring.writers, 1);
+
 	if (_syslog) {
 		va_list ap_syslog;
 		va_copy(ap_syslog, ap);
@@ -71,6 +368,7 @@ static void vlog(int priority, const char *format, va_list ap) {
 
 	funlockfile(stderr);
 
+final:
 	pthread_setcancelstate(oldstate, NULL);
 
 }
@@ -78,21 +376,21 @@ static void vlog(int priority, const char *format, va_list ap) {
 void error(const char *format, ...) {
 	va_list ap;
 	va_start(ap, format);
-	vlog(LOG_ERR, format, ap);
+	vlog((uintptr_t)__builtin_return_address(0), LOG_ERR, format, ap);
 	va_end(ap);
 }
 
 void warn(const char *format, ...) {
 	va_list ap;
 	va_start(ap, format);
-	vlog(LOG_WARNING, format, ap);
+	vlog((uintptr_t)__builtin_return_address(0), LOG_WARNING, format, ap);
 	va_end(ap);
 }
 
 void info(const char *format, ...) {
 	va_list ap;
 	va_start(ap, format);
-	vlog(LOG_INFO, format, ap);
+	vlog((uintptr_t)__builtin_return_address(0), LOG_INFO, format, ap);
 	va_end(ap);
 }
 
@@ -100,7 +398,7 @@ void info(const char *format, ...) {
 void _debug(const char *format, ...) {
 	va_list ap;
 	va_start(ap, format);
-	vlog(LOG_DEBUG, format, ap);
+	vlog((uintptr_t)__builtin_return_address(0), LOG_DEBUG, format, ap);
 	va_end(ap);
 }
 #endif
@@ -25,6 +25,9 @@
 #endif
 
 void log_open(const char *ident, bool syslog, bool time);
+int log_async_start(void);
+void log_async_stop(void);
+void log_async_stats(unsigned long *dropped, unsigned long *suppressed);
 void error(const char *format, ...) __attribute__ ((format(printf, 1, 2)));
 void warn(const char *format, ...) __attribute__ ((format(printf, 1, 2)));
 void info(const char *format, ...) __attribute__ ((format(printf, 1, 2)));
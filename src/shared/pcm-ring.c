@@ -0,0 +1,337 @@
+/*
+ * BlueALSA - pcm-ring.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "pcm-ring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+# define MFD_CLOEXEC 0x0001U
+#endif
+
+/* offset of the data area - control block occupies the first page */
+#define PCM_RING_DATA_OFFSET 4096
+
+
+/**
+ * Map the shared memory and set up the ring structure. */
+static int pcm_ring_mmap(struct pcm_ring *ring, int memfd, size_t mmap_size) {
+
+	void *addr;
+
+	if ((addr = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, memfd, 0)) == MAP_FAILED)
+		return -1;
+
+	ring->ctrl = addr;
+	ring->data = (uint8_t *)addr + PCM_RING_DATA_OFFSET;
+	ring->mmap_size = mmap_size;
+	ring->size = mmap_size - PCM_RING_DATA_OFFSET;
+	ring->broken = false;
+	return 0;
+}
+
+/**
+ * Get the number of bytes stored in the ring.
+ *
+ * Counters are stored in the shared memory, so the other side might have
+ * set them to any value. If there is more data than the ring can hold, the
+ * ring is marked as broken and it is reported as closed from now on.
+ *
+ * @return This function returns the number of stored bytes, or zero if the
+ *   ring state is not valid. */
+static size_t pcm_ring_fill(struct pcm_ring *ring, uint32_t head, uint32_t tail) {
+
+	const uint32_t len = head - tail;
+
+	if (len > ring->size) {
+		ring->broken = true;
+		return 0;
+	}
+
+	return len;
+}
+
+/**
+ * Ring the doorbell of the other side, if it is waiting for it. */
+static void pcm_ring_notify(atomic_uint_least32_t *wait, int fd) {
+	if (atomic_exchange(wait, 0) != 0)
+		eventfd_write(fd, 1);
+}
+
+/**
+ * Rearm own doorbell after the ring has been drained (or filled up).
+ *
+ * The doorbell file descriptor stays readable for as long as there might be
+ * something to do, so it can be used with the level-triggered poll(). When
+ * there is nothing left, the doorbell is cleared and the wait flag is set.
+ * If the other side has made progress in the meantime, but it has not seen
+ * our wait flag, we have to ring the doorbell on our own. */
+static void pcm_ring_rearm(struct pcm_ring *ring, atomic_uint_least32_t *wait,
+		int fd, bool reader) {
+
+	eventfd_t value;
+	eventfd_read(fd, &value);
+	atomic_store(wait, 1);
+
+	const size_t len = pcm_ring_len_out(ring);
+	if (ring->broken)
+		return;
+	if ((reader && len > 0) || (!reader && len < ring->size))
+		pcm_ring_notify(wait, fd);
+
+}
+
+/**
+ * Create new ring buffer in the shared memory.
+ *
+ * @param ring Address of the ring structure to initialize.
+ * @param size Size of the ring data area in bytes. This value is rounded up
+ *   to the next power of two.
+ * @return On success this function returns the memfd file descriptor, which
+ *   should be passed to the other side together with ring doorbells. This
+ *   descriptor is not required for the ring operation, so it might be closed
+ *   afterwards. On error, -1 is returned and errno is set appropriately. */
+int pcm_ring_create(struct pcm_ring *ring, size_t size) {
+
+	size_t ring_size = 1;
+	int memfd;
+	int err;
+
+	while (ring_size < size)
+		ring_size <<= 1;
+
+	ring->ctrl = NULL;
+	ring->data_fd = ring->space_fd = -1;
+
+	/* The memfd_create() wrapper is not available in older libc
+	 * implementations, so we will use a raw system call instead. */
+	if ((memfd = syscall(SYS_memfd_create, "bluealsa-pcm", MFD_CLOEXEC)) == -1)
+		return -1;
+
+	if (ftruncate(memfd, PCM_RING_DATA_OFFSET + ring_size) == -1)
+		goto fail;
+	if (pcm_ring_mmap(ring, memfd, PCM_RING_DATA_OFFSET + ring_size) == -1)
+		goto fail;
+
+	if ((ring->data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 ||
+			(ring->space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		goto fail;
+
+	ring->ctrl->magic = PCM_RING_MAGIC;
+	ring->ctrl->size = ring_size;
+	atomic_init(&ring->ctrl->head, 0);
+	atomic_init(&ring->ctrl->tail, 0);
+	/* ring is empty - reader is waiting for data */
+	atomic_init(&ring->ctrl->rd_wait, 1);
+	atomic_init(&ring->ctrl->wr_wait, 0);
+	atomic_init(&ring->ctrl->closed, 0);
+
+	/* there is a space for writing right away */
+	eventfd_write(ring->space_fd, 1);
+
+	return memfd;
+
+fail:
+	err = errno;
+	pcm_ring_free(ring);
+	close(memfd);
+	errno = err;
+	return -1;
+}
+
+/**
+ * Attach to the ring buffer created by the other side.
+ *
+ * Upon success, the ownership of the doorbell file descriptors is moved to
+ * the ring structure. The memfd file descriptor is not used afterwards.
+ *
+ * @param ring Address of the ring structure to initialize.
+ * @param memfd The memfd file descriptor returned by pcm_ring_create().
+ * @param data_fd The data doorbell file descriptor.
+ * @param space_fd The space doorbell file descriptor.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int pcm_ring_attach(struct pcm_ring *ring, int memfd, int data_fd, int space_fd) {
+
+	struct stat st;
+
+	ring->ctrl = NULL;
+	ring->data_fd = ring->space_fd = -1;
+
+	if (fstat(memfd, &st) == -1)
+		return -1;
+	if ((size_t)st.st_size <= PCM_RING_DATA_OFFSET) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (pcm_ring_mmap(ring, memfd, st.st_size) == -1)
+		return -1;
+
+	/* size of the data area has to be a power of two */
+	if (ring->ctrl->magic != PCM_RING_MAGIC ||
+			ring->ctrl->size != ring->size ||
+			(ring->size & (ring->size - 1)) != 0) {
+		munmap(ring->ctrl, ring->mmap_size);
+		ring->ctrl = NULL;
+		errno = EPROTO;
+		return -1;
+	}
+
+	ring->data_fd = data_fd;
+	ring->space_fd = space_fd;
+	return 0;
+}
+
+/**
+ * Free resources allocated for the ring buffer.
+ *
+ * Doorbell file descriptors are closed only if the ring is mapped, so it is
+ * safe to call this function for a zero-initialized structure.
+ *
+ * @param ring Address of the ring structure. */
+void pcm_ring_free(struct pcm_ring *ring) {
+	if (ring->ctrl == NULL)
+		return;
+	munmap(ring->ctrl, ring->mmap_size);
+	ring->ctrl = NULL;
+	if (ring->data_fd != -1) {
+		close(ring->data_fd);
+		ring->data_fd = -1;
+	}
+	if (ring->space_fd != -1) {
+		close(ring->space_fd);
+		ring->space_fd = -1;
+	}
+}
+
+/**
+ * Read data from the ring buffer.
+ *
+ * This function never blocks. In order to wait for data, one should poll
+ * the data_fd doorbell for reading.
+ *
+ * @param ring Address of the ring structure.
+ * @param buffer Address of the destination buffer.
+ * @param len Size of the destination buffer in bytes.
+ * @return This function returns the number of bytes read. */
+size_t pcm_ring_read(struct pcm_ring *ring, void *buffer, size_t len) {
+
+	struct pcm_ring_ctrl *ctrl = ring->ctrl;
+	const uint32_t mask = ring->size - 1;
+
+	uint32_t tail = atomic_load_explicit(&ctrl->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ctrl->head, memory_order_acquire);
+	size_t avail = pcm_ring_fill(ring, head, tail);
+
+	if (ring->broken)
+		return 0;
+
+	if (len > avail)
+		len = avail;
+
+	if (len > 0) {
+
+		size_t offset = tail & mask;
+		size_t chunk = ring->size - offset;
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(buffer, ring->data + offset, chunk);
+		memcpy((uint8_t *)buffer + chunk, ring->data, len - chunk);
+
+		atomic_store_explicit(&ctrl->tail, tail + len, memory_order_release);
+		pcm_ring_notify(&ctrl->wr_wait, ring->space_fd);
+
+	}
+
+	if (len == avail)
+		pcm_ring_rearm(ring, &ctrl->rd_wait, ring->data_fd, true);
+
+	return len;
+}
+
+/**
+ * Write data to the ring buffer.
+ *
+ * This function never blocks. In order to wait for space, one should poll
+ * the space_fd doorbell for reading.
+ *
+ * @param ring Address of the ring structure.
+ * @param buffer Address of the source buffer.
+ * @param len Number of bytes to write.
+ * @return This function returns the number of bytes written. */
+size_t pcm_ring_write(struct pcm_ring *ring, const void *buffer, size_t len) {
+
+	struct pcm_ring_ctrl *ctrl = ring->ctrl;
+	const uint32_t mask = ring->size - 1;
+
+	uint32_t head = atomic_load_explicit(&ctrl->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ctrl->tail, memory_order_acquire);
+	size_t space = ring->size - pcm_ring_fill(ring, head, tail);
+
+	if (ring->broken)
+		return 0;
+
+	if (len > space)
+		len = space;
+
+	if (len > 0) {
+
+		size_t offset = head & mask;
+		size_t chunk = ring->size - offset;
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(ring->data + offset, buffer, chunk);
+		memcpy(ring->data, (const uint8_t *)buffer + chunk, len - chunk);
+
+		atomic_store_explicit(&ctrl->head, head + len, memory_order_release);
+		pcm_ring_notify(&ctrl->rd_wait, ring->data_fd);
+
+	}
+
+	if (len == space)
+		pcm_ring_rearm(ring, &ctrl->wr_wait, ring->space_fd, false);
+
+	return len;
+}
+
+/**
+ * Get number of bytes available for reading.
+ *
+ * @param ring Address of the ring structure.
+ * @return This function returns the number of bytes stored in the ring. If
+ *   the ring state has been corrupted by the other side, zero is returned
+ *   and the ring is reported as closed. */
+size_t pcm_ring_len_out(struct pcm_ring *ring) {
+	return pcm_ring_fill(ring,
+			atomic_load_explicit(&ring->ctrl->head, memory_order_acquire),
+			atomic_load_explicit(&ring->ctrl->tail, memory_order_acquire));
+}
+
+/**
+ * Mark the ring as released and wake up the other side.
+ *
+ * @param ring Address of the ring structure. */
+void pcm_ring_close(struct pcm_ring *ring) {
+	if (ring->ctrl == NULL)
+		return;
+	atomic_store(&ring->ctrl->closed, 1);
+	eventfd_write(ring->data_fd, 1);
+	eventfd_write(ring->space_fd, 1);
+}
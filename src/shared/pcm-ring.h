@@ -0,0 +1,90 @@
+/*
+ * BlueALSA - pcm-ring.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_SHARED_PCMRING_H_
+#define BLUEALSA_SHARED_PCMRING_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Magic number stored at the beginning of the shared memory - "BAPR". */
+#define PCM_RING_MAGIC 0x42415052
+
+/**
+ * Control block of the ring, which is stored in the shared memory.
+ *
+ * Head and tail are free-running byte counters, so the number of bytes
+ * stored in the ring is always (head - tail). The size of the ring data
+ * area has to be a power of two. */
+struct pcm_ring_ctrl {
+
+	uint32_t magic;
+	uint32_t size;
+
+	/* total number of bytes written and read */
+	atomic_uint_least32_t head;
+	atomic_uint_least32_t tail;
+
+	/* Non-zero value indicates, that the reader (or the writer) has run out
+	 * of data (or space) and it shall be notified via the doorbell. */
+	atomic_uint_least32_t rd_wait;
+	atomic_uint_least32_t wr_wait;
+
+	/* set to non-zero when either side has released the ring */
+	atomic_uint_least32_t closed;
+
+};
+
+/**
+ * Single-producer/single-consumer ring buffer located in a memfd-backed
+ * shared memory, with the eventfd doorbells for both directions. */
+struct pcm_ring {
+	/* mapped control block followed by the data area */
+	struct pcm_ring_ctrl *ctrl;
+	uint8_t *data;
+	size_t mmap_size;
+	/* The size of the data area latched upon create (or attach). The control
+	 * block is writable by the other side, so it is not trusted afterwards. */
+	uint32_t size;
+	/* set when the other side has corrupted the ring state */
+	bool broken;
+	/* doorbell rung by the writer - readable when there is data */
+	int data_fd;
+	/* doorbell rung by the reader - readable when there is space */
+	int space_fd;
+};
+
+int pcm_ring_create(struct pcm_ring *ring, size_t size);
+int pcm_ring_attach(struct pcm_ring *ring, int memfd, int data_fd, int space_fd);
+void pcm_ring_free(struct pcm_ring *ring);
+
+size_t pcm_ring_read(struct pcm_ring *ring, void *buffer, size_t len);
+size_t pcm_ring_write(struct pcm_ring *ring, const void *buffer, size_t len);
+
+void pcm_ring_close(struct pcm_ring *ring);
+
+size_t pcm_ring_len_out(struct pcm_ring *ring);
+
+/**
+ * Get number of bytes available for writing. */
+#define pcm_ring_len_in(r) ((r)->broken ? 0 : (r)->size - pcm_ring_len_out(r))
+
+/**
+ * Check whether the ring has been released by any side. */
+#define pcm_ring_closed(r) ((r)->broken || \
+		atomic_load_explicit(&(r)->ctrl->closed, memory_order_acquire) != 0)
+
+#endif
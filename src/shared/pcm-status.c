@@ -0,0 +1,193 @@
+/*
+ * BlueALSA - pcm-status.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "pcm-status.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+# define MFD_CLOEXEC 0x0001U
+#endif
+
+/* the status page occupies single memory page */
+#define PCM_STATUS_SIZE 4096
+
+
+/**
+ * Create new status page in the shared memory.
+ *
+ * @param status Address of the status structure to initialize.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int pcm_status_create(struct pcm_status *status) {
+
+	void *addr;
+	int err;
+
+	status->page = NULL;
+
+	/* The memfd_create() wrapper is not available in older libc
+	 * implementations, so we will use a raw system call instead. */
+	if ((status->memfd = syscall(SYS_memfd_create, "bluealsa-status", MFD_CLOEXEC)) == -1)
+		return -1;
+
+	if (ftruncate(status->memfd, PCM_STATUS_SIZE) == -1)
+		goto fail;
+	if ((addr = mmap(NULL, PCM_STATUS_SIZE, PROT_READ | PROT_WRITE,
+					MAP_SHARED, status->memfd, 0)) == MAP_FAILED)
+		goto fail;
+
+	status->page = addr;
+	status->page->magic = PCM_STATUS_MAGIC;
+	atomic_init(&status->page->seq, 0);
+	atomic_init(&status->page->delay, 0);
+	atomic_init(&status->page->bt_queued, 0);
+	atomic_init(&status->page->hw_ptr, 0);
+	atomic_init(&status->page->timestamp, 0);
+
+	return 0;
+
+fail:
+	err = errno;
+	close(status->memfd);
+	status->memfd = -1;
+	errno = err;
+	return -1;
+}
+
+/**
+ * Attach to the status page created by the other side.
+ *
+ * The page is mapped read-only. The memfd file descriptor is not used
+ * afterwards, so it might be closed by the caller.
+ *
+ * @param status Address of the status structure to initialize.
+ * @param memfd The memfd file descriptor of the status page.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int pcm_status_attach(struct pcm_status *status, int memfd) {
+
+	struct stat st;
+	void *addr;
+
+	status->page = NULL;
+	status->memfd = -1;
+
+	if (fstat(memfd, &st) == -1)
+		return -1;
+	if (st.st_size != PCM_STATUS_SIZE) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	if ((addr = mmap(NULL, PCM_STATUS_SIZE, PROT_READ,
+					MAP_SHARED, memfd, 0)) == MAP_FAILED)
+		return -1;
+
+	if (((struct pcm_status_page *)addr)->magic != PCM_STATUS_MAGIC) {
+		munmap(addr, PCM_STATUS_SIZE);
+		errno = EPROTO;
+		return -1;
+	}
+
+	status->page = addr;
+	return 0;
+}
+
+/**
+ * Duplicate status page file descriptor with the read-only access mode.
+ *
+ * Such a descriptor can be passed to other process, which will not be able
+ * to modify the status page content.
+ *
+ * @param status Address of the status structure.
+ * @return Upon success this function returns new file descriptor. Otherwise,
+ *   -1 is returned and errno is set appropriately. */
+int pcm_status_dup_readonly(const struct pcm_status *status) {
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", status->memfd);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * Free resources allocated for the status page.
+ *
+ * It is safe to call this function for a zero-initialized structure.
+ *
+ * @param status Address of the status structure. */
+void pcm_status_free(struct pcm_status *status) {
+	if (status->page == NULL)
+		return;
+	munmap(status->page, PCM_STATUS_SIZE);
+	status->page = NULL;
+	if (status->memfd != -1) {
+		close(status->memfd);
+		status->memfd = -1;
+	}
+}
+
+/**
+ * Publish new status data.
+ *
+ * This function shall be called by the single writer only.
+ *
+ * @param status Address of the status structure.
+ * @param data Address of the status data to publish. */
+void pcm_status_update(struct pcm_status *status, const struct pcm_status_data *data) {
+
+	struct pcm_status_page *page = status->page;
+	const uint32_t seq = atomic_load_explicit(&page->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&page->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&page->delay, data->delay, memory_order_relaxed);
+	atomic_store_explicit(&page->bt_queued, data->bt_queued, memory_order_relaxed);
+	atomic_store_explicit(&page->hw_ptr, data->hw_ptr, memory_order_relaxed);
+	atomic_store_explicit(&page->timestamp, data->timestamp, memory_order_relaxed);
+
+	atomic_store_explicit(&page->seq, seq + 2, memory_order_release);
+
+}
+
+/**
+ * Read consistent snapshot of the status data.
+ *
+ * This function never blocks the writer. If the update is in progress, the
+ * read is retried.
+ *
+ * @param status Address of the status structure.
+ * @param data Address where the status data will be stored. */
+void pcm_status_read(const struct pcm_status *status, struct pcm_status_data *data) {
+
+	struct pcm_status_page *page = status->page;
+	uint32_t seq;
+
+	do {
+
+		while ((seq = atomic_load_explicit(&page->seq, memory_order_acquire)) & 1)
+			continue;
+
+		data->delay = atomic_load_explicit(&page->delay, memory_order_relaxed);
+		data->bt_queued = atomic_load_explicit(&page->bt_queued, memory_order_relaxed);
+		data->hw_ptr = atomic_load_explicit(&page->hw_ptr, memory_order_relaxed);
+		data->timestamp = atomic_load_explicit(&page->timestamp, memory_order_relaxed);
+
+		atomic_thread_fence(memory_order_acquire);
+
+	} while (atomic_load_explicit(&page->seq, memory_order_relaxed) != seq);
+
+}
@@ -0,0 +1,72 @@
+/*
+ * BlueALSA - pcm-status.h
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_SHARED_PCMSTATUS_H_
+#define BLUEALSA_SHARED_PCMSTATUS_H_
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Magic number stored at the beginning of the shared memory - "BAPS". */
+#define PCM_STATUS_MAGIC 0x42415053
+
+/**
+ * PCM status page, which is stored in the shared memory.
+ *
+ * The page is written by the server IO thread only, and it is protected by
+ * the sequence lock. Odd sequence number indicates, that the update is in
+ * progress. All fields are accessed atomically, so there is no data race,
+ * even though the snapshot might be inconsistent until verified with the
+ * sequence number. */
+struct pcm_status_page {
+
+	uint32_t magic;
+	atomic_uint_least32_t seq;
+
+	/* transport delay in 1/10 of millisecond */
+	atomic_uint_least32_t delay;
+	/* number of bytes queued in the BT socket output buffer */
+	atomic_uint_least32_t bt_queued;
+	/* number of frames transfered by the server IO thread */
+	atomic_uint_least64_t hw_ptr;
+	/* time-stamp (CLOCK_MONOTONIC) of the last update in microseconds */
+	atomic_uint_least64_t timestamp;
+
+};
+
+/**
+ * Snapshot of the PCM status page. */
+struct pcm_status_data {
+	unsigned int delay;
+	unsigned int bt_queued;
+	uint64_t hw_ptr;
+	uint64_t timestamp;
+};
+
+struct pcm_status {
+	/* mapped status page - NULL if not available */
+	struct pcm_status_page *page;
+	int memfd;
+};
+
+int pcm_status_create(struct pcm_status *status);
+int pcm_status_attach(struct pcm_status *status, int memfd);
+int pcm_status_dup_readonly(const struct pcm_status *status);
+void pcm_status_free(struct pcm_status *status);
+
+void pcm_status_update(struct pcm_status *status, const struct pcm_status_data *data);
+void pcm_status_read(const struct pcm_status *status, struct pcm_status_data *data);
+
+#endif
@@ -10,6 +10,7 @@
 
 #include "rt.h"
 
+#include <errno.h>
 #include <stdlib.h>
 
 
@@ -18,9 +19,10 @@
  *
  * Notes:
  * 1. Time synchronization relies on the frame counter being linear.
- * 2. In order to prevent frame counter overflow (for more information see
- *   the asrsync structure definition), this counter should be initialized
- *   (zeroed) upon every transfer stop.
+ * 2. The frame counter should be initialized (zeroed) upon every transfer
+ *   stop, otherwise the transfer will be resumed with a burst.
+ * 3. After an overrun, the synchronization behaves according to the
+ *   catchup field of the asrsync structure.
  *
  * @param asrs Pointer to the time synchronization structure.
  * @param frames Number of frames since the last call to this function.
@@ -31,31 +33,72 @@
 int asrsync_sync(struct asrsync *asrs, unsigned int frames) {
 
 	const unsigned int rate = asrs->rate;
-	struct timespec ts_rate;
+	struct timespec ts_deadline;
 	struct timespec ts;
 	int rv = 0;
 
 	asrs->frames += frames;
-	frames = asrs->frames;
 
-	ts_rate.tv_sec = frames / rate;
-	ts_rate.tv_nsec = 1000000000 / rate * (frames % rate);
+	/* absolute deadline for the transfered frames */
+	ts_deadline.tv_sec = asrs->ts0.tv_sec + asrs->frames / rate;
+	ts_deadline.tv_nsec = asrs->ts0.tv_nsec + (asrs->frames % rate) * 1000000000 / rate;
+	if (ts_deadline.tv_nsec >= 1000000000) {
+		ts_deadline.tv_nsec -= 1000000000;
+		ts_deadline.tv_sec++;
+	}
 
-	gettimestamp(&ts);
+	clock_gettime(ASRSYNC_CLOCK, &ts);
 	/* calculate delay since the last sync */
 	difftimespec(&asrs->ts, &ts, &asrs->ts_busy);
 
 	/* maintain constant rate */
-	difftimespec(&asrs->ts0, &ts, &ts);
-	if (difftimespec(&ts, &ts_rate, &asrs->ts_idle) > 0) {
-		nanosleep(&asrs->ts_idle, NULL);
+	if (difftimespec(&ts, &ts_deadline, &asrs->ts_idle) > 0) {
+		while (clock_nanosleep(ASRSYNC_CLOCK, TIMER_ABSTIME, &ts_deadline, NULL) == EINTR)
+			continue;
 		rv = 1;
 	}
+	else if (asrs->catchup == ASRSYNC_CATCHUP_SKIP) {
+		/* move the reference time point by the overdue time */
+		asrs->ts0.tv_sec += asrs->ts_idle.tv_sec;
+		asrs->ts0.tv_nsec += asrs->ts_idle.tv_nsec;
+		if (asrs->ts0.tv_nsec >= 1000000000) {
+			asrs->ts0.tv_nsec -= 1000000000;
+			asrs->ts0.tv_sec++;
+		}
+		asrs->skipped += asrsync_get_overdue_usec(asrs);
+	}
 
-	gettimestamp(&asrs->ts);
+	clock_gettime(ASRSYNC_CLOCK, &asrs->ts);
 	return rv;
 }
 
+/**
+ * Check whether the deadline for the given number of frames has passed.
+ *
+ * This function does not modify the synchronization structure, so it can be
+ * used to check whether the subsequent asrsync_sync() call will block.
+ *
+ * @param asrs Pointer to the time synchronization structure.
+ * @param frames Number of frames since the last call to asrsync_sync().
+ * @return This function returns true if the deadline has already passed. */
+bool asrsync_is_overdue(const struct asrsync *asrs, unsigned int frames) {
+
+	const unsigned int rate = asrs->rate;
+	const uint64_t total = asrs->frames + frames;
+	struct timespec ts_deadline;
+	struct timespec ts;
+
+	ts_deadline.tv_sec = asrs->ts0.tv_sec + total / rate;
+	ts_deadline.tv_nsec = asrs->ts0.tv_nsec + (total % rate) * 1000000000 / rate;
+	if (ts_deadline.tv_nsec >= 1000000000) {
+		ts_deadline.tv_nsec -= 1000000000;
+		ts_deadline.tv_sec++;
+	}
+
+	clock_gettime(ASRSYNC_CLOCK, &ts);
+	return difftimespec(&ts, &ts_deadline, &ts) <= 0;
+}
+
 /**
  * Calculate time difference for two time points.
  *
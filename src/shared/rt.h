@@ -11,15 +11,33 @@
 #ifndef BLUEALSA_SHARED_RT_H_
 #define BLUEALSA_SHARED_RT_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
+/* Clock used for the time synchronization. It has to be supported by the
+ * clock_nanosleep(), hence the CLOCK_MONOTONIC_RAW can not be used. */
+#define ASRSYNC_CLOCK CLOCK_MONOTONIC
+
+/**
+ * Behavior of the time synchronization after an overrun. */
+enum asrsync_catchup {
+	/* Keep the original time line - frames which are overdue are
+	 * transfered without any delay, until the synchronization is
+	 * regained. */
+	ASRSYNC_CATCHUP_BURST = 0,
+	/* Move the time line by the overdue time, so the transfer will
+	 * continue with the nominal rate right away. */
+	ASRSYNC_CATCHUP_SKIP,
+};
+
 /**
  * Structure used for time synchronization.
  *
- * With the size of the frame counter being 32 bits, it is possible to track
- * up to ~24 hours, with the sampling rate of 48 kHz. If it is insufficient,
- * one can switch to 64 bits, which would suffice for 12 million years. */
+ * Every synchronization point is an absolute deadline calculated from the
+ * reference time point and the number of transfered frames. Hence, there
+ * is no error accumulation over time. With the 64-bit frame counter it is
+ * possible to track millions of years of audio. */
 struct asrsync {
 
 	/* used sampling rate */
@@ -30,7 +48,7 @@ struct asrsync {
 	/* time-stamp from the previous sync */
 	struct timespec ts;
 	/* transfered frames since ts0 */
-	uint32_t frames;
+	uint64_t frames;
 
 	/* time spent outside of the sync function */
 	struct timespec ts_busy;
@@ -40,6 +58,12 @@ struct asrsync {
 	 * too much time spent outside of the sync function. */
 	struct timespec ts_idle;
 
+	/* overrun handling mode */
+	enum asrsync_catchup catchup;
+	/* Accumulated time (in microseconds) by which the time line has been
+	 * moved due to overruns. This value is not reset by the init. */
+	uint64_t skipped;
+
 };
 
 /**
@@ -49,18 +73,24 @@ struct asrsync {
  * @param sr Synchronization sampling rate. */
 #define asrsync_init(asrs, sr) do { \
 		(asrs)->rate = sr; \
-		gettimestamp(&(asrs)->ts0); \
+		clock_gettime(ASRSYNC_CLOCK, &(asrs)->ts0); \
 		(asrs)->ts = (asrs)->ts0; \
 		(asrs)->frames = 0; \
 	} while (0)
 
 int asrsync_sync(struct asrsync *asrs, unsigned int frames);
+bool asrsync_is_overdue(const struct asrsync *asrs, unsigned int frames);
 
 /**
  * Get the number of microseconds spent outside of the sync function. */
 #define asrsync_get_busy_usec(asrs) \
 	((asrs)->ts_busy.tv_nsec / 1000)
 
+/**
+ * Get the overdue time (in microseconds) of the last synchronization. */
+#define asrsync_get_overdue_usec(asrs) \
+	((asrs)->ts_idle.tv_sec * 1000000 + (asrs)->ts_idle.tv_nsec / 1000)
+
 /**
  * Get system monotonic time-stamp.
  *
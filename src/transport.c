@@ -13,10 +13,14 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -31,10 +35,16 @@
 #include "ctl.h"
 #include "hfp.h"
 #include "io.h"
+#include "mem-pool.h"
 #include "rfcomm.h"
 #include "utils.h"
+#include "shared/defs.h"
 #include "log.h"
 
+/* Released device and transport structures are kept for reuse, because
+ * they are allocated and freed upon every (re)connection. */
+static struct mem_pool device_pool = MEM_POOL_INITIALIZER(struct ba_device);
+static struct mem_pool transport_pool = MEM_POOL_INITIALIZER(struct ba_transport);
 
 static const char *transport_type_to_string(enum ba_transport_type type) {
 	switch (type) {
@@ -48,11 +58,162 @@ static const char *transport_type_to_string(enum ba_transport_type type) {
 	return "N/A";
 }
 
+/**
+ * Lock process memory, so the IO threads will not stall on page faults.
+ *
+ * This function is called only once, before the first IO thread is created.
+ * Without the CAP_IPC_LOCK capability, all future mappings would count into
+ * the (usually small) memory lock limit, which might end up with allocation
+ * failures. In such a case memory is not locked at all. */
+static void io_thread_mlockall(void) {
+
+	static bool done = false;
+	struct rlimit limit;
+
+	if (done || !config.io_thread.mlockall)
+		return;
+	done = true;
+
+	if (geteuid() != 0 &&
+			getrlimit(RLIMIT_MEMLOCK, &limit) == 0 &&
+			limit.rlim_cur != RLIM_INFINITY) {
+		warn("Couldn't lock memory: Memory lock limit is too low");
+		return;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		warn("Couldn't lock memory: %s", strerror(errno));
+	else
+		debug("Process memory locked");
+
+}
+
+/**
+ * Get the part of the CPU set assigned to the given HCI device.
+ *
+ * When more than one HCI device is used, CPUs from the configured set are
+ * distributed between HCI devices in the round-robin fashion, so IO threads
+ * of different adapters do not compete for the same CPU. If there are fewer
+ * CPUs than HCI devices, some CPUs are shared.
+ *
+ * @param cpus The configured CPU set.
+ * @param hci_dev_id HCI device ID of the transport.
+ * @return The CPU set for the IO thread of the given HCI device. */
+static uint64_t io_thread_hci_dev_cpus(uint64_t cpus, int hci_dev_id) {
+
+	const int index = bluealsa_hci_dev_index(hci_dev_id);
+	size_t count = 0;
+	size_t i, n;
+	uint64_t set = 0;
+
+	if (config.hci_devs_len < 2 || index == -1)
+		return cpus;
+
+	for (i = 0; i < 64; i++)
+		if (cpus & (1ULL << i))
+			count++;
+
+	if (count < 2)
+		return cpus;
+
+	for (i = n = 0; i < 64; i++)
+		if (cpus & (1ULL << i)) {
+			if (count >= config.hci_devs_len ?
+					n % config.hci_devs_len == (size_t)index :
+					n == (size_t)index % count)
+				set |= 1ULL << i;
+			n++;
+		}
+
+	return set;
+}
+
+/**
+ * Apply configured scheduling policy and CPU affinity to the IO thread.
+ *
+ * Lack of privileges is not considered to be an error. In such a case the
+ * IO thread runs with the default scheduling, and the warning is logged
+ * only once. */
+static void io_thread_set_policy(struct ba_transport *t) {
+
+	static bool warned_sched = false;
+	static bool warned_affinity = false;
+	uint64_t cpus = 0;
+	int ret;
+
+	switch (t->type) {
+	case TRANSPORT_TYPE_A2DP:
+		cpus = config.io_thread.cpus_a2dp;
+		break;
+	case TRANSPORT_TYPE_RFCOMM:
+		/* RFCOMM is not time critical */
+		return;
+	case TRANSPORT_TYPE_SCO:
+		cpus = config.io_thread.cpus_sco;
+		break;
+	}
+
+	if (config.io_thread.policy != SCHED_OTHER) {
+		struct sched_param param = { .sched_priority = config.io_thread.priority };
+		if ((ret = pthread_setschedparam(t->thread, config.io_thread.policy, &param)) != 0 &&
+				!warned_sched) {
+			warn("Couldn't set IO thread real-time priority: %s", strerror(ret));
+			warned_sched = true;
+		}
+	}
+
+	if (cpus != 0) {
+
+		cpu_set_t set;
+		size_t i;
+
+		cpus = io_thread_hci_dev_cpus(cpus, t->device->hci_dev_id);
+
+		CPU_ZERO(&set);
+		for (i = 0; i < 64; i++)
+			if (cpus & (1ULL << i))
+				CPU_SET(i, &set);
+
+		if ((ret = pthread_setaffinity_np(t->thread, sizeof(set), &set)) != 0 &&
+				!warned_affinity) {
+			warn("Couldn't set IO thread CPU affinity: %s", strerror(ret));
+			warned_affinity = true;
+		}
+
+	}
+
+}
+
+/**
+ * Entry point of the IO thread.
+ *
+ * All IO buffers allocated by the IO thread routine are charged to the
+ * memory budget of the served transport. */
+static void *io_thread_start(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+	ffb_budget_attach(&t->buffers);
+	return t->routine(t);
+}
+
 static int io_thread_create(struct ba_transport *t) {
 
 	void *(*routine)(void *) = NULL;
 	int ret;
 
+	/* Transports which are implemented as a file descriptor (or timer)
+	 * driven state machine can be served by the shared pool of IO engine
+	 * workers. A2DP sources block on the PCM read and on the BT socket
+	 * write, and the RFCOMM loop uses blocking AT command writes, so these still
+	 * require a dedicated IO thread. */
+	if (io_engine_enabled()) {
+		if (t->type == TRANSPORT_TYPE_A2DP &&
+				t->profile == BLUETOOTH_PROFILE_A2DP_SINK &&
+				t->codec == A2DP_CODEC_SBC)
+			return io_engine_a2dp_sink_sbc(t);
+		if (t->type == TRANSPORT_TYPE_SCO)
+			return io_engine_sco(t);
+	}
+
 	switch (t->type) {
 	case TRANSPORT_TYPE_A2DP:
 		if (t->profile == BLUETOOTH_PROFILE_A2DP_SOURCE)
@@ -62,6 +223,7 @@ static int io_thread_create(struct ba_transport *t) {
 				break;
 #if ENABLE_MPEG
 			case A2DP_CODEC_MPEG12:
+				/* served by the passthrough IO loop only */
 				break;
 #endif
 #if ENABLE_AAC
@@ -74,6 +236,11 @@ static int io_thread_create(struct ba_transport *t) {
 				routine = io_thread_a2dp_source_aptx;
 				break;
 #endif
+#if ENABLE_APTX_HD
+			case A2DP_CODEC_VENDOR_APTX_HD:
+				routine = io_thread_a2dp_source_aptx_hd;
+				break;
+#endif
 #if ENABLE_LDAC
 			case A2DP_CODEC_VENDOR_LDAC:
 				routine = io_thread_a2dp_source_ldac;
@@ -108,27 +275,48 @@ static int io_thread_create(struct ba_transport *t) {
 		break;
 	}
 
+	/* Codecs which can be fed with the encoded data are served by the
+	 * dispatcher, which switches between the encoder and the passthrough
+	 * IO loop, depending on the format requested upon the PCM open. */
+	if (t->type == TRANSPORT_TYPE_A2DP &&
+			t->profile == BLUETOOTH_PROFILE_A2DP_SOURCE &&
+			transport_get_pcm_formats(t) & (1 << BA_PCM_FORMAT_ENCODED)) {
+		t->a2dp.encoder = routine;
+		routine = io_thread_a2dp_source_dispatch;
+	}
+
 	if (routine == NULL)
 		return -1;
 
-	if ((ret = pthread_create(&t->thread, NULL, routine, t)) != 0) {
+	io_thread_mlockall();
+
+	t->routine = routine;
+	if ((ret = pthread_create(&t->thread, NULL, io_thread_start, t)) != 0) {
 		error("Couldn't create IO thread: %s", strerror(ret));
 		t->thread = config.main_thread;
 		return -1;
 	}
 
 	pthread_setname_np(t->thread, "baio");
+	io_thread_set_policy(t);
 	debug("Created new IO thread: %s: %s",
 			transport_type_to_string(t->type),
 			bluetooth_profile_to_string(t->profile));
 	return 0;
 }
 
+/**
+ * Synchronous termination of the transport IO (either thread or task). */
+static void io_thread_cancel(struct ba_transport *t) {
+	io_engine_task_stop(&t->task);
+	transport_pthread_cancel(t->thread);
+}
+
 struct ba_device *device_new(int hci_dev_id, const bdaddr_t *addr, const char *name) {
 
 	struct ba_device *d;
 
-	if ((d = calloc(1, sizeof(*d))) == NULL)
+	if ((d = mem_pool_alloc(&device_pool)) == NULL)
 		return NULL;
 
 	d->hci_dev_id = hci_dev_id;
@@ -140,6 +328,8 @@ struct ba_device *device_new(int hci_dev_id, const bdaddr_t *addr, const char *n
 	d->transports = g_hash_table_new_full(g_str_hash, g_str_equal,
 			NULL, (GDestroyNotify)transport_free);
 
+	codec_cache_init(&d->codecs);
+
 	return d;
 }
 
@@ -175,7 +365,8 @@ void device_free(struct ba_device *d) {
 	}
 
 	g_hash_table_unref(d->transports);
-	free(d);
+	codec_cache_free(&d->codecs);
+	mem_pool_release(&device_pool, d);
 }
 
 struct ba_device *device_get(GHashTable *devices, const char *key) {
@@ -184,6 +375,7 @@ struct ba_device *device_get(GHashTable *devices, const char *key) {
 	char name[sizeof(d->name)];
 	GVariant *property;
 	bdaddr_t addr;
+	int hci_dev_id;
 
 	if ((d = g_hash_table_lookup(devices, key)) != NULL)
 		return d;
@@ -199,7 +391,11 @@ struct ba_device *device_get(GHashTable *devices, const char *key) {
 		g_variant_unref(property);
 	}
 
-	d = device_new(config.hci_dev.dev_id, &addr, name);
+	/* device path is prefixed with the path of the adapter it belongs to */
+	if ((hci_dev_id = g_dbus_object_path_to_hci_dev_id(key)) == -1)
+		hci_dev_id = config.hci_devs[0].dev_id;
+
+	d = device_new(hci_dev_id, &addr, name);
 	g_hash_table_insert(devices, g_strdup(key), d);
 	return d;
 }
@@ -215,7 +411,7 @@ bool device_remove(GHashTable *devices, const char *key) {
 void device_set_battery_level(struct ba_device *d, uint8_t value) {
 	d->battery.enabled = true;
 	d->battery.level = value;
-	bluealsa_ctl_event(BA_EVENT_UPDATE_BATTERY);
+	bluealsa_ctl_event_device(BA_EVENT_UPDATE_BATTERY, d);
 }
 
 /**
@@ -241,7 +437,7 @@ struct ba_transport *transport_new(
 	struct ba_transport *t;
 	int err;
 
-	if ((t = calloc(1, sizeof(*t))) == NULL)
+	if ((t = mem_pool_alloc(&transport_pool)) == NULL)
 		goto fail;
 
 	t->device = device;
@@ -255,23 +451,27 @@ struct ba_transport *transport_new(
 		t->codec = HFP_CODEC_CVSD;
 
 	pthread_mutex_init(&t->mutex, NULL);
+	pthread_mutex_init(&t->cmdq.ack_mutex, NULL);
+	pthread_cond_init(&t->cmdq.ack_cond, NULL);
 
 	t->state = TRANSPORT_IDLE;
 	t->thread = config.main_thread;
 
 	t->bt_fd = -1;
-	t->sig_fd[0] = -1;
-	t->sig_fd[1] = -1;
+	t->sig_fd = -1;
+
+	t->buffers.limit = config.io_thread.buffer_limit;
 
 	if ((t->dbus_owner = strdup(dbus_owner)) == NULL)
 		goto fail;
 	if ((t->dbus_path = strdup(dbus_path)) == NULL)
 		goto fail;
 
-	if (pipe(t->sig_fd) == -1)
+	if ((t->sig_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
 		goto fail;
 
 	g_hash_table_insert(device->transports, t->dbus_path, t);
+	g_hash_table_insert(config.transports, t->dbus_path, t);
 	return t;
 
 fail:
@@ -298,6 +498,7 @@ struct ba_transport *transport_new_a2dp(
 
 	t->a2dp.ch1_volume = 127;
 	t->a2dp.ch2_volume = 127;
+	t->a2dp.volume_update_next = -1;
 
 	if (config_size > 0) {
 		t->a2dp.cconfig = malloc(config_size);
@@ -305,12 +506,13 @@ struct ba_transport *transport_new_a2dp(
 		memcpy(t->a2dp.cconfig, config, config_size);
 	}
 
+	t->a2dp.pcm.t = t;
 	t->a2dp.pcm.fd = -1;
 	t->a2dp.pcm.client = -1;
-	pthread_cond_init(&t->a2dp.pcm.drained, NULL);
-	pthread_mutex_init(&t->a2dp.pcm.drained_mn, NULL);
+	atomic_init(&t->a2dp.pcm.drain, BA_PCM_DRAIN_NONE);
+	t->a2dp.keep_alive = transport_get_default_keep_alive(t);
 
-	bluealsa_ctl_event(BA_EVENT_TRANSPORT_ADDED);
+	bluealsa_ctl_event_transport(BA_EVENT_TRANSPORT_ADDED, t);
 	return t;
 }
 
@@ -321,17 +523,17 @@ void transport_sco_init(struct ba_transport * t) {
 
 	t->sco.spk_gain = 15;
 	t->sco.mic_gain = 15;
+	t->sco.connect_fd = -1;
 
+	spk_pcm->t = t;
 	spk_pcm->fd = -1;
 	spk_pcm->client = -1;
+	atomic_init(&spk_pcm->drain, BA_PCM_DRAIN_NONE);
 
-	pthread_cond_init(&spk_pcm->drained, NULL);
-	pthread_mutex_init(&spk_pcm->drained_mn, NULL);
-
+	mic_pcm->t = t;
 	mic_pcm->fd = -1;
 	mic_pcm->client = -1;
-	pthread_cond_init(&mic_pcm->drained, NULL);
-	pthread_mutex_init(&mic_pcm->drained_mn, NULL);
+	atomic_init(&mic_pcm->drain, BA_PCM_DRAIN_NONE);
 
 }
 
@@ -359,7 +561,7 @@ struct ba_transport *transport_new_rfcomm(
 
 	transport_sco_init(t_sco);
 
-	bluealsa_ctl_event(BA_EVENT_TRANSPORT_ADDED);
+	bluealsa_ctl_event_transport(BA_EVENT_TRANSPORT_ADDED, t_sco);
 	return t;
 
 fail:
@@ -369,6 +571,24 @@ fail:
 	return NULL;
 }
 
+/**
+ * Send the status of the pending drain request right away - the transport
+ * is going away, so the controller thread will not be able to do it. */
+static void transport_pcm_drain_abort(struct ba_pcm *pcm) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_ERROR_UNKNOWN };
+	int state;
+
+	if ((state = atomic_exchange(&pcm->drain, BA_PCM_DRAIN_NONE)) == BA_PCM_DRAIN_NONE ||
+			pcm->client == -1)
+		return;
+
+	if (state == BA_PCM_DRAIN_DONE)
+		status.code = BA_STATUS_CODE_SUCCESS;
+	send(pcm->client, &status, sizeof(status), MSG_NOSIGNAL);
+
+}
+
 void transport_free(struct ba_transport *t) {
 
 	if (t == NULL || t->state == TRANSPORT_LIMBO)
@@ -384,7 +604,7 @@ void transport_free(struct ba_transport *t) {
 	 * terminate the IO thread (or at least make sure it is not running any
 	 * more). Not doing so might result in an undefined behavior or even a
 	 * race condition (closed and reused file descriptor). */
-	transport_pthread_cancel(t->thread);
+	io_thread_cancel(t);
 
 	/* if possible, try to release resources gracefully */
 	if (t->release != NULL)
@@ -392,19 +612,30 @@ void transport_free(struct ba_transport *t) {
 
 	if (t->bt_fd != -1)
 		close(t->bt_fd);
-	if (t->sig_fd[0] != -1)
-		close(t->sig_fd[0]);
-	if (t->sig_fd[1] != -1)
-		close(t->sig_fd[1]);
+
+	/* BT sockets carried by undelivered link commands are owned by us */
+	struct ba_transport_cmd cmd;
+	while (t->sig_fd != -1 && transport_recv_command(t, &cmd))
+		if (cmd.sig == TRANSPORT_GROUP_LINK)
+			close(cmd.link.bt_fd);
+
+	if (t->sig_fd != -1)
+		close(t->sig_fd);
 
 	pthread_mutex_destroy(&t->mutex);
+	pthread_mutex_destroy(&t->cmdq.ack_mutex);
+	pthread_cond_destroy(&t->cmdq.ack_cond);
 
 	/* free type-specific resources */
 	switch (t->type) {
 	case TRANSPORT_TYPE_A2DP:
+		transport_acquire_bt_a2dp_cancel(t, NULL);
+		transport_pcm_drain_abort(&t->a2dp.pcm);
+		transport_set_pcm_client(t, &t->a2dp.pcm, -1);
 		transport_release_pcm(&t->a2dp.pcm);
-		pthread_cond_destroy(&t->a2dp.pcm.drained);
-		pthread_mutex_destroy(&t->a2dp.pcm.drained_mn);
+		pcm_ring_free(&t->a2dp.pcm.shm);
+		pcm_status_free(&t->a2dp.pcm.status);
+		resampler_free(&t->a2dp.pcm.rs);
 		free(t->a2dp.cconfig);
 		break;
 	case TRANSPORT_TYPE_RFCOMM:
@@ -413,12 +644,15 @@ void transport_free(struct ba_transport *t) {
 		transport_free(t->rfcomm.sco);
 		break;
 	case TRANSPORT_TYPE_SCO:
+		transport_pcm_drain_abort(&t->sco.spk_pcm);
+		transport_set_pcm_client(t, &t->sco.spk_pcm, -1);
 		transport_release_pcm(&t->sco.spk_pcm);
-		pthread_cond_destroy(&t->sco.spk_pcm.drained);
-		pthread_mutex_destroy(&t->sco.spk_pcm.drained_mn);
+		pcm_ring_free(&t->sco.spk_pcm.shm);
+		pcm_status_free(&t->sco.spk_pcm.status);
+		transport_set_pcm_client(t, &t->sco.mic_pcm, -1);
 		transport_release_pcm(&t->sco.mic_pcm);
-		pthread_cond_destroy(&t->sco.mic_pcm.drained);
-		pthread_mutex_destroy(&t->sco.mic_pcm.drained_mn);
+		pcm_ring_free(&t->sco.mic_pcm.shm);
+		pcm_status_free(&t->sco.mic_pcm.status);
 		if (!t->sco.is_ofono)
 			t->sco.rfcomm->rfcomm.sco = NULL;
 		break;
@@ -428,57 +662,119 @@ void transport_free(struct ba_transport *t) {
 	 * removing a value from the hash-table shouldn't hurt - it would have been
 	 * removed anyway. */
 	g_hash_table_steal(t->device->transports, t->dbus_path);
+	if (t->dbus_path != NULL &&
+			g_hash_table_lookup(config.transports, t->dbus_path) == t)
+		g_hash_table_remove(config.transports, t->dbus_path);
 
-	bluealsa_ctl_event(BA_EVENT_TRANSPORT_REMOVED);
+	bluealsa_ctl_event_transport(BA_EVENT_TRANSPORT_REMOVED, t);
 
 	free(t->dbus_owner);
 	free(t->dbus_path);
-	free(t);
+	mem_pool_release(&transport_pool, t);
 }
 
-struct ba_transport *transport_lookup(GHashTable *devices, const char *dbus_path) {
-
-	GHashTableIter iter;
-	struct ba_device *d;
-	struct ba_transport *t;
-
-	g_hash_table_iter_init(&iter, devices);
-	while (g_hash_table_iter_next(&iter, NULL, (gpointer)&d)) {
-		if ((t = g_hash_table_lookup(d->transports, dbus_path)) != NULL)
-			return t;
-	}
+/**
+ * Release structures kept in the device and transport pools. */
+void transport_pool_free(void) {
+	mem_pool_free(&transport_pool);
+	mem_pool_free(&device_pool);
+}
 
-	return NULL;
+/**
+ * Lookup transport by the D-Bus path.
+ *
+ * The lookup is done with the transport index, so it does not depend on
+ * the number of connected devices. This function shall be called with
+ * the devices mutex locked.
+ *
+ * @param devices Collection of connected devices.
+ * @param dbus_path D-Bus path of the transport.
+ * @return On success this function returns the pointer to the transport
+ *   structure. Otherwise, NULL is returned. */
+struct ba_transport *transport_lookup(GHashTable *devices, const char *dbus_path) {
+	(void)devices;
+	return g_hash_table_lookup(config.transports, dbus_path);
 }
 
+/**
+ * Lookup transport by the PCM client identifier.
+ *
+ * This function shall be called with the devices mutex locked.
+ *
+ * @param devices Collection of connected devices.
+ * @param client PCM client identifier.
+ * @return On success this function returns the pointer to the transport
+ *   structure. Otherwise, NULL is returned. */
 struct ba_transport *transport_lookup_pcm_client(GHashTable *devices, int client) {
+	(void)devices;
+	GSList *list = g_hash_table_lookup(config.pcm_clients, GINT_TO_POINTER(client));
+	return list != NULL ? list->data : NULL;
+}
 
-	GHashTableIter iter_d, iter_t;
-	struct ba_device *d;
-	struct ba_transport *t;
+/**
+ * Get the keep-alive time (in seconds) configured for the transport.
+ *
+ * @param t Transport structure.
+ * @return In the always-acquired standby mode, source transports are kept
+ *   alive indefinitely - this function returns -1. Otherwise, the value of
+ *   the global keep-alive option is returned. */
+int transport_get_default_keep_alive(const struct ba_transport *t) {
+	if (t->profile == BLUETOOTH_PROFILE_A2DP_SOURCE &&
+			config.a2dp.standby == BA_A2DP_STANDBY_ALWAYS)
+		return -1;
+	return config.a2dp.keep_alive;
+}
 
-	g_hash_table_iter_init(&iter_d, devices);
-	while (g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d)) {
-		g_hash_table_iter_init(&iter_t, d->transports);
-		while (g_hash_table_iter_next(&iter_t, NULL, (gpointer)&t)) {
-			switch (t->type) {
-			case TRANSPORT_TYPE_A2DP:
-				if (t->a2dp.pcm.client == client)
-					return t;
-				break;
-			case TRANSPORT_TYPE_RFCOMM:
-				break;
-			case TRANSPORT_TYPE_SCO:
-				if (t->sco.spk_pcm.client == client)
-					return t;
-				if (t->sco.mic_pcm.client == client)
-					return t;
-				break;
-			}
+/**
+ * Check whether any PCM of the transport is used by the given client. */
+static bool transport_has_pcm_client(const struct ba_transport *t, int client) {
+	switch (t->type) {
+	case TRANSPORT_TYPE_A2DP:
+		return t->a2dp.pcm.client == client;
+	case TRANSPORT_TYPE_RFCOMM:
+		break;
+	case TRANSPORT_TYPE_SCO:
+		return t->sco.spk_pcm.client == client ||
+			t->sco.mic_pcm.client == client;
+	}
+	return false;
+}
+
+/**
+ * Associate transport PCM with the client.
+ *
+ * This function keeps the PCM client index up to date, so it shall be
+ * used instead of a direct modification of the client field. It shall be
+ * called with the devices mutex locked.
+ *
+ * @param t Transport structure, which owns the PCM.
+ * @param pcm PCM structure.
+ * @param client PCM client identifier or -1 to drop the association. */
+void transport_set_pcm_client(struct ba_transport *t, struct ba_pcm *pcm, int client) {
+
+	const int old = pcm->client;
+	GSList *list;
+
+	if ((pcm->client = client) != -1) {
+		list = g_hash_table_lookup(config.pcm_clients, GINT_TO_POINTER(client));
+		if (g_slist_find(list, t) == NULL) {
+			/* steal the list, so it will not be freed upon replacement */
+			g_hash_table_steal(config.pcm_clients, GINT_TO_POINTER(client));
+			g_hash_table_insert(config.pcm_clients, GINT_TO_POINTER(client),
+					g_slist_prepend(list, t));
 		}
 	}
 
-	return NULL;
+	/* The client might still be using other PCM of this transport (e.g.
+	 * both SCO streams), in which case the index entry is kept. */
+	if (old == -1 || old == client || transport_has_pcm_client(t, old))
+		return;
+
+	list = g_hash_table_lookup(config.pcm_clients, GINT_TO_POINTER(old));
+	g_hash_table_steal(config.pcm_clients, GINT_TO_POINTER(old));
+	if ((list = g_slist_remove(list, t)) != NULL)
+		g_hash_table_insert(config.pcm_clients, GINT_TO_POINTER(old), list);
+
 }
 
 bool transport_remove(GHashTable *devices, const char *dbus_path) {
@@ -505,18 +801,367 @@ bool transport_remove(GHashTable *devices, const char *dbus_path) {
 	return false;
 }
 
+/**
+ * Coalesced commands in the order of dispatching. The PCM close goes before
+ * the PCM open, so the close followed by the open is seen as the reopen
+ * (the open followed by the close cancels the open, see below). The drain
+ * is dispatched after all other state changes. */
+static const enum ba_transport_signal transport_cmdq_coalesced[] = {
+	TRANSPORT_PCM_CLOSE,
+	TRANSPORT_PCM_OPEN,
+	TRANSPORT_PCM_PAUSE,
+	TRANSPORT_PCM_RESUME,
+	TRANSPORT_SET_VOLUME,
+	TRANSPORT_PCM_SYNC,
+};
+
+/**
+ * Get the PCM which can be drained with the PCM sync command. */
+static struct ba_pcm *transport_get_drain_pcm(struct ba_transport *t) {
+	switch (t->profile) {
+	case BLUETOOTH_PROFILE_NULL:
+	case BLUETOOTH_PROFILE_A2DP_SINK:
+		break;
+	case BLUETOOTH_PROFILE_A2DP_SOURCE:
+		return &t->a2dp.pcm;
+	case BLUETOOTH_PROFILE_HSP_AG:
+	case BLUETOOTH_PROFILE_HFP_AG:
+		return &t->sco.spk_pcm;
+	case BLUETOOTH_PROFILE_HSP_HS:
+	case BLUETOOTH_PROFILE_HFP_HF:
+		break;
+	}
+	return NULL;
+}
+
+/**
+ * Get the sequence number of the ring slot.
+ *
+ * The slot is free for the ring position equal to its sequence number, and
+ * it holds the command for the position one less than its sequence number.
+ * The stored value is shifted by the slot index, so the zero-filled ring
+ * is a valid empty ring. */
+static unsigned int transport_cmdq_slot_seq(struct ba_transport *t, unsigned int i) {
+	return atomic_load_explicit(&t->cmdq.slots[i].seq, memory_order_acquire) + i;
+}
+
+static void transport_cmdq_slot_set_seq(struct ba_transport *t, unsigned int i,
+		unsigned int seq) {
+	atomic_store_explicit(&t->cmdq.slots[i].seq, seq - i, memory_order_release);
+}
+
+/**
+ * Push the command into the ring - multiple senders are allowed. */
+static int transport_cmdq_push(struct ba_transport *t, const struct ba_transport_cmd *cmd) {
+
+	unsigned int pos = atomic_load_explicit(&t->cmdq.head, memory_order_relaxed);
+
+	for (;;) {
+		const unsigned int i = pos % TRANSPORT_CMDQ_SIZE;
+		const int diff = transport_cmdq_slot_seq(t, i) - pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&t->cmdq.head, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed)) {
+				t->cmdq.slots[i].cmd = *cmd;
+				transport_cmdq_slot_set_seq(t, i, pos + 1);
+				return 0;
+			}
+		}
+		else if (diff < 0) {
+			warn("Transport command queue overrun: %d", cmd->sig);
+			errno = EAGAIN;
+			return -1;
+		}
+		else
+			pos = atomic_load_explicit(&t->cmdq.head, memory_order_relaxed);
+	}
+
+}
+
+/**
+ * Pop the oldest command from the ring - IO thread only. */
+static bool transport_cmdq_pop(struct ba_transport *t, struct ba_transport_cmd *cmd) {
+
+	const unsigned int pos = t->cmdq.tail;
+	const unsigned int i = pos % TRANSPORT_CMDQ_SIZE;
+
+	if (transport_cmdq_slot_seq(t, i) != pos + 1)
+		return false;
+
+	*cmd = t->cmdq.slots[i].cmd;
+	transport_cmdq_slot_set_seq(t, i, pos + TRANSPORT_CMDQ_SIZE);
+	t->cmdq.tail = pos + 1;
+	return true;
+}
+
+/**
+ * Mark the coalesced command as pending. */
+static void transport_cmdq_set_pending(struct ba_transport *t,
+		const struct ba_transport_cmd *cmd) {
+
+	unsigned int clear = 0;
+
+	/* The payload is stored before the pending bit is set, so the IO thread
+	 * will see (at least) this payload once it has seen the bit. */
+	switch (cmd->sig) {
+	case TRANSPORT_PCM_OPEN:
+		/* notification will not override requested reconfiguration */
+		if (cmd->reconfig.format_valid)
+			atomic_store_explicit(&t->cmdq.reconfig, cmd->reconfig.format + 1,
+					memory_order_relaxed);
+		break;
+	case TRANSPORT_PCM_CLOSE:
+		clear = 1 << TRANSPORT_PCM_OPEN;
+		break;
+	case TRANSPORT_PCM_PAUSE:
+		clear = 1 << TRANSPORT_PCM_RESUME;
+		break;
+	case TRANSPORT_PCM_RESUME:
+		clear = 1 << TRANSPORT_PCM_PAUSE;
+		break;
+	case TRANSPORT_PCM_SYNC:
+		atomic_store_explicit(&t->cmdq.drain, cmd->drain.token, memory_order_relaxed);
+		break;
+	case TRANSPORT_SET_VOLUME:
+		atomic_store_explicit(&t->cmdq.volume,
+				cmd->volume.ch1_muted << 24 | cmd->volume.ch2_muted << 16 |
+				cmd->volume.ch1_volume << 8 | cmd->volume.ch2_volume,
+				memory_order_relaxed);
+		break;
+	default:
+		break;
+	}
+
+	unsigned int pending = atomic_load_explicit(&t->cmdq.pending, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&t->cmdq.pending, &pending,
+				(pending & ~clear) | 1 << cmd->sig, memory_order_release, memory_order_relaxed))
+		continue;
+
+}
+
+/**
+ * Take the next pending coalesced command - IO thread only. */
+static bool transport_cmdq_take_pending(struct ba_transport *t,
+		struct ba_transport_cmd *cmd) {
+
+	unsigned int value;
+	size_t i;
+
+	if (t->cmdq.pending_rx == 0)
+		t->cmdq.pending_rx = atomic_exchange_explicit(&t->cmdq.pending, 0,
+				memory_order_acquire);
+
+	for (i = 0; i < ARRAYSIZE(transport_cmdq_coalesced); i++) {
+
+		const enum ba_transport_signal sig = transport_cmdq_coalesced[i];
+		if (!(t->cmdq.pending_rx & 1 << sig))
+			continue;
+
+		t->cmdq.pending_rx &= ~(1 << sig);
+		*cmd = (struct ba_transport_cmd){ .sig = sig };
+
+		switch (sig) {
+		case TRANSPORT_PCM_OPEN:
+			if ((value = atomic_exchange_explicit(&t->cmdq.reconfig, 0,
+							memory_order_relaxed)) != 0) {
+				cmd->reconfig.format_valid = true;
+				cmd->reconfig.format = value - 1;
+			}
+			break;
+		case TRANSPORT_PCM_SYNC: {
+			struct ba_pcm *pcm;
+			cmd->drain.token = atomic_load_explicit(&t->cmdq.drain, memory_order_relaxed);
+			/* from now on the drain request is pending for the IO thread */
+			if ((pcm = transport_get_drain_pcm(t)) != NULL)
+				pcm->drain_token_rx = cmd->drain.token;
+		} break;
+		case TRANSPORT_SET_VOLUME:
+			value = atomic_load_explicit(&t->cmdq.volume, memory_order_relaxed);
+			cmd->volume.ch1_muted = value >> 24;
+			cmd->volume.ch2_muted = (value >> 16) & 0xFF;
+			cmd->volume.ch1_volume = (value >> 8) & 0xFF;
+			cmd->volume.ch2_volume = value & 0xFF;
+			break;
+		default:
+			break;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Queue control command for the transport IO thread.
+ *
+ * This function does not block and it might be called by many threads at
+ * the same time. State commands are coalesced with the pending command of
+ * the same type (the latest payload wins), so they can not be lost. Other
+ * commands are delivered in order, after the coalesced ones.
+ *
+ * @param t Transport structure.
+ * @param cmd Command which shall be copied into the transport queue.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. The EAGAIN error is reported if there
+ *   is no space for the ordered command. */
+int transport_send_command(struct ba_transport *t, const struct ba_transport_cmd *cmd) {
+
+	switch (cmd->sig) {
+	case TRANSPORT_SEND_RFCOMM:
+	case TRANSPORT_GROUP_LINK:
+	case TRANSPORT_GROUP_UNLINK:
+		if (transport_cmdq_push(t, cmd) == -1)
+			return -1;
+		break;
+	default:
+		transport_cmdq_set_pending(t, cmd);
+	}
+
+	/* Ring the doorbell. Multiple writes are coalesced by the eventfd, so the
+	 * IO thread is woken up once for all commands queued in the meantime. */
+	return eventfd_write(t->sig_fd, 1);
+}
+
+/**
+ * Queue control command and wait until the IO thread dispatches it.
+ *
+ * The IO thread acknowledges all commands at once, when its queue has been
+ * drained. If there is no IO thread (nor IO task), this function returns
+ * right after the command has been queued.
+ *
+ * @param t Transport structure.
+ * @param cmd Command which shall be copied into the transport queue.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. If the IO thread has not dispatched the
+ *   command within the TRANSPORT_CMDQ_ACK_TIMEOUT, errno is set to the
+ *   ETIMEDOUT. */
+int transport_send_command_sync(struct ba_transport *t, const struct ba_transport_cmd *cmd) {
+
+	const unsigned int seq = atomic_fetch_add(&t->cmdq.ack_seq, 1) + 1;
+	struct timespec ts;
+	int ret = 0;
+
+	if (transport_send_command(t, cmd) == -1)
+		return -1;
+
+	if (pthread_equal(t->thread, config.main_thread) &&
+			!io_engine_task_running(&t->task))
+		return 0;
+
+	/* The request is published after the command, so if the IO thread sees
+	 * the request, it will see the command as well. */
+	unsigned int req = atomic_load(&t->cmdq.ack_req);
+	while ((int)(req - seq) < 0 &&
+			!atomic_compare_exchange_weak(&t->cmdq.ack_req, &req, seq))
+		continue;
+	eventfd_write(t->sig_fd, 1);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += TRANSPORT_CMDQ_ACK_TIMEOUT / 1000;
+	ts.tv_nsec += TRANSPORT_CMDQ_ACK_TIMEOUT % 1000 * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&t->cmdq.ack_mutex);
+	while (ret == 0 && (int)(atomic_load(&t->cmdq.acked) - seq) < 0)
+		ret = pthread_cond_timedwait(&t->cmdq.ack_cond, &t->cmdq.ack_mutex, &ts);
+	pthread_mutex_unlock(&t->cmdq.ack_mutex);
+
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
 int transport_send_signal(struct ba_transport *t, enum ba_transport_signal sig) {
-	return write(t->sig_fd[1], &sig, sizeof(sig));
+	struct ba_transport_cmd cmd = { .sig = sig };
+	return transport_send_command(t, &cmd);
 }
 
 int transport_send_rfcomm(struct ba_transport *t, const char command[32]) {
+	struct ba_transport_cmd cmd = { .sig = TRANSPORT_SEND_RFCOMM };
+	memcpy(cmd.rfcomm, command, sizeof(cmd.rfcomm));
+	return transport_send_command(t, &cmd);
+}
+
+/**
+ * Take the next command from the transport queue. */
+static bool transport_cmdq_take(struct ba_transport *t, struct ba_transport_cmd *cmd) {
+	return transport_cmdq_take_pending(t, cmd) || transport_cmdq_pop(t, cmd);
+}
+
+/**
+ * Receive control command queued for the transport IO thread.
+ *
+ * This function shall be called by the IO thread only, when the sig_fd file
+ * descriptor is readable. It should be called in a loop until it returns
+ * false - all pending commands are dispatched within a single wake-up.
+ *
+ * @param t Transport structure.
+ * @param cmd Address where the received command will be stored.
+ * @return This function returns true if command was received, or false if
+ *   there are no more commands in the queue. */
+bool transport_recv_command(struct ba_transport *t, struct ba_transport_cmd *cmd) {
+
+	if (transport_cmdq_take(t, cmd))
+		return true;
+
+	/* The queue is empty, so clear the doorbell. However, the command might
+	 * have been queued before the doorbell has been cleared, so we have to
+	 * check the queue once more - otherwise such a command would be left
+	 * without the notification. */
+	eventfd_t value;
+	eventfd_read(t->sig_fd, &value);
+
+	/* The acknowledgment request is loaded before the last check, so all
+	 * commands queued prior to the request have been dispatched by now. */
+	const unsigned int req = atomic_load_explicit(&t->cmdq.ack_req, memory_order_acquire);
+
+	if (transport_cmdq_take(t, cmd))
+		return true;
+
+	if (atomic_load_explicit(&t->cmdq.acked, memory_order_relaxed) != req) {
+		pthread_mutex_lock(&t->cmdq.ack_mutex);
+		atomic_store_explicit(&t->cmdq.acked, req, memory_order_relaxed);
+		pthread_cond_broadcast(&t->cmdq.ack_cond);
+		pthread_mutex_unlock(&t->cmdq.ack_mutex);
+	}
+
+	return false;
+}
+
+/**
+ * Forward commands which have not been dispatched yet.
+ *
+ * This function shall be called by the IO thread which stops dispatching
+ * commands within a single wake-up, e.g. upon the IO loop handover. All
+ * remaining commands are passed to the next receiver, and the doorbell is
+ * rung, so they will be dispatched by the next IO loop of the transport.
+ *
+ * @param t Transport structure. */
+void transport_forward_commands(struct ba_transport *t) {
 
-	char msg[sizeof(enum ba_transport_signal) + 32];
+	const unsigned int pause = 1 << TRANSPORT_PCM_PAUSE | 1 << TRANSPORT_PCM_RESUME;
+	unsigned int forward = t->cmdq.pending_rx;
+	t->cmdq.pending_rx = 0;
 
-	((enum ba_transport_signal *)msg)[0] = TRANSPORT_SEND_RFCOMM;
-	memcpy(&msg[sizeof(enum ba_transport_signal)], command, 32);
+	/* Taken commands are merged with the ones queued in the meantime. The
+	 * latest pause or resume request wins, so the forwarded one is dropped
+	 * if any of these two is pending already. */
+	unsigned int pending = atomic_load_explicit(&t->cmdq.pending, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&t->cmdq.pending, &pending,
+				pending | (pending & pause ? forward & ~pause : forward),
+				memory_order_release, memory_order_relaxed))
+		continue;
+
+	/* ordered commands are kept in the ring */
+	eventfd_write(t->sig_fd, 1);
 
-	return write(t->sig_fd[1], msg, sizeof(msg));
 }
 
 unsigned int transport_get_channels(const struct ba_transport *t) {
@@ -566,6 +1211,16 @@ unsigned int transport_get_channels(const struct ba_transport *t) {
 			}
 			break;
 #endif
+#if ENABLE_APTX_HD
+		case A2DP_CODEC_VENDOR_APTX_HD:
+			switch (((a2dp_aptx_hd_t *)t->a2dp.cconfig)->channel_mode) {
+			case APTX_HD_CHANNEL_MODE_MONO:
+				return 1;
+			case APTX_HD_CHANNEL_MODE_STEREO:
+				return 2;
+			}
+			break;
+#endif
 #if ENABLE_LDAC
 		case A2DP_CODEC_VENDOR_LDAC:
 			switch (((a2dp_ldac_t *)t->a2dp.cconfig)->channel_mode) {
@@ -668,6 +1323,20 @@ unsigned int transport_get_sampling(const struct ba_transport *t) {
 			}
 			break;
 #endif
+#if ENABLE_APTX_HD
+		case A2DP_CODEC_VENDOR_APTX_HD:
+			switch (((a2dp_aptx_hd_t *)t->a2dp.cconfig)->frequency) {
+			case APTX_HD_SAMPLING_FREQ_16000:
+				return 16000;
+			case APTX_HD_SAMPLING_FREQ_32000:
+				return 32000;
+			case APTX_HD_SAMPLING_FREQ_44100:
+				return 44100;
+			case APTX_HD_SAMPLING_FREQ_48000:
+				return 48000;
+			}
+			break;
+#endif
 #if ENABLE_LDAC
 		case A2DP_CODEC_VENDOR_LDAC:
 			switch (((a2dp_ldac_t *)t->a2dp.cconfig)->frequency) {
@@ -705,9 +1374,161 @@ unsigned int transport_get_sampling(const struct ba_transport *t) {
 	return 0;
 }
 
-int transport_set_volume(struct ba_transport *t, uint8_t ch1_muted, uint8_t ch2_muted,
-		uint8_t ch1_volume, uint8_t ch2_volume) {
-
+/**
+ * Get PCM sample formats supported by the transport.
+ *
+ * The S16_LE format is supported by all transports which have an encoder.
+ * Other formats are supported only if the signal can be passed to the
+ * encoder as it is, or - in case of the encoded data - if the codec frames
+ * can be packetized without the encoder (or depacketized without the decoder
+ * in case of the A2DP sink).
+ *
+ * @param t Transport structure.
+ * @return This function returns the bit-mask of the 1 << BA_PCM_FORMAT_*
+ *   values. */
+unsigned int transport_get_pcm_formats(const struct ba_transport *t) {
+
+	unsigned int formats = 1 << BA_PCM_FORMAT_S16_LE;
+
+	if (t->type != TRANSPORT_TYPE_A2DP)
+		return formats;
+
+	/* sink can forward the RTP payload of codecs with a known framing */
+	if (t->profile == BLUETOOTH_PROFILE_A2DP_SINK) {
+		switch (t->codec) {
+		case A2DP_CODEC_SBC:
+#if ENABLE_AAC
+		case A2DP_CODEC_MPEG24:
+#endif
+			formats |= 1 << BA_PCM_FORMAT_ENCODED;
+			break;
+		default:
+			break;
+		}
+		return formats;
+	}
+
+	switch (t->codec) {
+	case A2DP_CODEC_SBC:
+		formats |= 1 << BA_PCM_FORMAT_ENCODED;
+		break;
+#if ENABLE_MPEG
+	case A2DP_CODEC_MPEG12:
+		/* there is no MPEG-1,2 audio encoder */
+		formats = 1 << BA_PCM_FORMAT_ENCODED;
+		break;
+#endif
+#if ENABLE_AAC
+	case A2DP_CODEC_MPEG24:
+		formats |= 1 << BA_PCM_FORMAT_ENCODED;
+		break;
+#endif
+#if ENABLE_LDAC
+	case A2DP_CODEC_VENDOR_LDAC:
+		formats |= 1 << BA_PCM_FORMAT_S24_3LE;
+		formats |= 1 << BA_PCM_FORMAT_S32_LE;
+		formats |= 1 << BA_PCM_FORMAT_FLOAT_LE;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return formats;
+}
+
+/**
+ * Get the size of a single sample in the given PCM format. */
+size_t transport_pcm_format_size(enum ba_pcm_format format) {
+	switch (format) {
+	case BA_PCM_FORMAT_S16_LE:
+		return sizeof(int16_t);
+	case BA_PCM_FORMAT_S24_3LE:
+		return 3;
+	case BA_PCM_FORMAT_S32_LE:
+		return sizeof(int32_t);
+	case BA_PCM_FORMAT_FLOAT_LE:
+		return sizeof(float);
+	case BA_PCM_FORMAT_ENCODED:
+		return sizeof(uint8_t);
+	}
+	return sizeof(int16_t);
+}
+
+/**
+ * Get the overall transport delay.
+ *
+ * @param t Transport structure.
+ * @return This function returns the delay in 1/10 of millisecond. */
+unsigned int transport_get_delay(const struct ba_transport *t) {
+
+	unsigned int delay = t->delay;
+
+	switch (t->type) {
+	case TRANSPORT_TYPE_A2DP:
+		delay += t->a2dp.delay;
+		delay += resampler_get_delay(&t->a2dp.pcm.rs);
+		break;
+	case TRANSPORT_TYPE_RFCOMM:
+		break;
+	case TRANSPORT_TYPE_SCO:
+		delay += 10;
+		break;
+	}
+
+	return delay;
+}
+
+static void transport_update_volume(struct ba_transport *t);
+
+/**
+ * Completion callback for the native volume update.
+ *
+ * The transport might have been removed in the meantime, so it is looked up
+ * by the D-Bus object path passed as the user data. */
+static void transport_update_volume_finish(GObject *source, GAsyncResult *result,
+		gpointer userdata) {
+
+	char *dbus_path = userdata;
+	struct ba_transport *t;
+
+	g_dbus_set_property_finish(G_DBUS_CONNECTION(source), result);
+
+	pthread_mutex_lock(&config.devices_mutex);
+	if ((t = transport_lookup(config.devices, dbus_path)) != NULL &&
+			t->type == TRANSPORT_TYPE_A2DP) {
+		t->a2dp.volume_update_pending = false;
+		/* send volume requested while the call was in progress */
+		transport_update_volume(t);
+	}
+	pthread_mutex_unlock(&config.devices_mutex);
+
+	g_free(dbus_path);
+}
+
+/**
+ * Send the latest requested volume to the Bluetooth device.
+ *
+ * This function shall be called with the devices mutex locked. */
+static void transport_update_volume(struct ba_transport *t) {
+
+	if (t->a2dp.volume_update_pending ||
+			t->a2dp.volume_update_next == -1)
+		return;
+
+	const uint16_t volume = t->a2dp.volume_update_next;
+	t->a2dp.volume_update_next = -1;
+	t->a2dp.volume_update_pending = true;
+
+	g_dbus_set_property_async(config.dbus, t->dbus_owner, t->dbus_path,
+			"org.bluez.MediaTransport1", "Volume", g_variant_new_uint16(volume),
+			transport_update_volume_finish, g_strdup(t->dbus_path));
+
+}
+
+int transport_set_volume(struct ba_transport *t, uint8_t ch1_muted, uint8_t ch2_muted,
+		uint8_t ch1_volume, uint8_t ch2_volume) {
+
 	debug("Setting volume for %s profile %d: %d<>%d [%c%c]", batostr_(&t->device->addr),
 			t->profile, ch1_volume, ch2_volume, ch1_muted ? 'M' : 'O', ch2_muted ? 'M' : 'O');
 
@@ -720,9 +1541,10 @@ int transport_set_volume(struct ba_transport *t, uint8_t ch1_muted, uint8_t ch2_
 		t->a2dp.ch2_volume = ch2_volume;
 
 		if (config.a2dp.volume) {
-			uint16_t volume = (ch1_muted | ch2_muted) ? 0 : MIN(ch1_volume, ch2_volume);
-			g_dbus_set_property(config.dbus, t->dbus_owner, t->dbus_path,
-					"org.bluez.MediaTransport1", "Volume", g_variant_new_uint16(volume));
+			/* Updates are coalesced, so a storm of volume changes (e.g. mixer
+			 * slider drag) will not flood the D-Bus with synchronous calls. */
+			t->a2dp.volume_update_next = (ch1_muted | ch2_muted) ? 0 : MIN(ch1_volume, ch2_volume);
+			transport_update_volume(t);
 		}
 
 		break;
@@ -739,7 +1561,11 @@ int transport_set_volume(struct ba_transport *t, uint8_t ch1_muted, uint8_t ch2_
 
 		if (!t->sco.is_ofono) {
 			/* notify associated RFCOMM transport */
-			transport_send_signal(t->sco.rfcomm, TRANSPORT_SET_VOLUME);
+			struct ba_transport_cmd cmd = {
+				.sig = TRANSPORT_SET_VOLUME,
+				.volume = { ch1_muted, ch2_muted, ch1_volume, ch2_volume },
+			};
+			transport_send_command(t->sco.rfcomm, &cmd);
 		}
 
 		break;
@@ -767,7 +1593,7 @@ int transport_set_state(struct ba_transport *t, enum ba_transport_state state) {
 
 	switch (state) {
 	case TRANSPORT_IDLE:
-		transport_pthread_cancel(t->thread);
+		io_thread_cancel(t);
 		break;
 	case TRANSPORT_PENDING:
 		/* When transport is marked as pending, try to acquire transport, but only
@@ -778,7 +1604,8 @@ int transport_set_state(struct ba_transport *t, enum ba_transport_state state) {
 		break;
 	case TRANSPORT_ACTIVE:
 	case TRANSPORT_PAUSED:
-		if (pthread_equal(t->thread, config.main_thread))
+		if (pthread_equal(t->thread, config.main_thread) &&
+				!io_engine_task_running(&t->task))
 			ret = io_thread_create(t);
 		break;
 	case TRANSPORT_LIMBO:
@@ -789,6 +1616,7 @@ int transport_set_state(struct ba_transport *t, enum ba_transport_state state) {
 	if (ret == -1)
 		return transport_set_state(t, TRANSPORT_IDLE);
 
+	bluealsa_ctl_event_transport(BA_EVENT_UPDATE_STATE, t);
 	return ret;
 }
 
@@ -808,79 +1636,268 @@ int transport_set_state_from_string(struct ba_transport *t, const char *state) {
 	return 0;
 }
 
-int transport_drain_pcm(struct ba_transport *t) {
+/**
+ * Check whether the transport can be linked with the group leader. */
+static bool transport_group_is_member(const struct ba_transport *leader,
+		const struct ba_transport *t) {
+	return t != leader &&
+		t->type == TRANSPORT_TYPE_A2DP &&
+		t->profile == BLUETOOTH_PROFILE_A2DP_SOURCE &&
+		t->a2dp.group == leader->a2dp.group &&
+		/* member with its own PCM client is not controlled by the group */
+		t->a2dp.pcm.fd == -1;
+}
 
-	struct ba_pcm *pcm = NULL;
+/**
+ * Link group member with the group leader.
+ *
+ * The BT transport of the member is acquired, and its duplicated socket is
+ * passed to the leader IO thread. Fan-out is supported by the SBC encoder
+ * only, and the sampling of both transports has to be the same. */
+static int transport_group_link_member(struct ba_transport *leader,
+		struct ba_transport *t) {
+
+	struct ba_transport_cmd cmd = { .sig = TRANSPORT_GROUP_LINK };
+
+	if (leader->codec != A2DP_CODEC_SBC || t->codec != A2DP_CODEC_SBC ||
+			t->a2dp.cconfig_size > sizeof(cmd.link.cconfig) ||
+			transport_get_sampling(t) != transport_get_sampling(leader) ||
+			transport_get_channels(t) != transport_get_channels(leader)) {
+		warn("Couldn't link transport with the group: %s", t->device->name);
+		errno = ENOTSUP;
+		return -1;
+	}
 
-	switch (t->profile) {
-	case BLUETOOTH_PROFILE_NULL:
-	case BLUETOOTH_PROFILE_A2DP_SINK:
-		break;
-	case BLUETOOTH_PROFILE_A2DP_SOURCE:
-		pcm = &t->a2dp.pcm;
-		break;
-	case BLUETOOTH_PROFILE_HSP_AG:
-	case BLUETOOTH_PROFILE_HFP_AG:
-		pcm = &t->sco.spk_pcm;
-		break;
-	case BLUETOOTH_PROFILE_HSP_HS:
-	case BLUETOOTH_PROFILE_HFP_HF:
-		break;
+	pthread_mutex_lock(&t->mutex);
+
+	if (transport_acquire_bt_a2dp(t) == -1 ||
+			(cmd.link.bt_fd = fcntl(t->bt_fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+		pthread_mutex_unlock(&t->mutex);
+		return -1;
 	}
 
-	if (pcm == NULL || t->state != TRANSPORT_ACTIVE)
+	bacpy(&cmd.link.addr, &t->device->addr);
+	cmd.link.mtu_write = t->mtu_write;
+	cmd.link.bt_fd_coutq_init = t->a2dp.bt_fd_coutq_init;
+	memcpy(cmd.link.cconfig, t->a2dp.cconfig, t->a2dp.cconfig_size);
+	cmd.link.cconfig_size = t->a2dp.cconfig_size;
+
+	pthread_mutex_unlock(&t->mutex);
+
+	if (transport_send_command(leader, &cmd) == -1) {
+		close(cmd.link.bt_fd);
+		return -1;
+	}
+
+	debug("Linked transport with group %u: %s", t->a2dp.group, t->device->name);
+
+	/* The IO thread of the member will not transfer anything by itself, but
+	 * it has to keep the BT transport acquired as long as the group does. */
+	transport_send_signal(t, TRANSPORT_PCM_OPEN);
+
+	return 0;
+}
+
+/**
+ * Link transport with its group.
+ *
+ * This function is not thread-safe - the devices mutex shall be held.
+ *
+ * @param devices Address of the hash-table with connected devices.
+ * @param t Transport structure. If this transport is the group leader (its
+ *   PCM is opened), all other group members are linked with it. Otherwise,
+ *   the transport is linked with the current group leader, if any.
+ * @return This function returns the number of linked transports. */
+int transport_group_link(GHashTable *devices, struct ba_transport *t) {
+
+	GHashTableIter iter_d, iter_t;
+	struct ba_transport *leader;
+	struct ba_device *d;
+	struct ba_transport *m;
+	int count = 0;
+
+	if ((leader = transport_group_lookup_leader(devices, t->a2dp.group)) == NULL)
 		return 0;
 
-	pthread_mutex_lock(&pcm->drained_mn);
+	if (leader != t)
+		return transport_group_is_member(leader, t) &&
+			transport_group_link_member(leader, t) == 0 ? 1 : 0;
 
-	transport_send_signal(t, TRANSPORT_PCM_SYNC);
-	pthread_cond_wait(&pcm->drained, &pcm->drained_mn);
+	g_hash_table_iter_init(&iter_d, devices);
+	while (g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d)) {
+		g_hash_table_iter_init(&iter_t, d->transports);
+		while (g_hash_table_iter_next(&iter_t, NULL, (gpointer)&m))
+			if (transport_group_is_member(leader, m) &&
+					transport_group_link_member(leader, m) == 0)
+				count++;
+	}
 
-	pthread_mutex_unlock(&pcm->drained_mn);
+	return count;
+}
+
+/**
+ * Unlink transport from its group.
+ *
+ * This function is not thread-safe - the devices mutex shall be held.
+ *
+ * @param devices Address of the hash-table with connected devices.
+ * @param t Transport structure, which shall not be the group leader.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int transport_group_unlink(GHashTable *devices, struct ba_transport *t) {
+
+	struct ba_transport_cmd cmd = { .sig = TRANSPORT_GROUP_UNLINK };
+	struct ba_transport *leader;
+
+	if ((leader = transport_group_lookup_leader(devices, t->a2dp.group)) == NULL ||
+			leader == t)
+		return 0;
+
+	bacpy(&cmd.link.addr, &t->device->addr);
+	if (transport_send_command(leader, &cmd) == -1)
+		return -1;
+
+	/* let the member release its BT transport after the keep-alive time */
+	if (t->bt_fd != -1)
+		transport_send_signal(t, TRANSPORT_PCM_CLOSE);
 
-	/* TODO: Asynchronous transport release.
-	 *
-	 * Unfortunately, BlueZ does not provide API for internal buffer drain.
-	 * Also, there is no specification for Bluetooth playback drain. In order
-	 * to make sure, that all samples are played out, we have to wait some
-	 * arbitrary time before releasing transport. In order to make it right,
-	 * there is a requirement for an asynchronous release mechanism, which
-	 * is not implemented - it requires a little bit of refactoring. */
-	usleep(200000);
-
-	debug("PCM drained");
 	return 0;
 }
 
-int transport_acquire_bt_a2dp(struct ba_transport *t) {
+/**
+ * Send signal to all members of the transport group.
+ *
+ * This function is not thread-safe - the devices mutex shall be held.
+ *
+ * @param devices Address of the hash-table with connected devices.
+ * @param t The group leader transport structure.
+ * @param sig Signal which shall be sent to all group members, which have
+ *   their BT transport acquired. */
+void transport_group_signal(GHashTable *devices, struct ba_transport *t,
+		enum ba_transport_signal sig) {
 
-	GDBusMessage *msg, *rep;
-	GUnixFDList *fd_list;
-	GError *err = NULL;
+	GHashTableIter iter_d, iter_t;
+	struct ba_device *d;
+	struct ba_transport *m;
 
-	/* Check whether transport is already acquired - keep-alive mode. */
-	if (t->bt_fd != -1) {
-		debug("Reusing transport: %d", t->bt_fd);
-		goto final;
+	if (t->type != TRANSPORT_TYPE_A2DP || t->a2dp.group == 0)
+		return;
+
+	g_hash_table_iter_init(&iter_d, devices);
+	while (g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d)) {
+		g_hash_table_iter_init(&iter_t, d->transports);
+		while (g_hash_table_iter_next(&iter_t, NULL, (gpointer)&m))
+			if (transport_group_is_member(t, m) && m->bt_fd != -1)
+				transport_send_signal(m, sig);
 	}
 
-	msg = g_dbus_message_new_method_call(t->dbus_owner, t->dbus_path, "org.bluez.MediaTransport1",
-			t->state == TRANSPORT_PENDING ? "TryAcquire" : "Acquire");
+}
 
-	if ((rep = g_dbus_connection_send_message_with_reply_sync(config.dbus, msg,
-					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
-		goto fail;
+/**
+ * Look up the leader of the transport group.
+ *
+ * This function is not thread-safe - the devices mutex shall be held.
+ *
+ * @param devices Address of the hash-table with connected devices.
+ * @param group Transport group identifier.
+ * @return The A2DP source transport of the given group with the opened PCM,
+ *   or NULL if there is no such transport. */
+struct ba_transport *transport_group_lookup_leader(GHashTable *devices, uint8_t group) {
+
+	GHashTableIter iter_d, iter_t;
+	struct ba_device *d;
+	struct ba_transport *t;
+
+	if (group == 0)
+		return NULL;
+
+	g_hash_table_iter_init(&iter_d, devices);
+	while (g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d)) {
+		g_hash_table_iter_init(&iter_t, d->transports);
+		while (g_hash_table_iter_next(&iter_t, NULL, (gpointer)&t))
+			if (t->type == TRANSPORT_TYPE_A2DP &&
+					t->profile == BLUETOOTH_PROFILE_A2DP_SOURCE &&
+					t->a2dp.group == group &&
+					t->a2dp.pcm.fd != -1)
+				return t;
+	}
+
+	return NULL;
+}
+
+/**
+ * Request PCM drain.
+ *
+ * This function does not wait for the drain completion. The IO thread will
+ * report the completion with the transport_pcm_drained(), and then the
+ * controller thread will send the status to the PCM client.
+ *
+ * @param t Transport structure.
+ * @return If the drain has been requested, this function returns 1. If
+ *   there is nothing to drain, 0 is returned. */
+int transport_drain_pcm(struct ba_transport *t) {
+
+	struct ba_pcm *pcm = transport_get_drain_pcm(t);
+	struct ba_transport_cmd cmd = { .sig = TRANSPORT_PCM_SYNC };
+
+	if (pcm == NULL || t->state != TRANSPORT_ACTIVE)
+		return 0;
+
+	cmd.drain.token = atomic_fetch_add(&pcm->drain_token, 1) + 1;
+	atomic_store(&pcm->drain, BA_PCM_DRAIN_PENDING);
+	if (transport_send_command(t, &cmd) == -1) {
+		atomic_store(&pcm->drain, BA_PCM_DRAIN_NONE);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Check whether the PCM drain has been requested.
+ *
+ * This function shall be called by the IO thread. The drain is pending
+ * only if the IO thread has received the drain command of the current
+ * request. */
+bool transport_pcm_drain_pending(struct ba_pcm *pcm) {
+	return atomic_load(&pcm->drain) == BA_PCM_DRAIN_PENDING &&
+		pcm->drain_token_rx == atomic_load(&pcm->drain_token);
+}
+
+/**
+ * Report PCM drain completion - this function shall be called by the IO
+ * thread when all samples have been transfered. */
+void transport_pcm_drained(struct ba_pcm *pcm) {
+	int state = BA_PCM_DRAIN_PENDING;
+	if (atomic_compare_exchange_strong(&pcm->drain, &state, BA_PCM_DRAIN_DONE)) {
+		debug("PCM drained");
+		bluealsa_ctl_pcm_drained();
+	}
+}
+
+/**
+ * Setup acquired BT transport with the data from the BlueZ reply.
+ *
+ * @param t Transport structure.
+ * @param rep Reply for the MediaTransport1 acquire call.
+ * @param err Address where the error will be stored.
+ * @return On success this function returns BT socket. Otherwise, -1 is
+ *   returned and the error is set. */
+static int transport_acquire_bt_a2dp_finish(struct ba_transport *t,
+		GDBusMessage *rep, GError **err) {
+
+	GUnixFDList *fd_list;
 
 	if (g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR) {
-		g_dbus_message_to_gerror(rep, &err);
-		goto fail;
+		g_dbus_message_to_gerror(rep, err);
+		return -1;
 	}
 
 	g_variant_get(g_dbus_message_get_body(rep), "(hqq)", (int32_t *)&t->bt_fd,
 			(uint16_t *)&t->mtu_read, (uint16_t *)&t->mtu_write);
 
 	fd_list = g_dbus_message_get_unix_fd_list(rep);
-	t->bt_fd = g_unix_fd_list_get(fd_list, 0, &err);
+	t->bt_fd = g_unix_fd_list_get(fd_list, 0, err);
 	t->release = transport_release_bt_a2dp;
 
 	/* Minimize audio delay and increase responsiveness (seeking, stopping) by
@@ -895,6 +1912,33 @@ int transport_acquire_bt_a2dp(struct ba_transport *t) {
 
 	debug("New transport: %d (MTU: R:%zu W:%zu)", t->bt_fd, t->mtu_read, t->mtu_write);
 
+	return t->bt_fd;
+}
+
+static GDBusMessage *transport_acquire_bt_a2dp_msg(const struct ba_transport *t) {
+	return g_dbus_message_new_method_call(t->dbus_owner, t->dbus_path, "org.bluez.MediaTransport1",
+			t->state == TRANSPORT_PENDING ? "TryAcquire" : "Acquire");
+}
+
+int transport_acquire_bt_a2dp(struct ba_transport *t) {
+
+	GDBusMessage *msg, *rep;
+	GError *err = NULL;
+
+	/* Check whether transport is already acquired - keep-alive mode. */
+	if (t->bt_fd != -1) {
+		debug("Reusing transport: %d", t->bt_fd);
+		goto final;
+	}
+
+	msg = transport_acquire_bt_a2dp_msg(t);
+
+	if ((rep = g_dbus_connection_send_message_with_reply_sync(config.dbus, msg,
+					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
+		goto fail;
+
+	transport_acquire_bt_a2dp_finish(t, rep, &err);
+
 fail:
 	g_object_unref(msg);
 	if (rep != NULL)
@@ -908,6 +1952,184 @@ final:
 	return t->bt_fd;
 }
 
+struct transport_acquire_waiter {
+	transport_acquire_cb callback;
+	void *userdata;
+};
+
+/**
+ * Pending asynchronous BT transport acquisition. */
+struct transport_acquire_call {
+	/* transport - NULL if it has been freed in the meantime */
+	struct ba_transport *t;
+	/* list of callbacks waiting for the completion */
+	GSList *waiters;
+};
+
+/**
+ * Notify all waiters about acquisition completion. */
+static void transport_acquire_call_notify(struct transport_acquire_call *call,
+		struct ba_transport *t, int ret) {
+
+	const int err = errno;
+	GSList *el;
+
+	for (el = call->waiters; el != NULL; el = el->next) {
+		struct transport_acquire_waiter *w = el->data;
+		errno = err;
+		w->callback(t, ret, w->userdata);
+	}
+
+	g_slist_free_full(call->waiters, free);
+	call->waiters = NULL;
+}
+
+static void transport_acquire_bt_a2dp_ready(GObject *source, GAsyncResult *result,
+		gpointer userdata) {
+
+	struct transport_acquire_call *call = userdata;
+	struct ba_transport *t;
+	GDBusMessage *rep;
+	GError *err = NULL;
+	int ret = -1;
+
+	rep = g_dbus_connection_send_message_with_reply_finish(G_DBUS_CONNECTION(source), result, &err);
+
+	pthread_mutex_lock(&config.devices_mutex);
+
+	/* The transport detaches itself from the call upon free, which is always
+	 * done with the devices mutex locked, so if it is still attached, it is
+	 * valid. Otherwise the BT socket (if any) is closed with the reply. */
+	if ((t = call->t) == NULL) {
+		debug("Transport freed during acquisition");
+		goto final;
+	}
+
+	pthread_mutex_lock(&t->mutex);
+
+	t->a2dp.acquire = NULL;
+
+	if (rep != NULL)
+		ret = transport_acquire_bt_a2dp_finish(t, rep, &err);
+	if (err != NULL) {
+		error("Couldn't acquire transport: %s", err->message);
+		errno = EIO;
+	}
+
+	transport_acquire_call_notify(call, t, ret);
+	pthread_mutex_unlock(&t->mutex);
+
+final:
+	pthread_mutex_unlock(&config.devices_mutex);
+	if (rep != NULL)
+		g_object_unref(rep);
+	if (err != NULL)
+		g_error_free(err);
+	free(call);
+}
+
+/**
+ * Acquire BT transport without blocking the caller.
+ *
+ * The D-Bus call is dispatched by the main loop, so neither the devices
+ * mutex nor the transport mutex is held during the round-trip to BlueZ.
+ * If the transport is already acquired, the callback is called right away.
+ * If the acquisition is already in progress, the callback is queued, so
+ * there is never more than one acquire call pending for the transport.
+ *
+ * This function shall be called with the devices mutex and the transport
+ * mutex locked.
+ *
+ * @param t Transport structure.
+ * @param callback Function called upon completion.
+ * @param userdata Data passed to the callback function.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately - the callback will not be called. */
+int transport_acquire_bt_a2dp_async(struct ba_transport *t,
+		transport_acquire_cb callback, void *userdata) {
+
+	struct transport_acquire_call *call = t->a2dp.acquire;
+	struct transport_acquire_waiter *w;
+	GDBusMessage *msg;
+
+	if (t->bt_fd != -1) {
+		debug("Reusing transport: %d", t->bt_fd);
+		callback(t, t->bt_fd, userdata);
+		return 0;
+	}
+
+	if ((w = malloc(sizeof(*w))) == NULL)
+		return -1;
+
+	w->callback = callback;
+	w->userdata = userdata;
+
+	if (call != NULL) {
+		debug("Transport acquisition in progress: %s", t->dbus_path);
+		call->waiters = g_slist_append(call->waiters, w);
+		return 0;
+	}
+
+	if ((call = malloc(sizeof(*call))) == NULL) {
+		free(w);
+		return -1;
+	}
+
+	call->t = t;
+	call->waiters = g_slist_append(NULL, w);
+	t->a2dp.acquire = call;
+
+	msg = transport_acquire_bt_a2dp_msg(t);
+	g_dbus_connection_send_message_with_reply(config.dbus, msg,
+			G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL,
+			transport_acquire_bt_a2dp_ready, call);
+	g_object_unref(msg);
+
+	return 0;
+}
+
+/**
+ * Cancel waiting for the asynchronous BT transport acquisition.
+ *
+ * The callback registered with the given user data is called right away
+ * with the NULL transport. The D-Bus call itself is not canceled, so the
+ * transport will be acquired anyway, if other waiters are still pending
+ * or not. This function shall be called with the devices mutex locked.
+ *
+ * @param t Transport structure.
+ * @param userdata Data of the waiter to cancel. If NULL, all waiters are
+ *   canceled and the transport is detached from the pending call, which
+ *   shall be done when the transport is about to be freed. */
+void transport_acquire_bt_a2dp_cancel(struct ba_transport *t, void *userdata) {
+
+	struct transport_acquire_call *call;
+	GSList *el;
+
+	if ((call = t->a2dp.acquire) == NULL)
+		return;
+
+	debug("Canceling transport acquisition: %s", t->dbus_path);
+
+	errno = ECANCELED;
+	if (userdata == NULL) {
+		transport_acquire_call_notify(call, NULL, -1);
+		t->a2dp.acquire = NULL;
+		call->t = NULL;
+		return;
+	}
+
+	for (el = call->waiters; el != NULL; el = el->next) {
+		struct transport_acquire_waiter *w = el->data;
+		if (w->userdata == userdata) {
+			call->waiters = g_slist_delete_link(call->waiters, el);
+			w->callback(NULL, -1, w->userdata);
+			free(w);
+			break;
+		}
+	}
+
+}
+
 int transport_release_bt_a2dp(struct ba_transport *t) {
 
 	GDBusMessage *msg = NULL, *rep = NULL;
@@ -989,6 +2211,18 @@ int transport_release_bt_rfcomm(struct ba_transport *t) {
 	return 0;
 }
 
+/**
+ * Acquire SCO link for the given transport.
+ *
+ * The connection is established asynchronously, so the IO thread is not
+ * blocked for the duration of the baseband paging. When the connection
+ * socket (t->sco.connect_fd) becomes writable, the IO thread shall call
+ * the transport_acquire_bt_sco_complete() function.
+ *
+ * @param t Transport structure.
+ * @return If the SCO link is available, this function returns the file
+ *   descriptor of the SCO socket. Otherwise, -1 is returned and errno is
+ *   set to indicate the error - EINPROGRESS if the connection is pending. */
 int transport_acquire_bt_sco(struct ba_transport *t) {
 
 	struct hci_dev_info di;
@@ -999,20 +2233,57 @@ int transport_acquire_bt_sco(struct ba_transport *t) {
 	if (t->sco.acquire)
 		return t->sco.acquire(t);
 
+	if (t->sco.connect_fd != -1) {
+		errno = EINPROGRESS;
+		return -1;
+	}
+
 	if (hci_devinfo(t->device->hci_dev_id, &di) == -1) {
 		error("Couldn't get HCI device info: %s", strerror(errno));
 		return -1;
 	}
 
-	if ((t->bt_fd = hci_open_sco(&di, &t->device->addr, t->codec != HFP_CODEC_CVSD)) == -1) {
+	if ((t->sco.connect_fd = hci_open_sco(&di, &t->device->addr,
+					t->codec != HFP_CODEC_CVSD, true)) == -1) {
 		error("Couldn't open SCO link: %s", strerror(errno));
 		return -1;
 	}
 
-	t->mtu_read = di.sco_mtu;
-	t->mtu_write = di.sco_mtu;
+	/* release pending connection upon transport removal */
 	t->release = transport_release_bt_sco;
 
+	debug("Connecting SCO: %d", t->sco.connect_fd);
+
+	errno = EINPROGRESS;
+	return -1;
+}
+
+/**
+ * Complete pending SCO connection.
+ *
+ * @param t Transport structure.
+ * @return On success this function returns the file descriptor of the
+ *   SCO socket. Otherwise, -1 is returned and errno is set to indicate
+ *   the error. */
+int transport_acquire_bt_sco_complete(struct ba_transport *t) {
+
+	const int fd = t->sco.connect_fd;
+
+	if (fd == -1) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	t->sco.connect_fd = -1;
+
+	if (hci_open_sco_complete(fd) == -1) {
+		error("Couldn't open SCO link: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	t->bt_fd = fd;
+
 	/* XXX: It seems, that the MTU values returned by the HCI interface
 	 *      are incorrect (or our interpretation of them is incorrect). */
 	t->mtu_read = 48;
@@ -1028,6 +2299,12 @@ int transport_release_bt_sco(struct ba_transport *t) {
 	if (t->sco.release)
 		return t->sco.release(t);
 
+	if (t->sco.connect_fd != -1) {
+		debug("Aborting SCO connection: %d", t->sco.connect_fd);
+		close(t->sco.connect_fd);
+		t->sco.connect_fd = -1;
+	}
+
 	if (t->bt_fd == -1)
 		return 0;
 
@@ -1055,7 +2332,14 @@ int transport_release_pcm(struct ba_pcm *pcm) {
 
 	if (pcm->fd != -1) {
 		debug("Closing PCM: %d", pcm->fd);
-		close(pcm->fd);
+		/* In the SHM mode, the file descriptor is owned by the ring. We can not
+		 * unmap the ring here, because IO thread might be using it right now,
+		 * so we will only wake up both sides and let them know that the PCM
+		 * has been released. */
+		if (pcm->shm.ctrl != NULL)
+			pcm_ring_close(&pcm->shm);
+		else
+			close(pcm->fd);
 		pcm->fd = -1;
 	}
 
@@ -1092,6 +2376,19 @@ void transport_pthread_cleanup(struct ba_transport *t) {
 	if (t->release != NULL)
 		t->release(t);
 
+	/* There will be no more data transfered, so the pending drain request
+	 * (if any) is completed. */
+	switch (t->type) {
+	case TRANSPORT_TYPE_A2DP:
+		transport_pcm_drained(&t->a2dp.pcm);
+		break;
+	case TRANSPORT_TYPE_RFCOMM:
+		break;
+	case TRANSPORT_TYPE_SCO:
+		transport_pcm_drained(&t->sco.spk_pcm);
+		break;
+	}
+
 	/* Make sure, that after termination, this thread handler will not
 	 * be used anymore. */
 	t->thread = config.main_thread;
@@ -12,6 +12,7 @@
 #define BLUEALSA_TRANSPORT_H_
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -21,7 +22,15 @@
 #include <glib.h>
 
 #include "bluez.h"
+#include "codec-cache.h"
 #include "hfp.h"
+#include "io-engine.h"
+#include "resample.h"
+#include "shared/ctl-proto.h"
+#include "shared/drift.h"
+#include "shared/ffb.h"
+#include "shared/pcm-ring.h"
+#include "shared/pcm-status.h"
 
 #if HAVE_CONFIG_H
 # include "config.h"
@@ -49,7 +58,63 @@ enum ba_transport_signal {
 	TRANSPORT_PCM_RESUME,
 	TRANSPORT_PCM_SYNC,
 	TRANSPORT_SET_VOLUME,
-	TRANSPORT_SEND_RFCOMM
+	TRANSPORT_SEND_RFCOMM,
+	TRANSPORT_GROUP_LINK,
+	TRANSPORT_GROUP_UNLINK,
+};
+
+/* The maximal number of ordered (not coalesced) commands queued in the
+ * transport - RFCOMM data and group link updates. It shall be a power of 2. */
+#define TRANSPORT_CMDQ_SIZE 16
+/* The time (in milliseconds) for which the sender waits for the IO thread
+ * to acknowledge dispatched commands. */
+#define TRANSPORT_CMDQ_ACK_TIMEOUT 500
+/* The maximal size of the codec configuration carried by the link command. */
+#define TRANSPORT_GROUP_CCONFIG_SIZE 8
+
+/**
+ * Transport control command.
+ *
+ * Unlike the bare signal, the command can carry a payload, which is a
+ * snapshot taken by the sender - the IO thread does not have to look up
+ * shared transport fields which might have been modified in the meantime. */
+struct ba_transport_cmd {
+	enum ba_transport_signal sig;
+	union {
+		/* TRANSPORT_PCM_OPEN */
+		struct {
+			/* The sample format of the opened PCM, which the encoder shall
+			 * be reconfigured to. If the format is not valid, the command is
+			 * just a notification, e.g. for the SCO link acquisition. */
+			bool format_valid;
+			enum ba_pcm_format format;
+		} reconfig;
+		/* TRANSPORT_PCM_SYNC */
+		struct {
+			/* identifier of the drain request */
+			unsigned int token;
+		} drain;
+		/* TRANSPORT_SET_VOLUME */
+		struct {
+			uint8_t ch1_muted;
+			uint8_t ch2_muted;
+			uint8_t ch1_volume;
+			uint8_t ch2_volume;
+		} volume;
+		/* TRANSPORT_SEND_RFCOMM */
+		char rfcomm[32];
+		/* TRANSPORT_GROUP_LINK, TRANSPORT_GROUP_UNLINK */
+		struct {
+			bdaddr_t addr;
+			/* Duplicated BT socket of the linked transport (link only). The
+			 * ownership is passed to the receiver of this command. */
+			int bt_fd;
+			uint16_t mtu_write;
+			int bt_fd_coutq_init;
+			uint8_t cconfig[TRANSPORT_GROUP_CCONFIG_SIZE];
+			uint8_t cconfig_size;
+		} link;
+	};
 };
 
 struct ba_device {
@@ -83,19 +148,109 @@ struct ba_device {
 	/* hash-map with connected transports */
 	GHashTable *transports;
 
+	/* Initialized codec contexts left by terminated IO threads. Reusing
+	 * them cuts the time needed to start the audio stream. */
+	struct codec_cache codecs;
+
+};
+
+struct ba_transport_stats {
+	/* codec processing time histogram - see ba_msg_transport_stats */
+	unsigned int codec_time[BA_STATS_CODEC_TIME_BINS];
+	/* overall time (in microseconds) spent on the codec processing */
+	uint64_t codec_time_total;
+	/* codec specific quality parameter - see ba_msg_transport_stats */
+	unsigned int codec_param;
+	/* time (in microseconds) spent on waiting for the BT socket */
+	uint64_t bt_blocked;
+	/* the last sampled and the highest number of bytes queued in the
+	 * BT socket output buffer */
+	unsigned int bt_coutq;
+	unsigned int bt_coutq_max;
+	unsigned int bt_packets;
+	uint64_t bt_bytes;
+	unsigned int bt_dropped;
+	unsigned int pcm_underruns;
+	unsigned int pcm_overruns;
+	unsigned int rtp_gaps;
+	/* transfer pacing drift (in microseconds) */
+	uint64_t sync_skipped;
+	unsigned int sync_overdue_max;
+	/* estimated drift of the remote clock (A2DP sink only) */
+	int drift_ppm;
+};
+
+enum ba_pcm_drain {
+	BA_PCM_DRAIN_NONE = 0,
+	/* drain has been requested by the client */
+	BA_PCM_DRAIN_PENDING,
+	/* drain has been completed, but the client was not notified yet */
+	BA_PCM_DRAIN_DONE,
 };
 
 struct ba_pcm {
 
+	/* backward reference to the owner */
+	struct ba_transport *t;
+
+	/* PCM FIFO file descriptor or the doorbell (data doorbell for playback
+	 * and space doorbell for capture) of the shared memory ring */
 	int fd;
 
+	/* Shared memory ring buffer used with the BA_PCM_TRANSFER_SHM mode. The
+	 * ring is mapped if the ctrl field is not NULL. Upon PCM release, this
+	 * ring is only marked as closed - it is unmapped when the PCM is opened
+	 * again or when the transport is freed. */
+	struct pcm_ring shm;
+
+	/* Read-only (for the client) status page with the transport delay and
+	 * the position of the IO thread. The page is created when the PCM is
+	 * opened for the first time and it is valid until the transport is
+	 * freed, so the IO thread can update it without any locking. */
+	struct pcm_status status;
+
+	/* Sample-rate converter used when the client has opened the PCM with
+	 * a sampling rate different from the transport one. The converter is
+	 * enabled if the filter field is not NULL, and similarly to the shared
+	 * memory ring, it is freed when the PCM is opened again. */
+	struct resampler rs;
+
+	/* Set when the PCM is served by the IO engine. In such case the PCM write
+	 * never blocks - samples which do not fit in the FIFO (or in the shared
+	 * memory ring) are dropped and accounted as the PCM overrun. */
+	bool nonblock;
+
+	/* Sample format of the PCM signal negotiated upon the PCM open. Formats
+	 * other than the S16_LE are passed straight to the encoder, so they are
+	 * available only for the codecs which can accept them. */
+	enum ba_pcm_format format;
+
+	/* Trailing bytes of an incomplete sample read from the PCM. Neither the
+	 * FIFO nor the shared memory ring guarantees, that the client writes
+	 * whole samples only, so these bytes are prepended to the next read. */
+	uint8_t residue[sizeof(int32_t)];
+	size_t residue_len;
+
 	/* client identifier (most likely client socket file descriptor) used
-	 * by the PCM client lookup function - transport_lookup_pcm_client() */
+	 * by the PCM client lookup function - transport_lookup_pcm_client(),
+	 * it shall be modified with the transport_set_pcm_client() only */
 	int client;
 
-	/* variables used for PCM synchronization */
-	pthread_cond_t drained;
-	pthread_mutex_t drained_mn;
+	/* PCM open request (owned by the controller) which waits for the BT
+	 * transport acquisition - NULL if there is no such request */
+	void *open_request;
+
+	/* State of the PCM drain request. The status of the request is sent to
+	 * the client by the controller thread, once the IO thread reports that
+	 * all samples have been transfered. */
+	atomic_int drain;
+	/* Identifier of the latest drain request and the identifier carried by
+	 * the last drain command received by the IO thread. The drain is not
+	 * pending for the IO thread until it has received the command of the
+	 * current request - completion of an aborted drain request will not be
+	 * taken for the completion of its successor. */
+	atomic_uint drain_token;
+	unsigned int drain_token_rx;
 
 };
 
@@ -125,6 +280,10 @@ struct ba_transport {
 	/* IO thread - actual transport layer */
 	enum ba_transport_state state;
 	pthread_t thread;
+	void *(*routine)(void *);
+
+	/* IO task used instead of the IO thread, when the IO engine is enabled */
+	struct io_engine_task task;
 
 	/* This field stores a file descriptor (socket) associated with the BlueZ
 	 * side of the transport. The role of this socket depends on the transport
@@ -135,15 +294,57 @@ struct ba_transport {
 	size_t mtu_read;
 	size_t mtu_write;
 
-	/* PIPE used to notify thread about changes. If thread is based on loop with
-	 * an event wait syscall (e.g. poll), this file descriptor is used to send a
-	 * control event. */
-	int sig_fd[2];
+	/* Queue of control commands - both senders and the IO thread access it
+	 * without locking. The zero-filled structure is an empty queue.
+	 *
+	 * State commands (PCM open, close, pause, resume, sync and volume) are
+	 * coalesced - every command type has a pending bit and a payload slot
+	 * holding the latest payload - so these commands are never lost. The
+	 * RFCOMM data and group link updates are kept in order in the bounded
+	 * multi-producer ring. */
+	struct {
+		atomic_uint pending;
+		/* pending commands taken by the IO thread, but not dispatched yet */
+		unsigned int pending_rx;
+		/* payload slots of the coalesced commands */
+		atomic_uint reconfig;
+		atomic_uint drain;
+		atomic_uint volume;
+		/* ring positions and slots - see transport_cmdq_slot_seq() */
+		atomic_uint head;
+		unsigned int tail;
+		struct {
+			atomic_uint seq;
+			struct ba_transport_cmd cmd;
+		} slots[TRANSPORT_CMDQ_SIZE];
+		/* The latest acknowledgment request and the latest request which has
+		 * been acknowledged by the IO thread - all commands queued prior to
+		 * the request have been dispatched. The mutex and the condition are
+		 * used for waiting only, the queue itself is not guarded by them. */
+		atomic_uint ack_seq;
+		atomic_uint ack_req;
+		atomic_uint acked;
+		pthread_mutex_t ack_mutex;
+		pthread_cond_t ack_cond;
+	} cmdq;
+
+	/* Event file descriptor used to notify thread about queued commands. If
+	 * thread is based on loop with an event wait syscall (e.g. poll), this
+	 * file descriptor shall be added to the polling set. */
+	int sig_fd;
 
 	/* Overall delay in 1/10 of millisecond, caused by the data transfer and
 	 * the audio encoder or decoder. */
 	unsigned int delay;
 
+	/* Performance counters updated by the IO thread. The controller thread
+	 * reads them without any synchronization - they are informative only. */
+	struct ba_transport_stats stats;
+
+	/* Memory used by the IO buffers of this transport. Buffers allocated by
+	 * the IO thread (or task setup) are charged to this budget. */
+	struct ffb_budget buffers;
+
 	union {
 
 		struct {
@@ -155,15 +356,31 @@ struct ba_transport {
 			uint8_t ch1_volume;
 			uint8_t ch2_volume;
 
+			/* Native volume update (protected by the devices mutex). There can
+			 * be only one D-Bus call in progress - meanwhile, only the latest
+			 * requested volume is stored (-1 if there is no such request). */
+			bool volume_update_pending;
+			int volume_update_next;
+
 			/* delay reported by the AVDTP */
 			uint16_t delay;
 
+			/* Identifier of the transport group - zero if the transport is not
+			 * grouped. The PCM opened for one of the A2DP source transports in
+			 * the group (leader) is transmitted to all other group members. */
+			uint8_t group;
+
 			struct ba_pcm pcm;
 
 			/* selected audio codec configuration */
 			uint8_t *cconfig;
 			size_t cconfig_size;
 
+			/* Encoder IO thread routine of the transport, which is run by the
+			 * source dispatcher, unless the PCM has been opened with encoded
+			 * data - NULL if the codec is supported in the passthrough only. */
+			void *(*encoder)(void *);
+
 			/* Value reported by the ioctl(TIOCOUTQ) when the output buffer is
 			 * empty. Somehow this ioctl call reports "available" buffer space.
 			 * So, in order to get the number of bytes in the queue buffer, we
@@ -171,6 +388,18 @@ struct ba_transport {
 			 * subsequent ioctl() calls. */
 			int bt_fd_coutq_init;
 
+			/* Drift of the remote clock estimated from RTP time-stamps of the
+			 * received packets (A2DP sink only). */
+			struct drift_estimator drift;
+
+			/* The number of seconds for keeping the transport acquired without
+			 * the PCM - see the keep-alive option. Unlike the global option,
+			 * it might be adjusted by the warm-standby request. */
+			int keep_alive;
+
+			/* pending asynchronous BT transport acquisition */
+			struct transport_acquire_call *acquire;
+
 		} a2dp;
 
 		struct {
@@ -206,6 +435,13 @@ struct ba_transport {
 			int (*release)(struct ba_transport*);
 			int (*acquire)(struct ba_transport*);
 
+			/* SCO socket with the connection in progress. Upon completion,
+			 * which is handled by the IO thread, it becomes the bt_fd. */
+			int connect_fd;
+			/* If true, the SCO link shall be established even if there is
+			 * no PCM client, e.g. when there is an incoming call. */
+			bool preconnect;
+
 			bool is_ofono;
 #if ENABLE_OFONO
 			struct ofono {
@@ -256,16 +492,26 @@ struct ba_transport *transport_new_rfcomm(
 		const char *dbus_path,
 		enum bluetooth_profile profile);
 void transport_free(struct ba_transport *t);
+void transport_pool_free(void);
 
 struct ba_transport *transport_lookup(GHashTable *devices, const char *dbus_path);
 struct ba_transport *transport_lookup_pcm_client(GHashTable *devices, int client);
+int transport_get_default_keep_alive(const struct ba_transport *t);
+void transport_set_pcm_client(struct ba_transport *t, struct ba_pcm *pcm, int client);
 bool transport_remove(GHashTable *devices, const char *dbus_path);
 
+int transport_send_command(struct ba_transport *t, const struct ba_transport_cmd *cmd);
+int transport_send_command_sync(struct ba_transport *t, const struct ba_transport_cmd *cmd);
 int transport_send_signal(struct ba_transport *t, enum ba_transport_signal sig);
 int transport_send_rfcomm(struct ba_transport *t, const char command[32]);
+bool transport_recv_command(struct ba_transport *t, struct ba_transport_cmd *cmd);
+void transport_forward_commands(struct ba_transport *t);
 
 unsigned int transport_get_channels(const struct ba_transport *t);
 unsigned int transport_get_sampling(const struct ba_transport *t);
+unsigned int transport_get_pcm_formats(const struct ba_transport *t);
+size_t transport_pcm_format_size(enum ba_pcm_format format);
+unsigned int transport_get_delay(const struct ba_transport *t);
 
 int transport_set_volume(struct ba_transport *t, uint8_t ch1_muted, uint8_t ch2_muted,
 		uint8_t ch1_volume, uint8_t ch2_volume);
@@ -273,14 +519,38 @@ int transport_set_volume(struct ba_transport *t, uint8_t ch1_muted, uint8_t ch2_
 int transport_set_state(struct ba_transport *t, enum ba_transport_state state);
 int transport_set_state_from_string(struct ba_transport *t, const char *state);
 
+int transport_group_link(GHashTable *devices, struct ba_transport *t);
+int transport_group_unlink(GHashTable *devices, struct ba_transport *t);
+void transport_group_signal(GHashTable *devices, struct ba_transport *t,
+		enum ba_transport_signal sig);
+struct ba_transport *transport_group_lookup_leader(GHashTable *devices, uint8_t group);
+
 int transport_drain_pcm(struct ba_transport *t);
+bool transport_pcm_drain_pending(struct ba_pcm *pcm);
+void transport_pcm_drained(struct ba_pcm *pcm);
+
+/**
+ * Callback function called upon asynchronous acquisition completion.
+ *
+ * The callback is called with the devices mutex and the transport mutex
+ * locked. If the waiting has been canceled, the transport is NULL, and
+ * errno is set to ECANCELED.
+ *
+ * @param t Transport structure or NULL.
+ * @param ret BT socket or -1 on error.
+ * @param userdata Data passed to the transport_acquire_bt_a2dp_async(). */
+typedef void (*transport_acquire_cb)(struct ba_transport *t, int ret, void *userdata);
 
 int transport_acquire_bt_a2dp(struct ba_transport *t);
+int transport_acquire_bt_a2dp_async(struct ba_transport *t,
+		transport_acquire_cb callback, void *userdata);
+void transport_acquire_bt_a2dp_cancel(struct ba_transport *t, void *userdata);
 int transport_release_bt_a2dp(struct ba_transport *t);
 
 int transport_release_bt_rfcomm(struct ba_transport *t);
 
 int transport_acquire_bt_sco(struct ba_transport *t);
+int transport_acquire_bt_sco_complete(struct ba_transport *t);
 int transport_release_bt_sco(struct ba_transport *t);
 
 void transport_sco_init(struct ba_transport *t);
@@ -11,8 +11,14 @@
 #include "utils.h"
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci_lib.h>
@@ -99,9 +105,14 @@ int hci_devlist(struct hci_dev_info **di, int *num) {
  *   link should be established.
  * @param ba Pointer to the Bluetooth address structure for a target device.
  * @param transparent Use transparent mode for voice transmission.
+ * @param nonblock If true, this function will not wait for the link to be
+ *   established. The returned socket will be in the non-blocking mode, and
+ *   the caller shall wait for it to become writable, and then check the
+ *   connection status with the hci_open_sco_complete() function.
  * @return On success this function returns socket file descriptor. Otherwise,
  *   -1 is returned and errno is set to indicate the error. */
-int hci_open_sco(const struct hci_dev_info *di, const bdaddr_t *ba, bool transparent) {
+int hci_open_sco(const struct hci_dev_info *di, const bdaddr_t *ba, bool transparent,
+		bool nonblock) {
 
 	struct sockaddr_sco addr_hci = {
 		.sco_family = AF_BLUETOOTH,
@@ -113,7 +124,8 @@ int hci_open_sco(const struct hci_dev_info *di, const bdaddr_t *ba, bool transpa
 	};
 	int dd, err;
 
-	if ((dd = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_SCO)) == -1)
+	if ((dd = socket(PF_BLUETOOTH, SOCK_SEQPACKET | (nonblock ? SOCK_NONBLOCK : 0),
+					BTPROTO_SCO)) == -1)
 		return -1;
 	if (bind(dd, (struct sockaddr *)&addr_hci, sizeof(addr_hci)) == -1)
 		goto fail;
@@ -126,7 +138,8 @@ int hci_open_sco(const struct hci_dev_info *di, const bdaddr_t *ba, bool transpa
 			goto fail;
 	}
 
-	if (connect(dd, (struct sockaddr *)&addr_dev, sizeof(addr_dev)) == -1)
+	if (connect(dd, (struct sockaddr *)&addr_dev, sizeof(addr_dev)) == -1 &&
+			!(nonblock && errno == EINPROGRESS))
 		goto fail;
 
 	return dd;
@@ -138,6 +151,28 @@ fail:
 	return -1;
 }
 
+/**
+ * Check the status of the non-blocking SCO connection.
+ *
+ * @param dd SCO socket returned by the hci_open_sco() in the non-blocking
+ *   mode, which has become writable.
+ * @return If the link has been established, this function returns 0.
+ *   Otherwise, -1 is returned and errno is set to indicate the error. */
+int hci_open_sco_complete(int dd) {
+
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(dd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		return -1;
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
  * Get BlueZ D-Bus object path for given profile and codec.
  *
@@ -162,6 +197,10 @@ const char *g_dbus_get_profile_object_path(enum bluetooth_profile profile, uint1
 		case A2DP_CODEC_VENDOR_APTX:
 			return "/A2DP/APTX/Source";
 #endif
+#if ENABLE_APTX_HD
+		case A2DP_CODEC_VENDOR_APTX_HD:
+			return "/A2DP/APTXHD/Source";
+#endif
 #if ENABLE_LDAC
 		case A2DP_CODEC_VENDOR_LDAC:
 			return "/A2DP/LDAC/Source";
@@ -186,6 +225,10 @@ const char *g_dbus_get_profile_object_path(enum bluetooth_profile profile, uint1
 		case A2DP_CODEC_VENDOR_APTX:
 			return "/A2DP/APTX/Sink";
 #endif
+#if ENABLE_APTX_HD
+		case A2DP_CODEC_VENDOR_APTX_HD:
+			return "/A2DP/APTXHD/Sink";
+#endif
 #if ENABLE_LDAC
 		case A2DP_CODEC_VENDOR_LDAC:
 			return "/A2DP/LDAC/Sink";
@@ -264,6 +307,30 @@ int g_dbus_device_path_to_bdaddr(const char *path, bdaddr_t *addr) {
 	return ret;
 }
 
+/**
+ * Get HCI device ID from the BlueZ D-Bus object path.
+ *
+ * @param path BlueZ D-Bus adapter or device path, e.g. /org/bluez/hci0 or
+ *   /org/bluez/hci0/dev_12_34_56_78_9A_BC.
+ * @return On success this function returns the HCI device ID. Otherwise, -1
+ *   is returned. */
+int g_dbus_object_path_to_hci_dev_id(const char *path) {
+
+	char *tmp;
+	long id;
+
+	if ((path = strstr(path, "/hci")) == NULL)
+		return -1;
+
+	path += 4;
+	id = strtol(path, &tmp, 10);
+	if (tmp == path || (*tmp != '\0' && *tmp != '/') ||
+			id < 0 || id >= HCI_MAX_DEV)
+		return -1;
+
+	return id;
+}
+
 /**
  * Get a property of a given D-Bus interface.
  *
@@ -353,6 +420,59 @@ fail:
 	return TRUE;
 }
 
+/**
+ * Set a property of a given D-Bus interface asynchronously.
+ *
+ * @param conn D-Bus connection handler.
+ * @param name Valid D-Bus name or NULL.
+ * @param path Valid D-Bus object path.
+ * @param interface Interface with the given property.
+ * @param property The property name.
+ * @param value Variant containing property value.
+ * @param callback Function called when the call has been completed. It
+ *   shall call the g_dbus_set_property_finish() to get the result.
+ * @param userdata Data passed to the callback function. */
+void g_dbus_set_property_async(GDBusConnection *conn, const char *name,
+		const char *path, const char *interface, const char *property,
+		const GVariant *value, GAsyncReadyCallback callback, void *userdata) {
+
+	GDBusMessage *msg;
+
+	msg = g_dbus_message_new_method_call(name, path, "org.freedesktop.DBus.Properties", "Set");
+	g_dbus_message_set_body(msg, g_variant_new("(ssv)", interface, property, value));
+
+	g_dbus_connection_send_message_with_reply(conn, msg,
+			G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, callback, userdata);
+
+	g_object_unref(msg);
+}
+
+/**
+ * Finish asynchronous D-Bus property set operation.
+ *
+ * @param conn D-Bus connection handler.
+ * @param result The result passed to the completion callback.
+ * @return On success this function returns TRUE. Otherwise, FALSE. */
+gboolean g_dbus_set_property_finish(GDBusConnection *conn, GAsyncResult *result) {
+
+	GDBusMessage *rep;
+	GError *err = NULL;
+
+	if ((rep = g_dbus_connection_send_message_with_reply_finish(conn, result, &err)) != NULL &&
+			g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR)
+		g_dbus_message_to_gerror(rep, &err);
+
+	if (rep != NULL)
+		g_object_unref(rep);
+	if (err != NULL) {
+		warn("Couldn't set property: %s", err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 /**
  * Convert Bluetooth profile into a human-readable string.
  *
@@ -431,34 +551,350 @@ const char *batostr_(const bdaddr_t *ba) {
 	return NULL;
 }
 
+/**
+ * Convert CPU list into the CPU bit mask.
+ *
+ * The CPU list is a comma-separated list of CPU numbers and ranges, e.g.
+ * "0,2-3". Only the first 64 CPUs can be addressed.
+ *
+ * @param list CPU list string.
+ * @param mask Address where the CPU mask will be stored.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to EINVAL. */
+int cpulist_to_mask(const char *list, uint64_t *mask) {
+
+	uint64_t _mask = 0;
+	unsigned long first, last;
+	char *tmp;
+
+	do {
+
+		first = last = strtoul(list, &tmp, 10);
+		if (tmp == list)
+			goto fail;
+
+		if (*tmp == '-') {
+			list = tmp + 1;
+			last = strtoul(list, &tmp, 10);
+			if (tmp == list)
+				goto fail;
+		}
+
+		if (first > last || last >= 64)
+			goto fail;
+		for (; first <= last; first++)
+			_mask |= 1ULL << first;
+
+		list = tmp + 1;
+
+	} while (*tmp == ',');
+
+	if (*tmp != '\0')
+		goto fail;
+
+	*mask = _mask;
+	return 0;
+
+fail:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Q15 gain values for the 7-bit volume level.
+ *
+ * The volume level is mapped linearly onto the range from -64 dB (level 0)
+ * up to 0 dB (level 127), i.e. gain = 10 ^ ((-64 + 64 * level / 127) / 20).
+ * Muting shall be done with the gain equal to 0. */
+const uint16_t snd_pcm_volume_gain[128] = {
+	0x0015, 0x0016, 0x0017, 0x0019, 0x001A, 0x001C, 0x001D, 0x001F,
+	0x0021, 0x0023, 0x0025, 0x0027, 0x0029, 0x002C, 0x002F, 0x0031,
+	0x0034, 0x0037, 0x003B, 0x003E, 0x0042, 0x0046, 0x004A, 0x004F,
+	0x0053, 0x0058, 0x005D, 0x0063, 0x0069, 0x006F, 0x0076, 0x007D,
+	0x0084, 0x008C, 0x0095, 0x009E, 0x00A7, 0x00B1, 0x00BB, 0x00C7,
+	0x00D3, 0x00DF, 0x00EC, 0x00FB, 0x010A, 0x0119, 0x012A, 0x013C,
+	0x014F, 0x0163, 0x0178, 0x018F, 0x01A6, 0x01C0, 0x01DA, 0x01F7,
+	0x0215, 0x0235, 0x0256, 0x027A, 0x02A0, 0x02C8, 0x02F2, 0x0320,
+	0x034F, 0x0382, 0x03B8, 0x03F0, 0x042D, 0x046C, 0x04B0, 0x04F8,
+	0x0544, 0x0594, 0x05EA, 0x0644, 0x06A4, 0x0709, 0x0775, 0x07E7,
+	0x0860, 0x08E0, 0x0968, 0x09F7, 0x0A90, 0x0B31, 0x0BDD, 0x0C92,
+	0x0D52, 0x0E1E, 0x0EF6, 0x0FDA, 0x10CD, 0x11CE, 0x12DE, 0x13FF,
+	0x1530, 0x1674, 0x17CC, 0x1938, 0x1AB9, 0x1C52, 0x1E03, 0x1FCE,
+	0x21B4, 0x23B8, 0x25DA, 0x281D, 0x2A82, 0x2D0C, 0x2FBD, 0x3297,
+	0x359D, 0x38D0, 0x3C35, 0x3FCE, 0x439E, 0x47A7, 0x4BEF, 0x5078,
+	0x5547, 0x5A5F, 0x5FC5, 0x657D, 0x6B8D, 0x71FA, 0x78C9, 0x8000,
+};
+
+/**
+ * Scale single PCM sample with the given Q15 gain. */
+static inline int16_t snd_pcm_scale_sample(int16_t sample, uint16_t gain) {
+	if (gain == SND_PCM_GAIN_UNITY)
+		return sample;
+	int32_t v = ((int32_t)sample * gain + (1 << 14)) >> 15;
+	if (v > INT16_MAX)
+		return INT16_MAX;
+	if (v < INT16_MIN)
+		return INT16_MIN;
+	return v;
+}
+
 /**
  * Scale PCM signal stored in the buffer.
  *
- * Neutral value for scaling factor is 1.0. It is possible to increase
- * signal gain by using scaling factor values greater than 1, however
- * clipping will most certainly occur.
+ * Neutral value for the gain is SND_PCM_GAIN_UNITY (1.0 in the Q15 format).
+ * It is possible to increase signal gain by using values greater than that,
+ * in which case the output signal is saturated. However, such values are
+ * not supported by the vectorized code path.
  *
  * @param buffer Address to the buffer where the PCM signal is stored.
- * @param size The number of samples in the buffer.
+ * @param samples The number of samples in the buffer.
  * @param channels The number of channels in the buffer.
- * @param ch1_scale The scaling factor for 1st channel.
- * @param ch1_scale The scaling factor for 2nd channel. */
-void snd_pcm_scale_s16le(int16_t *buffer, size_t size, int channels,
-		double ch1_scale, double ch2_scale) {
+ * @param ch1_gain The Q15 gain for 1st channel.
+ * @param ch2_gain The Q15 gain for 2nd channel. */
+void snd_pcm_scale_s16le(int16_t *buffer, size_t samples, int channels,
+		uint16_t ch1_gain, uint16_t ch2_gain) {
+
+	switch (channels) {
+	case 1:
+		ch2_gain = ch1_gain;
+		break;
+	case 2:
+		break;
+	default:
+		return;
+	}
+
+	if (ch1_gain == SND_PCM_GAIN_UNITY && ch2_gain == SND_PCM_GAIN_UNITY)
+		return;
+	if (ch1_gain == 0 && ch2_gain == 0) {
+		memset(buffer, 0, samples * sizeof(*buffer));
+		return;
+	}
+
+	/* For vectorized code, gain has to fit into signed 16-bit integer, so
+	 * the unity gain is handled by restoring unmodified samples with a
+	 * bitwise blend. Since every vector holds an even number of samples,
+	 * channels of the interleaved signal stay in the same lanes. */
+	const int16_t g1 = ch1_gain < SND_PCM_GAIN_UNITY ? ch1_gain : INT16_MAX;
+	const int16_t g2 = ch2_gain < SND_PCM_GAIN_UNITY ? ch2_gain : INT16_MAX;
+	const int16_t k1 = ch1_gain == SND_PCM_GAIN_UNITY ? -1 : 0;
+	const int16_t k2 = ch2_gain == SND_PCM_GAIN_UNITY ? -1 : 0;
+
+#if defined(__SSE2__)
+
+	const __m128i gain = _mm_set_epi16(g2, g1, g2, g1, g2, g1, g2, g1);
+	const __m128i keep = _mm_set_epi16(k2, k1, k2, k1, k2, k1, k2, k1);
+	const __m128i round = _mm_set1_epi32(1 << 14);
+
+	for (; samples >= 8; samples -= 8, buffer += 8) {
+		__m128i s = _mm_loadu_si128((__m128i *)buffer);
+		__m128i lo = _mm_mullo_epi16(s, gain);
+		__m128i hi = _mm_mulhi_epi16(s, gain);
+		__m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 15);
+		__m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 15);
+		__m128i r = _mm_packs_epi32(p0, p1);
+		r = _mm_or_si128(_mm_and_si128(keep, s), _mm_andnot_si128(keep, r));
+		_mm_storeu_si128((__m128i *)buffer, r);
+	}
+
+#elif defined(__ARM_NEON)
+
+	const int16_t gain_[8] = { g1, g2, g1, g2, g1, g2, g1, g2 };
+	const uint16_t keep_[8] = { k1, k2, k1, k2, k1, k2, k1, k2 };
+	const int16x8_t gain = vld1q_s16(gain_);
+	const uint16x8_t keep = vld1q_u16(keep_);
+
+	for (; samples >= 8; samples -= 8, buffer += 8) {
+		int16x8_t s = vld1q_s16(buffer);
+		int32x4_t p0 = vmull_s16(vget_low_s16(s), vget_low_s16(gain));
+		int32x4_t p1 = vmull_s16(vget_high_s16(s), vget_high_s16(gain));
+		int16x8_t r = vcombine_s16(vqrshrn_n_s32(p0, 15), vqrshrn_n_s32(p1, 15));
+		vst1q_s16(buffer, vbslq_s16(keep, s, r));
+	}
+
+#else
+	(void)g1; (void)g2;
+	(void)k1; (void)k2;
+#endif
+
+	/* scalar fallback and the tail of the vectorized loop */
+	for (; samples >= 2; samples -= 2, buffer += 2) {
+		buffer[0] = snd_pcm_scale_sample(buffer[0], ch1_gain);
+		buffer[1] = snd_pcm_scale_sample(buffer[1], ch2_gain);
+	}
+	if (samples == 1)
+		buffer[0] = snd_pcm_scale_sample(buffer[0], ch1_gain);
+
+}
+
+/**
+ * Scale single 32-bit PCM sample with the given Q15 gain and saturate it
+ * to the given number of bits. */
+static inline int32_t snd_pcm_scale_sample32(int32_t sample, uint16_t gain, int bits) {
+	const int32_t max = (int32_t)(((int64_t)1 << (bits - 1)) - 1);
+	if (gain == SND_PCM_GAIN_UNITY)
+		return sample;
+	int64_t v = ((int64_t)sample * gain + (1 << 14)) >> 15;
+	if (v > max)
+		return max;
+	if (v < -max - 1)
+		return -max - 1;
+	return v;
+}
+
+/**
+ * Scale PCM signal stored in the buffer as 24-bit packed samples.
+ *
+ * See the snd_pcm_scale_s16le() for the description of parameters. */
+void snd_pcm_scale_s24_3le(uint8_t *buffer, size_t samples, int channels,
+		uint16_t ch1_gain, uint16_t ch2_gain) {
+
+	switch (channels) {
+	case 1:
+		ch2_gain = ch1_gain;
+		break;
+	case 2:
+		break;
+	default:
+		return;
+	}
+
+	if (ch1_gain == SND_PCM_GAIN_UNITY && ch2_gain == SND_PCM_GAIN_UNITY)
+		return;
+	if (ch1_gain == 0 && ch2_gain == 0) {
+		memset(buffer, 0, samples * 3);
+		return;
+	}
+
+	size_t i;
+	for (i = 0; i < samples; i++, buffer += 3) {
+		/* sign extension is done by the arithmetic shift of the upper byte */
+		int32_t v = (int32_t)((uint32_t)buffer[0] << 8 | (uint32_t)buffer[1] << 16 |
+				(uint32_t)buffer[2] << 24) >> 8;
+		v = snd_pcm_scale_sample32(v, i % 2 ? ch2_gain : ch1_gain, 24);
+		buffer[0] = v;
+		buffer[1] = v >> 8;
+		buffer[2] = v >> 16;
+	}
+
+}
+
+/**
+ * Scale PCM signal stored in the buffer as 32-bit samples.
+ *
+ * See the snd_pcm_scale_s16le() for the description of parameters. */
+void snd_pcm_scale_s32le(int32_t *buffer, size_t samples, int channels,
+		uint16_t ch1_gain, uint16_t ch2_gain) {
+
 	switch (channels) {
 	case 1:
-		if (ch1_scale != 1.0)
-			while (size--)
-				buffer[size] = buffer[size] * ch1_scale;
+		ch2_gain = ch1_gain;
 		break;
 	case 2:
-		if (ch1_scale != 1.0 || ch2_scale != 1.0)
-			while (size--) {
-				double scale = size % 2 == 0 ? ch1_scale : ch2_scale;
-				buffer[size] = buffer[size] * scale;
-			}
 		break;
+	default:
+		return;
+	}
+
+	if (ch1_gain == SND_PCM_GAIN_UNITY && ch2_gain == SND_PCM_GAIN_UNITY)
+		return;
+	if (ch1_gain == 0 && ch2_gain == 0) {
+		memset(buffer, 0, samples * sizeof(*buffer));
+		return;
+	}
+
+	for (; samples >= 2; samples -= 2, buffer += 2) {
+		buffer[0] = snd_pcm_scale_sample32(buffer[0], ch1_gain, 32);
+		buffer[1] = snd_pcm_scale_sample32(buffer[1], ch2_gain, 32);
+	}
+	if (samples == 1)
+		buffer[0] = snd_pcm_scale_sample32(buffer[0], ch1_gain, 32);
+
+}
+
+/**
+ * Scale PCM signal stored in the buffer as 32-bit float samples.
+ *
+ * Samples are saturated to the range [-1.0, 1.0] if the gain is greater
+ * than the unity. See the snd_pcm_scale_s16le() for other details. */
+void snd_pcm_scale_float_le(float *buffer, size_t samples, int channels,
+		uint16_t ch1_gain, uint16_t ch2_gain) {
+
+	switch (channels) {
+	case 1:
+		ch2_gain = ch1_gain;
+		break;
+	case 2:
+		break;
+	default:
+		return;
 	}
+
+	if (ch1_gain == SND_PCM_GAIN_UNITY && ch2_gain == SND_PCM_GAIN_UNITY)
+		return;
+
+	const float g[2] = {
+		(float)ch1_gain / SND_PCM_GAIN_UNITY,
+		(float)ch2_gain / SND_PCM_GAIN_UNITY };
+	size_t i;
+
+	for (i = 0; i < samples; i++) {
+		float v = buffer[i] * g[i % 2];
+		if (v > 1.0f)
+			v = 1.0f;
+		else if (v < -1.0f)
+			v = -1.0f;
+		buffer[i] = v;
+	}
+
+}
+
+/**
+ * Split interleaved stereo S16 signal into 32-bit channel buffers.
+ *
+ * @param src Address of the interleaved stereo signal.
+ * @param frames The number of frames in the source buffer.
+ * @param shift The number of bits by which every sample is shifted to the
+ *   left, e.g. 8 for encoders which take 24-bit samples.
+ * @param ch1 Address of the buffer for the 1st channel.
+ * @param ch2 Address of the buffer for the 2nd channel. */
+void snd_pcm_deinterleave_s16le(const int16_t *src, size_t frames,
+		unsigned int shift, int32_t *ch1, int32_t *ch2) {
+
+#if defined(__SSE2__)
+
+	const __m128i count = _mm_cvtsi32_si128(shift);
+
+	/* every 32-bit lane holds one frame - the sign of the 1st channel is
+	 * extended by the arithmetic shift of the lower half-word */
+	for (; frames >= 4; frames -= 4, src += 8, ch1 += 4, ch2 += 4) {
+		__m128i s = _mm_loadu_si128((__m128i *)src);
+		__m128i l = _mm_srai_epi32(_mm_slli_epi32(s, 16), 16);
+		__m128i r = _mm_srai_epi32(s, 16);
+		_mm_storeu_si128((__m128i *)ch1, _mm_sll_epi32(l, count));
+		_mm_storeu_si128((__m128i *)ch2, _mm_sll_epi32(r, count));
+	}
+
+#elif defined(__ARM_NEON)
+
+	const int32x4_t count = vdupq_n_s32(shift);
+
+	for (; frames >= 8; frames -= 8, src += 16, ch1 += 8, ch2 += 8) {
+		int16x8x2_t s = vld2q_s16(src);
+		vst1q_s32(ch1, vshlq_s32(vmovl_s16(vget_low_s16(s.val[0])), count));
+		vst1q_s32(ch1 + 4, vshlq_s32(vmovl_s16(vget_high_s16(s.val[0])), count));
+		vst1q_s32(ch2, vshlq_s32(vmovl_s16(vget_low_s16(s.val[1])), count));
+		vst1q_s32(ch2 + 4, vshlq_s32(vmovl_s16(vget_high_s16(s.val[1])), count));
+	}
+
+#endif
+
+	/* scalar fallback and the tail of the vectorized loop */
+	for (; frames > 0; frames--, src += 2) {
+		*ch1++ = (int32_t)((uint32_t)(int32_t)src[0] << shift);
+		*ch2++ = (int32_t)((uint32_t)(int32_t)src[1] << shift);
+	}
+
 }
 
 #if ENABLE_AAC
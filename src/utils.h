@@ -16,6 +16,7 @@
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #include <bluetooth/bluetooth.h>
@@ -27,24 +28,47 @@
 int a2dp_sbc_default_bitpool(int freq, int mode);
 
 int hci_devlist(struct hci_dev_info **di, int *num);
-int hci_open_sco(const struct hci_dev_info *di, const bdaddr_t *ba, bool transparent);
+int hci_open_sco(const struct hci_dev_info *di, const bdaddr_t *ba, bool transparent,
+		bool nonblock);
+int hci_open_sco_complete(int dd);
 
 const char *bluetooth_profile_to_string(enum bluetooth_profile profile);
 const char *bluetooth_a2dp_codec_to_string(uint16_t codec);
 const char *batostr_(const bdaddr_t *ba);
 
+int cpulist_to_mask(const char *list, uint64_t *mask);
+
 const char *g_dbus_get_profile_object_path(enum bluetooth_profile profile, uint16_t codec);
 enum bluetooth_profile g_dbus_object_path_to_profile(const char *path);
 int g_dbus_device_path_to_bdaddr(const char *path, bdaddr_t *addr);
+int g_dbus_object_path_to_hci_dev_id(const char *path);
 
 GVariant *g_dbus_get_property(GDBusConnection *conn, const char *name,
 		const char *path, const char *interface, const char *property);
 gboolean g_dbus_set_property(GDBusConnection *conn, const char *name,
 		const char *path, const char *interface, const char *property,
 		const GVariant *value);
+void g_dbus_set_property_async(GDBusConnection *conn, const char *name,
+		const char *path, const char *interface, const char *property,
+		const GVariant *value, GAsyncReadyCallback callback, void *userdata);
+gboolean g_dbus_set_property_finish(GDBusConnection *conn, GAsyncResult *result);
+
+/* Q15 representation of the neutral gain */
+#define SND_PCM_GAIN_UNITY 0x8000
+
+extern const uint16_t snd_pcm_volume_gain[128];
+
+void snd_pcm_scale_s16le(int16_t *buffer, size_t samples, int channels,
+		uint16_t ch1_gain, uint16_t ch2_gain);
+void snd_pcm_scale_s24_3le(uint8_t *buffer, size_t samples, int channels,
+		uint16_t ch1_gain, uint16_t ch2_gain);
+void snd_pcm_scale_s32le(int32_t *buffer, size_t samples, int channels,
+		uint16_t ch1_gain, uint16_t ch2_gain);
+void snd_pcm_scale_float_le(float *buffer, size_t samples, int channels,
+		uint16_t ch1_gain, uint16_t ch2_gain);
 
-void snd_pcm_scale_s16le(int16_t *buffer, size_t size, int channels,
-		double ch1_scale, double ch2_scale);
+void snd_pcm_deinterleave_s16le(const int16_t *src, size_t frames,
+		unsigned int shift, int32_t *ch1, int32_t *ch2);
 
 #if ENABLE_AAC
 #include <fdk-aac/aacdecoder_lib.h>
@@ -0,0 +1,136 @@
+/*
+ * bench-at.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/at.c"
+#include "../src/shared/ffb.c"
+#include "../src/shared/log.c"
+
+/* Burst of messages sent by a typical headset during the SLC setup. */
+static const char bench_at_burst[] =
+	"AT+BRSF=191\rAT+BAC=1,2\rAT+CIND=?\rAT+CIND?\rAT+CMER=3,0,0,1\r"
+	"AT+CHLD=?\rAT+BIA=0,0,0,1,1,1,0\rAT+XAPL=ABCD-1234-0100,10\r"
+	"AT+IPHONEACCEV=2,1,5,2,0\rAT+VGS=12\rAT+VGM=8\rAT+BTRH?\r"
+	"\r\n+CIND:(\"call\",(0,1)),(\"callsetup\",(0-3)),(\"service\",(0-1))\r\n"
+	"\r\nOK\r\n";
+
+static double bench_timestamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Feed the burst in chunks of the given size and parse all messages.
+ *
+ * The chunk size of zero means, that chunk sizes are random (in the range
+ * from 1 to 32 bytes), which simulates arbitrary RFCOMM fragmentation. */
+static void bench_tokenizer(unsigned int iterations, size_t chunk) {
+
+	struct at_tokenizer tok;
+	unsigned int seed = 0xB1A5;
+	size_t messages = 0;
+	size_t errors = 0;
+	unsigned int i;
+
+	if (at_tokenizer_init(&tok) == -1) {
+		fprintf(stderr, "Couldn't create AT tokenizer: %s\n", strerror(errno));
+		return;
+	}
+
+	const double t0 = bench_timestamp();
+	for (i = 0; i < iterations; i++) {
+
+		size_t offset = 0;
+		while (offset < sizeof(bench_at_burst) - 1) {
+
+			size_t len = chunk != 0 ? chunk : (size_t)rand_r(&seed) % 32 + 1;
+			if (len > sizeof(bench_at_burst) - 1 - offset)
+				len = sizeof(bench_at_burst) - 1 - offset;
+
+			at_tokenizer_feed(&tok, &bench_at_burst[offset], len);
+			offset += len;
+
+			struct bt_at at;
+			int ret;
+			while ((ret = at_tokenizer_next(&tok, &at)) != 0) {
+				if (ret == 1)
+					messages++;
+				else
+					errors++;
+			}
+
+		}
+
+	}
+	const double wall = bench_timestamp() - t0;
+
+	char label[16] = "random";
+	if (chunk != 0)
+		snprintf(label, sizeof(label), "%zu", chunk);
+
+	printf("%s\t%zu\t%zu\t%zu\t%.3f\t%.0f\t%.1f\n", label, messages, errors,
+			(size_t)iterations * (sizeof(bench_at_burst) - 1), wall,
+			messages / wall, (sizeof(bench_at_burst) - 1) * iterations / wall / 1e6);
+
+	at_tokenizer_free(&tok);
+}
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	const char *opts = "hn:";
+	const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ 0, 0, 0, 0 },
+	};
+
+	unsigned int iterations = 100000;
+
+	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h':
+			printf("Usage:\n"
+					"  %s [OPTION]...\n"
+					"\nOptions:\n"
+					"  -h, --help\t\tprint this help and exit\n"
+					"  -n, --iterations=NUM\tnumber of parsed SLC bursts\n"
+					"\nOutput columns (tab separated):\n"
+					"  chunk size, messages, errors, bytes, wall time [s],\n"
+					"  messages per second, throughput [MB/s]\n",
+					argv[0]);
+			return EXIT_SUCCESS;
+		case 'n':
+			if ((iterations = atoi(optarg)) == 0) {
+				fprintf(stderr, "Invalid number of iterations: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	printf("#chunk\tmessages\terrors\tbytes\twall\tmsg_per_s\tmb_per_s\n");
+
+	bench_tokenizer(iterations, sizeof(bench_at_burst) - 1);
+	bench_tokenizer(iterations, 16);
+	bench_tokenizer(iterations, 1);
+	bench_tokenizer(iterations, 0);
+
+	return EXIT_SUCCESS;
+}
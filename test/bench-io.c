@@ -0,0 +1,714 @@
+/*
+ * bench-io.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "inc/sine.inc"
+#include "../src/shared/rt.c"
+
+/* Run codecs at full speed - instead of keeping the constant bit rate,
+ * only account the number of transfered frames. */
+#define asrsync_sync(asrs, frames) bench_asrsync_sync(asrs, frames)
+static int bench_asrsync_sync(struct asrsync *asrs, unsigned int frames) {
+	asrs->frames += frames;
+	return 1;
+}
+
+#include "../src/abr.c"
+#include "../src/capture.c"
+#include "../src/codec-cache.c"
+#include "../src/codec-lib.c"
+#include "../src/cpu-budget.c"
+#include "../src/link-history.c"
+#include "../src/mem-pool.c"
+#include "../src/at.c"
+#include "../src/bluealsa.c"
+#include "../src/ctl.c"
+#include "../src/io.c"
+#include "../src/io-engine.c"
+#include "../src/jitter.c"
+#include "../src/resample.c"
+#include "../src/rfcomm.c"
+#include "../src/transport.c"
+#include "../src/utils.c"
+#include "../src/shared/drift.c"
+#include "../src/shared/ffb.c"
+#include "../src/shared/log.c"
+#include "../src/shared/pcm-ring.c"
+#include "../src/shared/pcm-status.c"
+
+#undef asrsync_sync
+
+/* The MTU of the typical A2DP L2CAP channel. */
+#define BENCH_MTU 895
+/* Time (in milliseconds) of inactivity, which marks the end of the run. */
+#define BENCH_IDLE_TIMEOUT 250
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/* Allocations are accounted for the codec thread only. */
+static __thread bool bench_alloc_tracked = false;
+static atomic_uint bench_allocs;
+static atomic_size_t bench_alloc_bytes;
+
+void *malloc(size_t size) {
+	if (bench_alloc_tracked) {
+		bench_allocs++;
+		bench_alloc_bytes += size;
+	}
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	if (bench_alloc_tracked) {
+		bench_allocs++;
+		bench_alloc_bytes += nmemb * size;
+	}
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	if (bench_alloc_tracked) {
+		bench_allocs++;
+		bench_alloc_bytes += size;
+	}
+	return __libc_realloc(ptr, size);
+}
+
+struct bench_config {
+	const char *codec;
+	char label[32];
+	uint16_t codec_id;
+	union {
+		a2dp_sbc_t sbc;
+#if ENABLE_AAC
+		a2dp_aac_t aac;
+#endif
+#if ENABLE_APTX
+		a2dp_aptx_t aptx;
+#endif
+#if ENABLE_APTX_HD
+		a2dp_aptx_hd_t aptx_hd;
+#endif
+#if ENABLE_LDAC
+		a2dp_ldac_t ldac;
+#endif
+	} cconfig;
+	size_t cconfig_size;
+	void *(*encoder)(void *);
+	void *(*decoder)(void *);
+	/* codec specific global configuration */
+	int aac_vbr_mode;
+	int ldac_eqmid;
+};
+
+struct bench_result {
+	unsigned int frames;
+	struct timespec wall;
+	struct timespec cpu;
+	unsigned int allocs;
+	size_t alloc_bytes;
+	unsigned int packets;
+	size_t bytes;
+};
+
+/**
+ * Encoded BT packets, which are used as an input for the decoder. */
+static struct {
+	struct {
+		uint8_t *data;
+		size_t len;
+	} *packets;
+	size_t count;
+	size_t size;
+} bench_bt_data;
+
+struct bench_thread {
+	void *(*cb)(void *);
+	struct ba_transport *t;
+};
+
+static void *bench_codec_thread(void *arg) {
+	const struct bench_thread *bt = arg;
+	bench_alloc_tracked = true;
+	return bt->cb(bt->t);
+}
+
+struct bench_writer {
+	int fd;
+	const int16_t *pcm;
+	size_t pcm_len;
+};
+
+static void *bench_pcm_writer(void *arg) {
+
+	const struct bench_writer *w = arg;
+	const uint8_t *data = (const uint8_t *)w->pcm;
+	size_t len = w->pcm_len * sizeof(int16_t);
+	ssize_t ret;
+
+	while (len > 0) {
+		if ((ret = write(w->fd, data, MIN(len, 4096))) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return NULL;
+}
+
+static void *bench_bt_writer(void *arg) {
+
+	const struct bench_writer *w = arg;
+	size_t i;
+
+	for (i = 0; i < bench_bt_data.count; i++)
+		if (write(w->fd, bench_bt_data.packets[i].data, bench_bt_data.packets[i].len) == -1)
+			break;
+
+	return NULL;
+}
+
+static void bench_bt_data_free(void) {
+	size_t i;
+	for (i = 0; i < bench_bt_data.count; i++)
+		free(bench_bt_data.packets[i].data);
+	free(bench_bt_data.packets);
+	memset(&bench_bt_data, 0, sizeof(bench_bt_data));
+}
+
+static int bench_bt_data_add(const void *data, size_t len) {
+
+	if (bench_bt_data.count == bench_bt_data.size) {
+		size_t size = bench_bt_data.size + 1024;
+		void *tmp;
+		if ((tmp = realloc(bench_bt_data.packets, size * sizeof(*bench_bt_data.packets))) == NULL)
+			return -1;
+		bench_bt_data.packets = tmp;
+		bench_bt_data.size = size;
+	}
+
+	if ((bench_bt_data.packets[bench_bt_data.count].data = malloc(len)) == NULL)
+		return -1;
+	memcpy(bench_bt_data.packets[bench_bt_data.count].data, data, len);
+	bench_bt_data.packets[bench_bt_data.count++].len = len;
+
+	return 0;
+}
+
+/**
+ * Run single codec thread.
+ *
+ * @param c Benchmark configuration.
+ * @param encode If true, the encoder is benchmarked, otherwise the decoder.
+ * @param duration The duration of the audio in seconds.
+ * @param r Address where the result will be stored.
+ * @return On success this function returns 0. Otherwise, -1 is returned. */
+static int bench_run(const struct bench_config *c, bool encode,
+		unsigned int duration, struct bench_result *r) {
+
+	struct ba_transport t = {
+		.type = TRANSPORT_TYPE_A2DP,
+		.profile = encode ? BLUETOOTH_PROFILE_A2DP_SOURCE : BLUETOOTH_PROFILE_A2DP_SINK,
+		.codec = c->codec_id,
+		.state = TRANSPORT_ACTIVE,
+		.mtu_read = BENCH_MTU,
+		.mtu_write = BENCH_MTU,
+		.a2dp = {
+			.cconfig = (uint8_t *)&c->cconfig,
+			.cconfig_size = c->cconfig_size,
+		},
+	};
+
+	int bt_fds[2];
+	int pcm_fds[2];
+	int16_t *pcm = NULL;
+	int ret = -1;
+
+	memset(r, 0, sizeof(*r));
+
+	if ((t.sig_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+		return -1;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bt_fds) == -1)
+		goto fail_bt;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pcm_fds) == -1)
+		goto fail_pcm;
+
+	const unsigned int channels = transport_get_channels(&t);
+	const unsigned int samplerate = transport_get_sampling(&t);
+	struct bench_writer writer;
+	int fd;
+
+	if (encode) {
+		const size_t samples = (size_t)duration * samplerate * channels;
+		if ((pcm = malloc(samples * sizeof(*pcm))) == NULL)
+			goto fail;
+		snd_pcm_sine_s16le(pcm, samples, channels, 0, 1.0 / 128);
+		bench_bt_data_free();
+		t.bt_fd = bt_fds[0];
+		t.a2dp.pcm.fd = pcm_fds[1];
+		writer = (struct bench_writer){ pcm_fds[0], pcm, samples };
+		fd = bt_fds[1];
+	}
+	else {
+		t.bt_fd = bt_fds[1];
+		t.a2dp.pcm.fd = pcm_fds[0];
+		writer = (struct bench_writer){ bt_fds[0], NULL, 0 };
+		fd = pcm_fds[1];
+	}
+
+	struct bench_thread bt = { encode ? c->encoder : c->decoder, &t };
+	pthread_t thread_codec;
+	pthread_t thread_writer;
+	clockid_t clock_codec;
+	struct timespec ts0, ts;
+
+	bench_allocs = 0;
+	bench_alloc_bytes = 0;
+
+	gettimestamp(&ts0);
+	ts = ts0;
+
+	if ((errno = pthread_create(&thread_codec, NULL, bench_codec_thread, &bt)) != 0)
+		goto fail;
+	if ((errno = pthread_create(&thread_writer, NULL,
+					encode ? bench_pcm_writer : bench_bt_writer, &writer)) != 0) {
+		pthread_cancel(thread_codec);
+		pthread_join(thread_codec, NULL);
+		goto fail;
+	}
+
+	struct pollfd pfds[] = {{ fd, POLLIN, 0 }};
+	uint8_t buffer[1024 * 16];
+	size_t pcm_bytes = 0;
+	ssize_t len;
+
+	while (poll(pfds, ARRAYSIZE(pfds), BENCH_IDLE_TIMEOUT) > 0) {
+		if ((len = read(fd, buffer, sizeof(buffer))) <= 0)
+			break;
+		gettimestamp(&ts);
+		if (encode) {
+			bench_bt_data_add(buffer, len);
+			r->packets++;
+			r->bytes += len;
+		}
+		else
+			pcm_bytes += len;
+	}
+
+	pthread_join(thread_writer, NULL);
+
+	/* At this point the codec thread is idle, so its CPU time is final. */
+	if (pthread_getcpuclockid(thread_codec, &clock_codec) == 0)
+		clock_gettime(clock_codec, &r->cpu);
+
+	pthread_cancel(thread_codec);
+	pthread_join(thread_codec, NULL);
+
+	difftimespec(&ts0, &ts, &r->wall);
+	r->allocs = bench_allocs;
+	r->alloc_bytes = bench_alloc_bytes;
+
+	if (encode)
+		r->frames = writer.pcm_len / channels;
+	else {
+		size_t i;
+		r->frames = pcm_bytes / sizeof(int16_t) / channels;
+		r->packets = bench_bt_data.count;
+		for (i = 0; i < bench_bt_data.count; i++)
+			r->bytes += bench_bt_data.packets[i].len;
+	}
+
+	ret = 0;
+
+fail:
+	free(pcm);
+	close(pcm_fds[0]);
+	close(pcm_fds[1]);
+fail_pcm:
+	close(bt_fds[0]);
+	close(bt_fds[1]);
+fail_bt:
+	close(t.sig_fd);
+	return ret;
+}
+
+static double bench_timespec_to_double(const struct timespec *ts) {
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static void bench_print(const struct bench_config *c, const char *direction,
+		unsigned int samplerate, unsigned int channels, const struct bench_result *r) {
+
+	const double audio = (double)r->frames / samplerate;
+	const double wall = bench_timespec_to_double(&r->wall);
+	const double cpu = bench_timespec_to_double(&r->cpu);
+
+	printf("%s\t%s\t%s\t%u\t%u\t%.3f\t%.3f\t%.2f\t%.3f\t%u\t%zu\t%u\t%zu\n",
+			c->codec, c->label, direction, samplerate, channels,
+			audio, wall, wall > 0 ? audio / wall : 0,
+			audio > 0 ? cpu * 1000 / audio : 0,
+			r->allocs, r->alloc_bytes, r->packets, r->bytes);
+	fflush(stdout);
+
+}
+
+static void bench_config(const struct bench_config *c, unsigned int duration) {
+
+	struct ba_transport t = {
+		.type = TRANSPORT_TYPE_A2DP,
+		.codec = c->codec_id,
+		.a2dp = {
+			.cconfig = (uint8_t *)&c->cconfig,
+			.cconfig_size = c->cconfig_size,
+		},
+	};
+
+	const unsigned int channels = transport_get_channels(&t);
+	const unsigned int samplerate = transport_get_sampling(&t);
+	struct bench_result r;
+
+#if ENABLE_AAC
+	config.aac_vbr_mode = c->aac_vbr_mode;
+#endif
+#if ENABLE_LDAC
+	config.ldac_eqmid = c->ldac_eqmid;
+#endif
+
+	if (bench_run(c, true, duration, &r) == -1) {
+		fprintf(stderr, "%s %s: Couldn't run encoder: %s\n", c->codec, c->label, strerror(errno));
+		return;
+	}
+	bench_print(c, "encode", samplerate, channels, &r);
+
+	if (c->decoder == NULL)
+		return;
+
+	if (bench_run(c, false, duration, &r) == -1) {
+		fprintf(stderr, "%s %s: Couldn't run decoder: %s\n", c->codec, c->label, strerror(errno));
+		return;
+	}
+	bench_print(c, "decode", samplerate, channels, &r);
+
+}
+
+static bool bench_codec_selected(const char *codec, const char *selected) {
+	return selected == NULL || strcasecmp(codec, selected) == 0;
+}
+
+static void bench_sbc(unsigned int duration) {
+
+	static const struct {
+		uint8_t value;
+		unsigned int rate;
+	} frequencies[] = {
+		{ SBC_SAMPLING_FREQ_16000, 16000 },
+		{ SBC_SAMPLING_FREQ_32000, 32000 },
+		{ SBC_SAMPLING_FREQ_44100, 44100 },
+		{ SBC_SAMPLING_FREQ_48000, 48000 },
+	};
+	static const struct {
+		uint8_t value;
+		const char *name;
+	} modes[] = {
+		{ SBC_CHANNEL_MODE_MONO, "mono" },
+		{ SBC_CHANNEL_MODE_DUAL_CHANNEL, "dual" },
+		{ SBC_CHANNEL_MODE_STEREO, "stereo" },
+		{ SBC_CHANNEL_MODE_JOINT_STEREO, "joint" },
+	};
+	static const uint8_t bitpools[] = { 19, 35, 53 };
+
+	size_t i, ii, iii;
+	for (i = 0; i < ARRAYSIZE(frequencies); i++)
+		for (ii = 0; ii < ARRAYSIZE(modes); ii++)
+			for (iii = 0; iii < ARRAYSIZE(bitpools); iii++) {
+
+				struct bench_config c = {
+					.codec = "SBC",
+					.codec_id = A2DP_CODEC_SBC,
+					.cconfig.sbc = {
+						.frequency = frequencies[i].value,
+						.channel_mode = modes[ii].value,
+						.block_length = SBC_BLOCK_LENGTH_16,
+						.subbands = SBC_SUBBANDS_8,
+						.allocation_method = SBC_ALLOCATION_LOUDNESS,
+						.min_bitpool = SBC_MIN_BITPOOL,
+						.max_bitpool = bitpools[iii],
+					},
+					.cconfig_size = sizeof(a2dp_sbc_t),
+					.encoder = io_thread_a2dp_source_sbc,
+					.decoder = io_thread_a2dp_sink_sbc,
+				};
+
+				snprintf(c.label, sizeof(c.label), "%u/%s/bp%u",
+						frequencies[i].rate, modes[ii].name, bitpools[iii]);
+				bench_config(&c, duration);
+
+			}
+
+}
+
+#if ENABLE_AAC
+static void bench_aac(unsigned int duration) {
+
+	static const struct {
+		unsigned int rate;
+		uint16_t value;
+	} frequencies[] = {
+		{ 44100, AAC_SAMPLING_FREQ_44100 },
+		{ 48000, AAC_SAMPLING_FREQ_48000 },
+	};
+	static const struct {
+		uint8_t value;
+		const char *name;
+	} modes[] = {
+		{ AAC_CHANNELS_1, "mono" },
+		{ AAC_CHANNELS_2, "stereo" },
+	};
+
+	size_t i, ii;
+	int vbr;
+
+	for (i = 0; i < ARRAYSIZE(frequencies); i++)
+		for (ii = 0; ii < ARRAYSIZE(modes); ii++)
+			/* zero stands for the constant bit rate */
+			for (vbr = 0; vbr <= 5; vbr++) {
+
+				struct bench_config c = {
+					.codec = "AAC",
+					.codec_id = A2DP_CODEC_MPEG24,
+					.cconfig.aac = {
+						.object_type = AAC_OBJECT_TYPE_MPEG4_AAC_LC,
+						AAC_INIT_FREQUENCY(frequencies[i].value)
+						.channels = modes[ii].value,
+						.vbr = vbr != 0,
+						AAC_INIT_BITRATE(320000)
+					},
+					.cconfig_size = sizeof(a2dp_aac_t),
+					.encoder = io_thread_a2dp_source_aac,
+					.decoder = io_thread_a2dp_sink_aac,
+					.aac_vbr_mode = vbr,
+				};
+
+				if (vbr == 0)
+					snprintf(c.label, sizeof(c.label), "%u/%s/cbr",
+							frequencies[i].rate, modes[ii].name);
+				else
+					snprintf(c.label, sizeof(c.label), "%u/%s/vbr%d",
+							frequencies[i].rate, modes[ii].name, vbr);
+				bench_config(&c, duration);
+
+			}
+
+}
+#endif
+
+#if ENABLE_APTX
+static void bench_aptx(unsigned int duration) {
+
+	static const struct {
+		unsigned int rate;
+		uint8_t value;
+	} frequencies[] = {
+		{ 44100, APTX_SAMPLING_FREQ_44100 },
+		{ 48000, APTX_SAMPLING_FREQ_48000 },
+	};
+
+	size_t i;
+	for (i = 0; i < ARRAYSIZE(frequencies); i++) {
+
+		struct bench_config c = {
+			.codec = "aptX",
+			.codec_id = A2DP_CODEC_VENDOR_APTX,
+			.cconfig.aptx = {
+				.info.vendor_id = APTX_VENDOR_ID,
+				.info.codec_id = APTX_CODEC_ID,
+				.frequency = frequencies[i].value,
+				.channel_mode = APTX_CHANNEL_MODE_STEREO,
+			},
+			.cconfig_size = sizeof(a2dp_aptx_t),
+			.encoder = io_thread_a2dp_source_aptx,
+		};
+
+		snprintf(c.label, sizeof(c.label), "%u/stereo", frequencies[i].rate);
+		bench_config(&c, duration);
+
+	}
+
+}
+#endif
+
+#if ENABLE_APTX_HD
+static void bench_aptx_hd(unsigned int duration) {
+
+	static const struct {
+		unsigned int rate;
+		uint8_t value;
+	} frequencies[] = {
+		{ 44100, APTX_HD_SAMPLING_FREQ_44100 },
+		{ 48000, APTX_HD_SAMPLING_FREQ_48000 },
+	};
+
+	size_t i;
+	for (i = 0; i < ARRAYSIZE(frequencies); i++) {
+
+		struct bench_config c = {
+			.codec = "aptX-HD",
+			.codec_id = A2DP_CODEC_VENDOR_APTX_HD,
+			.cconfig.aptx_hd = {
+				.info.vendor_id = APTX_HD_VENDOR_ID,
+				.info.codec_id = APTX_HD_CODEC_ID,
+				.frequency = frequencies[i].value,
+				.channel_mode = APTX_HD_CHANNEL_MODE_STEREO,
+			},
+			.cconfig_size = sizeof(a2dp_aptx_hd_t),
+			.encoder = io_thread_a2dp_source_aptx_hd,
+		};
+
+		snprintf(c.label, sizeof(c.label), "%u/stereo", frequencies[i].rate);
+		bench_config(&c, duration);
+
+	}
+
+}
+#endif
+
+#if ENABLE_LDAC
+static void bench_ldac(unsigned int duration) {
+
+	static const struct {
+		unsigned int rate;
+		uint8_t value;
+	} frequencies[] = {
+		{ 44100, LDAC_SAMPLING_FREQ_44100 },
+		{ 48000, LDAC_SAMPLING_FREQ_48000 },
+		{ 88200, LDAC_SAMPLING_FREQ_88200 },
+		{ 96000, LDAC_SAMPLING_FREQ_96000 },
+	};
+	static const struct {
+		int value;
+		const char *name;
+	} eqmids[] = {
+		{ LDACBT_EQMID_HQ, "hq" },
+		{ LDACBT_EQMID_SQ, "sq" },
+		{ LDACBT_EQMID_MQ, "mq" },
+	};
+
+	size_t i, ii;
+	for (i = 0; i < ARRAYSIZE(frequencies); i++)
+		for (ii = 0; ii < ARRAYSIZE(eqmids); ii++) {
+
+			struct bench_config c = {
+				.codec = "LDAC",
+				.codec_id = A2DP_CODEC_VENDOR_LDAC,
+				.cconfig.ldac = {
+					.info.vendor_id = LDAC_VENDOR_ID,
+					.info.codec_id = LDAC_CODEC_ID,
+					.frequency = frequencies[i].value,
+					.channel_mode = LDAC_CHANNEL_MODE_STEREO,
+				},
+				.cconfig_size = sizeof(a2dp_ldac_t),
+				.encoder = io_thread_a2dp_source_ldac,
+				.ldac_eqmid = eqmids[ii].value,
+			};
+
+			snprintf(c.label, sizeof(c.label), "%u/stereo/%s",
+					frequencies[i].rate, eqmids[ii].name);
+			bench_config(&c, duration);
+
+		}
+
+}
+#endif
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	const char *opts = "hc:d:";
+	const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "codec", required_argument, NULL, 'c' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ 0, 0, 0, 0 },
+	};
+
+	const char *codec = NULL;
+	unsigned int duration = 10;
+
+	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h':
+			printf("Usage:\n"
+					"  %s [OPTION]...\n"
+					"\nOptions:\n"
+					"  -h, --help\t\tprint this help and exit\n"
+					"  -c, --codec=NAME\tbenchmark given codec only\n"
+					"  -d, --duration=SEC\tduration of the audio per run\n"
+					"\nOutput columns (tab separated):\n"
+					"  codec, configuration, direction, sampling rate, channels,\n"
+					"  audio time [s], wall time [s], realtime factor,\n"
+					"  CPU time per second of audio [ms], allocations,\n"
+					"  allocated bytes, BT packets, BT bytes\n",
+					argv[0]);
+			return EXIT_SUCCESS;
+		case 'c':
+			codec = optarg;
+			break;
+		case 'd':
+			if ((duration = atoi(optarg)) == 0) {
+				fprintf(stderr, "Invalid duration: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	/* do not interfere with the encoder configuration */
+	config.a2dp.abr = false;
+	config.a2dp.pipeline = false;
+	config.a2dp.jitter_buffer = 0;
+
+	printf("#codec\tconfig\tdirection\trate\tchannels\taudio\twall\trtf\tcpu_ms_per_s"
+			"\tallocs\talloc_bytes\tpackets\tbytes\n");
+
+	if (bench_codec_selected("SBC", codec))
+		bench_sbc(duration);
+#if ENABLE_AAC
+	if (bench_codec_selected("AAC", codec))
+		bench_aac(duration);
+#endif
+#if ENABLE_APTX
+	if (bench_codec_selected("aptX", codec))
+		bench_aptx(duration);
+#endif
+#if ENABLE_APTX_HD
+	if (bench_codec_selected("aptX-HD", codec))
+		bench_aptx_hd(duration);
+#endif
+#if ENABLE_LDAC
+	if (bench_codec_selected("LDAC", codec))
+		bench_ldac(duration);
+#endif
+
+	bench_bt_data_free();
+	return EXIT_SUCCESS;
+}
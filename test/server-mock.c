@@ -10,33 +10,67 @@
  * plug-ins. It should work exactly the same as the BlueALSA server. When
  * connecting to the bluealsa device, one should use "hci-mock" interface.
  *
+ * In the loopback mode, the A2DP source and sink transports are served by
+ * the real IO threads, and the BT socket of the source is connected with
+ * the BT socket of the sink. Signal written to the playback PCM is then
+ * encoded, packetized, decoded and read back from the capture PCM.
+ *
+ * In the stress mode, the given number of simulated devices is created,
+ * each of them with the A2DP source (and optionally the A2DP sink and the
+ * SCO) transport served by the real IO threads. BT sockets are connected
+ * with the simulated peers, which consume the data with the configured
+ * throughput. Concurrent controller clients exercise the control socket,
+ * and at the end the command latency and the resource usage are reported.
+ *
  */
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "inc/sine.inc"
 
 #include "../src/bluealsa.c"
+#include "../src/abr.c"
+#include "../src/capture.c"
+#include "../src/codec-cache.c"
+#include "../src/codec-lib.c"
+#include "../src/cpu-budget.c"
+#include "../src/link-history.c"
+#include "../src/mem-pool.c"
 #include "../src/at.c"
 #include "../src/ctl.c"
 #include "../src/io.h"
 #define io_thread_a2dp_sink_sbc _io_thread_a2dp_sink_sbc
 #define io_thread_a2dp_source_sbc _io_thread_a2dp_source_sbc
 #include "../src/io.c"
+#include "../src/io-engine.c"
 #undef io_thread_a2dp_sink_sbc
 #undef io_thread_a2dp_source_sbc
+#include "../src/jitter.c"
+#include "../src/resample.c"
 #include "../src/rfcomm.c"
 #define transport_acquire_bt_a2dp _transport_acquire_bt_a2dp
+#define transport_acquire_bt_a2dp_async _transport_acquire_bt_a2dp_async
 #include "../src/transport.c"
 #undef transport_acquire_bt_a2dp
+#undef transport_acquire_bt_a2dp_async
 #include "../src/utils.c"
+#include "../src/shared/ctl-client.c"
+#include "../src/shared/drift.c"
 #include "../src/shared/ffb.c"
 #include "../src/shared/log.c"
+#include "../src/shared/pcm-ring.c"
+#include "../src/shared/pcm-status.c"
 #include "../src/shared/rt.c"
 
 static const a2dp_sbc_t cconfig = {
@@ -49,6 +83,398 @@ static const a2dp_sbc_t cconfig = {
 	.max_bitpool = SBC_MAX_BITPOOL,
 };
 
+#if ENABLE_AAC
+static const a2dp_aac_t cconfig_aac = {
+	.object_type = AAC_OBJECT_TYPE_MPEG4_AAC_LC,
+	AAC_INIT_FREQUENCY(AAC_SAMPLING_FREQ_44100)
+	.channels = AAC_CHANNELS_2,
+	.vbr = 1,
+	AAC_INIT_BITRATE(0xFFFF)
+};
+#endif
+
+/* BT socket pair used in the loopback mode */
+static int loopback_fds[2] = { -1, -1 };
+static size_t loopback_mtu = 0;
+
+/**
+ * Simulated BT link used in the stress mode. The first socket of the pair
+ * is used by the transport, the second one by the simulated peer. */
+struct stress_link {
+	struct ba_transport *t;
+	int fds[2];
+	/* peer socket of the A2DP sink, which receives forwarded packets */
+	int forward_fd;
+	pthread_t thread;
+};
+
+/* controller commands measured by the stress clients */
+enum stress_command {
+	STRESS_COMMAND_LIST,
+	STRESS_COMMAND_VOLUME,
+	STRESS_COMMAND_OPEN,
+	STRESS_COMMAND_CLOSE,
+	__STRESS_COMMAND_MAX
+};
+
+static const char *stress_command_names[] = {
+	[STRESS_COMMAND_LIST] = "list",
+	[STRESS_COMMAND_VOLUME] = "volume",
+	[STRESS_COMMAND_OPEN] = "open",
+	[STRESS_COMMAND_CLOSE] = "close",
+};
+
+static struct {
+
+	unsigned int devices;
+	unsigned int clients;
+	bool sink;
+	bool sco;
+	size_t mtu;
+	/* peer throughput in bytes per second (zero means unlimited) */
+	unsigned int rate;
+
+	struct stress_link *links;
+	size_t links_len;
+
+	pthread_mutex_t mutex;
+	/* command latencies in microseconds */
+	unsigned int *latency[__STRESS_COMMAND_MAX];
+	size_t latency_len[__STRESS_COMMAND_MAX];
+	size_t latency_size[__STRESS_COMMAND_MAX];
+	unsigned int errors[__STRESS_COMMAND_MAX];
+	unsigned int events;
+	unsigned int events_lost;
+
+	volatile bool stop;
+
+} stress = {
+	.mtu = 153 * 3,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct stress_link *stress_link_lookup(const struct ba_transport *t) {
+	size_t i;
+	for (i = 0; i < stress.links_len; i++)
+		if (stress.links[i].t == t)
+			return &stress.links[i];
+	return NULL;
+}
+
+static int stress_sco_acquire(struct ba_transport *t) {
+	struct stress_link *l = stress_link_lookup(t);
+	if (t->bt_fd == -1)
+		t->bt_fd = dup(l->fds[0]);
+	return t->bt_fd;
+}
+
+static int stress_sco_release(struct ba_transport *t) {
+	if (t->bt_fd != -1)
+		close(t->bt_fd);
+	t->bt_fd = -1;
+	return 0;
+}
+
+/**
+ * Simulated BT peer.
+ *
+ * The A2DP data is consumed (or forwarded to the A2DP sink) with the given
+ * throughput, so the IO thread experiences the backpressure of a slow link.
+ * The SCO peer sends silence with the SCO packet rate, and it consumes data
+ * sent by the IO thread. */
+static void *stress_link_peer(void *arg) {
+	struct stress_link *l = (struct stress_link *)arg;
+
+	const bool sco = l->t->type == TRANSPORT_TYPE_SCO;
+	const size_t mtu = sco ? l->t->mtu_read : stress.mtu;
+	/* CVSD codec transfers 16 bytes per millisecond */
+	const int timeout = sco ? (int)mtu / 16 : -1;
+	struct pollfd pfd = { l->fds[1], POLLIN, 0 };
+	uint8_t buffer[4096] = { 0 };
+	ssize_t len;
+
+	for (;;) {
+
+		int ret;
+		if ((ret = poll(&pfd, 1, timeout)) == -1)
+			break;
+
+		if (ret == 0) {
+			/* microphone packet from the headset */
+			if (write(l->fds[1], buffer, MIN(mtu, sizeof(buffer))) == -1)
+				break;
+			continue;
+		}
+
+		if ((len = read(l->fds[1], buffer, sizeof(buffer))) <= 0)
+			break;
+
+		if (l->forward_fd != -1 &&
+				write(l->forward_fd, buffer, len) == -1)
+			debug("Couldn't forward BT packet: %s", strerror(errno));
+
+		if (stress.rate != 0)
+			usleep((uint64_t)len * 1000000 / stress.rate);
+
+	}
+
+	return NULL;
+}
+
+static struct stress_link *stress_link_new(struct ba_transport *t) {
+
+	struct stress_link *l = &stress.links[stress.links_len++];
+
+	l->t = t;
+	l->forward_fd = -1;
+	assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, l->fds) == 0);
+
+	/* The sink peer only receives forwarded packets. It is not drained, so
+	 * the IO thread of the sink is never blocked by the backpressure. */
+	if (t->profile != BLUETOOTH_PROFILE_A2DP_SINK) {
+		assert(pthread_create(&l->thread, NULL, stress_link_peer, l) == 0);
+		pthread_detach(l->thread);
+	}
+
+	return l;
+}
+
+static void stress_command_account(enum stress_command command,
+		const struct timespec *ts0, bool error) {
+
+	struct timespec ts;
+	gettimestamp(&ts);
+	difftimespec(ts0, &ts, &ts);
+
+	pthread_mutex_lock(&stress.mutex);
+
+	if (error)
+		stress.errors[command]++;
+	else {
+		if (stress.latency_len[command] == stress.latency_size[command]) {
+			size_t size = stress.latency_size[command] + 1024;
+			unsigned int *latency = realloc(stress.latency[command], size * sizeof(*latency));
+			assert(latency != NULL);
+			stress.latency[command] = latency;
+			stress.latency_size[command] = size;
+		}
+		stress.latency[command][stress.latency_len[command]++] =
+			ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	pthread_mutex_unlock(&stress.mutex);
+
+}
+
+/**
+ * Transfer PCM data for a while, so the IO thread has something to do. */
+static void stress_client_transfer(int pcm_fd, const struct ba_msg_transport *transport) {
+
+	const bool playback = transport->stream == BA_PCM_STREAM_PLAYBACK;
+	/* 10 ms of the S16_LE signal */
+	const size_t len = transport->sampling / 100 * transport->channels * sizeof(int16_t);
+	struct pollfd pfd = { pcm_fd, playback ? POLLOUT : POLLIN, 0 };
+	uint8_t buffer[4096] = { 0 };
+	size_t i;
+
+	for (i = 0; i < 10 && !stress.stop; i++) {
+		if (poll(&pfd, 1, 10) <= 0)
+			continue;
+		ssize_t ret = playback ?
+			write(pcm_fd, buffer, MIN(len, sizeof(buffer))) :
+			read(pcm_fd, buffer, sizeof(buffer));
+		if (ret <= 0)
+			break;
+		usleep(10000);
+	}
+
+}
+
+/**
+ * Controller client driving the list, volume, PCM open and close commands
+ * in a loop. Events are received on the separate subscribed connection. */
+static void *stress_client(void *arg) {
+
+	unsigned int seed = (uintptr_t)arg;
+	const char *interface = config.hci_devs[0].name;
+	struct ba_msg_transport *transports = NULL;
+	struct timespec ts0;
+	uint32_t event_seq = 0;
+	int fd, fd_events;
+
+	if ((fd = bluealsa_open(interface)) == -1 ||
+			(fd_events = bluealsa_open(interface)) == -1 ||
+			bluealsa_subscribe(fd_events, BA_EVENT_TRANSPORT_ADDED | BA_EVENT_TRANSPORT_CHANGED |
+				BA_EVENT_TRANSPORT_REMOVED | BA_EVENT_UPDATE_VOLUME | BA_EVENT_UPDATE_STATE |
+				BA_EVENT_V2) == -1) {
+		error("Couldn't connect stress client: %s", strerror(errno));
+		return NULL;
+	}
+
+	while (!stress.stop) {
+
+		struct ba_msg_event_v2 event;
+		ssize_t count;
+
+		while (recv(fd_events, &event, sizeof(event), MSG_DONTWAIT) == sizeof(event)) {
+			pthread_mutex_lock(&stress.mutex);
+			stress.events++;
+			stress.events_lost += event.seq - event_seq - 1;
+			pthread_mutex_unlock(&stress.mutex);
+			event_seq = event.seq;
+		}
+
+		free(transports);
+		transports = NULL;
+
+		gettimestamp(&ts0);
+		count = bluealsa_get_transports(fd, &transports);
+		stress_command_account(STRESS_COMMAND_LIST, &ts0, count == -1);
+		if (count <= 0) {
+			usleep(10000);
+			continue;
+		}
+
+		struct ba_msg_transport transport = transports[rand_r(&seed) % count];
+		int pcm_fd;
+
+		gettimestamp(&ts0);
+		stress_command_account(STRESS_COMMAND_VOLUME, &ts0,
+				bluealsa_set_transport_volume(fd, &transport, false, rand_r(&seed) % 128,
+					false, rand_r(&seed) % 128) == -1);
+
+		if (transport.stream == BA_PCM_STREAM_DUPLEX)
+			transport.stream = rand_r(&seed) % 2 ? BA_PCM_STREAM_PLAYBACK : BA_PCM_STREAM_CAPTURE;
+
+		/* PCM might be opened by the other client */
+		gettimestamp(&ts0);
+		pcm_fd = bluealsa_open_transport(fd, &transport);
+		stress_command_account(STRESS_COMMAND_OPEN, &ts0, pcm_fd == -1 && errno != EBUSY);
+		if (pcm_fd == -1)
+			continue;
+
+		stress_client_transfer(pcm_fd, &transport);
+
+		gettimestamp(&ts0);
+		stress_command_account(STRESS_COMMAND_CLOSE, &ts0,
+				bluealsa_close_transport(fd, &transport) == -1);
+		close(pcm_fd);
+
+	}
+
+	free(transports);
+	close(fd_events);
+	close(fd);
+	return NULL;
+}
+
+static int stress_cmp(const void *a, const void *b) {
+	const unsigned int x = *(const unsigned int *)a;
+	const unsigned int y = *(const unsigned int *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Print the value of the given field from the /proc/self/status file. */
+static void stress_print_status(const char *field) {
+
+	char line[256];
+	FILE *f;
+
+	if ((f = fopen("/proc/self/status", "r")) == NULL)
+		return;
+
+	const size_t len = strlen(field);
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (strncmp(line, field, len) == 0 && line[len] == ':') {
+			printf("%s\t%ld\n", field, strtol(&line[len + 1], NULL, 10));
+			break;
+		}
+
+	fclose(f);
+}
+
+/**
+ * Print the CPU usage of every IO thread. */
+static void stress_print_threads(double wall) {
+
+	const long ticks = sysconf(_SC_CLK_TCK);
+	struct dirent *entry;
+	char path[64];
+	char stat[512];
+	DIR *dir;
+
+	if ((dir = opendir("/proc/self/task")) == NULL)
+		return;
+
+	printf("#tid\tname\tcpu\n");
+	while ((entry = readdir(dir)) != NULL) {
+
+		unsigned long utime, stime;
+		char name[16];
+		FILE *f;
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/self/task/%s/stat", entry->d_name);
+		if ((f = fopen(path, "r")) == NULL)
+			continue;
+		if (fgets(stat, sizeof(stat), f) != NULL &&
+				sscanf(stat, "%*d (%15[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+					name, &utime, &stime) == 3 &&
+				strcmp(name, "baio") == 0)
+			printf("%s\t%s\t%.1f%%\n", entry->d_name, name,
+					100.0 * (utime + stime) / ticks / wall);
+		fclose(f);
+
+	}
+
+	closedir(dir);
+}
+
+static void stress_report(double wall) {
+
+	size_t i;
+
+	printf("#command\tcount\terrors\tmean_us\tp50_us\tp99_us\tmax_us\n");
+	for (i = 0; i < __STRESS_COMMAND_MAX; i++) {
+
+		unsigned int *latency = stress.latency[i];
+		const size_t count = stress.latency_len[i];
+		unsigned long long sum = 0;
+		size_t j;
+
+		qsort(latency, count, sizeof(*latency), stress_cmp);
+		for (j = 0; j < count; j++)
+			sum += latency[j];
+
+		printf("%s\t%zu\t%u\t%llu\t%u\t%u\t%u\n", stress_command_names[i],
+				count, stress.errors[i], count ? sum / count : 0,
+				count ? latency[(count - 1) * 50 / 100] : 0,
+				count ? latency[(count - 1) * 99 / 100] : 0,
+				count ? latency[count - 1] : 0);
+
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	const double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+	printf("#resource\tvalue\n");
+	printf("events\t%u\n", stress.events);
+	printf("events_lost\t%u\n", stress.events_lost);
+	stress_print_status("Threads");
+	stress_print_status("VmRSS");
+	printf("cpu\t%.1f%%\n", 100.0 * cpu / wall);
+	if (stress.links_len > 0)
+		printf("cpu_per_stream\t%.1f%%\n", 100.0 * cpu / wall / stress.links_len);
+
+	stress_print_threads(wall);
+
+}
+
 static void test_pcm_setup_free(void) {
 	bluealsa_ctl_free();
 	bluealsa_config_free();
@@ -79,14 +505,35 @@ static void test_sigusr_handler(int sig) {
 }
 
 int transport_acquire_bt_a2dp(struct ba_transport *t) {
+	struct stress_link *l;
+	if (loopback_fds[0] != -1 && t->bt_fd == -1) {
+		/* socket is duplicated, because it is closed upon release */
+		const bool source = t->profile == BLUETOOTH_PROFILE_A2DP_SOURCE;
+		assert((t->bt_fd = dup(loopback_fds[source ? 0 : 1])) != -1);
+		t->mtu_read = t->mtu_write = loopback_mtu;
+	}
+	if ((l = stress_link_lookup(t)) != NULL && t->bt_fd == -1) {
+		assert((t->bt_fd = dup(l->fds[0])) != -1);
+		t->mtu_read = t->mtu_write = stress.mtu;
+	}
 	t->delay = 1; /* suppress delay check trigger */
 	t->state = TRANSPORT_ACTIVE;
 	assert(io_thread_create(t) == 0);
 	return 0;
 }
 
+int transport_acquire_bt_a2dp_async(struct ba_transport *t,
+		transport_acquire_cb callback, void *userdata) {
+	callback(t, transport_acquire_bt_a2dp(t), userdata);
+	return 0;
+}
+
 void *io_thread_a2dp_sink_sbc(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
+
+	if (loopback_fds[0] != -1 || stress.devices > 0)
+		return _io_thread_a2dp_sink_sbc(arg);
+
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
 
 	struct asrsync asrs = { .frames = 0 };
@@ -120,6 +567,10 @@ void *io_thread_a2dp_sink_sbc(void *arg) {
 
 void *io_thread_a2dp_source_sbc(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
+
+	if (loopback_fds[0] != -1 || stress.devices > 0)
+		return _io_thread_a2dp_source_sbc(arg);
+
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
 
 	struct asrsync asrs = { .frames = 0 };
@@ -156,6 +607,13 @@ int main(int argc, char *argv[]) {
 		{ "timeout", required_argument, NULL, 't' },
 		{ "source", no_argument, NULL, 1 },
 		{ "sink", no_argument, NULL, 2 },
+		{ "loopback", required_argument, NULL, 3 },
+		{ "stress", required_argument, NULL, 4 },
+		{ "stress-clients", required_argument, NULL, 5 },
+		{ "stress-mtu", required_argument, NULL, 6 },
+		{ "stress-rate", required_argument, NULL, 7 },
+		{ "stress-sink", no_argument, NULL, 8 },
+		{ "stress-sco", no_argument, NULL, 9 },
 		{ 0, 0, 0, 0 },
 	};
 
@@ -163,11 +621,15 @@ int main(int argc, char *argv[]) {
 	unsigned int timeout = 5;
 	bool source = false;
 	bool sink = false;
+	const char *loopback = NULL;
 
 	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
 		switch (opt) {
 		case 'h':
-			printf("usage: %s [--source] [--sink] [--device HCI] [--timeout SEC]\n", argv[0]);
+			printf("usage: %s [--source] [--sink] [--loopback CODEC] [--device HCI] [--timeout SEC]\n"
+					"       %s --stress NUM [--stress-clients NUM] [--stress-mtu BYTES]\n"
+					"          [--stress-rate BYTES] [--stress-sink] [--stress-sco]\n",
+					argv[0], argv[0]);
 			return EXIT_SUCCESS;
 		case 1:
 			source = true;
@@ -175,6 +637,27 @@ int main(int argc, char *argv[]) {
 		case 2:
 			sink = true;
 			break;
+		case 3:
+			loopback = optarg;
+			break;
+		case 4:
+			stress.devices = atoi(optarg);
+			break;
+		case 5:
+			stress.clients = atoi(optarg);
+			break;
+		case 6:
+			stress.mtu = atoi(optarg);
+			break;
+		case 7:
+			stress.rate = atoi(optarg);
+			break;
+		case 8:
+			stress.sink = true;
+			break;
+		case 9:
+			stress.sco = true;
+			break;
 		case 'i':
 			device = optarg;
 			break;
@@ -187,7 +670,8 @@ int main(int argc, char *argv[]) {
 		}
 
 	/* emulate dummy test HCI device */
-	strncpy(config.hci_dev.name, device, sizeof(config.hci_dev.name) - 1);
+	strncpy(config.hci_devs[0].name, device, sizeof(config.hci_devs[0].name) - 1);
+	config.hci_devs_len = 1;
 
 	assert(bluealsa_config_init() == 0);
 	assert(bluealsa_ctl_thread_init() == 0);
@@ -228,6 +712,38 @@ int main(int argc, char *argv[]) {
 					A2DP_CODEC_SBC, (uint8_t *)&cconfig, sizeof(cconfig)) != NULL);
 	}
 
+	if (loopback != NULL) {
+
+		uint16_t codec = A2DP_CODEC_SBC;
+		const uint8_t *codec_config = (uint8_t *)&cconfig;
+		size_t codec_config_size = sizeof(cconfig);
+
+		if (strcasecmp(loopback, "sbc") == 0)
+			loopback_mtu = 153 * 3;
+#if ENABLE_AAC
+		else if (strcasecmp(loopback, "aac") == 0) {
+			codec = A2DP_CODEC_MPEG24;
+			codec_config = (uint8_t *)&cconfig_aac;
+			codec_config_size = sizeof(cconfig_aac);
+			loopback_mtu = 672;
+		}
+#endif
+		else {
+			fprintf(stderr, "Unsupported loopback codec: %s\n", loopback);
+			return EXIT_FAILURE;
+		}
+
+		assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, loopback_fds) == 0);
+
+		struct ba_transport *t;
+		assert(transport_new_a2dp(d1, ":test", "/source/1", BLUETOOTH_PROFILE_A2DP_SOURCE,
+					codec, codec_config, codec_config_size) != NULL);
+		assert((t = transport_new_a2dp(d1, ":test", "/sink/1", BLUETOOTH_PROFILE_A2DP_SINK,
+						codec, codec_config, codec_config_size)) != NULL);
+		assert(transport_acquire_bt_a2dp(t) == 0);
+
+	}
+
 	if (sink) {
 		struct ba_transport *t;
 		assert((t = transport_new_a2dp(d1, ":test", "/sink/1", BLUETOOTH_PROFILE_A2DP_SINK,
@@ -238,8 +754,82 @@ int main(int argc, char *argv[]) {
 		assert(transport_acquire_bt_a2dp(t) == 0);
 	}
 
+	pthread_t *clients = NULL;
+	struct timespec ts0;
+	size_t i;
+
+	if (stress.devices > 0) {
+
+		assert((stress.links = calloc(stress.devices * 3, sizeof(*stress.links))) != NULL);
+		assert((clients = calloc(stress.clients, sizeof(*clients))) != NULL);
+
+		for (i = 0; i < stress.devices; i++) {
+
+			struct ba_device *d;
+			struct ba_transport *t;
+			struct stress_link *l;
+			char path[64];
+
+			sprintf(path, "00:00:00:00:%02zX:%02zX", i >> 8, i & 0xFF);
+			str2ba(path, &addr);
+			sprintf(path, "Stress Device %zu", i);
+			assert((d = device_new(1, &addr, path)) != NULL);
+			sprintf(path, "/stress/%zu", i);
+			g_hash_table_insert(config.devices, g_strdup(path), d);
+
+			sprintf(path, "/stress/%zu/source", i);
+			assert((t = transport_new_a2dp(d, ":test", path, BLUETOOTH_PROFILE_A2DP_SOURCE,
+							A2DP_CODEC_SBC, (uint8_t *)&cconfig, sizeof(cconfig))) != NULL);
+			l = stress_link_new(t);
+
+			if (stress.sink) {
+				sprintf(path, "/stress/%zu/sink", i);
+				assert((t = transport_new_a2dp(d, ":test", path, BLUETOOTH_PROFILE_A2DP_SINK,
+								A2DP_CODEC_SBC, (uint8_t *)&cconfig, sizeof(cconfig))) != NULL);
+				l->forward_fd = stress_link_new(t)->fds[1];
+				assert(transport_acquire_bt_a2dp(t) == 0);
+			}
+
+			if (stress.sco) {
+				/* SCO transport without the RFCOMM, the same as for oFono */
+				sprintf(path, "/stress/%zu/sco", i);
+				assert((t = transport_new(d, TRANSPORT_TYPE_SCO, ":test", path,
+								BLUETOOTH_PROFILE_HSP_AG, HFP_CODEC_CVSD)) != NULL);
+				transport_sco_init(t);
+				t->mtu_read = t->mtu_write = 48;
+				t->sco.is_ofono = true;
+				t->sco.acquire = stress_sco_acquire;
+				t->sco.release = stress_sco_release;
+				stress_link_new(t);
+				transport_set_state(t, TRANSPORT_ACTIVE);
+			}
+
+		}
+
+		for (i = 0; i < stress.clients; i++)
+			assert(pthread_create(&clients[i], NULL, stress_client, (void *)(i + 1)) == 0);
+
+	}
+
+	gettimestamp(&ts0);
+
 	while (timeout != 0 && main_loop_on)
 		timeout = sleep(timeout);
 
+	if (stress.devices > 0) {
+
+		stress.stop = true;
+		for (i = 0; i < stress.clients; i++)
+			pthread_join(clients[i], NULL);
+
+		struct timespec ts;
+		gettimestamp(&ts);
+		difftimespec(&ts0, &ts, &ts);
+		stress_report(ts.tv_sec + ts.tv_nsec / 1e9);
+
+		free(clients);
+
+	}
+
 	return EXIT_SUCCESS;
 }
@@ -8,11 +8,33 @@
  *
  */
 
+#include <stdlib.h>
+
 #include <check.h>
 
 #include "../src/at.c"
+#include "../src/shared/ffb.c"
 #include "../src/shared/log.c"
 
+static struct at_tokenizer tok;
+
+static void tokenizer_setup(void) {
+	ck_assert_int_eq(at_tokenizer_init(&tok), 0);
+}
+
+static void tokenizer_teardown(void) {
+	at_tokenizer_free(&tok);
+}
+
+/**
+ * Parse single AT message with a fresh tokenizer. */
+static int at_parse(const char *str, struct bt_at *at) {
+	tokenizer_teardown();
+	tokenizer_setup();
+	ck_assert_int_eq(at_tokenizer_feed(&tok, str, strlen(str)), 0);
+	return at_tokenizer_next(&tok, at);
+}
+
 START_TEST(test_at_build) {
 
 	char buffer[256];
@@ -35,16 +57,18 @@ START_TEST(test_at_build) {
 START_TEST(test_at_parse_invalid) {
 	struct bt_at at;
 	/* invalid AT command lines */
-	ck_assert_ptr_eq(at_parse("ABC\r", &at), NULL);
-	ck_assert_ptr_eq(at_parse("AT+CLCK?", &at), NULL);
-	ck_assert_ptr_eq(at_parse("\r\r", &at), NULL);
-	ck_assert_ptr_eq(at_parse("\r\nOK", &at), NULL);
+	ck_assert_int_eq(at_parse("ABC\r", &at), -1);
+	ck_assert_int_eq(errno, EBADMSG);
+	ck_assert_str_eq(at.command, "ABC");
+	ck_assert_int_eq(at_parse("AT+CLCK?", &at), 0);
+	ck_assert_int_eq(at_parse("\r\r", &at), 0);
+	ck_assert_int_eq(at_parse("\r\nOK", &at), 0);
 } END_TEST
 
 START_TEST(test_at_parse_cmd) {
 	struct bt_at at;
 	/* parse AT plain command */
-	ck_assert_ptr_ne(at_parse("AT+CLCC\r", &at), NULL);
+	ck_assert_int_eq(at_parse("AT+CLCC\r", &at), 1);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD);
 	ck_assert_str_eq(at.command, "+CLCC");
 	ck_assert_ptr_eq(at.value, NULL);
@@ -53,7 +77,7 @@ START_TEST(test_at_parse_cmd) {
 START_TEST(test_at_parse_cmd_get) {
 	struct bt_at at;
 	/* parse AT GET command */
-	ck_assert_ptr_ne(at_parse("AT+COPS?\r", &at), NULL);
+	ck_assert_int_eq(at_parse("AT+COPS?\r", &at), 1);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD_GET);
 	ck_assert_str_eq(at.command, "+COPS");
 	ck_assert_ptr_eq(at.value, NULL);
@@ -62,7 +86,7 @@ START_TEST(test_at_parse_cmd_get) {
 START_TEST(test_at_parse_cmd_set) {
 	struct bt_at at;
 	/* parse AT SET command */
-	ck_assert_ptr_ne(at_parse("AT+CLCK=\"SC\",0,\"1234\"\r", &at), NULL);
+	ck_assert_int_eq(at_parse("AT+CLCK=\"SC\",0,\"1234\"\r", &at), 1);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD_SET);
 	ck_assert_str_eq(at.command, "+CLCK");
 	ck_assert_str_eq(at.value, "\"SC\",0,\"1234\"");
@@ -71,7 +95,7 @@ START_TEST(test_at_parse_cmd_set) {
 START_TEST(test_at_parse_cmd_test) {
 	struct bt_at at;
 	/* parse AT TEST command */
-	ck_assert_ptr_ne(at_parse("AT+COPS=?\r", &at), NULL);
+	ck_assert_int_eq(at_parse("AT+COPS=?\r", &at), 1);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD_TEST);
 	ck_assert_str_eq(at.command, "+COPS");
 	ck_assert_ptr_eq(at.value, NULL);
@@ -80,7 +104,7 @@ START_TEST(test_at_parse_cmd_test) {
 START_TEST(test_at_parse_resp) {
 	struct bt_at at;
 	/* parse response result code */
-	ck_assert_ptr_ne(at_parse("\r\n+CIND:0,0,1,4,0,4,0\r\n", &at), NULL);
+	ck_assert_int_eq(at_parse("\r\n+CIND:0,0,1,4,0,4,0\r\n", &at), 1);
 	ck_assert_int_eq(at.type, AT_TYPE_RESP);
 	ck_assert_str_eq(at.command, "+CIND");
 	ck_assert_str_eq(at.value, "0,0,1,4,0,4,0");
@@ -89,7 +113,7 @@ START_TEST(test_at_parse_resp) {
 START_TEST(test_at_parse_resp_empty) {
 	struct bt_at at;
 	/* parse response result code with empty value */
-	ck_assert_ptr_ne(at_parse("\r\n+CIND:\r\n", &at), NULL);
+	ck_assert_int_eq(at_parse("\r\n+CIND:\r\n", &at), 1);
 	ck_assert_int_eq(at.type, AT_TYPE_RESP);
 	ck_assert_str_eq(at.command, "+CIND");
 	ck_assert_str_eq(at.value, "");
@@ -98,7 +122,7 @@ START_TEST(test_at_parse_resp_empty) {
 START_TEST(test_at_parse_resp_unsolicited) {
 	struct bt_at at;
 	/* parse unsolicited result code */
-	ck_assert_ptr_ne(at_parse("\r\nRING\r\n", &at), NULL);
+	ck_assert_int_eq(at_parse("\r\nRING\r\n", &at), 1);
 	ck_assert_int_eq(at.type, AT_TYPE_RESP);
 	ck_assert_str_eq(at.command, "");
 	ck_assert_str_eq(at.value, "RING");
@@ -107,7 +131,7 @@ START_TEST(test_at_parse_resp_unsolicited) {
 START_TEST(test_at_parse_case_sensitivity) {
 	struct bt_at at;
 	/* case-insensitive command and case-sensitive value */
-	ck_assert_ptr_ne(at_parse("aT+tEsT=VaLuE\r", &at), NULL);
+	ck_assert_int_eq(at_parse("aT+tEsT=VaLuE\r", &at), 1);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD_SET);
 	ck_assert_str_eq(at.command, "+TEST");
 	ck_assert_str_eq(at.value, "VaLuE");
@@ -117,10 +141,126 @@ START_TEST(test_at_parse_multiple_cmds) {
 	struct bt_at at;
 	/* concatenated commands */
 	const char *cmd = "\r\nOK\r\n\r\n+COPS:1\r\n";
-	ck_assert_str_eq(at_parse(cmd, &at), &cmd[6]);
+	ck_assert_int_eq(at_parse(cmd, &at), 1);
 	ck_assert_int_eq(at.type, AT_TYPE_RESP);
 	ck_assert_str_eq(at.command, "");
 	ck_assert_str_eq(at.value, "OK");
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), 1);
+	ck_assert_int_eq(at.type, AT_TYPE_RESP);
+	ck_assert_str_eq(at.command, "+COPS");
+	ck_assert_str_eq(at.value, "1");
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), 0);
+} END_TEST
+
+START_TEST(test_at_tokenizer_partial) {
+	struct bt_at at;
+
+	/* command split across several reads */
+	ck_assert_int_eq(at_parse("AT+CI", &at), 0);
+	ck_assert_int_eq(at_tokenizer_feed(&tok, "ND=", 3), 0);
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), 0);
+	ck_assert_int_eq(at_tokenizer_feed(&tok, "?\rAT+B", 6), 0);
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), 1);
+	ck_assert_int_eq(at.type, AT_TYPE_CMD_TEST);
+	ck_assert_str_eq(at.command, "+CIND");
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), 0);
+	ck_assert_int_eq(at_tokenizer_feed(&tok, "IA=0,1\r", 7), 0);
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), 1);
+	ck_assert_int_eq(at.type, AT_TYPE_CMD_SET);
+	ck_assert_str_eq(at.command, "+BIA");
+	ck_assert_str_eq(at.value, "0,1");
+
+	/* response with the trailing <LF> received later */
+	ck_assert_int_eq(at_parse("\r\nOK\r", &at), 1);
+	ck_assert_str_eq(at.value, "OK");
+	ck_assert_int_eq(at_tokenizer_feed(&tok, "\nAT+CLCC\r", 9), 0);
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), 1);
+	ck_assert_int_eq(at.type, AT_TYPE_CMD);
+	ck_assert_str_eq(at.command, "+CLCC");
+
+} END_TEST
+
+START_TEST(test_at_tokenizer_overflow) {
+
+	char buffer[AT_TOKENIZER_BUFFER_SIZE];
+	struct bt_at at;
+
+	memset(buffer, 'A', sizeof(buffer));
+
+	/* message which does not fit into the buffer is discarded */
+	ck_assert_int_eq(at_parse("AT+XXX=", &at), 0);
+	ck_assert_int_eq(at_tokenizer_feed(&tok, buffer, ffb_len_in(&tok.buffer)), 0);
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), -1);
+	ck_assert_int_eq(errno, EBADMSG);
+
+	/* invalid message does not break the stream */
+	ck_assert_int_eq(at_tokenizer_feed(&tok, "X\rAT+COPS?\r", 12), 0);
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), -1);
+	ck_assert_int_eq(at_tokenizer_next(&tok, &at), 1);
+	ck_assert_int_eq(at.type, AT_TYPE_CMD_GET);
+	ck_assert_str_eq(at.command, "+COPS");
+
+} END_TEST
+
+START_TEST(test_at_tokenizer_fuzz) {
+
+	static const char stream[] =
+		"AT+BRSF=191\rAT+BAC=1,2\rAT+CIND=?\rAT+CIND?\rAT+CMER=3,0,0,1\r"
+		"\r\n+CIND:0,0,1,4,0,4,0\r\n\r\nOK\r\n\r\nRING\r\n"
+		"AT+BIA=0,0,0,1,1,1,0\rAT+XAPL=ABCD-1234-0100,10\rAT+CHLD=?\r";
+	static const struct {
+		enum bt_at_type type;
+		const char *command;
+		const char *value;
+	} messages[] = {
+		{ AT_TYPE_CMD_SET, "+BRSF", "191" },
+		{ AT_TYPE_CMD_SET, "+BAC", "1,2" },
+		{ AT_TYPE_CMD_TEST, "+CIND", NULL },
+		{ AT_TYPE_CMD_GET, "+CIND", NULL },
+		{ AT_TYPE_CMD_SET, "+CMER", "3,0,0,1" },
+		{ AT_TYPE_RESP, "+CIND", "0,0,1,4,0,4,0" },
+		{ AT_TYPE_RESP, "", "OK" },
+		{ AT_TYPE_RESP, "", "RING" },
+		{ AT_TYPE_CMD_SET, "+BIA", "0,0,0,1,1,1,0" },
+		{ AT_TYPE_CMD_SET, "+XAPL", "ABCD-1234-0100,10" },
+		{ AT_TYPE_CMD_TEST, "+CHLD", NULL },
+	};
+
+	unsigned int seed = 0xB1A5;
+	size_t i, ii;
+
+	/* Feed the same stream of pipelined messages split at random positions
+	 * many times in a row - parsed messages shall not depend on splits. */
+	for (i = ii = 0; i < 500; i++) {
+
+		size_t offset = 0;
+		while (offset < sizeof(stream) - 1) {
+
+			size_t len = rand_r(&seed) % 24 + 1;
+			if (len > sizeof(stream) - 1 - offset)
+				len = sizeof(stream) - 1 - offset;
+
+			ck_assert_int_eq(at_tokenizer_feed(&tok, &stream[offset], len), 0);
+			offset += len;
+
+			struct bt_at at;
+			while (at_tokenizer_next(&tok, &at) == 1) {
+				ck_assert_int_eq(at.type, messages[ii].type);
+				ck_assert_str_eq(at.command, messages[ii].command);
+				if (messages[ii].value == NULL)
+					ck_assert_ptr_eq(at.value, NULL);
+				else
+					ck_assert_str_eq(at.value, messages[ii].value);
+				ii = (ii + 1) % ARRAYSIZE(messages);
+			}
+
+		}
+
+	}
+
+	ck_assert_int_eq(ii, 0);
+	ck_assert_int_eq(ffb_len_out(&tok.buffer), 0);
+
 } END_TEST
 
 START_TEST(test_at_parse_cind) {
@@ -150,6 +290,7 @@ int main(void) {
 	SRunner *sr = srunner_create(s);
 
 	suite_add_tcase(s, tc);
+	tcase_add_checked_fixture(tc, tokenizer_setup, tokenizer_teardown);
 
 	tcase_add_test(tc, test_at_build);
 	tcase_add_test(tc, test_at_parse_invalid);
@@ -162,6 +303,9 @@ int main(void) {
 	tcase_add_test(tc, test_at_parse_resp_unsolicited);
 	tcase_add_test(tc, test_at_parse_case_sensitivity);
 	tcase_add_test(tc, test_at_parse_multiple_cmds);
+	tcase_add_test(tc, test_at_tokenizer_partial);
+	tcase_add_test(tc, test_at_tokenizer_overflow);
+	tcase_add_test(tc, test_at_tokenizer_fuzz);
 	tcase_add_test(tc, test_at_parse_cind);
 
 	srunner_run_all(sr, CK_ENV);
@@ -14,15 +14,28 @@
 #include <check.h>
 
 #include "inc/sine.inc"
+#include "../src/abr.c"
+#include "../src/capture.c"
+#include "../src/codec-cache.c"
+#include "../src/codec-lib.c"
+#include "../src/cpu-budget.c"
+#include "../src/link-history.c"
+#include "../src/mem-pool.c"
 #include "../src/at.c"
 #include "../src/bluealsa.c"
 #include "../src/ctl.c"
 #include "../src/io.c"
+#include "../src/io-engine.c"
+#include "../src/jitter.c"
+#include "../src/resample.c"
 #include "../src/rfcomm.c"
 #include "../src/transport.c"
 #include "../src/utils.c"
+#include "../src/shared/drift.c"
 #include "../src/shared/ffb.c"
 #include "../src/shared/log.c"
+#include "../src/shared/pcm-ring.c"
+#include "../src/shared/pcm-status.c"
 #include "../src/shared/rt.c"
 
 static const a2dp_sbc_t config_sbc_44100_stereo = {
@@ -50,6 +63,13 @@ static const a2dp_aptx_t config_aptx_44100_stereo = {
 	.channel_mode = APTX_CHANNEL_MODE_STEREO,
 };
 
+static const a2dp_aptx_hd_t config_aptx_hd_44100_stereo = {
+	.info.vendor_id = APTX_HD_VENDOR_ID,
+	.info.codec_id = APTX_HD_CODEC_ID,
+	.frequency = APTX_HD_SAMPLING_FREQ_44100,
+	.channel_mode = APTX_HD_CHANNEL_MODE_STEREO,
+};
+
 static const a2dp_ldac_t config_ldac_44100_stereo = {
 	.info.vendor_id = LDAC_VENDOR_ID,
 	.info.codec_id = LDAC_CODEC_ID,
@@ -157,6 +177,293 @@ static void test_a2dp_decoding(struct ba_transport *t, void *(*cb)(void *)) {
 	close(bt_fds[0]);
 }
 
+START_TEST(test_transport_cmdq) {
+
+	struct ba_transport transport = { 0 };
+	struct ba_transport_cmd cmd;
+	size_t i;
+
+	ck_assert_int_ne(transport.sig_fd = eventfd(0, EFD_NONBLOCK), -1);
+
+	struct pollfd pfds[] = {{ transport.sig_fd, POLLIN, 0 }};
+	ck_assert_int_eq(poll(pfds, ARRAYSIZE(pfds), 0), 0);
+
+	cmd = (struct ba_transport_cmd){ .sig = TRANSPORT_PCM_OPEN,
+		.reconfig = { .format_valid = true, .format = BA_PCM_FORMAT_S24_3LE } };
+	ck_assert_int_eq(transport_send_command(&transport, &cmd), 0);
+	ck_assert_int_eq(transport_send_rfcomm(&transport, "AT+TEST"), 0);
+	cmd = (struct ba_transport_cmd){ .sig = TRANSPORT_SET_VOLUME, .volume = { 0, 1, 10, 15 } };
+	ck_assert_int_eq(transport_send_command(&transport, &cmd), 0);
+
+	/* all commands are delivered within a single wake-up - the state ones
+	 * first, then the ordered ones */
+	ck_assert_int_eq(poll(pfds, ARRAYSIZE(pfds), 0), 1);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_PCM_OPEN);
+	ck_assert_int_eq(cmd.reconfig.format_valid, true);
+	ck_assert_int_eq(cmd.reconfig.format, BA_PCM_FORMAT_S24_3LE);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_SET_VOLUME);
+	ck_assert_int_eq(cmd.volume.ch2_muted, 1);
+	ck_assert_int_eq(cmd.volume.ch2_volume, 15);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_SEND_RFCOMM);
+	ck_assert_str_eq(cmd.rfcomm, "AT+TEST");
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), false);
+	ck_assert_int_eq(poll(pfds, ARRAYSIZE(pfds), 0), 0);
+
+	/* state commands are coalesced, so they are never lost */
+	for (i = 0; i < 2 * TRANSPORT_CMDQ_SIZE; i++) {
+		cmd = (struct ba_transport_cmd){ .sig = TRANSPORT_SET_VOLUME, .volume = { 0, 0, i, i } };
+		ck_assert_int_eq(transport_send_command(&transport, &cmd), 0);
+	}
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_SET_VOLUME);
+	ck_assert_int_eq(cmd.volume.ch1_volume, 2 * TRANSPORT_CMDQ_SIZE - 1);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), false);
+
+	/* the close cancels the pending open, but not the other way around */
+	ck_assert_int_eq(transport_send_signal(&transport, TRANSPORT_PCM_OPEN), 0);
+	ck_assert_int_eq(transport_send_signal(&transport, TRANSPORT_PCM_CLOSE), 0);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_PCM_CLOSE);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), false);
+	ck_assert_int_eq(transport_send_signal(&transport, TRANSPORT_PCM_CLOSE), 0);
+	ck_assert_int_eq(transport_send_signal(&transport, TRANSPORT_PCM_OPEN), 0);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_PCM_CLOSE);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_PCM_OPEN);
+	ck_assert_int_eq(cmd.reconfig.format_valid, false);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), false);
+
+	/* commands not dispatched upon handover are passed to the next receiver */
+	ck_assert_int_eq(transport_send_signal(&transport, TRANSPORT_PCM_OPEN), 0);
+	ck_assert_int_eq(transport_send_signal(&transport, TRANSPORT_PCM_PAUSE), 0);
+	cmd = (struct ba_transport_cmd){ .sig = TRANSPORT_SET_VOLUME, .volume = { 0, 0, 5, 5 } };
+	ck_assert_int_eq(transport_send_command(&transport, &cmd), 0);
+	ck_assert_int_eq(transport_send_rfcomm(&transport, "AT+NEXT"), 0);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_PCM_OPEN);
+	transport_forward_commands(&transport);
+	ck_assert_int_eq(transport_send_signal(&transport, TRANSPORT_PCM_RESUME), 0);
+	ck_assert_int_eq(poll(pfds, ARRAYSIZE(pfds), 0), 1);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_PCM_RESUME);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_SET_VOLUME);
+	ck_assert_int_eq(cmd.volume.ch1_volume, 5);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_SEND_RFCOMM);
+	ck_assert_str_eq(cmd.rfcomm, "AT+NEXT");
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), false);
+
+	/* ordered queue overrun */
+	for (i = 0; i < 2; i++) {
+		size_t j;
+		for (j = 0; j < TRANSPORT_CMDQ_SIZE; j++)
+			ck_assert_int_eq(transport_send_rfcomm(&transport, "AT"), 0);
+		ck_assert_int_eq(transport_send_rfcomm(&transport, "AT"), -1);
+		ck_assert_int_eq(errno, EAGAIN);
+		for (j = 0; j < TRANSPORT_CMDQ_SIZE; j++)
+			ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+		ck_assert_int_eq(transport_recv_command(&transport, &cmd), false);
+	}
+
+	close(transport.sig_fd);
+
+} END_TEST
+
+static void *test_transport_cmdq_ack_thread(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+	struct pollfd pfds[] = {{ t->sig_fd, POLLIN, 0 }};
+	struct ba_transport_cmd cmd;
+	bool closed = false;
+	while (!closed && poll(pfds, ARRAYSIZE(pfds), 1000) > 0)
+		while (transport_recv_command(t, &cmd))
+			if (cmd.sig == TRANSPORT_PCM_CLOSE)
+				closed = true;
+	return NULL;
+}
+
+START_TEST(test_transport_cmdq_ack) {
+
+	struct ba_transport transport = { 0 };
+	struct ba_transport_cmd cmd = { .sig = TRANSPORT_PCM_CLOSE };
+
+	ck_assert_int_ne(transport.sig_fd = eventfd(0, EFD_NONBLOCK), -1);
+
+	/* there is no IO thread, so there is nothing to wait for */
+	transport.thread = config.main_thread;
+	ck_assert_int_eq(transport_send_command_sync(&transport, &cmd), 0);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), false);
+
+	/* IO thread which does not dispatch commands */
+	transport.thread = pthread_self();
+	ck_assert_int_eq(transport_send_command_sync(&transport, &cmd), -1);
+	ck_assert_int_eq(errno, ETIMEDOUT);
+	while (transport_recv_command(&transport, &cmd))
+		continue;
+
+	/* the command is acknowledged once the IO thread has dispatched it */
+	ck_assert_int_eq(pthread_create(&transport.thread, NULL,
+				test_transport_cmdq_ack_thread, &transport), 0);
+	ck_assert_int_eq(transport_send_command_sync(&transport, &cmd), 0);
+	ck_assert_int_eq(pthread_join(transport.thread, NULL), 0);
+
+	close(transport.sig_fd);
+
+} END_TEST
+
+START_TEST(test_transport_pcm_drain) {
+
+	struct ba_transport transport = {
+		.type = TRANSPORT_TYPE_A2DP,
+		.profile = BLUETOOTH_PROFILE_A2DP_SOURCE,
+		.state = TRANSPORT_ACTIVE,
+	};
+	struct ba_transport_cmd cmd;
+	enum ba_event event;
+
+	ck_assert_int_ne(transport.sig_fd = eventfd(0, EFD_NONBLOCK), -1);
+	ck_assert_int_eq(pipe(config.ctl.evt), 0);
+
+	/* drain request is not blocking, and it is pending for the IO thread
+	 * once the drain command has been received */
+	ck_assert_int_eq(transport_drain_pcm(&transport), 1);
+	ck_assert_int_eq(transport_pcm_drain_pending(&transport.a2dp.pcm), false);
+	ck_assert_int_eq(transport_recv_command(&transport, &cmd), true);
+	ck_assert_int_eq(cmd.sig, TRANSPORT_PCM_SYNC);
+	ck_assert_int_eq(cmd.drain.token, 1);
+	ck_assert_int_eq(transport_pcm_drain_pending(&transport.a2dp.pcm), true);
+
+	/* controller is notified about the drain completion only once */
+	transport_pcm_drained(&transport.a2dp.pcm);
+	transport_pcm_drained(&transport.a2dp.pcm);
+	ck_assert_int_eq(transport_pcm_drain_pending(&transport.a2dp.pcm), false);
+	ck_assert_int_eq(transport.a2dp.pcm.drain, BA_PCM_DRAIN_DONE);
+	ck_assert_int_eq(read(config.ctl.evt[0], &event, sizeof(event)), sizeof(event));
+	ck_assert_int_eq(event, 0);
+	struct pollfd pfds[] = {{ config.ctl.evt[0], POLLIN, 0 }};
+	ck_assert_int_eq(poll(pfds, ARRAYSIZE(pfds), 0), 0);
+
+	/* there is nothing to drain for the inactive transport */
+	transport.state = TRANSPORT_PAUSED;
+	ck_assert_int_eq(transport_drain_pcm(&transport), 0);
+
+	close(config.ctl.evt[0]);
+	close(config.ctl.evt[1]);
+	config.ctl.evt[0] = config.ctl.evt[1] = -1;
+	close(transport.sig_fd);
+
+} END_TEST
+
+START_TEST(test_pcm_write_nonblock) {
+
+	struct ba_transport transport = { .type = TRANSPORT_TYPE_A2DP };
+	struct ba_pcm *pcm = &transport.a2dp.pcm;
+	int16_t buffer[1024] = { 0 };
+	int pipefd[2];
+	size_t i;
+	int len;
+
+	ck_assert_int_eq(pipe2(pipefd, O_NONBLOCK), 0);
+	pcm->t = &transport;
+	pcm->fd = pipefd[1];
+	pcm->format = BA_PCM_FORMAT_S16_LE;
+	pcm->nonblock = true;
+
+	/* samples which do not fit in the FIFO are dropped */
+	const size_t fifo_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+	for (i = 0; i < fifo_size / sizeof(buffer); i++)
+		ck_assert_int_eq(io_thread_write_pcm(pcm, buffer, ARRAYSIZE(buffer)), ARRAYSIZE(buffer));
+	ck_assert_int_eq(transport.stats.pcm_overruns, 0);
+	ck_assert_int_eq(io_thread_write_pcm(pcm, buffer, ARRAYSIZE(buffer)), ARRAYSIZE(buffer));
+	ck_assert_int_eq(transport.stats.pcm_overruns, 1);
+	ck_assert_int_eq(ioctl(pipefd[0], FIONREAD, &len), 0);
+	ck_assert_int_eq(len, fifo_size);
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+} END_TEST
+
+START_TEST(test_pcm_read_eof) {
+
+	struct ba_transport transport = { .type = TRANSPORT_TYPE_A2DP };
+	struct ba_pcm *pcm = &transport.a2dp.pcm;
+	int16_t buffer[64] = { 0 };
+	int pipefd[2];
+
+	ck_assert_int_eq(pipe2(pipefd, O_NONBLOCK), 0);
+	pcm->t = &transport;
+	pcm->fd = pipefd[0];
+	pcm->format = BA_PCM_FORMAT_S16_LE;
+
+	/* no space in the buffer is not the end of the stream */
+	ck_assert_int_eq(write(pipefd[1], buffer, sizeof(buffer)), sizeof(buffer));
+	ck_assert_int_eq(io_thread_read_pcm(pcm, buffer, 0), -1);
+	ck_assert_int_eq(errno, EAGAIN);
+	ck_assert_int_eq(pcm->fd, pipefd[0]);
+	ck_assert_int_eq(io_thread_read_pcm(pcm, buffer, ARRAYSIZE(buffer)), ARRAYSIZE(buffer));
+
+	/* neither is the empty FIFO */
+	ck_assert_int_eq(io_thread_read_pcm(pcm, buffer, ARRAYSIZE(buffer)), -1);
+	ck_assert_int_eq(errno, EAGAIN);
+	ck_assert_int_eq(pcm->fd, pipefd[0]);
+
+	/* the PCM is released once the client closes the FIFO */
+	close(pipefd[1]);
+	ck_assert_int_eq(io_thread_read_pcm(pcm, buffer, ARRAYSIZE(buffer)), 0);
+	ck_assert_int_eq(pcm->fd, -1);
+
+} END_TEST
+
+START_TEST(test_sco_recv) {
+
+	ffb_uint8_t bt = { 0 };
+	uint8_t packet[48];
+	int fds[2];
+	size_t i;
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds), 0);
+	ck_assert_int_eq(ffb_uint8_init(&bt, 4 * sizeof(packet)), 0);
+
+	/* there is no data pending */
+	ck_assert_int_eq(io_thread_sco_recv(fds[0], &bt, sizeof(packet)), 0);
+
+	for (i = 0; i < sizeof(packet); i++)
+		packet[i] = i;
+	ck_assert_int_eq(write(fds[1], packet, sizeof(packet)), sizeof(packet));
+	ck_assert_int_eq(write(fds[1], packet, 30), 30);
+	ck_assert_int_eq(write(fds[1], packet, sizeof(packet)), sizeof(packet));
+
+	/* all pending packets are received at once without gaps */
+	ck_assert_int_eq(io_thread_sco_recv(fds[0], &bt, sizeof(packet)), 48 + 30 + 48);
+	ck_assert_int_eq(ffb_len_out(&bt), 48 + 30 + 48);
+	ck_assert_int_eq(memcmp(bt.head, packet, 48), 0);
+	ck_assert_int_eq(memcmp(bt.head + 48, packet, 30), 0);
+	ck_assert_int_eq(memcmp(bt.head + 48 + 30, packet, 48), 0);
+
+	/* the number of received packets is limited by the buffer space */
+	for (i = 0; i < 4; i++)
+		ck_assert_int_eq(write(fds[1], packet, sizeof(packet)), sizeof(packet));
+	ck_assert_int_eq(io_thread_sco_recv(fds[0], &bt, sizeof(packet)), 48);
+	ck_assert_int_eq(io_thread_sco_recv(fds[0], &bt, sizeof(packet)), 0);
+	ffb_rewind(&bt);
+	ck_assert_int_eq(io_thread_sco_recv(fds[0], &bt, sizeof(packet)), 3 * 48);
+
+	/* link disconnection is reported as an error */
+	close(fds[1]);
+	ck_assert_int_eq(io_thread_sco_recv(fds[0], &bt, sizeof(packet)), -1);
+	ck_assert_int_eq(errno, ECONNRESET);
+
+	ffb_uint8_free(&bt);
+	close(fds[0]);
+
+} END_TEST
+
 START_TEST(test_a2dp_sbc) {
 
 	struct ba_transport transport = {
@@ -170,11 +477,520 @@ START_TEST(test_a2dp_sbc) {
 	transport.mtu_write = 153 * 3,
 	test_a2dp_encoding(&transport, io_thread_a2dp_source_sbc);
 
+	unsigned int i, encoded = 0;
+	for (i = 0; i < BA_STATS_CODEC_TIME_BINS; i++)
+		encoded += transport.stats.codec_time[i];
+	ck_assert_int_gt(transport.stats.bt_packets, 0);
+	ck_assert_int_gt(encoded, 0);
+
+	memset(&transport.stats, 0, sizeof(transport.stats));
 	transport.mtu_read = transport.mtu_write;
 	test_a2dp_decoding(&transport, io_thread_a2dp_sink_sbc);
 
+	ck_assert_int_gt(transport.stats.bt_packets, 0);
+	ck_assert_int_eq(transport.stats.rtp_gaps, 0);
+
+} END_TEST
+
+START_TEST(test_a2dp_sbc_encoded_sink) {
+
+	struct ba_transport transport = {
+		.codec = A2DP_CODEC_SBC,
+		.mtu_write = 153 * 3,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_sbc_44100_stereo,
+			.cconfig_size = sizeof(config_sbc_44100_stereo),
+		},
+	};
+
+	test_a2dp_encoding(&transport, io_thread_a2dp_source_sbc);
+	ck_assert_int_gt(test_a2dp_bt_data[0].len, 0);
+
+	int bt_fds[2];
+	int pcm_fds[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bt_fds), 0);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pcm_fds), 0);
+
+	transport.profile = BLUETOOTH_PROFILE_A2DP_SINK;
+	transport.mtu_read = transport.mtu_write;
+	transport.bt_fd = bt_fds[1];
+	transport.a2dp.pcm.fd = pcm_fds[0];
+	transport.a2dp.pcm.format = BA_PCM_FORMAT_ENCODED;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, io_thread_a2dp_sink_sbc, &transport);
+
+	size_t i;
+	for (i = 0; i < ARRAYSIZE(test_a2dp_bt_data); i++) {
+
+		const size_t len = test_a2dp_bt_data[i].len;
+		if (len == 0)
+			break;
+
+		ck_assert_int_eq(write(bt_fds[0], test_a2dp_bt_data[i].data, len), len);
+
+		/* RTP payload is forwarded without the RTP and the media header */
+		const rtp_header_t *rtp_header = (rtp_header_t *)test_a2dp_bt_data[i].data;
+		const size_t offset = RTP_HEADER_LEN + sizeof(rtp_media_header_t);
+		struct ba_pcm_encoded_frame header;
+		uint8_t payload[1024];
+
+		ck_assert_int_eq(read(pcm_fds[1], &header, sizeof(header)), sizeof(header));
+		ck_assert_int_eq(header.timestamp, ntohl(rtp_header->timestamp));
+		ck_assert_int_eq(header.len, len - offset);
+		ck_assert_int_eq(read(pcm_fds[1], payload, header.len), header.len);
+		ck_assert_int_eq(memcmp(payload, &test_a2dp_bt_data[i].data[offset], header.len), 0);
+
+	}
+
+	ck_assert_int_eq(pthread_cancel(thread), 0);
+	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
+
+	close(pcm_fds[1]);
+	close(bt_fds[0]);
+
+} END_TEST
+
+START_TEST(test_a2dp_sbc_io_engine) {
+
+	struct ba_transport transport = {
+		.codec = A2DP_CODEC_SBC,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_sbc_44100_stereo,
+			.cconfig_size = sizeof(config_sbc_44100_stereo),
+		},
+	};
+
+	transport.mtu_write = 153 * 3,
+	test_a2dp_encoding(&transport, io_thread_a2dp_source_sbc);
+
+	int bt_fds[2];
+	int pcm_fds[2];
+
+	ck_assert_int_ne(transport.sig_fd = eventfd(0, EFD_NONBLOCK), -1);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bt_fds), 0);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pcm_fds), 0);
+
+	transport.profile = BLUETOOTH_PROFILE_A2DP_SINK;
+	transport.state = TRANSPORT_ACTIVE;
+	transport.mtu_read = transport.mtu_write;
+	transport.bt_fd = bt_fds[1];
+	transport.a2dp.pcm.fd = pcm_fds[0];
+
+	ck_assert_int_eq(io_engine_init(1), 0);
+
+	/* the second run uses the timer driven jitter buffer playout */
+	unsigned int jitter_buffers[] = { 0, 50 };
+	size_t i, j;
+
+	for (j = 0; j < ARRAYSIZE(jitter_buffers); j++) {
+
+		config.a2dp.jitter_buffer = jitter_buffers[j];
+		ck_assert_int_eq(io_engine_a2dp_sink_sbc(&transport), 0);
+		ck_assert_int_eq(io_engine_task_running(&transport.task), true);
+
+		for (i = 0; i < ARRAYSIZE(test_a2dp_bt_data); i++)
+			if (test_a2dp_bt_data[i].len != 0)
+				ck_assert_int_gt(write(bt_fds[0], test_a2dp_bt_data[i].data, test_a2dp_bt_data[i].len), 0);
+
+		struct pollfd pfds[] = {{ pcm_fds[1], POLLIN, 0 }};
+		int16_t buffer[1024 * 10];
+		size_t decoded = 0;
+
+		while (poll(pfds, ARRAYSIZE(pfds), 500) > 0)
+			decoded += read(pcm_fds[1], buffer, sizeof(buffer));
+		ck_assert_int_gt(decoded, 0);
+
+		io_engine_task_stop(&transport.task);
+		ck_assert_int_eq(io_engine_task_running(&transport.task), false);
+
+	}
+
+	config.a2dp.jitter_buffer = 0;
+	io_engine_free();
+
+	close(pcm_fds[0]);
+	close(pcm_fds[1]);
+	close(bt_fds[0]);
+	close(bt_fds[1]);
+	close(transport.sig_fd);
+
+} END_TEST
+
+START_TEST(test_a2dp_sbc_group) {
+
+	a2dp_sbc_t config_sbc_low = config_sbc_44100_stereo;
+	config_sbc_low.max_bitpool = 24;
+
+	struct ba_transport transport = {
+		.codec = A2DP_CODEC_SBC,
+		.profile = BLUETOOTH_PROFILE_A2DP_SOURCE,
+		.state = TRANSPORT_ACTIVE,
+		.mtu_write = 153 * 3,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_sbc_44100_stereo,
+			.cconfig_size = sizeof(config_sbc_44100_stereo),
+		},
+	};
+
+	int bt_fds[3][2];
+	int pcm_fds[2];
+	size_t i;
+
+	for (i = 0; i < ARRAYSIZE(bt_fds); i++)
+		ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bt_fds[i]), 0);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pcm_fds), 0);
+	ck_assert_int_ne(transport.sig_fd = eventfd(0, EFD_NONBLOCK), -1);
+
+	transport.bt_fd = bt_fds[0][0];
+	transport.a2dp.pcm.fd = pcm_fds[1];
+
+	/* the first member shares the leader encoder, the second one uses
+	 * its own encoder due to the different bitpool */
+	struct ba_transport_cmd cmd = { .sig = TRANSPORT_GROUP_LINK };
+	cmd.link.mtu_write = transport.mtu_write;
+	cmd.link.cconfig_size = sizeof(config_sbc_44100_stereo);
+	memcpy(cmd.link.cconfig, &config_sbc_44100_stereo, sizeof(config_sbc_44100_stereo));
+	cmd.link.addr.b[0] = 1;
+	cmd.link.bt_fd = bt_fds[1][0];
+	ck_assert_int_eq(transport_send_command(&transport, &cmd), 0);
+	memcpy(cmd.link.cconfig, &config_sbc_low, sizeof(config_sbc_low));
+	cmd.link.addr.b[0] = 2;
+	cmd.link.bt_fd = bt_fds[2][0];
+	ck_assert_int_eq(transport_send_command(&transport, &cmd), 0);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, io_thread_a2dp_source_sbc, &transport);
+
+	int16_t buffer[1024 * 10];
+	snd_pcm_sine_s16le(buffer, sizeof(buffer) / sizeof(int16_t), 2, 0, 0.01);
+	ck_assert_int_eq(write(pcm_fds[0], buffer, sizeof(buffer)), sizeof(buffer));
+
+	struct pollfd pfds[] = {
+		{ bt_fds[0][1], POLLIN, 0 },
+		{ bt_fds[1][1], POLLIN, 0 },
+		{ bt_fds[2][1], POLLIN, 0 },
+	};
+
+	uint8_t leader[16][1024];
+	ssize_t leader_len[16] = { 0 };
+	size_t packets[3] = { 0 };
+	size_t frames[3] = { 0 };
+
+	while (poll(pfds, ARRAYSIZE(pfds), 500) > 0)
+		for (i = 0; i < ARRAYSIZE(pfds); i++) {
+
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+
+			uint8_t data[1024];
+			ssize_t len = read(pfds[i].fd, data, sizeof(data));
+			const rtp_header_t *rtp_header = (rtp_header_t *)data;
+			const rtp_media_header_t *rtp_media_header = (rtp_media_header_t *)&rtp_header->csrc[0];
+			ck_assert_int_gt(len, RTP_HEADER_LEN + sizeof(*rtp_media_header));
+			frames[i] += rtp_media_header->frame_count;
+
+			/* shared encoder - payload identical with the leader one */
+			if (i == 0 && packets[0] < ARRAYSIZE(leader)) {
+				memcpy(leader[packets[0]], data, len);
+				leader_len[packets[0]] = len;
+			}
+			if (i == 1 && packets[1] < ARRAYSIZE(leader)) {
+				ck_assert_int_eq(len, leader_len[packets[1]]);
+				ck_assert_int_eq(memcmp(&data[RTP_HEADER_LEN],
+							&leader[packets[1]][RTP_HEADER_LEN], len - RTP_HEADER_LEN), 0);
+			}
+
+			packets[i]++;
+		}
+
+	ck_assert_int_gt(packets[0], 0);
+	ck_assert_int_eq(packets[1], packets[0]);
+	ck_assert_int_gt(packets[2], 0);
+	/* all members received the same amount of audio */
+	ck_assert_int_eq(frames[1], frames[0]);
+	ck_assert_int_eq(frames[2], frames[0]);
+
+	ck_assert_int_eq(pthread_cancel(thread), 0);
+	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
+
+	/* linked BT sockets are closed by the IO thread */
+	ck_assert_int_eq(read(bt_fds[1][1], buffer, sizeof(buffer)), 0);
+	ck_assert_int_eq(read(bt_fds[2][1], buffer, sizeof(buffer)), 0);
+
+	for (i = 0; i < ARRAYSIZE(bt_fds); i++)
+		close(bt_fds[i][1]);
+	close(pcm_fds[0]);
+	close(transport.sig_fd);
+
+} END_TEST
+
+START_TEST(test_a2dp_sbc_muted) {
+
+	struct ba_transport transport = {
+		.codec = A2DP_CODEC_SBC,
+		.a2dp = {
+			.ch1_muted = true,
+			.ch2_muted = true,
+			.cconfig = (uint8_t *)&config_sbc_44100_stereo,
+			.cconfig_size = sizeof(config_sbc_44100_stereo),
+		},
+	};
+
+	transport.mtu_write = 153 * 3,
+	test_a2dp_encoding(&transport, io_thread_a2dp_source_sbc);
+
+	/* pre-encoded silence is sent without running the encoder */
+	unsigned int i, encoded = 0;
+	for (i = 0; i < BA_STATS_CODEC_TIME_BINS; i++)
+		encoded += transport.stats.codec_time[i];
+	ck_assert_int_gt(transport.stats.bt_packets, 0);
+	ck_assert_int_eq(encoded, 0);
+
+	/* all packets carry the same silent SBC frames */
+	const size_t offset = RTP_HEADER_LEN + sizeof(rtp_media_header_t);
+	for (i = 1; i < ARRAYSIZE(test_a2dp_bt_data) && test_a2dp_bt_data[i].len != 0; i++) {
+		ck_assert_int_eq(test_a2dp_bt_data[i].len, test_a2dp_bt_data[0].len);
+		ck_assert_int_eq(memcmp(&test_a2dp_bt_data[i].data[offset],
+					&test_a2dp_bt_data[0].data[offset], test_a2dp_bt_data[0].len - offset), 0);
+	}
+
+} END_TEST
+
+START_TEST(test_a2dp_sbc_silence) {
+
+	struct ba_transport transport = {
+		.codec = A2DP_CODEC_SBC,
+		.profile = BLUETOOTH_PROFILE_A2DP_SOURCE,
+		.state = TRANSPORT_ACTIVE,
+		.mtu_write = 153 * 3,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_sbc_44100_stereo,
+			.cconfig_size = sizeof(config_sbc_44100_stereo),
+		},
+	};
+
+	int bt_fds[2];
+	int pcm_fds[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bt_fds), 0);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pcm_fds), 0);
+	ck_assert_int_ne(transport.sig_fd = eventfd(0, EFD_NONBLOCK), -1);
+
+	transport.bt_fd = bt_fds[0];
+	transport.a2dp.pcm.fd = pcm_fds[1];
+
+	config.a2dp.silence_timeout = 1;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, io_thread_a2dp_source_sbc, &transport);
+
+	/* 1.5 seconds of silence followed by the sine wave */
+	const size_t silence_samples = 44100 * 3 / 2 * 2;
+	int16_t sine[1024 * 10];
+	int16_t buffer[1024];
+	size_t written = 0;
+
+	snd_pcm_sine_s16le(sine, ARRAYSIZE(sine), 2, 0, 0.01);
+	memset(buffer, 0, sizeof(buffer));
+
+	struct pollfd pfds[] = {
+		{ bt_fds[1], POLLIN, 0 },
+		{ pcm_fds[0], POLLOUT, 0 },
+	};
+
+	uint32_t timestamp = 0;
+	uint32_t timestamp_gap = 0;
+	size_t packets = 0;
+
+	/* while suspended, there is no BT traffic for about half a second */
+	while (poll(pfds, ARRAYSIZE(pfds), 1000) > 0) {
+
+		if (pfds[0].revents & POLLIN) {
+
+			uint8_t data[1024];
+			ssize_t len = read(bt_fds[1], data, sizeof(data));
+			const rtp_header_t *rtp_header = (rtp_header_t *)data;
+			ck_assert_int_gt(len, RTP_HEADER_LEN);
+
+			const uint32_t ts = ntohl(rtp_header->timestamp);
+			if (packets++ > 0 && ts - timestamp > timestamp_gap)
+				timestamp_gap = ts - timestamp;
+			timestamp = ts;
+
+		}
+
+		if (pfds[1].revents & POLLOUT) {
+			if (written < silence_samples) {
+				ck_assert_int_eq(write(pcm_fds[0], buffer, sizeof(buffer)), sizeof(buffer));
+				written += ARRAYSIZE(buffer);
+			}
+			else {
+				ck_assert_int_eq(write(pcm_fds[0], sine, sizeof(sine)), sizeof(sine));
+				pfds[1].events = 0;
+			}
+		}
+
+	}
+
+	ck_assert_int_eq(pthread_cancel(thread), 0);
+	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
+
+	config.a2dp.silence_timeout = 0;
+
+	/* Transmission has been resumed with the RTP time line moved by the
+	 * suspension period - the RTP time-stamp unit is 100 us. */
+	ck_assert_int_gt(packets, 0);
+	ck_assert_int_gt(timestamp_gap, 2500);
+	ck_assert_int_lt(timestamp_gap, 10000);
+
+	close(bt_fds[1]);
+	close(pcm_fds[0]);
+	close(transport.sig_fd);
+
 } END_TEST
 
+/**
+ * Feed the passthrough IO thread with the encoded stream. */
+static size_t test_a2dp_passthrough(struct ba_transport *t, const void *data, size_t len) {
+
+	int bt_fds[2];
+	int pcm_fds[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bt_fds), 0);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pcm_fds), 0);
+	ck_assert_int_ne(t->sig_fd = eventfd(0, EFD_NONBLOCK), -1);
+
+	t->profile = BLUETOOTH_PROFILE_A2DP_SOURCE;
+	t->state = TRANSPORT_ACTIVE;
+	t->bt_fd = bt_fds[0];
+	t->a2dp.pcm.fd = pcm_fds[1];
+	t->a2dp.pcm.format = BA_PCM_FORMAT_ENCODED;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, io_thread_a2dp_source_passthrough, t);
+
+	ck_assert_int_eq(write(pcm_fds[0], data, len), len);
+
+	struct pollfd pfds[] = {{ bt_fds[1], POLLIN, 0 }};
+	size_t i = 0;
+
+	memset(test_a2dp_bt_data, 0, sizeof(test_a2dp_bt_data));
+	while (poll(pfds, ARRAYSIZE(pfds), 500) > 0) {
+		ck_assert_int_lt(i, ARRAYSIZE(test_a2dp_bt_data));
+		ssize_t ret = read(bt_fds[1], test_a2dp_bt_data[i].data, sizeof(test_a2dp_bt_data[i].data));
+		ck_assert_int_gt(ret, RTP_HEADER_LEN);
+		test_a2dp_bt_data[i++].len = ret;
+	}
+
+	ck_assert_int_eq(pthread_cancel(thread), 0);
+	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
+
+	close(pcm_fds[0]);
+	close(bt_fds[1]);
+	close(t->sig_fd);
+
+	return i;
+}
+
+START_TEST(test_a2dp_sbc_passthrough) {
+
+	struct ba_transport transport = {
+		.codec = A2DP_CODEC_SBC,
+		.mtu_write = 153 * 3,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_sbc_44100_stereo,
+			.cconfig_size = sizeof(config_sbc_44100_stereo),
+		},
+	};
+
+	int16_t sine[1024 * 2];
+	snd_pcm_sine_s16le(sine, ARRAYSIZE(sine), 2, 0, 0.01);
+
+	sbc_t sbc;
+	ck_assert_int_eq(sbc_init_a2dp(&sbc, 0, &config_sbc_44100_stereo,
+				sizeof(config_sbc_44100_stereo)), 0);
+
+	const size_t codesize = sbc_get_codesize(&sbc);
+	const size_t frame_len = sbc_get_frame_length(&sbc);
+	const size_t frames = sizeof(sine) / codesize;
+
+	/* encoded stream preceded by some garbage */
+	uint8_t stream[3 + 16 * 128] = { 0x01, 0x02, 0x03 };
+	size_t i, len = 3;
+
+	ck_assert_int_le(frames * frame_len, sizeof(stream) - len);
+	for (i = 0; i < frames; i++) {
+		ssize_t encoded;
+		ck_assert_int_eq(sbc_encode(&sbc, (uint8_t *)sine + i * codesize, codesize,
+					&stream[len], sizeof(stream) - len, &encoded), codesize);
+		len += encoded;
+	}
+
+	sbc_finish(&sbc);
+
+	const size_t packets = test_a2dp_passthrough(&transport, stream, len);
+	const size_t offset = RTP_HEADER_LEN + sizeof(rtp_media_header_t);
+	size_t received = 0;
+
+	/* frames are copied as they are, as many as fit into the MTU */
+	ck_assert_int_gt(packets, 0);
+	for (i = 0; i < packets; i++) {
+		const rtp_media_header_t *rtp_media_header = (rtp_media_header_t *)&test_a2dp_bt_data[i].data[RTP_HEADER_LEN];
+		const size_t payload_len = test_a2dp_bt_data[i].len - offset;
+		ck_assert_int_eq(payload_len, rtp_media_header->frame_count * frame_len);
+		ck_assert_int_le(test_a2dp_bt_data[i].len, transport.mtu_write);
+		ck_assert_int_eq(memcmp(&test_a2dp_bt_data[i].data[offset],
+					&stream[3 + received * frame_len], payload_len), 0);
+		received += rtp_media_header->frame_count;
+	}
+
+	ck_assert_int_eq(received, frames);
+
+} END_TEST
+
+#if ENABLE_MPEG
+START_TEST(test_a2dp_mpeg_passthrough) {
+
+	static const a2dp_mpeg_t config_mpeg_44100_stereo = {
+		.layer = MPEG_LAYER_MP3,
+		.channel_mode = MPEG_CHANNEL_MODE_JOINT_STEREO,
+		.frequency = MPEG_SAMPLING_FREQ_44100,
+	};
+
+	struct ba_transport transport = {
+		.codec = A2DP_CODEC_MPEG12,
+		.mtu_write = 1000,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_mpeg_44100_stereo,
+			.cconfig_size = sizeof(config_mpeg_44100_stereo),
+		},
+	};
+
+	/* MPEG-1 layer III, 128 kbit/s, 44.1 kHz, joint stereo */
+	static const uint8_t header[] = { 0xFF, 0xFB, 0x90, 0x40 };
+	const size_t frame_len = 144 * 128000 / 44100;
+	uint8_t stream[4 * 417];
+	size_t i;
+
+	ck_assert_int_eq(frame_len, 417);
+	memset(stream, 0x55, sizeof(stream));
+	for (i = 0; i < 4; i++)
+		memcpy(&stream[i * frame_len], header, sizeof(header));
+
+	/* two frames fit into the MTU (RTP header and 4-byte MPA header) */
+	ck_assert_int_eq(test_a2dp_passthrough(&transport, stream, sizeof(stream)), 2);
+	for (i = 0; i < 2; i++) {
+		ck_assert_int_eq(test_a2dp_bt_data[i].len, RTP_HEADER_LEN + 4 + 2 * frame_len);
+		ck_assert_int_eq(memcmp(&test_a2dp_bt_data[i].data[RTP_HEADER_LEN], "\0\0\0\0", 4), 0);
+		ck_assert_int_eq(memcmp(&test_a2dp_bt_data[i].data[RTP_HEADER_LEN + 4],
+					&stream[i * 2 * frame_len], 2 * frame_len), 0);
+	}
+
+} END_TEST
+#endif
+
 #if ENABLE_AAC
 START_TEST(test_a2dp_aac) {
 
@@ -192,6 +1008,29 @@ START_TEST(test_a2dp_aac) {
 	transport.mtu_read = transport.mtu_write;
 	test_a2dp_decoding(&transport, io_thread_a2dp_sink_aac);
 
+} END_TEST
+
+START_TEST(test_a2dp_aac_pipeline) {
+
+	struct ba_transport transport = {
+		.codec = A2DP_CODEC_MPEG24,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_aac_44100_stereo,
+			.cconfig_size = sizeof(config_aac_44100_stereo),
+		},
+	};
+
+	config.a2dp.pipeline = true;
+
+	transport.mtu_write = 64;
+	test_a2dp_encoding(&transport, io_thread_a2dp_source_aac);
+	ck_assert_int_gt(test_a2dp_bt_data[0].len, 0);
+
+	transport.mtu_read = transport.mtu_write;
+	test_a2dp_decoding(&transport, io_thread_a2dp_sink_aac);
+
+	config.a2dp.pipeline = false;
+
 } END_TEST
 #endif
 
@@ -212,6 +1051,23 @@ START_TEST(test_a2dp_aptx) {
 } END_TEST
 #endif
 
+#if ENABLE_APTX_HD
+START_TEST(test_a2dp_aptx_hd) {
+
+	struct ba_transport transport = {
+		.codec = A2DP_CODEC_VENDOR_APTX_HD,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_aptx_hd_44100_stereo,
+			.cconfig_size = sizeof(config_aptx_hd_44100_stereo),
+		},
+	};
+
+	transport.mtu_write = 60;
+	test_a2dp_encoding(&transport, io_thread_a2dp_source_aptx_hd);
+
+} END_TEST
+#endif
+
 #if ENABLE_LDAC
 START_TEST(test_a2dp_ldac) {
 
@@ -238,14 +1094,33 @@ int main(void) {
 
 	suite_add_tcase(s, tc);
 
+	tcase_add_test(tc, test_transport_cmdq);
+	tcase_add_test(tc, test_transport_cmdq_ack);
+	tcase_add_test(tc, test_transport_pcm_drain);
+	tcase_add_test(tc, test_pcm_write_nonblock);
+	tcase_add_test(tc, test_pcm_read_eof);
+	tcase_add_test(tc, test_sco_recv);
 	tcase_add_test(tc, test_a2dp_sbc);
+	tcase_add_test(tc, test_a2dp_sbc_io_engine);
+	tcase_add_test(tc, test_a2dp_sbc_group);
+	tcase_add_test(tc, test_a2dp_sbc_muted);
+	tcase_add_test(tc, test_a2dp_sbc_silence);
+	tcase_add_test(tc, test_a2dp_sbc_passthrough);
+	tcase_add_test(tc, test_a2dp_sbc_encoded_sink);
+#if ENABLE_MPEG
+	tcase_add_test(tc, test_a2dp_mpeg_passthrough);
+#endif
 #if ENABLE_AAC
 	config.aac_afterburner = true;
 	tcase_add_test(tc, test_a2dp_aac);
+	tcase_add_test(tc, test_a2dp_aac_pipeline);
 #endif
 #if ENABLE_APTX
 	tcase_add_test(tc, test_a2dp_aptx);
 #endif
+#if ENABLE_APTX_HD
+	tcase_add_test(tc, test_a2dp_aptx_hd);
+#endif
 #if ENABLE_LDAC
 	config.ldac_abr = true;
 	config.ldac_eqmid = LDACBT_EQMID_HQ;
@@ -0,0 +1,390 @@
+/*
+ * test-latency.c
+ * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ * This program measures the end-to-end latency of the PCM plug-in and the
+ * IO threads. Marker pulses are written to the playback PCM of the server
+ * mock running in the loopback mode, and they are detected in the signal
+ * read from the capture PCM - after the full encode, RTP and decode path.
+ *
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <alsa/asoundlib.h>
+
+#include "inc/server.inc"
+#include "inc/sine.inc"
+
+/* hard-coded values used in the server-mock */
+#define latency_channels 2
+#define latency_rate 44100
+
+/* the number of markers sent before the measurement starts */
+#define latency_warmup 2
+
+/* length of the marker pulse in frames */
+#define latency_pulse_frames 512
+
+/* The signal level above which the marker is detected. The pulse is a full
+ * scale sine, so even a heavy lossy compression will not affect it much. */
+#define latency_threshold (SHRT_MAX / 4)
+
+struct latency_capture {
+	snd_pcm_t *pcm;
+	snd_pcm_uframes_t period_size;
+	/* minimal distance between two markers */
+	size_t quiet_frames;
+	/* detection time-stamps */
+	double *detected;
+	size_t detected_len;
+	size_t detected_max;
+	unsigned int xruns;
+	volatile bool stop;
+};
+
+static double latency_timestamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int latency_cmp(const void *a, const void *b) {
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int snd_pcm_open_bluealsa(snd_pcm_t **pcmp, const char *hci, snd_pcm_stream_t stream, int mode) {
+
+	char buffer[256];
+	snd_config_t *conf = NULL;
+	snd_input_t *input = NULL;
+	int err;
+
+	sprintf(buffer,
+			"pcm.bluealsa {\n"
+			"  type bluealsa\n"
+			"  interface \"%s\"\n"
+			"  device \"12:34:56:78:9A:BC\"\n"
+			"  profile \"a2dp\"\n"
+			"  delay 0\n"
+			"}\n", hci);
+
+	if ((err = snd_config_top(&conf)) < 0)
+		goto fail;
+	if ((err = snd_input_buffer_open(&input, buffer, strlen(buffer))) != 0)
+		goto fail;
+	if ((err = snd_config_load(conf, input)) != 0)
+		goto fail;
+	err = snd_pcm_open_lconf(pcmp, "bluealsa", stream, mode, conf);
+
+fail:
+	if (conf != NULL)
+		snd_config_delete(conf);
+	if (input != NULL)
+		snd_input_close(input);
+	return err;
+}
+
+static int set_hw_params(snd_pcm_t *pcm, unsigned int *buffer_time, unsigned int *period_time,
+		snd_pcm_uframes_t *period_size) {
+
+	snd_pcm_hw_params_t *params;
+	int dir;
+	int err;
+
+	snd_pcm_hw_params_alloca(&params);
+	snd_pcm_hw_params_any(pcm, params);
+
+	if ((err = snd_pcm_hw_params_set_access(pcm, params, SND_PCM_ACCESS_RW_INTERLEAVED)) != 0 ||
+			(err = snd_pcm_hw_params_set_format(pcm, params, SND_PCM_FORMAT_S16_LE)) != 0 ||
+			(err = snd_pcm_hw_params_set_channels(pcm, params, latency_channels)) != 0 ||
+			(err = snd_pcm_hw_params_set_rate(pcm, params, latency_rate, 0)) != 0 ||
+			(err = snd_pcm_hw_params_set_buffer_time_near(pcm, params, buffer_time, &dir)) != 0 ||
+			(err = snd_pcm_hw_params_set_period_time_near(pcm, params, period_time, &dir)) != 0 ||
+			(err = snd_pcm_hw_params(pcm, params)) != 0)
+		return err;
+
+	return snd_pcm_hw_params_get_period_size(params, period_size, &dir);
+}
+
+/**
+ * Read the capture PCM and detect the onset of marker pulses. */
+static void *latency_capture_thread(void *arg) {
+	struct latency_capture *c = (struct latency_capture *)arg;
+
+	int16_t *buffer = malloc(c->period_size * latency_channels * sizeof(int16_t));
+	size_t quiet = c->quiet_frames;
+
+	while (!c->stop && buffer != NULL && c->detected_len < c->detected_max) {
+
+		snd_pcm_sframes_t frames;
+		snd_pcm_sframes_t i;
+
+		if (snd_pcm_wait(c->pcm, 100) == 0)
+			continue;
+
+		if ((frames = snd_pcm_readi(c->pcm, buffer, c->period_size)) < 0) {
+			if (frames == -EAGAIN)
+				continue;
+			if (frames == -EPIPE) {
+				c->xruns++;
+				snd_pcm_prepare(c->pcm);
+				continue;
+			}
+			fprintf(stderr, "Couldn't read capture PCM: %s\n", snd_strerror(frames));
+			break;
+		}
+
+		/* The last frame has just arrived, so the preceding ones were
+		 * received earlier - one sample period each. */
+		const double ts = latency_timestamp();
+
+		for (i = 0; i < frames; i++) {
+			if (abs(buffer[i * latency_channels]) < latency_threshold) {
+				quiet++;
+				continue;
+			}
+			if (quiet >= c->quiet_frames && c->detected_len < c->detected_max)
+				c->detected[c->detected_len++] = ts - (double)(frames - 1 - i) / latency_rate;
+			quiet = 0;
+		}
+
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	const char *opts = "hc:b:p:n:i:m:";
+	const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "codec", required_argument, NULL, 'c' },
+		{ "buffer-time", required_argument, NULL, 'b' },
+		{ "period-time", required_argument, NULL, 'p' },
+		{ "markers", required_argument, NULL, 'n' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "max-latency", required_argument, NULL, 'm' },
+		{ 0, 0, 0, 0 },
+	};
+
+	const char *codec = "sbc";
+	unsigned int buffer_time = 200000;
+	unsigned int period_time = 20000;
+	unsigned int markers = 20;
+	unsigned int interval = 500;
+	unsigned int max_latency = 1000;
+
+	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h':
+			printf("Usage:\n"
+					"  %s [OPTION]...\n"
+					"\nOptions:\n"
+					"  -h, --help\t\tprint this help and exit\n"
+					"  -c, --codec=NAME\tcodec used by the loopback (default: sbc)\n"
+					"  -b, --buffer-time=US\tPCM buffer time (default: 200000)\n"
+					"  -p, --period-time=US\tPCM period time (default: 20000)\n"
+					"  -n, --markers=NUM\tnumber of measured markers (default: 20)\n"
+					"  -i, --interval=MS\tinterval between markers (default: 500)\n"
+					"  -m, --max-latency=MS\tfail if the 95th percentile exceeds this value\n"
+					"\nOutput columns (tab separated):\n"
+					"  codec, buffer time [us], period time [us], markers, lost markers,\n"
+					"  latency percentiles 50, 95, 99 and max [ms], jitter [ms]\n",
+					argv[0]);
+			return EXIT_SUCCESS;
+		case 'c':
+			codec = optarg;
+			break;
+		case 'b':
+			buffer_time = atoi(optarg);
+			break;
+		case 'p':
+			period_time = atoi(optarg);
+			break;
+		case 'n':
+			markers = atoi(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'm':
+			max_latency = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	if (markers == 0 || interval == 0) {
+		fprintf(stderr, "Invalid number of markers or interval: %u, %u\n", markers, interval);
+		return EXIT_FAILURE;
+	}
+
+	/* test-latency and server-mock shall be placed in the same directory */
+	bin_path = dirname(argv[0]);
+
+	const char *hci = "hci-lat";
+	const unsigned int total = latency_warmup + markers;
+	const unsigned int timeout = total * interval / 1000 + 5;
+	pid_t pid = spawn_bluealsa_server_loopback(hci, timeout, codec);
+
+	snd_pcm_t *pcm_playback = NULL;
+	snd_pcm_t *pcm_capture = NULL;
+	snd_pcm_uframes_t period_size;
+	unsigned int capture_buffer_time = buffer_time;
+	unsigned int capture_period_time = period_time;
+	int rv = EXIT_FAILURE;
+	int err;
+
+	double *emitted = calloc(total, sizeof(*emitted));
+	double *detected = calloc(total, sizeof(*detected));
+	double *latency = calloc(total, sizeof(*latency));
+	int16_t *buffer = NULL;
+
+	struct latency_capture capture = {
+		.detected = detected,
+		.detected_max = total,
+	};
+
+	if (emitted == NULL || detected == NULL || latency == NULL) {
+		fprintf(stderr, "Couldn't allocate buffers: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	if ((err = snd_pcm_open_bluealsa(&pcm_capture, hci, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK)) != 0 ||
+			(err = set_hw_params(pcm_capture, &capture_buffer_time, &capture_period_time,
+					&capture.period_size)) != 0 ||
+			(err = snd_pcm_prepare(pcm_capture)) != 0 ||
+			(err = snd_pcm_start(pcm_capture)) != 0) {
+		fprintf(stderr, "Couldn't open capture PCM: %s\n", snd_strerror(err));
+		goto fail;
+	}
+
+	if ((err = snd_pcm_open_bluealsa(&pcm_playback, hci, SND_PCM_STREAM_PLAYBACK, 0)) != 0 ||
+			(err = set_hw_params(pcm_playback, &buffer_time, &period_time, &period_size)) != 0 ||
+			(err = snd_pcm_prepare(pcm_playback)) != 0) {
+		fprintf(stderr, "Couldn't open playback PCM: %s\n", snd_strerror(err));
+		goto fail;
+	}
+
+	/* markers are aligned to the period boundary */
+	const size_t interval_periods = (size_t)interval * latency_rate / 1000 / period_size + 1;
+	capture.quiet_frames = interval_periods * period_size / 2;
+
+	if ((buffer = malloc(period_size * latency_channels * sizeof(int16_t))) == NULL) {
+		fprintf(stderr, "Couldn't allocate buffers: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, latency_capture_thread, &capture);
+
+	size_t pulse = 0;
+	size_t i, n;
+
+	for (i = n = 0; n < total || pulse > 0; i++) {
+
+		const size_t samples = period_size * latency_channels;
+		const bool marker = i % interval_periods == 0 && n < total;
+		snd_pcm_sframes_t frames;
+
+		memset(buffer, 0, samples * sizeof(int16_t));
+
+		if (marker)
+			pulse = latency_pulse_frames;
+		if (pulse > 0) {
+			const size_t len = pulse < period_size ? pulse : period_size;
+			snd_pcm_sine_s16le(buffer, len * latency_channels, latency_channels,
+					latency_pulse_frames - pulse, 1000.0 / latency_rate);
+			pulse -= len;
+		}
+
+		if ((frames = snd_pcm_writei(pcm_playback, buffer, period_size)) < 0) {
+			fprintf(stderr, "Couldn't write playback PCM: %s\n", snd_strerror(frames));
+			break;
+		}
+
+		/* the first frame of the marker has been passed to the plug-in */
+		if (marker)
+			emitted[n++] = latency_timestamp();
+
+	}
+
+	snd_pcm_drain(pcm_playback);
+
+	/* give the capture some time to receive the last marker */
+	for (i = 0; i < 20 && capture.detected_len < total; i++)
+		usleep(100000);
+	capture.stop = true;
+	pthread_join(thread, NULL);
+
+	/* Markers are paired in order, so the measurement is valid only if no
+	 * marker has been lost (or falsely detected). */
+	const size_t lost = total - capture.detected_len;
+	size_t count = 0;
+	double jitter = 0;
+
+	for (i = latency_warmup; i < capture.detected_len; i++) {
+		latency[count] = (detected[i] - emitted[i]) * 1000;
+		if (count > 0) {
+			const double d = latency[count] - latency[count - 1];
+			jitter += d > 0 ? d : -d;
+		}
+		count++;
+	}
+
+	if (count > 1)
+		jitter /= count - 1;
+
+	qsort(latency, count, sizeof(*latency), latency_cmp);
+	const double p50 = count ? latency[(count - 1) * 50 / 100] : 0;
+	const double p95 = count ? latency[(count - 1) * 95 / 100] : 0;
+	const double p99 = count ? latency[(count - 1) * 99 / 100] : 0;
+	const double max = count ? latency[count - 1] : 0;
+
+	printf("#codec\tbuffer\tperiod\tmarkers\tlost\tp50\tp95\tp99\tmax\tjitter\n");
+	printf("%s\t%u\t%u\t%u\t%zu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+			codec, buffer_time, period_time, markers, lost, p50, p95, p99, max, jitter);
+
+	if (capture.xruns > 0)
+		fprintf(stderr, "Capture overruns: %u\n", capture.xruns);
+
+	if (lost > 0 || count == 0)
+		fprintf(stderr, "Markers lost: %zu\n", lost);
+	else if (max_latency != 0 && p95 > max_latency)
+		fprintf(stderr, "Latency limit exceeded: %.1f > %u\n", p95, max_latency);
+	else
+		rv = EXIT_SUCCESS;
+
+fail:
+	if (pcm_playback != NULL)
+		snd_pcm_close(pcm_playback);
+	if (pcm_capture != NULL)
+		snd_pcm_close(pcm_capture);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	free(buffer);
+	free(latency);
+	free(detected);
+	free(emitted);
+	return rv;
+}
@@ -10,12 +10,581 @@
 
 #include <check.h>
 
+#include "../src/abr.c"
+#include "../src/capture.c"
+#include "../src/codec-cache.c"
+#include "../src/cpu-budget.c"
+#include "../src/link-history.c"
+#include "../src/mem-pool.c"
+#include "../src/jitter.c"
+#include "../src/resample.c"
 #include "../src/utils.c"
 #include "../src/shared/defs.h"
+#include "../src/shared/drift.c"
 #include "../src/shared/ffb.c"
 #include "../src/shared/log.c"
+#include "../src/shared/pcm-ring.c"
+#include "../src/shared/pcm-status.c"
 #include "../src/shared/rt.c"
 
+START_TEST(test_abr) {
+
+	const struct abr_config config = {
+		.queue_low = 1, .queue_high = 4,
+		.blocked = 10, .upgrade = 1000, .holdoff = 100 };
+	struct timespec ts = { 0 };
+	struct abr abr;
+
+	abr_init(&abr, &config, 3, &ts);
+	ck_assert_int_eq(abr.level, 0);
+
+	/* level is clamped to the available levels */
+	abr_set_level(&abr, 5, &ts);
+	ck_assert_int_eq(abr.level, 2);
+	abr_set_level(&abr, 0, &ts);
+	ck_assert_int_eq(abr.level, 0);
+
+	/* queue growth lowers the quality level */
+	ck_assert_int_eq(abr_update(&abr, 2, 0, &ts), 0);
+	ts.tv_nsec = 200000000;
+	ck_assert_int_eq(abr_update(&abr, 4, 0, &ts), 1);
+	/* next step is possible after the hold-off period only */
+	ts.tv_nsec = 250000000;
+	ck_assert_int_eq(abr_update(&abr, 5, 0, &ts), 1);
+	/* blocked socket is a congestion as well */
+	ts.tv_nsec = 400000000;
+	ck_assert_int_eq(abr_update(&abr, 0, 15, &ts), 2);
+	/* there is no lower quality level */
+	ts.tv_nsec = 600000000;
+	ck_assert_int_eq(abr_update(&abr, 8, 0, &ts), 2);
+
+	/* quality is increased after the period without congestion */
+	ts.tv_sec = 1; ts.tv_nsec = 0;
+	ck_assert_int_eq(abr_update(&abr, 0, 0, &ts), 2);
+	ts.tv_sec = 1; ts.tv_nsec = 700000000;
+	ck_assert_int_eq(abr_update(&abr, 1, 0, &ts), 1);
+	/* moderate queue resets the upgrade period */
+	ts.tv_sec = 2; ts.tv_nsec = 600000000;
+	ck_assert_int_eq(abr_update(&abr, 2, 0, &ts), 1);
+	ts.tv_sec = 3; ts.tv_nsec = 0;
+	ck_assert_int_eq(abr_update(&abr, 0, 0, &ts), 1);
+	ts.tv_sec = 3; ts.tv_nsec = 700000000;
+	ck_assert_int_eq(abr_update(&abr, 0, 0, &ts), 0);
+
+} END_TEST
+
+START_TEST(test_cpu_budget) {
+
+	struct cpu_budget budget;
+	struct cpu_budget_client a;
+	struct cpu_budget_client b;
+	struct timespec ts = { 0 };
+
+	/* 50% of a single CPU core */
+	cpu_budget_init(&budget, 500);
+	cpu_budget_register(&budget, &a, 3, 0, &ts);
+	cpu_budget_register(&budget, &b, 1, 0, &ts);
+
+	/* the load is measured once per interval */
+	ts.tv_nsec = 500000000;
+	ck_assert_int_eq(cpu_budget_update(&budget, &a, 200000, &ts), false);
+	ck_assert_int_eq(a.load, 0);
+	ts.tv_sec = 1; ts.tv_nsec = 0;
+	ck_assert_int_eq(cpu_budget_update(&budget, &a, 400000, &ts), false);
+	ck_assert_int_eq(a.load, 400);
+
+	/* overload is resolved by the heaviest client which has levels left */
+	ck_assert_int_eq(cpu_budget_update(&budget, &b, 300000, &ts), false);
+	ck_assert_int_eq(b.load, 300);
+	ts.tv_sec = 2;
+	ck_assert_int_eq(cpu_budget_update(&budget, &a, 800000, &ts), true);
+	ck_assert_int_eq(a.level, 1);
+
+	/* next step is possible after the hold-off period only */
+	ts.tv_sec = 3;
+	ck_assert_int_eq(cpu_budget_update(&budget, &b, 900000, &ts), false);
+	ck_assert_int_eq(cpu_budget_update(&budget, &a, 1100000, &ts), false);
+	ck_assert_int_eq(a.level, 1);
+	ts.tv_sec = 4;
+	ck_assert_int_eq(cpu_budget_update(&budget, &b, 1500000, &ts), false);
+	ck_assert_int_eq(cpu_budget_update(&budget, &a, 1400000, &ts), true);
+	ck_assert_int_eq(a.level, 2);
+
+	/* idle client is not accounted, but the upgrade is postponed */
+	ts.tv_sec = 7;
+	ck_assert_int_eq(cpu_budget_update(&budget, &a, 2000000, &ts), false);
+	ck_assert_int_eq(a.level, 2);
+	ts.tv_sec = 14;
+	ck_assert_int_eq(cpu_budget_update(&budget, &a, 3400000, &ts), true);
+	ck_assert_int_eq(a.level, 1);
+
+	/* upgrade is not done if the known load would exceed the budget */
+	ts.tv_sec = 24;
+	ck_assert_int_eq(cpu_budget_update(&budget, &b, 4500000, &ts), false);
+	ck_assert_int_eq(cpu_budget_update(&budget, &a, 5400000, &ts), false);
+	ck_assert_int_eq(a.level, 1);
+
+	cpu_budget_unregister(&budget, &b);
+	ck_assert_ptr_eq(budget.clients, &a);
+	cpu_budget_unregister(&budget, &b);
+	ts.tv_sec = 25;
+	ck_assert_int_eq(cpu_budget_update(&budget, &a, 5600000, &ts), true);
+	ck_assert_int_eq(a.level, 0);
+
+	cpu_budget_unregister(&budget, &a);
+	ck_assert_ptr_eq(budget.clients, NULL);
+	cpu_budget_free(&budget);
+
+} END_TEST
+
+START_TEST(test_jitter_buffer) {
+
+	struct jitter_buffer jb;
+	struct timespec ts = { 0 };
+	const uint8_t *packet;
+	unsigned int frames;
+	size_t len;
+	uint8_t data;
+
+	/* with 1 kHz sampling, 1 frame is 1 ms */
+	ck_assert_int_eq(jitter_buffer_init(&jb, 16, 1000, 20), 0);
+	ck_assert_int_eq(jitter_buffer_timeout(&jb, &ts), -1);
+
+	/* playout starts when the target delay is buffered */
+	data = 100;
+	ck_assert_int_eq(jitter_buffer_put(&jb, &data, 1, 100, 10), 0);
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_EMPTY);
+	data = 102;
+	ck_assert_int_eq(jitter_buffer_put(&jb, &data, 1, 102, 10), 0);
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_PACKET);
+	ck_assert_int_eq(packet[0], 100);
+	ck_assert_int_eq(len, 1);
+	ck_assert_int_eq(frames, 10);
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_EMPTY);
+	ck_assert_int_eq(jitter_buffer_timeout(&jb, &ts), 10);
+
+	/* out of order arrival and duplicates */
+	data = 101;
+	ck_assert_int_eq(jitter_buffer_put(&jb, &data, 1, 101, 10), 0);
+	ck_assert_int_eq(jitter_buffer_put(&jb, &data, 1, 100, 10), -1);
+	ck_assert_int_eq(errno, EALREADY);
+	ck_assert_int_eq(jitter_buffer_put(&jb, &data, 1, 101, 10), -1);
+	ck_assert_int_eq(jb.late, 2);
+
+	/* packets are released with the stream rate */
+	ts.tv_nsec = 10000000;
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_PACKET);
+	ck_assert_int_eq(packet[0], 101);
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_EMPTY);
+	ts.tv_nsec = 20000000;
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_PACKET);
+	ck_assert_int_eq(packet[0], 102);
+
+	/* underrun stops the playout */
+	ts.tv_nsec = 30000000;
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_EMPTY);
+	ck_assert_int_eq(jb.underruns, 1);
+	ck_assert_int_eq(jitter_buffer_timeout(&jb, &ts), -1);
+
+	/* missing packet has to be concealed */
+	data = 104;
+	ck_assert_int_eq(jitter_buffer_put(&jb, &data, 1, 104, 10), 0);
+	data = 105;
+	ck_assert_int_eq(jitter_buffer_put(&jb, &data, 1, 105, 10), 0);
+	data = 107;
+	ck_assert_int_eq(jitter_buffer_put(&jb, &data, 1, 107, 10), 0);
+	ts.tv_nsec = 40000000;
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_PACKET);
+	ck_assert_int_eq(packet[0], 104);
+	ts.tv_nsec = 50000000;
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_PACKET);
+	ck_assert_int_eq(packet[0], 105);
+	ts.tv_nsec = 60000000;
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_LOST);
+	ck_assert_int_eq(frames, 10);
+	ck_assert_int_eq(jb.lost, 1);
+	ts.tv_nsec = 70000000;
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_PACKET);
+	ck_assert_int_eq(packet[0], 107);
+
+	/* buffered audio is limited to twice the target delay */
+	for (data = 108; data < 113; data++)
+		ck_assert_int_eq(jitter_buffer_put(&jb, &data, 1, data, 10), 0);
+	ck_assert_int_eq(jb.frames, 40);
+	ck_assert_int_eq(jb.dropped, 1);
+	ts.tv_nsec = 80000000;
+	ck_assert_int_eq(jitter_buffer_get(&jb, &ts, &packet, &len, &frames), JITTER_PACKET);
+	ck_assert_int_eq(packet[0], 109);
+
+	/* too big packet */
+	uint8_t big[32] = { 0 };
+	ck_assert_int_eq(jitter_buffer_put(&jb, big, sizeof(big), 113, 10), -1);
+	ck_assert_int_eq(errno, EMSGSIZE);
+
+	jitter_buffer_free(&jb);
+
+} END_TEST
+
+START_TEST(test_resampler) {
+
+	static int16_t in[2 * 4800];
+	static int16_t out[2 * 4800];
+	struct resampler r;
+	size_t i, n, frames, total = 0;
+
+	/* unsupported conversion ratio */
+	ck_assert_int_eq(resampler_init(&r, RESAMPLER_QUALITY_FAST, 2, 44100, 44101), -1);
+	ck_assert_int_eq(errno, EINVAL);
+
+	ck_assert_int_eq(resampler_init(&r, RESAMPLER_QUALITY_MEDIUM, 2, 48000, 44100), 0);
+	ck_assert_int_eq(r.up, 147);
+	ck_assert_int_eq(r.down, 160);
+	ck_assert_int_eq(resampler_get_delay(&r), 3);
+
+	for (i = 0; i < ARRAYSIZE(in) / 2; i++)
+		in[i * 2] = in[i * 2 + 1] = 8192;
+
+	/* DC signal is passed with the unity gain, and the output rate
+	 * matches the requested one regardless of the input block size */
+	for (i = 0; i < ARRAYSIZE(in) / 2; i += n) {
+		n = ARRAYSIZE(in) / 2 - i < 100 ? ARRAYSIZE(in) / 2 - i : 100;
+		frames = n;
+		total += resampler_process(&r, &in[i * 2], &frames, &out[total * 2], 4800 - total);
+		ck_assert_int_eq(frames, n);
+	}
+	ck_assert_int_eq(total, 4410);
+	for (i = 100; i < total; i++) {
+		ck_assert_int_le(abs(out[i * 2] - 8192), 2);
+		ck_assert_int_eq(out[i * 2], out[i * 2 + 1]);
+	}
+
+	/* the amount of the input data required for the exact output */
+	frames = resampler_input_frames(&r, 441);
+	ck_assert_int_eq(resampler_process(&r, in, &frames, out, 441), 441);
+	ck_assert_int_le(frames = resampler_input_frames(&r, 1), 2);
+	ck_assert_int_eq(resampler_process(&r, in, &frames, out, 1), 1);
+
+	/* output is limited by the buffer size */
+	frames = 1000;
+	ck_assert_int_eq(resampler_process(&r, in, &frames, out, 10), 10);
+	ck_assert_int_lt(frames, 1000);
+
+	resampler_free(&r);
+
+} END_TEST
+
+START_TEST(test_drift_estimator) {
+
+	struct drift_estimator d;
+	struct timespec ts;
+	uint32_t rtp_ts = 0x7FFFF000;
+	uint64_t usec;
+	size_t i;
+
+	drift_estimator_init(&d, 48000);
+	srand(7);
+
+	/* Remote clock is faster by 50 ppm, so 10 ms worth of RTP ticks arrive
+	 * slightly earlier. Packets are delayed by the random jitter up to 20 ms,
+	 * and the RTP time-stamp wraps around in the meantime. */
+	for (i = 0; i < 40000; i++, rtp_ts += 480) {
+		usec = i * 10000 / (1 + 50e-6) + rand() % 20000;
+		ts.tv_sec = usec / 1000000;
+		ts.tv_nsec = usec % 1000000 * 1000;
+		drift_estimator_update(&d, rtp_ts, &ts);
+	}
+
+	ck_assert_int_eq(d.rtp_rate, 48000);
+	ck_assert_int_le(abs(drift_estimator_get_ppm(&d) - 50), 5);
+
+	/* the estimation is retained after the stream pause */
+	usec += 5 * 1000000;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = usec % 1000000 * 1000;
+	drift_estimator_update(&d, rtp_ts, &ts);
+	ck_assert_int_eq(d.len, 0);
+	ck_assert_int_le(abs(drift_estimator_get_ppm(&d) - 50), 5);
+
+	/* 10 kHz RTP clock is detected as well */
+	drift_estimator_init(&d, 44100);
+	for (i = 0, rtp_ts = 0; i < 1000; i++, rtp_ts += 100) {
+		usec = i * 10000;
+		ts.tv_sec = usec / 1000000;
+		ts.tv_nsec = usec % 1000000 * 1000;
+		drift_estimator_update(&d, rtp_ts, &ts);
+	}
+	ck_assert_int_eq(d.rtp_rate, 10000);
+	ck_assert_int_eq(drift_estimator_get_ppm(&d), 0);
+
+} END_TEST
+
+START_TEST(test_drift_controller) {
+
+	struct drift_controller c;
+	size_t i;
+	int ppm;
+
+	drift_controller_init(&c, 48000, 4800);
+
+	/* buffer at the target level - no correction */
+	ck_assert_int_eq(drift_controller_update(&c, 4800, 100000, 0), 0);
+	/* the feed-forward is applied directly */
+	ck_assert_int_eq(drift_controller_update(&c, 4800, 100000, 30), 30);
+
+	/* buffer is too full, so it has to be consumed faster */
+	for (i = 0; i < 10; i++)
+		ppm = drift_controller_update(&c, 4800 + 480, 100000, 0);
+	ck_assert_int_gt(ppm, 0);
+	ck_assert_int_le(ppm, DRIFT_PPM_MAX);
+
+	/* the correction is limited */
+	for (i = 0; i < 100; i++)
+		ppm = drift_controller_update(&c, 48000, 100000, 0);
+	ck_assert_int_eq(ppm, DRIFT_PPM_MAX);
+	for (i = 0; i < 100; i++)
+		ppm = drift_controller_update(&c, 0, 100000, 0);
+	ck_assert_int_eq(ppm, -DRIFT_PPM_MAX);
+
+} END_TEST
+
+START_TEST(test_drift_resampler) {
+
+	static int16_t in[2 * 10000];
+	static int16_t out[2 * 10100];
+	struct drift_resampler r;
+	size_t i, n, frames, total;
+
+	ck_assert_int_eq(drift_resampler_init(&r, DRIFT_CHANNELS_MAX + 1), -1);
+	ck_assert_int_eq(errno, EINVAL);
+	ck_assert_int_eq(drift_resampler_init(&r, 2), 0);
+
+	for (i = 0; i < ARRAYSIZE(in) / 2; i++) {
+		in[i * 2] = i;
+		in[i * 2 + 1] = -i;
+	}
+
+	/* without the correction, the signal is passed through unchanged,
+	 * regardless of the input block size */
+	for (i = total = 0; i < 1000; i += frames) {
+		n = frames = i + 7 > 1000 ? 1000 - i : 7;
+		total += drift_resampler_process(&r, &in[i * 2], &frames, &out[total * 2], 2000);
+		ck_assert_int_eq(frames, n);
+	}
+	ck_assert_int_eq(total, 999);
+	for (i = 0; i < total; i++) {
+		ck_assert_int_eq(out[i * 2], i);
+		ck_assert_int_eq(out[i * 2 + 1], -(int)i);
+	}
+
+	/* with the positive correction, less frames are generated */
+	drift_resampler_reset(&r);
+	drift_resampler_set_ppm(&r, 1000);
+	frames = 10000;
+	total = drift_resampler_process(&r, in, &frames, out, 10100);
+	ck_assert_int_eq(frames, 10000);
+	ck_assert_int_le(abs((int)total - 9990), 1);
+	/* interpolated ramp stays monotonic */
+	for (i = 1; i < total; i++)
+		ck_assert_int_ge(out[i * 2], out[(i - 1) * 2]);
+
+	/* with the negative correction, more frames are generated */
+	drift_resampler_reset(&r);
+	drift_resampler_set_ppm(&r, -1000);
+	frames = 10000;
+	total = drift_resampler_process(&r, in, &frames, out, 10100);
+	ck_assert_int_le(abs((int)total - 10010), 1);
+
+	/* output is limited by the buffer size */
+	frames = 1000;
+	ck_assert_int_eq(drift_resampler_process(&r, in, &frames, out, 10), 10);
+	ck_assert_int_lt(frames, 1000);
+
+} END_TEST
+
+static unsigned int codec_cache_freed = 0;
+static void codec_cache_test_free(void *handle) {
+	codec_cache_freed++;
+	free(handle);
+}
+
+START_TEST(test_codec_cache) {
+
+	const uint8_t cconfig1[] = { 0x11, 0x22 };
+	const uint8_t cconfig2[] = { 0x11, 0x23 };
+	struct codec_cache cache;
+	struct codec_cache_entry e;
+	void *handle;
+	size_t i;
+
+	codec_cache_init(&cache);
+
+	/* empty cache - handle has to be created by the caller */
+	ck_assert_ptr_eq(codec_cache_take(&cache, &e, 2, true, cconfig1, sizeof(cconfig1), 0), NULL);
+	e.handle = handle = malloc(1);
+	e.free = codec_cache_test_free;
+
+	/* not reusable context is freed upon release */
+	codec_cache_release(&e);
+	ck_assert_int_eq(codec_cache_freed, 1);
+	ck_assert_int_eq(cache.len, 0);
+
+	codec_cache_take(&cache, &e, 2, true, cconfig1, sizeof(cconfig1), 0);
+	e.handle = handle = malloc(1);
+	e.free = codec_cache_test_free;
+	e.reusable = true;
+	codec_cache_release(&e);
+	ck_assert_int_eq(cache.len, 1);
+
+	/* context is taken by the exact key only */
+	ck_assert_ptr_eq(codec_cache_take(&cache, &e, 2, false, cconfig1, sizeof(cconfig1), 0), NULL);
+	ck_assert_ptr_eq(codec_cache_take(&cache, &e, 2, true, cconfig2, sizeof(cconfig2), 0), NULL);
+	ck_assert_ptr_eq(codec_cache_take(&cache, &e, 2, true, cconfig1, sizeof(cconfig1), 1), NULL);
+	ck_assert_ptr_eq(codec_cache_take(&cache, &e, 2, true, cconfig1, sizeof(cconfig1), 0), handle);
+	ck_assert_int_eq(cache.len, 0);
+
+	/* the least recently released context is evicted */
+	codec_cache_freed = 0;
+	for (i = 0; i <= CODEC_CACHE_SIZE; i++) {
+		ck_assert_ptr_eq(codec_cache_take(&cache, &e, 2, true, cconfig1, sizeof(cconfig1), i + 1), NULL);
+		e.handle = malloc(1);
+		e.free = codec_cache_test_free;
+		e.reusable = true;
+		codec_cache_release(&e);
+	}
+	ck_assert_int_eq(codec_cache_freed, 1);
+	ck_assert_int_eq(cache.len, CODEC_CACHE_SIZE);
+	ck_assert_ptr_eq(codec_cache_take(&cache, &e, 2, true, cconfig1, sizeof(cconfig1), 1), NULL);
+
+	/* previously taken context is still owned by us */
+	free(handle);
+
+	codec_cache_free(&cache);
+	ck_assert_int_eq(codec_cache_freed, 1 + CODEC_CACHE_SIZE);
+
+} END_TEST
+
+START_TEST(test_link_history) {
+
+	const bdaddr_t addr1 = {{ 1, 2, 3, 4, 5, 6 }};
+	const bdaddr_t addr2 = {{ 1, 2, 3, 4, 5, 7 }};
+	struct link_history h;
+	bdaddr_t addr;
+	size_t i;
+
+	link_history_init(&h);
+
+	/* unknown device starts with the highest quality */
+	ck_assert_int_eq(link_history_get_level(&h, &addr1, 0, 8), 0);
+
+	link_history_update(&h, &addr1, 0, 3, 8);
+	ck_assert_int_eq(link_history_get_level(&h, &addr1, 0, 8), 3);
+	/* history is kept per device and codec */
+	ck_assert_int_eq(link_history_get_level(&h, &addr2, 0, 8), 0);
+	ck_assert_int_eq(link_history_get_level(&h, &addr1, 2, 8), 0);
+
+	/* level is scaled (towards lower quality) to the number of levels */
+	ck_assert_int_eq(link_history_get_level(&h, &addr1, 0, 15), 6);
+	ck_assert_int_eq(link_history_get_level(&h, &addr1, 0, 3), 1);
+	ck_assert_int_eq(link_history_get_level(&h, &addr1, 0, 1), 0);
+
+	/* the last update wins */
+	link_history_update(&h, &addr1, 0, 1, 8);
+	ck_assert_int_eq(link_history_get_level(&h, &addr1, 0, 8), 1);
+
+	/* the least recently updated entry is evicted */
+	for (i = 0; i < LINK_HISTORY_SIZE; i++) {
+		bacpy(&addr, &addr2);
+		addr.b[0] = i;
+		link_history_update(&h, &addr, 0, 2, 8);
+	}
+	ck_assert_int_eq(h.len, LINK_HISTORY_SIZE);
+	ck_assert_int_eq(link_history_get_level(&h, &addr1, 0, 8), 0);
+	ck_assert_int_eq(link_history_get_level(&h, &addr, 0, 8), 2);
+
+	link_history_free(&h);
+
+} END_TEST
+
+START_TEST(test_mem_pool) {
+
+	struct mem_pool pool = MEM_POOL_INITIALIZER(uint64_t[4]);
+	void *objects[MEM_POOL_SIZE + 1];
+	uint64_t *v;
+	size_t i;
+
+	ck_assert_ptr_ne(v = mem_pool_alloc(&pool), NULL);
+	v[0] = v[3] = 0xDEAD;
+
+	/* released object shall be reused and zeroed */
+	mem_pool_release(&pool, v);
+	ck_assert_int_eq(pool.len, 1);
+	ck_assert_ptr_eq(mem_pool_alloc(&pool), v);
+	ck_assert_int_eq(pool.len, 0);
+	ck_assert_int_eq(v[0], 0);
+	ck_assert_int_eq(v[3], 0);
+	mem_pool_release(&pool, v);
+
+	/* objects above the pool size are freed */
+	for (i = 0; i < ARRAYSIZE(objects); i++)
+		ck_assert_ptr_ne(objects[i] = mem_pool_alloc(&pool), NULL);
+	for (i = 0; i < ARRAYSIZE(objects); i++)
+		mem_pool_release(&pool, objects[i]);
+	ck_assert_int_eq(pool.len, MEM_POOL_SIZE);
+
+	mem_pool_free(&pool);
+	ck_assert_int_eq(pool.len, 0);
+
+} END_TEST
+
+START_TEST(test_capture) {
+
+	char path[] = "/tmp/test-capture-XXXXXX";
+	const bdaddr_t addr = {{ 1, 2, 3, 4, 5, 6 }};
+	uint8_t data[CAPTURE_SNAPLEN + 16] = { 0xAB, 0xCD };
+	struct capture c;
+	int fd;
+
+	ck_assert_int_ne(fd = mkstemp(path), -1);
+	close(fd);
+
+	capture_init(&c);
+
+	/* disabled capture does not touch anything */
+	capture_record(&c, &addr, 1, 2, CAPTURE_TYPE_BT_IN, data, 2);
+	ck_assert_ptr_eq(c.header, NULL);
+
+	ck_assert_int_eq(capture_start(&c, path, 2), 0);
+	capture_record(&c, &addr, 1, 2, CAPTURE_TYPE_BT_IN, data, 2);
+	capture_record(&c, &addr, 1, 2, CAPTURE_TYPE_PCM_OUT, data, 4);
+	/* the oldest record is overwritten and long chunk is truncated */
+	capture_record(&c, &addr, 1, 2, CAPTURE_TYPE_BT_OUT, data, sizeof(data));
+
+	const struct capture_header *h = c.header;
+	const struct capture_record *r1 = (void *)((uint8_t *)h + CAPTURE_HEADER_SIZE);
+	const struct capture_record *r2 = (void *)((uint8_t *)r1 + h->record_size);
+
+	ck_assert_int_eq(h->magic, CAPTURE_MAGIC);
+	ck_assert_int_eq(h->records, 2);
+	ck_assert_int_eq(h->seq, 3);
+	ck_assert_int_eq(r1->seq, 3);
+	ck_assert_int_eq(r1->type, CAPTURE_TYPE_BT_OUT);
+	ck_assert_int_eq(r1->len, CAPTURE_SNAPLEN);
+	ck_assert_int_eq(r1->orig_len, sizeof(data));
+	ck_assert_int_eq(r2->seq, 2);
+	ck_assert_int_eq(r2->type, CAPTURE_TYPE_PCM_OUT);
+	ck_assert_int_eq(r2->len, 4);
+	ck_assert_int_eq(bacmp(&r2->addr, &addr), 0);
+	ck_assert_int_eq(r2->data[1], 0xCD);
+	ck_assert_int_le(r2->timestamp, r1->timestamp);
+
+	capture_stop(&c);
+	ck_assert_ptr_eq(c.header, NULL);
+	capture_record(&c, &addr, 1, 2, CAPTURE_TYPE_BT_IN, data, 2);
+
+	unlink(path);
+
+} END_TEST
+
 START_TEST(test_dbus_profile_object_path) {
 
 	static const struct {
@@ -43,6 +612,10 @@ START_TEST(test_dbus_profile_object_path) {
 		{ BLUETOOTH_PROFILE_A2DP_SOURCE, A2DP_CODEC_VENDOR_APTX, "/A2DP/APTX/Source" },
 		{ BLUETOOTH_PROFILE_A2DP_SINK, A2DP_CODEC_VENDOR_APTX, "/A2DP/APTX/Sink" },
 #endif
+#if ENABLE_APTX_HD
+		{ BLUETOOTH_PROFILE_A2DP_SOURCE, A2DP_CODEC_VENDOR_APTX_HD, "/A2DP/APTXHD/Source" },
+		{ BLUETOOTH_PROFILE_A2DP_SINK, A2DP_CODEC_VENDOR_APTX_HD, "/A2DP/APTXHD/Sink" },
+#endif
 #if ENABLE_LDAC
 		{ BLUETOOTH_PROFILE_A2DP_SOURCE, A2DP_CODEC_VENDOR_LDAC, "/A2DP/LDAC/Source" },
 		{ BLUETOOTH_PROFILE_A2DP_SINK, A2DP_CODEC_VENDOR_LDAC, "/A2DP/LDAC/Sink" },
@@ -64,12 +637,51 @@ START_TEST(test_dbus_profile_object_path) {
 
 } END_TEST
 
+START_TEST(test_dbus_object_path_to_hci_dev_id) {
+
+	ck_assert_int_eq(g_dbus_object_path_to_hci_dev_id("/org/bluez/hci0"), 0);
+	ck_assert_int_eq(g_dbus_object_path_to_hci_dev_id("/org/bluez/hci12"), 12);
+	ck_assert_int_eq(g_dbus_object_path_to_hci_dev_id("/org/bluez/hci1/dev_12_34_56_78_9A_BC"), 1);
+	ck_assert_int_eq(g_dbus_object_path_to_hci_dev_id("/org/bluez/hci1/dev_12_34_56_78_9A_BC/fd0"), 1);
+
+	ck_assert_int_eq(g_dbus_object_path_to_hci_dev_id("/org/bluez"), -1);
+	ck_assert_int_eq(g_dbus_object_path_to_hci_dev_id("/org/bluez/hci"), -1);
+	ck_assert_int_eq(g_dbus_object_path_to_hci_dev_id("/org/bluez/hciX"), -1);
+	ck_assert_int_eq(g_dbus_object_path_to_hci_dev_id("/org/bluez/hci1x/dev_12_34_56_78_9A_BC"), -1);
+	ck_assert_int_eq(g_dbus_object_path_to_hci_dev_id("/org/bluez/hci9999"), -1);
+
+} END_TEST
+
+START_TEST(test_cpulist_to_mask) {
+
+	uint64_t mask;
+
+	ck_assert_int_eq(cpulist_to_mask("0", &mask), 0);
+	ck_assert_int_eq(mask, 0x1);
+	ck_assert_int_eq(cpulist_to_mask("1,3", &mask), 0);
+	ck_assert_int_eq(mask, 0xA);
+	ck_assert_int_eq(cpulist_to_mask("0-2,5,8-9", &mask), 0);
+	ck_assert_int_eq(mask, 0x327);
+	ck_assert_int_eq(cpulist_to_mask("63", &mask), 0);
+	ck_assert_int_eq(mask == 0x8000000000000000ULL, 1);
+
+	mask = 0xFF;
+	ck_assert_int_eq(cpulist_to_mask("", &mask), -1);
+	ck_assert_int_eq(cpulist_to_mask("1,", &mask), -1);
+	ck_assert_int_eq(cpulist_to_mask("3-1", &mask), -1);
+	ck_assert_int_eq(cpulist_to_mask("64", &mask), -1);
+	ck_assert_int_eq(cpulist_to_mask("0-x", &mask), -1);
+	ck_assert_int_eq(errno, EINVAL);
+	ck_assert_int_eq(mask, 0xFF);
+
+} END_TEST
+
 START_TEST(test_pcm_scale_s16le) {
 
 	const int16_t mute[] = { 0x0000, 0x0000, 0x0000, 0x0000 };
-	const int16_t half[] = { 0x1234 / 2, 0x2345 / 2, (int16_t)0xBCDE / 2, (int16_t)0xCDEF / 2 };
+	const int16_t half[] = { 0x1234 / 2, (0x2345 + 1) / 2, (int16_t)0xBCDE / 2, ((int16_t)0xCDEF + 1) / 2 };
 	const int16_t halfl[] = { 0x1234 / 2, 0x2345, (int16_t)0xBCDE / 2, 0xCDEF };
-	const int16_t halfr[] = { 0x1234, 0x2345 / 2, 0xBCDE, (int16_t)0xCDEF / 2 };
+	const int16_t halfr[] = { 0x1234, (0x2345 + 1) / 2, 0xBCDE, ((int16_t)0xCDEF + 1) / 2 };
 	const int16_t in[] = { 0x1234, 0x2345, 0xBCDE, 0xCDEF };
 	int16_t tmp[ARRAYSIZE(in)];
 
@@ -78,21 +690,110 @@ START_TEST(test_pcm_scale_s16le) {
 	ck_assert_int_eq(memcmp(tmp, mute, sizeof(mute)), 0);
 
 	memcpy(tmp, in, sizeof(tmp));
-	snd_pcm_scale_s16le(tmp, ARRAYSIZE(tmp), 1, 1.0, 1.0);
+	snd_pcm_scale_s16le(tmp, ARRAYSIZE(tmp), 1, SND_PCM_GAIN_UNITY, SND_PCM_GAIN_UNITY);
 	ck_assert_int_eq(memcmp(tmp, in, sizeof(in)), 0);
 
 	memcpy(tmp, in, sizeof(tmp));
-	snd_pcm_scale_s16le(tmp, ARRAYSIZE(tmp), 1, 0.5, 0.5);
+	snd_pcm_scale_s16le(tmp, ARRAYSIZE(tmp), 1, 0x4000, 0x4000);
 	ck_assert_int_eq(memcmp(tmp, half, sizeof(half)), 0);
 
 	memcpy(tmp, in, sizeof(tmp));
-	snd_pcm_scale_s16le(tmp, ARRAYSIZE(tmp), 2, 0.5, 1.0);
+	snd_pcm_scale_s16le(tmp, ARRAYSIZE(tmp), 2, 0x4000, SND_PCM_GAIN_UNITY);
 	ck_assert_int_eq(memcmp(tmp, halfl, sizeof(halfl)), 0);
 
 	memcpy(tmp, in, sizeof(tmp));
-	snd_pcm_scale_s16le(tmp, ARRAYSIZE(tmp), 2, 1.0, 0.5);
+	snd_pcm_scale_s16le(tmp, ARRAYSIZE(tmp), 2, SND_PCM_GAIN_UNITY, 0x4000);
 	ck_assert_int_eq(memcmp(tmp, halfr, sizeof(halfr)), 0);
 
+	ck_assert_int_eq(snd_pcm_volume_gain[127], SND_PCM_GAIN_UNITY);
+	ck_assert_int_gt(snd_pcm_volume_gain[0], 0);
+
+} END_TEST
+
+START_TEST(test_pcm_scale_s16le_vector) {
+
+	int16_t buffer[2 * 37 + 1];
+	int16_t expected[ARRAYSIZE(buffer)];
+	size_t i;
+
+	/* use odd number of samples, so the scalar tail is exercised as well */
+	for (i = 0; i < ARRAYSIZE(buffer); i++)
+		buffer[i] = (i % 2 ? -1 : 1) * (int16_t)(i * 887);
+
+	for (i = 0; i < ARRAYSIZE(buffer); i++) {
+		const uint16_t gain = i % 2 ? SND_PCM_GAIN_UNITY : snd_pcm_volume_gain[100];
+		expected[i] = (buffer[i] * gain + (1 << 14)) >> 15;
+	}
+
+	snd_pcm_scale_s16le(buffer, ARRAYSIZE(buffer), 2,
+			snd_pcm_volume_gain[100], SND_PCM_GAIN_UNITY);
+	ck_assert_int_eq(memcmp(buffer, expected, sizeof(expected)), 0);
+
+} END_TEST
+
+START_TEST(test_pcm_deinterleave_s16le) {
+
+	int16_t buffer[2 * 37];
+	int32_t ch1[37], ch2[37];
+	size_t i;
+
+	/* use odd number of frames, so the scalar tail is exercised as well */
+	for (i = 0; i < ARRAYSIZE(buffer); i++)
+		buffer[i] = (i % 2 ? -1 : 1) * (int16_t)(i * 887);
+
+	snd_pcm_deinterleave_s16le(buffer, ARRAYSIZE(ch1), 0, ch1, ch2);
+	for (i = 0; i < ARRAYSIZE(ch1); i++) {
+		ck_assert_int_eq(ch1[i], buffer[2 * i]);
+		ck_assert_int_eq(ch2[i], buffer[2 * i + 1]);
+	}
+
+	/* expansion to the 24-bit resolution */
+	snd_pcm_deinterleave_s16le(buffer, ARRAYSIZE(ch1), 8, ch1, ch2);
+	for (i = 0; i < ARRAYSIZE(ch1); i++) {
+		ck_assert_int_eq(ch1[i], buffer[2 * i] * 256);
+		ck_assert_int_eq(ch2[i], buffer[2 * i + 1] * 256);
+	}
+
+} END_TEST
+
+START_TEST(test_pcm_scale_wide) {
+
+	const uint8_t in24[] = { 0x56, 0x34, 0x12, 0x22, 0xED, 0xCB, 0xFF, 0xFF, 0x7F };
+	const uint8_t half24[] = { 0x2B, 0x1A, 0x09, 0x91, 0xF6, 0xE5, 0x00, 0x00, 0x40 };
+	uint8_t tmp24[sizeof(in24)];
+
+	memcpy(tmp24, in24, sizeof(tmp24));
+	snd_pcm_scale_s24_3le(tmp24, 3, 1, 0x4000, 0x4000);
+	ck_assert_int_eq(memcmp(tmp24, half24, sizeof(half24)), 0);
+
+	memcpy(tmp24, in24, sizeof(tmp24));
+	snd_pcm_scale_s24_3le(tmp24, 3, 2, SND_PCM_GAIN_UNITY, 0);
+	ck_assert_int_eq(memcmp(tmp24, in24, 3), 0);
+	ck_assert_int_eq(memcmp(&tmp24[3], "\0\0\0", 3), 0);
+	ck_assert_int_eq(memcmp(&tmp24[6], &in24[6], 3), 0);
+
+	/* saturation of the signal amplified above the unity gain */
+	memcpy(tmp24, in24, sizeof(tmp24));
+	snd_pcm_scale_s24_3le(tmp24, 3, 1, 0xFFFF, 0xFFFF);
+	ck_assert_int_eq(memcmp(&tmp24[6], "\xFF\xFF\x7F", 3), 0);
+
+	const int32_t in32[] = { 0x12345678, (int32_t)0xBCDEF012, INT32_MAX, INT32_MIN };
+	const int32_t half32[] = { 0x12345678 / 2, (int32_t)0xBCDEF012 / 2, INT32_MAX, INT32_MIN };
+	int32_t tmp32[ARRAYSIZE(in32)];
+
+	memcpy(tmp32, in32, sizeof(tmp32));
+	snd_pcm_scale_s32le(tmp32, 2, 1, 0x4000, 0x4000);
+	snd_pcm_scale_s32le(&tmp32[2], 2, 2, 0xFFFF, 0xFFFF);
+	ck_assert_int_eq(memcmp(tmp32, half32, sizeof(half32)), 0);
+
+	float tmpf[] = { 0.5, -0.5, 0.75, -0.75 };
+
+	snd_pcm_scale_float_le(tmpf, ARRAYSIZE(tmpf), 2, 0x4000, 0xFFFF);
+	ck_assert(tmpf[0] == 0.25f);
+	ck_assert(tmpf[1] < -0.99f && tmpf[1] > -1.0f);
+	ck_assert(tmpf[2] == 0.375f);
+	ck_assert(tmpf[3] == -1.0f);
+
 } END_TEST
 
 START_TEST(test_difftimespec) {
@@ -139,17 +840,50 @@ START_TEST(test_difftimespec) {
 
 } END_TEST
 
+START_TEST(test_asrsync) {
+
+	struct asrsync asrs = { .frames = 0 };
+	struct timespec ts0, ts;
+
+	/* 10 ms of audio at 8 kHz is paced with an absolute deadline */
+	asrsync_init(&asrs, 8000);
+	clock_gettime(ASRSYNC_CLOCK, &ts0);
+	ck_assert_int_eq(asrsync_is_overdue(&asrs, 80), false);
+	ck_assert_int_eq(asrsync_sync(&asrs, 80), 1);
+	clock_gettime(ASRSYNC_CLOCK, &ts);
+	difftimespec(&ts0, &ts, &ts);
+	ck_assert_int_ge(ts.tv_nsec, 9000000);
+
+	/* burst mode keeps the original time line after an overrun */
+	usleep(30000);
+	ck_assert_int_eq(asrsync_is_overdue(&asrs, 80), true);
+	ck_assert_int_eq(asrsync_sync(&asrs, 80), 0);
+	ck_assert_int_ge(asrsync_get_overdue_usec(&asrs), 15000);
+	ck_assert_int_eq(asrsync_sync(&asrs, 80), 0);
+	ck_assert_int_eq(asrs.skipped, 0);
+
+	/* skip mode moves the time line by the overdue time */
+	asrs.catchup = ASRSYNC_CATCHUP_SKIP;
+	asrsync_init(&asrs, 8000);
+	usleep(30000);
+	ck_assert_int_eq(asrsync_sync(&asrs, 80), 0);
+	ck_assert_int_ge(asrs.skipped, 15000);
+	ck_assert_int_eq(asrsync_sync(&asrs, 80), 1);
+	ck_assert_int_eq(asrs.frames, 160);
+
+} END_TEST
+
 START_TEST(test_fifo_buffer) {
 
 	ffb_uint8_t ffb_u8 = { 0 };
 	ffb_int16_t ffb_16 = { 0 };
 
-	ck_assert_ptr_ne(ffb_init(&ffb_u8, 64), NULL);
-	ck_assert_ptr_eq(ffb_u8.data, ffb_u8.tail);
+	ck_assert_int_eq(ffb_uint8_init(&ffb_u8, 64), 0);
+	ck_assert_ptr_eq(ffb_u8.head, ffb_u8.tail);
 	ck_assert_int_eq(ffb_u8.size, 64);
 
-	ck_assert_ptr_ne(ffb_init(&ffb_16, 64), NULL);
-	ck_assert_ptr_eq(ffb_16.data, ffb_16.tail);
+	ck_assert_int_eq(ffb_int16_init(&ffb_16, 64), 0);
+	ck_assert_ptr_eq(ffb_16.head, ffb_16.tail);
 	ck_assert_int_eq(ffb_16.size, 64);
 
 	memcpy(ffb_u8.data, "1234567890ABCDEFGHIJKLMNOPQRSTUVWXYZ", 36);
@@ -173,14 +907,271 @@ START_TEST(test_fifo_buffer) {
 	ffb_shift(&ffb_u8, 15);
 	ck_assert_int_eq(ffb_len_in(&ffb_u8), 64 - (36 - 15));
 	ck_assert_int_eq(ffb_len_out(&ffb_u8), 36 - 15);
-	ck_assert_int_eq(memcmp(ffb_u8.data, "FGHIJKLMNOPQRSTUVWXYZ", ffb_len_out(&ffb_u8)), 0);
+	ck_assert_int_eq(memcmp(ffb_u8.head, "FGHIJKLMNOPQRSTUVWXYZ", ffb_len_out(&ffb_u8)), 0);
 	ck_assert_int_eq(ffb_u8.tail[-1], 'Z');
 
 	ffb_rewind(&ffb_u8);
+	ck_assert_ptr_eq(ffb_u8.data, ffb_u8.head);
 	ck_assert_ptr_eq(ffb_u8.data, ffb_u8.tail);
 
 	ffb_uint8_free(&ffb_u8);
 	ck_assert_ptr_eq(ffb_u8.data, NULL);
+	ffb_int16_free(&ffb_16);
+	ck_assert_ptr_eq(ffb_16.data, NULL);
+
+} END_TEST
+
+START_TEST(test_fifo_buffer_ring) {
+
+	ffb_uint8_t ffb = { 0 };
+	size_t i;
+
+	ck_assert_int_eq(ffb_uint8_init(&ffb, 64), 0);
+	ck_assert_int_ge(ffb.ring, 64);
+	/* use the whole mapped ring */
+	ck_assert_int_eq(ffb_uint8_init(&ffb, ffb.ring), 0);
+	ck_assert_int_eq(ffb.size, ffb.ring);
+
+	/* move the head close to the end of the ring */
+	ffb_seek(&ffb, ffb.ring - 10);
+	ffb_shift(&ffb, ffb.ring - 10);
+	ck_assert_int_eq(ffb_len_out(&ffb), 0);
+	ck_assert_ptr_eq(ffb.head, ffb.data + ffb.ring - 10);
+
+	/* write across the ring boundary as a single block */
+	memcpy(ffb.tail, "1234567890ABCDEFGHIJ", 20);
+	ffb_seek(&ffb, 20);
+	ck_assert_int_eq(ffb_len_out(&ffb), 20);
+	ck_assert_int_eq(memcmp(ffb.head, "1234567890ABCDEFGHIJ", 20), 0);
+	/* wrapped data shall be visible at the beginning of the ring */
+	ck_assert_int_eq(memcmp(ffb.data, "ABCDEFGHIJ", 10), 0);
+
+	/* shifting past the ring end shall wrap both pointers */
+	ffb_shift(&ffb, 15);
+	ck_assert_ptr_eq(ffb.head, ffb.data + 5);
+	ck_assert_int_eq(ffb_len_out(&ffb), 5);
+	ck_assert_int_eq(memcmp(ffb.head, "FGHIJ", 5), 0);
+
+	/* reallocation shall preserve stored data */
+	ck_assert_int_eq(ffb_uint8_init(&ffb, ffb.ring + 1), 0);
+	ck_assert_ptr_eq(ffb.head, ffb.data);
+	ck_assert_int_eq(ffb_len_out(&ffb), 5);
+	ck_assert_int_eq(memcmp(ffb.head, "FGHIJ", 5), 0);
+
+	/* fill the whole buffer in many steps without any data move */
+	ffb_rewind(&ffb);
+	for (i = 0; i < 10 * ffb.ring; i++) {
+		*ffb.tail = i;
+		ffb_seek(&ffb, 1);
+		if (ffb_len_in(&ffb) == 0)
+			ffb_shift(&ffb, 1);
+		ck_assert_int_eq(ffb.tail[-1], (uint8_t)i);
+	}
+
+	ffb_uint8_free(&ffb);
+	ck_assert_ptr_eq(ffb.data, NULL);
+
+} END_TEST
+
+START_TEST(test_fifo_buffer_pool) {
+
+	struct ffb_budget budget = { .limit = 0 };
+	ffb_uint8_t ffb = { 0 };
+	ffb_int16_t ffb2 = { 0 };
+	uint8_t *data;
+
+	ffb_pool_set_limit(1024 * 1024);
+	ffb_budget_attach(&budget);
+
+	ck_assert_int_eq(ffb_uint8_init(&ffb, 64), 0);
+	ck_assert_int_eq(atomic_load(&budget.used), ffb.ring);
+	memset(ffb.data, 0xAA, 64);
+	data = ffb.data;
+
+	/* released ring shall be reused by the buffer of the same size */
+	ffb_uint8_free(&ffb);
+	ck_assert_int_eq(atomic_load(&budget.used), 0);
+	ck_assert_int_eq(ffb_uint8_init(&ffb, 64), 0);
+	ck_assert_ptr_eq(ffb.data, data);
+	ck_assert_int_eq(ffb.data[0], 0);
+
+	/* budget is charged by all buffers and the peak is tracked */
+	ck_assert_int_eq(ffb_int16_init(&ffb2, 64), 0);
+	ck_assert_int_eq(atomic_load(&budget.used), ffb.ring + ffb2.ring * sizeof(int16_t));
+	const size_t peak = atomic_load(&budget.used);
+	ffb_int16_free(&ffb2);
+	ck_assert_int_eq(atomic_load(&budget.peak), peak);
+
+	/* allocation over the limit shall fail */
+	budget.limit = atomic_load(&budget.used);
+	ck_assert_int_eq(ffb_int16_init(&ffb2, 64), -1);
+	ck_assert_int_eq(errno, ENOMEM);
+	ck_assert_ptr_eq(ffb2.data, NULL);
+	/* stored data shall be preserved upon failed resize */
+	ck_assert_int_eq(ffb_uint8_init(&ffb, ffb.ring + 1), -1);
+	ck_assert_ptr_eq(ffb.data, data);
+
+	ffb_uint8_free(&ffb);
+	ck_assert_int_eq(atomic_load(&budget.used), 0);
+
+	ffb_budget_attach(NULL);
+	ffb_pool_set_limit(0);
+
+} END_TEST
+
+START_TEST(test_pcm_ring) {
+
+	struct pcm_ring writer = { 0 };
+	struct pcm_ring reader = { 0 };
+	uint8_t buffer[64];
+	eventfd_t value;
+	int memfd, data_fd, space_fd;
+
+	/* it shall be safe to free zero-initialized structure */
+	pcm_ring_free(&writer);
+
+	ck_assert_int_ne(memfd = pcm_ring_create(&writer, 60), -1);
+	ck_assert_int_eq(writer.ctrl->size, 64);
+
+	data_fd = dup(writer.data_fd);
+	space_fd = dup(writer.space_fd);
+	ck_assert_int_eq(pcm_ring_attach(&reader, memfd, data_fd, space_fd), 0);
+	ck_assert_int_eq(close(memfd), 0);
+
+	/* empty ring - there is a space, but no data */
+	ck_assert_int_eq(eventfd_read(reader.data_fd, &value), -1);
+	ck_assert_int_eq(eventfd_read(writer.space_fd, &value), 0);
+	eventfd_write(writer.space_fd, value);
+
+	ck_assert_int_eq(pcm_ring_write(&writer, "0123456789", 10), 10);
+	ck_assert_int_eq(pcm_ring_len_out(&reader), 10);
+	ck_assert_int_eq(pcm_ring_read(&reader, buffer, 4), 4);
+	ck_assert_int_eq(memcmp(buffer, "0123", 4), 0);
+	ck_assert_int_eq(pcm_ring_read(&reader, buffer, sizeof(buffer)), 6);
+	ck_assert_int_eq(memcmp(buffer, "456789", 6), 0);
+
+	/* drained ring shall clear the data doorbell */
+	ck_assert_int_eq(eventfd_read(reader.data_fd, &value), -1);
+
+	/* write across the ring boundary */
+	memset(buffer, 'X', sizeof(buffer));
+	ck_assert_int_eq(pcm_ring_write(&writer, buffer, 50), 50);
+	ck_assert_int_eq(pcm_ring_write(&writer, "ABCDEFGHIJKLMNOPQRSTUVWXYZ", 26), 14);
+	ck_assert_int_eq(pcm_ring_len_in(&writer), 0);
+	/* full ring shall clear the space doorbell */
+	ck_assert_int_eq(eventfd_read(writer.space_fd, &value), -1);
+
+	ck_assert_int_eq(pcm_ring_read(&reader, buffer, 50), 50);
+	/* reader has made some space, so the writer shall be notified */
+	ck_assert_int_eq(eventfd_read(writer.space_fd, &value), 0);
+	ck_assert_int_eq(pcm_ring_read(&reader, buffer, sizeof(buffer)), 14);
+	ck_assert_int_eq(memcmp(buffer, "ABCDEFGHIJKLMN", 14), 0);
+
+	ck_assert_int_eq(pcm_ring_closed(&reader), false);
+	pcm_ring_close(&writer);
+	ck_assert_int_eq(pcm_ring_closed(&reader), true);
+	ck_assert_int_eq(eventfd_read(reader.data_fd, &value), 0);
+
+	/* the ring size is latched, so it can not be extended by the other side */
+	reader.ctrl->size = 1 << 20;
+	ck_assert_int_eq(pcm_ring_len_in(&writer), 64);
+	/* counters which do not fit the ring break it, nothing is copied */
+	atomic_store(&reader.ctrl->tail, atomic_load(&reader.ctrl->head) - 65);
+	ck_assert_int_eq(pcm_ring_read(&reader, buffer, sizeof(buffer)), 0);
+	ck_assert_int_eq(reader.broken, true);
+	ck_assert_int_eq(pcm_ring_write(&writer, "0123", 4), 0);
+	ck_assert_int_eq(pcm_ring_closed(&writer), true);
+
+	pcm_ring_free(&reader);
+	pcm_ring_free(&writer);
+	ck_assert_ptr_eq(writer.ctrl, NULL);
+
+} END_TEST
+
+START_TEST(test_pcm_status) {
+
+	struct pcm_status writer = { 0 };
+	struct pcm_status reader = { 0 };
+	struct pcm_status_data data;
+	int fd;
+
+	/* it shall be safe to free zero-initialized structure */
+	pcm_status_free(&writer);
+
+	ck_assert_int_eq(pcm_status_create(&writer), 0);
+
+	const struct pcm_status_data data0 = { 200, 1024, 4096, 123456789 };
+	pcm_status_update(&writer, &data0);
+	ck_assert_int_eq(atomic_load(&writer.page->seq), 2);
+
+	ck_assert_int_ne(fd = pcm_status_dup_readonly(&writer), -1);
+	ck_assert_int_eq(pcm_status_attach(&reader, fd), 0);
+	ck_assert_int_eq(close(fd), 0);
+
+	pcm_status_read(&reader, &data);
+	ck_assert_int_eq(data.delay, 200);
+	ck_assert_int_eq(data.bt_queued, 1024);
+	ck_assert_int_eq(data.hw_ptr, 4096);
+	ck_assert_int_eq(data.timestamp, 123456789);
+
+	/* reader shall see the most recent update */
+	const struct pcm_status_data data1 = { 150, 0, 8192, 123466789 };
+	pcm_status_update(&writer, &data1);
+	pcm_status_read(&reader, &data);
+	ck_assert_int_eq(data.delay, 150);
+	ck_assert_int_eq(data.hw_ptr, 8192);
+	pcm_status_free(&reader);
+
+	/* attaching to something else than the status page shall fail */
+	ck_assert_int_ne(fd = open("/dev/null", O_RDONLY), -1);
+	ck_assert_int_eq(pcm_status_attach(&reader, fd), -1);
+	ck_assert_int_eq(close(fd), 0);
+
+	pcm_status_free(&writer);
+
+} END_TEST
+
+START_TEST(test_log_async) {
+
+	char buffer[4096] = { 0 };
+	unsigned long dropped, suppressed;
+	int fds[2], fd_stderr;
+	size_t i, lines;
+	char *p;
+
+	ck_assert_int_eq(pipe(fds), 0);
+	ck_assert_int_ne(fd_stderr = dup(STDERR_FILENO), -1);
+	ck_assert_int_ne(dup2(fds[1], STDERR_FILENO), -1);
+
+	ck_assert_int_eq(log_async_start(), 0);
+	/* messages logged by a single call site are rate limited */
+	for (i = 0; i < 100; i++)
+		warn("Rate limited message: %zu", i);
+	error("Other call site");
+	log_async_stop();
+	/* messages logged after the stop are written directly */
+	error("Logged after stop");
+	/* logging can be restarted */
+	ck_assert_int_eq(log_async_start(), 0);
+	log_async_stop();
+
+	ck_assert_int_ne(dup2(fd_stderr, STDERR_FILENO), -1);
+	close(fds[1]);
+	ck_assert_int_gt(read(fds[0], buffer, sizeof(buffer) - 1), 0);
+	close(fds[0]);
+
+	for (lines = 0, p = buffer; (p = strchr(p, '\n')) != NULL; p++)
+		lines++;
+	/* burst might be split across two rate limiting windows */
+	ck_assert_int_ge(lines, LOG_RATE_BURST + 2);
+	ck_assert_int_le(lines, 2 * LOG_RATE_BURST + 3);
+	ck_assert_ptr_ne(strstr(buffer, "Rate limited message: 0\n"), NULL);
+	ck_assert_ptr_ne(strstr(buffer, "Other call site\n"), NULL);
+	ck_assert_ptr_ne(strstr(buffer, "Logged after stop\n"), NULL);
+
+	log_async_stats(&dropped, &suppressed);
+	ck_assert_int_eq(dropped, 0);
+	ck_assert_int_ge(suppressed, 100 - 2 * LOG_RATE_BURST);
 
 } END_TEST
 
@@ -192,10 +1183,32 @@ int main(void) {
 
 	suite_add_tcase(s, tc);
 
+	tcase_add_test(tc, test_abr);
+	tcase_add_test(tc, test_cpu_budget);
+	tcase_add_test(tc, test_jitter_buffer);
+	tcase_add_test(tc, test_resampler);
+	tcase_add_test(tc, test_drift_estimator);
+	tcase_add_test(tc, test_drift_controller);
+	tcase_add_test(tc, test_drift_resampler);
+	tcase_add_test(tc, test_codec_cache);
+	tcase_add_test(tc, test_link_history);
+	tcase_add_test(tc, test_mem_pool);
+	tcase_add_test(tc, test_capture);
 	tcase_add_test(tc, test_dbus_profile_object_path);
+	tcase_add_test(tc, test_dbus_object_path_to_hci_dev_id);
+	tcase_add_test(tc, test_cpulist_to_mask);
 	tcase_add_test(tc, test_pcm_scale_s16le);
+	tcase_add_test(tc, test_pcm_scale_s16le_vector);
+	tcase_add_test(tc, test_pcm_deinterleave_s16le);
+	tcase_add_test(tc, test_pcm_scale_wide);
 	tcase_add_test(tc, test_difftimespec);
+	tcase_add_test(tc, test_asrsync);
 	tcase_add_test(tc, test_fifo_buffer);
+	tcase_add_test(tc, test_fifo_buffer_ring);
+	tcase_add_test(tc, test_fifo_buffer_pool);
+	tcase_add_test(tc, test_pcm_ring);
+	tcase_add_test(tc, test_pcm_status);
+	tcase_add_test(tc, test_log_async);
 
 	srunner_run_all(sr, CK_ENV);
 	int nf = srunner_ntests_failed(sr);
@@ -12,21 +12,32 @@
 # include "config.h"
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
 
 #include <alsa/asoundlib.h>
 #include <gio/gio.h>
 
 #include "shared/ctl-client.h"
 #include "shared/defs.h"
+#include "shared/drift.h"
 #include "shared/ffb.h"
 #include "shared/log.h"
 
@@ -45,6 +56,44 @@ struct pcm_worker {
 	bool active;
 	/* human-readable BT address */
 	char addr[18];
+	/* PCM buffer used in the mixing mode */
+	ffb_int16_t buffer;
+	/* time of the last PCM FIFO read in the mixing mode */
+	struct timespec ts;
+	/* Q15 gain applied in the mixing mode */
+	int32_t gain;
+};
+
+struct mix_gain {
+	bdaddr_t addr;
+	int32_t gain;
+};
+
+/* Q15 unity gain of the mixer */
+#define MIX_GAIN_UNITY (1 << 15)
+
+/* Time (in milliseconds) after the playback start, during which the buffer
+ * occupancy settles, and the interval of the drift compensation update. */
+#define DRIFT_SETTLE_MS 5000
+#define DRIFT_UPDATE_MS 100
+/* Interval (in milliseconds) of the remote drift estimation poll. */
+#define DRIFT_STATS_MS 5000
+
+/**
+ * Clock drift compensation state of the PCM worker. */
+struct pcm_drift {
+	struct drift_resampler resampler;
+	struct drift_controller controller;
+	/* resampled signal - it can hold slightly more frames than the input */
+	int16_t *out;
+	size_t out_frames;
+	/* the buffer occupancy target has been set */
+	bool settled;
+	struct timespec ts_start;
+	struct timespec ts_update;
+	struct timespec ts_stats;
+	/* drift of the remote clock estimated by the server */
+	int remote_ppm;
 };
 
 static unsigned int verbose = 0;
@@ -54,6 +103,22 @@ static unsigned int pcm_buffer_time = 500000;
 static unsigned int pcm_period_time = 100000;
 static enum ba_pcm_type ba_type = BA_PCM_TYPE_A2DP;
 static bool pcm_mixer = true;
+static bool drift_comp = false;
+
+/* In the mixing mode, all PCM FIFOs are handled by the main loop, and the
+ * mixed signal is written to a single playback PCM device. */
+static bool mix_mode = false;
+static unsigned int mix_rate = 0;
+static struct mix_gain *mix_gains = NULL;
+static size_t mix_gains_count = 0;
+static snd_pcm_t *mix_pcm = NULL;
+static struct timespec mix_pcm_retry_ts = { 0 };
+static unsigned int mix_sampling = 0;
+static unsigned int mix_channels = 0;
+static size_t mix_chunk_frames = 0;
+static size_t mix_sources = 0;
+static int32_t *mix_acc = NULL;
+static int16_t *mix_out = NULL;
 
 static GDBusConnection *dbus = NULL;
 
@@ -211,6 +276,113 @@ fail:
 	return err;
 }
 
+/**
+ * Add scaled PCM signal to the mixing accumulator.
+ *
+ * If the number of channels of the source differs from the number of
+ * channels of the mixer, mono signal is copied to all output channels,
+ * otherwise the signal is down-mixed by averaging all input channels.
+ *
+ * @param acc Address to the accumulator with interleaved samples.
+ * @param in Address to the source signal with interleaved samples.
+ * @param frames The number of frames to mix.
+ * @param channels_in The number of channels of the source signal.
+ * @param channels_out The number of channels of the accumulator.
+ * @param gain The Q15 gain in the range [0, MIX_GAIN_UNITY]. */
+static void mix_s16_accumulate(int32_t *acc, const int16_t *in, size_t frames,
+		unsigned int channels_in, unsigned int channels_out, int32_t gain) {
+
+	size_t i = 0;
+	unsigned int c;
+
+	if (channels_in != channels_out) {
+		for (; i < frames; i++, in += channels_in, acc += channels_out) {
+			int32_t v = in[0];
+			if (channels_in > 1) {
+				for (c = 1; c < channels_in; c++)
+					v += in[c];
+				v /= (int32_t)channels_in;
+			}
+			v = (v * gain) >> 15;
+			for (c = 0; c < channels_out; c++)
+				acc[c] += v;
+		}
+		return;
+	}
+
+	const size_t samples = frames * channels_out;
+
+	/* For vectorized code, gain has to fit into signed 16-bit integer, so
+	 * the unity gain is halved and the missing bit is restored by the lower
+	 * arithmetic shift of the product. */
+	const int shift = gain > INT16_MAX ? 1 : 0;
+
+#if defined(__SSE2__)
+
+	const __m128i g = _mm_set1_epi16(gain >> shift);
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i s = _mm_loadu_si128((const __m128i *)&in[i]);
+		__m128i lo = _mm_mullo_epi16(s, g);
+		__m128i hi = _mm_mulhi_epi16(s, g);
+		__m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 15 - shift);
+		__m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 15 - shift);
+		__m128i *a = (__m128i *)&acc[i];
+		_mm_storeu_si128(&a[0], _mm_add_epi32(_mm_loadu_si128(&a[0]), p0));
+		_mm_storeu_si128(&a[1], _mm_add_epi32(_mm_loadu_si128(&a[1]), p1));
+	}
+
+#elif defined(__ARM_NEON)
+
+	const int16x4_t g = vdup_n_s16(gain >> shift);
+	const int32x4_t sh = vdupq_n_s32(shift - 15);
+
+	for (; i + 8 <= samples; i += 8) {
+		int16x8_t s = vld1q_s16(&in[i]);
+		int32x4_t p0 = vshlq_s32(vmull_s16(vget_low_s16(s), g), sh);
+		int32x4_t p1 = vshlq_s32(vmull_s16(vget_high_s16(s), g), sh);
+		vst1q_s32(&acc[i], vaddq_s32(vld1q_s32(&acc[i]), p0));
+		vst1q_s32(&acc[i + 4], vaddq_s32(vld1q_s32(&acc[i + 4]), p1));
+	}
+
+#endif
+
+	for (; i < samples; i++)
+		acc[i] += (in[i] * gain) >> 15;
+
+}
+
+/**
+ * Convert the mixing accumulator into the signed 16-bit signal.
+ *
+ * @param out Address to the output buffer.
+ * @param acc Address to the accumulator.
+ * @param samples The number of samples to convert. */
+static void mix_s16_saturate(int16_t *out, const int32_t *acc, size_t samples) {
+
+	size_t i = 0;
+
+#if defined(__SSE2__)
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)&acc[i]);
+		__m128i a1 = _mm_loadu_si128((const __m128i *)&acc[i + 4]);
+		_mm_storeu_si128((__m128i *)&out[i], _mm_packs_epi32(a0, a1));
+	}
+
+#elif defined(__ARM_NEON)
+
+	for (; i + 8 <= samples; i += 8)
+		vst1q_s16(&out[i], vcombine_s16(vqmovn_s32(vld1q_s32(&acc[i])),
+					vqmovn_s32(vld1q_s32(&acc[i + 4]))));
+
+#endif
+
+	for (; i < samples; i++)
+		out[i] = acc[i] > INT16_MAX ? INT16_MAX : acc[i] < INT16_MIN ? INT16_MIN : acc[i];
+
+}
+
 static struct pcm_worker *get_active_worker(void) {
 
 	struct pcm_worker *w = NULL;
@@ -267,6 +439,105 @@ final:
 	return ret;
 }
 
+static long drift_elapsed_ms(const struct timespec *now, const struct timespec *ts) {
+	return (now->tv_sec - ts->tv_sec) * 1000 + (now->tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+static void pcm_drift_free(struct pcm_drift *d) {
+	free(d->out);
+	d->out = NULL;
+}
+
+/**
+ * Restart drift compensation, e.g. after the PCM (re)open or an underrun. */
+static void pcm_drift_reset(struct pcm_drift *d) {
+	drift_resampler_reset(&d->resampler);
+	drift_resampler_set_ppm(&d->resampler, d->remote_ppm);
+	clock_gettime(CLOCK_MONOTONIC, &d->ts_start);
+	d->ts_update = d->ts_start;
+	d->settled = false;
+}
+
+/**
+ * Get the number of frames buffered between the server and the sound card.
+ *
+ * It is the sum of the data queued in the PCM FIFO, in the worker buffer
+ * and in the playback PCM buffer. */
+static size_t pcm_drift_level(struct pcm_worker *w, size_t buffered) {
+
+	const size_t frame_size = w->transport.channels * sizeof(int16_t);
+	snd_pcm_sframes_t delay = 0;
+	int queued = 0;
+
+	if (ioctl(w->pcm_fd, FIONREAD, &queued) == -1)
+		queued = 0;
+	if (snd_pcm_delay(w->pcm, &delay) < 0 || delay < 0)
+		delay = 0;
+
+	return queued / frame_size + buffered + delay;
+}
+
+/**
+ * Write PCM frames with the clock drift compensation.
+ *
+ * The rate correction is determined by the buffer occupancy controller,
+ * which keeps the overall buffered audio at the level measured after the
+ * playback has settled. The remote clock drift estimated by the server is
+ * used as a feed-forward, so the controller needs to correct the sound card
+ * clock drift only.
+ *
+ * @return On success this function returns the number of consumed frames.
+ *   Otherwise, negative error code is returned, like the snd_pcm_writei(). */
+static snd_pcm_sframes_t pcm_drift_write(struct pcm_worker *w, struct pcm_drift *d,
+		const int16_t *buffer, size_t frames) {
+
+	const unsigned int channels = w->transport.channels;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (drift_elapsed_ms(&now, &d->ts_stats) >= DRIFT_STATS_MS) {
+		struct ba_msg_transport_stats stats = { 0 };
+		if (bluealsa_get_transport_stats(w->ba_fd, &w->transport, &stats) == 0)
+			d->remote_ppm = stats.drift_ppm;
+		d->ts_stats = now;
+	}
+
+	long elapsed;
+	if ((elapsed = drift_elapsed_ms(&now, &d->ts_update)) >= DRIFT_UPDATE_MS) {
+
+		const size_t level = pcm_drift_level(w, frames);
+		int ppm = d->remote_ppm;
+
+		if (d->settled)
+			ppm = drift_controller_update(&d->controller, level, elapsed * 1000, d->remote_ppm);
+		else if (drift_elapsed_ms(&now, &d->ts_start) >= DRIFT_SETTLE_MS) {
+			debug("Drift compensation target for %s: %zu frames", w->addr, level);
+			drift_controller_init(&d->controller, w->transport.sampling, level);
+			d->settled = true;
+		}
+
+		drift_resampler_set_ppm(&d->resampler, ppm);
+		d->ts_update = now;
+	}
+
+	size_t consumed = frames;
+	size_t generated = drift_resampler_process(&d->resampler, buffer, &consumed,
+			d->out, d->out_frames);
+
+	/* Resampled frames are not kept in the worker buffer, so all of them
+	 * have to be written, even if the write is interrupted. */
+	size_t written = 0;
+	while (written < generated) {
+		snd_pcm_sframes_t ret;
+		if ((ret = snd_pcm_writei(w->pcm, d->out + written * channels, generated - written)) < 0)
+			return ret;
+		written += ret;
+	}
+
+	return consumed;
+}
+
 static void pcm_worker_routine_exit(struct pcm_worker *worker) {
 	if (worker->pcm_fd != -1) {
 		bluealsa_close_transport(worker->ba_fd, &worker->transport);
@@ -290,6 +561,7 @@ static void *pcm_worker_routine(void *arg) {
 
 	size_t pcm_1s_samples = w->transport.sampling * w->transport.channels;
 	ffb_int16_t buffer = { 0 };
+	struct pcm_drift drift = { 0 };
 
 	/* Cancellation should be possible only in the carefully selected place
 	 * in order to prevent memory leaks and resources not being released. */
@@ -297,13 +569,26 @@ static void *pcm_worker_routine(void *arg) {
 
 	pthread_cleanup_push(PTHREAD_CLEANUP(pcm_worker_routine_exit), w);
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &buffer);
+	pthread_cleanup_push(PTHREAD_CLEANUP(pcm_drift_free), &drift);
 
 	/* create buffer big enough to hold 100 ms of PCM data */
-	if (ffb_init(&buffer, pcm_1s_samples / 10) == NULL) {
-		error("Couldn't create PCM buffer: %s", strerror(ENOMEM));
+	if (ffb_int16_init(&buffer, pcm_1s_samples / 10) == -1) {
+		error("Couldn't create PCM buffer: %s", strerror(errno));
 		goto fail;
 	}
 
+	if (drift_comp) {
+		/* resampler output might be longer than the input by the maximal
+		 * rate correction, plus one frame due to the interpolation phase */
+		drift.out_frames = buffer.size / w->transport.channels;
+		drift.out_frames += drift.out_frames * DRIFT_PPM_MAX / 1000000 + 2;
+		if (drift_resampler_init(&drift.resampler, w->transport.channels) == -1 ||
+				(drift.out = malloc(drift.out_frames * w->transport.channels * sizeof(int16_t))) == NULL) {
+			error("Couldn't create drift resampler: %s", strerror(errno));
+			goto fail;
+		}
+	}
+
 	if ((w->ba_fd = bluealsa_open(ba_interface)) == -1) {
 		error("Couldn't open BlueALSA: %s", strerror(errno));
 		goto fail;
@@ -419,6 +704,9 @@ static void *pcm_worker_routine(void *arg) {
 			pcm_max_read_len = period_size * w->transport.channels;
 			pcm_open_retries = 0;
 
+			if (drift_comp)
+				pcm_drift_reset(&drift);
+
 			if (verbose >= 2) {
 				printf("Used configuration for %s:\n"
 						"  PCM buffer time: %u us (%zu bytes)\n"
@@ -441,12 +729,20 @@ static void *pcm_worker_routine(void *arg) {
 		ffb_seek(&buffer, ret / sizeof(*buffer.data));
 		snd_pcm_sframes_t frames = ffb_len_out(&buffer) / w->transport.channels;
 
-		if ((frames = snd_pcm_writei(w->pcm, buffer.data, frames)) < 0)
+		if (drift_comp)
+			frames = pcm_drift_write(w, &drift, buffer.head, frames);
+		else
+			frames = snd_pcm_writei(w->pcm, buffer.head, frames);
+
+		if (frames < 0)
 			switch (-frames) {
 			case EPIPE:
 				debug("An underrun has occurred");
 				snd_pcm_prepare(w->pcm);
 				usleep(50000);
+				if (drift_comp)
+					/* buffer occupancy has to settle again */
+					pcm_drift_reset(&drift);
 				frames = 0;
 				break;
 			default:
@@ -454,7 +750,7 @@ static void *pcm_worker_routine(void *arg) {
 				goto fail;
 			}
 
-		/* move leftovers to the beginning and reposition tail */
+		/* release consumed samples, leftovers stay in the ring */
 		ffb_shift(&buffer, frames * w->transport.channels);
 
 	}
@@ -463,9 +759,285 @@ fail:
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_cleanup_pop(1);
 	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
 	return NULL;
 }
 
+static int32_t mix_get_gain(const bdaddr_t *addr) {
+
+	int32_t gain = MIX_GAIN_UNITY;
+	size_t i;
+
+	for (i = 0; i < mix_gains_count; i++) {
+		if (bacmp(&mix_gains[i].addr, addr) == 0)
+			return mix_gains[i].gain;
+		if (bacmp(&mix_gains[i].addr, BDADDR_ANY) == 0)
+			gain = mix_gains[i].gain;
+	}
+
+	return gain;
+}
+
+static void mix_source_close(struct pcm_worker *w) {
+
+	if (w->pcm_fd == -1)
+		return;
+
+	debug("Closing mixer source %s", w->addr);
+
+	bluealsa_close_transport(w->ba_fd, &w->transport);
+	close(w->pcm_fd);
+	w->pcm_fd = -1;
+	close(w->ba_fd);
+	w->ba_fd = -1;
+	ffb_int16_free(&w->buffer);
+	w->active = false;
+
+	/* release the output when the last source is gone, so the next
+	 * source can set up the mixer with its own parameters */
+	if (--mix_sources == 0) {
+		if (mix_pcm != NULL) {
+			snd_pcm_close(mix_pcm);
+			mix_pcm = NULL;
+		}
+		free(mix_acc);
+		mix_acc = NULL;
+		free(mix_out);
+		mix_out = NULL;
+	}
+
+}
+
+/**
+ * Open the PCM FIFO of the worker transport for the mixer.
+ *
+ * The first source determines the sampling rate (unless it was given on
+ * the command line) and the number of channels of the mixer. All other
+ * sources are resampled by the server, if required. */
+static int mix_source_open(struct pcm_worker *w) {
+
+	if (mix_sources == 0) {
+		mix_sampling = mix_rate != 0 ? mix_rate : w->transport.sampling;
+		mix_channels = w->transport.channels;
+		mix_chunk_frames = (uint64_t)mix_sampling * pcm_period_time / 1000000;
+		if (mix_chunk_frames == 0)
+			mix_chunk_frames = 1;
+		free(mix_acc);
+		free(mix_out);
+		if ((mix_acc = malloc(mix_chunk_frames * mix_channels * sizeof(*mix_acc))) == NULL ||
+				(mix_out = malloc(mix_chunk_frames * mix_channels * sizeof(*mix_out))) == NULL) {
+			error("Couldn't create mixer buffer: %s", strerror(errno));
+			goto fail;
+		}
+	}
+
+	debug("Opening mixer source %s", w->addr);
+
+	/* buffer up to four mixing chunks of the source signal */
+	if (ffb_int16_init(&w->buffer, mix_chunk_frames * w->transport.channels * 4) == -1) {
+		error("Couldn't create PCM buffer: %s", strerror(errno));
+		goto fail;
+	}
+
+	if ((w->ba_fd = bluealsa_open(ba_interface)) == -1) {
+		error("Couldn't open BlueALSA: %s", strerror(errno));
+		goto fail;
+	}
+
+	w->transport.stream = BA_PCM_STREAM_CAPTURE;
+	w->transport.sampling = mix_sampling;
+	if ((w->pcm_fd = bluealsa_open_transport(w->ba_fd, &w->transport)) == -1) {
+		error("Couldn't open PCM FIFO: %s", strerror(errno));
+		goto fail;
+	}
+
+	/* the main loop must not block on any of the sources */
+	fcntl(w->pcm_fd, F_SETFL, fcntl(w->pcm_fd, F_GETFL) | O_NONBLOCK);
+
+	w->gain = mix_get_gain(&w->transport.addr);
+	w->active = false;
+	mix_sources++;
+	return 0;
+
+fail:
+	if (w->ba_fd != -1) {
+		close(w->ba_fd);
+		w->ba_fd = -1;
+	}
+	ffb_int16_free(&w->buffer);
+	if (mix_sources == 0) {
+		free(mix_acc);
+		mix_acc = NULL;
+		free(mix_out);
+		mix_out = NULL;
+	}
+	return -1;
+}
+
+static long mix_elapsed_ms(const struct timespec *now, const struct timespec *ts) {
+	return (now->tv_sec - ts->tv_sec) * 1000 + (now->tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+static int mix_pcm_open(void) {
+
+	unsigned int buffer_time = pcm_buffer_time;
+	unsigned int period_time = pcm_period_time;
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+	char *tmp;
+
+	if (pcm_open(&mix_pcm, mix_channels, mix_sampling,
+				&buffer_time, &period_time, &tmp) != 0) {
+		warn("Couldn't open PCM: %s", tmp);
+		free(tmp);
+		return -1;
+	}
+
+	snd_pcm_get_params(mix_pcm, &buffer_size, &period_size);
+
+	if (verbose >= 2) {
+		printf("Used configuration for mixer:\n"
+				"  PCM buffer time: %u us (%zu bytes)\n"
+				"  PCM period time: %u us (%zu bytes)\n"
+				"  Sampling rate: %u Hz\n"
+				"  Channels: %u\n",
+				buffer_time, snd_pcm_frames_to_bytes(mix_pcm, buffer_size),
+				period_time, snd_pcm_frames_to_bytes(mix_pcm, period_size),
+				mix_sampling, mix_channels);
+	}
+
+	return 0;
+}
+
+/**
+ * Read available PCM signal from all sources and write mixed chunks.
+ *
+ * The chunk is mixed when every active source has buffered a full chunk,
+ * or when any source is ahead by two chunks - in such case sources which
+ * lag behind contribute silence for missing frames. If the source buffer
+ * overflows (the source clock runs faster than the output one), the oldest
+ * chunk of its signal is dropped.
+ *
+ * @param pfds Poll descriptors of the opened sources, in the order of the
+ *   workers array.
+ * @return On fatal error, this function returns -1. */
+static int mix_process(const struct pollfd *pfds) {
+
+	struct timespec now;
+	size_t i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i = 0, n = 0; i < workers_count; i++) {
+		struct pcm_worker *w = &workers[i];
+
+		if (w->pcm_fd == -1)
+			continue;
+
+		const short revents = pfds[n++].revents;
+		const size_t chunk = mix_chunk_frames * w->transport.channels;
+		ssize_t ret = -1;
+
+		if (revents & POLLIN) {
+
+			if (ffb_len_in(&w->buffer) == 0)
+				ffb_shift(&w->buffer, chunk);
+
+			if ((ret = read(w->pcm_fd, w->buffer.tail, ffb_blen_in(&w->buffer))) > 0) {
+				ffb_seek(&w->buffer, ret / sizeof(*w->buffer.data));
+				w->active = true;
+				w->ts = now;
+			}
+			else if (ret == -1 && errno != EAGAIN && errno != EINTR) {
+				error("PCM FIFO read error: %s", strerror(errno));
+				mix_source_close(w);
+				continue;
+			}
+
+		}
+
+		/* FIFO has been terminated on the writing side */
+		if (ret == 0 || (!(revents & POLLIN) && revents & (POLLHUP | POLLERR))) {
+			mix_source_close(w);
+			continue;
+		}
+
+		if (w->active && mix_elapsed_ms(&now, &w->ts) > 500) {
+			debug("Device marked as inactive: %s", w->addr);
+			ffb_rewind(&w->buffer);
+			w->active = false;
+		}
+
+	}
+
+	for (;;) {
+
+		size_t min_frames = SIZE_MAX;
+		size_t max_frames = 0;
+
+		for (i = 0; i < workers_count; i++) {
+			const struct pcm_worker *w = &workers[i];
+			if (w->pcm_fd == -1 || !w->active)
+				continue;
+			const size_t frames = ffb_len_out(&w->buffer) / w->transport.channels;
+			min_frames = MIN(min_frames, frames);
+			max_frames = MAX(max_frames, frames);
+		}
+
+		if (max_frames == 0) {
+			/* close the output device when all sources are inactive */
+			if (min_frames == SIZE_MAX && mix_pcm != NULL) {
+				snd_pcm_close(mix_pcm);
+				mix_pcm = NULL;
+			}
+			return 0;
+		}
+
+		if (min_frames < mix_chunk_frames && max_frames < 2 * mix_chunk_frames)
+			return 0;
+
+		const size_t samples = mix_chunk_frames * mix_channels;
+		memset(mix_acc, 0, samples * sizeof(*mix_acc));
+
+		for (i = 0; i < workers_count; i++) {
+			struct pcm_worker *w = &workers[i];
+			if (w->pcm_fd == -1 || !w->active)
+				continue;
+			const size_t frames = MIN(ffb_len_out(&w->buffer) / w->transport.channels, mix_chunk_frames);
+			mix_s16_accumulate(mix_acc, w->buffer.head, frames,
+					w->transport.channels, mix_channels, w->gain);
+			ffb_shift(&w->buffer, frames * w->transport.channels);
+		}
+
+		/* After PCM open failure wait one second before retry. In the meantime
+		 * the mixed signal is discarded, so the sources are drained. */
+		if (mix_pcm == NULL) {
+			if (mix_elapsed_ms(&now, &mix_pcm_retry_ts) < 1000)
+				continue;
+			if (mix_pcm_open() == -1) {
+				mix_pcm_retry_ts = now;
+				continue;
+			}
+		}
+
+		mix_s16_saturate(mix_out, mix_acc, samples);
+
+		snd_pcm_sframes_t frames;
+		if ((frames = snd_pcm_writei(mix_pcm, mix_out, mix_chunk_frames)) < 0)
+			switch (-frames) {
+			case EPIPE:
+				debug("An underrun has occurred");
+				snd_pcm_prepare(mix_pcm);
+				break;
+			default:
+				error("Couldn't write to PCM: %s", snd_strerror(frames));
+				return -1;
+			}
+
+	}
+
+}
+
 int main(int argc, char *argv[]) {
 
 	int opt;
@@ -481,6 +1053,10 @@ int main(int argc, char *argv[]) {
 		{ "profile-a2dp", no_argument, NULL, 1 },
 		{ "profile-sco", no_argument, NULL, 2 },
 		{ "single-audio", no_argument, NULL, 5 },
+		{ "mix", no_argument, NULL, 6 },
+		{ "mix-rate", required_argument, NULL, 7 },
+		{ "mix-gain", required_argument, NULL, 8 },
+		{ "drift-comp", no_argument, NULL, 9 },
 		{ 0, 0, 0, 0 },
 	};
 
@@ -501,11 +1077,21 @@ usage:
 					"  --profile-a2dp\tuse A2DP profile\n"
 					"  --profile-sco\t\tuse SCO profile\n"
 					"  --single-audio\tsingle audio mode\n"
+					"  --mix\t\t\tmix all devices into a single PCM\n"
+					"  --mix-rate=INT\tsampling rate of the mixer\n"
+					"  --mix-gain=ADDR,INT\tgain of the mixer source in percent\n"
+					"  --drift-comp\t\tcompensate clock drift of the A2DP source\n"
 					"\nNote:\n"
 					"If one wants to receive audio from more than one Bluetooth device, it is\n"
 					"possible to specify more than one MAC address. By specifying any/empty MAC\n"
 					"address (00:00:00:00:00:00), one will allow connections from any Bluetooth\n"
-					"device.\n",
+					"device.\n"
+					"\nIn the mixing mode, audio from all devices is mixed in-process and played\n"
+					"through a single PCM device. The gain can be set for every device separately\n"
+					"(use the any address to change the default gain).\n"
+					"\nWith the drift compensation, the playback is resampled by a tiny fraction,\n"
+					"so the audio buffered between the Bluetooth device and the sound card stays\n"
+					"at the level measured after the playback start.\n",
 					argv[0]);
 			return EXIT_SUCCESS;
 
@@ -542,6 +1128,42 @@ usage:
 			pcm_mixer = false;
 			break;
 
+		case 6 /* --mix */ :
+			mix_mode = true;
+			break;
+		case 7 /* --mix-rate=INT */ :
+			mix_rate = atoi(optarg);
+			break;
+		case 8 /* --mix-gain=ADDR,INT */ : {
+
+			char *tmp;
+			struct mix_gain gain;
+			if ((tmp = strchr(optarg, ',')) == NULL) {
+				error("Invalid mixer gain: %s", optarg);
+				return EXIT_FAILURE;
+			}
+
+			*tmp++ = '\0';
+			int percent = atoi(tmp);
+			if (str2ba(optarg, &gain.addr) != 0 || percent < 0 || percent > 100) {
+				error("Invalid mixer gain: %s,%s", optarg, tmp);
+				return EXIT_FAILURE;
+			}
+
+			gain.gain = percent * MIX_GAIN_UNITY / 100;
+			if ((mix_gains = realloc(mix_gains, sizeof(*mix_gains) * (mix_gains_count + 1))) == NULL) {
+				error("Couldn't allocate memory for mixer gains");
+				return EXIT_FAILURE;
+			}
+			mix_gains[mix_gains_count++] = gain;
+
+			break;
+		}
+
+		case 9 /* --drift-comp */ :
+			drift_comp = true;
+			break;
+
 		default:
 			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
 			return EXIT_FAILURE;
@@ -575,6 +1197,11 @@ usage:
 			ba_addr_any = true;
 	}
 
+	if (drift_comp && mix_mode) {
+		warn("Drift compensation is not supported in the mixing mode");
+		drift_comp = false;
+	}
+
 	if (verbose >= 1) {
 
 		char *ba_str = malloc(19 * ba_addrs_count + 1);
@@ -590,10 +1217,14 @@ usage:
 				"  PCM buffer time: %u us\n"
 				"  PCM period time: %u us\n"
 				"  Bluetooth device(s): %s\n"
-				"  Profile: %s\n",
+				"  Profile: %s\n"
+				"  Mixing mode: %s\n"
+				"  Drift compensation: %s\n",
 				ba_interface, device, pcm_buffer_time, pcm_period_time,
 				ba_addr_any ? "ANY" : &ba_str[2],
-				ba_type == BA_PCM_TYPE_A2DP ? "A2DP" : "SCO");
+				ba_type == BA_PCM_TYPE_A2DP ? "A2DP" : "SCO",
+				mix_mode ? "yes" : "no",
+				drift_comp ? "yes" : "no");
 
 		free(ba_str);
 	}
@@ -623,6 +1254,9 @@ usage:
 	sigaction(SIGTERM, &sigact, NULL);
 	sigaction(SIGINT, &sigact, NULL);
 
+	struct pollfd *pfds = NULL;
+	size_t pfds_size = 0;
+
 	debug("Starting main loop");
 	goto init;
 
@@ -633,8 +1267,36 @@ usage:
 		ssize_t ret;
 		size_t i;
 
-		struct pollfd pfds[] = {{ ba_event_fd, POLLIN, 0 }};
-		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1 && errno == EINTR)
+		/* in the mixing mode PCM FIFOs are polled by the main loop */
+		if (pfds_size < 1 + workers_count) {
+			pfds_size = 1 + workers_size;
+			if ((pfds = realloc(pfds, sizeof(*pfds) * pfds_size)) == NULL) {
+				error("Couldn't (re)allocate memory for poll descriptors");
+				goto fail;
+			}
+		}
+
+		nfds_t nfds = 0;
+		int timeout = -1;
+
+		pfds[nfds++] = (struct pollfd){ ba_event_fd, POLLIN, 0 };
+		if (mix_mode)
+			for (i = 0; i < workers_count; i++) {
+				if (workers[i].pcm_fd == -1)
+					continue;
+				pfds[nfds++] = (struct pollfd){ workers[i].pcm_fd, POLLIN, 0 };
+				/* sources have to be checked for inactivity */
+				if (workers[i].active)
+					timeout = 100;
+			}
+
+		if (poll(pfds, nfds, timeout) == -1 && errno == EINTR)
+			continue;
+
+		if (mix_mode && mix_process(&pfds[1]) == -1)
+			goto fail;
+
+		if (pfds[0].revents == 0)
 			continue;
 
 		while ((ret = recv(ba_event_fd, &event, sizeof(event), MSG_DONTWAIT)) == -1 && errno == EINTR)
@@ -709,6 +1371,13 @@ init:
 				worker->pcm_fd = -1;
 				worker->ba_fd = -1;
 				worker->pcm = NULL;
+				memset(&worker->buffer, 0, sizeof(worker->buffer));
+
+				if (mix_mode) {
+					if (mix_source_open(worker) == -1)
+						workers_count--;
+					continue;
+				}
 
 				debug("Creating PCM worker %s", worker->addr);
 
@@ -726,8 +1395,12 @@ init:
 		for (i = workers_count; i > 0; i--) {
 			struct pcm_worker *worker = &workers[i - 1];
 			if (worker->eviction) {
-				pthread_cancel(worker->thread);
-				pthread_join(worker->thread, NULL);
+				if (mix_mode)
+					mix_source_close(worker);
+				else {
+					pthread_cancel(worker->thread);
+					pthread_join(worker->thread, NULL);
+				}
 				memcpy(worker, &workers[workers_count - 1], sizeof(*worker));
 				workers_count--;
 			}
@@ -741,6 +1414,9 @@ fail:
 	status = EXIT_FAILURE;
 
 success:
+	if (mix_mode)
+		for (i = 0; i < workers_count; i++)
+			mix_source_close(&workers[i]);
 	if (ba_fd != -1)
 		close(ba_fd);
 	if (ba_event_fd != -1)
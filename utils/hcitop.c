@@ -12,10 +12,17 @@
 # include "config.h"
 #endif
 
+#include <errno.h>
 #include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 #include <ncurses.h>
 #include <bsd/stdlib.h>
@@ -24,6 +31,11 @@
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 
+#include "a2dp-codecs.h"
+#include "hfp.h"
+#include "shared/ctl-client.h"
+#include "shared/defs.h"
+
 static const struct {
 	unsigned int bit;
 	char flag;
@@ -39,6 +51,29 @@ static const struct {
 	{ HCI_RAW, 'X' },
 };
 
+struct ba_transport_view {
+	struct ba_msg_transport transport;
+	struct ba_msg_transport_stats stats;
+	/* counters of the previous snapshot used for rate calculation */
+	struct timespec ts;
+	uint64_t bt_bytes;
+	uint64_t codec_time_total;
+	bool valid;
+	/* calculated rates */
+	unsigned int bitrate;
+	unsigned int cpu;
+};
+
+struct ba_controller {
+	/* control and event subscription sockets */
+	int fd;
+	int event_fd;
+	struct ba_transport_view *transports;
+	size_t count;
+};
+
+static struct ba_controller controllers[HCI_MAX_DEV];
+
 static int get_devinfo(struct hci_dev_info di[HCI_MAX_DEV]) {
 
 	int i, num;
@@ -78,6 +113,222 @@ static unsigned int get_average_rate(unsigned int *array, size_t size) {
 	return x + y / size;
 }
 
+static const char *get_codec_name(enum ba_pcm_type type, uint16_t codec) {
+	if (type == BA_PCM_TYPE_SCO)
+		switch (codec) {
+		case HFP_CODEC_CVSD:
+			return "CVSD";
+		case HFP_CODEC_MSBC:
+			return "mSBC";
+		}
+	else
+		switch (codec) {
+		case A2DP_CODEC_SBC:
+			return "SBC";
+		case A2DP_CODEC_MPEG12:
+			return "MPEG";
+		case A2DP_CODEC_MPEG24:
+			return "AAC";
+		case A2DP_CODEC_ATRAC:
+			return "ATRAC";
+		case A2DP_CODEC_VENDOR_APTX:
+			return "aptX";
+		case A2DP_CODEC_VENDOR_APTX_HD:
+			return "aptX HD";
+		case A2DP_CODEC_VENDOR_LDAC:
+			return "LDAC";
+		}
+	return "N/A";
+}
+
+static const char *get_profile_name(const struct ba_msg_transport *transport) {
+	if (transport->type == BA_PCM_TYPE_SCO)
+		return "SCO";
+	return transport->stream == BA_PCM_STREAM_PLAYBACK ? "A2DP-SRC" : "A2DP-SNK";
+}
+
+static void controller_close(struct ba_controller *c) {
+	if (c->fd != -1)
+		close(c->fd);
+	if (c->event_fd != -1)
+		close(c->event_fd);
+	c->fd = c->event_fd = -1;
+	free(c->transports);
+	c->transports = NULL;
+	c->count = 0;
+}
+
+/**
+ * Connect to the BlueALSA server which uses the given HCI device.
+ *
+ * The event subscription is used solely for detecting changes in the set
+ * of transports, so the view can be refreshed without waiting for the next
+ * sampling period. */
+static int controller_open(struct ba_controller *c, const char *hci) {
+
+	if (c->fd != -1)
+		return 0;
+
+	if ((c->fd = bluealsa_open(hci)) == -1 ||
+			(c->event_fd = bluealsa_open(hci)) == -1 ||
+			bluealsa_subscribe(c->event_fd, BA_EVENT_TRANSPORT_ADDED |
+				BA_EVENT_TRANSPORT_CHANGED | BA_EVENT_TRANSPORT_REMOVED) == -1) {
+		controller_close(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Consume pending events from the server.
+ *
+ * @return This function returns true if there was any event. If the server
+ *   has been terminated, the connection is closed. */
+static bool controller_dispatch(struct ba_controller *c) {
+
+	struct ba_msg_event event;
+	bool changed = false;
+	ssize_t ret;
+
+	while ((ret = recv(c->event_fd, &event, sizeof(event), MSG_DONTWAIT)) > 0)
+		changed = true;
+	if (ret == 0 || (errno != EAGAIN && errno != EINTR)) {
+		controller_close(c);
+		changed = true;
+	}
+
+	return changed;
+}
+
+/**
+ * Take the snapshot of transports and their counters.
+ *
+ * Counters of transports which were present in the previous snapshot are
+ * used for calculating the bit rate and the codec CPU share. The overhead
+ * of the sampling on the server side is a single request per transport. */
+static void controller_update(struct ba_controller *c) {
+
+	struct ba_msg_transport *transports;
+	struct ba_transport_view *views;
+	struct timespec ts;
+	ssize_t count;
+	size_t i, ii;
+
+	if ((count = bluealsa_get_transports(c->fd, &transports)) == -1) {
+		controller_close(c);
+		return;
+	}
+
+	if ((views = calloc(count > 0 ? count : 1, sizeof(*views))) == NULL) {
+		free(transports);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	for (i = 0; i < (size_t)count; i++) {
+
+		struct ba_transport_view *v = &views[i];
+		v->transport = transports[i];
+		v->ts = ts;
+
+		if (bluealsa_get_transport_stats(c->fd, &v->transport, &v->stats) == -1)
+			continue;
+
+		v->bt_bytes = v->stats.bt_bytes;
+		v->codec_time_total = v->stats.codec_time_total;
+		v->valid = true;
+
+		for (ii = 0; ii < c->count; ii++) {
+			const struct ba_transport_view *prev = &c->transports[ii];
+			if (!prev->valid ||
+					bacmp(&prev->transport.addr, &v->transport.addr) != 0 ||
+					prev->transport.type != v->transport.type ||
+					prev->transport.stream != v->transport.stream)
+				continue;
+			const uint64_t usec = (ts.tv_sec - prev->ts.tv_sec) * 1000000 +
+				(ts.tv_nsec - prev->ts.tv_nsec) / 1000;
+			/* keep the previous rates if there was no time to measure them */
+			v->bitrate = prev->bitrate;
+			v->cpu = prev->cpu;
+			if (usec >= 100000 && v->bt_bytes >= prev->bt_bytes &&
+					v->codec_time_total >= prev->codec_time_total) {
+				v->bitrate = (v->bt_bytes - prev->bt_bytes) * 8 * 1000000 / usec;
+				/* codec CPU share in 1/10 of percent */
+				v->cpu = (v->codec_time_total - prev->codec_time_total) * 1000 / usec;
+			}
+			else {
+				v->ts = prev->ts;
+				v->bt_bytes = prev->bt_bytes;
+				v->codec_time_total = prev->codec_time_total;
+			}
+			break;
+		}
+
+	}
+
+	free(transports);
+	free(c->transports);
+	c->transports = views;
+	c->count = count;
+}
+
+static void print_transports(int row, const struct hci_dev_info *devices, int count) {
+
+	const char *template_top = "%5s %17s %8s %7s %8s %6s %5s %6s %6s %7s %8s %8s";
+	const char *template_row = "%5s %17s %8s %7s %8s %6s %5s %6s %6s %7s %8u %8u";
+	int i;
+
+	move(row, 0);
+	clrtobot();
+
+	attron(A_REVERSE);
+	mvprintw(row++, 0, template_top, "HCI", "DEVICE", "PROFILE", "CODEC",
+			"BITRATE", "PARAM", "CPU%", "COUTQ", "BUFFER", "DELAY", "UNDERRUN", "DROPPED");
+	attroff(A_REVERSE);
+
+	for (i = 0; i < count; i++) {
+
+		const struct ba_controller *c = &controllers[devices[i].dev_id];
+		size_t ii;
+
+		for (ii = 0; ii < c->count; ii++) {
+
+			const struct ba_transport_view *v = &c->transports[ii];
+			const struct ba_msg_transport_stats *stats = &v->stats;
+			char addr[18], bitrate[9], param[7], cpu[6], coutq[7], buffer[7], delay[8];
+
+			ba2str(&v->transport.addr, addr);
+			humanize_number(bitrate, sizeof(bitrate), v->bitrate, "b", HN_AUTOSCALE, HN_DECIMAL | HN_DIVISOR_1000);
+			humanize_number(coutq, sizeof(coutq), stats->bt_coutq, "B", HN_AUTOSCALE, 0);
+			humanize_number(buffer, sizeof(buffer), stats->buffer_bytes, "B", HN_AUTOSCALE, 0);
+			snprintf(cpu, sizeof(cpu), "%u.%u", v->cpu / 10, v->cpu % 10);
+			snprintf(delay, sizeof(delay), "%u.%u", v->transport.delay / 10, v->transport.delay % 10);
+
+			/* AAC bit rate does not fit into the column */
+			if (v->transport.type == BA_PCM_TYPE_A2DP && stats->codec == A2DP_CODEC_MPEG24)
+				humanize_number(param, sizeof(param), stats->codec_param, "", HN_AUTOSCALE, HN_DIVISOR_1000);
+			else if (stats->codec_param != 0)
+				snprintf(param, sizeof(param), "%u", stats->codec_param);
+			else
+				strcpy(param, "-");
+
+			/* codec reported by the stats command is not truncated */
+			const uint16_t codec = v->valid && stats->codec != 0 ? stats->codec : v->transport.codec;
+
+			mvprintw(row++, 0, template_row, devices[i].name, addr,
+					get_profile_name(&v->transport), get_codec_name(v->transport.type, codec),
+					v->valid ? bitrate : "-", v->valid ? param : "-", v->valid ? cpu : "-",
+					v->valid ? coutq : "-", v->valid ? buffer : "-", delay, stats->pcm_underruns, stats->bt_dropped);
+
+		}
+
+	}
+
+	refresh();
+}
+
 static void sprint_hci_flags(char *str, unsigned int flags) {
 
 	size_t i;
@@ -91,24 +342,28 @@ static void sprint_hci_flags(char *str, unsigned int flags) {
 int main(int argc, char *argv[]) {
 
 	int opt;
-	const char *opts = "hVd:";
+	const char *opts = "hVd:B";
 	const struct option longopts[] = {
 		{ "help", no_argument, NULL, 'h' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "delay", required_argument, NULL, 'd' },
+		{ "no-bluealsa", no_argument, NULL, 'B' },
 		{ 0, 0, 0, 0 },
 	};
 
+	bool bluealsa = true;
+
 	int delay_sec = 1;
 	int delay_msec = 0;
 
 	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
 		switch (opt) {
 		case 'h' /* --help */ :
-			printf("usage: %s [ -d sec ]\n"
+			printf("usage: %s [ -d sec ] [ -B ]\n"
 					"  -h, --help\t\tprint this help and exit\n"
 					"  -V, --version\t\tprint version and exit\n"
-					"  -d, --delay=SEC\tdelay time interval\n",
+					"  -d, --delay=SEC\tdelay time interval\n"
+					"  -B, --no-bluealsa\tdo not show BlueALSA transports\n",
 					argv[0]);
 			return EXIT_SUCCESS;
 
@@ -125,6 +380,10 @@ int main(int argc, char *argv[]) {
 			}
 			break;
 
+		case 'B' /* --no-bluealsa */ :
+			bluealsa = false;
+			break;
+
 		default:
 			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
 			return EXIT_FAILURE;
@@ -138,6 +397,11 @@ int main(int argc, char *argv[]) {
 	memset(byte_rx, 0, sizeof(byte_rx));
 	memset(byte_tx, 0, sizeof(byte_tx));
 
+	for (ii = 0; ii < ARRAYSIZE(controllers); ii++) {
+		controllers[ii].fd = -1;
+		controllers[ii].event_fd = -1;
+	}
+
 	initscr();
 	cbreak();
 	noecho();
@@ -189,12 +453,67 @@ int main(int argc, char *argv[]) {
 			mvprintw(i + 1, 0, template_row, devices[i].name, flags, rx, tx, rx_rate, tx_rate);
 		}
 
-		timeout(delay_sec * 1000 + delay_msec);
-		if (getch() == 'q')
+		if (bluealsa) {
+			for (i = 0; i < count; i++) {
+				struct ba_controller *c = &controllers[devices[i].dev_id];
+				if (controller_open(c, devices[i].name) == 0)
+					controller_update(c);
+			}
+			print_transports(count + 2, devices, count);
+		}
+
+		/* Wait for the key press or the end of the sampling period. Changes
+		 * in the set of BlueALSA transports are shown right away. */
+		struct timespec ts_end;
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		ts_end.tv_sec += delay_sec + (ts_end.tv_nsec / 1000000 + delay_msec) / 1000;
+		ts_end.tv_nsec = (ts_end.tv_nsec / 1000000 + delay_msec) % 1000 * 1000000;
+
+		int key = ERR;
+		for (;;) {
+
+			struct pollfd pfds[1 + HCI_MAX_DEV] = {{ STDIN_FILENO, POLLIN, 0 }};
+			struct timespec ts;
+			nfds_t nfds = 1;
+
+			for (i = 0; bluealsa && i < count; i++)
+				if (controllers[devices[i].dev_id].event_fd != -1)
+					pfds[nfds++] = (struct pollfd){
+						controllers[devices[i].dev_id].event_fd, POLLIN, 0 };
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			long wait_ms = (ts_end.tv_sec - ts.tv_sec) * 1000 +
+				(ts_end.tv_nsec - ts.tv_nsec) / 1000000;
+			if (wait_ms <= 0 || poll(pfds, nfds, wait_ms) <= 0)
+				break;
+
+			if (pfds[0].revents & POLLIN) {
+				timeout(0);
+				if ((key = getch()) == 'q')
+					break;
+			}
+
+			bool changed = false;
+			for (i = 0; bluealsa && i < count; i++) {
+				struct ba_controller *c = &controllers[devices[i].dev_id];
+				if (c->event_fd != -1 && controller_dispatch(c) && c->fd != -1) {
+					controller_update(c);
+					changed = true;
+				}
+			}
+			if (changed)
+				print_transports(count + 2, devices, count);
+
+		}
+
+		if (key == 'q')
 			break;
 
 	}
 
+	for (ii = 0; ii < ARRAYSIZE(controllers); ii++)
+		controller_close(&controllers[ii]);
+
 	endwin();
 	return EXIT_SUCCESS;
 }